@@ -60,6 +60,9 @@
 /* Define to 1 if you have the `z' library (-lz). */
 #undef HAVE_LIBZ
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#undef HAVE_LINUX_IO_URING_H
+
 /* Define to 1 if you have the <machine/types.h> header file. */
 #undef HAVE_MACHINE_TYPES_H
 
@@ -75,6 +78,15 @@
 /* Define to 1 if you have the `winpcap' library (-lwpcap) */
 #undef HAVE_PCAP
 
+/* Define to 1 if you have the <pthread.h> header file. */
+#undef HAVE_PTHREAD_H
+
+/* Define to 1 if you have the `recvmmsg' function. */
+#undef HAVE_RECVMMSG
+
+/* Define to 1 if you have the `sendmmsg' function. */
+#undef HAVE_SENDMMSG
+
 /* Define to 1 if you have the `sigaction' function. */
 #undef HAVE_SIGACTION
 
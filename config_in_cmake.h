@@ -55,12 +55,18 @@
 /* Define to 1 if you have the <inttypes.h> header file. */
 #cmakedefine HAVE_INTTYPES_H 1
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#cmakedefine HAVE_LINUX_IO_URING_H 1
+
 /* Define to 1 if you have the <machine/types.h> header file. */
 #cmakedefine HAVE_MACHINE_TYPES_H 1
 
 /* Define to 1 if you have the <netinet/in.h> header file. */
 #cmakedefine HAVE_NETINET_IN_H 1
 
+/* Define to 1 if you have the <pthread.h> header file. */
+#cmakedefine HAVE_PTHREAD_H 1
+
 /* Define to 1 if you have the <stdint.h> header file. */
 #cmakedefine HAVE_STDINT_H 1
 
@@ -97,6 +103,12 @@
 /* Define to 1 if you have the `usleep' function. */
 #cmakedefine HAVE_USLEEP 1
 
+/* Define to 1 if you have the `sendmmsg' function. */
+#cmakedefine HAVE_SENDMMSG 1
+
+/* Define to 1 if you have the `recvmmsg' function. */
+#cmakedefine HAVE_RECVMMSG 1
+
 /* Define to 1 if the system has the type `uint8_t'. */
 #cmakedefine HAVE_UINT8_T 1
 
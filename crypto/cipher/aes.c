@@ -50,6 +50,12 @@
 #include "aes.h"
 #include "err.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) &&                              \
+    (defined(__x86_64__) || defined(__i386__))
+#define SRTP_AES_VPERM
+#include <tmmintrin.h>
+#endif
+
 /*
  * we use the tables T0, T1, T2, T3, and T4 to compute AES, and
  * the tables U0, U1, U2, and U4 to compute its inverse
@@ -1495,11 +1501,13 @@ static void aes_256_expand_encryption_key(const uint8_t *key,
     }
 }
 
-srtp_err_status_t srtp_aes_expand_encryption_key(
+static srtp_err_status_t aes_expand_encryption_key(
     const uint8_t *key,
     size_t key_len,
     srtp_aes_expanded_key_t *expanded_key)
 {
+    expanded_key->vperm = false;
+
     if (key_len == 16) {
         aes_128_expand_encryption_key(key, expanded_key);
         return srtp_err_status_ok;
@@ -1514,18 +1522,336 @@ srtp_err_status_t srtp_aes_expand_encryption_key(
     }
 }
 
+#ifdef SRTP_AES_VPERM
+
+/*
+ * vector-permute AES
+ *
+ * On x86 processors with SSSE3 the S-box is not looked up in a table
+ * but computed with pshufb, following the vpaes construction of Mike
+ * Hamburg ("Accelerating AES with Vector Permute Instructions", CHES
+ * 2009).  The state is kept in a basis where GF(2^8) inversion splits
+ * into GF(2^4) operations, each of which is a 16-entry lookup done by
+ * a single pshufb; MixColumns and ShiftRows are byte permutations.
+ * There are no secret-dependent memory accesses, and the sixteen
+ * constants below fit in a few cache lines instead of the 4 KiB of
+ * T-tables, so the cipher neither leaks through nor slows down under
+ * cache contention.
+ *
+ * The round keys produced by aes_vperm_expand_encryption_key() are in
+ * the transformed basis and can only be used by aes_vperm_encrypt();
+ * decryption keeps using the tables.
+ */
+
+/* clang-format off */
+__attribute__((aligned(16)))
+static const uint64_t aes_vperm_consts[][2] = {
+#define VPERM_INV       0  /* inv, inva */
+    { 0x0E05060F0D080180, 0x040703090A0B0C02 },
+    { 0x01040A060F0B0780, 0x030D0E0C02050809 },
+#define VPERM_S0F       2
+    { 0x0F0F0F0F0F0F0F0F, 0x0F0F0F0F0F0F0F0F },
+#define VPERM_IPT       3  /* input transform (lo, hi) */
+    { 0xC2B2E8985A2A7000, 0xCABAE09052227808 },
+    { 0x4C01307D317C4D00, 0xCD80B1FCB0FDCC81 },
+#define VPERM_SB1       5  /* sb1u, sb1t */
+    { 0xB19BE18FCB503E00, 0xA5DF7A6E142AF544 },
+    { 0x3618D415FAE22300, 0x3BF7CCC10D2ED9EF },
+#define VPERM_SB2       7  /* sb2u, sb2t */
+    { 0xE27A93C60B712400, 0x5EB7E955BC982FCD },
+    { 0x69EB88400AE12900, 0xC2A163C8AB82234A },
+#define VPERM_SBO       9  /* sbou, sbot */
+    { 0xD0D26D176FBDC700, 0x15AABF7AC502A878 },
+    { 0xCFE474A55FBB6A00, 0x8E1E90D1412B35FA },
+#define VPERM_MC_FWD   11
+    { 0x0407060500030201, 0x0C0F0E0D080B0A09 },
+    { 0x080B0A0904070605, 0x000302010C0F0E0D },
+    { 0x0C0F0E0D080B0A09, 0x0407060500030201 },
+    { 0x000302010C0F0E0D, 0x080B0A0904070605 },
+#define VPERM_MC_BWD   15
+    { 0x0605040702010003, 0x0E0D0C0F0A09080B },
+    { 0x020100030E0D0C0F, 0x0A09080B06050407 },
+    { 0x0E0D0C0F0A09080B, 0x0605040702010003 },
+    { 0x0A09080B06050407, 0x020100030E0D0C0F },
+#define VPERM_SR       19  /* ShiftRows, by round mod 4 */
+    { 0x0706050403020100, 0x0F0E0D0C0B0A0908 },
+    { 0x030E09040F0A0500, 0x0B06010C07020D08 },
+    { 0x0F060D040B020900, 0x070E050C030A0108 },
+    { 0x0B0E0104070A0D00, 0x0306090C0F020508 },
+#define VPERM_RCON     23
+    { 0x1F8391B9AF9DEEB6, 0x702A98084D7C7D81 },
+#define VPERM_S63      24  /* 0x63 in the transformed basis */
+    { 0x5B5B5B5B5B5B5B5B, 0x5B5B5B5B5B5B5B5B },
+#define VPERM_OPT      25  /* output transform (lo, hi) */
+    { 0xFF9F4929D6B66000, 0xF7974121DEBE6808 },
+    { 0x01EDBD5150BCEC00, 0xE10D5DB1B05C0CE0 },
+};
+/* clang-format on */
+
+#define VPERM(i) _mm_load_si128((const __m128i *)aes_vperm_consts[i])
+
+#define AES_VPERM_TARGET __attribute__((target("ssse3")))
+
+/*
+ * aes_vperm_transform(x, table) applies the linear map given by the
+ * lo/hi nibble tables starting at table
+ */
+AES_VPERM_TARGET
+static inline __m128i aes_vperm_transform(__m128i x, size_t table)
+{
+    __m128i mask = VPERM(VPERM_S0F);
+    __m128i hi = _mm_srli_epi32(_mm_andnot_si128(mask, x), 4);
+    __m128i lo = _mm_and_si128(x, mask);
+
+    return _mm_xor_si128(_mm_shuffle_epi8(VPERM(table), lo),
+                         _mm_shuffle_epi8(VPERM(table + 1), hi));
+}
+
+/*
+ * aes_vperm_invert(x, &io, &jo) performs the GF(2^8) inversion at the
+ * top of every round, leaving two nibble indices for the output tables
+ */
+AES_VPERM_TARGET
+static inline void aes_vperm_invert(__m128i x, __m128i *io, __m128i *jo)
+{
+    __m128i mask = VPERM(VPERM_S0F);
+    __m128i inv = VPERM(VPERM_INV);
+    __m128i i = _mm_srli_epi32(_mm_andnot_si128(mask, x), 4);
+    __m128i k = _mm_and_si128(x, mask);
+    __m128i ak = _mm_shuffle_epi8(VPERM(VPERM_INV + 1), k);
+    __m128i j = _mm_xor_si128(k, i);
+    __m128i iak = _mm_xor_si128(_mm_shuffle_epi8(inv, i), ak);
+    __m128i jak = _mm_xor_si128(_mm_shuffle_epi8(inv, j), ak);
+
+    *io = _mm_xor_si128(_mm_shuffle_epi8(inv, iak), j);
+    *jo = _mm_xor_si128(_mm_shuffle_epi8(inv, jak), i);
+}
+
+AES_VPERM_TARGET
+static void aes_vperm_encrypt(v128_t *plaintext,
+                              const srtp_aes_expanded_key_t *exp_key)
+{
+    const __m128i *round = (const __m128i *)exp_key->round;
+    __m128i x = _mm_loadu_si128((const __m128i *)plaintext);
+    __m128i io, jo;
+    size_t m = 1;
+
+    x = _mm_xor_si128(aes_vperm_transform(x, VPERM_IPT),
+                      _mm_loadu_si128(&round[0]));
+
+    for (size_t r = 1; r < exp_key->num_rounds; r++) {
+        __m128i a, b, d;
+
+        aes_vperm_invert(x, &io, &jo);
+
+        /* SubBytes, AddRoundKey, then MixColumns as 2A + 3B + C + D */
+        a = _mm_xor_si128(_mm_shuffle_epi8(VPERM(VPERM_SB1), io),
+                          _mm_loadu_si128(&round[r]));
+        a = _mm_xor_si128(a, _mm_shuffle_epi8(VPERM(VPERM_SB1 + 1), jo));
+        x = _mm_xor_si128(_mm_shuffle_epi8(VPERM(VPERM_SB2), io),
+                          _mm_shuffle_epi8(VPERM(VPERM_SB2 + 1), jo));
+        b = _mm_shuffle_epi8(a, VPERM(VPERM_MC_FWD + m));
+        d = _mm_shuffle_epi8(a, VPERM(VPERM_MC_BWD + m));
+        x = _mm_xor_si128(x, b);
+        d = _mm_xor_si128(d, x);
+        x = _mm_shuffle_epi8(x, VPERM(VPERM_MC_FWD + m));
+        x = _mm_xor_si128(x, d);
+
+        m = (m + 1) & 3;
+    }
+
+    /* last round: SubBytes, AddRoundKey and the deferred ShiftRows */
+    aes_vperm_invert(x, &io, &jo);
+    x = _mm_xor_si128(_mm_shuffle_epi8(VPERM(VPERM_SBO), io),
+                      _mm_loadu_si128(&round[exp_key->num_rounds]));
+    x = _mm_xor_si128(x, _mm_shuffle_epi8(VPERM(VPERM_SBO + 1), jo));
+    x = _mm_shuffle_epi8(x, VPERM(VPERM_SR + m));
+
+    _mm_storeu_si128((__m128i *)plaintext, x);
+}
+
+/*
+ * aes_vperm_schedule_round(x, prev) returns the next round key in the
+ * transformed basis: prev with its words smeared, plus SubWord(x)
+ */
+AES_VPERM_TARGET
+static inline __m128i aes_vperm_schedule_round(__m128i x, __m128i prev)
+{
+    __m128i io, jo;
+
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 4));
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 8));
+    prev = _mm_xor_si128(prev, VPERM(VPERM_S63));
+
+    aes_vperm_invert(x, &io, &jo);
+    x = _mm_xor_si128(_mm_shuffle_epi8(VPERM(VPERM_SB1), io),
+                      _mm_shuffle_epi8(VPERM(VPERM_SB1 + 1), jo));
+
+    return _mm_xor_si128(x, prev);
+}
+
+/*
+ * aes_vperm_rot_word(x, &prev, &rcon) broadcasts the last word of x
+ * rotated by one byte, and folds the next round constant into prev
+ */
+AES_VPERM_TARGET
+static inline __m128i aes_vperm_rot_word(__m128i x, __m128i *prev,
+                                         __m128i *rcon)
+{
+    *prev = _mm_xor_si128(*prev,
+                          _mm_alignr_epi8(_mm_setzero_si128(), *rcon, 15));
+    *rcon = _mm_alignr_epi8(*rcon, *rcon, 15);
+
+    x = _mm_shuffle_epi32(x, 0xFF);
+    return _mm_alignr_epi8(x, x, 1);
+}
+
+/*
+ * aes_vperm_mangle(x, i) puts round key i into the form the
+ * encryption rounds consume: MixColumns applied and ShiftRows undone
+ */
+AES_VPERM_TARGET
+static inline __m128i aes_vperm_mangle(__m128i x, size_t i)
+{
+    __m128i mc = VPERM(VPERM_MC_FWD);
+    __m128i t, y;
+
+    t = _mm_shuffle_epi8(_mm_xor_si128(x, VPERM(VPERM_S63)), mc);
+    y = t;
+    t = _mm_shuffle_epi8(t, mc);
+    y = _mm_xor_si128(y, t);
+    t = _mm_shuffle_epi8(t, mc);
+    y = _mm_xor_si128(y, t);
+
+    return _mm_shuffle_epi8(y, VPERM(VPERM_SR + ((4 - i) & 3)));
+}
+
+/*
+ * aes_vperm_mangle_last(x, i) converts the final round key back out
+ * of the transformed basis
+ */
+AES_VPERM_TARGET
+static inline __m128i aes_vperm_mangle_last(__m128i x, size_t i)
+{
+    x = _mm_shuffle_epi8(x, VPERM(VPERM_SR + ((4 - i) & 3)));
+    x = _mm_xor_si128(x, VPERM(VPERM_S63));
+
+    return aes_vperm_transform(x, VPERM_OPT);
+}
+
+AES_VPERM_TARGET
+static void aes_vperm_expand_encryption_key(
+    const uint8_t *key,
+    size_t key_len,
+    srtp_aes_expanded_key_t *expanded_key)
+{
+    __m128i *round = (__m128i *)expanded_key->round;
+    __m128i rcon = VPERM(VPERM_RCON);
+    __m128i x, prev;
+
+    expanded_key->num_rounds = (key_len == 16) ? 10 : 14;
+    expanded_key->vperm = true;
+
+    x = aes_vperm_transform(_mm_loadu_si128((const __m128i *)key), VPERM_IPT);
+    prev = x;
+    _mm_storeu_si128(&round[0], x);
+
+    if (key_len == 16) {
+        for (size_t i = 1; i < 10; i++) {
+            x = aes_vperm_rot_word(x, &prev, &rcon);
+            x = prev = aes_vperm_schedule_round(x, prev);
+            _mm_storeu_si128(&round[i], aes_vperm_mangle(x, i));
+        }
+        x = aes_vperm_rot_word(x, &prev, &rcon);
+        x = aes_vperm_schedule_round(x, prev);
+        _mm_storeu_si128(&round[10], aes_vperm_mangle_last(x, 10));
+        return;
+    }
+
+    /* AES-256 alternates rounds with and without RotWord and rcon */
+    x = aes_vperm_transform(_mm_loadu_si128((const __m128i *)(key + 16)),
+                            VPERM_IPT);
+    for (size_t i = 1;; i += 2) {
+        __m128i odd = x;
+
+        _mm_storeu_si128(&round[i], aes_vperm_mangle(x, i));
+
+        x = aes_vperm_rot_word(x, &prev, &rcon);
+        x = prev = aes_vperm_schedule_round(x, prev);
+        if (i + 1 == 14) {
+            _mm_storeu_si128(&round[14], aes_vperm_mangle_last(x, 14));
+            return;
+        }
+        _mm_storeu_si128(&round[i + 1], aes_vperm_mangle(x, i + 1));
+
+        x = aes_vperm_schedule_round(_mm_shuffle_epi32(x, 0xFF), odd);
+    }
+}
+
+/*
+ * aes_vperm_supported() reports whether the processor executes SSSE3;
+ * it is checked at key expansion, and the choice travels with the key
+ */
+static bool aes_vperm_supported(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+#endif /* SRTP_AES_VPERM */
+
+static srtp_aes_impl_t aes_impl = srtp_aes_impl_auto;
+
+srtp_err_status_t srtp_aes_set_implementation(srtp_aes_impl_t impl)
+{
+    switch (impl) {
+    case srtp_aes_impl_auto:
+    case srtp_aes_impl_table:
+        break;
+    case srtp_aes_impl_vperm:
+#ifdef SRTP_AES_VPERM
+        if (aes_vperm_supported()) {
+            break;
+        }
+#endif
+        return srtp_err_status_cipher_fail;
+    default:
+        return srtp_err_status_bad_param;
+    }
+
+    aes_impl = impl;
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_aes_expand_encryption_key(
+    const uint8_t *key,
+    size_t key_len,
+    srtp_aes_expanded_key_t *expanded_key)
+{
+#ifdef SRTP_AES_VPERM
+    if ((key_len == 16 || key_len == 32) && aes_impl != srtp_aes_impl_table &&
+        (aes_impl == srtp_aes_impl_vperm || aes_vperm_supported())) {
+        aes_vperm_expand_encryption_key(key, key_len, expanded_key);
+        return srtp_err_status_ok;
+    }
+#endif
+
+    return aes_expand_encryption_key(key, key_len, expanded_key);
+}
+
 srtp_err_status_t srtp_aes_expand_decryption_key(
     const uint8_t *key,
     size_t key_len,
     srtp_aes_expanded_key_t *expanded_key)
 {
     srtp_err_status_t status;
-    size_t num_rounds = expanded_key->num_rounds;
+    size_t num_rounds;
 
-    status = srtp_aes_expand_encryption_key(key, key_len, expanded_key);
+    /* the inverse cipher always runs on the tables */
+    status = aes_expand_encryption_key(key, key_len, expanded_key);
     if (status) {
         return status;
     }
+    num_rounds = expanded_key->num_rounds;
 
     /* invert the order of the round keys */
     for (size_t i = 0; i < num_rounds / 2; i++) {
@@ -2101,6 +2427,13 @@ static inline void aes_inv_final_round(v128_t *state, const v128_t *round_key)
 
 void srtp_aes_encrypt(v128_t *plaintext, const srtp_aes_expanded_key_t *exp_key)
 {
+#ifdef SRTP_AES_VPERM
+    if (exp_key->vperm) {
+        aes_vperm_encrypt(plaintext, exp_key);
+        return;
+    }
+#endif
+
     /* add in the subkey */
     v128_xor_eq(plaintext, &exp_key->round[0]);
 
@@ -124,6 +124,11 @@ static srtp_err_status_t srtp_aes_gcm_mbedtls_decrypt(void *cv,
                                                       uint8_t *dst,
                                                       size_t *dst_len);
 
+static srtp_err_status_t srtp_aes_gcm_mbedtls_update(void *cv,
+                                                     const uint8_t *src,
+                                                     size_t src_len,
+                                                     uint8_t *dst);
+
 /*
  * Name of this crypto engine
  */
@@ -146,7 +151,10 @@ const srtp_cipher_type_t srtp_aes_gcm_128 = {
     srtp_aes_gcm_mbedtls_set_iv,
     srtp_aes_gcm_128_mbedtls_description,
     &srtp_aes_gcm_128_test_case_0,
-    SRTP_AES_GCM_128
+    SRTP_AES_GCM_128,
+    0, /* batch */
+    0, /* copy */
+    srtp_aes_gcm_mbedtls_update /* update */
 };
 /* clang-format on */
 
@@ -164,7 +172,10 @@ const srtp_cipher_type_t srtp_aes_gcm_256 = {
     srtp_aes_gcm_mbedtls_set_iv,
     srtp_aes_gcm_256_mbedtls_description,
     &srtp_aes_gcm_256_test_case_0,
-    SRTP_AES_GCM_256
+    SRTP_AES_GCM_256,
+    0, /* batch */
+    0, /* copy */
+    srtp_aes_gcm_mbedtls_update /* update */
 };
 /* clang-format on */
 
@@ -278,6 +289,7 @@ static srtp_err_status_t srtp_aes_gcm_mbedtls_context_init(void *cv,
     int errCode = 0;
     c->dir = srtp_direction_any;
     c->aad_size = 0;
+    c->pending_len = 0;
 
     debug_print(srtp_mod_aes_gcm, "key:  %s",
                 srtp_octet_string_hex_string(key, c->key_size));
@@ -319,6 +331,7 @@ static srtp_err_status_t srtp_aes_gcm_mbedtls_set_iv(
                 srtp_octet_string_hex_string(iv, GCM_IV_LEN));
     c->iv_len = GCM_IV_LEN;
     memcpy(c->iv, iv, c->iv_len);
+    c->pending_len = 0;
     return (srtp_err_status_ok);
 }
 
@@ -350,6 +363,85 @@ static srtp_err_status_t srtp_aes_gcm_mbedtls_set_aad(void *cv,
     return (srtp_err_status_ok);
 }
 
+/*
+ * The mbedtls functions used here take the message in one piece, so the
+ * part of it given to update is held until the message is finished
+ *
+ * Parameters:
+ *	c	Crypto context
+ *	src	data to encrypt or decrypt
+ *	src_len	length of src, and of the result written to dst
+ */
+static srtp_err_status_t srtp_aes_gcm_mbedtls_update(void *cv,
+                                                     const uint8_t *src,
+                                                     size_t src_len,
+                                                     uint8_t *dst)
+{
+    FUNC_ENTRY();
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+
+    if (c->dir != srtp_direction_encrypt &&
+        c->dir != srtp_direction_decrypt) {
+        return srtp_err_status_bad_param;
+    }
+
+    /* only one part is held */
+    if (c->pending_len) {
+        return srtp_err_status_bad_param;
+    }
+
+    c->pending_src = src;
+    c->pending_dst = dst;
+    c->pending_len = src_len;
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * This function finishes a message with a part held by update: both
+ * parts are gathered into one buffer for the operation op, and the
+ * result is written back to the two destinations
+ */
+static srtp_err_status_t srtp_aes_gcm_mbedtls_gather(
+    void *cv,
+    srtp_cipher_encrypt_func_t op,
+    const uint8_t *src,
+    size_t src_len,
+    uint8_t *dst,
+    size_t *dst_len)
+{
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+    size_t pending_len = c->pending_len;
+    size_t buf_size = pending_len + src_len + c->tag_len;
+    size_t len = buf_size;
+    srtp_err_status_t status;
+    uint8_t *buf;
+
+    c->pending_len = 0;
+
+    buf = (uint8_t *)srtp_crypto_alloc(buf_size);
+    if (buf == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    memcpy(buf, c->pending_src, pending_len);
+    memcpy(buf + pending_len, src, src_len);
+
+    status = op(cv, buf, pending_len + src_len, buf, &len);
+    if (!status && (len < pending_len || *dst_len < len - pending_len)) {
+        status = srtp_err_status_buffer_small;
+    }
+    if (!status) {
+        memcpy(c->pending_dst, buf, pending_len);
+        memcpy(dst, buf + pending_len, len - pending_len);
+        *dst_len = len - pending_len;
+    }
+
+    octet_string_set_to_zero(buf, buf_size);
+    srtp_crypto_free(buf);
+
+    return status;
+}
+
 /*
  * This function encrypts a buffer using AES GCM mode
  *
@@ -372,6 +464,11 @@ static srtp_err_status_t srtp_aes_gcm_mbedtls_encrypt(void *cv,
         return srtp_err_status_bad_param;
     }
 
+    if (c->pending_len) {
+        return srtp_aes_gcm_mbedtls_gather(
+            cv, srtp_aes_gcm_mbedtls_encrypt, src, src_len, dst, dst_len);
+    }
+
     if (*dst_len < src_len + c->tag_len) {
         return srtp_err_status_buffer_small;
     }
@@ -413,6 +510,11 @@ static srtp_err_status_t srtp_aes_gcm_mbedtls_decrypt(void *cv,
         return srtp_err_status_bad_param;
     }
 
+    if (c->pending_len) {
+        return srtp_aes_gcm_mbedtls_gather(
+            cv, srtp_aes_gcm_mbedtls_decrypt, src, src_len, dst, dst_len);
+    }
+
     if (src_len < c->tag_len) {
         return srtp_err_status_bad_param;
     }
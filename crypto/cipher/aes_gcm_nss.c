@@ -199,6 +199,7 @@ static srtp_err_status_t srtp_aes_gcm_nss_context_init(void *cv,
     srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
 
     c->dir = srtp_direction_any;
+    c->pending_len = 0;
 
     debug_print(srtp_mod_aes_gcm, "key:  %s",
                 srtp_octet_string_hex_string(key, c->key_size));
@@ -248,6 +249,7 @@ static srtp_err_status_t srtp_aes_gcm_nss_set_iv(
                 srtp_octet_string_hex_string(iv, GCM_IV_LEN));
 
     memcpy(c->iv, iv, GCM_IV_LEN);
+    c->pending_len = 0;
 
     return (srtp_err_status_ok);
 }
@@ -336,6 +338,84 @@ static srtp_err_status_t srtp_aes_gcm_nss_do_crypto(void *cv,
     return status;
 }
 
+/*
+ * NSS only takes the message in one piece, so the part of it given to
+ * update is held until the message is finished
+ *
+ * Parameters:
+ *	c	Crypto context
+ *	src	data to encrypt or decrypt
+ *	src_len	length of src, and of the result written to dst
+ */
+static srtp_err_status_t srtp_aes_gcm_nss_update(void *cv,
+                                                 const uint8_t *src,
+                                                 size_t src_len,
+                                                 uint8_t *dst)
+{
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+
+    if (c->dir != srtp_direction_encrypt &&
+        c->dir != srtp_direction_decrypt) {
+        return srtp_err_status_bad_param;
+    }
+
+    /* only one part is held */
+    if (c->pending_len) {
+        return srtp_err_status_bad_param;
+    }
+
+    c->pending_src = src;
+    c->pending_dst = dst;
+    c->pending_len = src_len;
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * This function finishes a message with a part held by update: both
+ * parts are gathered into one buffer for the operation op, and the
+ * result is written back to the two destinations
+ */
+static srtp_err_status_t srtp_aes_gcm_nss_gather(
+    void *cv,
+    srtp_cipher_encrypt_func_t op,
+    const uint8_t *src,
+    size_t src_len,
+    uint8_t *dst,
+    size_t *dst_len)
+{
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+    size_t pending_len = c->pending_len;
+    size_t buf_size = pending_len + src_len + c->tag_size;
+    size_t len = buf_size;
+    srtp_err_status_t status;
+    uint8_t *buf;
+
+    c->pending_len = 0;
+
+    buf = (uint8_t *)srtp_crypto_alloc(buf_size);
+    if (buf == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    memcpy(buf, c->pending_src, pending_len);
+    memcpy(buf + pending_len, src, src_len);
+
+    status = op(cv, buf, pending_len + src_len, buf, &len);
+    if (!status && (len < pending_len || *dst_len < len - pending_len)) {
+        status = srtp_err_status_buffer_small;
+    }
+    if (!status) {
+        memcpy(c->pending_dst, buf, pending_len);
+        memcpy(dst, buf + pending_len, len - pending_len);
+        *dst_len = len - pending_len;
+    }
+
+    octet_string_set_to_zero(buf, buf_size);
+    srtp_crypto_free(buf);
+
+    return status;
+}
+
 /*
  * This function encrypts a buffer using AES GCM mode
  *
@@ -350,6 +430,13 @@ static srtp_err_status_t srtp_aes_gcm_nss_encrypt(void *cv,
                                                   uint8_t *dst,
                                                   size_t *dst_len)
 {
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+
+    if (c->pending_len) {
+        return srtp_aes_gcm_nss_gather(cv, srtp_aes_gcm_nss_encrypt, src,
+                                       src_len, dst, dst_len);
+    }
+
     return srtp_aes_gcm_nss_do_crypto(cv, true, src, src_len, dst, dst_len);
 }
 
@@ -367,8 +454,15 @@ static srtp_err_status_t srtp_aes_gcm_nss_decrypt(void *cv,
                                                   uint8_t *dst,
                                                   size_t *dst_len)
 {
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
     uint8_t tagbuf[16];
     uint8_t *non_null_dst_buf = dst;
+
+    if (c->pending_len) {
+        return srtp_aes_gcm_nss_gather(cv, srtp_aes_gcm_nss_decrypt, src,
+                                       src_len, dst, dst_len);
+    }
+
     if (!non_null_dst_buf && (*dst_len == 0)) {
         non_null_dst_buf = tagbuf;
         *dst_len = sizeof(tagbuf);
@@ -408,7 +502,10 @@ const srtp_cipher_type_t srtp_aes_gcm_128 = {
     srtp_aes_gcm_nss_set_iv,
     srtp_aes_gcm_128_nss_description,
     &srtp_aes_gcm_128_test_case_0,
-    SRTP_AES_GCM_128
+    SRTP_AES_GCM_128,
+    0, /* batch */
+    0, /* copy */
+    srtp_aes_gcm_nss_update /* update */
 };
 /* clang-format on */
 
@@ -426,6 +523,9 @@ const srtp_cipher_type_t srtp_aes_gcm_256 = {
     srtp_aes_gcm_nss_set_iv,
     srtp_aes_gcm_256_nss_description,
     &srtp_aes_gcm_256_test_case_0,
-    SRTP_AES_GCM_256
+    SRTP_AES_GCM_256,
+    0, /* batch */
+    0, /* copy */
+    srtp_aes_gcm_nss_update /* update */
 };
 /* clang-format on */
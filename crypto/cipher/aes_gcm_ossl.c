@@ -68,6 +68,15 @@ srtp_debug_module_t srtp_mod_aes_gcm = {
 #define GCM_AUTH_TAG_LEN 16
 #define GCM_AUTH_TAG_LEN_8 8
 
+/*
+ * srtp_aes_gcm_cipher_t is the single allocation that holds a cipher and
+ * its state
+ */
+typedef struct {
+    srtp_cipher_t cipher;
+    srtp_aes_gcm_ctx_t gcm;
+} srtp_aes_gcm_cipher_t;
+
 /*
  * This function allocates a new instance of this crypto engine.
  * The key_len parameter should be one of 28 or 44 for
@@ -79,6 +88,7 @@ static srtp_err_status_t srtp_aes_gcm_openssl_alloc(srtp_cipher_t **c,
                                                     size_t key_len,
                                                     size_t tlen)
 {
+    srtp_aes_gcm_cipher_t *cipher;
     srtp_aes_gcm_ctx_t *gcm;
 
     debug_print(srtp_mod_aes_gcm, "allocating cipher with key length %zu",
@@ -98,28 +108,25 @@ static srtp_err_status_t srtp_aes_gcm_openssl_alloc(srtp_cipher_t **c,
         return (srtp_err_status_bad_param);
     }
 
-    /* allocate memory a cipher of type aes_gcm */
-    *c = (srtp_cipher_t *)srtp_crypto_alloc(sizeof(srtp_cipher_t));
-    if (*c == NULL) {
-        return (srtp_err_status_alloc_fail);
-    }
-
-    gcm = (srtp_aes_gcm_ctx_t *)srtp_crypto_alloc(sizeof(srtp_aes_gcm_ctx_t));
-    if (gcm == NULL) {
-        srtp_crypto_free(*c);
-        *c = NULL;
+    /*
+     * allocate memory for a cipher of type aes_gcm and its state in one
+     * block, so that the state is next to the cipher that points to it
+     */
+    cipher = (srtp_aes_gcm_cipher_t *)srtp_crypto_alloc(
+        sizeof(srtp_aes_gcm_cipher_t));
+    if (cipher == NULL) {
         return (srtp_err_status_alloc_fail);
     }
+    gcm = &cipher->gcm;
 
     gcm->ctx = EVP_CIPHER_CTX_new();
     if (gcm->ctx == NULL) {
-        srtp_crypto_free(gcm);
-        srtp_crypto_free(*c);
-        *c = NULL;
+        srtp_crypto_free(cipher);
         return srtp_err_status_alloc_fail;
     }
 
     /* set pointers */
+    *c = &cipher->cipher;
     (*c)->state = gcm;
 
     /* setup cipher attributes */
@@ -156,10 +163,9 @@ static srtp_err_status_t srtp_aes_gcm_openssl_dealloc(srtp_cipher_t *c)
         EVP_CIPHER_CTX_free(ctx->ctx);
         /* zeroize the key material */
         octet_string_set_to_zero(ctx, sizeof(srtp_aes_gcm_ctx_t));
-        srtp_crypto_free(ctx);
     }
 
-    /* free memory */
+    /* free memory, including the state */
     srtp_crypto_free(c);
 
     return (srtp_err_status_ok);
@@ -275,6 +281,42 @@ static srtp_err_status_t srtp_aes_gcm_openssl_set_aad(void *cv,
     return srtp_err_status_ok;
 }
 
+/*
+ * This function encrypts or decrypts a part of the message that comes
+ * before the part given to encrypt or decrypt
+ *
+ * Parameters:
+ *	c	Crypto context
+ *	src	data to encrypt or decrypt
+ *	src_len	length of src, and of the result written to dst
+ */
+static srtp_err_status_t srtp_aes_gcm_openssl_update(void *cv,
+                                                     const uint8_t *src,
+                                                     size_t src_len,
+                                                     uint8_t *dst)
+{
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+    int len = 0;
+
+    if (c->dir == srtp_direction_encrypt) {
+        if (EVP_EncryptUpdate(c->ctx, dst, &len, src, (int)src_len) != 1) {
+            return srtp_err_status_algo_fail;
+        }
+    } else if (c->dir == srtp_direction_decrypt) {
+        if (EVP_DecryptUpdate(c->ctx, dst, &len, src, (int)src_len) != 1) {
+            return srtp_err_status_algo_fail;
+        }
+    } else {
+        return srtp_err_status_bad_param;
+    }
+
+    if (len != (int)src_len) {
+        return srtp_err_status_algo_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+
 /*
  * This function encrypts a buffer using AES GCM mode
  *
@@ -410,7 +452,10 @@ const srtp_cipher_type_t srtp_aes_gcm_128 = {
     srtp_aes_gcm_openssl_set_iv,
     srtp_aes_gcm_128_openssl_description,
     &srtp_aes_gcm_128_test_case_0,
-    SRTP_AES_GCM_128
+    SRTP_AES_GCM_128,
+    0, /* batch */
+    0, /* copy */
+    srtp_aes_gcm_openssl_update /* update */
 };
 /* clang-format on */
 
@@ -428,6 +473,9 @@ const srtp_cipher_type_t srtp_aes_gcm_256 = {
     srtp_aes_gcm_openssl_set_iv,
     srtp_aes_gcm_256_openssl_description,
     &srtp_aes_gcm_256_test_case_0,
-    SRTP_AES_GCM_256
+    SRTP_AES_GCM_256,
+    0, /* batch */
+    0, /* copy */
+    srtp_aes_gcm_openssl_update /* update */
 };
 /* clang-format on */
@@ -198,6 +198,7 @@ static srtp_err_status_t srtp_aes_gcm_wolfssl_context_init(void *cv,
     c->dir = srtp_direction_any;
 #ifndef WOLFSSL_AESGCM_STREAM
     c->aad_size = 0;
+    c->pending_len = 0;
 #endif
 
     debug_print(srtp_mod_aes_gcm, "key:  %s",
@@ -258,6 +259,7 @@ static srtp_err_status_t srtp_aes_gcm_wolfssl_set_iv(
     memcpy(c->iv, iv, c->iv_len);
 
     c->aad_size = 0;
+    c->pending_len = 0;
 #else
     err = wc_AesGcmInit(c->ctx, NULL, 0, iv, GCM_NONCE_MID_SZ);
     if (err < 0) {
@@ -312,6 +314,120 @@ static srtp_err_status_t srtp_aes_gcm_wolfssl_set_aad(void *cv,
     return (srtp_err_status_ok);
 }
 
+#ifndef WOLFSSL_AESGCM_STREAM
+/*
+ * Without WOLFSSL_AESGCM_STREAM wolfSSL takes the message in one piece, so
+ * the part of it given to update is held until the message is finished
+ *
+ * Parameters:
+ *	c	Crypto context
+ *	src	data to encrypt or decrypt
+ *	src_len	length of src, and of the result written to dst
+ */
+static srtp_err_status_t srtp_aes_gcm_wolfssl_update(void *cv,
+                                                     const uint8_t *src,
+                                                     size_t src_len,
+                                                     uint8_t *dst)
+{
+    FUNC_ENTRY();
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+
+    if (c->dir != srtp_direction_encrypt &&
+        c->dir != srtp_direction_decrypt) {
+        return srtp_err_status_bad_param;
+    }
+
+    /* only one part is held */
+    if (c->pending_len) {
+        return srtp_err_status_bad_param;
+    }
+
+    c->pending_src = src;
+    c->pending_dst = dst;
+    c->pending_len = src_len;
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * This function finishes a message with a part held by update: both
+ * parts are gathered into one buffer for the operation op, and the
+ * result is written back to the two destinations
+ */
+static srtp_err_status_t srtp_aes_gcm_wolfssl_gather(
+    void *cv,
+    srtp_cipher_encrypt_func_t op,
+    const uint8_t *src,
+    size_t src_len,
+    uint8_t *dst,
+    size_t *dst_len)
+{
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+    size_t pending_len = c->pending_len;
+    size_t buf_size = pending_len + src_len + c->tag_len;
+    size_t len = buf_size;
+    srtp_err_status_t status;
+    uint8_t *buf;
+
+    c->pending_len = 0;
+
+    buf = (uint8_t *)srtp_crypto_alloc(buf_size);
+    if (buf == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    memcpy(buf, c->pending_src, pending_len);
+    memcpy(buf + pending_len, src, src_len);
+
+    status = op(cv, buf, pending_len + src_len, buf, &len);
+    if (!status && (len < pending_len || *dst_len < len - pending_len)) {
+        status = srtp_err_status_buffer_small;
+    }
+    if (!status) {
+        memcpy(c->pending_dst, buf, pending_len);
+        memcpy(dst, buf + pending_len, len - pending_len);
+        *dst_len = len - pending_len;
+    }
+
+    octet_string_set_to_zero(buf, buf_size);
+    srtp_crypto_free(buf);
+
+    return status;
+}
+#else
+/*
+ * This function encrypts or decrypts a part of the message that comes
+ * before the part given to encrypt or decrypt
+ *
+ * Parameters:
+ *	c	Crypto context
+ *	src	data to encrypt or decrypt
+ *	src_len	length of src, and of the result written to dst
+ */
+static srtp_err_status_t srtp_aes_gcm_wolfssl_update(void *cv,
+                                                     const uint8_t *src,
+                                                     size_t src_len,
+                                                     uint8_t *dst)
+{
+    FUNC_ENTRY();
+    srtp_aes_gcm_ctx_t *c = (srtp_aes_gcm_ctx_t *)cv;
+    int err;
+
+    if (c->dir == srtp_direction_encrypt) {
+        err = wc_AesGcmEncryptUpdate(c->ctx, dst, src, src_len, NULL, 0);
+    } else if (c->dir == srtp_direction_decrypt) {
+        err = wc_AesGcmDecryptUpdate(c->ctx, dst, src, src_len, NULL, 0);
+    } else {
+        return srtp_err_status_bad_param;
+    }
+    if (err < 0) {
+        debug_print(srtp_mod_aes_gcm, "wolfSSL error code:  %d", err);
+        return srtp_err_status_algo_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+#endif
+
 /*
  * This function encrypts a buffer using AES GCM mode
  *
@@ -334,6 +450,13 @@ static srtp_err_status_t srtp_aes_gcm_wolfssl_encrypt(void *cv,
         return srtp_err_status_bad_param;
     }
 
+#ifndef WOLFSSL_AESGCM_STREAM
+    if (c->pending_len) {
+        return srtp_aes_gcm_wolfssl_gather(
+            cv, srtp_aes_gcm_wolfssl_encrypt, src, src_len, dst, dst_len);
+    }
+#endif
+
     if (*dst_len < src_len + c->tag_len) {
         return srtp_err_status_buffer_small;
     }
@@ -389,6 +512,13 @@ static srtp_err_status_t srtp_aes_gcm_wolfssl_decrypt(void *cv,
         return srtp_err_status_bad_param;
     }
 
+#ifndef WOLFSSL_AESGCM_STREAM
+    if (c->pending_len) {
+        return srtp_aes_gcm_wolfssl_gather(
+            cv, srtp_aes_gcm_wolfssl_decrypt, src, src_len, dst, dst_len);
+    }
+#endif
+
     if (src_len < c->tag_len) {
         return srtp_err_status_bad_param;
     }
@@ -451,7 +581,10 @@ const srtp_cipher_type_t srtp_aes_gcm_128 = {
     srtp_aes_gcm_wolfssl_set_iv,
     srtp_aes_gcm_128_wolfssl_description,
     &srtp_aes_gcm_128_test_case_0,
-    SRTP_AES_GCM_128
+    SRTP_AES_GCM_128,
+    0, /* batch */
+    0, /* copy */
+    srtp_aes_gcm_wolfssl_update /* update */
 };
 /* clang-format on */
 
@@ -469,6 +602,9 @@ const srtp_cipher_type_t srtp_aes_gcm_256 = {
     srtp_aes_gcm_wolfssl_set_iv,
     srtp_aes_gcm_256_wolfssl_description,
     &srtp_aes_gcm_256_test_case_0,
-    SRTP_AES_GCM_256
+    SRTP_AES_GCM_256,
+    0, /* batch */
+    0, /* copy */
+    srtp_aes_gcm_wolfssl_update /* update */
 };
 /* clang-format on */
@@ -93,10 +93,20 @@ srtp_debug_module_t srtp_mod_aes_icm = {
  *
  */
 
+/*
+ * srtp_aes_icm_cipher_t is the single allocation that holds a cipher and
+ * its state
+ */
+typedef struct {
+    srtp_cipher_t cipher;
+    srtp_aes_icm_ctx_t icm;
+} srtp_aes_icm_cipher_t;
+
 static srtp_err_status_t srtp_aes_icm_alloc(srtp_cipher_t **c,
                                             size_t key_len,
                                             size_t tlen)
 {
+    srtp_aes_icm_cipher_t *cipher;
     srtp_aes_icm_ctx_t *icm;
     (void)tlen;
 
@@ -114,20 +124,19 @@ static srtp_err_status_t srtp_aes_icm_alloc(srtp_cipher_t **c,
         return srtp_err_status_bad_param;
     }
 
-    /* allocate memory a cipher of type aes_icm */
-    *c = (srtp_cipher_t *)srtp_crypto_alloc(sizeof(srtp_cipher_t));
-    if (*c == NULL) {
-        return srtp_err_status_alloc_fail;
-    }
-
-    icm = (srtp_aes_icm_ctx_t *)srtp_crypto_alloc(sizeof(srtp_aes_icm_ctx_t));
-    if (icm == NULL) {
-        srtp_crypto_free(*c);
-        *c = NULL;
+    /*
+     * allocate memory for a cipher of type aes_icm and its state in one
+     * block, so that the state is next to the cipher that points to it
+     */
+    cipher = (srtp_aes_icm_cipher_t *)srtp_crypto_alloc(
+        sizeof(srtp_aes_icm_cipher_t));
+    if (cipher == NULL) {
         return srtp_err_status_alloc_fail;
     }
 
     /* set pointers */
+    *c = &cipher->cipher;
+    icm = &cipher->icm;
     (*c)->state = icm;
 
     switch (key_len) {
@@ -160,15 +169,25 @@ static srtp_err_status_t srtp_aes_icm_dealloc(srtp_cipher_t *c)
     if (ctx) {
         /* zeroize the key material */
         octet_string_set_to_zero(ctx, sizeof(srtp_aes_icm_ctx_t));
-        srtp_crypto_free(ctx);
     }
 
-    /* free the cipher context */
+    /* free the cipher context, which holds the state */
     srtp_crypto_free(c);
 
     return srtp_err_status_ok;
 }
 
+/*
+ * srtp_aes_icm_copy(dst, src) copies the expanded key, counter and
+ * keystream buffer of src, none of which points elsewhere
+ */
+static srtp_err_status_t srtp_aes_icm_copy(void *dst, const void *src)
+{
+    memcpy(dst, src, sizeof(srtp_aes_icm_ctx_t));
+
+    return srtp_err_status_ok;
+}
+
 /*
  * aes_icm_context_init(...) initializes the aes_icm_context
  * using the value in key[].
@@ -432,7 +451,10 @@ const srtp_cipher_type_t srtp_aes_icm_128 = {
     srtp_aes_icm_set_iv,           /* */
     srtp_aes_icm_128_description,  /* */
     &srtp_aes_icm_128_test_case_0, /* */
-    SRTP_AES_ICM_128               /* */
+    SRTP_AES_ICM_128,              /* */
+    0,                             /* batch */
+    srtp_aes_icm_copy,             /* copy */
+    0                              /* update */
 };
 
 const srtp_cipher_type_t srtp_aes_icm_256 = {
@@ -445,5 +467,8 @@ const srtp_cipher_type_t srtp_aes_icm_256 = {
     srtp_aes_icm_set_iv,           /* */
     srtp_aes_icm_256_description,  /* */
     &srtp_aes_icm_256_test_case_0, /* */
-    SRTP_AES_ICM_256               /* */
+    SRTP_AES_ICM_256,              /* */
+    0,                             /* batch */
+    srtp_aes_icm_copy,             /* copy */
+    0                              /* update */
 };
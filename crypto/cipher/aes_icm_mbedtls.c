@@ -105,7 +105,10 @@ const srtp_cipher_type_t srtp_aes_icm_128 = {
     srtp_aes_icm_mbedtls_set_iv,          /* */
     srtp_aes_icm_128_mbedtls_description, /* */
     &srtp_aes_icm_128_test_case_0,        /* */
-    SRTP_AES_ICM_128                      /* */
+    SRTP_AES_ICM_128,                     /* */
+    0,                                    /* batch */
+    0,                                    /* copy */
+    0                                     /* update */
 };
 
 /*
@@ -122,7 +125,10 @@ const srtp_cipher_type_t srtp_aes_icm_192 = {
     srtp_aes_icm_mbedtls_set_iv,          /* */
     srtp_aes_icm_192_mbedtls_description, /* */
     &srtp_aes_icm_192_test_case_0,        /* */
-    SRTP_AES_ICM_192                      /* */
+    SRTP_AES_ICM_192,                     /* */
+    0,                                    /* batch */
+    0,                                    /* copy */
+    0                                     /* update */
 };
 
 /*
@@ -139,7 +145,10 @@ const srtp_cipher_type_t srtp_aes_icm_256 = {
     srtp_aes_icm_mbedtls_set_iv,          /* */
     srtp_aes_icm_256_mbedtls_description, /* */
     &srtp_aes_icm_256_test_case_0,        /* */
-    SRTP_AES_ICM_256                      /* */
+    SRTP_AES_ICM_256,                     /* */
+    0,                                    /* batch */
+    0,                                    /* copy */
+    0                                     /* update */
 };
 
 /*
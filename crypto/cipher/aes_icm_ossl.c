@@ -99,6 +99,15 @@ srtp_debug_module_t srtp_mod_aes_icm = {
  *
  */
 
+/*
+ * srtp_aes_icm_cipher_t is the single allocation that holds a cipher and
+ * its state
+ */
+typedef struct {
+    srtp_cipher_t cipher;
+    srtp_aes_icm_ctx_t icm;
+} srtp_aes_icm_cipher_t;
+
 /*
  * This function allocates a new instance of this crypto engine.
  * The key_len parameter should be one of 30, 38, or 46 for
@@ -111,6 +120,7 @@ static srtp_err_status_t srtp_aes_icm_openssl_alloc(srtp_cipher_t **c,
                                                     size_t key_len,
                                                     size_t tlen)
 {
+    srtp_aes_icm_cipher_t *cipher;
     srtp_aes_icm_ctx_t *icm;
     (void)tlen;
 
@@ -126,28 +136,25 @@ static srtp_err_status_t srtp_aes_icm_openssl_alloc(srtp_cipher_t **c,
         return srtp_err_status_bad_param;
     }
 
-    /* allocate memory a cipher of type aes_icm */
-    *c = (srtp_cipher_t *)srtp_crypto_alloc(sizeof(srtp_cipher_t));
-    if (*c == NULL) {
-        return srtp_err_status_alloc_fail;
-    }
-
-    icm = (srtp_aes_icm_ctx_t *)srtp_crypto_alloc(sizeof(srtp_aes_icm_ctx_t));
-    if (icm == NULL) {
-        srtp_crypto_free(*c);
-        *c = NULL;
+    /*
+     * allocate memory for a cipher of type aes_icm and its state in one
+     * block, so that the state is next to the cipher that points to it
+     */
+    cipher = (srtp_aes_icm_cipher_t *)srtp_crypto_alloc(
+        sizeof(srtp_aes_icm_cipher_t));
+    if (cipher == NULL) {
         return srtp_err_status_alloc_fail;
     }
+    icm = &cipher->icm;
 
     icm->ctx = EVP_CIPHER_CTX_new();
     if (icm->ctx == NULL) {
-        srtp_crypto_free(icm);
-        srtp_crypto_free(*c);
-        *c = NULL;
+        srtp_crypto_free(cipher);
         return srtp_err_status_alloc_fail;
     }
 
     /* set pointers */
+    *c = &cipher->cipher;
     (*c)->state = icm;
 
     /* setup cipher parameters */
@@ -194,15 +201,34 @@ static srtp_err_status_t srtp_aes_icm_openssl_dealloc(srtp_cipher_t *c)
         EVP_CIPHER_CTX_free(ctx->ctx);
         /* zeroize the key material */
         octet_string_set_to_zero(ctx, sizeof(srtp_aes_icm_ctx_t));
-        srtp_crypto_free(ctx);
     }
 
-    /* free memory */
+    /* free memory, including the state */
     srtp_crypto_free(c);
 
     return srtp_err_status_ok;
 }
 
+/*
+ * srtp_aes_icm_openssl_copy(dst, src) copies the counter and the keyed
+ * EVP context of src
+ */
+static srtp_err_status_t srtp_aes_icm_openssl_copy(void *dstv,
+                                                   const void *srcv)
+{
+    srtp_aes_icm_ctx_t *dst = (srtp_aes_icm_ctx_t *)dstv;
+    const srtp_aes_icm_ctx_t *src = (const srtp_aes_icm_ctx_t *)srcv;
+
+    if (!EVP_CIPHER_CTX_copy(dst->ctx, src->ctx)) {
+        return srtp_err_status_fail;
+    }
+    dst->counter = src->counter;
+    dst->offset = src->offset;
+    dst->key_size = src->key_size;
+
+    return srtp_err_status_ok;
+}
+
 /*
  * aes_icm_openssl_context_init(...) initializes the aes_icm_context
  * using the value in key[].
@@ -353,7 +379,10 @@ const srtp_cipher_type_t srtp_aes_icm_128 = {
     srtp_aes_icm_openssl_set_iv,          /* */
     srtp_aes_icm_128_openssl_description, /* */
     &srtp_aes_icm_128_test_case_0,        /* */
-    SRTP_AES_ICM_128                      /* */
+    SRTP_AES_ICM_128,                     /* */
+    0,                                    /* batch */
+    srtp_aes_icm_openssl_copy,            /* copy */
+    0                                     /* update */
 };
 
 /*
@@ -370,7 +399,10 @@ const srtp_cipher_type_t srtp_aes_icm_192 = {
     srtp_aes_icm_openssl_set_iv,          /* */
     srtp_aes_icm_192_openssl_description, /* */
     &srtp_aes_icm_192_test_case_0,        /* */
-    SRTP_AES_ICM_192                      /* */
+    SRTP_AES_ICM_192,                     /* */
+    0,                                    /* batch */
+    srtp_aes_icm_openssl_copy,            /* copy */
+    0                                     /* update */
 };
 
 /*
@@ -387,5 +419,8 @@ const srtp_cipher_type_t srtp_aes_icm_256 = {
     srtp_aes_icm_openssl_set_iv,          /* */
     srtp_aes_icm_256_openssl_description, /* */
     &srtp_aes_icm_256_test_case_0,        /* */
-    SRTP_AES_ICM_256                      /* */
+    SRTP_AES_ICM_256,                     /* */
+    0,                                    /* batch */
+    srtp_aes_icm_openssl_copy,            /* copy */
+    0                                     /* update */
 };
@@ -361,7 +361,10 @@ const srtp_cipher_type_t srtp_aes_icm_128 = {
     srtp_aes_icm_wolfssl_set_iv,          /* */
     srtp_aes_icm_128_wolfssl_description, /* */
     &srtp_aes_icm_128_test_case_0,        /* */
-    SRTP_AES_ICM_128                      /* */
+    SRTP_AES_ICM_128,                     /* */
+    0,                                    /* batch */
+    0,                                    /* copy */
+    0                                     /* update */
 };
 
 /*
@@ -378,7 +381,10 @@ const srtp_cipher_type_t srtp_aes_icm_192 = {
     srtp_aes_icm_wolfssl_set_iv,          /* */
     srtp_aes_icm_192_wolfssl_description, /* */
     &srtp_aes_icm_192_test_case_0,        /* */
-    SRTP_AES_ICM_192                      /* */
+    SRTP_AES_ICM_192,                     /* */
+    0,                                    /* batch */
+    0,                                    /* copy */
+    0                                     /* update */
 };
 
 /*
@@ -395,5 +401,8 @@ const srtp_cipher_type_t srtp_aes_icm_256 = {
     srtp_aes_icm_wolfssl_set_iv,          /* */
     srtp_aes_icm_256_wolfssl_description, /* */
     &srtp_aes_icm_256_test_case_0,        /* */
-    SRTP_AES_ICM_256                      /* */
+    SRTP_AES_ICM_256,                     /* */
+    0,                                    /* batch */
+    0,                                    /* copy */
+    0                                     /* update */
 };
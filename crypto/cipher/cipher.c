@@ -151,8 +151,76 @@ srtp_err_status_t srtp_cipher_set_aad(srtp_cipher_t *c,
     return (((c)->type)->set_aad(((c)->state), aad, aad_len));
 }
 
+srtp_err_status_t srtp_cipher_update(srtp_cipher_t *c,
+                                     const uint8_t *src,
+                                     size_t src_len,
+                                     uint8_t *dst)
+{
+    if (!c || !c->type || !c->state) {
+        return (srtp_err_status_bad_param);
+    }
+    if (!((c)->type)->update) {
+        return (srtp_err_status_no_such_op);
+    }
+
+    return (((c)->type)->update(((c)->state), src, src_len, dst));
+}
+
+srtp_err_status_t srtp_cipher_batch(srtp_cipher_t *c,
+                                    srtp_cipher_direction_t direction,
+                                    srtp_cipher_job_t *jobs,
+                                    size_t num_jobs)
+{
+    srtp_err_status_t status = srtp_err_status_ok;
+
+    if (!c || !c->type || !c->state || (!jobs && num_jobs) ||
+        direction == srtp_direction_any) {
+        return (srtp_err_status_bad_param);
+    }
+
+    if (c->type->batch) {
+        return c->type->batch(c->state, direction, jobs, num_jobs);
+    }
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        srtp_cipher_job_t *job = &jobs[i];
+
+        job->status = c->type->set_iv(c->state, job->iv, direction);
+        if (!job->status && job->aad) {
+            job->status = srtp_cipher_set_aad(c, job->aad, job->aad_len);
+        }
+        if (!job->status) {
+            if (direction == srtp_direction_encrypt) {
+                job->status = c->type->encrypt(c->state, job->src,
+                                               job->src_len, job->dst,
+                                               &job->dst_len);
+            } else {
+                job->status = c->type->decrypt(c->state, job->src,
+                                               job->src_len, job->dst,
+                                               &job->dst_len);
+            }
+        }
+        if (job->status && !status) {
+            status = job->status;
+        }
+    }
+
+    return status;
+}
+
 /* some bookkeeping functions */
 
+srtp_err_status_t srtp_cipher_copy(srtp_cipher_t *dst,
+                                   const srtp_cipher_t *src)
+{
+    if (!dst || !src || !dst->type || !src->type || !src->type->copy ||
+        dst->type->copy != src->type->copy || dst->key_len != src->key_len) {
+        return (srtp_err_status_bad_param);
+    }
+
+    return (src->type->copy(dst->state, src->state));
+}
+
 size_t srtp_cipher_get_key_length(const srtp_cipher_t *c)
 {
     return c->key_len;
@@ -190,6 +258,143 @@ uint32_t srtp_cipher_rand_u32_for_tests(void)
 #define SELF_TEST_BUF_OCTETS 128
 #define NUM_RAND_TESTS 128
 #define MAX_KEY_LEN 64
+
+/*
+ * srtp_cipher_batch_test(c, test_case) runs test_case twice in one batch
+ * in each direction, so that a batch entry point is held to the same
+ * known answers as encrypt and decrypt
+ */
+static srtp_err_status_t srtp_cipher_batch_test(
+    srtp_cipher_t *c,
+    const srtp_cipher_test_case_t *test_case)
+{
+    uint8_t buffer[2][SELF_TEST_BUF_OCTETS];
+    srtp_cipher_job_t jobs[2];
+    srtp_err_status_t status;
+
+    for (int d = 0; d < 2; d++) {
+        srtp_cipher_direction_t direction =
+            d == 0 ? srtp_direction_encrypt : srtp_direction_decrypt;
+        const uint8_t *expected =
+            d == 0 ? test_case->ciphertext : test_case->plaintext;
+        size_t expected_len = d == 0 ? test_case->ciphertext_length_octets
+                                     : test_case->plaintext_length_octets;
+
+        status = srtp_cipher_init(c, test_case->key);
+        if (status) {
+            return status;
+        }
+
+        for (size_t i = 0; i < 2; i++) {
+            jobs[i].iv = test_case->idx;
+            jobs[i].aad = test_case->aad;
+            jobs[i].aad_len = test_case->aad_length_octets;
+            if (direction == srtp_direction_encrypt) {
+                jobs[i].src = test_case->plaintext;
+                jobs[i].src_len = test_case->plaintext_length_octets;
+            } else {
+                jobs[i].src = test_case->ciphertext;
+                jobs[i].src_len = test_case->ciphertext_length_octets;
+            }
+            jobs[i].dst = buffer[i];
+            jobs[i].dst_len = sizeof(buffer[i]);
+        }
+
+        status = srtp_cipher_batch(c, direction, jobs, 2);
+        if (status) {
+            return status;
+        }
+
+        for (size_t i = 0; i < 2; i++) {
+            if (jobs[i].status || jobs[i].dst_len != expected_len) {
+                return srtp_err_status_algo_fail;
+            }
+            for (size_t k = 0; k < expected_len; k++) {
+                if (buffer[i][k] != expected[k]) {
+                    debug_print(srtp_mod_cipher, "batch job %zu failed", i);
+                    return srtp_err_status_algo_fail;
+                }
+            }
+        }
+    }
+
+    return srtp_err_status_ok;
+}
+/*
+ * srtp_cipher_update_test(c, test_case) runs test_case in each direction
+ * with the aad and the message each given in two parts, the first part of
+ * the message through the update entry point, so that it is held to the
+ * same known answers as encrypt and decrypt
+ */
+static srtp_err_status_t srtp_cipher_update_test(
+    srtp_cipher_t *c,
+    const srtp_cipher_test_case_t *test_case)
+{
+    static const size_t splits[] = { 1, 4, 13, 16 };
+    uint8_t buffer[SELF_TEST_BUF_OCTETS];
+    size_t aad_split = test_case->aad_length_octets / 2;
+    srtp_err_status_t status;
+
+    if (!c->type->update) {
+        return srtp_err_status_ok;
+    }
+
+    for (size_t i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+        size_t split = splits[i];
+        if (split > test_case->plaintext_length_octets) {
+            break;
+        }
+
+        for (int d = 0; d < 2; d++) {
+            srtp_cipher_direction_t direction =
+                d == 0 ? srtp_direction_encrypt : srtp_direction_decrypt;
+            const uint8_t *src =
+                d == 0 ? test_case->plaintext : test_case->ciphertext;
+            size_t src_len = d == 0 ? test_case->plaintext_length_octets
+                                    : test_case->ciphertext_length_octets;
+            const uint8_t *expected =
+                d == 0 ? test_case->ciphertext : test_case->plaintext;
+            size_t expected_len = d == 0 ? test_case->ciphertext_length_octets
+                                         : test_case->plaintext_length_octets;
+            size_t len = sizeof(buffer) - split;
+
+            status = srtp_cipher_init(c, test_case->key);
+            if (!status) {
+                status = srtp_cipher_set_iv(c, test_case->idx, direction);
+            }
+            if (!status) {
+                status = srtp_cipher_set_aad(c, test_case->aad, aad_split);
+            }
+            if (!status) {
+                status = srtp_cipher_set_aad(
+                    c, test_case->aad + aad_split,
+                    test_case->aad_length_octets - aad_split);
+            }
+            if (!status) {
+                status = srtp_cipher_update(c, src, split, buffer);
+            }
+            if (!status && direction == srtp_direction_encrypt) {
+                status = srtp_cipher_encrypt(c, src + split, src_len - split,
+                                             buffer + split, &len);
+            } else if (!status) {
+                status = srtp_cipher_decrypt(c, src + split, src_len - split,
+                                             buffer + split, &len);
+            }
+            if (status) {
+                return status;
+            }
+
+            if (split + len != expected_len ||
+                memcmp(buffer, expected, expected_len) != 0) {
+                debug_print(srtp_mod_cipher, "update at %zu failed", split);
+                return srtp_err_status_algo_fail;
+            }
+        }
+    }
+
+    return srtp_err_status_ok;
+}
+
 /*
  * srtp_cipher_type_test(ct, test_data) tests a cipher of type ct against
  * test cases provided in a list test_data of values of key, salt, iv,
@@ -408,6 +613,22 @@ srtp_err_status_t srtp_cipher_type_test(
             return srtp_err_status_algo_fail;
         }
 
+        /* test the batch entry point, or the loop standing in for it */
+        debug_print0(srtp_mod_cipher, "testing batch");
+        status = srtp_cipher_batch_test(c, test_case);
+        if (status) {
+            srtp_cipher_dealloc(c);
+            return status;
+        }
+
+        /* test a message given in parts, if the cipher can take that */
+        debug_print0(srtp_mod_cipher, "testing update");
+        status = srtp_cipher_update_test(c, test_case);
+        if (status) {
+            srtp_cipher_dealloc(c);
+            return status;
+        }
+
         /* deallocate the cipher */
         status = srtp_cipher_dealloc(c);
         if (status) {
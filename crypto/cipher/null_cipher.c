@@ -162,5 +162,8 @@ const srtp_cipher_type_t srtp_null_cipher = {
     srtp_null_cipher_set_iv,      /* */
     srtp_null_cipher_description, /* */
     &srtp_null_cipher_test_0,     /* */
-    SRTP_NULL_CIPHER              /* */
+    SRTP_NULL_CIPHER,             /* */
+    0,                            /* batch */
+    0,                            /* copy */
+    0                             /* update */
 };
@@ -73,6 +73,52 @@ size_t srtp_auth_get_prefix_length(const srtp_auth_t *a)
     return a->prefix_len;
 }
 
+srtp_err_status_t srtp_auth_batch(srtp_auth_t *a,
+                                  srtp_auth_job_t *jobs,
+                                  size_t num_jobs)
+{
+    srtp_err_status_t status = srtp_err_status_ok;
+
+    if (!a || !a->type || (!jobs && num_jobs)) {
+        return srtp_err_status_bad_param;
+    }
+
+    if (a->type->batch) {
+        return a->type->batch(a->state, a->out_len, jobs, num_jobs);
+    }
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        srtp_auth_job_t *job = &jobs[i];
+
+        job->status = srtp_auth_start(a);
+        if (!job->status && job->trailer) {
+            job->status = srtp_auth_update(a, job->buffer, job->len);
+            if (!job->status) {
+                job->status = srtp_auth_compute(a, job->trailer,
+                                                job->trailer_len, job->tag);
+            }
+        } else if (!job->status) {
+            job->status = srtp_auth_compute(a, job->buffer, job->len, job->tag);
+        }
+        if (job->status && !status) {
+            status = job->status;
+        }
+    }
+
+    return status;
+}
+
+srtp_err_status_t srtp_auth_copy(srtp_auth_t *dst, const srtp_auth_t *src)
+{
+    if (!dst || !src || !dst->type || !src->type || !src->type->copy ||
+        dst->type->copy != src->type->copy || dst->key_len != src->key_len ||
+        dst->out_len != src->out_len) {
+        return srtp_err_status_bad_param;
+    }
+
+    return src->type->copy(dst->state, src->state);
+}
+
 /*
  * srtp_auth_type_test() tests an auth function of type ct against
  * test cases provided in a list test_data of values of key, data, and tag
@@ -89,6 +135,8 @@ srtp_err_status_t srtp_auth_type_test(const srtp_auth_type_t *at,
     srtp_auth_t *a;
     srtp_err_status_t status;
     uint8_t tag[SELF_TEST_TAG_BUF_OCTETS];
+    uint8_t batch_tags[2][SELF_TEST_TAG_BUF_OCTETS];
+    srtp_auth_job_t jobs[2];
     size_t i = 0;
     size_t case_num = 0;
 
@@ -166,6 +214,36 @@ srtp_err_status_t srtp_auth_type_test(const srtp_auth_type_t *at,
             return srtp_err_status_algo_fail;
         }
 
+        /*
+         * run the test case again as a batch, once in one piece and once
+         * with the second half of the data as a trailer
+         */
+        jobs[0].buffer = test_case->data;
+        jobs[0].len = test_case->data_length_octets;
+        jobs[0].trailer = NULL;
+        jobs[0].trailer_len = 0;
+        jobs[0].tag = batch_tags[0];
+        jobs[1].buffer = test_case->data;
+        jobs[1].len = test_case->data_length_octets / 2;
+        jobs[1].trailer = test_case->data + jobs[1].len;
+        jobs[1].trailer_len = test_case->data_length_octets - jobs[1].len;
+        jobs[1].tag = batch_tags[1];
+        octet_string_set_to_zero(batch_tags, sizeof(batch_tags));
+        status = srtp_auth_batch(a, jobs, 2);
+        if (status) {
+            srtp_auth_dealloc(a);
+            return status;
+        }
+        for (i = 0; i < test_case->tag_length_octets; i++) {
+            if (batch_tags[0][i] != test_case->tag[i] ||
+                batch_tags[1][i] != test_case->tag[i]) {
+                debug_print(srtp_mod_auth, "batch test case %zu failed",
+                            case_num);
+                srtp_auth_dealloc(a);
+                return srtp_err_status_algo_fail;
+            }
+        }
+
         /* deallocate the auth function */
         status = srtp_auth_dealloc(a);
         if (status) {
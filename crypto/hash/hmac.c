@@ -112,12 +112,24 @@ static srtp_err_status_t srtp_hmac_dealloc(srtp_auth_t *a)
     return srtp_err_status_ok;
 }
 
+/*
+ * srtp_hmac_copy(dst, src) copies the keyed hash states of src, which hold
+ * no pointers
+ */
+static srtp_err_status_t srtp_hmac_copy(void *dst, const void *src)
+{
+    memcpy(dst, src, sizeof(srtp_hmac_ctx_t));
+
+    return srtp_err_status_ok;
+}
+
 static srtp_err_status_t srtp_hmac_init(void *statev,
                                         const uint8_t *key,
                                         size_t key_len)
 {
     srtp_hmac_ctx_t *state = (srtp_hmac_ctx_t *)statev;
     uint8_t ipad[64];
+    uint8_t opad[64];
 
     /*
      * check key length - note that we don't support keys larger
@@ -133,12 +145,12 @@ static srtp_err_status_t srtp_hmac_init(void *statev,
      */
     for (size_t i = 0; i < key_len; i++) {
         ipad[i] = key[i] ^ 0x36;
-        state->opad[i] = key[i] ^ 0x5c;
+        opad[i] = key[i] ^ 0x5c;
     }
     /* set the rest of ipad, opad to constant values */
     for (size_t i = key_len; i < 64; i++) {
         ipad[i] = 0x36;
-        ((uint8_t *)state->opad)[i] = 0x5c;
+        opad[i] = 0x5c;
     }
 
     debug_print(srtp_mod_hmac, "ipad: %s",
@@ -151,6 +163,16 @@ static srtp_err_status_t srtp_hmac_init(void *statev,
     srtp_sha1_update(&state->init_ctx, ipad, 64);
     memcpy(&state->ctx, &state->init_ctx, sizeof(srtp_sha1_ctx_t));
 
+    /*
+     * hash opad ^ key once here, rather than for every tag, which saves
+     * one of the three compressions that a short packet costs
+     */
+    srtp_sha1_init(&state->outer_ctx);
+    srtp_sha1_update(&state->outer_ctx, opad, 64);
+
+    octet_string_set_to_zero(ipad, sizeof(ipad));
+    octet_string_set_to_zero(opad, sizeof(opad));
+
     return srtp_err_status_ok;
 }
 
@@ -205,11 +227,8 @@ static srtp_err_status_t srtp_hmac_compute(void *statev,
     debug_print(srtp_mod_hmac, "intermediate state: %s",
                 srtp_octet_string_hex_string((uint8_t *)H, 20));
 
-    /* re-initialize hash context */
-    srtp_sha1_init(&state->ctx);
-
-    /* hash opad ^ key  */
-    srtp_sha1_update(&state->ctx, (uint8_t *)state->opad, 64);
+    /* start from the state after opad ^ key */
+    memcpy(&state->ctx, &state->outer_ctx, sizeof(srtp_sha1_ctx_t));
 
     /* hash the result of the inner hash */
     srtp_sha1_update(&state->ctx, (uint8_t *)H, 20);
@@ -244,5 +263,7 @@ const srtp_auth_type_t srtp_hmac = {
     srtp_hmac_start,        /* */
     srtp_hmac_description,  /* */
     &srtp_hmac_test_case_0, /* */
-    SRTP_HMAC_SHA1          /* */
+    SRTP_HMAC_SHA1,         /* */
+    0,                      /* batch */
+    srtp_hmac_copy          /* copy */
 };
@@ -220,5 +220,7 @@ const srtp_auth_type_t srtp_hmac = {
     srtp_hmac_mbedtls_start,       /* */
     srtp_hmac_mbedtls_description, /* */
     &srtp_hmac_test_case_0,        /* */
-    SRTP_HMAC_SHA1                 /* */
+    SRTP_HMAC_SHA1,                /* */
+    0,                             /* batch */
+    0                              /* copy */
 };
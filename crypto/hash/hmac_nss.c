@@ -287,5 +287,7 @@ const srtp_auth_type_t srtp_hmac = {
     srtp_hmac_start,        /* */
     srtp_hmac_description,  /* */
     &srtp_hmac_test_case_0, /* */
-    SRTP_HMAC_SHA1          /* */
+    SRTP_HMAC_SHA1,         /* */
+    0,                      /* batch */
+    0                       /* copy */
 };
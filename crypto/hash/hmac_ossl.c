@@ -223,6 +223,32 @@ static srtp_err_status_t srtp_hmac_start(void *statev)
     return srtp_err_status_ok;
 }
 
+/*
+ * srtp_hmac_copy(dst, src) duplicates the keyed MAC context of src, or
+ * the template it is duplicated from at every start
+ */
+static srtp_err_status_t srtp_hmac_copy(void *dstv, const void *srcv)
+{
+    srtp_hmac_ossl_ctx_t *dst = (srtp_hmac_ossl_ctx_t *)dstv;
+    const srtp_hmac_ossl_ctx_t *src = (const srtp_hmac_ossl_ctx_t *)srcv;
+
+#ifdef SRTP_OSSL_USE_EVP_MAC
+    EVP_MAC_CTX **to = src->use_dup ? &dst->ctx_dup : &dst->ctx;
+    EVP_MAC_CTX *ctx = EVP_MAC_CTX_dup(src->use_dup ? src->ctx_dup : src->ctx);
+
+    if (ctx == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    EVP_MAC_CTX_free(*to);
+    *to = ctx;
+#else
+    if (HMAC_CTX_copy(dst->ctx, src->ctx) == 0) {
+        return srtp_err_status_auth_fail;
+    }
+#endif
+    return srtp_err_status_ok;
+}
+
 static srtp_err_status_t srtp_hmac_init(void *statev,
                                         const uint8_t *key,
                                         size_t key_len)
@@ -339,5 +365,7 @@ const srtp_auth_type_t srtp_hmac = {
     srtp_hmac_start,        /* */
     srtp_hmac_description,  /* */
     &srtp_hmac_test_case_0, /* */
-    SRTP_HMAC_SHA1          /* */
+    SRTP_HMAC_SHA1,         /* */
+    0,                      /* batch */
+    srtp_hmac_copy          /* copy */
 };
@@ -177,5 +177,7 @@ const srtp_auth_type_t srtp_null_auth = {
     srtp_null_auth_start,        /* */
     srtp_null_auth_description,  /* */
     &srtp_null_auth_test_case_0, /* */
-    SRTP_NULL_AUTH               /* */
+    SRTP_NULL_AUTH,              /* */
+    0,                           /* batch */
+    0                            /* copy */
 };
@@ -58,6 +58,7 @@ extern "C" {
 typedef struct {
     v128_t round[15];
     size_t num_rounds;
+    bool vperm; /* round keys are in the vector-permute basis */
 } srtp_aes_expanded_key_t;
 
 srtp_err_status_t srtp_aes_expand_encryption_key(
@@ -76,6 +77,21 @@ void srtp_aes_encrypt(v128_t *plaintext,
 void srtp_aes_decrypt(v128_t *plaintext,
                       const srtp_aes_expanded_key_t *exp_key);
 
+/*
+ * srtp_aes_set_implementation() chooses how keys expanded from then on
+ * are run: srtp_aes_impl_auto uses the vector-permute cipher where the
+ * processor has SSSE3 and the tables otherwise, the other two force one
+ * or the other.  The setting is process wide and not synchronized; it
+ * is meant for tests
+ */
+typedef enum {
+    srtp_aes_impl_auto = 0,
+    srtp_aes_impl_table = 1,
+    srtp_aes_impl_vperm = 2,
+} srtp_aes_impl_t;
+
+srtp_err_status_t srtp_aes_set_implementation(srtp_aes_impl_t impl);
+
 #ifdef __cplusplus
 }
 #endif
@@ -83,6 +83,9 @@ typedef struct {
     size_t iv_len;
     uint8_t iv[GCM_NONCE_MID_SZ];
     uint8_t aad[MAX_AD_SIZE];
+    const uint8_t *pending_src; /* part of the message given to update */
+    uint8_t *pending_dst;
+    size_t pending_len;
 #endif
     Aes *ctx;
     srtp_cipher_direction_t dir;
@@ -102,6 +105,9 @@ typedef struct {
     size_t iv_len;
     uint8_t iv[12];
     uint8_t aad[MAX_AD_SIZE];
+    const uint8_t *pending_src; /* part of the message given to update */
+    uint8_t *pending_dst;
+    size_t pending_len;
     mbedtls_gcm_context *ctx;
     srtp_cipher_direction_t dir;
 } srtp_aes_gcm_ctx_t;
@@ -126,6 +132,9 @@ typedef struct {
     uint8_t iv[12];
     uint8_t aad[MAX_AD_SIZE];
     size_t aad_size;
+    const uint8_t *pending_src; /* part of the message given to update */
+    uint8_t *pending_dst;
+    size_t pending_len;
     CK_GCM_PARAMS params;
 } srtp_aes_gcm_ctx_t;
 
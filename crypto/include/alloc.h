@@ -69,6 +69,15 @@ void *srtp_crypto_alloc(size_t size);
  */
 void srtp_crypto_free(void *ptr);
 
+/*
+ * srtp_crypto_set_alloc_hook
+ *
+ * Makes srtp_crypto_alloc call hook with the size of every request
+ * before serving it, or stops it calling a hook if hook is NULL.  It is
+ * meant for tests that count allocations, and is not thread safe.
+ */
+void srtp_crypto_set_alloc_hook(void (*hook)(size_t size));
+
 #ifdef __cplusplus
 }
 #endif
@@ -78,6 +78,38 @@ typedef srtp_err_status_t (*srtp_auth_update_func)(void *state,
 
 typedef srtp_err_status_t (*srtp_auth_start_func)(void *state);
 
+/*
+ * a srtp_auth_job_t is one buffer of a batch: its tag is computed over len
+ * octets at buffer followed, if trailer is not NULL, by trailer_len octets
+ * at trailer (e.g. the ROC of an SRTP packet), and written to tag
+ */
+typedef struct srtp_auth_job_t {
+    const uint8_t *buffer;
+    size_t len;
+    const uint8_t *trailer;
+    size_t trailer_len;
+    uint8_t *tag;
+    srtp_err_status_t status;
+} srtp_auth_job_t;
+
+/*
+ * a srtp_auth_batch_func computes tag_len octet tags for num_jobs buffers
+ * under the same key.  It sets the status of every job and returns the
+ * status of the first one that failed, or srtp_err_status_ok.
+ */
+typedef srtp_err_status_t (*srtp_auth_batch_func)(void *state,
+                                                  size_t tag_len,
+                                                  srtp_auth_job_t *jobs,
+                                                  size_t num_jobs);
+
+/*
+ * a srtp_auth_copy_func gives the auth function at dst_state, allocated by
+ * the same type with the same key length, the key and state of the one at
+ * src_state, so that the two can be used independently
+ */
+typedef srtp_err_status_t (*srtp_auth_copy_func)(void *dst_state,
+                                                 const void *src_state);
+
 /* some syntactic sugar on these function types */
 #define srtp_auth_type_alloc(at, a, klen, outlen)                              \
     ((at)->alloc((a), (klen), (outlen)))
@@ -102,6 +134,25 @@ size_t srtp_auth_get_tag_length(const struct srtp_auth_t *a);
 
 size_t srtp_auth_get_prefix_length(const struct srtp_auth_t *a);
 
+/*
+ * srtp_auth_batch(a, jobs, num_jobs) computes the tags of the buffers
+ * described by jobs, through the batch entry point of the auth type if it
+ * has one and one buffer at a time otherwise; the burst functions of srtp
+ * use it for the packets of a stream
+ */
+srtp_err_status_t srtp_auth_batch(struct srtp_auth_t *a,
+                                  srtp_auth_job_t *jobs,
+                                  size_t num_jobs);
+
+/*
+ * srtp_auth_copy(dst, src) gives dst, allocated by a type with the same
+ * copy entry point as src and with the same key and tag lengths, the key
+ * and state of src; it returns srtp_err_status_bad_param if src cannot be
+ * copied
+ */
+srtp_err_status_t srtp_auth_copy(struct srtp_auth_t *dst,
+                                 const struct srtp_auth_t *src);
+
 /*
  * srtp_auth_test_case_t is a (list of) key/message/tag values that are
  * known to be correct for a particular cipher.  this data can be used
@@ -120,7 +171,7 @@ typedef struct srtp_auth_test_case_t {
         *next_test_case; /* pointer to next testcase */
 } srtp_auth_test_case_t;
 
-/* srtp_auth_type_t */
+/* srtp_auth_type_t; batch and copy are optional */
 typedef struct srtp_auth_type_t {
     srtp_auth_alloc_func alloc;
     srtp_auth_dealloc_func dealloc;
@@ -131,6 +182,8 @@ typedef struct srtp_auth_type_t {
     const char *description;
     const srtp_auth_test_case_t *test_data;
     srtp_auth_type_id_t id;
+    srtp_auth_batch_func batch;
+    srtp_auth_copy_func copy;
 } srtp_auth_type_t;
 
 typedef struct srtp_auth_t {
@@ -161,7 +214,8 @@ srtp_err_status_t srtp_auth_type_test(const srtp_auth_type_t *at,
  *
  * replaces srtp's kernel's auth type implementation for the auth_type id
  * with a new one passed in externally.  The new auth type must pass all the
- * existing auth_type's self tests as well as its own.
+ * existing auth_type's self tests as well as its own, which also check its
+ * batch entry point if it has one.
  */
 srtp_err_status_t srtp_replace_auth_type(const srtp_auth_type_t *ct,
                                          srtp_auth_type_id_t id);
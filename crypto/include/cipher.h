@@ -118,6 +118,57 @@ typedef srtp_err_status_t (*srtp_cipher_set_iv_func_t)(
     uint8_t *iv,
     srtp_cipher_direction_t direction);
 
+/*
+ * a srtp_cipher_job_t is one buffer of a batch: the cipher is set to iv
+ * (and, for AEAD ciphers, given aad if it is not NULL), then src_len
+ * octets at src are encrypted or decrypted into dst.  dst_len is the room
+ * in dst on input and the number of octets written on output, and status
+ * is the result for this buffer
+ */
+typedef struct srtp_cipher_job_t {
+    uint8_t *iv;
+    const uint8_t *aad;
+    size_t aad_len;
+    const uint8_t *src;
+    size_t src_len;
+    uint8_t *dst;
+    size_t dst_len;
+    srtp_err_status_t status;
+} srtp_cipher_job_t;
+
+/*
+ * a srtp_cipher_batch_func_t encrypts or decrypts num_jobs buffers under
+ * the same key, e.g. with a multi-buffer kernel.  It sets the status of
+ * every job and returns the status of the first one that failed, or
+ * srtp_err_status_ok.
+ */
+typedef srtp_err_status_t (*srtp_cipher_batch_func_t)(
+    void *state,
+    srtp_cipher_direction_t direction,
+    srtp_cipher_job_t *jobs,
+    size_t num_jobs);
+
+/*
+ * a srtp_cipher_copy_func_t gives the cipher at dst_state, allocated by
+ * the same type with the same key length, the key and state of the one at
+ * src_state, so that the two can be used independently
+ */
+typedef srtp_err_status_t (*srtp_cipher_copy_func_t)(void *dst_state,
+                                                     const void *src_state);
+
+/*
+ * a srtp_cipher_update_func_t encrypts or decrypts the src_len octets at
+ * src into dst as the next part of the message of an AEAD cipher, after
+ * its aad and before the part given to encrypt or decrypt, which finishes
+ * the message and produces or checks the tag.  src and dst have to stay
+ * valid until then, since a cipher that can only take the message in one
+ * piece writes dst when the message is finished
+ */
+typedef srtp_err_status_t (*srtp_cipher_update_func_t)(void *state,
+                                                       const uint8_t *src,
+                                                       size_t src_len,
+                                                       uint8_t *dst);
+
 /*
  * srtp_cipher_test_case_t is a (list of) key, salt, plaintext, ciphertext,
  * and aad values that are known to be correct for a
@@ -140,7 +191,11 @@ typedef struct srtp_cipher_test_case_t {
         *next_test_case; /* pointer to next testcase */
 } srtp_cipher_test_case_t;
 
-/* srtp_cipher_type_t defines the 'metadata' for a particular cipher type */
+/*
+ * srtp_cipher_type_t defines the 'metadata' for a particular cipher type;
+ * batch, copy and update are optional, without batch a batch is processed
+ * one buffer at a time
+ */
 typedef struct srtp_cipher_type_t {
     srtp_cipher_alloc_func_t alloc;
     srtp_cipher_dealloc_func_t dealloc;
@@ -152,6 +207,9 @@ typedef struct srtp_cipher_type_t {
     const char *description;
     const srtp_cipher_test_case_t *test_data;
     srtp_cipher_type_id_t id;
+    srtp_cipher_batch_func_t batch;
+    srtp_cipher_copy_func_t copy;
+    srtp_cipher_update_func_t update;
 } srtp_cipher_type_t;
 
 /*
@@ -225,12 +283,44 @@ srtp_err_status_t srtp_cipher_set_aad(srtp_cipher_t *c,
                                       const uint8_t *aad,
                                       size_t aad_len);
 
+/*
+ * srtp_cipher_update(c, src, src_len, dst) passes a part of the message
+ * of an AEAD cipher that is not contiguous with the rest, e.g. the CSRC
+ * list of a cryptex packet; it returns srtp_err_status_no_such_op if the
+ * cipher type cannot take the message in parts
+ */
+srtp_err_status_t srtp_cipher_update(srtp_cipher_t *c,
+                                     const uint8_t *src,
+                                     size_t src_len,
+                                     uint8_t *dst);
+
+/*
+ * srtp_cipher_batch(c, direction, jobs, num_jobs) encrypts or decrypts
+ * the buffers described by jobs, through the batch entry point of the
+ * cipher type if it has one and one buffer at a time otherwise; the burst
+ * functions of srtp use it for the packets of a stream
+ */
+srtp_err_status_t srtp_cipher_batch(srtp_cipher_t *c,
+                                    srtp_cipher_direction_t direction,
+                                    srtp_cipher_job_t *jobs,
+                                    size_t num_jobs);
+
+/*
+ * srtp_cipher_copy(dst, src) gives dst, allocated by a type with the same
+ * copy entry point as src and with the same key length, the key and state
+ * of src; it returns srtp_err_status_bad_param if src cannot be copied
+ */
+srtp_err_status_t srtp_cipher_copy(srtp_cipher_t *dst,
+                                   const srtp_cipher_t *src);
+
 /*
  * srtp_replace_cipher_type(ct, id)
  *
  * replaces srtp's existing cipher implementation for the cipher_type id
  * with a new one passed in externally.  The new cipher must pass all the
- * existing cipher_type's self tests as well as its own.
+ * existing cipher_type's self tests as well as its own.  A cipher type
+ * with a batch entry point, e.g. a multi-buffer engine, has it checked
+ * by the same tests.
  */
 srtp_err_status_t srtp_replace_cipher_type(const srtp_cipher_type_t *ct,
                                            srtp_cipher_type_id_t id);
@@ -66,12 +66,28 @@ typedef enum {
     srtp_crypto_kernel_state_secure
 } srtp_crypto_kernel_state_t;
 
+/*
+ * srtp_kernel_self_test_state_t records whether a loaded type has run
+ * its self-test yet:
+ *
+ *    untested - loaded with deferred self-tests, not yet allocated
+ *    passed   - self-test ran and passed
+ *    failed   - self-test ran and failed, see self_test_status
+ */
+typedef enum {
+    srtp_kernel_self_test_untested,
+    srtp_kernel_self_test_passed,
+    srtp_kernel_self_test_failed
+} srtp_kernel_self_test_state_t;
+
 /*
  * linked list of cipher types
  */
 typedef struct srtp_kernel_cipher_type {
     srtp_cipher_type_id_t id;
     const srtp_cipher_type_t *cipher_type;
+    int self_test;                      /* srtp_kernel_self_test_state_t */
+    srtp_err_status_t self_test_status; /* result if self_test == failed */
     struct srtp_kernel_cipher_type *next;
 } srtp_kernel_cipher_type_t;
 
@@ -81,6 +97,8 @@ typedef struct srtp_kernel_cipher_type {
 typedef struct srtp_kernel_auth_type {
     srtp_auth_type_id_t id;
     const srtp_auth_type_t *auth_type;
+    int self_test;                      /* srtp_kernel_self_test_state_t */
+    srtp_err_status_t self_test_status; /* result if self_test == failed */
     struct srtp_kernel_auth_type *next;
 } srtp_kernel_auth_type_t;
 
@@ -104,6 +122,7 @@ typedef struct {
     srtp_kernel_auth_type_t *auth_type_list; /* list of all auth func types */
     srtp_kernel_debug_module_t
         *debug_module_list; /* list of all debug modules   */
+    bool defer_self_tests;  /* test types on first alloc   */
 } srtp_crypto_kernel_t;
 
 /*
@@ -146,6 +165,29 @@ srtp_err_status_t srtp_crypto_kernel_shutdown(void);
  */
 srtp_err_status_t srtp_crypto_kernel_status(void);
 
+/*
+ * srtp_crypto_kernel_set_deferred_self_tests(defer)
+ *
+ * when defer is true, cipher and auth types loaded afterwards are not
+ * self-tested at load time; instead each type runs its self-test once,
+ * the first time a cipher or auth function of that type is allocated,
+ * and the result is cached for later allocations.  This must be set
+ * before srtp_crypto_kernel_init() to affect the built-in types.
+ */
+void srtp_crypto_kernel_set_deferred_self_tests(bool defer);
+
+/*
+ * srtp_crypto_kernel_self_test() runs the self-test of every loaded
+ * cipher and auth type that has not been tested yet and records the
+ * results.  Unlike srtp_crypto_kernel_status() it does not print a
+ * report or exit on failure.  Possible return values are:
+ *
+ *    srtp_err_status_ok          all types passed
+ *    srtp_err_status_init_fail   the kernel is not initialized
+ *    <other>                     the status of the first failing type
+ */
+srtp_err_status_t srtp_crypto_kernel_self_test(void);
+
 /*
  * srtp_crypto_kernel_list_debug_modules() outputs a list of debugging modules
  *
@@ -175,6 +217,7 @@ srtp_err_status_t srtp_crypto_kernel_load_debug_module(
  *    srtp_err_status_ok           no problems
  *    srtp_err_status_alloc_fail   an allocation failure occured
  *    srtp_err_status_fail         couldn't find cipher with identifier 'id'
+ *    <other>                      the cipher type failed its self-test
  */
 srtp_err_status_t srtp_crypto_kernel_alloc_cipher(srtp_cipher_type_id_t id,
                                                   srtp_cipher_pointer_t *cp,
@@ -191,6 +234,7 @@ srtp_err_status_t srtp_crypto_kernel_alloc_cipher(srtp_cipher_type_id_t id,
  *    srtp_err_status_ok           no problems
  *    srtp_err_status_alloc_fail   an allocation failure occured
  *    srtp_err_status_fail         couldn't find auth with identifier 'id'
+ *    <other>                      the auth type failed its self-test
  */
 srtp_err_status_t srtp_crypto_kernel_alloc_auth(srtp_auth_type_id_t id,
                                                 srtp_auth_pointer_t *ap,
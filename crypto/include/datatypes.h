@@ -257,6 +257,8 @@ void bitvector_set_to_zero(bitvector_t *x);
 
 void bitvector_left_shift(bitvector_t *x, size_t index);
 
+void bitvector_clear_range(bitvector_t *x, size_t first, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -123,22 +123,58 @@ typedef struct {
     const char *name; /* printable name for debug module      */
 } srtp_debug_module_t;
 
+/*
+ * srtp_err_report_module is srtp_err_report for a report made on behalf
+ * of a debug module, which deferred reporting rate limits separately.
+ */
+
+void srtp_err_report_module(srtp_err_reporting_level_t level,
+                            const srtp_debug_module_t *mod,
+                            const char *format,
+                            ...) LIBSRTP_FORMAT_PRINTF(3, 4);
+
+/*
+ * srtp_err_reporting_defer sets up deferred reporting with a ring of
+ * num_records records and at most max_per_second reports per module per
+ * second (0 for no limit), or goes back to reporting as errors happen if
+ * num_records is 0.  Reports are then formatted and passed on by
+ * srtp_err_reporting_flush.  Must not be called while other threads may
+ * report errors.
+ */
+
+srtp_err_status_t srtp_err_reporting_defer(size_t num_records,
+                                           uint32_t max_per_second);
+
+srtp_err_status_t srtp_err_reporting_flush(size_t *num_records);
+
+/*
+ * srtp_err_reporting_drops returns the number of reports of the named
+ * module, or of reports outside any module if mod_name is NULL, that
+ * deferred reporting dropped.
+ */
+
+srtp_err_status_t srtp_err_reporting_drops(const char *mod_name,
+                                           uint64_t *rate_limited,
+                                           uint64_t *queue_full);
+
 #ifdef ENABLE_DEBUG_LOGGING
 
 #ifndef debug_print0
 #define debug_print0(mod, format)                                              \
-    srtp_err_report(srtp_err_level_debug, ("%s: " format "\n"), mod.name)
+    srtp_err_report_module(srtp_err_level_debug, &(mod),                       \
+                           ("%s: " format "\n"), mod.name)
 #endif
 
 #ifndef debug_print
 #define debug_print(mod, format, arg)                                          \
-    srtp_err_report(srtp_err_level_debug, ("%s: " format "\n"), mod.name, arg)
+    srtp_err_report_module(srtp_err_level_debug, &(mod),                       \
+                           ("%s: " format "\n"), mod.name, arg)
 #endif
 
 #ifndef debug_print2
 #define debug_print2(mod, format, arg1, arg2)                                  \
-    srtp_err_report(srtp_err_level_debug, ("%s: " format "\n"), mod.name,      \
-                    arg1, arg2)
+    srtp_err_report_module(srtp_err_level_debug, &(mod),                       \
+                           ("%s: " format "\n"), mod.name, arg1, arg2)
 #endif
 
 #else
@@ -146,20 +182,22 @@ typedef struct {
 #ifndef debug_print0
 #define debug_print0(mod, format)                                              \
     if (mod.on)                                                                \
-    srtp_err_report(srtp_err_level_debug, ("%s: " format "\n"), mod.name)
+    srtp_err_report_module(srtp_err_level_debug, &(mod),                       \
+                           ("%s: " format "\n"), mod.name)
 #endif
 
 #ifndef debug_print
 #define debug_print(mod, format, arg)                                          \
     if (mod.on)                                                                \
-    srtp_err_report(srtp_err_level_debug, ("%s: " format "\n"), mod.name, arg)
+    srtp_err_report_module(srtp_err_level_debug, &(mod),                       \
+                           ("%s: " format "\n"), mod.name, arg)
 #endif
 
 #ifndef debug_print2
 #define debug_print2(mod, format, arg1, arg2)                                  \
     if (mod.on)                                                                \
-    srtp_err_report(srtp_err_level_debug, ("%s: " format "\n"), mod.name,      \
-                    arg1, arg2)
+    srtp_err_report_module(srtp_err_level_debug, &(mod),                       \
+                           ("%s: " format "\n"), mod.name, arg1, arg2)
 #endif
 
 #endif
@@ -50,9 +50,9 @@
 #include "sha1.h"
 
 typedef struct {
-    uint8_t opad[64];
     srtp_sha1_ctx_t ctx;
-    srtp_sha1_ctx_t init_ctx;
+    srtp_sha1_ctx_t init_ctx;  /* state after hashing ipad ^ key */
+    srtp_sha1_ctx_t outer_ctx; /* state after hashing opad ^ key */
 } srtp_hmac_ctx_t;
 
 #endif /* HMAC_H */
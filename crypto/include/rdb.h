@@ -46,7 +46,7 @@
 #ifndef REPLAY_DB_H
 #define REPLAY_DB_H
 
-#include "datatypes.h" /* for v128_t       */
+#include "datatypes.h" /* for bitvector_t  */
 #include "err.h"       /* for srtp_err_status_t */
 
 #ifdef __cplusplus
@@ -54,23 +54,57 @@ extern "C" {
 #endif
 
 /*
- * if the ith least significant bit is one, then the packet index
- * window_end-i is in the database
+ * the window covers the packet indices window_start to
+ * window_start + window_size - 1; packet index i is in the database if
+ * bit (i mod length) of the bitmask ring is one
  */
 
 typedef struct {
-    uint32_t window_start; /* packet index of the first bit in bitmask */
-    v128_t bitmask;
+    uint32_t window_start; /* packet index of the first packet in window */
+    size_t window_size;    /* number of packets covered by the window    */
+    bitvector_t bitmask;   /* ring of at least window_size bits          */
 } srtp_rdb_t;
 
 /*
  * srtp_rdb_init
  *
- * initalizes rdb
+ * initalizes rdb with a window of ws packets
  *
- * returns srtp_err_status_ok on success, srtp_err_status_t_fail otherwise
+ * returns srtp_err_status_ok on success, srtp_err_status_bad_param if ws
+ * is zero and srtp_err_status_alloc_fail if the bitmask can not be
+ * allocated
  */
-srtp_err_status_t srtp_rdb_init(srtp_rdb_t *rdb);
+srtp_err_status_t srtp_rdb_init(srtp_rdb_t *rdb, size_t ws);
+
+/*
+ * srtp_rdb_dealloc
+ *
+ * frees memory associated with the rdb
+ */
+srtp_err_status_t srtp_rdb_dealloc(srtp_rdb_t *rdb);
+
+/*
+ * srtp_rdb_reset
+ *
+ * empties rdb, keeping its window size and memory
+ */
+void srtp_rdb_reset(srtp_rdb_t *rdb);
+
+/*
+ * srtp_rdb_get_window_size
+ *
+ * returns the window size which was used to initialize the rdb
+ */
+size_t srtp_rdb_get_window_size(const srtp_rdb_t *rdb);
+
+/*
+ * srtp_rdb_copy(dst, src)
+ *
+ * sets the initialized rdb dst to the state it would have had if it had
+ * been given the indices recorded in src.  dst and src need not have the
+ * same window size.
+ */
+void srtp_rdb_copy(srtp_rdb_t *dst, const srtp_rdb_t *src);
 
 /*
  * srtp_rdb_check
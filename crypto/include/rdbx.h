@@ -77,13 +77,27 @@ typedef uint16_t srtp_rollover_counter_t; /* 16 bit rollover counter */
  */
 typedef uint64_t srtp_xtd_seq_num_t;
 
+/*
+ * SRTP_RDBX_INLINE_BITS is the longest ring that an srtp_rdbx_t keeps in
+ * itself rather than in a separate allocation; it covers the default
+ * window of 128 packets
+ */
+#define SRTP_RDBX_INLINE_BITS 128
+
 /*
  * An srtp_rdbx_t is a replay database with extended range; it uses an
- * xtd_seq_num_t and a bitmask of recently received indices.
+ * xtd_seq_num_t and a bitmask of recently received indices.  The bitmask
+ * is a ring of (at least) window_size bits indexed by the low bits of
+ * the packet index.  A ring of up to SRTP_RDBX_INLINE_BITS bits is kept
+ * in inline_word, with bitmask.word set to NULL, so that an srtp_rdbx_t
+ * never points into itself; srtp_rdbx_get_bitmask() returns the ring
+ * wherever it is kept.
  */
 typedef struct {
     srtp_xtd_seq_num_t index;
+    size_t window_size;
     bitvector_t bitmask;
+    uint32_t inline_word[SRTP_RDBX_INLINE_BITS / bits_per_word];
 } srtp_rdbx_t;
 
 /*
@@ -101,6 +115,31 @@ srtp_err_status_t srtp_rdbx_init(srtp_rdbx_t *rdbx, size_t ws);
  */
 srtp_err_status_t srtp_rdbx_dealloc(srtp_rdbx_t *rdbx);
 
+/*
+ * srtp_rdbx_get_bitmask(rdbx_ptr)
+ *
+ * returns the ring of the rdbx; its words may be stored in the rdbx
+ * itself, so it is only valid while the rdbx is neither moved nor
+ * deallocated
+ */
+bitvector_t srtp_rdbx_get_bitmask(srtp_rdbx_t *rdbx);
+
+/*
+ * srtp_rdbx_get_ring(rdbx_ptr)
+ *
+ * returns the words of the ring of the rdbx for reading, with the same
+ * lifetime as those of srtp_rdbx_get_bitmask()
+ */
+const uint32_t *srtp_rdbx_get_ring(const srtp_rdbx_t *rdbx);
+
+/*
+ * srtp_rdbx_reset(rdbx_ptr)
+ *
+ * sets the rollover counter and sequence number of the rdbx back to zero
+ * and empties its window, keeping its window size and memory
+ */
+void srtp_rdbx_reset(srtp_rdbx_t *rdbx);
+
 /*
  * srtp_rdbx_estimate_index(rdbx, guess, s)
  *
@@ -202,6 +241,69 @@ srtp_err_status_t srtp_rdbx_set_roc_seq(srtp_rdbx_t *rdbx,
                                         uint32_t roc,
                                         uint16_t seq);
 
+/*
+ * srtp_rdbx_atomic_t is a replay database with extended range that may
+ * be checked and updated from several threads at once without a lock.
+ * Unlike srtp_rdbx_t it is reference counted, so that it can be shared,
+ * and it works on packet indices rather than on deltas, since the
+ * highest index can move between the estimate and the update.  It needs
+ * the GCC/clang atomic builtins; srtp_rdbx_atomic_alloc() fails without
+ * them.
+ */
+typedef struct srtp_rdbx_atomic_t srtp_rdbx_atomic_t;
+
+/*
+ * srtp_rdbx_atomic_alloc(rdbx_ptr, ws, index)
+ *
+ * allocates an atomic rdbx with window size ws and highest packet index
+ * index, holding one reference
+ */
+srtp_err_status_t srtp_rdbx_atomic_alloc(srtp_rdbx_atomic_t **rdbx_ptr,
+                                         size_t ws,
+                                         srtp_xtd_seq_num_t index);
+
+/*
+ * srtp_rdbx_atomic_retain(rdbx) takes an additional reference and
+ * srtp_rdbx_atomic_release(rdbx) drops one, freeing the rdbx when the
+ * last reference is dropped
+ */
+void srtp_rdbx_atomic_retain(srtp_rdbx_atomic_t *rdbx);
+
+void srtp_rdbx_atomic_release(srtp_rdbx_atomic_t *rdbx);
+
+size_t srtp_rdbx_atomic_get_window_size(const srtp_rdbx_atomic_t *rdbx);
+
+srtp_xtd_seq_num_t srtp_rdbx_atomic_get_packet_index(srtp_rdbx_atomic_t *rdbx);
+
+/*
+ * srtp_rdbx_atomic_estimate_index(rdbx, guess, s)
+ *
+ * as srtp_rdbx_estimate_index(), using the highest index seen so far
+ */
+ssize_t srtp_rdbx_atomic_estimate_index(srtp_rdbx_atomic_t *rdbx,
+                                        srtp_xtd_seq_num_t *guess,
+                                        srtp_sequence_number_t s);
+
+/*
+ * srtp_rdbx_atomic_check(rdbx, index)
+ *
+ * returns srtp_err_status_replay_fail if index has been added,
+ * srtp_err_status_replay_old if it is outside of the window and
+ * srtp_err_status_ok otherwise
+ */
+srtp_err_status_t srtp_rdbx_atomic_check(srtp_rdbx_atomic_t *rdbx,
+                                         srtp_xtd_seq_num_t index);
+
+/*
+ * srtp_rdbx_atomic_add_index(rdbx, index)
+ *
+ * atomically checks for and adds index, returning the same values as
+ * srtp_rdbx_atomic_check().  When several threads add the same index
+ * exactly one of them gets srtp_err_status_ok.
+ */
+srtp_err_status_t srtp_rdbx_atomic_add_index(srtp_rdbx_atomic_t *rdbx,
+                                             srtp_xtd_seq_num_t index);
+
 #ifdef __cplusplus
 }
 #endif
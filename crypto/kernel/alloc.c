@@ -67,6 +67,14 @@ srtp_debug_module_t srtp_mod_alloc = {
  * address.
  */
 
+/* called by srtp_crypto_alloc() if set, see srtp_crypto_set_alloc_hook() */
+static void (*srtp_alloc_hook)(size_t size) = NULL;
+
+void srtp_crypto_set_alloc_hook(void (*hook)(size_t size))
+{
+    srtp_alloc_hook = hook;
+}
+
 void *srtp_crypto_alloc(size_t size)
 {
     void *ptr;
@@ -75,6 +83,10 @@ void *srtp_crypto_alloc(size_t size)
         return NULL;
     }
 
+    if (srtp_alloc_hook != NULL) {
+        srtp_alloc_hook(size);
+    }
+
     ptr = calloc(1, size);
 
     if (ptr) {
@@ -65,9 +65,25 @@ static srtp_crypto_kernel_t crypto_kernel = {
     srtp_crypto_kernel_state_insecure, /* start off in insecure state */
     NULL,                              /* no cipher types yet         */
     NULL,                              /* no auth types yet           */
-    NULL                               /* no debug modules yet        */
+    NULL,                              /* no debug modules yet        */
+    false                              /* self-test types on load     */
 };
 
+/*
+ * the self-test state of a kernel type may be read and written by
+ * several threads allocating streams at once; a race only means that a
+ * self-test is run more than once, which is harmless, but the state
+ * must not be observed before the status it refers to
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define self_test_state_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define self_test_state_store(p, v)                                            \
+    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define self_test_state_load(p) (*(p))
+#define self_test_state_store(p, v) (*(p) = (v))
+#endif
+
 #define MAX_RNG_TRIALS 25
 
 srtp_err_status_t srtp_crypto_kernel_init(void)
@@ -78,8 +94,12 @@ srtp_err_status_t srtp_crypto_kernel_init(void)
     if (crypto_kernel.state == srtp_crypto_kernel_state_secure) {
         /*
          * we're already in the secure state, but we've been asked to
-         * re-initialize, so we just re-run the self-tests and then return
+         * re-initialize, so we just re-run the self-tests and then return;
+         * with deferred self-tests the types are checked when first used
          */
+        if (crypto_kernel.defer_self_tests) {
+            return srtp_err_status_ok;
+        }
         return srtp_crypto_kernel_status();
     }
 
@@ -210,6 +230,96 @@ srtp_err_status_t srtp_crypto_kernel_status(void)
     return srtp_err_status_ok;
 }
 
+void srtp_crypto_kernel_set_deferred_self_tests(bool defer)
+{
+    crypto_kernel.defer_self_tests = defer;
+}
+
+static srtp_err_status_t srtp_kernel_cipher_type_check(
+    srtp_kernel_cipher_type_t *ctype)
+{
+    srtp_err_status_t status;
+
+    switch (self_test_state_load(&ctype->self_test)) {
+    case srtp_kernel_self_test_passed:
+        return srtp_err_status_ok;
+    case srtp_kernel_self_test_failed:
+        return ctype->self_test_status;
+    default:
+        break;
+    }
+
+    debug_print(srtp_mod_crypto_kernel, "running deferred self-test for %s",
+                ctype->cipher_type->description);
+    status = srtp_cipher_type_self_test(ctype->cipher_type);
+    if (status) {
+        ctype->self_test_status = status;
+        self_test_state_store(&ctype->self_test, srtp_kernel_self_test_failed);
+        return status;
+    }
+    self_test_state_store(&ctype->self_test, srtp_kernel_self_test_passed);
+
+    return srtp_err_status_ok;
+}
+
+static srtp_err_status_t srtp_kernel_auth_type_check(
+    srtp_kernel_auth_type_t *atype)
+{
+    srtp_err_status_t status;
+
+    switch (self_test_state_load(&atype->self_test)) {
+    case srtp_kernel_self_test_passed:
+        return srtp_err_status_ok;
+    case srtp_kernel_self_test_failed:
+        return atype->self_test_status;
+    default:
+        break;
+    }
+
+    debug_print(srtp_mod_crypto_kernel, "running deferred self-test for %s",
+                atype->auth_type->description);
+    status = srtp_auth_type_self_test(atype->auth_type);
+    if (status) {
+        atype->self_test_status = status;
+        self_test_state_store(&atype->self_test, srtp_kernel_self_test_failed);
+        return status;
+    }
+    self_test_state_store(&atype->self_test, srtp_kernel_self_test_passed);
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_crypto_kernel_self_test(void)
+{
+    srtp_err_status_t status = srtp_err_status_ok;
+    srtp_err_status_t type_status;
+    srtp_kernel_cipher_type_t *ctype = crypto_kernel.cipher_type_list;
+    srtp_kernel_auth_type_t *atype = crypto_kernel.auth_type_list;
+
+    if (crypto_kernel.state != srtp_crypto_kernel_state_secure) {
+        return srtp_err_status_init_fail;
+    }
+
+    /* test every type so that each records its result, report the first */
+    while (ctype != NULL) {
+        type_status = srtp_kernel_cipher_type_check(ctype);
+        if (type_status && !status) {
+            status = type_status;
+        }
+        ctype = ctype->next;
+    }
+
+    while (atype != NULL) {
+        type_status = srtp_kernel_auth_type_check(atype);
+        if (type_status && !status) {
+            status = type_status;
+        }
+        atype = atype->next;
+    }
+
+    return status;
+}
+
 srtp_err_status_t srtp_crypto_kernel_list_debug_modules(void)
 {
     srtp_kernel_debug_module_t *dm = crypto_kernel.debug_module_list;
@@ -287,10 +397,12 @@ static inline srtp_err_status_t srtp_crypto_kernel_do_load_cipher_type(
         return srtp_err_status_bad_param;
     }
 
-    /* check cipher type by running self-test */
-    status = srtp_cipher_type_self_test(new_ct);
-    if (status) {
-        return status;
+    /* check cipher type by running self-test, unless that is deferred */
+    if (!crypto_kernel.defer_self_tests) {
+        status = srtp_cipher_type_self_test(new_ct);
+        if (status) {
+            return status;
+        }
     }
 
     /* walk down list, checking if this type is in the list already  */
@@ -330,6 +442,11 @@ static inline srtp_err_status_t srtp_crypto_kernel_do_load_cipher_type(
     /* set fields */
     new_ctype->cipher_type = new_ct;
     new_ctype->id = id;
+    new_ctype->self_test_status = srtp_err_status_ok;
+    self_test_state_store(&new_ctype->self_test,
+                          crypto_kernel.defer_self_tests
+                              ? srtp_kernel_self_test_untested
+                              : srtp_kernel_self_test_passed);
 
     return srtp_err_status_ok;
 }
@@ -365,10 +482,12 @@ srtp_err_status_t srtp_crypto_kernel_do_load_auth_type(
         return srtp_err_status_bad_param;
     }
 
-    /* check auth type by running self-test */
-    status = srtp_auth_type_self_test(new_at);
-    if (status) {
-        return status;
+    /* check auth type by running self-test, unless that is deferred */
+    if (!crypto_kernel.defer_self_tests) {
+        status = srtp_auth_type_self_test(new_at);
+        if (status) {
+            return status;
+        }
     }
 
     /* walk down list, checking if this type is in the list already  */
@@ -407,6 +526,11 @@ srtp_err_status_t srtp_crypto_kernel_do_load_auth_type(
     /* set fields */
     new_atype->auth_type = new_at;
     new_atype->id = id;
+    new_atype->self_test_status = srtp_err_status_ok;
+    self_test_state_store(&new_atype->self_test,
+                          crypto_kernel.defer_self_tests
+                              ? srtp_kernel_self_test_untested
+                              : srtp_kernel_self_test_passed);
 
     return srtp_err_status_ok;
 }
@@ -424,7 +548,7 @@ srtp_err_status_t srtp_replace_auth_type(const srtp_auth_type_t *new_at,
     return srtp_crypto_kernel_do_load_auth_type(new_at, id, true);
 }
 
-const srtp_cipher_type_t *srtp_crypto_kernel_get_cipher_type(
+static srtp_kernel_cipher_type_t *srtp_crypto_kernel_find_cipher_type(
     srtp_cipher_type_id_t id)
 {
     srtp_kernel_cipher_type_t *ctype;
@@ -433,7 +557,7 @@ const srtp_cipher_type_t *srtp_crypto_kernel_get_cipher_type(
     ctype = crypto_kernel.cipher_type_list;
     while (ctype != NULL) {
         if (id == ctype->id) {
-            return ctype->cipher_type;
+            return ctype;
         }
         ctype = ctype->next;
     }
@@ -442,12 +566,21 @@ const srtp_cipher_type_t *srtp_crypto_kernel_get_cipher_type(
     return NULL;
 }
 
+const srtp_cipher_type_t *srtp_crypto_kernel_get_cipher_type(
+    srtp_cipher_type_id_t id)
+{
+    srtp_kernel_cipher_type_t *ctype = srtp_crypto_kernel_find_cipher_type(id);
+
+    return ctype ? ctype->cipher_type : NULL;
+}
+
 srtp_err_status_t srtp_crypto_kernel_alloc_cipher(srtp_cipher_type_id_t id,
                                                   srtp_cipher_pointer_t *cp,
                                                   size_t key_len,
                                                   size_t tag_len)
 {
-    const srtp_cipher_type_t *ct;
+    srtp_kernel_cipher_type_t *ctype;
+    srtp_err_status_t status;
 
     /*
      * if the crypto_kernel is not yet initialized, we refuse to allocate
@@ -457,15 +590,22 @@ srtp_err_status_t srtp_crypto_kernel_alloc_cipher(srtp_cipher_type_id_t id,
         return srtp_err_status_init_fail;
     }
 
-    ct = srtp_crypto_kernel_get_cipher_type(id);
-    if (!ct) {
+    ctype = srtp_crypto_kernel_find_cipher_type(id);
+    if (!ctype) {
         return srtp_err_status_fail;
     }
 
-    return ((ct)->alloc(cp, key_len, tag_len));
+    /* a type whose self-test was deferred is tested on first use */
+    status = srtp_kernel_cipher_type_check(ctype);
+    if (status) {
+        return status;
+    }
+
+    return ((ctype->cipher_type)->alloc(cp, key_len, tag_len));
 }
 
-const srtp_auth_type_t *srtp_crypto_kernel_get_auth_type(srtp_auth_type_id_t id)
+static srtp_kernel_auth_type_t *srtp_crypto_kernel_find_auth_type(
+    srtp_auth_type_id_t id)
 {
     srtp_kernel_auth_type_t *atype;
 
@@ -473,7 +613,7 @@ const srtp_auth_type_t *srtp_crypto_kernel_get_auth_type(srtp_auth_type_id_t id)
     atype = crypto_kernel.auth_type_list;
     while (atype != NULL) {
         if (id == atype->id) {
-            return atype->auth_type;
+            return atype;
         }
         atype = atype->next;
     }
@@ -482,12 +622,20 @@ const srtp_auth_type_t *srtp_crypto_kernel_get_auth_type(srtp_auth_type_id_t id)
     return NULL;
 }
 
+const srtp_auth_type_t *srtp_crypto_kernel_get_auth_type(srtp_auth_type_id_t id)
+{
+    srtp_kernel_auth_type_t *atype = srtp_crypto_kernel_find_auth_type(id);
+
+    return atype ? atype->auth_type : NULL;
+}
+
 srtp_err_status_t srtp_crypto_kernel_alloc_auth(srtp_auth_type_id_t id,
                                                 srtp_auth_pointer_t *ap,
                                                 size_t key_len,
                                                 size_t tag_len)
 {
-    const srtp_auth_type_t *at;
+    srtp_kernel_auth_type_t *atype;
+    srtp_err_status_t status;
 
     /*
      * if the crypto_kernel is not yet initialized, we refuse to allocate
@@ -497,12 +645,18 @@ srtp_err_status_t srtp_crypto_kernel_alloc_auth(srtp_auth_type_id_t id,
         return srtp_err_status_init_fail;
     }
 
-    at = srtp_crypto_kernel_get_auth_type(id);
-    if (!at) {
+    atype = srtp_crypto_kernel_find_auth_type(id);
+    if (!atype) {
         return srtp_err_status_fail;
     }
 
-    return ((at)->alloc(ap, key_len, tag_len));
+    /* a type whose self-test was deferred is tested on first use */
+    status = srtp_kernel_auth_type_check(atype);
+    if (status) {
+        return status;
+    }
+
+    return ((atype->auth_type)->alloc(ap, key_len, tag_len));
 }
 
 srtp_err_status_t srtp_crypto_kernel_load_debug_module(
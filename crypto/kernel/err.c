@@ -48,7 +48,11 @@
 
 #include "err.h"
 #include "datatypes.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* srtp_err_file is the FILE to which errors are reported */
 
@@ -78,17 +82,582 @@ srtp_err_status_t srtp_install_err_report_handler(
     return srtp_err_status_ok;
 }
 
-void srtp_err_report(srtp_err_reporting_level_t level, const char *format, ...)
+/*
+ * deferred error reporting
+ *
+ * When srtp_err_reporting_defer() has set up a ring, a report is not
+ * formatted.  Its level, module, format string and arguments are copied
+ * into a fixed size record instead, and srtp_err_reporting_flush() does
+ * the formatting later.  The ring is a bounded multi-producer queue in
+ * which every record carries a sequence number: a producer claims a
+ * position by advancing the head, fills the record and then publishes it
+ * by setting its sequence number to position + 1; the consumer frees the
+ * record again by setting it to position + number of records.
+ *
+ * Arguments are taken by walking the format string.  Only the integer,
+ * character, pointer and string conversions are recorded this way; a
+ * report that uses anything else, or more than SRTP_ERR_MAX_ARGS
+ * arguments, is formatted when it is made and recorded as a string.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define SRTP_ERR_HAVE_ATOMIC_BUILTINS
+#endif
+
+#define SRTP_ERR_MAX_ARGS 6
+#define SRTP_ERR_STRINGS_LEN 128
+#define SRTP_ERR_LIMIT_SLOTS 64
+
+typedef struct {
+    uint64_t seq;
+    srtp_err_reporting_level_t level;
+    const srtp_debug_module_t *mod;
+    const char *format;
+    uint64_t args[SRTP_ERR_MAX_ARGS]; /* for %s an offset into strings */
+    char strings[SRTP_ERR_STRINGS_LEN];
+} srtp_err_record_t;
+
+typedef struct {
+    const srtp_debug_module_t *mod;
+    uint64_t second;
+    uint32_t count;
+    uint64_t rate_limited;
+    uint64_t queue_full;
+} srtp_err_limit_t;
+
+typedef enum {
+    srtp_err_len_none,
+    srtp_err_len_hh,
+    srtp_err_len_h,
+    srtp_err_len_l,
+    srtp_err_len_ll,
+    srtp_err_len_size,
+    srtp_err_len_intmax,
+    srtp_err_len_ptrdiff,
+} srtp_err_len_t;
+
+/* a conversion specification, from the % up to the conversion character */
+typedef struct {
+    const char *start;
+    size_t len;
+    srtp_err_len_t length;
+    char conv; /* 0 if not one that can be recorded */
+} srtp_err_spec_t;
+
+static srtp_err_record_t *srtp_err_ring = NULL;
+
+#ifdef SRTP_ERR_HAVE_ATOMIC_BUILTINS
+
+/* reports outside a debug module are counted against this one */
+static srtp_debug_module_t srtp_err_no_module = { false, "" };
+
+static size_t srtp_err_ring_mask = 0;
+static uint64_t srtp_err_ring_head = 0;
+static uint64_t srtp_err_ring_tail = 0;
+static uint32_t srtp_err_max_per_second = 0;
+static srtp_err_limit_t srtp_err_limits[SRTP_ERR_LIMIT_SLOTS];
+
+/*
+ * Parses the conversion specification that starts at p, which points just
+ * past a '%'.  Returns a pointer past the specification.
+ */
+static const char *srtp_err_parse_spec(const char *p, srtp_err_spec_t *spec)
+{
+    spec->start = p - 1;
+    spec->length = srtp_err_len_none;
+    spec->conv = 0;
+
+    while (*p && strchr("-+ #0", *p)) {
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    switch (*p) {
+    case 'h':
+        p++;
+        spec->length = srtp_err_len_h;
+        if (*p == 'h') {
+            p++;
+            spec->length = srtp_err_len_hh;
+        }
+        break;
+    case 'l':
+        p++;
+        spec->length = srtp_err_len_l;
+        if (*p == 'l') {
+            p++;
+            spec->length = srtp_err_len_ll;
+        }
+        break;
+    case 'z':
+        p++;
+        spec->length = srtp_err_len_size;
+        break;
+    case 'j':
+        p++;
+        spec->length = srtp_err_len_intmax;
+        break;
+    case 't':
+        p++;
+        spec->length = srtp_err_len_ptrdiff;
+        break;
+    default:
+        break;
+    }
+
+    if (*p && strchr("diuxXocps", *p)) {
+        spec->conv = *p;
+    }
+    if (*p) {
+        p++;
+    }
+    spec->len = (size_t)(p - spec->start);
+
+    return p;
+}
+
+static bool srtp_err_is_signed(char conv)
+{
+    return conv == 'd' || conv == 'i';
+}
+
+static uint64_t srtp_err_take_int(const srtp_err_spec_t *spec, va_list *args)
+{
+    bool is_signed = srtp_err_is_signed(spec->conv);
+
+    switch (spec->length) {
+    case srtp_err_len_l:
+        return is_signed ? (uint64_t)va_arg(*args, long)
+                         : (uint64_t)va_arg(*args, unsigned long);
+    case srtp_err_len_ll:
+        return is_signed ? (uint64_t)va_arg(*args, long long)
+                         : (uint64_t)va_arg(*args, unsigned long long);
+    case srtp_err_len_size:
+        return (uint64_t)va_arg(*args, size_t);
+    case srtp_err_len_intmax:
+        return is_signed ? (uint64_t)va_arg(*args, intmax_t)
+                         : (uint64_t)va_arg(*args, uintmax_t);
+    case srtp_err_len_ptrdiff:
+        return (uint64_t)va_arg(*args, ptrdiff_t);
+    default:
+        return is_signed ? (uint64_t)va_arg(*args, int)
+                         : (uint64_t)va_arg(*args, unsigned int);
+    }
+}
+
+/*
+ * Copies the arguments of a report into rec.  Returns false if the report
+ * cannot be recorded that way.
+ */
+static bool srtp_err_capture(srtp_err_record_t *rec,
+                             const char *format,
+                             va_list *args)
+{
+    const char *p = format;
+    size_t num_args = 0;
+    size_t strings_len = 0;
+    srtp_err_spec_t spec;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+        p = srtp_err_parse_spec(p + 1, &spec);
+        if (spec.conv == 0 || num_args == SRTP_ERR_MAX_ARGS) {
+            return false;
+        }
+
+        if (spec.conv == 's') {
+            const char *str = va_arg(*args, const char *);
+            size_t len;
+            if (str == NULL) {
+                str = "(null)";
+            }
+            if (strings_len >= SRTP_ERR_STRINGS_LEN) {
+                /* no room left, use the terminator of the last string */
+                rec->args[num_args++] = SRTP_ERR_STRINGS_LEN - 1;
+                continue;
+            }
+            len = strlen(str);
+            if (len >= SRTP_ERR_STRINGS_LEN - strings_len) {
+                len = SRTP_ERR_STRINGS_LEN - strings_len - 1;
+            }
+            memcpy(rec->strings + strings_len, str, len);
+            rec->strings[strings_len + len] = '\0';
+            rec->args[num_args++] = strings_len;
+            strings_len += len + 1;
+        } else if (spec.conv == 'p') {
+            rec->args[num_args++] = (uintptr_t)va_arg(*args, void *);
+        } else {
+            rec->args[num_args++] = srtp_err_take_int(&spec, args);
+        }
+    }
+
+    return true;
+}
+
+/* formats the argument of one conversion specification */
+static int srtp_err_format_arg(char *out,
+                               size_t out_len,
+                               const srtp_err_spec_t *spec,
+                               const srtp_err_record_t *rec,
+                               uint64_t arg)
+{
+    char fmt[32];
+    bool is_signed = srtp_err_is_signed(spec->conv);
+
+    if (spec->len >= sizeof(fmt)) {
+        return 0;
+    }
+    memcpy(fmt, spec->start, spec->len);
+    fmt[spec->len] = '\0';
+
+    switch (spec->conv) {
+    case 's':
+        return snprintf(out, out_len, fmt, rec->strings + arg);
+    case 'p':
+        return snprintf(out, out_len, fmt, (void *)(uintptr_t)arg);
+    default:
+        break;
+    }
+
+    switch (spec->length) {
+    case srtp_err_len_l:
+        return is_signed ? snprintf(out, out_len, fmt, (long)arg)
+                         : snprintf(out, out_len, fmt, (unsigned long)arg);
+    case srtp_err_len_ll:
+        return is_signed ? snprintf(out, out_len, fmt, (long long)arg)
+                         : snprintf(out, out_len, fmt, (unsigned long long)arg);
+    case srtp_err_len_size:
+        return snprintf(out, out_len, fmt, (size_t)arg);
+    case srtp_err_len_intmax:
+        return is_signed ? snprintf(out, out_len, fmt, (intmax_t)arg)
+                         : snprintf(out, out_len, fmt, (uintmax_t)arg);
+    case srtp_err_len_ptrdiff:
+        return snprintf(out, out_len, fmt, (ptrdiff_t)arg);
+    default:
+        return is_signed ? snprintf(out, out_len, fmt, (int)arg)
+                         : snprintf(out, out_len, fmt, (unsigned int)arg);
+    }
+}
+
+static void srtp_err_format_record(const srtp_err_record_t *rec,
+                                   char *msg,
+                                   size_t msg_len)
+{
+    const char *p = rec->format;
+    size_t pos = 0;
+    size_t num_args = 0;
+    srtp_err_spec_t spec;
+
+    msg[0] = '\0';
+    while (*p && pos + 1 < msg_len) {
+        int n;
+        if (*p != '%') {
+            msg[pos++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            msg[pos++] = '%';
+            p += 2;
+            continue;
+        }
+        p = srtp_err_parse_spec(p + 1, &spec);
+        if (num_args == SRTP_ERR_MAX_ARGS) {
+            break;
+        }
+        n = srtp_err_format_arg(msg + pos, msg_len - pos, &spec, rec,
+                                rec->args[num_args++]);
+        if (n > 0) {
+            pos += (size_t)n;
+        }
+    }
+    if (pos >= msg_len) {
+        pos = msg_len - 1;
+    }
+    msg[pos] = '\0';
+}
+
+static void srtp_err_deliver(srtp_err_reporting_level_t level, char *msg)
+{
+    if (srtp_err_file != NULL) {
+        fputs(msg, srtp_err_file);
+    }
+    if (srtp_err_report_handler != NULL) {
+        /* strip trailing \n, callback should not have one */
+        size_t l = strlen(msg);
+        if (l && msg[l - 1] == '\n') {
+            msg[l - 1] = '\0';
+        }
+        srtp_err_report_handler(level, msg);
+    }
+}
+
+static srtp_err_limit_t *srtp_err_get_limit(const srtp_debug_module_t *mod)
+{
+    size_t slot = ((uintptr_t)mod >> 4) % SRTP_ERR_LIMIT_SLOTS;
+    size_t i;
+
+    for (i = 0; i < SRTP_ERR_LIMIT_SLOTS; i++) {
+        srtp_err_limit_t *limit =
+            &srtp_err_limits[(slot + i) % SRTP_ERR_LIMIT_SLOTS];
+        const srtp_debug_module_t *owner =
+            __atomic_load_n(&limit->mod, __ATOMIC_ACQUIRE);
+        if (owner == NULL) {
+            if (__atomic_compare_exchange_n(&limit->mod, &owner, mod, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                return limit;
+            }
+        }
+        if (owner == mod) {
+            return limit;
+        }
+    }
+
+    /* more modules than slots, share the last one */
+    return &srtp_err_limits[SRTP_ERR_LIMIT_SLOTS - 1];
+}
+
+static bool srtp_err_within_limit(srtp_err_limit_t *limit)
+{
+    uint64_t now = (uint64_t)time(NULL);
+    uint64_t second = __atomic_load_n(&limit->second, __ATOMIC_RELAXED);
+
+    if (srtp_err_max_per_second == 0) {
+        return true;
+    }
+
+    if (second != now &&
+        __atomic_compare_exchange_n(&limit->second, &second, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+    }
+
+    return __atomic_add_fetch(&limit->count, 1, __ATOMIC_RELAXED) <=
+           srtp_err_max_per_second;
+}
+
+static void srtp_err_record(srtp_err_reporting_level_t level,
+                            const srtp_debug_module_t *mod,
+                            const char *format,
+                            va_list args)
+{
+    srtp_err_limit_t *limit;
+    srtp_err_record_t *rec;
+    uint64_t pos;
+    va_list args_copy;
+
+    if (mod == NULL) {
+        mod = &srtp_err_no_module;
+    }
+    limit = srtp_err_get_limit(mod);
+
+    if (!srtp_err_within_limit(limit)) {
+        __atomic_add_fetch(&limit->rate_limited, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    pos = __atomic_load_n(&srtp_err_ring_head, __ATOMIC_RELAXED);
+    while (true) {
+        uint64_t seq;
+        rec = &srtp_err_ring[pos & srtp_err_ring_mask];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&srtp_err_ring_head, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((int64_t)(seq - pos) < 0) {
+            __atomic_add_fetch(&limit->queue_full, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&srtp_err_ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->level = level;
+    rec->mod = mod;
+    rec->format = format;
+    va_copy(args_copy, args);
+    if (!srtp_err_capture(rec, format, &args_copy)) {
+        vsnprintf(rec->strings, sizeof(rec->strings), format, args);
+        rec->format = "%s";
+        rec->args[0] = 0;
+    }
+    va_end(args_copy);
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+srtp_err_status_t srtp_err_reporting_defer(size_t num_records,
+                                           uint32_t max_per_second)
+{
+    srtp_err_record_t *ring = NULL;
+    size_t n = 1;
+    size_t i;
+
+    if (num_records > 0) {
+        while (n < num_records) {
+            if (n > SIZE_MAX / 2 / sizeof(srtp_err_record_t)) {
+                return srtp_err_status_bad_param;
+            }
+            n *= 2;
+        }
+        ring = (srtp_err_record_t *)calloc(n, sizeof(srtp_err_record_t));
+        if (ring == NULL) {
+            return srtp_err_status_alloc_fail;
+        }
+        for (i = 0; i < n; i++) {
+            ring[i].seq = i;
+        }
+    }
+
+    /* records that were never flushed can hold key material */
+    if (srtp_err_ring != NULL) {
+        octet_string_set_to_zero(srtp_err_ring, (srtp_err_ring_mask + 1) *
+                                                    sizeof(srtp_err_record_t));
+    }
+    free(srtp_err_ring);
+    srtp_err_ring = ring;
+    srtp_err_ring_mask = n - 1;
+    srtp_err_ring_head = 0;
+    srtp_err_ring_tail = 0;
+    srtp_err_max_per_second = max_per_second;
+    memset(srtp_err_limits, 0, sizeof(srtp_err_limits));
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_err_reporting_flush(size_t *num_records)
 {
     char msg[512];
-    va_list args;
+    size_t n = 0;
+
+    if (srtp_err_ring == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    while (true) {
+        uint64_t pos = srtp_err_ring_tail;
+        srtp_err_record_t *rec = &srtp_err_ring[pos & srtp_err_ring_mask];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+
+        srtp_err_format_record(rec, msg, sizeof(msg));
+        srtp_err_deliver(rec->level, msg);
+        octet_string_set_to_zero(msg, sizeof(msg));
+        octet_string_set_to_zero(rec->args, sizeof(rec->args));
+        octet_string_set_to_zero(rec->strings, sizeof(rec->strings));
+
+        __atomic_store_n(&rec->seq, pos + srtp_err_ring_mask + 1,
+                         __ATOMIC_RELEASE);
+        srtp_err_ring_tail = pos + 1;
+        n++;
+    }
+
+    if (num_records) {
+        *num_records = n;
+    }
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_err_reporting_drops(const char *mod_name,
+                                           uint64_t *rate_limited,
+                                           uint64_t *queue_full)
+{
+    size_t i;
+
+    *rate_limited = 0;
+    *queue_full = 0;
+
+    if (mod_name == NULL) {
+        mod_name = srtp_err_no_module.name;
+    }
+
+    for (i = 0; i < SRTP_ERR_LIMIT_SLOTS; i++) {
+        srtp_err_limit_t *limit = &srtp_err_limits[i];
+        const srtp_debug_module_t *mod =
+            __atomic_load_n(&limit->mod, __ATOMIC_ACQUIRE);
+        if (mod != NULL && strcmp(mod->name, mod_name) == 0) {
+            *rate_limited +=
+                __atomic_load_n(&limit->rate_limited, __ATOMIC_RELAXED);
+            *queue_full += __atomic_load_n(&limit->queue_full, __ATOMIC_RELAXED);
+        }
+    }
+
+    return srtp_err_status_ok;
+}
+
+#else /* SRTP_ERR_HAVE_ATOMIC_BUILTINS */
+
+static void srtp_err_record(srtp_err_reporting_level_t level,
+                            const srtp_debug_module_t *mod,
+                            const char *format,
+                            va_list args)
+{
+    /* srtp_err_reporting_defer() never sets up a ring */
+    (void)level;
+    (void)mod;
+    (void)format;
+    (void)args;
+}
+
+srtp_err_status_t srtp_err_reporting_defer(size_t num_records,
+                                           uint32_t max_per_second)
+{
+    (void)max_per_second;
+    return num_records ? srtp_err_status_fail : srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_err_reporting_flush(size_t *num_records)
+{
+    (void)num_records;
+    return srtp_err_status_bad_param;
+}
+
+srtp_err_status_t srtp_err_reporting_drops(const char *mod_name,
+                                           uint64_t *rate_limited,
+                                           uint64_t *queue_full)
+{
+    (void)mod_name;
+    *rate_limited = 0;
+    *queue_full = 0;
+    return srtp_err_status_ok;
+}
+
+#endif /* SRTP_ERR_HAVE_ATOMIC_BUILTINS */
+
+static void srtp_err_vreport(srtp_err_reporting_level_t level,
+                             const srtp_debug_module_t *mod,
+                             const char *format,
+                             va_list args)
+{
+    char msg[512];
+    va_list args_copy;
+
+    if (srtp_err_ring != NULL) {
+        srtp_err_record(level, mod, format, args);
+        return;
+    }
+
     if (srtp_err_file != NULL) {
-        va_start(args, format);
-        vfprintf(srtp_err_file, format, args);
-        va_end(args);
+        va_copy(args_copy, args);
+        vfprintf(srtp_err_file, format, args_copy);
+        va_end(args_copy);
     }
     if (srtp_err_report_handler != NULL) {
-        va_start(args, format);
         if (vsnprintf(msg, sizeof(msg), format, args) > 0) {
             /* strip trailing \n, callback should not have one */
             size_t l = strlen(msg);
@@ -103,6 +672,24 @@ void srtp_err_report(srtp_err_reporting_level_t level, const char *format, ...)
              */
             octet_string_set_to_zero(msg, sizeof(msg));
         }
-        va_end(args);
     }
 }
+
+void srtp_err_report(srtp_err_reporting_level_t level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    srtp_err_vreport(level, NULL, format, args);
+    va_end(args);
+}
+
+void srtp_err_report_module(srtp_err_reporting_level_t level,
+                            const srtp_debug_module_t *mod,
+                            const char *format,
+                            ...)
+{
+    va_list args;
+    va_start(args, format);
+    srtp_err_vreport(level, mod, format, args);
+    va_end(args);
+}
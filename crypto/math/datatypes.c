@@ -305,6 +305,60 @@ void bitvector_set_to_zero(bitvector_t *x)
     memset(x->word, 0, x->length >> 3);
 }
 
+/*
+ * bitvector_clear_range(x, first, count) clears the count bits starting
+ * at bit index first, wrapping around to bit zero if the range runs past
+ * the end of x (count must not exceed the length of x).  Only the words
+ * covering the range are touched, so the cost depends on count rather
+ * than on the length of x.
+ */
+void bitvector_clear_range(bitvector_t *x, size_t first, size_t count)
+{
+    size_t word_index = first >> 5;
+    const size_t bit_index = first & 31;
+
+    if (count == 0) {
+        return;
+    }
+
+    if (first + count > x->length) {
+        bitvector_clear_range(x, 0, first + count - x->length);
+        count = x->length - first;
+    }
+
+    /* leading partial word */
+    if (bit_index != 0) {
+        size_t n = 32 - bit_index;
+        uint32_t mask;
+        if (count < n) {
+            n = count;
+        }
+        mask = (n == 32) ? 0xffffffff : (((uint32_t)1 << n) - 1);
+        x->word[word_index] &= ~(mask << bit_index);
+        count -= n;
+        word_index++;
+    }
+
+    /* whole words */
+    size_t num_words = count >> 5;
+    uint32_t *w = x->word + word_index;
+#if defined(__SSE2__)
+    for (; num_words >= 8; num_words -= 8, w += 8) {
+        _mm_storeu_si128((__m128i *)w, _mm_setzero_si128());
+        _mm_storeu_si128((__m128i *)(w + 4), _mm_setzero_si128());
+    }
+#endif
+    for (; num_words > 0; num_words--) {
+        *w++ = 0;
+    }
+
+    /* trailing partial word */
+    count &= 31;
+    if (count != 0) {
+        *w &= ~(((uint32_t)1 << count) - 1);
+    }
+}
+
 #if defined(__SSSE3__)
 
 void bitvector_left_shift(bitvector_t *x, size_t shift)
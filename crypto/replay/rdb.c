@@ -49,32 +49,73 @@
 
 #include "rdb.h"
 
-#define rdb_bits_in_bitmask (8 * sizeof(v128_t))
-
 /*
  * this implementation of a replay database works as follows:
  *
  * window_start is the index of the first packet in the window
- * bitmask      a bit-buffer, containing the most recently entered
- *              index as the leftmost bit
+ * window_size  the number of packets in the window
+ * bitmask      a ring of bits, at least window_size long and a power of
+ *              two, in which index i is recorded at bit (i & (length - 1))
  *
+ * Moving the window forward clears only the bits of the indices that
+ * leave it, so check and add do not depend on the window size.
  */
 
+/* srtp_rdb_bit returns the position of the bit recording index in the ring */
+static inline size_t srtp_rdb_bit(const srtp_rdb_t *rdb, uint32_t p_index)
+{
+    return (size_t)p_index & (bitvector_get_length(&rdb->bitmask) - 1);
+}
+
 /* srtp_rdb_init initalizes rdb */
-srtp_err_status_t srtp_rdb_init(srtp_rdb_t *rdb)
+srtp_err_status_t srtp_rdb_init(srtp_rdb_t *rdb, size_t ws)
 {
-    v128_set_to_zero(&rdb->bitmask);
+    size_t ring_length = bits_per_word;
+
+    if (ws == 0) {
+        return srtp_err_status_bad_param;
+    }
+
+    while (ring_length < ws) {
+        ring_length <<= 1;
+    }
+
+    if (!bitvector_alloc(&rdb->bitmask, ring_length)) {
+        return srtp_err_status_alloc_fail;
+    }
+
+    rdb->window_size = ws;
     rdb->window_start = 0;
     return srtp_err_status_ok;
 }
 
+/* srtp_rdb_dealloc frees memory for rdb */
+srtp_err_status_t srtp_rdb_dealloc(srtp_rdb_t *rdb)
+{
+    bitvector_dealloc(&rdb->bitmask);
+
+    return srtp_err_status_ok;
+}
+
+/* srtp_rdb_reset empties rdb without reallocating its bitmask */
+void srtp_rdb_reset(srtp_rdb_t *rdb)
+{
+    bitvector_set_to_zero(&rdb->bitmask);
+    rdb->window_start = 0;
+}
+
+size_t srtp_rdb_get_window_size(const srtp_rdb_t *rdb)
+{
+    return rdb->window_size;
+}
+
 /*
  * srtp_rdb_check checks to see if index appears in rdb
  */
 srtp_err_status_t srtp_rdb_check(const srtp_rdb_t *rdb, uint32_t p_index)
 {
     /* if the index appears after (or at very end of) the window, its good */
-    if (p_index >= rdb->window_start + rdb_bits_in_bitmask) {
+    if (p_index >= rdb->window_start + rdb->window_size) {
         return srtp_err_status_ok;
     }
 
@@ -84,7 +125,7 @@ srtp_err_status_t srtp_rdb_check(const srtp_rdb_t *rdb, uint32_t p_index)
     }
 
     /* otherwise, the index appears within the window, so check the bitmask */
-    if (v128_get_bit(&rdb->bitmask, (p_index - rdb->window_start)) == 1) {
+    if (bitvector_get_bit(&rdb->bitmask, srtp_rdb_bit(rdb, p_index)) == 1) {
         return srtp_err_status_replay_fail;
     }
 
@@ -109,22 +150,38 @@ srtp_err_status_t srtp_rdb_add_index(srtp_rdb_t *rdb, uint32_t p_index)
     }
 
     delta = (p_index - rdb->window_start);
-    if (delta < rdb_bits_in_bitmask) {
-        /* if the p_index is within the window, set the appropriate bit */
-        v128_set_bit(&rdb->bitmask, delta);
-
-    } else {
-        delta -= rdb_bits_in_bitmask - 1;
-
-        /* shift the window forward by delta bits*/
-        v128_left_shift(&rdb->bitmask, delta);
-        v128_set_bit(&rdb->bitmask, rdb_bits_in_bitmask - 1);
-        rdb->window_start += delta;
+    if (delta >= rdb->window_size) {
+        /* move the window forward so that p_index is its last packet */
+        size_t shift = delta - (rdb->window_size - 1);
+
+        /* clear the bits of the indices leaving the window */
+        if (shift >= rdb->window_size) {
+            bitvector_set_to_zero(&rdb->bitmask);
+        } else {
+            bitvector_clear_range(&rdb->bitmask,
+                                  srtp_rdb_bit(rdb, rdb->window_start), shift);
+        }
+        rdb->window_start += (uint32_t)shift;
     }
 
+    bitvector_set_bit(&rdb->bitmask, srtp_rdb_bit(rdb, p_index));
+
     return srtp_err_status_ok;
 }
 
+void srtp_rdb_copy(srtp_rdb_t *dst, const srtp_rdb_t *src)
+{
+    bitvector_set_to_zero(&dst->bitmask);
+    dst->window_start = src->window_start;
+
+    for (size_t i = 0; i < src->window_size; i++) {
+        uint32_t p_index = src->window_start + (uint32_t)i;
+        if (bitvector_get_bit(&src->bitmask, srtp_rdb_bit(src, p_index))) {
+            srtp_rdb_add_index(dst, p_index);
+        }
+    }
+}
+
 srtp_err_status_t srtp_rdb_increment(srtp_rdb_t *rdb)
 {
     if (rdb->window_start >= 0x7fffffff) {
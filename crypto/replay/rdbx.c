@@ -48,6 +48,7 @@
 #endif
 
 #include "rdbx.h"
+#include "alloc.h"
 
 /*
  * from RFC 3711:
@@ -82,8 +83,13 @@
  *
  * A srtp_rdbx_t consists of a srtp_xtd_seq_num_t and a bitmask.  The index is
  * highest sequence number that has been received, and the bitmask indicates
- * which of the recent indicies have been received as well.  The
- * highest bit in the bitmask corresponds to the index in the bitmask.
+ * which of the recent indicies have been received as well.
+ *
+ * The bitmask is used as a ring: its length is the window size rounded
+ * up to a power of two, and index i is recorded in bit (i & (length - 1)).
+ * Moving the window forward by delta only clears the delta bits that are
+ * being reused (or the whole ring, if delta exceeds its length), so check
+ * and add cost the same for a window of 64 packets as for one of 32768.
  */
 
 void srtp_index_init(srtp_xtd_seq_num_t *pi)
@@ -149,20 +155,74 @@ ssize_t srtp_index_guess(const srtp_xtd_seq_num_t *local,
  *
  */
 
+/*
+ * srtp_rdbx_bit(rdbx, index) returns the position of the bit recording
+ * index in the ring
+ */
+static inline size_t srtp_rdbx_bit(const srtp_rdbx_t *rdbx,
+                                   srtp_xtd_seq_num_t index)
+{
+    return (size_t)index & (bitvector_get_length(&rdbx->bitmask) - 1);
+}
+
+/*
+ * srtp_rdbx_ring(rdbx) returns the ring of rdbx, which is in inline_word
+ * unless it was too long and has its own allocation
+ */
+static inline bitvector_t srtp_rdbx_ring(srtp_rdbx_t *rdbx)
+{
+    bitvector_t ring = rdbx->bitmask;
+
+    if (ring.word == NULL) {
+        ring.word = rdbx->inline_word;
+    }
+    return ring;
+}
+
+/*
+ * srtp_rdbx_words(rdbx) returns the words of the ring of rdbx for reading
+ */
+static inline const uint32_t *srtp_rdbx_words(const srtp_rdbx_t *rdbx)
+{
+    return rdbx->bitmask.word ? rdbx->bitmask.word : rdbx->inline_word;
+}
+
+bitvector_t srtp_rdbx_get_bitmask(srtp_rdbx_t *rdbx)
+{
+    return srtp_rdbx_ring(rdbx);
+}
+
+const uint32_t *srtp_rdbx_get_ring(const srtp_rdbx_t *rdbx)
+{
+    return srtp_rdbx_words(rdbx);
+}
+
 /*
  *  srtp_rdbx_init(&r, ws) initializes the srtp_rdbx_t pointed to by r with
  * window size ws
  */
 srtp_err_status_t srtp_rdbx_init(srtp_rdbx_t *rdbx, size_t ws)
 {
+    size_t ring_length = bits_per_word;
+
     if (ws == 0) {
         return srtp_err_status_bad_param;
     }
 
-    if (!bitvector_alloc(&rdbx->bitmask, ws)) {
+    while (ring_length < ws) {
+        ring_length <<= 1;
+    }
+
+    /* the common window sizes keep the ring next to the index */
+    if (ring_length <= SRTP_RDBX_INLINE_BITS) {
+        rdbx->bitmask.word = NULL;
+        rdbx->bitmask.length = ring_length;
+        memset(rdbx->inline_word, 0, sizeof(rdbx->inline_word));
+    } else if (!bitvector_alloc(&rdbx->bitmask, ring_length)) {
         return srtp_err_status_alloc_fail;
     }
 
+    rdbx->window_size = ws;
     srtp_index_init(&rdbx->index);
 
     return srtp_err_status_ok;
@@ -178,6 +238,18 @@ srtp_err_status_t srtp_rdbx_dealloc(srtp_rdbx_t *rdbx)
     return srtp_err_status_ok;
 }
 
+/*
+ * srtp_rdbx_reset(rdbx) returns rdbx to the state srtp_rdbx_init() left it
+ * in, without allocating
+ */
+void srtp_rdbx_reset(srtp_rdbx_t *rdbx)
+{
+    bitvector_t ring = srtp_rdbx_ring(rdbx);
+
+    srtp_index_init(&rdbx->index);
+    bitvector_set_to_zero(&ring);
+}
+
 /*
  * srtp_rdbx_set_roc(rdbx, roc) initializes the srtp_rdbx_t at the location rdbx
  * to have the rollover counter value roc.  If that value is less than
@@ -187,7 +259,9 @@ srtp_err_status_t srtp_rdbx_dealloc(srtp_rdbx_t *rdbx)
  */
 srtp_err_status_t srtp_rdbx_set_roc(srtp_rdbx_t *rdbx, uint32_t roc)
 {
-    bitvector_set_to_zero(&rdbx->bitmask);
+    bitvector_t ring = srtp_rdbx_ring(rdbx);
+
+    bitvector_set_to_zero(&ring);
 
     /* make sure that we're not moving backwards */
     if (roc < (rdbx->index >> 16)) {
@@ -217,7 +291,7 @@ srtp_xtd_seq_num_t srtp_rdbx_get_packet_index(const srtp_rdbx_t *rdbx)
  */
 size_t srtp_rdbx_get_window_size(const srtp_rdbx_t *rdbx)
 {
-    return bitvector_get_length(&rdbx->bitmask);
+    return rdbx->window_size;
 }
 
 /*
@@ -226,15 +300,18 @@ size_t srtp_rdbx_get_window_size(const srtp_rdbx_t *rdbx)
  */
 srtp_err_status_t srtp_rdbx_check(const srtp_rdbx_t *rdbx, ssize_t delta)
 {
+    size_t bit;
+
     if (delta > 0) { /* if delta is positive, it's good */
         return srtp_err_status_ok;
-    } else if ((int)(bitvector_get_length(&rdbx->bitmask) - 1) + delta < 0) {
-        /* if delta is lower than the bitmask, it's bad */
+    } else if ((ssize_t)(rdbx->window_size - 1) + delta < 0) {
+        /* if delta is lower than the window, it's bad */
         return srtp_err_status_replay_old;
-    } else if (bitvector_get_bit(&rdbx->bitmask,
-                                 (bitvector_get_length(&rdbx->bitmask) - 1) +
-                                     delta) == 1) {
-        /* delta is within the window, so check the bitmask */
+    }
+
+    /* delta is within the window, so check the bitmask */
+    bit = srtp_rdbx_bit(rdbx, rdbx->index + delta);
+    if (((srtp_rdbx_words(rdbx)[bit >> 5] >> (bit & 31)) & 1) == 1) {
         return srtp_err_status_replay_fail;
     }
     /* otherwise, the index is okay */
@@ -252,16 +329,21 @@ srtp_err_status_t srtp_rdbx_check(const srtp_rdbx_t *rdbx, ssize_t delta)
  */
 srtp_err_status_t srtp_rdbx_add_index(srtp_rdbx_t *rdbx, ssize_t delta)
 {
+    bitvector_t ring = srtp_rdbx_ring(rdbx);
+
     if (delta > 0) {
-        /* shift forward by delta */
+        /* clear the bits of the indices the window moves over */
+        if ((size_t)delta >= bitvector_get_length(&ring)) {
+            bitvector_set_to_zero(&ring);
+        } else {
+            bitvector_clear_range(&ring, srtp_rdbx_bit(rdbx, rdbx->index + 1),
+                                  (size_t)delta);
+        }
         srtp_index_advance(&rdbx->index, (srtp_sequence_number_t)delta);
-        bitvector_left_shift(&rdbx->bitmask, delta);
-        bitvector_set_bit(&rdbx->bitmask,
-                          bitvector_get_length(&rdbx->bitmask) - 1);
+        bitvector_set_bit(&ring, srtp_rdbx_bit(rdbx, rdbx->index));
     } else {
         /* delta is in window */
-        bitvector_set_bit(&rdbx->bitmask,
-                          bitvector_get_length(&rdbx->bitmask) - 1 + delta);
+        bitvector_set_bit(&ring, srtp_rdbx_bit(rdbx, rdbx->index + delta));
     }
 
     /* note that we need not consider the case that delta == 0 */
@@ -332,7 +414,248 @@ srtp_err_status_t srtp_rdbx_set_roc_seq(srtp_rdbx_t *rdbx,
     rdbx->index = seq;
     rdbx->index |= ((uint64_t)roc) << 16; /* set ROC */
 
-    bitvector_set_to_zero(&rdbx->bitmask);
+    bitvector_t ring = srtp_rdbx_ring(rdbx);
+    bitvector_set_to_zero(&ring);
 
     return srtp_err_status_ok;
 }
+
+/*
+ * srtp_rdbx_atomic_t
+ *
+ * The window is a ring of 64-bit slots, each covering a block of 32
+ * packet indices: the upper half of a slot holds the block number
+ * (index >> 5, truncated to 32 bits) and the lower half one bit per
+ * index in the block.  A slot is only ever replaced by a newer block,
+ * so setting a bit with compare-and-swap either succeeds, finds the bit
+ * already set (a replay), or finds that the block has been evicted (too
+ * old).  There are enough slots that a block is only evicted once it
+ * has left the window.  The highest index is moved forward with a
+ * compare-and-swap loop and never moves back.
+ */
+
+/* the GCC atomic builtins, which clang also provides */
+#if defined(__GNUC__) || defined(__clang__)
+#define SRTP_HAVE_ATOMIC_BUILTINS
+#endif
+
+#ifdef SRTP_HAVE_ATOMIC_BUILTINS
+
+struct srtp_rdbx_atomic_t {
+    uint64_t index;
+    size_t refcount;
+    size_t window_size;
+    size_t slot_mask;
+    uint64_t *slots;
+};
+
+srtp_err_status_t srtp_rdbx_atomic_alloc(srtp_rdbx_atomic_t **rdbx_ptr,
+                                         size_t ws,
+                                         srtp_xtd_seq_num_t index)
+{
+    srtp_rdbx_atomic_t *rdbx;
+    size_t num_slots = 1;
+
+    *rdbx_ptr = NULL;
+
+    if (ws == 0) {
+        return srtp_err_status_bad_param;
+    }
+
+    /* the blocks of a full window plus a partial block at either end */
+    while (num_slots < (ws >> 5) + 2) {
+        num_slots <<= 1;
+    }
+
+    rdbx = (srtp_rdbx_atomic_t *)srtp_crypto_alloc(sizeof(*rdbx));
+    if (rdbx == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+
+    rdbx->slots = (uint64_t *)srtp_crypto_alloc(num_slots * sizeof(uint64_t));
+    if (rdbx->slots == NULL) {
+        srtp_crypto_free(rdbx);
+        return srtp_err_status_alloc_fail;
+    }
+
+    rdbx->index = index;
+    rdbx->refcount = 1;
+    rdbx->window_size = ws;
+    rdbx->slot_mask = num_slots - 1;
+
+    *rdbx_ptr = rdbx;
+
+    return srtp_err_status_ok;
+}
+
+void srtp_rdbx_atomic_retain(srtp_rdbx_atomic_t *rdbx)
+{
+    __atomic_fetch_add(&rdbx->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void srtp_rdbx_atomic_release(srtp_rdbx_atomic_t *rdbx)
+{
+    if (rdbx == NULL) {
+        return;
+    }
+
+    if (__atomic_sub_fetch(&rdbx->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    srtp_crypto_free(rdbx->slots);
+    srtp_crypto_free(rdbx);
+}
+
+size_t srtp_rdbx_atomic_get_window_size(const srtp_rdbx_atomic_t *rdbx)
+{
+    return rdbx->window_size;
+}
+
+srtp_xtd_seq_num_t srtp_rdbx_atomic_get_packet_index(srtp_rdbx_atomic_t *rdbx)
+{
+    return __atomic_load_n(&rdbx->index, __ATOMIC_ACQUIRE);
+}
+
+ssize_t srtp_rdbx_atomic_estimate_index(srtp_rdbx_atomic_t *rdbx,
+                                        srtp_xtd_seq_num_t *guess,
+                                        srtp_sequence_number_t s)
+{
+    srtp_xtd_seq_num_t local =
+        __atomic_load_n(&rdbx->index, __ATOMIC_ACQUIRE);
+
+    /* see srtp_rdbx_estimate_index() */
+    if (local > seq_num_median) {
+        return srtp_index_guess(&local, guess, s);
+    }
+
+    *guess = s;
+
+    return s - local;
+}
+
+srtp_err_status_t srtp_rdbx_atomic_check(srtp_rdbx_atomic_t *rdbx,
+                                         srtp_xtd_seq_num_t index)
+{
+    const uint32_t block = (uint32_t)(index >> 5);
+    uint64_t slot;
+
+    if (index + rdbx->window_size <=
+        __atomic_load_n(&rdbx->index, __ATOMIC_ACQUIRE)) {
+        return srtp_err_status_replay_old;
+    }
+
+    slot = __atomic_load_n(&rdbx->slots[block & rdbx->slot_mask],
+                           __ATOMIC_ACQUIRE);
+    if ((int32_t)((uint32_t)(slot >> 32) - block) > 0) {
+        /* the slot has been taken over by a later block */
+        return srtp_err_status_replay_old;
+    }
+    if ((uint32_t)(slot >> 32) == block && ((slot >> (index & 31)) & 1)) {
+        return srtp_err_status_replay_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_rdbx_atomic_add_index(srtp_rdbx_atomic_t *rdbx,
+                                             srtp_xtd_seq_num_t index)
+{
+    const uint32_t block = (uint32_t)(index >> 5);
+    const uint64_t bit = (uint64_t)1 << (index & 31);
+    uint64_t *slot = &rdbx->slots[block & rdbx->slot_mask];
+    uint64_t old_slot;
+    uint64_t new_slot;
+    srtp_xtd_seq_num_t highest;
+
+    highest = __atomic_load_n(&rdbx->index, __ATOMIC_ACQUIRE);
+    if (index + rdbx->window_size <= highest) {
+        return srtp_err_status_replay_old;
+    }
+
+    old_slot = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    do {
+        int32_t age = (int32_t)((uint32_t)(old_slot >> 32) - block);
+        if (age > 0) {
+            return srtp_err_status_replay_old;
+        } else if (age == 0) {
+            if (old_slot & bit) {
+                return srtp_err_status_replay_fail;
+            }
+            new_slot = old_slot | bit;
+        } else {
+            new_slot = ((uint64_t)block << 32) | bit;
+        }
+    } while (!__atomic_compare_exchange_n(slot, &old_slot, new_slot, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    while (index > highest &&
+           !__atomic_compare_exchange_n(&rdbx->index, &highest, index, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+    }
+
+    return srtp_err_status_ok;
+}
+
+#else /* SRTP_HAVE_ATOMIC_BUILTINS */
+
+srtp_err_status_t srtp_rdbx_atomic_alloc(srtp_rdbx_atomic_t **rdbx_ptr,
+                                         size_t ws,
+                                         srtp_xtd_seq_num_t index)
+{
+    (void)ws;
+    (void)index;
+
+    *rdbx_ptr = NULL;
+
+    return srtp_err_status_fail;
+}
+
+void srtp_rdbx_atomic_retain(srtp_rdbx_atomic_t *rdbx)
+{
+    (void)rdbx;
+}
+
+void srtp_rdbx_atomic_release(srtp_rdbx_atomic_t *rdbx)
+{
+    (void)rdbx;
+}
+
+size_t srtp_rdbx_atomic_get_window_size(const srtp_rdbx_atomic_t *rdbx)
+{
+    (void)rdbx;
+    return 0;
+}
+
+srtp_xtd_seq_num_t srtp_rdbx_atomic_get_packet_index(srtp_rdbx_atomic_t *rdbx)
+{
+    (void)rdbx;
+    return 0;
+}
+
+ssize_t srtp_rdbx_atomic_estimate_index(srtp_rdbx_atomic_t *rdbx,
+                                        srtp_xtd_seq_num_t *guess,
+                                        srtp_sequence_number_t s)
+{
+    (void)rdbx;
+    *guess = s;
+    return 0;
+}
+
+srtp_err_status_t srtp_rdbx_atomic_check(srtp_rdbx_atomic_t *rdbx,
+                                         srtp_xtd_seq_num_t index)
+{
+    (void)rdbx;
+    (void)index;
+    return srtp_err_status_fail;
+}
+
+srtp_err_status_t srtp_rdbx_atomic_add_index(srtp_rdbx_atomic_t *rdbx,
+                                             srtp_xtd_seq_num_t index)
+{
+    (void)rdbx;
+    (void)index;
+    return srtp_err_status_fail;
+}
+
+#endif /* SRTP_HAVE_ATOMIC_BUILTINS */
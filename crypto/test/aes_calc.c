@@ -54,6 +54,12 @@
  key:            000102030405060708090a0b0c0d0e0f
  ciphertext:     69c4e0d86a7b0430d8cdb78070b4c55a
 
+ With -t instead of a key and plaintext, the FIPS 197 test vectors and a
+ run of random keys are checked against both the table and the vector
+ permute implementation:
+
+ [sh]$ test/aes_calc -t -v
+
  */
 
 #ifdef HAVE_CONFIG_H
@@ -69,12 +75,163 @@
 
 void usage(char *prog_name)
 {
-    printf("usage: %s <key> <plaintext> [<ciphertext>] [-v]\n", prog_name);
+    printf("usage: %s <key> <plaintext> [<ciphertext>] [-v]\n"
+           "       %s -t [-v]\n",
+           prog_name, prog_name);
     exit(255);
 }
 
 #define AES_MAX_KEY_LEN 32
 
+/* FIPS 197, appendix B, C.1 and C.3; AES-192 is not implemented */
+static const struct {
+    const char *key;
+    const char *plaintext;
+    const char *ciphertext;
+} aes_test_vectors[] = {
+    { "2b7e151628aed2a6abf7158809cf4f3c", "3243f6a8885a308d313198a2e0370734",
+      "3925841d02dc09fbdc118597196a0b32" },
+    { "000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff",
+      "69c4e0d86a7b0430d8cdb78070b4c55a" },
+    { "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+      "00112233445566778899aabbccddeeff", "8ea2b7ca516745bfeafc49904b496089" },
+};
+
+#define AES_NUM_RANDOM_KEYS 1000
+
+/* xorshift64, so that a failing random case can be reproduced */
+static uint64_t aes_test_rand_state = 0x9e3779b97f4a7c15;
+
+static void aes_test_rand(uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        aes_test_rand_state ^= aes_test_rand_state << 13;
+        aes_test_rand_state ^= aes_test_rand_state >> 7;
+        aes_test_rand_state ^= aes_test_rand_state << 17;
+        buf[i] = (uint8_t)aes_test_rand_state;
+    }
+}
+
+/*
+ * aes_encrypt_with(impl, ...) encrypts one block with the implementation
+ * impl, and checks that decrypting it gives the plaintext back
+ */
+static srtp_err_status_t aes_encrypt_with(srtp_aes_impl_t impl,
+                                          const uint8_t *key,
+                                          size_t key_len,
+                                          const v128_t *plaintext,
+                                          v128_t *ciphertext)
+{
+    srtp_aes_expanded_key_t exp_key;
+    srtp_err_status_t status;
+    v128_t data;
+
+    status = srtp_aes_set_implementation(impl);
+    if (status) {
+        return status;
+    }
+    status = srtp_aes_expand_encryption_key(key, key_len, &exp_key);
+    srtp_aes_set_implementation(srtp_aes_impl_auto);
+    if (status) {
+        return status;
+    }
+    if (exp_key.vperm != (impl == srtp_aes_impl_vperm)) {
+        return srtp_err_status_algo_fail;
+    }
+    v128_copy(ciphertext, plaintext);
+    srtp_aes_encrypt(ciphertext, &exp_key);
+
+    status = srtp_aes_expand_decryption_key(key, key_len, &exp_key);
+    if (status) {
+        return status;
+    }
+    v128_copy(&data, ciphertext);
+    srtp_aes_decrypt(&data, &exp_key);
+    if (memcmp(&data, plaintext, sizeof(data)) != 0) {
+        return srtp_err_status_algo_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+
+static int aes_self_test(bool verbose)
+{
+    static const struct {
+        srtp_aes_impl_t impl;
+        const char *name;
+    } impls[] = {
+        { srtp_aes_impl_table, "table" },
+        { srtp_aes_impl_vperm, "vector permute" },
+    };
+    static const size_t key_lens[] = { 16, 32 };
+    uint8_t key[AES_MAX_KEY_LEN];
+    v128_t plaintext, ciphertext, expected;
+    size_t key_len;
+    bool have_vperm;
+
+    have_vperm = srtp_aes_set_implementation(srtp_aes_impl_vperm) ==
+                 srtp_err_status_ok;
+    srtp_aes_set_implementation(srtp_aes_impl_auto);
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (impls[i].impl == srtp_aes_impl_vperm && !have_vperm) {
+            printf("%s implementation not available, skipped\n",
+                   impls[i].name);
+            continue;
+        }
+        for (size_t j = 0;
+             j < sizeof(aes_test_vectors) / sizeof(aes_test_vectors[0]); j++) {
+            key_len = hex_string_to_octet_string(key, aes_test_vectors[j].key,
+                                                 AES_MAX_KEY_LEN * 2) /
+                      2;
+            hex_string_to_octet_string((uint8_t *)&plaintext,
+                                       aes_test_vectors[j].plaintext, 16 * 2);
+            hex_string_to_octet_string((uint8_t *)&expected,
+                                       aes_test_vectors[j].ciphertext, 16 * 2);
+            if (aes_encrypt_with(impls[i].impl, key, key_len, &plaintext,
+                                 &ciphertext) ||
+                memcmp(&ciphertext, &expected, sizeof(expected)) != 0) {
+                fprintf(stderr,
+                        "error: %s implementation failed FIPS 197 vector "
+                        "with key %s\n",
+                        impls[i].name, aes_test_vectors[j].key);
+                return 1;
+            }
+        }
+        if (verbose) {
+            printf("%s implementation: FIPS 197 vectors passed\n",
+                   impls[i].name);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(key_lens) / sizeof(key_lens[0]); i++) {
+        key_len = key_lens[i];
+        for (size_t j = 0; j < AES_NUM_RANDOM_KEYS; j++) {
+            aes_test_rand(key, key_len);
+            aes_test_rand((uint8_t *)&plaintext, sizeof(plaintext));
+            if (aes_encrypt_with(srtp_aes_impl_table, key, key_len, &plaintext,
+                                 &expected) ||
+                (have_vperm &&
+                 (aes_encrypt_with(srtp_aes_impl_vperm, key, key_len,
+                                   &plaintext, &ciphertext) ||
+                  memcmp(&ciphertext, &expected, sizeof(expected)) != 0))) {
+                fprintf(stderr,
+                        "error: implementations disagree for key %s ",
+                        octet_string_hex_string(key, key_len));
+                fprintf(stderr, "and plaintext %s\n",
+                        v128_hex_string(&plaintext));
+                return 1;
+            }
+        }
+        if (verbose) {
+            printf("%zu random %zu-bit keys passed\n",
+                   (size_t)AES_NUM_RANDOM_KEYS, key_len * 8);
+        }
+    }
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     const char *expected_ciphertext = NULL;
@@ -93,6 +250,10 @@ int main(int argc, char *argv[])
         --argc;
     }
 
+    if (argc == 2 && strcmp(argv[1], "-t") == 0) {
+        return aes_self_test(verbose);
+    }
+
     if (argc < 3 || argc > 4) {
         /* we've been fed the wrong number of arguments - compain and exit */
         usage(argv[0]);
@@ -50,6 +50,7 @@
 #include "getopt_s.h"
 #include "cipher.h"
 #include "cipher_priv.h"
+#include "crypto_kernel.h"
 #include "datatypes.h"
 #include "alloc.h"
 #include "util.h"
@@ -72,6 +73,8 @@ srtp_err_status_t cipher_driver_test_multi_aes_icm_128(void);
 srtp_err_status_t cipher_driver_test_multi_aes_gcm_128(void);
 #endif
 
+srtp_err_status_t cipher_driver_test_batch(void);
+
 /*
  * cipher_driver_test_buffering(ct) tests the cipher's output
  * buffering for correctness by checking the consistency of successive
@@ -228,6 +231,7 @@ int main(int argc, char *argv[])
 #ifdef GCM
         cipher_driver_test_multi_aes_gcm_128();
 #endif
+        cipher_driver_test_batch();
     }
 
     /* do timing and/or buffer_test on srtp_null_cipher */
@@ -899,6 +903,123 @@ srtp_err_status_t cipher_driver_test_multi_aes_gcm_128(void)
 }
 #endif
 
+/*
+ * counting_aes_icm_128 stands in for a multi-buffer engine: it is
+ * aes_icm_128 with a batch entry point that counts the batches it gets
+ */
+static srtp_cipher_type_t counting_aes_icm_128;
+static size_t num_batches = 0;
+
+static srtp_err_status_t counting_alloc(srtp_cipher_pointer_t *cp,
+                                        size_t key_len,
+                                        size_t tag_len)
+{
+    srtp_err_status_t status = srtp_aes_icm_128.alloc(cp, key_len, tag_len);
+    if (status == srtp_err_status_ok) {
+        (*cp)->type = &counting_aes_icm_128;
+    }
+    return status;
+}
+
+static srtp_err_status_t counting_batch(void *state,
+                                        srtp_cipher_direction_t direction,
+                                        srtp_cipher_job_t *jobs,
+                                        size_t num_jobs)
+{
+    srtp_err_status_t status = srtp_err_status_ok;
+
+    num_batches++;
+    for (size_t i = 0; i < num_jobs; i++) {
+        jobs[i].status = srtp_aes_icm_128.set_iv(state, jobs[i].iv, direction);
+        if (jobs[i].status == srtp_err_status_ok) {
+            jobs[i].status =
+                srtp_aes_icm_128.encrypt(state, jobs[i].src, jobs[i].src_len,
+                                         jobs[i].dst, &jobs[i].dst_len);
+        }
+        if (jobs[i].status && !status) {
+            status = jobs[i].status;
+        }
+    }
+
+    return status;
+}
+
+srtp_err_status_t cipher_driver_test_batch(void)
+{
+    uint8_t key[SRTP_AES_ICM_128_KEY_LEN_WSALT];
+    uint8_t ivs[4][16];
+    uint8_t src[4][64];
+    uint8_t ref[4][64];
+    uint8_t dst[4][64];
+    srtp_cipher_job_t jobs[4];
+    srtp_cipher_t *c = NULL;
+
+    printf("testing cipher batch for %s...", srtp_aes_icm_128.description);
+
+    srtp_cipher_rand_for_tests(key, sizeof(key));
+    srtp_cipher_rand_for_tests(ivs[0], sizeof(ivs));
+    srtp_cipher_rand_for_tests(src[0], sizeof(src));
+
+    /* the reference, one buffer at a time */
+    CHECK_OK(srtp_cipher_type_alloc(&srtp_aes_icm_128, &c, sizeof(key), 0));
+    CHECK_OK(srtp_cipher_init(c, key));
+    for (size_t i = 0; i < 4; i++) {
+        size_t len = sizeof(ref[i]);
+        CHECK_OK(srtp_cipher_set_iv(c, ivs[i], srtp_direction_encrypt));
+        CHECK_OK(srtp_cipher_encrypt(c, src[i], 16 * (i + 1), ref[i], &len));
+        CHECK(len == 16 * (i + 1));
+    }
+
+    /* without a batch entry point the jobs run one after the other */
+    for (size_t i = 0; i < 4; i++) {
+        jobs[i].iv = ivs[i];
+        jobs[i].aad = NULL;
+        jobs[i].aad_len = 0;
+        jobs[i].src = src[i];
+        jobs[i].src_len = 16 * (i + 1);
+        jobs[i].dst = dst[i];
+        jobs[i].dst_len = sizeof(dst[i]);
+    }
+    CHECK_OK(srtp_cipher_batch(c, srtp_direction_encrypt, jobs, 4));
+    for (size_t i = 0; i < 4; i++) {
+        CHECK_OK(jobs[i].status);
+        CHECK(jobs[i].dst_len == 16 * (i + 1));
+        CHECK_BUFFER_EQUAL(ref[i], dst[i], jobs[i].dst_len);
+    }
+    CHECK_OK(srtp_cipher_dealloc(c));
+
+    /* an engine plugged in with srtp_replace_cipher_type gets them at once */
+    counting_aes_icm_128 = srtp_aes_icm_128;
+    counting_aes_icm_128.alloc = counting_alloc;
+    counting_aes_icm_128.batch = counting_batch;
+    CHECK_OK(srtp_crypto_kernel_init());
+    CHECK_OK(srtp_replace_cipher_type(&counting_aes_icm_128, SRTP_AES_ICM_128));
+    CHECK(num_batches > 0); /* the self-tests went through it */
+
+    CHECK_OK(srtp_crypto_kernel_alloc_cipher(SRTP_AES_ICM_128, &c,
+                                             sizeof(key), 0));
+    CHECK(c->type == &counting_aes_icm_128);
+    CHECK_OK(srtp_cipher_init(c, key));
+    for (size_t i = 0; i < 4; i++) {
+        jobs[i].dst_len = sizeof(dst[i]);
+    }
+    octet_string_set_to_zero(dst, sizeof(dst));
+    num_batches = 0;
+    CHECK_OK(srtp_cipher_batch(c, srtp_direction_encrypt, jobs, 4));
+    CHECK(num_batches == 1);
+    for (size_t i = 0; i < 4; i++) {
+        CHECK_OK(jobs[i].status);
+        CHECK(jobs[i].dst_len == 16 * (i + 1));
+        CHECK_BUFFER_EQUAL(ref[i], dst[i], jobs[i].dst_len);
+    }
+    CHECK_OK(srtp_cipher_dealloc(c));
+    CHECK_OK(srtp_crypto_kernel_shutdown());
+
+    printf("passed\n");
+
+    return srtp_err_status_ok;
+}
+
 /*
  * cipher_driver_test_buffering(ct) tests the cipher's output
  * buffering for correctness by checking the consistency of successive
@@ -355,6 +355,9 @@ typedef struct srtp_policy_t {
     bool use_cryptex;           /**< Encrypt header block and CSRCs with */
                                 /**< cryptex.                            */
     struct srtp_policy_t *next; /**< Pointer to next stream policy.      */
+    size_t rtcp_window_size;    /**< The window size to use for SRTCP    */
+                                /**< replay protection; 0 selects the    */
+                                /**< default of 128 packets.             */
 } srtp_policy_t;
 
 /**
@@ -386,6 +389,44 @@ srtp_err_status_t srtp_init(void);
  */
 srtp_err_status_t srtp_shutdown(void);
 
+/**
+ * @brief srtp_set_deferred_self_tests() defers the cipher and auth
+ * self-tests to first use.
+ *
+ * By default srtp_init() runs the known-answer self-test of every
+ * cipher and auth type it loads.  When srtp_set_deferred_self_tests(true)
+ * has been called beforehand, srtp_init() skips those tests; instead
+ * each type runs its self-test the first time a cipher or auth function
+ * of that type is allocated (e.g. by srtp_create() or srtp_stream_add()),
+ * and the result is cached for the lifetime of the library.  If the
+ * self-test fails, every allocation of that type fails with the status
+ * returned by the test.
+ *
+ * The setting persists across srtp_shutdown() and applies to types
+ * loaded later with srtp_replace_cipher_type() or
+ * srtp_replace_auth_type().
+ *
+ * @param defer true to defer self-tests, false to run them on load.
+ */
+void srtp_set_deferred_self_tests(bool defer);
+
+/**
+ * @brief srtp_self_test() runs all outstanding cipher and auth
+ * self-tests.
+ *
+ * Where compliance requires every algorithm to be verified before use,
+ * call this function after srtp_init() when self-tests are deferred.
+ * Each type that has not been tested yet is tested and its result
+ * recorded; without deferral all types were tested by srtp_init() and
+ * this function returns immediately.
+ *
+ * @return
+ *    - srtp_err_status_ok         if all types passed their self-tests.
+ *    - srtp_err_status_init_fail  if the library is not initialized.
+ *    - [other]                    the status of the first failing type.
+ */
+srtp_err_status_t srtp_self_test(void);
+
 /**
  * @brief srtp_protect() is the Secure RTP sender-side packet processing
  * function.
@@ -488,6 +529,250 @@ srtp_err_status_t srtp_unprotect(srtp_t ctx,
                                  uint8_t *rtp,
                                  size_t *rtp_len);
 
+/**
+ * @brief srtp_protect_burst() protects a burst of RTP packets into a
+ * buffer with a fixed stride.
+ *
+ * The function call srtp_protect_burst(ctx, rtp, rtp_stride, rtp_len,
+ * num_pkts, srtp, srtp_stride, srtp_len, mki_index) applies srtp_protect()
+ * to the num_pkts RTP packets found at rtp + i * rtp_stride (of length
+ * rtp_len[i]) and writes the i-th SRTP packet, including its MKI and
+ * authentication tag, to srtp + i * srtp_stride.  The length of each SRTP
+ * packet is returned in srtp_len[i].
+ *
+ * This lays a burst out the way Linux UDP generic segmentation offload
+ * (UDP_SEGMENT) expects it: if every SRTP packet but the last one is exactly
+ * srtp_stride octets long, the whole burst can be sent with a single
+ * sendmsg() using srtp_stride as segment size.  The packets typically belong
+ * to a single stream.
+ *
+ * Consecutive packets of a stream that uses AES-ICM with HMAC-SHA1, without
+ * MKI, cryptex, header extension encryption or precomputed keystream, are
+ * encrypted and authenticated together, through the batch entry points of
+ * the cipher and auth types (see srtp_replace_cipher_type()), so that a
+ * multi-buffer engine gets several packets per call.  The result is the
+ * same as with srtp_protect().
+ *
+ * Packets are protected in order and processing stops at the first failure;
+ * srtp_len[i] is 0 for that packet and every packet after it.
+ *
+ * @param ctx is the SRTP context to use in processing the packets.
+ *
+ * @param rtp is a pointer to the first RTP packet.
+ *
+ * @param rtp_stride is the distance in octets between consecutive RTP
+ * packets.
+ *
+ * @param rtp_len is an array of num_pkts RTP packet lengths.
+ *
+ * @param num_pkts is the number of packets in the burst.
+ *
+ * @param srtp is a pointer to the buffer receiving the SRTP packets, which
+ * must hold num_pkts * srtp_stride octets.  The value of srtp can be the same
+ * as rtp, with the same stride, to support in-place io; the buffers must not
+ * overlap otherwise.
+ *
+ * @param srtp_stride is the distance in octets between consecutive SRTP
+ * packets, it bounds the size of each SRTP packet.
+ *
+ * @param srtp_len is an array of num_pkts entries that receives the SRTP
+ * packet lengths.
+ *
+ * @param mki_index integer value specifying which set of session keys should be
+ * used if use_mki in the policy was set to true. Otherwise ignored.
+ *
+ * @return
+ *    - srtp_err_status_ok            all packets were protected
+ *    - srtp_err_status_bad_param     a stride is zero, or the buffers are the
+ *                                    same but the strides differ
+ *    - srtp_err_status_buffer_small  an SRTP packet does not fit the stride
+ *    - @e other                      as returned by srtp_protect()
+ */
+srtp_err_status_t srtp_protect_burst(srtp_t ctx,
+                                     const uint8_t *rtp,
+                                     size_t rtp_stride,
+                                     const size_t rtp_len[],
+                                     size_t num_pkts,
+                                     uint8_t *srtp,
+                                     size_t srtp_stride,
+                                     size_t srtp_len[],
+                                     size_t mki_index);
+
+/**
+ * @brief srtp_unprotect_burst() unprotects, in place, the SRTP packets of a
+ * coalesced receive buffer.
+ *
+ * The function call srtp_unprotect_burst(ctx, buf, buf_len, stride, rtp_len,
+ * pkt_status, max_pkts, num_pkts) splits the buf_len octets at buf into
+ * segments of stride octets, the last of which may be shorter, as delivered
+ * by Linux UDP generic receive offload (UDP_GRO) with stride as the segment
+ * size.  Each segment is passed to srtp_unprotect() in place; the resulting
+ * RTP packet starts at buf + i * stride and is rtp_len[i] octets long.
+ *
+ * The packets are independent of each other: the result of each one is
+ * reported in pkt_status[i], and rtp_len[i] is 0 for packets that failed.
+ * As for srtp_protect_burst(), the packets of a stream that uses AES-ICM
+ * with HMAC-SHA1 go to the batch entry points of the cipher and auth types;
+ * each packet is still checked against the replay database and accepted in
+ * order, so the results are those of srtp_unprotect().
+ *
+ * @param ctx is the SRTP session which applies to the packets.
+ *
+ * @param buf is a pointer to the coalesced SRTP packets.
+ *
+ * @param buf_len is the number of octets in buf.
+ *
+ * @param stride is the segment size.
+ *
+ * @param rtp_len is an array of max_pkts entries that receives the RTP packet
+ * lengths.
+ *
+ * @param pkt_status is an array of max_pkts entries that receives the status
+ * of each packet, as returned by srtp_unprotect().
+ *
+ * @param max_pkts is the number of entries of rtp_len and pkt_status.
+ *
+ * @param num_pkts receives the number of segments processed.
+ *
+ * @return
+ *    - srtp_err_status_ok            all segments were processed, check
+ *                                    pkt_status for the individual results
+ *    - srtp_err_status_bad_param     the stride is zero
+ *    - srtp_err_status_buffer_small  buf holds more than max_pkts segments,
+ *                                    nothing was processed
+ */
+srtp_err_status_t srtp_unprotect_burst(srtp_t ctx,
+                                       uint8_t *buf,
+                                       size_t buf_len,
+                                       size_t stride,
+                                       size_t rtp_len[],
+                                       srtp_err_status_t pkt_status[],
+                                       size_t max_pkts,
+                                       size_t *num_pkts);
+
+/**
+ * @brief srtp_protect_outer() applies only the hop-by-hop layer of RFC 8723
+ * double encryption to a packet.
+ *
+ * A media distributor forwards packets whose payload it cannot decrypt:
+ * the payload is the end-to-end (inner) ciphertext and tag followed by the
+ * original header block (OHB).  The function call srtp_protect_outer(ctx,
+ * rtp, rtp_len, srtp, srtp_len, mki_index) encrypts such a packet with the
+ * AEAD policy of its stream in ctx, exactly as srtp_protect() would, after
+ * checking that it ends in a well-formed OHB.  For a stream with a double
+ * policy the inner layer is left alone.
+ *
+ * The hop-by-hop layer of the double profiles is the AEAD_AES_128_GCM or
+ * AEAD_AES_256_GCM transform, so a media distributor that only holds the
+ * hop-by-hop keys uses srtp_profile_aead_aes_128_gcm or
+ * srtp_profile_aead_aes_256_gcm for its sessions.
+ *
+ * @param ctx is the SRTP context to use in processing the packet.
+ *
+ * @param rtp is a pointer to the packet, as returned by
+ * srtp_unprotect_outer() and possibly changed by
+ * srtp_double_rewrite_header().
+ *
+ * @param rtp_len is the length in octets of the packet.
+ *
+ * @param srtp is a pointer to the output buffer, which can be the same as
+ * rtp.
+ *
+ * @param srtp_len is a pointer to the length in octets of the srtp buffer
+ * before the function call, and of the SRTP packet after the call.
+ *
+ * @param mki_index selects the session keys if use_mki is set in the policy.
+ *
+ * @return
+ *    - srtp_err_status_ok          no problems
+ *    - srtp_err_status_parse_err   the packet does not end in an OHB
+ *    - srtp_err_status_bad_param   the stream does not use an AEAD cipher
+ *    - @e other                    as returned by srtp_protect()
+ */
+srtp_err_status_t srtp_protect_outer(srtp_t ctx,
+                                     const uint8_t *rtp,
+                                     size_t rtp_len,
+                                     uint8_t *srtp,
+                                     size_t *srtp_len,
+                                     size_t mki_index);
+
+/**
+ * @brief srtp_unprotect_outer() removes only the hop-by-hop layer of RFC
+ * 8723 double encryption from a packet.
+ *
+ * The function call srtp_unprotect_outer(ctx, srtp, srtp_len, rtp, rtp_len)
+ * verifies and decrypts the hop-by-hop layer of the SRTP packet as
+ * srtp_unprotect() would, and checks that the result ends in a well-formed
+ * OHB.  The RTP header and its extensions are then in the clear, while the
+ * payload is still the end-to-end ciphertext followed by the OHB.  For a
+ * stream with a double policy the inner layer is not decrypted.
+ *
+ * @param ctx is the SRTP session which applies to the packet.
+ *
+ * @param srtp is a pointer to the SRTP packet.
+ *
+ * @param srtp_len is the length in octets of the SRTP packet.
+ *
+ * @param rtp is a pointer to the output buffer, which can be the same as
+ * srtp.
+ *
+ * @param rtp_len is a pointer to the length of the rtp buffer before the
+ * function call, and of the packet after the call.
+ *
+ * @return
+ *    - srtp_err_status_ok          the hop-by-hop layer is valid
+ *    - srtp_err_status_parse_err   the decrypted packet does not end in an
+ *                                  OHB
+ *    - srtp_err_status_bad_param   the stream does not use an AEAD cipher
+ *    - @e other                    as returned by srtp_unprotect()
+ */
+srtp_err_status_t srtp_unprotect_outer(srtp_t ctx,
+                                       const uint8_t *srtp,
+                                       size_t srtp_len,
+                                       uint8_t *rtp,
+                                       size_t *rtp_len);
+
+/**
+ * @brief srtp_double_rewrite_header() changes the payload type, sequence
+ * number and marker bit of a packet whose hop-by-hop layer was removed.
+ *
+ * The end-to-end layer of RFC 8723 double encryption authenticates the
+ * header fields that the sender set.  A media distributor that changes
+ * them has to keep the original values in the original header block (OHB)
+ * at the end of the packet, so that the receiving endpoint can check the
+ * end-to-end tag.  The function call srtp_double_rewrite_header(rtp,
+ * rtp_len, new_len, payload_type, seq, marker) sets the header fields of
+ * the packet at rtp and records in its OHB the original value of every
+ * field that changes and that the OHB does not hold already; values that
+ * are already recorded are kept.
+ *
+ * @param rtp is a pointer to a packet as returned by srtp_unprotect_outer().
+ *
+ * @param rtp_len is the length in octets of the packet.
+ *
+ * @param new_len is a pointer to the size of the buffer at rtp before the
+ * call, and to the length of the packet after it; the OHB grows by at most
+ * three octets.
+ *
+ * @param payload_type is the new payload type.
+ *
+ * @param seq is the new sequence number, in host order.
+ *
+ * @param marker is the new marker bit.
+ *
+ * @return
+ *    - srtp_err_status_ok            the header was rewritten
+ *    - srtp_err_status_parse_err     the packet does not end in an OHB
+ *    - srtp_err_status_buffer_small  the buffer has no room for the OHB
+ *    - srtp_err_status_bad_param     the payload type has more than 7 bits
+ */
+srtp_err_status_t srtp_double_rewrite_header(uint8_t *rtp,
+                                             size_t rtp_len,
+                                             size_t *new_len,
+                                             uint8_t payload_type,
+                                             uint16_t seq,
+                                             bool marker);
+
 /**
  * @brief srtp_create() allocates and initializes an SRTP session.
  *
@@ -532,7 +817,8 @@ srtp_err_status_t srtp_stream_add(srtp_t session, const srtp_policy_t *policy);
  *
  * The function call srtp_stream_remove(session, ssrc) removes
  * the SRTP stream with the SSRC value ssrc from the SRTP session
- * context given by the argument session.
+ * context given by the argument session.  The session's cache of
+ * recently derived keys is zeroized along with the stream.
  *
  * @param session is the SRTP session from which the stream
  * will be removed.
@@ -554,6 +840,106 @@ srtp_err_status_t srtp_stream_add(srtp_t session, const srtp_policy_t *policy);
  */
 srtp_err_status_t srtp_stream_remove(srtp_t session, uint32_t ssrc);
 
+/**
+ * @brief srtp_set_max_streams() limits the number of streams that are
+ * created from the template of a session.
+ *
+ * A session with an ssrc_any_inbound or ssrc_any_outbound policy creates a
+ * stream for every new SSRC that it protects or unprotects.  Once the
+ * session has max_streams of these streams, the least recently used one is
+ * removed before another is created.  Streams that were added with their
+ * own policy are never removed.  Recent use is measured with the clock of
+ * srtp_expire_idle_streams(); streams that were used since the same call
+ * are removed in no particular order.
+ *
+ * @param session is the SRTP session.
+ *
+ * @param max_streams is the largest number of streams created from the
+ * template that the session keeps, or 0 for no limit, the default.
+ *
+ * @return
+ *    - srtp_err_status_ok     on success.
+ *    - [other]           otherwise.
+ *
+ */
+srtp_err_status_t srtp_set_max_streams(srtp_t session, size_t max_streams);
+
+/**
+ * @brief srtp_expire_idle_streams() removes the streams created from the
+ * template of a session that have been idle for a while.
+ *
+ * The function call srtp_expire_idle_streams(session, now, idle) removes
+ * each stream that was created from the template of the session and has
+ * not protected or unprotected a packet for at least idle, and sets the
+ * clock of the session to now.  Packets only mark their stream as used
+ * since the last call, so the function is meant to be called periodically,
+ * and a stream is removed between idle and idle plus one period after its
+ * last packet.  now and idle are in any unit, e.g. milliseconds, as long as
+ * now never goes back.
+ *
+ * @param session is the SRTP session.
+ *
+ * @param now is the current time.
+ *
+ * @param idle is how long a stream may go unused before it is removed.
+ *
+ * @return
+ *    - srtp_err_status_ok     on success.
+ *    - [other]           otherwise.
+ *
+ */
+srtp_err_status_t srtp_expire_idle_streams(srtp_t session,
+                                           uint64_t now,
+                                           uint64_t idle);
+
+/**
+ * @brief srtp_reserve_streams() prepares a session to create streams for
+ * new SSRCs without allocating memory.
+ *
+ * A session with an ssrc_any_inbound or ssrc_any_outbound policy creates a
+ * stream from its template for the first packet of every new SSRC, which
+ * allocates the stream and may grow the stream list.  After
+ * srtp_reserve_streams(session, num_streams), the session keeps up to
+ * num_streams spare streams cloned from the template, and room for as
+ * many in its stream list, so that srtp_protect() and srtp_unprotect() take
+ * a spare instead.  A stream created from the template that is removed,
+ * expired or evicted becomes a spare again, and the session replaces its
+ * spares when the template changes.
+ *
+ * @param session is the SRTP session.
+ *
+ * @param num_streams is the number of spare streams to keep, or 0 to stop
+ * keeping spares, the default.
+ *
+ * @return
+ *    - srtp_err_status_ok           on success.
+ *    - srtp_err_status_alloc_fail   if the spares could not be allocated.
+ *    - [other]                 otherwise.
+ *
+ */
+srtp_err_status_t srtp_reserve_streams(srtp_t session, size_t num_streams);
+
+/**
+ * @brief srtp_set_no_packet_alloc() makes srtp_protect() and
+ * srtp_unprotect() fail rather than allocate memory.
+ *
+ * Once no_alloc is set, a packet with a new SSRC for which the session has
+ * no spare stream, see srtp_reserve_streams(), is rejected with
+ * srtp_err_status_alloc_fail instead of creating a stream from the
+ * template.
+ *
+ * @param session is the SRTP session.
+ *
+ * @param no_alloc is true to forbid allocations on the packet path, or
+ * false to allow them, the default.
+ *
+ * @return
+ *    - srtp_err_status_ok     on success.
+ *    - [other]           otherwise.
+ *
+ */
+srtp_err_status_t srtp_set_no_packet_alloc(srtp_t session, bool no_alloc);
+
 /**
  * @brief srtp_update() updates all streams in the session.
  *
@@ -562,6 +948,15 @@ srtp_err_status_t srtp_stream_remove(srtp_t session, uint32_t ssrc);
  * and key. The existing ROC value of all streams will be
  * preserved.
  *
+ * All the new keys of a stream are derived before any of them is
+ * installed, so a stream whose keys cannot be derived keeps its old keys
+ * and the update returns the error.  Only if installing the derived keys
+ * fails, the stream cannot be left with a mix of old and new keys and is
+ * removed; for a wildcard policy that is the template together with the
+ * streams cloned from it.  The session's cache of recently derived keys
+ * is zeroized before the new keys are derived, so no copy of the old keys
+ * is kept.
+ *
  * @param session is the SRTP session that contains the streams
  *        to be updated.
  *
@@ -586,7 +981,10 @@ srtp_err_status_t srtp_update(srtp_t session, const srtp_policy_t *policy);
  * The function call srtp_stream_update(session, policy) updates
  * the stream(s) in the session that match applying the given
  * policy and key. The existing ROC value of all stream(s) will
- * be preserved.
+ * be preserved.  As with srtp_update(), a stream whose new keys cannot be
+ * derived keeps its old keys, one that fails part way through installing
+ * them is removed, and the cache of recently derived keys is zeroized
+ * first.
  *
  * @param session is the SRTP session that contains the streams
  *        to be updated.
@@ -983,6 +1381,49 @@ void srtp_crypto_policy_set_aes_gcm_128_16_auth(srtp_crypto_policy_t *p);
  */
 void srtp_crypto_policy_set_aes_gcm_256_16_auth(srtp_crypto_policy_t *p);
 
+/**
+ * @brief srtp_crypto_policy_set_double_aes_gcm_128_16_auth() sets a crypto
+ * policy structure to the RFC 8723 double encryption policy
+ * DOUBLE_AEAD_AES_128_GCM_AEAD_AES_128_GCM
+ *
+ * @param p is a pointer to the policy structure to be set
+ *
+ * The function call srtp_crypto_policy_set_double_aes_gcm_128_16_auth(&p)
+ * sets the srtp_crypto_policy_t at location p to protect RTP packets twice
+ * with AES-128 Galois Counter Mode and a 16 octet auth tag: an end-to-end
+ * (inner) layer over the payload and the header without its extensions,
+ * and a hop-by-hop (outer) layer over the whole packet, which a media
+ * distributor can remove and reapply with srtp_unprotect_outer() and
+ * srtp_protect_outer().  The cipher key length covers both layers.
+ *
+ * The master key of a stream with this policy is the inner key followed
+ * by the outer key, then the inner salt followed by the outer salt, and
+ * the stream has a single master key.  The policy only applies to RTP;
+ * RTCP is protected with the hop-by-hop key alone, using
+ * srtp_crypto_policy_set_aes_gcm_128_16_auth().
+ *
+ * @return void.
+ *
+ */
+void srtp_crypto_policy_set_double_aes_gcm_128_16_auth(
+    srtp_crypto_policy_t *p);
+
+/**
+ * @brief srtp_crypto_policy_set_double_aes_gcm_256_16_auth() sets a crypto
+ * policy structure to the RFC 8723 double encryption policy
+ * DOUBLE_AEAD_AES_256_GCM_AEAD_AES_256_GCM
+ *
+ * @param p is a pointer to the policy structure to be set
+ *
+ * As srtp_crypto_policy_set_double_aes_gcm_128_16_auth(), with AES-256
+ * Galois Counter Mode for both layers.
+ *
+ * @return void.
+ *
+ */
+void srtp_crypto_policy_set_double_aes_gcm_256_16_auth(
+    srtp_crypto_policy_t *p);
+
 /**
  * @brief srtp_dealloc() deallocates storage for an SRTP session
  * context.
@@ -992,6 +1433,10 @@ void srtp_crypto_policy_set_aes_gcm_256_16_auth(srtp_crypto_policy_t *p);
  * than one time for each of the contexts allocated by the function
  * srtp_create().
  *
+ * If the session is attached to a worker pool, srtp_dealloc() first waits
+ * for the packets it submitted to be processed, and their completions that
+ * have not been collected report a NULL session.
+ *
  * @param s is the srtp_t for the session to be deallocated.
  *
  * @return
@@ -1013,7 +1458,9 @@ typedef enum {
     srtp_profile_null_sha1_80 = 5,
     srtp_profile_null_sha1_32 = 6,
     srtp_profile_aead_aes_128_gcm = 7,
-    srtp_profile_aead_aes_256_gcm = 8
+    srtp_profile_aead_aes_256_gcm = 8,
+    srtp_profile_double_aead_aes_128_gcm_aead_aes_128_gcm = 9,
+    srtp_profile_double_aead_aes_256_gcm_aead_aes_256_gcm = 10
 } srtp_profile_t;
 
 /**
@@ -1256,6 +1703,200 @@ void srtp_set_user_data(srtp_t ctx, void *data);
  */
 void *srtp_get_user_data(srtp_t ctx);
 
+/**
+ * @}
+ */
+
+/**
+ * @defgroup SRTPasync Asynchronous packet processing
+ * @ingroup  SRTP
+ *
+ * @brief A worker pool protects and unprotects packets on its own threads.
+ *
+ * An application whose I/O threads should not spend their time in the
+ * ciphers and authentication functions creates a worker pool with
+ * srtp_worker_pool_create(), attaches sessions to it with
+ * srtp_set_worker_pool(), and submits packets with srtp_protect_async()
+ * and srtp_unprotect_async().  The results are collected with
+ * srtp_poll_completions().
+ *
+ * The packets of one session use its streams in the order they were
+ * submitted, so the packet indices and replay databases of the streams
+ * are updated exactly as by srtp_protect() and srtp_unprotect(), and
+ * their completions are reported in that order.  Only that bookkeeping is
+ * serialized: the packets of streams using AES-ICM and HMAC-SHA1 without
+ * MKI, header extension encryption, cryptex or a keystream cache are
+ * encrypted and authenticated, or verified and decrypted, in parallel,
+ * within a stream as well as across streams and sessions.  Any other
+ * packet, including the first packet of a stream cloned from a template,
+ * is processed whole once the packets of its session submitted before it
+ * are done.  A received packet that is rejected after it was decrypted,
+ * e.g. a replay of a packet that was still in the pool, has its payload
+ * wiped.  While a session has packets in the pool it must not be used in
+ * any other way.
+ *
+ * The worker pool needs POSIX threads; without them
+ * srtp_worker_pool_create() returns srtp_err_status_fail.
+ *
+ * @{
+ */
+
+typedef struct srtp_worker_pool_ctx_t_ srtp_worker_pool_ctx_t;
+
+/**
+ * @brief An srtp_worker_pool_t is a pointer to a pool of threads that
+ * process the packets submitted with srtp_protect_async() and
+ * srtp_unprotect_async().
+ */
+typedef srtp_worker_pool_ctx_t *srtp_worker_pool_t;
+
+/**
+ * @brief srtp_completion_t reports the result of a packet submitted to a
+ * worker pool.
+ */
+typedef struct srtp_completion_t {
+    srtp_t session;           /**< The session the packet was submitted to, */
+                              /**< or NULL if it has left the pool since.   */
+    void *user_data;          /**< The user_data it was submitted with.     */
+    uint8_t *packet;          /**< The output buffer it was submitted with. */
+    size_t len;               /**< The length of the output packet.         */
+    srtp_err_status_t status; /**< What srtp_protect() or srtp_unprotect()  */
+                              /**< would have returned.                     */
+} srtp_completion_t;
+
+/**
+ * @brief srtp_worker_pool_create() starts a pool of worker threads.
+ *
+ * @param pool receives the new pool.
+ *
+ * @param num_workers is the number of threads, at least 1.
+ *
+ * @param capacity is the number of packets that can be in the pool at
+ * once, counting those whose completions have not been collected yet.
+ *
+ * @return
+ *    - srtp_err_status_ok           on success.
+ *    - srtp_err_status_bad_param    if num_workers or capacity is 0.
+ *    - srtp_err_status_alloc_fail   if the pool could not be allocated.
+ *    - srtp_err_status_fail         if the threads could not be started, or
+ *                                   the platform has no threads.
+ */
+srtp_err_status_t srtp_worker_pool_create(srtp_worker_pool_t *pool,
+                                          size_t num_workers,
+                                          size_t capacity);
+
+/**
+ * @brief srtp_worker_pool_dealloc() stops the threads of a pool and frees
+ * it.
+ *
+ * Every session must have been detached from the pool, or deallocated,
+ * before, so that all the packets submitted to it have been processed;
+ * completions that were not collected are discarded.
+ *
+ * @param pool is the pool to free.
+ *
+ * @return
+ *    - srtp_err_status_ok     on success.
+ *    - srtp_err_status_fail   if a session is still attached to the pool.
+ */
+srtp_err_status_t srtp_worker_pool_dealloc(srtp_worker_pool_t pool);
+
+/**
+ * @brief srtp_set_worker_pool() attaches a session to a worker pool.
+ *
+ * Attaching a session to another pool, or to NULL to detach it, first
+ * waits until the packets it submitted have been processed; the
+ * completions of those packets that have not been collected yet then
+ * report a NULL session.  srtp_dealloc() detaches the session it frees,
+ * so that no completion points to a freed session.
+ *
+ * @param session is the session.
+ *
+ * @param pool is the pool that processes the packets of the session, or
+ * NULL.
+ *
+ * @return
+ *    - srtp_err_status_ok     on success.
+ *    - [other]           otherwise.
+ */
+srtp_err_status_t srtp_set_worker_pool(srtp_t session,
+                                       srtp_worker_pool_t pool);
+
+/**
+ * @brief srtp_protect_async() submits an RTP packet to be protected by the
+ * worker pool of a session.
+ *
+ * The packet is protected as by srtp_protect(ctx, rtp, rtp_len, srtp,
+ * &len, mki_index), where len starts as srtp_len, and the result is
+ * reported by srtp_poll_completions().  Neither buffer may be touched
+ * until then; they may be the same buffer.
+ *
+ * @param ctx is a session attached to a worker pool.
+ *
+ * @param user_data is passed back in the completion.
+ *
+ * @return
+ *    - srtp_err_status_ok           if the packet was submitted.
+ *    - srtp_err_status_bad_param    if the session has no worker pool.
+ *    - srtp_err_status_alloc_fail   if the pool is at its capacity.
+ */
+srtp_err_status_t srtp_protect_async(srtp_t ctx,
+                                     const uint8_t *rtp,
+                                     size_t rtp_len,
+                                     uint8_t *srtp,
+                                     size_t srtp_len,
+                                     size_t mki_index,
+                                     void *user_data);
+
+/**
+ * @brief srtp_unprotect_async() submits an SRTP packet to be unprotected
+ * by the worker pool of a session.
+ *
+ * The packet is unprotected as by srtp_unprotect(ctx, srtp, srtp_len, rtp,
+ * &len), where len starts as rtp_len, and the result is reported by
+ * srtp_poll_completions().  Neither buffer may be touched until then;
+ * they may be the same buffer.
+ *
+ * @param ctx is a session attached to a worker pool.
+ *
+ * @param user_data is passed back in the completion.
+ *
+ * @return
+ *    - srtp_err_status_ok           if the packet was submitted.
+ *    - srtp_err_status_bad_param    if the session has no worker pool.
+ *    - srtp_err_status_alloc_fail   if the pool is at its capacity.
+ */
+srtp_err_status_t srtp_unprotect_async(srtp_t ctx,
+                                       const uint8_t *srtp,
+                                       size_t srtp_len,
+                                       uint8_t *rtp,
+                                       size_t rtp_len,
+                                       void *user_data);
+
+/**
+ * @brief srtp_poll_completions() takes the results of processed packets
+ * from a worker pool.
+ *
+ * @param pool is the worker pool.
+ *
+ * @param completions receives the results; those of one session are in
+ * the order its packets were submitted.
+ *
+ * @param num_completions is the number of entries in completions on
+ * input, and the number of results taken on output.
+ *
+ * @param wait is true to block until there is at least one result, unless
+ * the pool has no packets at all.
+ *
+ * @return
+ *    - srtp_err_status_ok          on success.
+ *    - srtp_err_status_bad_param   if pool is NULL.
+ */
+srtp_err_status_t srtp_poll_completions(srtp_worker_pool_t pool,
+                                        srtp_completion_t *completions,
+                                        size_t *num_completions,
+                                        bool wait);
+
 /**
  * @}
  */
@@ -1281,6 +1922,10 @@ void *srtp_get_user_data(srtp_t ctx);
  * function to NULL, in which case all events will just be silently
  * ignored.
  *
+ * Alternatively, a session can queue its events with
+ * srtp_set_event_queue(), for the application to collect with
+ * srtp_poll_events() outside the data path.
+ *
  * @{
  */
 
@@ -1351,6 +1996,65 @@ typedef void(srtp_event_handler_func_t)(srtp_event_data_t *data);
  */
 srtp_err_status_t srtp_install_event_handler(srtp_event_handler_func_t func);
 
+/**
+ * @brief srtp_set_event_queue() makes a session queue its events.
+ *
+ * Once a session has an event queue, its events are no longer passed to
+ * the handler from inside srtp_protect(), srtp_unprotect() and their RTCP
+ * counterparts.  They are written to a bounded ring instead, which the
+ * application drains with srtp_poll_events(), typically from a control
+ * thread while another thread handles packets.  An event that is still
+ * waiting in the queue for the same stream is not queued again, so a
+ * queue with room for three events per stream never overflows; events
+ * that do not fit are dropped.
+ *
+ * Replacing or removing the queue discards the events in it, and must not
+ * be done while packets are being processed in the session.
+ *
+ * @param session is the session whose events are queued.
+ *
+ * @param capacity is the number of events the queue holds, rounded up to a
+ *        power of two, or 0 to remove the queue and pass events to the
+ *        handler again.
+ *
+ * @return srtp_err_status_ok on success, srtp_err_status_alloc_fail if the
+ *         queue could not be allocated, or srtp_err_status_fail if the
+ *         platform lacks the atomic operations the queue needs.
+ */
+srtp_err_status_t srtp_set_event_queue(srtp_t session, size_t capacity);
+
+/**
+ * @brief srtp_poll_events() takes events from a session's event queue.
+ *
+ * @param session is a session set up with srtp_set_event_queue().
+ *
+ * @param events receives the events, oldest first.
+ *
+ * @param num_events is the number of entries in events on input, and the
+ *        number of events taken on output.
+ *
+ * @return srtp_err_status_ok on success, or srtp_err_status_bad_param if
+ *         the session has no event queue.
+ */
+srtp_err_status_t srtp_poll_events(srtp_t session,
+                                   srtp_event_data_t *events,
+                                   size_t *num_events);
+
+/**
+ * @brief srtp_dispatch_events() passes queued events to the handler.
+ *
+ * Takes every event from the session's event queue and calls the handler
+ * installed with srtp_install_event_handler() with it, on the calling
+ * thread.  This lets an application written for the handler move event
+ * handling off the data path without changing the handler.
+ *
+ * @param session is a session set up with srtp_set_event_queue().
+ *
+ * @return srtp_err_status_ok on success, or srtp_err_status_bad_param if
+ *         the session has no event queue.
+ */
+srtp_err_status_t srtp_dispatch_events(srtp_t session);
+
 /**
  * @brief Returns the version string of the library.
  *
@@ -1424,6 +2128,69 @@ typedef void(srtp_log_handler_func_t)(srtp_log_level_t level,
 srtp_err_status_t srtp_install_log_handler(srtp_log_handler_func_t func,
                                            void *data);
 
+/**
+ * @brief srtp_set_log_deferred() moves the formatting of log messages out
+ * of the threads that report them.
+ *
+ * In deferred mode a log message is not formatted when it is reported.
+ * Its level, debug module, format string and arguments are copied into a
+ * fixed size record in a bounded lock-free ring, and srtp_flush_log()
+ * formats the records and passes them to the log handler, typically from
+ * a thread dedicated to logging.  Reporting a message never blocks and
+ * never calls the handler.  A message is dropped if the ring is full, or
+ * if its debug module has already reported max_per_second messages in the
+ * current second; see srtp_get_log_drops().
+ *
+ * Must not be called while other threads may be logging, so typically
+ * once at start up.  Records still in the ring are discarded.
+ *
+ * @param num_records is the size of the ring, rounded up to a power of
+ *        two, or 0 to go back to formatting messages as they are reported.
+ *
+ * @param max_per_second is the number of messages each debug module may
+ *        report per second, or 0 for no limit.
+ *
+ * @return srtp_err_status_ok on success, srtp_err_status_alloc_fail if the
+ *         ring could not be allocated, or srtp_err_status_fail if the
+ *         platform lacks the atomic operations the ring needs.
+ */
+srtp_err_status_t srtp_set_log_deferred(size_t num_records,
+                                        uint32_t max_per_second);
+
+/**
+ * @brief srtp_flush_log() formats the log messages recorded in deferred
+ * mode and passes them to the log handler.
+ *
+ * Only one thread at a time may call srtp_flush_log().
+ *
+ * @param num_records is set to the number of messages passed on, and may
+ *        be NULL.
+ *
+ * @return srtp_err_status_ok on success, or srtp_err_status_bad_param if
+ *         logging is not deferred.
+ */
+srtp_err_status_t srtp_flush_log(size_t *num_records);
+
+/**
+ * @brief srtp_get_log_drops() returns the number of log messages of a
+ * debug module that deferred mode dropped.
+ *
+ * @param mod_name is the name of a debug module, see
+ *        srtp_list_debug_modules(), or NULL for the messages that do not
+ *        belong to a debug module, such as event reports.
+ *
+ * @param rate_limited is set to the number of messages dropped because
+ *        the module reached its limit per second.
+ *
+ * @param queue_full is set to the number of messages dropped because the
+ *        ring was full.
+ *
+ * @return srtp_err_status_ok on success.
+ */
+srtp_err_status_t srtp_get_log_drops(const char *mod_name,
+                                     uint64_t *rate_limited,
+                                     uint64_t *queue_full);
+
 /**
  * @brief srtp_get_protect_trailer_length(session, use_mki, mki_index, length)
  *
@@ -1481,6 +2248,283 @@ srtp_err_status_t srtp_stream_get_roc(srtp_t session,
                                       uint32_t ssrc,
                                       uint32_t *roc);
 
+/**
+ * @brief srtp_stream_add_master_key(session, ssrc, key)
+ *
+ * Adds a master key to the stream with the given SSRC, which must use
+ * MKIs.  The session keys are derived before the key is made available,
+ * and the keys already in the stream are not touched, so this can be used
+ * to install the next key while packets protected with the current one
+ * are still being processed.  The new key is accepted by srtp_unprotect()
+ * and srtp_unprotect_rtcp() as soon as this returns; a sender switches to
+ * it by passing its MKI index, see srtp_stream_get_mki_index(), to
+ * srtp_protect().
+ *
+ * The MKI of key must have the mki_size of the stream's policy and must
+ * not already be in use.  Streams that were created from a wildcard
+ * policy share their keys with it and cannot have keys added.
+ *
+ * returns err_status_ok on success, srtp_err_status_bad_param if there is
+ * no such stream, it does not use MKIs, already has
+ * SRTP_MAX_NUM_MASTER_KEYS keys or already has a key with this MKI
+ *
+ */
+srtp_err_status_t srtp_stream_add_master_key(srtp_t session,
+                                             uint32_t ssrc,
+                                             const srtp_master_key_t *key);
+
+/**
+ * @brief srtp_stream_remove_master_key(session, ssrc, mki_id)
+ *
+ * Retires the master key with the given MKI from the stream with the
+ * given SSRC; packets carrying that MKI are rejected from then on.  The
+ * other keys are kept, but those that came after the removed one move
+ * down by one MKI index.  The session keys derived from the removed key
+ * are zeroized, as is the session's cache of recently derived keys.
+ *
+ * returns err_status_ok on success, srtp_err_status_bad_mki if the stream
+ * has no key with this MKI, srtp_err_status_bad_param if there is no such
+ * stream, it does not use MKIs or this is its only key
+ *
+ */
+srtp_err_status_t srtp_stream_remove_master_key(srtp_t session,
+                                                uint32_t ssrc,
+                                                const uint8_t *mki_id);
+
+/**
+ * @brief srtp_stream_get_mki_index(session, ssrc, mki_id, mki_index)
+ *
+ * Looks up the MKI index, as passed to srtp_protect(), of the master key
+ * with the given MKI in the stream with the given SSRC.
+ *
+ * returns err_status_ok on success, srtp_err_status_bad_mki if the stream
+ * has no key with this MKI, srtp_err_status_bad_param if there is no such
+ * stream or it does not use MKIs
+ *
+ */
+srtp_err_status_t srtp_stream_get_mki_index(srtp_t session,
+                                            uint32_t ssrc,
+                                            const uint8_t *mki_id,
+                                            size_t *mki_index);
+
+/**
+ * @brief srtp_stream_share_replay_window(session, ssrc, peer)
+ *
+ * Makes the stream with the given SSRC in session use the same SRTP replay
+ * window as the stream with that SSRC in peer.  The shared window is
+ * updated with atomic operations, so srtp_unprotect() can run on the two
+ * sessions in different threads at the same time and a packet is still
+ * accepted by only one of them.  This lets the packets of one SSRC be
+ * spread over several receive threads, each with its own session holding
+ * the same keys.  Any number of sessions can share a window by sharing it
+ * with the same peer; the window size is that of the stream in peer.
+ *
+ * The window starts out empty, so this should be called before the
+ * streams receive packets.  It is kept across srtp_update() and released
+ * when the last stream using it is removed.  SRTCP replay protection is
+ * not shared.
+ *
+ * returns err_status_ok on success, srtp_err_status_bad_param if either
+ * stream is not found or both are the same, srtp_err_status_fail if the
+ * platform does not provide the needed atomic operations
+ *
+ */
+srtp_err_status_t srtp_stream_share_replay_window(srtp_t session,
+                                                  uint32_t ssrc,
+                                                  srtp_t peer);
+
+/**
+ * @brief srtp_stream_precompute(session, ssrc, mki_index, num_packets,
+ * max_len)
+ *
+ * Generates, ahead of time, the AES counter mode keystream for the next
+ * num_packets RTP packets of the sending stream with the given SSRC, so that
+ * srtp_protect() only has to XOR it into the payload.  The packets are those
+ * following the last one protected, and up to max_len octets of payload
+ * (everything after the RTP header and header extension) are covered.  The
+ * keystream for an index is used by at most one srtp_protect() call; calling
+ * this function again only fills in the entries that have been used.
+ *
+ * Packets that use extension header encryption or cryptex, and payloads
+ * longer than max_len, are processed as usual.  Calling the function with
+ * num_packets or max_len set to 0 releases the keystream.
+ *
+ * The function must not run concurrently with any other call on the session,
+ * e.g. it can be called from the pacing thread between packets.
+ *
+ * returns err_status_ok on success, srtp_err_status_bad_param if there is no
+ * stream found, the stream does not use AES counter mode encryption, max_len
+ * is larger than the largest RTP payload (65515 octets) or the keystream
+ * would not fit in memory, srtp_err_status_bad_mki if the MKI index is
+ * invalid
+ *
+ */
+srtp_err_status_t srtp_stream_precompute(srtp_t session,
+                                         uint32_t ssrc,
+                                         size_t mki_index,
+                                         size_t num_packets,
+                                         size_t max_len);
+
+/**
+ * @brief srtp_set_serializable() makes the streams of a session keep their
+ * session keys for srtp_session_serialize().
+ *
+ * The session keys are otherwise only held inside the ciphers and auth
+ * functions, and a stream cannot be serialized.  The setting applies to
+ * the streams added, or keyed by srtp_update(), after it is made: a
+ * session that is to be serialized is created without a policy, made
+ * serializable, and then given its streams with srtp_stream_add().
+ * Sessions created by srtp_session_restore() and streams taken with
+ * srtp_stream_store_take() keep their session keys.
+ *
+ * @param session is the SRTP session.
+ *
+ * @param serializable is true to keep the session keys, or false not to,
+ * the default.
+ *
+ * @return
+ *    - srtp_err_status_ok     on success.
+ *    - [other]           otherwise.
+ *
+ */
+srtp_err_status_t srtp_set_serializable(srtp_t session, bool serializable);
+
+/**
+ * @brief srtp_session_serialize(session, buf, len)
+ *
+ * Writes the state of all of the streams of a session, and of its template
+ * stream, to buf as a versioned binary blob from which
+ * srtp_session_restore() recreates the session, e.g. on a standby host that
+ * takes over the media of a failed one.  The blob holds, for each stream,
+ * the SSRC, direction, session keys derived from the master keys, the SRTP
+ * packet index and replay window, the SRTCP replay window, the key usage
+ * counters and the MKIs.  The master keys themselves are not included.
+ *
+ * The blob contains session keys: it must be protected like the master keys
+ * it was derived from.  The event handler, the user data, and keystream
+ * generated by srtp_stream_precompute() are not part of the state.
+ *
+ * On input *len is the size of buf; on return it is the size of the blob.
+ * If buf is NULL only the size is returned.
+ *
+ * The function must not run concurrently with any other call on the session.
+ *
+ * returns err_status_ok on success, srtp_err_status_buffer_small if buf is
+ * too small for the blob, in which case *len holds the size needed,
+ * srtp_err_status_bad_param if a stream did not keep its session keys, see
+ * srtp_set_serializable(), or is a double stream
+ *
+ */
+srtp_err_status_t srtp_session_serialize(srtp_t session,
+                                         uint8_t *buf,
+                                         size_t *len);
+
+/**
+ * @brief srtp_session_restore(session, buf, len)
+ *
+ * Allocates a new session with the streams that were written to buf by
+ * srtp_session_serialize().  The streams are keyed directly with the session
+ * keys in the blob, without running the key derivation, and continue from
+ * the packet indices and replay windows that they had.  The session is
+ * freed with srtp_dealloc().
+ *
+ * A sending stream continues from the packet index in the blob.  Restoring
+ * it from a blob older than its last srtp_protect() call makes it use those
+ * packet indices again, and so encrypt different packets with the same
+ * keystream; only the latest blob of a sending stream may be restored, and
+ * only once.  A receiving stream restored from an older blob accepts
+ * packets that it had already seen.
+ *
+ * Only the streams are restored.  The limit set by srtp_set_max_streams(),
+ * the event queue, the streams reserved by srtp_reserve_streams() and the
+ * other session settings are not part of the blob and have to be set up
+ * again.  The session is serializable, see srtp_set_serializable().
+ *
+ * returns err_status_ok on success, srtp_err_status_parse_err if buf does not
+ * hold a valid blob, srtp_err_status_alloc_fail if memory could not be
+ * allocated
+ *
+ */
+srtp_err_status_t srtp_session_restore(srtp_t *session,
+                                       const uint8_t *buf,
+                                       size_t len);
+
+/**
+ * @brief srtp_stream_store_size(num_slots, slot_len)
+ *
+ * Returns the size of the memory region that srtp_stream_store_init() needs
+ * for a stream store of num_slots streams of up to slot_len octets of state
+ * each.  A stream with one master key and replay windows of the default
+ * size takes less than 512 octets.
+ *
+ */
+size_t srtp_stream_store_size(size_t num_slots, size_t slot_len);
+
+/**
+ * @brief srtp_stream_store_init(region, num_slots, slot_len)
+ *
+ * Formats region as an empty stream store.  A stream store holds the state
+ * of streams that are handed from one session to another, typically between
+ * processes: the region is then memory that they share, e.g. from mmap()
+ * with MAP_SHARED.  The store holds no pointers, so each process may map
+ * it at a different address.
+ *
+ * returns err_status_ok on success, srtp_err_status_bad_param if a
+ * parameter is not valid
+ *
+ */
+srtp_err_status_t srtp_stream_store_init(void *region,
+                                         size_t num_slots,
+                                         size_t slot_len);
+
+/**
+ * @brief srtp_stream_store_put(region, session, ssrc, owner)
+ *
+ * Moves the stream with the given SSRC from session to the stream store in
+ * region.  The stream, its packet index, replay windows and session keys
+ * are written as with srtp_session_serialize(), and it is removed from the
+ * session.  owner is a non-zero identifier of the caller, e.g. a worker
+ * process number; a stream that was taken with srtp_stream_store_take() can
+ * only be put back by the owner that took it.  If the stream does not fit,
+ * the store keeps the state it held before.  If the stream cannot be
+ * removed from the session, its state is wiped from the store, so that it
+ * cannot be taken elsewhere while it may still be in use.
+ *
+ * The store may be used by several threads and processes at once.  It needs
+ * the atomic builtins of GCC or clang.
+ *
+ * returns err_status_ok on success, srtp_err_status_no_ctx if there is no
+ * stream found, srtp_err_status_bad_param if another owner holds the
+ * stream or it did not keep its session keys, see srtp_set_serializable(),
+ * srtp_err_status_alloc_fail if the store is full,
+ * srtp_err_status_buffer_small if the state does not fit in a slot
+ *
+ */
+srtp_err_status_t srtp_stream_store_put(void *region,
+                                        srtp_t session,
+                                        uint32_t ssrc,
+                                        uint32_t owner);
+
+/**
+ * @brief srtp_stream_store_take(region, session, ssrc, owner)
+ *
+ * Takes the stream with the given SSRC from the stream store in region and
+ * adds it to session, keyed with its session keys and continuing from its
+ * packet index and replay windows, without running the key derivation.  The
+ * stream belongs to owner until it is put back with srtp_stream_store_put(),
+ * and its keys are cleared from the store meanwhile.  The stream keeps its
+ * session keys so that it can be put back.
+ *
+ * returns err_status_ok on success, srtp_err_status_no_ctx if the store does
+ * not hold the stream, e.g. because another owner has taken it,
+ * srtp_err_status_bad_param if session already has a stream with the SSRC
+ *
+ */
+srtp_err_status_t srtp_stream_store_take(void *region,
+                                         srtp_t session,
+                                         uint32_t ssrc,
+                                         uint32_t owner);
+
 /**
  * @}
  */
@@ -77,6 +77,13 @@ typedef struct srtp_stream_list_ctx_t_ *srtp_stream_list_t;
  */
 srtp_stream_t srtp_get_stream(srtp_t srtp, uint32_t ssrc);
 
+/*
+ * srtp_stream_compile(stream) binds the RTP packet handlers specialized
+ * for the stream's current configuration, or clears them if there are
+ * none; it must be called whenever that configuration changes
+ */
+void srtp_stream_compile(srtp_stream_ctx_t *stream);
+
 /*
  * libsrtp internal datatypes
  */
@@ -89,43 +96,128 @@ typedef enum direction_t {
 /*
  * srtp_session_keys_t will contain the encryption, hmac, salt keys
  * for both SRTP and SRTCP.  The session keys will also contain the
- * MKI ID which is used to identify the session keys.
+ * MKI ID which is used to identify the session keys.  The fields used
+ * for every RTP packet come first.
  */
 typedef struct srtp_session_keys_t {
     srtp_cipher_t *rtp_cipher;
-    srtp_cipher_t *rtp_xtn_hdr_cipher;
     srtp_auth_t *rtp_auth;
-    srtp_cipher_t *rtcp_cipher;
-    srtp_auth_t *rtcp_auth;
+    srtp_key_limit_ctx_t *limit;
     uint8_t salt[SRTP_AEAD_SALT_LEN];
     uint8_t c_salt[SRTP_AEAD_SALT_LEN];
+    srtp_cipher_t *rtp_xtn_hdr_cipher;
+    srtp_cipher_t *rtcp_cipher;
+    srtp_auth_t *rtcp_auth;
     uint8_t *mki_id;
-    srtp_key_limit_ctx_t *limit;
+    struct srtp_kdf_output_t *derived; /* for srtp_session_serialize() */
 } srtp_session_keys_t;
 
+/*
+ * SRTP_MKI_INDEX_SIZE is the number of buckets in the hash table that maps
+ * an MKI value to its position in session_keys, see
+ * srtp_get_session_keys_for_packet(); it is a power of two with room for
+ * twice the maximum number of master keys so that probe chains stay short
+ */
+#define SRTP_MKI_INDEX_SIZE (2 * SRTP_MAX_NUM_MASTER_KEYS)
+
+/*
+ * srtp_keystream_cache_t holds AES-ICM keystream generated ahead of time
+ * for the packet indices that a sending stream will use next, see
+ * srtp_stream_precompute(); each entry is consumed by the srtp_protect()
+ * call for its index
+ */
+typedef struct srtp_keystream_entry_t {
+    srtp_xtd_seq_num_t index;
+    bool valid;
+} srtp_keystream_entry_t;
+
+typedef struct srtp_keystream_cache_t {
+    const srtp_session_keys_t *session_keys; /* keys used for the keystream */
+    size_t num_entries;
+    size_t entry_len;
+    srtp_keystream_entry_t *entries;
+    uint8_t *keystream; /* num_entries * entry_len octets */
+} srtp_keystream_cache_t;
+
+/*
+ * srtp_rtp_protect_func_t and srtp_rtp_unprotect_func_t are the types of
+ * the packet handlers that srtp_stream_compile() binds to a stream whose
+ * configuration has a specialized implementation; they are called by
+ * srtp_protect() and srtp_unprotect() once the stream has been found
+ */
+typedef srtp_err_status_t (*srtp_rtp_protect_func_t)(
+    srtp_ctx_t *ctx,
+    srtp_stream_ctx_t *stream,
+    const uint8_t *rtp,
+    size_t rtp_len,
+    uint8_t *srtp,
+    size_t *srtp_len);
+
+typedef srtp_err_status_t (*srtp_rtp_unprotect_func_t)(
+    srtp_ctx_t *ctx,
+    srtp_stream_ctx_t *stream,
+    const uint8_t *srtp,
+    size_t srtp_len,
+    uint8_t *rtp,
+    size_t *rtp_len);
+
+/* number of kinds of srtp_event_t */
+#define SRTP_EVENT_KINDS (event_packet_index_limit + 1)
+
+/*
+ * an srtp_event_queue_t is the ring set up by srtp_set_event_queue().  It is
+ * written by the thread protecting and unprotecting packets and read by the
+ * one calling srtp_poll_events().  Positions only grow; the event at
+ * position i is in events[i & mask].
+ */
+typedef struct srtp_event_queue_t {
+    uint64_t head; /* next position written */
+    uint64_t tail; /* next position read */
+    size_t mask;
+    srtp_event_data_t *events;
+} srtp_event_queue_t;
+
 /*
  * an srtp_stream_t has its own SSRC, encryption key, authentication
  * key, sequence number, and replay database
  *
  * note that the keys might not actually be unique, in which case the
  * srtp_cipher_t and srtp_auth_t pointers will point to the same structures
+ *
+ * the fields that the specialized packet handlers read come first, then
+ * those of the generic path and last the RTCP and configuration state.
+ * The session keys are allocated with the stream, after it, and the
+ * replay window of up to SRTP_RDBX_INLINE_BITS packets is kept in
+ * rtp_rdbx, so a stream does not point into its own memory.
  */
 typedef struct srtp_stream_ctx_t_ {
     uint32_t ssrc;
-    srtp_session_keys_t *session_keys;
+    direction_t direction;
+    srtp_sec_serv_t rtp_services;
+    uint32_t pending_roc;
+    srtp_rtp_protect_func_t rtp_protect;     /* NULL for the generic path */
+    srtp_rtp_unprotect_func_t rtp_unprotect; /* NULL for the generic path */
+    srtp_rdbx_atomic_t *shared_rdbx; /* set by srtp_stream_share_replay_window */
+    uint64_t last_used;                  /* session clock at last use */
+    struct srtp_stream_ctx_t_ *lru_prev; /* clones, least recently used */
+    struct srtp_stream_ctx_t_ *lru_next; /* first                       */
+    srtp_rdbx_t rtp_rdbx;
+    struct srtp_stream_ctx_t_ *inner; /* RFC 8723 end-to-end layer */
+    srtp_keystream_cache_t *keystream_cache;
     size_t num_master_keys;
-    bool use_mki;
     size_t mki_size;
-    srtp_rdbx_t rtp_rdbx;
-    srtp_sec_serv_t rtp_services;
+    size_t enc_xtn_hdr_count;
+    bool use_mki;
+    bool use_cryptex;
+    bool allow_repeat_tx;
+    bool keep_derived; /* keys kept for serializing */
     srtp_rdb_t rtcp_rdb;
     srtp_sec_serv_t rtcp_services;
-    direction_t direction;
-    bool allow_repeat_tx;
+    uint8_t mki_index[SRTP_MKI_INDEX_SIZE]; /* position + 1, 0 if unused */
     uint8_t *enc_xtn_hdr;
-    size_t enc_xtn_hdr_count;
-    uint32_t pending_roc;
-    bool use_cryptex;
+    uint32_t enc_xtn_hdr_ids[8]; /* bitmap of the ids in enc_xtn_hdr */
+    uint64_t event_pos[SRTP_EVENT_KINDS]; /* last queued, position + 1 */
+    srtp_session_keys_t session_keys[];   /* see srtp_stream_alloc_ctx() */
 } strp_stream_ctx_t_;
 
 /*
@@ -136,6 +228,26 @@ typedef struct srtp_ctx_t_ {
     struct srtp_stream_ctx_t_ *stream_template; /* act as template for other  */
                                                 /* streams                    */
     void *user_data;                            /* user custom data           */
+    struct srtp_kdf_cache_t *kdf_cache;         /* recently derived keys      */
+    uint64_t clock;                             /* just after the last expiry */
+    size_t max_streams;                         /* most clones, 0 if no limit */
+    size_t num_cloned;                          /* clones in the stream list  */
+    srtp_stream_ctx_t *lru_head;                /* least recently used clone  */
+    srtp_stream_ctx_t *lru_tail;                /* most recently used clone   */
+    srtp_event_queue_t *event_queue;            /* NULL to use the handler    */
+    struct srtp_stream_ctx_t_ **spare_streams;  /* unused template clones     */
+    size_t num_spare_streams;                   /* clones in spare_streams    */
+    size_t reserved_streams;                    /* room in spare_streams      */
+    bool no_packet_alloc;                       /* fail instead of allocating */
+    bool serializable;                          /* streams keep derived keys  */
+    struct srtp_worker_pool_ctx_t_ *worker_pool; /* srtp_set_worker_pool   */
+    struct srtp_async_job_t *async_head;         /* jobs not finished yet  */
+    struct srtp_async_job_t *async_tail;
+    struct srtp_async_job_t *async_start;        /* first job not started  */
+    struct srtp_ctx_t_ *async_next;              /* next in the run queue  */
+    size_t async_jobs;                           /* jobs not finished yet  */
+    size_t async_running;                        /* started, not finished  */
+    bool async_scheduled;                        /* queued or running      */
 } srtp_ctx_t_;
 
 /*
@@ -231,15 +343,18 @@ typedef struct {
 #endif
 
 /*
- * srtp_handle_event(srtp, srtm, evnt) calls the event handling
- * function, if there is one.
+ * srtp_handle_event(srtp, srtm, evnt) queues the event if the session
+ * has an event queue, and otherwise calls the event handling function,
+ * if there is one.
  *
  * This macro is not included in the documentation as it is
  * an internal-only function.
  */
 
 #define srtp_handle_event(srtp, strm, evnt)                                    \
-    if (srtp_event_handler) {                                                  \
+    if ((srtp)->event_queue) {                                                 \
+        srtp_queue_event(srtp, strm, evnt);                                    \
+    } else if (srtp_event_handler) {                                           \
         srtp_event_data_t data;                                                \
         data.session = srtp;                                                   \
         data.ssrc = ntohl(strm->ssrc);                                         \
@@ -90,6 +90,16 @@ srtp_err_status_t srtp_stream_list_dealloc(srtp_stream_list_t list);
 srtp_err_status_t srtp_stream_list_insert(srtp_stream_list_t list,
                                           srtp_stream_t stream);
 
+/**
+ * make room in the list for count more streams
+ *
+ * after this returns srtp_err_status_ok, inserting up to count streams
+ * does not allocate memory; removing a stream gives its room back.
+ * returns srtp_err_status_alloc_fail if the room cannot be allocated
+ */
+srtp_err_status_t srtp_stream_list_reserve(srtp_stream_list_t list,
+                                           size_t count);
+
 /*
  * look up the stream corresponding to the specified SSRC and return it.
  * if no such SSRC is found, NULL is returned.
@@ -74,12 +74,19 @@
 #endif
 
 #include <limits.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #elif defined(HAVE_WINSOCK2_H)
 #include <winsock2.h>
 #endif
 
+#if defined(__GNUC__) || defined(__clang__)
+#define SRTP_HAVE_ATOMIC_BUILTINS
+#endif
+
 /* the debug module for srtp */
 srtp_debug_module_t mod_srtp = {
     false, /* debugging is off by default */
@@ -135,39 +142,20 @@ static uint16_t srtp_get_rtp_xtn_hdr_profile(const srtp_hdr_t *hdr,
     return ntohs(xtn_hdr->profile_specific);
 }
 
-static void srtp_cryptex_adjust_buffer(const srtp_hdr_t *hdr, uint8_t *rtp)
-{
-    if (hdr->cc) {
-        uint8_t tmp[4];
-        uint8_t *ptr = rtp + srtp_get_rtp_hdr_len(hdr);
-        size_t cc_list_size = hdr->cc * 4;
-        memcpy(tmp, ptr, 4);
-        ptr -= cc_list_size;
-        memmove(ptr + 4, ptr, cc_list_size);
-        memcpy(ptr, tmp, 4);
-    }
-}
-
-static void srtp_cryptex_restore_buffer(const srtp_hdr_t *hdr, uint8_t *rtp)
-{
-    if (hdr->cc) {
-        uint8_t tmp[4];
-        uint8_t *ptr = rtp + octets_in_rtp_header;
-        size_t cc_list_size = hdr->cc * 4;
-        memcpy(tmp, ptr, 4);
-        memmove(ptr, ptr + 4, cc_list_size);
-        ptr += cc_list_size;
-        memcpy(ptr, tmp, 4);
-    }
-}
-
+/*
+ * Cryptex (RFC 9335) encrypts the CSRC list, the header extension body and
+ * the payload as one span, while the header extension header between the
+ * CSRC list and the body stays in the clear.  The CSRC list is given to the
+ * cipher as the first part of that span and the rest with a second call, so
+ * the packet is processed where it is; AEAD ciphers take the CSRC list
+ * through srtp_cipher_update(), and the fixed header and the header
+ * extension header as two parts of the AAD.
+ */
 static srtp_err_status_t srtp_cryptex_protect_init(
     const srtp_stream_ctx_t *stream,
     const srtp_hdr_t *hdr,
     const uint8_t *rtp,
-    const uint8_t *srtp,
     bool *inuse,
-    bool *inplace,
     size_t *enc_start)
 {
     if (stream->use_cryptex && (stream->rtp_services & sec_serv_conf)) {
@@ -180,26 +168,48 @@ static srtp_err_status_t srtp_cryptex_protect_init(
         *inuse = false;
     }
 
-    *inplace = *inuse && rtp == srtp;
-
     if (*inuse) {
         *enc_start -=
             (srtp_get_rtp_xtn_hdr_len(hdr, rtp) - octets_in_rtp_xtn_hdr);
-        if (*inplace) {
-            *enc_start -= (hdr->cc * 4);
-        }
     }
 
     return srtp_err_status_ok;
 }
 
-static srtp_err_status_t srtp_cryptex_protect(bool inplace,
+/*
+ * srtp_cryptex_set_aad() gives an AEAD cipher the AAD of a cryptex packet:
+ * the fixed header and the header extension header, without the CSRC list
+ * in between
+ */
+static srtp_err_status_t srtp_cryptex_set_aad(const srtp_hdr_t *hdr,
+                                              const uint8_t *pkt,
+                                              srtp_cipher_t *rtp_cipher)
+{
+    srtp_err_status_t status;
+
+    status = srtp_cipher_set_aad(rtp_cipher, pkt, octets_in_rtp_header);
+    if (!status) {
+        status = srtp_cipher_set_aad(rtp_cipher,
+                                     pkt + srtp_get_rtp_hdr_len(hdr),
+                                     octets_in_rtp_xtn_hdr);
+    }
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+
+static srtp_err_status_t srtp_cryptex_protect(bool aead,
                                               const srtp_hdr_t *hdr,
+                                              const uint8_t *rtp,
                                               uint8_t *srtp,
                                               srtp_cipher_t *rtp_cipher)
 {
     srtp_hdr_xtnd_t *xtn_hdr = srtp_get_rtp_xtn_hdr(hdr, srtp);
     uint16_t profile = ntohs(xtn_hdr->profile_specific);
+    srtp_err_status_t status;
+
     if (profile == xtn_hdr_one_byte_profile) {
         xtn_hdr->profile_specific = htons(cryptex_one_byte_profile);
     } else if (profile == xtn_hdr_two_byte_profile) {
@@ -208,94 +218,92 @@ static srtp_err_status_t srtp_cryptex_protect(bool inplace,
         return srtp_err_status_parse_err;
     }
 
-    if (inplace) {
-        srtp_cryptex_adjust_buffer(hdr, srtp);
-    } else {
-        if (hdr->cc) {
-            uint8_t *cc_list = srtp + octets_in_rtp_header;
-            size_t cc_list_size = hdr->cc * 4;
-            /* CSRCs are in dst header already, enc in place */
-            srtp_err_status_t status = srtp_cipher_encrypt(
-                rtp_cipher, cc_list, cc_list_size, cc_list, &cc_list_size);
-            if (status) {
-                return srtp_err_status_cipher_fail;
-            }
+    if (aead) {
+        status = srtp_cryptex_set_aad(hdr, srtp, rtp_cipher);
+        if (status) {
+            return status;
         }
     }
 
-    return srtp_err_status_ok;
-}
-
-static void srtp_cryptex_protect_cleanup(bool inplace,
-                                         const srtp_hdr_t *hdr,
-                                         uint8_t *srtp)
-{
-    if (inplace) {
-        srtp_cryptex_restore_buffer(hdr, srtp);
+    if (hdr->cc) {
+        size_t cc_list_size = hdr->cc * 4;
+        if (aead) {
+            status = srtp_cipher_update(rtp_cipher, rtp + octets_in_rtp_header,
+                                        cc_list_size,
+                                        srtp + octets_in_rtp_header);
+        } else {
+            status = srtp_cipher_encrypt(
+                rtp_cipher, rtp + octets_in_rtp_header, cc_list_size,
+                srtp + octets_in_rtp_header, &cc_list_size);
+        }
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
     }
+
+    return srtp_err_status_ok;
 }
 
 static srtp_err_status_t srtp_cryptex_unprotect_init(
     const srtp_stream_ctx_t *stream,
     const srtp_hdr_t *hdr,
     const uint8_t *srtp,
-    const uint8_t *rtp,
     bool *inuse,
-    bool *inplace,
     size_t *enc_start)
 {
     if (stream->use_cryptex && hdr->x == 1) {
-        uint16_t profile = srtp_get_rtp_xtn_hdr_profile(hdr, rtp);
+        uint16_t profile = srtp_get_rtp_xtn_hdr_profile(hdr, srtp);
         *inuse = profile == cryptex_one_byte_profile ||
                  profile == cryptex_two_byte_profile;
     } else {
         *inuse = false;
     }
 
-    *inplace = *inuse && srtp == rtp;
-
     if (*inuse) {
         *enc_start -=
-            (srtp_get_rtp_xtn_hdr_len(hdr, rtp) - octets_in_rtp_xtn_hdr);
-        if (*inplace) {
-            *enc_start -= (hdr->cc * 4);
-        }
+            (srtp_get_rtp_xtn_hdr_len(hdr, srtp) - octets_in_rtp_xtn_hdr);
     }
 
     return srtp_err_status_ok;
 }
 
-static srtp_err_status_t srtp_cryptex_unprotect(bool inplace,
+static srtp_err_status_t srtp_cryptex_unprotect(bool aead,
                                                 const srtp_hdr_t *hdr,
+                                                const uint8_t *srtp,
                                                 uint8_t *rtp,
                                                 srtp_cipher_t *rtp_cipher)
 {
-    if (inplace) {
-        srtp_cryptex_adjust_buffer(hdr, rtp);
-    } else {
-        if (hdr->cc) {
-            uint8_t *cc_list = rtp + octets_in_rtp_header;
-            size_t cc_list_size = hdr->cc * 4;
-            /* CSRCs are in dst header already, enc in place */
-            srtp_err_status_t status = srtp_cipher_decrypt(
-                rtp_cipher, cc_list, cc_list_size, cc_list, &cc_list_size);
-            if (status) {
-                return srtp_err_status_cipher_fail;
-            }
+    srtp_err_status_t status;
+
+    if (aead) {
+        status = srtp_cryptex_set_aad(hdr, srtp, rtp_cipher);
+        if (status) {
+            return status;
+        }
+    }
+
+    if (hdr->cc) {
+        size_t cc_list_size = hdr->cc * 4;
+        if (aead) {
+            status = srtp_cipher_update(rtp_cipher, srtp + octets_in_rtp_header,
+                                        cc_list_size,
+                                        rtp + octets_in_rtp_header);
+        } else {
+            status = srtp_cipher_decrypt(
+                rtp_cipher, srtp + octets_in_rtp_header, cc_list_size,
+                rtp + octets_in_rtp_header, &cc_list_size);
+        }
+        if (status) {
+            return srtp_err_status_cipher_fail;
         }
     }
 
     return srtp_err_status_ok;
 }
 
-static void srtp_cryptex_unprotect_cleanup(bool inplace,
-                                           const srtp_hdr_t *hdr,
+static void srtp_cryptex_unprotect_cleanup(const srtp_hdr_t *hdr,
                                            uint8_t *rtp)
 {
-    if (inplace) {
-        srtp_cryptex_restore_buffer(hdr, rtp);
-    }
-
     srtp_hdr_xtnd_t *xtn_hdr = srtp_get_rtp_xtn_hdr(hdr, rtp);
     uint16_t profile = ntohs(xtn_hdr->profile_specific);
     if (profile == cryptex_one_byte_profile) {
@@ -336,6 +344,93 @@ static srtp_err_status_t srtp_validate_rtp_header(const uint8_t *rtp,
     return srtp_err_status_ok;
 }
 
+/*
+ * RFC 8723 double encryption ends the payload of a packet with the
+ * original header block (OHB), which holds the header fields that a media
+ * distributor changed as the sender set them:
+ *
+ *   OHB = [PT] [SEQ] config,  config = R R R R B M P Q
+ *
+ * where Q and P tell that SEQ and PT are present, M that the marker bit
+ * changed and B what it was
+ */
+#define SRTP_OHB_SEQ 0x01
+#define SRTP_OHB_PT 0x02
+#define SRTP_OHB_M 0x04
+#define SRTP_OHB_B 0x08
+#define SRTP_OHB_RESERVED 0xf0
+
+/* the largest RTP header, with 15 CSRCs */
+#define SRTP_MAX_RTP_HDR_LEN (12 + 15 * 4)
+
+/* the largest RTP payload, in a UDP datagram of 65535 octets */
+#define SRTP_MAX_RTP_PAYLOAD_LEN (0xffff - 8 - 12)
+
+typedef struct {
+    uint8_t config;
+    uint8_t pt;
+    uint16_t seq; /* in network order */
+    size_t len;
+} srtp_ohb_t;
+
+/*
+ * srtp_parse_ohb(rtp, rtp_len, payload_start, ohb) reads the OHB at the
+ * end of the payload of the packet at rtp
+ */
+static srtp_err_status_t srtp_parse_ohb(const uint8_t *rtp,
+                                        size_t rtp_len,
+                                        size_t payload_start,
+                                        srtp_ohb_t *ohb)
+{
+    const uint8_t *ptr;
+
+    if (rtp_len <= payload_start) {
+        return srtp_err_status_parse_err;
+    }
+
+    ohb->config = rtp[rtp_len - 1];
+    if (ohb->config & SRTP_OHB_RESERVED) {
+        return srtp_err_status_parse_err;
+    }
+
+    ohb->len = 1;
+    if (ohb->config & SRTP_OHB_PT) {
+        ohb->len += 1;
+    }
+    if (ohb->config & SRTP_OHB_SEQ) {
+        ohb->len += 2;
+    }
+    if (rtp_len - payload_start < ohb->len) {
+        return srtp_err_status_parse_err;
+    }
+
+    ptr = rtp + rtp_len - ohb->len;
+    ohb->pt = 0;
+    if (ohb->config & SRTP_OHB_PT) {
+        ohb->pt = *ptr++ & 0x7f;
+    }
+    ohb->seq = 0;
+    if (ohb->config & SRTP_OHB_SEQ) {
+        memcpy(&ohb->seq, ptr, 2);
+    }
+
+    return srtp_err_status_ok;
+}
+
+/* srtp_restore_ohb(hdr, ohb) puts back the header fields the OHB holds */
+static void srtp_restore_ohb(srtp_hdr_t *hdr, const srtp_ohb_t *ohb)
+{
+    if (ohb->config & SRTP_OHB_PT) {
+        hdr->pt = ohb->pt;
+    }
+    if (ohb->config & SRTP_OHB_SEQ) {
+        hdr->seq = ohb->seq;
+    }
+    if (ohb->config & SRTP_OHB_M) {
+        hdr->m = (ohb->config & SRTP_OHB_B) ? 1 : 0;
+    }
+}
+
 const char *srtp_get_version_string(void)
 {
     /*
@@ -375,177 +470,320 @@ unsigned int srtp_get_version(void)
     return rv;
 }
 
-static srtp_err_status_t srtp_stream_dealloc(
-    srtp_stream_ctx_t *stream,
-    const srtp_stream_ctx_t *stream_template)
+static void srtp_keystream_cache_dealloc(srtp_keystream_cache_t *cache)
 {
-    srtp_err_status_t status;
-    srtp_session_keys_t *session_keys = NULL;
-    srtp_session_keys_t *template_session_keys = NULL;
+    if (cache == NULL) {
+        return;
+    }
 
-    /*
-     * we use a conservative deallocation strategy - if any deallocation
-     * fails, then we report that fact without trying to deallocate
-     * anything else
-     */
-    if (stream->session_keys) {
-        for (size_t i = 0; i < stream->num_master_keys; i++) {
-            session_keys = &stream->session_keys[i];
+    /* the keystream is as sensitive as the key it was generated with */
+    if (cache->keystream) {
+        octet_string_set_to_zero(cache->keystream,
+                                 cache->num_entries * cache->entry_len);
+        srtp_crypto_free(cache->keystream);
+    }
+    if (cache->entries) {
+        srtp_crypto_free(cache->entries);
+    }
+    srtp_crypto_free(cache);
+}
 
-            if (stream_template &&
-                stream->num_master_keys == stream_template->num_master_keys) {
-                template_session_keys = &stream_template->session_keys[i];
-            } else {
-                template_session_keys = NULL;
-            }
+/*
+ * SRTP_KDF_MAX_OUTPUT_LEN is the longest key, including its salt, that the
+ * key derivation generates for a single cipher or auth function
+ */
+#define SRTP_KDF_MAX_OUTPUT_LEN 64
 
-            /*
-             * deallocate cipher, if it is not the same as that in template
-             */
-            if (template_session_keys &&
-                session_keys->rtp_cipher == template_session_keys->rtp_cipher) {
-                /* do nothing */
-            } else if (session_keys->rtp_cipher) {
-                status = srtp_cipher_dealloc(session_keys->rtp_cipher);
-                if (status) {
-                    return status;
-                }
-            }
+/*
+ * srtp_kdf_output_t holds the session keys derived from one master key;
+ * each cipher key is followed by its salt
+ */
+typedef struct srtp_kdf_output_t {
+    uint8_t rtp_key[SRTP_KDF_MAX_OUTPUT_LEN];
+    uint8_t rtp_auth_key[SRTP_KDF_MAX_OUTPUT_LEN];
+    uint8_t rtp_xtn_hdr_key[SRTP_KDF_MAX_OUTPUT_LEN];
+    uint8_t rtcp_key[SRTP_KDF_MAX_OUTPUT_LEN];
+    uint8_t rtcp_auth_key[SRTP_KDF_MAX_OUTPUT_LEN];
+} srtp_kdf_output_t;
 
-            /*
-             * deallocate auth function, if it is not the same as that in
-             * template
-             */
-            if (template_session_keys &&
-                session_keys->rtp_auth == template_session_keys->rtp_auth) {
-                /* do nothing */
-            } else if (session_keys->rtp_auth) {
-                status = srtp_auth_dealloc(session_keys->rtp_auth);
-                if (status) {
-                    return status;
-                }
-            }
+/*
+ * srtp_session_keys_dealloc(session_keys, template_session_keys, mki_size)
+ * frees the ciphers, auth functions and key limit of one master key,
+ * except for those that are shared with template_session_keys, and
+ * zeroizes the salts and MKI
+ */
+static srtp_err_status_t srtp_session_keys_dealloc(
+    srtp_session_keys_t *session_keys,
+    const srtp_session_keys_t *template_session_keys,
+    size_t mki_size)
+{
+    srtp_err_status_t status;
 
-            if (template_session_keys &&
-                session_keys->rtp_xtn_hdr_cipher ==
-                    template_session_keys->rtp_xtn_hdr_cipher) {
-                /* do nothing */
-            } else if (session_keys->rtp_xtn_hdr_cipher) {
-                status = srtp_cipher_dealloc(session_keys->rtp_xtn_hdr_cipher);
-                if (status) {
-                    return status;
-                }
-            }
+    /*
+     * deallocate cipher, if it is not the same as that in template
+     */
+    if (template_session_keys &&
+        session_keys->rtp_cipher == template_session_keys->rtp_cipher) {
+        /* do nothing */
+    } else if (session_keys->rtp_cipher) {
+        status = srtp_cipher_dealloc(session_keys->rtp_cipher);
+        if (status) {
+            return status;
+        }
+    }
 
-            /*
-             * deallocate rtcp cipher, if it is not the same as that in
-             * template
-             */
-            if (template_session_keys &&
-                session_keys->rtcp_cipher ==
-                    template_session_keys->rtcp_cipher) {
-                /* do nothing */
-            } else if (session_keys->rtcp_cipher) {
-                status = srtp_cipher_dealloc(session_keys->rtcp_cipher);
-                if (status) {
-                    return status;
-                }
-            }
+    /*
+     * deallocate auth function, if it is not the same as that in template
+     */
+    if (template_session_keys &&
+        session_keys->rtp_auth == template_session_keys->rtp_auth) {
+        /* do nothing */
+    } else if (session_keys->rtp_auth) {
+        status = srtp_auth_dealloc(session_keys->rtp_auth);
+        if (status) {
+            return status;
+        }
+    }
 
-            /*
-             * deallocate rtcp auth function, if it is not the same as that in
-             * template
-             */
-            if (template_session_keys &&
-                session_keys->rtcp_auth == template_session_keys->rtcp_auth) {
-                /* do nothing */
-            } else if (session_keys->rtcp_auth) {
-                status = srtp_auth_dealloc(session_keys->rtcp_auth);
-                if (status) {
-                    return status;
-                }
-            }
+    if (template_session_keys &&
+        session_keys->rtp_xtn_hdr_cipher ==
+            template_session_keys->rtp_xtn_hdr_cipher) {
+        /* do nothing */
+    } else if (session_keys->rtp_xtn_hdr_cipher) {
+        status = srtp_cipher_dealloc(session_keys->rtp_xtn_hdr_cipher);
+        if (status) {
+            return status;
+        }
+    }
 
-            /*
-             * zeroize the salt value
-             */
-            octet_string_set_to_zero(session_keys->salt, SRTP_AEAD_SALT_LEN);
-            octet_string_set_to_zero(session_keys->c_salt, SRTP_AEAD_SALT_LEN);
-
-            if (session_keys->mki_id) {
-                octet_string_set_to_zero(session_keys->mki_id,
-                                         stream->mki_size);
-                srtp_crypto_free(session_keys->mki_id);
-                session_keys->mki_id = NULL;
-            }
+    /*
+     * deallocate rtcp cipher, if it is not the same as that in template
+     */
+    if (template_session_keys &&
+        session_keys->rtcp_cipher == template_session_keys->rtcp_cipher) {
+        /* do nothing */
+    } else if (session_keys->rtcp_cipher) {
+        status = srtp_cipher_dealloc(session_keys->rtcp_cipher);
+        if (status) {
+            return status;
+        }
+    }
 
-            /*
-             * deallocate key usage limit, if it is not the same as that in
-             * template
-             */
-            if (template_session_keys &&
-                session_keys->limit == template_session_keys->limit) {
-                /* do nothing */
-            } else if (session_keys->limit) {
-                srtp_crypto_free(session_keys->limit);
-            }
+    /*
+     * deallocate rtcp auth function, if it is not the same as that in
+     * template
+     */
+    if (template_session_keys &&
+        session_keys->rtcp_auth == template_session_keys->rtcp_auth) {
+        /* do nothing */
+    } else if (session_keys->rtcp_auth) {
+        status = srtp_auth_dealloc(session_keys->rtcp_auth);
+        if (status) {
+            return status;
         }
-        srtp_crypto_free(stream->session_keys);
     }
 
-    status = srtp_rdbx_dealloc(&stream->rtp_rdbx);
-    if (status) {
-        return status;
+    /*
+     * zeroize the salt value
+     */
+    octet_string_set_to_zero(session_keys->salt, SRTP_AEAD_SALT_LEN);
+    octet_string_set_to_zero(session_keys->c_salt, SRTP_AEAD_SALT_LEN);
+
+    if (session_keys->mki_id) {
+        octet_string_set_to_zero(session_keys->mki_id, mki_size);
+        srtp_crypto_free(session_keys->mki_id);
+        session_keys->mki_id = NULL;
     }
 
-    if (stream_template &&
-        stream->enc_xtn_hdr == stream_template->enc_xtn_hdr) {
+    /*
+     * deallocate the copy of the derived keys, if it is not the same as
+     * that in template
+     */
+    if (template_session_keys &&
+        session_keys->derived == template_session_keys->derived) {
         /* do nothing */
-    } else if (stream->enc_xtn_hdr) {
-        srtp_crypto_free(stream->enc_xtn_hdr);
+    } else if (session_keys->derived) {
+        octet_string_set_to_zero(session_keys->derived,
+                                 sizeof(srtp_kdf_output_t));
+        srtp_crypto_free(session_keys->derived);
     }
+    session_keys->derived = NULL;
 
-    /* deallocate srtp stream context */
-    srtp_crypto_free(stream);
+    /*
+     * deallocate key usage limit, if it is not the same as that in
+     * template
+     */
+    if (template_session_keys &&
+        session_keys->limit == template_session_keys->limit) {
+        /* do nothing */
+    } else if (session_keys->limit) {
+        srtp_crypto_free(session_keys->limit);
+    }
 
     return srtp_err_status_ok;
 }
 
-/* try to insert stream in list or deallocate it */
-static srtp_err_status_t srtp_insert_or_dealloc_stream(srtp_stream_list_t list,
-                                                       srtp_stream_t stream,
-                                                       srtp_stream_t template)
+/*
+ * srtp_session_keys_alloc_like(session_keys, like) allocates ciphers, auth
+ * functions and a key limit for session_keys of the same types and sizes
+ * as those of like, for a master key that is added to a running stream
+ */
+static srtp_err_status_t srtp_session_keys_alloc_like(
+    srtp_session_keys_t *session_keys,
+    const srtp_session_keys_t *like)
 {
-    srtp_err_status_t status = srtp_stream_list_insert(list, stream);
-    /* on failure, ownership wasn't transferred and we need to deallocate */
-    if (status) {
-        srtp_stream_dealloc(stream, template);
+    srtp_err_status_t stat;
+
+    stat = srtp_crypto_kernel_alloc_cipher(
+        like->rtp_cipher->type->id, &session_keys->rtp_cipher,
+        srtp_cipher_get_key_length(like->rtp_cipher),
+        srtp_auth_get_tag_length(like->rtp_auth));
+    if (stat) {
+        return stat;
     }
-    return status;
-}
 
-struct remove_and_dealloc_streams_data {
-    srtp_err_status_t status;
-    srtp_stream_list_t list;
-    srtp_stream_t template;
-};
+    stat = srtp_crypto_kernel_alloc_auth(
+        like->rtp_auth->type->id, &session_keys->rtp_auth,
+        srtp_auth_get_key_length(like->rtp_auth),
+        srtp_auth_get_tag_length(like->rtp_auth));
+    if (stat) {
+        return stat;
+    }
 
-static bool remove_and_dealloc_streams_cb(srtp_stream_t stream, void *data)
-{
-    struct remove_and_dealloc_streams_data *d =
-        (struct remove_and_dealloc_streams_data *)data;
-    srtp_stream_list_remove(d->list, stream);
-    d->status = srtp_stream_dealloc(stream, d->template);
-    if (d->status) {
-        return false;
+    if (like->rtp_xtn_hdr_cipher) {
+        stat = srtp_crypto_kernel_alloc_cipher(
+            like->rtp_xtn_hdr_cipher->type->id,
+            &session_keys->rtp_xtn_hdr_cipher,
+            srtp_cipher_get_key_length(like->rtp_xtn_hdr_cipher), 0);
+        if (stat) {
+            return stat;
+        }
     }
-    return true;
-}
 
-static srtp_err_status_t srtp_remove_and_dealloc_streams(
-    srtp_stream_list_t list,
-    srtp_stream_t template)
-{
+    stat = srtp_crypto_kernel_alloc_cipher(
+        like->rtcp_cipher->type->id, &session_keys->rtcp_cipher,
+        srtp_cipher_get_key_length(like->rtcp_cipher),
+        srtp_auth_get_tag_length(like->rtcp_auth));
+    if (stat) {
+        return stat;
+    }
+
+    stat = srtp_crypto_kernel_alloc_auth(
+        like->rtcp_auth->type->id, &session_keys->rtcp_auth,
+        srtp_auth_get_key_length(like->rtcp_auth),
+        srtp_auth_get_tag_length(like->rtcp_auth));
+    if (stat) {
+        return stat;
+    }
+
+    session_keys->limit =
+        (srtp_key_limit_ctx_t *)srtp_crypto_alloc(sizeof(srtp_key_limit_ctx_t));
+    if (session_keys->limit == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+
+static srtp_err_status_t srtp_stream_dealloc(
+    srtp_stream_ctx_t *stream,
+    const srtp_stream_ctx_t *stream_template)
+{
+    srtp_err_status_t status;
+    const srtp_session_keys_t *template_session_keys = NULL;
+
+    /*
+     * we use a conservative deallocation strategy - if any deallocation
+     * fails, then we report that fact without trying to deallocate
+     * anything else
+     */
+    if (stream->inner) {
+        status = srtp_stream_dealloc(
+            stream->inner, stream_template ? stream_template->inner : NULL);
+        if (status) {
+            return status;
+        }
+        stream->inner = NULL;
+    }
+
+    for (size_t i = 0; i < stream->num_master_keys; i++) {
+        if (stream_template &&
+            stream->num_master_keys == stream_template->num_master_keys) {
+            template_session_keys = &stream_template->session_keys[i];
+        } else {
+            template_session_keys = NULL;
+        }
+
+        status = srtp_session_keys_dealloc(&stream->session_keys[i],
+                                           template_session_keys,
+                                           stream->mki_size);
+        if (status) {
+            return status;
+        }
+    }
+
+    status = srtp_rdbx_dealloc(&stream->rtp_rdbx);
+    if (status) {
+        return status;
+    }
+
+    status = srtp_rdb_dealloc(&stream->rtcp_rdb);
+    if (status) {
+        return status;
+    }
+
+    srtp_rdbx_atomic_release(stream->shared_rdbx);
+
+    if (stream_template &&
+        stream->enc_xtn_hdr == stream_template->enc_xtn_hdr) {
+        /* do nothing */
+    } else if (stream->enc_xtn_hdr) {
+        srtp_crypto_free(stream->enc_xtn_hdr);
+    }
+
+    srtp_keystream_cache_dealloc(stream->keystream_cache);
+
+    /* deallocate srtp stream context */
+    srtp_crypto_free(stream);
+
+    return srtp_err_status_ok;
+}
+
+/* try to insert stream in list or deallocate it */
+static srtp_err_status_t srtp_insert_or_dealloc_stream(srtp_stream_list_t list,
+                                                       srtp_stream_t stream,
+                                                       srtp_stream_t template)
+{
+    srtp_err_status_t status = srtp_stream_list_insert(list, stream);
+    /* on failure, ownership wasn't transferred and we need to deallocate */
+    if (status) {
+        srtp_stream_dealloc(stream, template);
+    }
+    return status;
+}
+
+struct remove_and_dealloc_streams_data {
+    srtp_err_status_t status;
+    srtp_stream_list_t list;
+    srtp_stream_t template;
+};
+
+static bool remove_and_dealloc_streams_cb(srtp_stream_t stream, void *data)
+{
+    struct remove_and_dealloc_streams_data *d =
+        (struct remove_and_dealloc_streams_data *)data;
+    srtp_stream_list_remove(d->list, stream);
+    d->status = srtp_stream_dealloc(stream, d->template);
+    if (d->status) {
+        return false;
+    }
+    return true;
+}
+
+static srtp_err_status_t srtp_remove_and_dealloc_streams(
+    srtp_stream_list_t list,
+    srtp_stream_t template)
+{
     struct remove_and_dealloc_streams_data data = { srtp_err_status_ok, list,
                                                     template };
     srtp_stream_list_for_each(list, remove_and_dealloc_streams_cb, &data);
@@ -592,12 +830,115 @@ static srtp_err_status_t srtp_valid_policy(const srtp_policy_t *policy)
     return srtp_err_status_ok;
 }
 
+/*
+ * srtp_policy_is_double(p) returns true if p is one of the RFC 8723 double
+ * encryption policies, whose cipher key holds the keys of both layers
+ */
+static bool srtp_policy_is_double(const srtp_crypto_policy_t *p)
+{
+    return (p->cipher_type == SRTP_AES_GCM_128 &&
+            p->cipher_key_len == 2 * SRTP_AES_GCM_128_KEY_LEN_WSALT) ||
+           (p->cipher_type == SRTP_AES_GCM_256 &&
+            p->cipher_key_len == 2 * SRTP_AES_GCM_256_KEY_LEN_WSALT);
+}
+
+/*
+ * a stream with a double policy is made of two streams: the outer one
+ * protects the whole packet with the hop-by-hop half of the master key,
+ * and the inner one, at stream->inner, protects RTP payloads with the
+ * end-to-end half.  srtp_double_policy_t holds the policies of the two
+ * streams, and the master keys they point to.
+ */
+typedef struct {
+    srtp_policy_t inner;
+    srtp_policy_t outer;
+    srtp_master_key_t outer_key;
+    srtp_master_key_t *outer_keys[1];
+    uint8_t inner_master_key[SRTP_MAX_KEY_LEN];
+    uint8_t outer_master_key[SRTP_MAX_KEY_LEN];
+} srtp_double_policy_t;
+
+/*
+ * srtp_double_policy_init(d, p) splits the double policy p into the
+ * policies of its layers; the master key of p is K_inner || K_outer ||
+ * S_inner || S_outer (RFC 8723, Section 5.2).  The caller wipes d when it
+ * is done with it.
+ */
+static srtp_err_status_t srtp_double_policy_init(srtp_double_policy_t *d,
+                                                 const srtp_policy_t *p)
+{
+    const uint8_t *key;
+    size_t key_len = p->rtp.cipher_key_len / 2;
+    size_t base_len = key_len - SRTP_AEAD_SALT_LEN;
+
+    /* the inner layer has no MKI, so it cannot follow a change of key */
+    if (p->key != NULL) {
+        key = p->key;
+    } else if (p->num_master_keys == 1) {
+        key = p->keys[0]->key;
+    } else {
+        return srtp_err_status_bad_param;
+    }
+
+    /* the inner layer authenticates the header as the sender built it */
+    if (p->use_cryptex) {
+        return srtp_err_status_bad_param;
+    }
+
+    memset(d, 0, sizeof(*d));
+    memcpy(d->inner_master_key, key, base_len);
+    memcpy(d->inner_master_key + base_len, key + 2 * base_len,
+           SRTP_AEAD_SALT_LEN);
+    memcpy(d->outer_master_key, key + base_len, base_len);
+    memcpy(d->outer_master_key + base_len,
+           key + 2 * base_len + SRTP_AEAD_SALT_LEN, SRTP_AEAD_SALT_LEN);
+
+    d->outer = *p;
+    d->outer.rtp.cipher_key_len = key_len;
+    if (srtp_policy_is_double(&p->rtcp)) {
+        d->outer.rtcp.cipher_key_len = p->rtcp.cipher_key_len / 2;
+    }
+    if (p->key != NULL) {
+        d->outer.key = d->outer_master_key;
+    } else {
+        d->outer_key.key = d->outer_master_key;
+        d->outer_key.mki_id = p->keys[0]->mki_id;
+        d->outer_keys[0] = &d->outer_key;
+        d->outer.keys = d->outer_keys;
+    }
+    d->outer.next = NULL;
+
+    d->inner = d->outer;
+    d->inner.rtcp = d->inner.rtp;
+    d->inner.key = d->inner_master_key;
+    d->inner.keys = NULL;
+    d->inner.num_master_keys = 0;
+    d->inner.use_mki = false;
+    d->inner.mki_size = 0;
+    d->inner.enc_xtn_hdr = NULL;
+    d->inner.enc_xtn_hdr_count = 0;
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_stream_alloc_ctx(num_keys) allocates a zeroed stream context with
+ * room for num_keys session keys after it, so that the keys of a stream
+ * share its allocation and the cache lines next to its packet state
+ */
+static srtp_stream_ctx_t *srtp_stream_alloc_ctx(size_t num_keys)
+{
+    return (srtp_stream_ctx_t *)srtp_crypto_alloc(
+        sizeof(srtp_stream_ctx_t) + sizeof(srtp_session_keys_t) * num_keys);
+}
+
 static srtp_err_status_t srtp_stream_alloc(srtp_stream_ctx_t **str_ptr,
                                            const srtp_policy_t *p)
 {
     srtp_stream_ctx_t *str;
     srtp_err_status_t stat;
     size_t i = 0;
+    size_t num_master_keys;
     srtp_session_keys_t *session_keys = NULL;
 
     stat = srtp_valid_policy(p);
@@ -605,6 +946,26 @@ static srtp_err_status_t srtp_stream_alloc(srtp_stream_ctx_t **str_ptr,
         return stat;
     }
 
+    if (srtp_policy_is_double(&p->rtp)) {
+        srtp_double_policy_t d;
+        srtp_stream_ctx_t *inner;
+
+        stat = srtp_double_policy_init(&d, p);
+        if (stat == srtp_err_status_ok) {
+            stat = srtp_stream_alloc(&inner, &d.inner);
+        }
+        if (stat == srtp_err_status_ok) {
+            stat = srtp_stream_alloc(str_ptr, &d.outer);
+            if (stat) {
+                srtp_stream_dealloc(inner, NULL);
+            } else {
+                (*str_ptr)->inner = inner;
+            }
+        }
+        octet_string_set_to_zero(&d, sizeof(d));
+        return stat;
+    }
+
     /*
      * This function allocates the stream context, rtp and rtcp ciphers
      * and auth functions, and key limit structure.  If there is a
@@ -613,32 +974,26 @@ static srtp_err_status_t srtp_stream_alloc(srtp_stream_ctx_t **str_ptr,
      * be improved, but it works and should be clear.
      */
 
-    /* allocate srtp stream and set str_ptr */
-    str = (srtp_stream_ctx_t *)srtp_crypto_alloc(sizeof(srtp_stream_ctx_t));
-    if (str == NULL) {
-        return srtp_err_status_alloc_fail;
-    }
-
-    *str_ptr = str;
-
     /*
      *To keep backwards API compatible if someone is using multiple master
      * keys then key should be set to NULL
      */
-    if (p->key != NULL) {
-        str->num_master_keys = 1;
-    } else {
-        str->num_master_keys = p->num_master_keys;
-    }
+    num_master_keys = p->key != NULL ? 1 : p->num_master_keys;
 
-    str->session_keys = (srtp_session_keys_t *)srtp_crypto_alloc(
-        sizeof(srtp_session_keys_t) * str->num_master_keys);
-
-    if (str->session_keys == NULL) {
-        srtp_stream_dealloc(str, NULL);
+    /*
+     * allocate srtp stream and set str_ptr; streams that select their keys
+     * by MKI get room for the maximum number of master keys, so that
+     * srtp_stream_add_master_key() can add one without moving the others
+     */
+    str = srtp_stream_alloc_ctx(p->use_mki ? SRTP_MAX_NUM_MASTER_KEYS
+                                           : num_master_keys);
+    if (str == NULL) {
         return srtp_err_status_alloc_fail;
     }
 
+    *str_ptr = str;
+    str->num_master_keys = num_master_keys;
+
     for (i = 0; i < str->num_master_keys; i++) {
         session_keys = &str->session_keys[i];
 
@@ -705,6 +1060,10 @@ static srtp_err_status_t srtp_stream_alloc(srtp_stream_ctx_t **str_ptr,
         memcpy(str->enc_xtn_hdr, p->enc_xtn_hdr,
                p->enc_xtn_hdr_count * sizeof(p->enc_xtn_hdr[0]));
         str->enc_xtn_hdr_count = p->enc_xtn_hdr_count;
+        for (i = 0; i < p->enc_xtn_hdr_count; i++) {
+            uint8_t id = p->enc_xtn_hdr[i];
+            str->enc_xtn_hdr_ids[id >> 5] |= (uint32_t)1 << (id & 31);
+        }
 
         /*
          * For GCM ciphers, the corresponding ICM cipher is used for header
@@ -774,21 +1133,13 @@ static srtp_err_status_t srtp_stream_clone(
                 (unsigned int)ntohl(ssrc));
 
     /* allocate srtp stream and set str_ptr */
-    str = (srtp_stream_ctx_t *)srtp_crypto_alloc(sizeof(srtp_stream_ctx_t));
+    str = srtp_stream_alloc_ctx(stream_template->num_master_keys);
     if (str == NULL) {
         return srtp_err_status_alloc_fail;
     }
     *str_ptr = str;
 
     str->num_master_keys = stream_template->num_master_keys;
-    str->session_keys = (srtp_session_keys_t *)srtp_crypto_alloc(
-        sizeof(srtp_session_keys_t) * str->num_master_keys);
-
-    if (str->session_keys == NULL) {
-        srtp_stream_dealloc(*str_ptr, stream_template);
-        *str_ptr = NULL;
-        return srtp_err_status_alloc_fail;
-    }
 
     for (size_t i = 0; i < stream_template->num_master_keys; i++) {
         session_keys = &str->session_keys[i];
@@ -801,6 +1152,7 @@ static srtp_err_status_t srtp_stream_clone(
             template_session_keys->rtp_xtn_hdr_cipher;
         session_keys->rtcp_cipher = template_session_keys->rtcp_cipher;
         session_keys->rtcp_auth = template_session_keys->rtcp_auth;
+        session_keys->derived = template_session_keys->derived;
 
         if (stream_template->mki_size == 0) {
             session_keys->mki_id = NULL;
@@ -833,6 +1185,7 @@ static srtp_err_status_t srtp_stream_clone(
 
     str->use_mki = stream_template->use_mki;
     str->mki_size = stream_template->mki_size;
+    memcpy(str->mki_index, stream_template->mki_index, sizeof(str->mki_index));
 
     /* initialize replay databases */
     status = srtp_rdbx_init(
@@ -842,7 +1195,13 @@ static srtp_err_status_t srtp_stream_clone(
         *str_ptr = NULL;
         return status;
     }
-    srtp_rdb_init(&str->rtcp_rdb);
+    status = srtp_rdb_init(
+        &str->rtcp_rdb, srtp_rdb_get_window_size(&stream_template->rtcp_rdb));
+    if (status) {
+        srtp_stream_dealloc(*str_ptr, stream_template);
+        *str_ptr = NULL;
+        return status;
+    }
     str->allow_repeat_tx = stream_template->allow_repeat_tx;
 
     /* set ssrc to that provided */
@@ -859,76 +1218,389 @@ static srtp_err_status_t srtp_stream_clone(
     /* copy information about extensions header encryption */
     str->enc_xtn_hdr = stream_template->enc_xtn_hdr;
     str->enc_xtn_hdr_count = stream_template->enc_xtn_hdr_count;
+    memcpy(str->enc_xtn_hdr_ids, stream_template->enc_xtn_hdr_ids,
+           sizeof(str->enc_xtn_hdr_ids));
     str->use_cryptex = stream_template->use_cryptex;
+
+    /* clone the end-to-end layer of a double stream along with it */
+    if (stream_template->inner != NULL) {
+        status = srtp_stream_clone(stream_template->inner, ssrc, &str->inner);
+        if (status) {
+            srtp_stream_dealloc(*str_ptr, stream_template);
+            *str_ptr = NULL;
+            return status;
+        }
+    }
+
+    srtp_stream_compile(str);
     return srtp_err_status_ok;
 }
 
 /*
- * key derivation functions, internal to libSRTP
- *
- * srtp_kdf_t is a key derivation context
- *
- * srtp_kdf_init(&kdf, cipher_id, k, keylen) initializes kdf to use cipher
- * described by cipher_id, with the master key k with length in octets keylen.
- *
- * srtp_kdf_generate(&kdf, l, kl, keylen) derives the key
- * corresponding to label l and puts it into kl; the length
- * of the key in octets is provided as keylen.  this function
- * should be called once for each subkey that is derived.
- *
- * srtp_kdf_clear(&kdf) zeroizes and deallocates the kdf state
+ * after the template has been rekeyed in place, a stream cloned from it
+ * already uses its new ciphers and auth functions, and only the copies of
+ * the salts, MKIs and flags need refreshing
  */
+static void srtp_stream_follow_template(
+    srtp_stream_ctx_t *stream,
+    const srtp_stream_ctx_t *stream_template)
+{
+    for (size_t i = 0; i < stream->num_master_keys; i++) {
+        srtp_session_keys_t *session_keys = &stream->session_keys[i];
+        const srtp_session_keys_t *template_session_keys =
+            &stream_template->session_keys[i];
 
-typedef enum {
-    label_rtp_encryption = 0x00,
-    label_rtp_msg_auth = 0x01,
-    label_rtp_salt = 0x02,
-    label_rtcp_encryption = 0x03,
-    label_rtcp_msg_auth = 0x04,
-    label_rtcp_salt = 0x05,
-    label_rtp_header_encryption = 0x06,
-    label_rtp_header_salt = 0x07
-} srtp_prf_label;
+        memcpy(session_keys->salt, template_session_keys->salt,
+               SRTP_AEAD_SALT_LEN);
+        memcpy(session_keys->c_salt, template_session_keys->c_salt,
+               SRTP_AEAD_SALT_LEN);
+        if (stream->mki_size > 0) {
+            memcpy(session_keys->mki_id, template_session_keys->mki_id,
+                   stream->mki_size);
+        }
+    }
+    memcpy(stream->mki_index, stream_template->mki_index,
+           sizeof(stream->mki_index));
 
-#define MAX_SRTP_KEY_LEN 256
+    if (stream->keystream_cache) {
+        stream->keystream_cache->session_keys = NULL;
+    }
 
-#if defined(OPENSSL) && defined(OPENSSL_KDF)
-#define MAX_SRTP_AESKEY_LEN 32
-#define MAX_SRTP_SALT_LEN 14
+    stream->rtp_services = stream_template->rtp_services;
+    stream->rtcp_services = stream_template->rtcp_services;
+    stream->allow_repeat_tx = stream_template->allow_repeat_tx;
+    stream->use_cryptex = stream_template->use_cryptex;
+    stream->direction = stream_template->direction;
+    stream->pending_roc = 0;
+
+    srtp_stream_compile(stream);
+
+    if (stream->inner != NULL && stream_template->inner != NULL) {
+        srtp_stream_follow_template(stream->inner, stream_template->inner);
+    }
+}
 
 /*
- * srtp_kdf_t represents a key derivation function.  The SRTP
- * default KDF is the only one implemented at present.
+ * a stream cloned from the template shares its ciphers with the template,
+ * so its master keys cannot be changed on their own
  */
-typedef struct {
-    uint8_t master_key[MAX_SRTP_AESKEY_LEN];
-    uint8_t master_salt[MAX_SRTP_SALT_LEN];
-    const EVP_CIPHER *evp;
-} srtp_kdf_t;
+static bool srtp_stream_shares_template_keys(srtp_t session,
+                                             const srtp_stream_ctx_t *stream)
+{
+    return session->stream_template != NULL &&
+           stream->session_keys[0].rtp_auth ==
+               session->stream_template->session_keys[0].rtp_auth;
+}
 
-static srtp_err_status_t srtp_kdf_init(srtp_kdf_t *kdf,
-                                       const uint8_t *key,
-                                       size_t key_len,
-                                       size_t salt_len)
+/*
+ * the streams in the stream list that were cloned from the template are
+ * also kept on a list in least recently used order, so that a session
+ * with max_streams set finds the clone to evict without a walk of the
+ * stream list
+ */
+static bool srtp_session_lru_linked(srtp_t session,
+                                    const srtp_stream_ctx_t *stream)
 {
-    memset(kdf, 0x0, sizeof(srtp_kdf_t));
+    return stream->lru_prev != NULL || session->lru_head == stream;
+}
 
-    /* The NULL cipher has zero key length */
-    if (key_len == 0) {
-        return srtp_err_status_ok;
+/* srtp_session_lru_link(session, prev, stream) puts stream after prev */
+static void srtp_session_lru_link(srtp_t session,
+                                  srtp_stream_ctx_t *prev,
+                                  srtp_stream_ctx_t *stream)
+{
+    stream->lru_prev = prev;
+    stream->lru_next = prev != NULL ? prev->lru_next : session->lru_head;
+    if (stream->lru_next != NULL) {
+        stream->lru_next->lru_prev = stream;
+    } else {
+        session->lru_tail = stream;
+    }
+    if (prev != NULL) {
+        prev->lru_next = stream;
+    } else {
+        session->lru_head = stream;
     }
+    session->num_cloned++;
+}
 
-    if ((key_len > MAX_SRTP_AESKEY_LEN) || (salt_len > MAX_SRTP_SALT_LEN)) {
-        return srtp_err_status_bad_param;
+static void srtp_session_lru_unlink(srtp_t session, srtp_stream_ctx_t *stream)
+{
+    if (!srtp_session_lru_linked(session, stream)) {
+        return;
     }
-    switch (key_len) {
-    case SRTP_AES_256_KEYSIZE:
-        kdf->evp = EVP_aes_256_ctr();
-        break;
-    case SRTP_AES_192_KEYSIZE:
-        kdf->evp = EVP_aes_192_ctr();
-        break;
-    case SRTP_AES_128_KEYSIZE:
+    if (stream->lru_prev != NULL) {
+        stream->lru_prev->lru_next = stream->lru_next;
+    } else {
+        session->lru_head = stream->lru_next;
+    }
+    if (stream->lru_next != NULL) {
+        stream->lru_next->lru_prev = stream->lru_prev;
+    } else {
+        session->lru_tail = stream->lru_prev;
+    }
+    stream->lru_prev = NULL;
+    stream->lru_next = NULL;
+    session->num_cloned--;
+}
+
+static bool srtp_session_lru_rebuild_cb(srtp_stream_t stream, void *raw_data)
+{
+    srtp_t session = (srtp_t)raw_data;
+
+    if (srtp_stream_shares_template_keys(session, stream)) {
+        srtp_session_lru_link(session, session->lru_tail, stream);
+    }
+    return true;
+}
+
+/*
+ * srtp_session_lru_rebuild(session) links the clones in the stream list
+ * again, in the order of the list, for when the order was lost
+ */
+static void srtp_session_lru_rebuild(srtp_t session)
+{
+    session->lru_head = NULL;
+    session->lru_tail = NULL;
+    session->num_cloned = 0;
+    srtp_stream_list_for_each(session->stream_list,
+                              srtp_session_lru_rebuild_cb, session);
+}
+
+/*
+ * srtp_stream_reset(stream, ssrc) gives a spare clone of the template the
+ * SSRC it is taken for, and the replay state and events of a new stream
+ */
+static void srtp_stream_reset(srtp_stream_ctx_t *stream, uint32_t ssrc)
+{
+    stream->ssrc = ssrc;
+    srtp_rdbx_reset(&stream->rtp_rdbx);
+    srtp_rdb_reset(&stream->rtcp_rdb);
+    memset(stream->event_pos, 0, sizeof(stream->event_pos));
+
+    if (stream->inner != NULL) {
+        srtp_stream_reset(stream->inner, ssrc);
+    }
+}
+
+/*
+ * srtp_session_release_stream(session, stream) keeps a stream that was
+ * removed from the stream list as a spare, if it was cloned from the
+ * template and there is room for it, and deallocates it otherwise
+ */
+static srtp_err_status_t srtp_session_release_stream(srtp_t session,
+                                                     srtp_stream_ctx_t *stream)
+{
+    srtp_session_lru_unlink(session, stream);
+
+    if (session->num_spare_streams < session->reserved_streams &&
+        srtp_stream_shares_template_keys(session, stream)) {
+        srtp_rdbx_atomic_release(stream->shared_rdbx);
+        stream->shared_rdbx = NULL;
+        srtp_keystream_cache_dealloc(stream->keystream_cache);
+        stream->keystream_cache = NULL;
+        session->spare_streams[session->num_spare_streams++] = stream;
+        return srtp_err_status_ok;
+    }
+
+    return srtp_stream_dealloc(stream, session->stream_template);
+}
+
+/*
+ * srtp_session_drop_spare_streams(session) deallocates the spare clones of
+ * the template, which must be done before the template is replaced
+ */
+static srtp_err_status_t srtp_session_drop_spare_streams(srtp_t session)
+{
+    srtp_err_status_t status;
+
+    while (session->num_spare_streams > 0) {
+        status = srtp_stream_dealloc(
+            session->spare_streams[session->num_spare_streams - 1],
+            session->stream_template);
+        if (status) {
+            return status;
+        }
+        session->num_spare_streams--;
+    }
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_session_fill_spare_streams(session) clones the template until the
+ * session has as many spare streams as it reserved, and makes room for
+ * them in the stream list, so that the packets of new SSRCs do not
+ * allocate
+ */
+static srtp_err_status_t srtp_session_fill_spare_streams(srtp_t session)
+{
+    srtp_err_status_t status;
+
+    if (session->reserved_streams == 0) {
+        return srtp_err_status_ok;
+    }
+
+    status = srtp_stream_list_reserve(session->stream_list,
+                                      session->reserved_streams);
+    if (status) {
+        return status;
+    }
+
+    if (session->stream_template == NULL) {
+        return srtp_err_status_ok;
+    }
+
+    while (session->num_spare_streams < session->reserved_streams) {
+        srtp_stream_ctx_t *stream;
+
+        status = srtp_stream_clone(session->stream_template, 0, &stream);
+        if (status) {
+            return status;
+        }
+        session->spare_streams[session->num_spare_streams++] = stream;
+    }
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_session_clone_stream(session, ssrc, str_ptr) clones the template
+ * of session for a new SSRC, taking a spare clone if there is one, and
+ * adds it to the stream list; if the session already has as many streams
+ * cloned from the template as it may have, the least recently used of
+ * them is removed first
+ */
+static srtp_err_status_t srtp_session_clone_stream(srtp_t session,
+                                                   uint32_t ssrc,
+                                                   srtp_stream_ctx_t **str_ptr)
+{
+    srtp_err_status_t status;
+    srtp_stream_ctx_t *stream;
+
+    if (session->max_streams != 0 && session->lru_head != NULL &&
+        session->num_cloned >= session->max_streams) {
+        stream = session->lru_head;
+        debug_print(mod_srtp, "evicting stream (SSRC: 0x%08x)",
+                    (unsigned int)ntohl(stream->ssrc));
+        srtp_stream_list_remove(session->stream_list, stream);
+        status = srtp_session_release_stream(session, stream);
+        if (status) {
+            return status;
+        }
+    }
+
+    if (session->num_spare_streams > 0) {
+        stream = session->spare_streams[--session->num_spare_streams];
+        srtp_stream_reset(stream, ssrc);
+        srtp_stream_follow_template(stream, session->stream_template);
+    } else if (session->no_packet_alloc) {
+        debug_print(mod_srtp, "no spare stream for SSRC 0x%08x",
+                    (unsigned int)ntohl(ssrc));
+        return srtp_err_status_alloc_fail;
+    } else {
+        status = srtp_stream_clone(session->stream_template, ssrc, &stream);
+        if (status) {
+            return status;
+        }
+    }
+    stream->last_used = session->clock;
+
+    status = srtp_insert_or_dealloc_stream(session->stream_list, stream,
+                                           session->stream_template);
+    if (status) {
+        return status;
+    }
+    srtp_session_lru_link(session, session->lru_tail, stream);
+    *str_ptr = stream;
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_session_use_stream(session, stream) marks a stream as used for
+ * srtp_expire_idle_streams() and as the most recently used clone; it is
+ * only called once a packet has been protected, or has passed the
+ * authentication and replay checks, so that forged packets cannot keep a
+ * stream alive
+ */
+static inline void srtp_session_use_stream(srtp_t session,
+                                           srtp_stream_ctx_t *stream)
+{
+    stream->last_used = session->clock;
+    if (stream != session->lru_tail &&
+        srtp_session_lru_linked(session, stream)) {
+        srtp_session_lru_unlink(session, stream);
+        srtp_session_lru_link(session, session->lru_tail, stream);
+    }
+}
+
+/*
+ * key derivation functions, internal to libSRTP
+ *
+ * srtp_kdf_t is a key derivation context
+ *
+ * srtp_kdf_init(&kdf, cipher_id, k, keylen) initializes kdf to use cipher
+ * described by cipher_id, with the master key k with length in octets keylen.
+ *
+ * srtp_kdf_generate(&kdf, l, kl, keylen) derives the key
+ * corresponding to label l and puts it into kl; the length
+ * of the key in octets is provided as keylen.  this function
+ * should be called once for each subkey that is derived.
+ *
+ * srtp_kdf_clear(&kdf) zeroizes and deallocates the kdf state
+ */
+
+typedef enum {
+    label_rtp_encryption = 0x00,
+    label_rtp_msg_auth = 0x01,
+    label_rtp_salt = 0x02,
+    label_rtcp_encryption = 0x03,
+    label_rtcp_msg_auth = 0x04,
+    label_rtcp_salt = 0x05,
+    label_rtp_header_encryption = 0x06,
+    label_rtp_header_salt = 0x07
+} srtp_prf_label;
+
+#define MAX_SRTP_KEY_LEN 256
+
+#if defined(OPENSSL) && defined(OPENSSL_KDF)
+#define MAX_SRTP_AESKEY_LEN 32
+#define MAX_SRTP_SALT_LEN 14
+
+/*
+ * srtp_kdf_t represents a key derivation function.  The SRTP
+ * default KDF is the only one implemented at present.
+ */
+typedef struct {
+    uint8_t master_key[MAX_SRTP_AESKEY_LEN];
+    uint8_t master_salt[MAX_SRTP_SALT_LEN];
+    const EVP_CIPHER *evp;
+} srtp_kdf_t;
+
+static srtp_err_status_t srtp_kdf_init(srtp_kdf_t *kdf,
+                                       const uint8_t *key,
+                                       size_t key_len,
+                                       size_t salt_len)
+{
+    memset(kdf, 0x0, sizeof(srtp_kdf_t));
+
+    /* The NULL cipher has zero key length */
+    if (key_len == 0) {
+        return srtp_err_status_ok;
+    }
+
+    if ((key_len > MAX_SRTP_AESKEY_LEN) || (salt_len > MAX_SRTP_SALT_LEN)) {
+        return srtp_err_status_bad_param;
+    }
+    switch (key_len) {
+    case SRTP_AES_256_KEYSIZE:
+        kdf->evp = EVP_aes_256_ctr();
+        break;
+    case SRTP_AES_192_KEYSIZE:
+        kdf->evp = EVP_aes_192_ctr();
+        break;
+    case SRTP_AES_128_KEYSIZE:
         kdf->evp = EVP_aes_128_ctr();
         break;
     default:
@@ -1205,6 +1877,77 @@ static inline size_t full_auth_key_length(const srtp_auth_type_t *auth)
     }
 }
 
+/*
+ * srtp_mki_hash(mki_id, mki_size) returns the bucket of the MKI index at
+ * which the search for mki_id starts (FNV-1a over the MKI)
+ */
+static size_t srtp_mki_hash(const uint8_t *mki_id, size_t mki_size)
+{
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < mki_size; i++) {
+        hash ^= mki_id[i];
+        hash *= 16777619U;
+    }
+
+    return hash & (SRTP_MKI_INDEX_SIZE - 1);
+}
+
+/*
+ * srtp_stream_find_mki(stream, mki_id) returns the position in
+ * session_keys of the master key with the given MKI, or num_master_keys
+ * if the stream has no such key
+ */
+static size_t srtp_stream_find_mki(const srtp_stream_ctx_t *stream,
+                                   const uint8_t *mki_id)
+{
+    size_t bucket = srtp_mki_hash(mki_id, stream->mki_size);
+
+    for (size_t i = 0; i < SRTP_MKI_INDEX_SIZE; i++) {
+        size_t entry = stream->mki_index[bucket];
+
+        if (entry == 0) {
+            break;
+        }
+        if (memcmp(mki_id, stream->session_keys[entry - 1].mki_id,
+                   stream->mki_size) == 0) {
+            return entry - 1;
+        }
+        bucket = (bucket + 1) & (SRTP_MKI_INDEX_SIZE - 1);
+    }
+
+    return stream->num_master_keys;
+}
+
+/*
+ * srtp_stream_index_mkis(stream) rebuilds the MKI index after the master
+ * keys of stream have changed; if two keys have the same MKI the first
+ * one is used, as with a linear search
+ */
+static void srtp_stream_index_mkis(srtp_stream_ctx_t *stream)
+{
+    memset(stream->mki_index, 0, sizeof(stream->mki_index));
+
+    if (!stream->use_mki) {
+        return;
+    }
+
+    for (size_t i = 0; i < stream->num_master_keys; i++) {
+        const uint8_t *mki_id = stream->session_keys[i].mki_id;
+        size_t bucket;
+
+        if (srtp_stream_find_mki(stream, mki_id) != stream->num_master_keys) {
+            continue;
+        }
+
+        bucket = srtp_mki_hash(mki_id, stream->mki_size);
+        while (stream->mki_index[bucket] != 0) {
+            bucket = (bucket + 1) & (SRTP_MKI_INDEX_SIZE - 1);
+        }
+        stream->mki_index[bucket] = (uint8_t)(i + 1);
+    }
+}
+
 srtp_err_status_t srtp_get_session_keys(srtp_stream_ctx_t *stream,
                                         size_t mki_index,
                                         srtp_session_keys_t **session_keys)
@@ -1231,39 +1974,103 @@ void srtp_inject_mki(uint8_t *mki_tag_location,
     }
 }
 
-srtp_err_status_t srtp_stream_init_keys(srtp_session_keys_t *session_keys,
-                                        const srtp_master_key_t *master_key,
-                                        size_t mki_size)
+/*
+ * srtp_kdf_profile_t describes what the key derivation produces for one
+ * master key: which master key octets go in, and how many octets are
+ * generated for each label.  Two master keys with the same octets and the
+ * same profile derive the same session keys.
+ */
+typedef struct srtp_kdf_profile_t {
+    size_t input_keylen;
+    size_t kdf_keylen;
+    size_t rtp_base_key_len;
+    size_t rtp_salt_len;
+    size_t rtp_auth_key_len;
+    bool rtp_xtn_hdr;
+    bool rtp_xtn_hdr_own_kdf; /* the header cipher is not the rtp cipher */
+    size_t rtp_xtn_hdr_base_key_len;
+    size_t rtp_xtn_hdr_salt_len;
+    size_t rtcp_base_key_len;
+    size_t rtcp_salt_len;
+    size_t rtcp_auth_key_len;
+} srtp_kdf_profile_t;
+
+/*
+ * srtp_kdf_cache_t remembers the session keys of the last few master keys
+ * that were derived in a session, so that streams added with the same
+ * master key and profile, e.g. from a policy list, skip the derivation
+ */
+#define SRTP_KDF_CACHE_SIZE 4
+
+typedef struct srtp_kdf_cache_entry_t {
+    bool valid;
+    srtp_kdf_profile_t profile;
+    uint8_t master_key[SRTP_KDF_MAX_OUTPUT_LEN];
+    srtp_kdf_output_t output;
+} srtp_kdf_cache_entry_t;
+
+typedef struct srtp_kdf_cache_t {
+    srtp_kdf_cache_entry_t entries[SRTP_KDF_CACHE_SIZE];
+    size_t next; /* entry to replace next */
+} srtp_kdf_cache_t;
+
+static void srtp_kdf_cache_dealloc(srtp_kdf_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    /* the cache holds copies of master keys */
+    octet_string_set_to_zero(cache, sizeof(srtp_kdf_cache_t));
+    srtp_crypto_free(cache);
+}
+
+/*
+ * srtp_session_kdf_cache_purge(session) zeroizes and frees the key
+ * derivation cache of session.  Session keys do not record the master key
+ * they came from, so when a key or a stream is removed, or a key replaced,
+ * the entries that belong to it cannot be told apart from the rest and all
+ * of them go.
+ */
+static void srtp_session_kdf_cache_purge(srtp_t session)
+{
+    srtp_kdf_cache_dealloc(session->kdf_cache);
+    session->kdf_cache = NULL;
+}
+
+/*
+ * srtp_session_kdf_cache(session) returns the key derivation cache of
+ * session, which is allocated when it is first needed; if that fails the
+ * keys are derived without a cache
+ */
+static srtp_kdf_cache_t *srtp_session_kdf_cache(srtp_t session)
+{
+    if (session->kdf_cache == NULL) {
+        session->kdf_cache =
+            (srtp_kdf_cache_t *)srtp_crypto_alloc(sizeof(srtp_kdf_cache_t));
+    }
+
+    return session->kdf_cache;
+}
+
+/*
+ * srtp_kdf_profile_init(profile, session_keys) works out the profile of
+ * the key derivation for the ciphers and auth functions of session_keys
+ */
+static srtp_err_status_t srtp_kdf_profile_init(
+    srtp_kdf_profile_t *profile,
+    const srtp_session_keys_t *session_keys)
 {
-    srtp_err_status_t stat;
-    srtp_kdf_t kdf;
-    uint8_t tmp_key[MAX_SRTP_KEY_LEN];
     size_t input_keylen, full_keylen;
     size_t kdf_keylen = 30, rtp_keylen, rtcp_keylen;
-    size_t rtp_base_key_len, rtp_salt_len;
-    size_t rtcp_base_key_len, rtcp_salt_len;
 
     /* If RTP or RTCP have a key length > AES-128, assume matching kdf. */
     /* TODO: kdf algorithm, master key length, and master salt length should
      * be part of srtp_policy_t.
      */
 
-    /* initialize key limit to maximum value */
-    srtp_key_limit_set(session_keys->limit, 0xffffffffffffLL);
-
-    if (mki_size != 0) {
-        if (master_key->mki_id == NULL) {
-            return srtp_err_status_bad_param;
-        }
-        session_keys->mki_id = srtp_crypto_alloc(mki_size);
-
-        if (session_keys->mki_id == NULL) {
-            return srtp_err_status_init_fail;
-        }
-        memcpy(session_keys->mki_id, master_key->mki_id, mki_size);
-    } else {
-        session_keys->mki_id = NULL;
-    }
+    /* the profile is compared as a whole, padding included */
+    memset(profile, 0, sizeof(srtp_kdf_profile_t));
 
     input_keylen = full_key_length(session_keys->rtp_cipher->type);
     full_keylen = full_auth_key_length(session_keys->rtp_auth->type);
@@ -1281,9 +2088,6 @@ srtp_err_status_t srtp_stream_init_keys(srtp_session_keys_t *session_keys,
 
     rtp_keylen = srtp_cipher_get_key_length(session_keys->rtp_cipher);
     rtcp_keylen = srtp_cipher_get_key_length(session_keys->rtcp_cipher);
-    rtp_base_key_len =
-        base_key_length(session_keys->rtp_cipher->type, rtp_keylen);
-    rtp_salt_len = rtp_keylen - rtp_base_key_len;
 
     /*
      * We assume that the `key` buffer provided by the caller has a length
@@ -1307,12 +2111,144 @@ srtp_err_status_t srtp_stream_init_keys(srtp_session_keys_t *session_keys,
         kdf_keylen = 46; /* AES-CTR mode is always used for KDF */
     }
 
-    debug_print(mod_srtp, "input key len: %zu", input_keylen);
-    debug_print(mod_srtp, "srtp key len: %zu", rtp_keylen);
-    debug_print(mod_srtp, "srtcp key len: %zu", rtcp_keylen);
-    debug_print(mod_srtp, "base key len: %zu", rtp_base_key_len);
+    profile->input_keylen = input_keylen;
+    profile->kdf_keylen = kdf_keylen;
+    profile->rtp_base_key_len =
+        base_key_length(session_keys->rtp_cipher->type, rtp_keylen);
+    profile->rtp_salt_len = rtp_keylen - profile->rtp_base_key_len;
+    profile->rtp_auth_key_len =
+        srtp_auth_get_key_length(session_keys->rtp_auth);
+    profile->rtcp_base_key_len =
+        base_key_length(session_keys->rtcp_cipher->type, rtcp_keylen);
+    profile->rtcp_salt_len = rtcp_keylen - profile->rtcp_base_key_len;
+    profile->rtcp_auth_key_len =
+        srtp_auth_get_key_length(session_keys->rtcp_auth);
+
+    if (session_keys->rtp_xtn_hdr_cipher) {
+        profile->rtp_xtn_hdr = true;
+
+        if (session_keys->rtp_xtn_hdr_cipher->type !=
+            session_keys->rtp_cipher->type) {
+            /*
+             * With GCM ciphers, the header extensions are still encrypted using
+             * the corresponding ICM cipher.
+             * See https://tools.ietf.org/html/rfc7714#section-8.3
+             */
+            size_t rtp_xtn_hdr_keylen =
+                srtp_cipher_get_key_length(session_keys->rtp_xtn_hdr_cipher);
+
+            profile->rtp_xtn_hdr_own_kdf = true;
+            profile->rtp_xtn_hdr_base_key_len = base_key_length(
+                session_keys->rtp_xtn_hdr_cipher->type, rtp_xtn_hdr_keylen);
+            profile->rtp_xtn_hdr_salt_len =
+                rtp_xtn_hdr_keylen - profile->rtp_xtn_hdr_base_key_len;
+            if (profile->rtp_xtn_hdr_salt_len > profile->rtp_salt_len) {
+                switch (session_keys->rtp_cipher->type->id) {
+                case SRTP_AES_GCM_128:
+                case SRTP_AES_GCM_256:
+                    /*
+                     * The shorter GCM salt is padded to the required ICM salt
+                     * length.
+                     */
+                    profile->rtp_xtn_hdr_salt_len = profile->rtp_salt_len;
+                    break;
+                default:
+                    return srtp_err_status_bad_param;
+                }
+            }
+        } else {
+            /* Reuse main KDF. */
+            profile->rtp_xtn_hdr_base_key_len = profile->rtp_base_key_len;
+            profile->rtp_xtn_hdr_salt_len = profile->rtp_salt_len;
+        }
+    }
+
+    if (input_keylen > SRTP_KDF_MAX_OUTPUT_LEN ||
+        rtp_keylen > SRTP_KDF_MAX_OUTPUT_LEN ||
+        rtcp_keylen > SRTP_KDF_MAX_OUTPUT_LEN ||
+        profile->rtp_auth_key_len > SRTP_KDF_MAX_OUTPUT_LEN ||
+        profile->rtcp_auth_key_len > SRTP_KDF_MAX_OUTPUT_LEN ||
+        profile->rtp_xtn_hdr_base_key_len + profile->rtp_xtn_hdr_salt_len >
+            SRTP_KDF_MAX_OUTPUT_LEN) {
+        return srtp_err_status_bad_param;
+    }
+
+    debug_print(mod_srtp, "input key len: %zu", input_keylen);
+    debug_print(mod_srtp, "srtp key len: %zu", rtp_keylen);
+    debug_print(mod_srtp, "srtcp key len: %zu", rtcp_keylen);
+    debug_print(mod_srtp, "base key len: %zu", profile->rtp_base_key_len);
     debug_print(mod_srtp, "kdf key len: %zu", kdf_keylen);
-    debug_print(mod_srtp, "rtp salt len: %zu", rtp_salt_len);
+    debug_print(mod_srtp, "rtp salt len: %zu", profile->rtp_salt_len);
+    debug_print(mod_srtp, "rtcp salt len: %zu", profile->rtcp_salt_len);
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_kdf_master_key_len(profile) is the number of master key octets
+ * that the derivation for profile reads
+ */
+static size_t srtp_kdf_master_key_len(const srtp_kdf_profile_t *profile)
+{
+    size_t len = profile->input_keylen;
+
+    if (profile->rtp_xtn_hdr_own_kdf &&
+        profile->rtp_xtn_hdr_base_key_len + profile->rtp_xtn_hdr_salt_len >
+            len) {
+        len = profile->rtp_xtn_hdr_base_key_len + profile->rtp_xtn_hdr_salt_len;
+    }
+
+    return len;
+}
+
+/*
+ * srtp_kdf_generate_key(kdf, key_label, salt_label, key, base_key_len,
+ * salt_len) generates a cipher key followed by its salt
+ */
+static srtp_err_status_t srtp_kdf_generate_key(srtp_kdf_t *kdf,
+                                               srtp_prf_label key_label,
+                                               srtp_prf_label salt_label,
+                                               uint8_t *key,
+                                               size_t base_key_len,
+                                               size_t salt_len)
+{
+    srtp_err_status_t stat;
+
+    stat = srtp_kdf_generate(kdf, key_label, key, base_key_len);
+    if (stat) {
+        return stat;
+    }
+
+    /*
+     * if the cipher uses a salt, then we need to generate the salt value,
+     * put after the key
+     */
+    if (salt_len > 0) {
+        stat = srtp_kdf_generate(kdf, salt_label, key + base_key_len, salt_len);
+        if (stat) {
+            return stat;
+        }
+    }
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_kdf_derive(profile, master_key, output) runs the key derivation for
+ * all labels of profile in one pass over a single KDF instance (two, if
+ * the header extension cipher needs its own)
+ */
+static srtp_err_status_t srtp_kdf_derive(const srtp_kdf_profile_t *profile,
+                                         const uint8_t *master_key,
+                                         srtp_kdf_output_t *output)
+{
+    srtp_err_status_t stat;
+    srtp_err_status_t clear_stat;
+    srtp_kdf_t kdf;
+    uint8_t tmp_key[MAX_SRTP_KEY_LEN];
+
+    /* short salts are padded with zeros */
+    octet_string_set_to_zero(output, sizeof(srtp_kdf_output_t));
 
     /*
      * Make sure the key given to us is 'zero' appended.  GCM
@@ -1320,289 +2256,306 @@ srtp_err_status_t srtp_stream_init_keys(srtp_session_keys_t *session_keys,
      * the legacy CTR mode KDF, which uses a 112 bit master SALT.
      */
     memset(tmp_key, 0x0, MAX_SRTP_KEY_LEN);
-    memcpy(tmp_key, master_key->key, input_keylen);
+    memcpy(tmp_key, master_key, profile->input_keylen);
 
 /* initialize KDF state     */
 #if defined(OPENSSL) && defined(OPENSSL_KDF)
-    stat = srtp_kdf_init(&kdf, tmp_key, rtp_base_key_len, rtp_salt_len);
+    stat = srtp_kdf_init(&kdf, tmp_key, profile->rtp_base_key_len,
+                         profile->rtp_salt_len);
 #else
-    stat = srtp_kdf_init(&kdf, tmp_key, kdf_keylen);
+    stat = srtp_kdf_init(&kdf, tmp_key, profile->kdf_keylen);
 #endif
+    octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
     if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
         return srtp_err_status_init_fail;
     }
 
-    /* generate encryption key  */
-    stat = srtp_kdf_generate(&kdf, label_rtp_encryption, tmp_key,
-                             rtp_base_key_len);
-    if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-        return srtp_err_status_init_fail;
+    stat = srtp_kdf_generate_key(&kdf, label_rtp_encryption, label_rtp_salt,
+                                 output->rtp_key, profile->rtp_base_key_len,
+                                 profile->rtp_salt_len);
+    if (stat == srtp_err_status_ok) {
+        stat = srtp_kdf_generate(&kdf, label_rtp_msg_auth,
+                                 output->rtp_auth_key,
+                                 profile->rtp_auth_key_len);
     }
-    debug_print(mod_srtp, "cipher key: %s",
-                srtp_octet_string_hex_string(tmp_key, rtp_base_key_len));
-
-    /*
-     * if the cipher in the srtp context uses a salt, then we need
-     * to generate the salt value
-     */
-    if (rtp_salt_len > 0) {
-        debug_print0(mod_srtp, "found rtp_salt_len > 0, generating salt");
-
-        /* generate encryption salt, put after encryption key */
-        stat = srtp_kdf_generate(&kdf, label_rtp_salt,
-                                 tmp_key + rtp_base_key_len, rtp_salt_len);
-        if (stat) {
-            /* zeroize temp buffer */
-            octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-            return srtp_err_status_init_fail;
-        }
-        memcpy(session_keys->salt, tmp_key + rtp_base_key_len,
-               SRTP_AEAD_SALT_LEN);
+    if (stat == srtp_err_status_ok && profile->rtp_xtn_hdr &&
+        !profile->rtp_xtn_hdr_own_kdf) {
+        stat = srtp_kdf_generate_key(
+            &kdf, label_rtp_header_encryption, label_rtp_header_salt,
+            output->rtp_xtn_hdr_key, profile->rtp_xtn_hdr_base_key_len,
+            profile->rtp_xtn_hdr_salt_len);
     }
-    if (rtp_salt_len > 0) {
-        debug_print(mod_srtp, "cipher salt: %s",
-                    srtp_octet_string_hex_string(tmp_key + rtp_base_key_len,
-                                                 rtp_salt_len));
+    if (stat == srtp_err_status_ok) {
+        stat = srtp_kdf_generate_key(
+            &kdf, label_rtcp_encryption, label_rtcp_salt, output->rtcp_key,
+            profile->rtcp_base_key_len, profile->rtcp_salt_len);
+    }
+    if (stat == srtp_err_status_ok) {
+        stat = srtp_kdf_generate(&kdf, label_rtcp_msg_auth,
+                                 output->rtcp_auth_key,
+                                 profile->rtcp_auth_key_len);
     }
 
-    /* initialize cipher */
-    stat = srtp_cipher_init(session_keys->rtp_cipher, tmp_key);
-    if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
+    clear_stat = srtp_kdf_clear(&kdf);
+    if (stat || clear_stat) {
+        octet_string_set_to_zero(output, sizeof(srtp_kdf_output_t));
         return srtp_err_status_init_fail;
     }
 
-    if (session_keys->rtp_xtn_hdr_cipher) {
-        /* generate extensions header encryption key  */
-        size_t rtp_xtn_hdr_keylen;
-        size_t rtp_xtn_hdr_base_key_len;
-        size_t rtp_xtn_hdr_salt_len;
-        srtp_kdf_t tmp_kdf;
-        srtp_kdf_t *xtn_hdr_kdf;
+    if (profile->rtp_xtn_hdr_own_kdf) {
+        size_t xtn_hdr_keylen =
+            profile->rtp_xtn_hdr_base_key_len + profile->rtp_xtn_hdr_salt_len;
 
-        if (session_keys->rtp_xtn_hdr_cipher->type !=
-            session_keys->rtp_cipher->type) {
-            /*
-             * With GCM ciphers, the header extensions are still encrypted using
-             * the corresponding ICM cipher.
-             * See https://tools.ietf.org/html/rfc7714#section-8.3
-             */
-            uint8_t tmp_xtn_hdr_key[MAX_SRTP_KEY_LEN];
-            rtp_xtn_hdr_keylen =
-                srtp_cipher_get_key_length(session_keys->rtp_xtn_hdr_cipher);
-            rtp_xtn_hdr_base_key_len = base_key_length(
-                session_keys->rtp_xtn_hdr_cipher->type, rtp_xtn_hdr_keylen);
-            rtp_xtn_hdr_salt_len =
-                rtp_xtn_hdr_keylen - rtp_xtn_hdr_base_key_len;
-            if (rtp_xtn_hdr_salt_len > rtp_salt_len) {
-                switch (session_keys->rtp_cipher->type->id) {
-                case SRTP_AES_GCM_128:
-                case SRTP_AES_GCM_256:
-                    /*
-                     * The shorter GCM salt is padded to the required ICM salt
-                     * length.
-                     */
-                    rtp_xtn_hdr_salt_len = rtp_salt_len;
-                    break;
-                default:
-                    /* zeroize temp buffer */
-                    octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-                    return srtp_err_status_bad_param;
-                }
-            }
-            memset(tmp_xtn_hdr_key, 0x0, MAX_SRTP_KEY_LEN);
-            memcpy(tmp_xtn_hdr_key, master_key->key,
-                   (rtp_xtn_hdr_base_key_len + rtp_xtn_hdr_salt_len));
-            xtn_hdr_kdf = &tmp_kdf;
+        memset(tmp_key, 0x0, MAX_SRTP_KEY_LEN);
+        memcpy(tmp_key, master_key, xtn_hdr_keylen);
 
 /* initialize KDF state */
 #if defined(OPENSSL) && defined(OPENSSL_KDF)
-            stat =
-                srtp_kdf_init(xtn_hdr_kdf, tmp_xtn_hdr_key,
-                              rtp_xtn_hdr_base_key_len, rtp_xtn_hdr_salt_len);
+        stat = srtp_kdf_init(&kdf, tmp_key, profile->rtp_xtn_hdr_base_key_len,
+                             profile->rtp_xtn_hdr_salt_len);
 #else
-            stat = srtp_kdf_init(xtn_hdr_kdf, tmp_xtn_hdr_key, kdf_keylen);
+        stat = srtp_kdf_init(&kdf, tmp_key, profile->kdf_keylen);
 #endif
-            octet_string_set_to_zero(tmp_xtn_hdr_key, MAX_SRTP_KEY_LEN);
-            if (stat) {
-                /* zeroize temp buffer */
-                octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-                return srtp_err_status_init_fail;
-            }
-        } else {
-            /* Reuse main KDF. */
-            rtp_xtn_hdr_keylen = rtp_keylen;
-            rtp_xtn_hdr_base_key_len = rtp_base_key_len;
-            rtp_xtn_hdr_salt_len = rtp_salt_len;
-            xtn_hdr_kdf = &kdf;
-        }
-
-        stat = srtp_kdf_generate(xtn_hdr_kdf, label_rtp_header_encryption,
-                                 tmp_key, rtp_xtn_hdr_base_key_len);
+        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
         if (stat) {
-            /* zeroize temp buffer */
-            octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
+            octet_string_set_to_zero(output, sizeof(srtp_kdf_output_t));
             return srtp_err_status_init_fail;
         }
-        debug_print(
-            mod_srtp, "extensions cipher key: %s",
-            srtp_octet_string_hex_string(tmp_key, rtp_xtn_hdr_base_key_len));
 
-        /*
-         * if the cipher in the srtp context uses a salt, then we need
-         * to generate the salt value
-         */
-        if (rtp_xtn_hdr_salt_len > 0) {
-            debug_print0(mod_srtp,
-                         "found rtp_xtn_hdr_salt_len > 0, generating salt");
-
-            /* generate encryption salt, put after encryption key */
-            stat = srtp_kdf_generate(xtn_hdr_kdf, label_rtp_header_salt,
-                                     tmp_key + rtp_xtn_hdr_base_key_len,
-                                     rtp_xtn_hdr_salt_len);
-            if (stat) {
-                /* zeroize temp buffer */
-                octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-                return srtp_err_status_init_fail;
-            }
-        }
-        if (rtp_xtn_hdr_salt_len > 0) {
-            debug_print(
-                mod_srtp, "extensions cipher salt: %s",
-                srtp_octet_string_hex_string(tmp_key + rtp_xtn_hdr_base_key_len,
-                                             rtp_xtn_hdr_salt_len));
-        }
+        stat = srtp_kdf_generate_key(
+            &kdf, label_rtp_header_encryption, label_rtp_header_salt,
+            output->rtp_xtn_hdr_key, profile->rtp_xtn_hdr_base_key_len,
+            profile->rtp_xtn_hdr_salt_len);
 
-        /* initialize extensions header cipher */
-        stat = srtp_cipher_init(session_keys->rtp_xtn_hdr_cipher, tmp_key);
-        if (stat) {
-            /* zeroize temp buffer */
-            octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
+        /* release memory for custom header extension encryption kdf */
+        clear_stat = srtp_kdf_clear(&kdf);
+        if (stat || clear_stat) {
+            octet_string_set_to_zero(output, sizeof(srtp_kdf_output_t));
             return srtp_err_status_init_fail;
         }
+    }
 
-        if (xtn_hdr_kdf != &kdf) {
-            /* release memory for custom header extension encryption kdf */
-            stat = srtp_kdf_clear(xtn_hdr_kdf);
-            if (stat) {
-                /* zeroize temp buffer */
-                octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-                return srtp_err_status_init_fail;
-            }
-        }
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_kdf_cache_derive(cache, profile, master_key, output) gets the
+ * session keys for master_key from cache if they are there, and runs the
+ * key derivation and adds them to it otherwise; cache may be NULL
+ */
+static srtp_err_status_t srtp_kdf_cache_derive(
+    srtp_kdf_cache_t *cache,
+    const srtp_kdf_profile_t *profile,
+    const uint8_t *master_key,
+    srtp_kdf_output_t *output)
+{
+    size_t master_key_len = srtp_kdf_master_key_len(profile);
+    srtp_kdf_cache_entry_t *entry;
+    srtp_err_status_t stat;
+
+    if (cache == NULL) {
+        return srtp_kdf_derive(profile, master_key, output);
     }
 
-    /* generate authentication key */
-    stat = srtp_kdf_generate(&kdf, label_rtp_msg_auth, tmp_key,
-                             srtp_auth_get_key_length(session_keys->rtp_auth));
-    if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-        return srtp_err_status_init_fail;
+    for (size_t i = 0; i < SRTP_KDF_CACHE_SIZE; i++) {
+        entry = &cache->entries[i];
+        if (entry->valid &&
+            memcmp(&entry->profile, profile, sizeof(srtp_kdf_profile_t)) ==
+                0 &&
+            srtp_octet_string_equal(entry->master_key, master_key,
+                                    master_key_len)) {
+            debug_print0(mod_srtp, "using cached session keys");
+            memcpy(output, &entry->output, sizeof(srtp_kdf_output_t));
+            return srtp_err_status_ok;
+        }
     }
-    debug_print(mod_srtp, "auth key:   %s",
-                srtp_octet_string_hex_string(
-                    tmp_key, srtp_auth_get_key_length(session_keys->rtp_auth)));
 
-    /* initialize auth function */
-    stat = srtp_auth_init(session_keys->rtp_auth, tmp_key);
+    stat = srtp_kdf_derive(profile, master_key, output);
     if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-        return srtp_err_status_init_fail;
+        return stat;
     }
 
-    /*
-     * ...now initialize SRTCP keys
-     */
+    entry = &cache->entries[cache->next];
+    cache->next = (cache->next + 1) % SRTP_KDF_CACHE_SIZE;
+    octet_string_set_to_zero(entry, sizeof(srtp_kdf_cache_entry_t));
+    entry->valid = true;
+    entry->profile = *profile;
+    memcpy(entry->master_key, master_key, master_key_len);
+    memcpy(&entry->output, output, sizeof(srtp_kdf_output_t));
 
-    rtcp_base_key_len =
-        base_key_length(session_keys->rtcp_cipher->type, rtcp_keylen);
-    rtcp_salt_len = rtcp_keylen - rtcp_base_key_len;
-    debug_print(mod_srtp, "rtcp salt len: %zu", rtcp_salt_len);
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_session_keys_install(session_keys, profile, output) keys the
+ * ciphers and auth functions of session_keys with the derived keys
+ */
+static srtp_err_status_t srtp_session_keys_install(
+    srtp_session_keys_t *session_keys,
+    const srtp_kdf_profile_t *profile,
+    const srtp_kdf_output_t *output)
+{
+    srtp_err_status_t stat;
 
-    /* generate encryption key  */
-    stat = srtp_kdf_generate(&kdf, label_rtcp_encryption, tmp_key,
-                             rtcp_base_key_len);
+    debug_print(mod_srtp, "cipher key: %s",
+                srtp_octet_string_hex_string(output->rtp_key,
+                                             profile->rtp_base_key_len));
+    if (profile->rtp_salt_len > 0) {
+        memcpy(session_keys->salt, output->rtp_key + profile->rtp_base_key_len,
+               SRTP_AEAD_SALT_LEN);
+        debug_print(mod_srtp, "cipher salt: %s",
+                    srtp_octet_string_hex_string(
+                        output->rtp_key + profile->rtp_base_key_len,
+                        profile->rtp_salt_len));
+    }
+
+    /* initialize cipher */
+    stat = srtp_cipher_init(session_keys->rtp_cipher, output->rtp_key);
     if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
         return srtp_err_status_init_fail;
     }
 
-    /*
-     * if the cipher in the srtp context uses a salt, then we need
-     * to generate the salt value
-     */
-    if (rtcp_salt_len > 0) {
-        debug_print0(mod_srtp, "found rtcp_salt_len > 0, generating rtcp salt");
+    if (session_keys->rtp_xtn_hdr_cipher) {
+        debug_print(mod_srtp, "extensions cipher key: %s",
+                    srtp_octet_string_hex_string(
+                        output->rtp_xtn_hdr_key,
+                        profile->rtp_xtn_hdr_base_key_len));
+        if (profile->rtp_xtn_hdr_salt_len > 0) {
+            debug_print(mod_srtp, "extensions cipher salt: %s",
+                        srtp_octet_string_hex_string(
+                            output->rtp_xtn_hdr_key +
+                                profile->rtp_xtn_hdr_base_key_len,
+                            profile->rtp_xtn_hdr_salt_len));
+        }
 
-        /* generate encryption salt, put after encryption key */
-        stat = srtp_kdf_generate(&kdf, label_rtcp_salt,
-                                 tmp_key + rtcp_base_key_len, rtcp_salt_len);
+        /* initialize extensions header cipher */
+        stat = srtp_cipher_init(session_keys->rtp_xtn_hdr_cipher,
+                                output->rtp_xtn_hdr_key);
         if (stat) {
-            /* zeroize temp buffer */
-            octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
             return srtp_err_status_init_fail;
         }
-        memcpy(session_keys->c_salt, tmp_key + rtcp_base_key_len,
-               SRTP_AEAD_SALT_LEN);
     }
+
+    debug_print(mod_srtp, "auth key:   %s",
+                srtp_octet_string_hex_string(output->rtp_auth_key,
+                                             profile->rtp_auth_key_len));
+
+    /* initialize auth function */
+    stat = srtp_auth_init(session_keys->rtp_auth, output->rtp_auth_key);
+    if (stat) {
+        return srtp_err_status_init_fail;
+    }
+
     debug_print(mod_srtp, "rtcp cipher key: %s",
-                srtp_octet_string_hex_string(tmp_key, rtcp_base_key_len));
-    if (rtcp_salt_len > 0) {
+                srtp_octet_string_hex_string(output->rtcp_key,
+                                             profile->rtcp_base_key_len));
+    if (profile->rtcp_salt_len > 0) {
+        memcpy(session_keys->c_salt,
+               output->rtcp_key + profile->rtcp_base_key_len,
+               SRTP_AEAD_SALT_LEN);
         debug_print(mod_srtp, "rtcp cipher salt: %s",
-                    srtp_octet_string_hex_string(tmp_key + rtcp_base_key_len,
-                                                 rtcp_salt_len));
+                    srtp_octet_string_hex_string(
+                        output->rtcp_key + profile->rtcp_base_key_len,
+                        profile->rtcp_salt_len));
     }
 
     /* initialize cipher */
-    stat = srtp_cipher_init(session_keys->rtcp_cipher, tmp_key);
+    stat = srtp_cipher_init(session_keys->rtcp_cipher, output->rtcp_key);
     if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
         return srtp_err_status_init_fail;
     }
 
-    /* generate authentication key */
-    stat = srtp_kdf_generate(&kdf, label_rtcp_msg_auth, tmp_key,
-                             srtp_auth_get_key_length(session_keys->rtcp_auth));
+    debug_print(mod_srtp, "rtcp auth key:   %s",
+                srtp_octet_string_hex_string(output->rtcp_auth_key,
+                                             profile->rtcp_auth_key_len));
+
+    /* initialize auth function */
+    stat = srtp_auth_init(session_keys->rtcp_auth, output->rtcp_auth_key);
     if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
         return srtp_err_status_init_fail;
     }
 
-    debug_print(
-        mod_srtp, "rtcp auth key:   %s",
-        srtp_octet_string_hex_string(
-            tmp_key, srtp_auth_get_key_length(session_keys->rtcp_auth)));
+    return srtp_err_status_ok;
+}
 
-    /* initialize auth function */
-    stat = srtp_auth_init(session_keys->rtcp_auth, tmp_key);
+/*
+ * srtp_session_keys_keep_derived(session_keys, output) keeps a copy of the
+ * derived keys, from which srtp_session_restore() keys a stream without
+ * running the key derivation; a stream that is rekeyed reuses its copy.
+ * Only the streams of a session set up with srtp_set_serializable() keep
+ * one.
+ */
+static srtp_err_status_t srtp_session_keys_keep_derived(
+    srtp_session_keys_t *session_keys,
+    const srtp_kdf_output_t *output)
+{
+    if (session_keys->derived == NULL) {
+        session_keys->derived =
+            (srtp_kdf_output_t *)srtp_crypto_alloc(sizeof(srtp_kdf_output_t));
+        if (session_keys->derived == NULL) {
+            return srtp_err_status_alloc_fail;
+        }
+    }
+    memcpy(session_keys->derived, output, sizeof(srtp_kdf_output_t));
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_stream_init_keys(srtp_session_keys_t *session_keys,
+                                        const srtp_master_key_t *master_key,
+                                        size_t mki_size,
+                                        bool keep_derived,
+                                        srtp_kdf_cache_t *kdf_cache)
+{
+    srtp_err_status_t stat;
+    srtp_kdf_profile_t profile;
+    srtp_kdf_output_t output;
+
+    /* initialize key limit to maximum value */
+    srtp_key_limit_set(session_keys->limit, 0xffffffffffffLL);
+
+    if (mki_size != 0) {
+        if (master_key->mki_id == NULL) {
+            return srtp_err_status_bad_param;
+        }
+        /* a stream that is rekeyed already has room for the MKI */
+        if (session_keys->mki_id == NULL) {
+            session_keys->mki_id = srtp_crypto_alloc(mki_size);
+        }
+
+        if (session_keys->mki_id == NULL) {
+            return srtp_err_status_init_fail;
+        }
+        memcpy(session_keys->mki_id, master_key->mki_id, mki_size);
+    } else {
+        session_keys->mki_id = NULL;
+    }
+
+    stat = srtp_kdf_profile_init(&profile, session_keys);
     if (stat) {
-        /* zeroize temp buffer */
-        octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
-        return srtp_err_status_init_fail;
+        return stat;
     }
 
-    /* clear memory then return */
-    stat = srtp_kdf_clear(&kdf);
-    octet_string_set_to_zero(tmp_key, MAX_SRTP_KEY_LEN);
+    stat = srtp_kdf_cache_derive(kdf_cache, &profile, master_key->key,
+                                 &output);
     if (stat) {
-        return srtp_err_status_init_fail;
+        return stat;
     }
 
-    return srtp_err_status_ok;
+    stat = srtp_session_keys_install(session_keys, &profile, &output);
+    if (stat == srtp_err_status_ok && keep_derived) {
+        stat = srtp_session_keys_keep_derived(session_keys, &output);
+    }
+
+    /* zeroize the derived keys */
+    octet_string_set_to_zero(&output, sizeof(srtp_kdf_output_t));
+
+    return stat;
 }
 
 srtp_err_status_t srtp_stream_init_all_master_keys(srtp_stream_ctx_t *srtp,
-                                                   const srtp_policy_t *p)
+                                                   const srtp_policy_t *p,
+                                                   srtp_kdf_cache_t *kdf_cache)
 {
     srtp_err_status_t status = srtp_err_status_ok;
     if (p->key != NULL) {
@@ -1616,7 +2569,8 @@ srtp_err_status_t srtp_stream_init_all_master_keys(srtp_stream_ctx_t *srtp,
         single_master_key.key = p->key;
         single_master_key.mki_id = NULL;
         status = srtp_stream_init_keys(&srtp->session_keys[0],
-                                       &single_master_key, 0);
+                                       &single_master_key, 0,
+                                       srtp->keep_derived, kdf_cache);
     } else {
         if (p->num_master_keys > SRTP_MAX_NUM_MASTER_KEYS) {
             return srtp_err_status_bad_param;
@@ -1631,18 +2585,22 @@ srtp_err_status_t srtp_stream_init_all_master_keys(srtp_stream_ctx_t *srtp,
 
         for (size_t i = 0; i < srtp->num_master_keys; i++) {
             status = srtp_stream_init_keys(&srtp->session_keys[i], p->keys[i],
-                                           srtp->mki_size);
+                                           srtp->mki_size, srtp->keep_derived,
+                                           kdf_cache);
             if (status) {
                 return status;
             }
         }
     }
 
+    srtp_stream_index_mkis(srtp);
+
     return status;
 }
 
 static srtp_err_status_t srtp_stream_init(srtp_stream_ctx_t *srtp,
-                                          const srtp_policy_t *p)
+                                          const srtp_policy_t *p,
+                                          srtp_kdf_cache_t *kdf_cache)
 {
     srtp_err_status_t err;
 
@@ -1651,6 +2609,23 @@ static srtp_err_status_t srtp_stream_init(srtp_stream_ctx_t *srtp,
         return err;
     }
 
+    if (srtp_policy_is_double(&p->rtp)) {
+        srtp_double_policy_t d;
+
+        if (srtp->inner == NULL) {
+            return srtp_err_status_bad_param;
+        }
+        err = srtp_double_policy_init(&d, p);
+        if (err == srtp_err_status_ok) {
+            err = srtp_stream_init(srtp->inner, &d.inner, kdf_cache);
+        }
+        if (err == srtp_err_status_ok) {
+            err = srtp_stream_init(srtp, &d.outer, kdf_cache);
+        }
+        octet_string_set_to_zero(&d, sizeof(d));
+        return err;
+    }
+
     debug_print(mod_srtp, "initializing stream (SSRC: 0x%08x)",
                 (unsigned int)p->ssrc.value);
 
@@ -1666,6 +2641,11 @@ static srtp_err_status_t srtp_stream_init(srtp_stream_ctx_t *srtp,
         (p->window_size < 64 || p->window_size >= 0x8000))
         return srtp_err_status_bad_param;
 
+    /* the same limits apply to the SRTCP window */
+    if (p->rtcp_window_size != 0 &&
+        (p->rtcp_window_size < 64 || p->rtcp_window_size >= 0x8000))
+        return srtp_err_status_bad_param;
+
     if (p->window_size != 0) {
         err = srtp_rdbx_init(&srtp->rtp_rdbx, p->window_size);
     } else {
@@ -1693,20 +2673,31 @@ static srtp_err_status_t srtp_stream_init(srtp_stream_ctx_t *srtp,
     srtp->direction = dir_unknown;
 
     /* initialize SRTCP replay database */
-    srtp_rdb_init(&srtp->rtcp_rdb);
-
-    /* initialize allow_repeat_tx */
-    srtp->allow_repeat_tx = p->allow_repeat_tx;
-
+    if (p->rtcp_window_size != 0) {
+        err = srtp_rdb_init(&srtp->rtcp_rdb, p->rtcp_window_size);
+    } else {
+        err = srtp_rdb_init(&srtp->rtcp_rdb, 128);
+    }
+    if (err) {
+        srtp_rdbx_dealloc(&srtp->rtp_rdbx);
+        return err;
+    }
+
+    /* initialize allow_repeat_tx */
+    srtp->allow_repeat_tx = p->allow_repeat_tx;
+
     /* DAM - no RTCP key limit at present */
 
     /* initialize keys */
-    err = srtp_stream_init_all_master_keys(srtp, p);
+    err = srtp_stream_init_all_master_keys(srtp, p, kdf_cache);
     if (err) {
         srtp_rdbx_dealloc(&srtp->rtp_rdbx);
+        srtp_rdb_dealloc(&srtp->rtcp_rdb);
         return err;
     }
 
+    srtp_stream_compile(srtp);
+
     return srtp_err_status_ok;
 }
 
@@ -1767,32 +2758,256 @@ srtp_err_status_t srtp_install_event_handler(srtp_event_handler_func_t func)
     return srtp_err_status_ok;
 }
 
+/*
+ * the event queue lets the data path hand events to the application
+ * without calling into it.  srtp_queue_event() only ever writes the head
+ * and srtp_poll_events() the tail, so each side publishes its position
+ * with a release store and reads the other's with an acquire load.  A
+ * stream remembers where it last queued each kind of event, and does not
+ * queue it again while that entry is unread.
+ */
+#ifdef SRTP_HAVE_ATOMIC_BUILTINS
+
+static void srtp_queue_event(srtp_ctx_t *ctx,
+                             srtp_stream_ctx_t *stream,
+                             srtp_event_t event)
+{
+    srtp_event_queue_t *queue = ctx->event_queue;
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    srtp_event_data_t *data;
+
+    if (stream->event_pos[event] > tail) {
+        /* still waiting to be read, coalesce */
+        return;
+    }
+
+    if (head - tail > queue->mask) {
+        debug_print(mod_srtp, "event queue full, dropping event %d", event);
+        return;
+    }
+
+    data = &queue->events[head & queue->mask];
+    data->session = ctx;
+    data->ssrc = ntohl(stream->ssrc);
+    data->event = event;
+    stream->event_pos[event] = head + 1;
+
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#else /* SRTP_HAVE_ATOMIC_BUILTINS */
+
+static void srtp_queue_event(srtp_ctx_t *ctx,
+                             srtp_stream_ctx_t *stream,
+                             srtp_event_t event)
+{
+    /* srtp_set_event_queue() never sets up a queue */
+    (void)ctx;
+    (void)stream;
+    (void)event;
+}
+
+#endif /* SRTP_HAVE_ATOMIC_BUILTINS */
+
+static bool reset_event_pos_cb(srtp_stream_t stream, void *data)
+{
+    (void)data;
+    memset(stream->event_pos, 0, sizeof(stream->event_pos));
+    return true;
+}
+
+srtp_err_status_t srtp_set_event_queue(srtp_t session, size_t capacity)
+{
+    srtp_event_queue_t *queue = NULL;
+    size_t num_events = 1;
+
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    if (capacity > 0) {
+#ifdef SRTP_HAVE_ATOMIC_BUILTINS
+        while (num_events < capacity) {
+            if (num_events > SIZE_MAX / 2 / sizeof(srtp_event_data_t)) {
+                return srtp_err_status_bad_param;
+            }
+            num_events *= 2;
+        }
+
+        queue = (srtp_event_queue_t *)srtp_crypto_alloc(
+            sizeof(srtp_event_queue_t) +
+            num_events * sizeof(srtp_event_data_t));
+        if (queue == NULL) {
+            return srtp_err_status_alloc_fail;
+        }
+        queue->mask = num_events - 1;
+        queue->events = (srtp_event_data_t *)(queue + 1);
+#else
+        return srtp_err_status_fail;
+#endif
+    }
+
+    /* positions recorded against the old queue mean nothing in the new one */
+    srtp_stream_list_for_each(session->stream_list, reset_event_pos_cb, NULL);
+    if (session->stream_template) {
+        reset_event_pos_cb(session->stream_template, NULL);
+    }
+
+    srtp_crypto_free(session->event_queue);
+    session->event_queue = queue;
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_poll_events(srtp_t session,
+                                   srtp_event_data_t *events,
+                                   size_t *num_events)
+{
+#ifdef SRTP_HAVE_ATOMIC_BUILTINS
+    srtp_event_queue_t *queue;
+    uint64_t head;
+    uint64_t tail;
+    size_t n = 0;
+
+    if (session == NULL || events == NULL || num_events == NULL ||
+        session->event_queue == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    queue = session->event_queue;
+    tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+    while (n < *num_events && tail != head) {
+        events[n++] = queue->events[tail & queue->mask];
+        tail++;
+    }
+
+    __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+    *num_events = n;
+
+    return srtp_err_status_ok;
+#else
+    (void)session;
+    (void)events;
+    (void)num_events;
+    return srtp_err_status_bad_param;
+#endif
+}
+
+srtp_err_status_t srtp_dispatch_events(srtp_t session)
+{
+    srtp_event_data_t events[16];
+    size_t num_events;
+    size_t i;
+    srtp_err_status_t status;
+
+    do {
+        num_events = sizeof(events) / sizeof(events[0]);
+        status = srtp_poll_events(session, events, &num_events);
+        if (status) {
+            return status;
+        }
+
+        if (srtp_event_handler) {
+            for (i = 0; i < num_events; i++) {
+                srtp_event_handler(&events[i]);
+            }
+        }
+    } while (num_events == sizeof(events) / sizeof(events[0]));
+
+    return srtp_err_status_ok;
+}
+
 /*
  * Check if the given extension header id is / should be encrypted.
  * Returns true if yes, otherwise false.
  */
-static bool srtp_protect_extension_header(srtp_stream_ctx_t *stream, uint8_t id)
+static bool srtp_protect_extension_header(const srtp_stream_ctx_t *stream,
+                                          uint8_t id)
 {
-    uint8_t *enc_xtn_hdr = stream->enc_xtn_hdr;
-    size_t count = stream->enc_xtn_hdr_count;
+    return (stream->enc_xtn_hdr_ids[id >> 5] >> (id & 31)) & 1;
+}
 
-    if (!enc_xtn_hdr || count <= 0) {
-        return false;
-    }
+/*
+ * Keystream for header extension encryption is generated for a run of
+ * adjacent elements at a time.  A run ends at padding, or when the next
+ * element would not fit; the buffer must hold the largest two-byte element
+ * (2 bytes header + 255 bytes data).
+ */
+#define SRTP_XTN_HDR_KEYSTREAM_LEN 512
+
+/*
+ * Parses the header of the element at data.  Sets *hdr_len to 0 when
+ * there are no further elements to process.
+ */
+static srtp_err_status_t srtp_xtn_hdr_element(bool one_byte,
+                                              const uint8_t *data,
+                                              const uint8_t *end,
+                                              uint8_t *id,
+                                              size_t *hdr_len,
+                                              size_t *len)
+{
+    *id = 0;
+    *hdr_len = 0;
+    *len = 0;
 
-    while (count > 0) {
-        if (*enc_xtn_hdr == id) {
-            return true;
+    if (one_byte) {
+        /* RFC 5285, section 4.2. One-Byte Header */
+        if (data >= end) {
+            return srtp_err_status_ok;
+        }
+        *id = (*data & 0xf0) >> 4;
+        *len = (*data & 0x0f) + 1;
+        if (data + 1 + *len > end) {
+            return srtp_err_status_parse_err;
+        }
+        if (*id == 15) {
+            /* found header 15, stop further processing */
+            return srtp_err_status_ok;
+        }
+        *hdr_len = 1;
+    } else {
+        /* RFC 5285, section 4.3. Two-Byte Header */
+        if (data + 1 >= end) {
+            return srtp_err_status_ok;
+        }
+        *id = data[0];
+        *len = data[1];
+        if (data + 2 + *len > end) {
+            return srtp_err_status_parse_err;
         }
+        *hdr_len = 2;
+    }
+
+    return srtp_err_status_ok;
+}
 
-        enc_xtn_hdr++;
-        count--;
+static void srtp_xor_xtn_hdr_run(uint8_t *data,
+                                 const uint8_t *keystream,
+                                 size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        v128_xor_eq(data + i, keystream + i);
+    }
+#endif
+    for (; i < len; i++) {
+        data[i] ^= keystream[i];
     }
-    return false;
 }
 
 /*
  * extensions header encryption RFC 6904
+ *
+ * The keystream for a run of elements is generated in one call.  It is
+ * then masked, zeroing the bytes that cover element headers and elements
+ * that are not encrypted, and xor'ed onto the whole run.  Keystream is
+ * consumed for element headers but not for padding, so a run never
+ * extends across padding.
  */
 static srtp_err_status_t srtp_process_header_encryption(
     srtp_stream_ctx_t *stream,
@@ -1800,89 +3015,79 @@ static srtp_err_status_t srtp_process_header_encryption(
     srtp_session_keys_t *session_keys)
 {
     srtp_err_status_t status;
-    uint8_t keystream[257]; /* Maximum 2 bytes header + 255 bytes data. */
-    size_t keystream_pos;
+    uint8_t keystream[SRTP_XTN_HDR_KEYSTREAM_LEN];
     uint8_t *xtn_hdr_data = ((uint8_t *)xtn_hdr) + octets_in_rtp_xtn_hdr;
     uint8_t *xtn_hdr_end =
         xtn_hdr_data + (ntohs(xtn_hdr->length) * sizeof(uint32_t));
+    uint16_t profile = ntohs(xtn_hdr->profile_specific);
+    bool one_byte;
+    bool done = false;
 
-    if (ntohs(xtn_hdr->profile_specific) == xtn_hdr_one_byte_profile) {
-        /* RFC 5285, section 4.2. One-Byte Header */
-        while (xtn_hdr_data < xtn_hdr_end) {
-            uint8_t xid = (*xtn_hdr_data & 0xf0) >> 4;
-            size_t xlen = (*xtn_hdr_data & 0x0f) + 1;
-            size_t xlen_with_header = 1 + xlen;
-            xtn_hdr_data++;
-
-            if (xtn_hdr_data + xlen > xtn_hdr_end) {
-                return srtp_err_status_parse_err;
-            }
+    if (profile == xtn_hdr_one_byte_profile) {
+        one_byte = true;
+    } else if ((profile & 0xfff0) == xtn_hdr_two_byte_profile) {
+        one_byte = false;
+    } else {
+        /* unsupported extension header format. */
+        return srtp_err_status_parse_err;
+    }
 
-            if (xid == 15) {
-                /* found header 15, stop further processing */
-                break;
-            }
+    while (!done) {
+        uint8_t *run_end = xtn_hdr_data;
+        size_t run_len;
+        size_t pos;
+        uint8_t xid;
+        size_t hdr_len;
+        size_t xlen;
 
-            status = srtp_cipher_output(session_keys->rtp_xtn_hdr_cipher,
-                                        keystream, &xlen_with_header);
+        /* find the end of the run */
+        while (true) {
+            status = srtp_xtn_hdr_element(one_byte, run_end, xtn_hdr_end, &xid,
+                                          &hdr_len, &xlen);
             if (status) {
-                return srtp_err_status_cipher_fail;
+                return status;
             }
-
-            if (srtp_protect_extension_header(stream, xid)) {
-                keystream_pos = 1;
-                while (xlen > 0) {
-                    *xtn_hdr_data ^= keystream[keystream_pos++];
-                    xtn_hdr_data++;
-                    xlen--;
-                }
-            } else {
-                xtn_hdr_data += xlen;
+            if (hdr_len == 0) {
+                done = true;
+                break;
             }
-
-            /* skip padding bytes */
-            while (xtn_hdr_data < xtn_hdr_end && *xtn_hdr_data == 0) {
-                xtn_hdr_data++;
+            if ((size_t)(run_end - xtn_hdr_data) + hdr_len + xlen >
+                sizeof(keystream)) {
+                break;
             }
-        }
-    } else if ((ntohs(xtn_hdr->profile_specific) & 0xfff0) ==
-               xtn_hdr_two_byte_profile) {
-        /* RFC 5285, section 4.3. Two-Byte Header */
-        while (xtn_hdr_data + 1 < xtn_hdr_end) {
-            uint8_t xid = *xtn_hdr_data;
-            size_t xlen = *(xtn_hdr_data + 1);
-            size_t xlen_with_header = 2 + xlen;
-            xtn_hdr_data += 2;
-
-            if (xtn_hdr_data + xlen > xtn_hdr_end) {
-                return srtp_err_status_parse_err;
+            run_end += hdr_len + xlen;
+            if (run_end < xtn_hdr_end && *run_end == 0) {
+                break;
             }
+        }
 
+        run_len = (size_t)(run_end - xtn_hdr_data);
+        if (run_len > 0) {
             status = srtp_cipher_output(session_keys->rtp_xtn_hdr_cipher,
-                                        keystream, &xlen_with_header);
+                                        keystream, &run_len);
             if (status) {
                 return srtp_err_status_cipher_fail;
             }
 
-            if (xlen > 0 && srtp_protect_extension_header(stream, xid)) {
-                keystream_pos = 2;
-                while (xlen > 0) {
-                    *xtn_hdr_data ^= keystream[keystream_pos++];
-                    xtn_hdr_data++;
-                    xlen--;
+            /* mask out headers and elements that are not encrypted */
+            for (pos = 0; pos < run_len; pos += hdr_len + xlen) {
+                srtp_xtn_hdr_element(one_byte, xtn_hdr_data + pos,
+                                     xtn_hdr_end, &xid, &hdr_len, &xlen);
+                if (xlen > 0 && srtp_protect_extension_header(stream, xid)) {
+                    memset(keystream + pos, 0, hdr_len);
+                } else {
+                    memset(keystream + pos, 0, hdr_len + xlen);
                 }
-            } else {
-                xtn_hdr_data += xlen;
             }
 
-            /* skip padding bytes. */
-            while (xtn_hdr_data < xtn_hdr_end && *xtn_hdr_data == 0) {
-                xtn_hdr_data++;
-            }
+            srtp_xor_xtn_hdr_run(xtn_hdr_data, keystream, run_len);
+        }
+
+        /* skip padding bytes */
+        xtn_hdr_data = run_end;
+        while (xtn_hdr_data < xtn_hdr_end && *xtn_hdr_data == 0) {
+            xtn_hdr_data++;
         }
-    } else {
-        /* unsupported extension header format. */
-        return srtp_err_status_parse_err;
     }
 
     return srtp_err_status_ok;
@@ -1979,15 +3184,13 @@ static srtp_err_status_t srtp_get_session_keys_for_packet(
 
     mki_start_location -= stream->mki_size;
 
-    for (size_t i = 0; i < stream->num_master_keys; i++) {
-        if (memcmp(hdr + mki_start_location, stream->session_keys[i].mki_id,
-                   stream->mki_size) == 0) {
-            *session_keys = &stream->session_keys[i];
-            return srtp_err_status_ok;
-        }
+    size_t i = srtp_stream_find_mki(stream, hdr + mki_start_location);
+    if (i == stream->num_master_keys) {
+        return srtp_err_status_bad_mki;
     }
 
-    return srtp_err_status_bad_mki;
+    *session_keys = &stream->session_keys[i];
+    return srtp_err_status_ok;
 }
 
 static srtp_err_status_t srtp_get_session_keys_for_rtp_packet(
@@ -2030,22 +3233,22 @@ static srtp_err_status_t srtp_get_session_keys_for_rtcp_packet(
                                             session_keys);
 }
 
-static srtp_err_status_t srtp_estimate_index(srtp_rdbx_t *rdbx,
+static srtp_err_status_t srtp_estimate_index(srtp_xtd_seq_num_t index,
                                              uint32_t roc,
                                              srtp_xtd_seq_num_t *est,
                                              srtp_sequence_number_t seq,
                                              ssize_t *delta)
 {
     *est = (srtp_xtd_seq_num_t)(((uint64_t)roc) << 16) | seq;
-    *delta = *est - rdbx->index;
+    *delta = *est - index;
 
-    if (*est > rdbx->index) {
-        if (*est - rdbx->index > seq_num_median) {
+    if (*est > index) {
+        if (*est - index > seq_num_median) {
             *delta = 0;
             return srtp_err_status_pkt_idx_adv;
         }
-    } else if (*est < rdbx->index) {
-        if (rdbx->index - *est > seq_num_median) {
+    } else if (*est < index) {
+        if (index - *est > seq_num_median) {
             *delta = 0;
             return srtp_err_status_pkt_idx_old;
         }
@@ -2062,8 +3265,15 @@ static srtp_err_status_t srtp_get_est_pkt_index(const srtp_hdr_t *hdr,
     srtp_err_status_t result = srtp_err_status_ok;
 
     if (stream->pending_roc) {
-        result = srtp_estimate_index(&stream->rtp_rdbx, stream->pending_roc,
-                                     est, ntohs(hdr->seq), delta);
+        srtp_xtd_seq_num_t index =
+            stream->shared_rdbx
+                ? srtp_rdbx_atomic_get_packet_index(stream->shared_rdbx)
+                : srtp_rdbx_get_packet_index(&stream->rtp_rdbx);
+        result = srtp_estimate_index(index, stream->pending_roc, est,
+                                     ntohs(hdr->seq), delta);
+    } else if (stream->shared_rdbx) {
+        *delta = srtp_rdbx_atomic_estimate_index(stream->shared_rdbx, est,
+                                                 ntohs(hdr->seq));
     } else {
         /* estimate packet index from seq. num. in header */
         *delta =
@@ -2075,6 +3285,58 @@ static srtp_err_status_t srtp_get_est_pkt_index(const srtp_hdr_t *hdr,
     return result;
 }
 
+/*
+ * srtp_check_pkt_index checks the estimated index of a received packet
+ * against the stream's replay database
+ */
+static srtp_err_status_t srtp_check_pkt_index(srtp_stream_ctx_t *stream,
+                                              srtp_xtd_seq_num_t est,
+                                              ssize_t delta)
+{
+    if (stream->shared_rdbx) {
+        return srtp_rdbx_atomic_check(stream->shared_rdbx, est);
+    }
+
+    return srtp_rdbx_check(&stream->rtp_rdbx, delta);
+}
+
+/*
+ * srtp_add_pkt_index adds the index of an authenticated packet to the
+ * stream's replay database.  A shared window can only be updated
+ * atomically with the check, which can then still fail if another
+ * thread got the same packet through first.
+ */
+static srtp_err_status_t srtp_add_pkt_index(srtp_stream_ctx_t *stream,
+                                            srtp_xtd_seq_num_t est,
+                                            ssize_t delta,
+                                            bool advance_packet_index)
+{
+    if (stream->shared_rdbx) {
+        srtp_err_status_t status =
+            srtp_rdbx_atomic_add_index(stream->shared_rdbx, est);
+        if (status) {
+            return status;
+        }
+        /* keep the stream's own index current for srtp_stream_get_roc() */
+        stream->pending_roc = 0;
+        if (est > stream->rtp_rdbx.index) {
+            stream->rtp_rdbx.index = est;
+        }
+        return srtp_err_status_ok;
+    }
+
+    if (advance_packet_index) {
+        srtp_rdbx_set_roc_seq(&stream->rtp_rdbx, (uint32_t)(est >> 16),
+                              (uint16_t)(est & 0xFFFF));
+        stream->pending_roc = 0;
+        srtp_rdbx_add_index(&stream->rtp_rdbx, 0);
+    } else {
+        srtp_rdbx_add_index(&stream->rtp_rdbx, delta);
+    }
+
+    return srtp_err_status_ok;
+}
+
 /*
  * This function handles outgoing SRTP packets while in AEAD mode,
  * which currently supports AES-GCM encryption.  All packets are
@@ -2136,19 +3398,13 @@ static srtp_err_status_t srtp_protect_aead(srtp_ctx_t *ctx,
         enc_start += srtp_get_rtp_xtn_hdr_len(hdr, rtp);
     }
 
-    bool cryptex_inuse, cryptex_inplace;
-    status = srtp_cryptex_protect_init(stream, hdr, rtp, srtp, &cryptex_inuse,
-                                       &cryptex_inplace, &enc_start);
+    bool cryptex_inuse;
+    status = srtp_cryptex_protect_init(stream, hdr, rtp, &cryptex_inuse,
+                                       &enc_start);
     if (status) {
         return status;
     }
 
-    if (cryptex_inuse && !cryptex_inplace && hdr->cc) {
-        debug_print0(mod_srtp,
-                     "unsupported cryptex mode, AEAD, CC and not inplace io");
-        return srtp_err_status_cryptex_err;
-    }
-
     /* note: the passed size is without the auth tag */
     if (enc_start > rtp_len) {
         return srtp_err_status_parse_err;
@@ -2219,20 +3475,21 @@ static srtp_err_status_t srtp_protect_aead(srtp_ctx_t *ctx,
     }
 
     if (cryptex_inuse) {
-        status = srtp_cryptex_protect(cryptex_inplace, hdr, srtp,
+        /* this sets the AAD too, which leaves out the CSRC list */
+        status = srtp_cryptex_protect(true, hdr, rtp, srtp,
                                       session_keys->rtp_cipher);
         if (status) {
             return status;
         }
-    }
-
-    /*
-     * Set the AAD over the RTP header
-     */
-    aad_len = enc_start;
-    status = srtp_cipher_set_aad(session_keys->rtp_cipher, srtp, aad_len);
-    if (status) {
-        return (srtp_err_status_cipher_fail);
+    } else {
+        /*
+         * Set the AAD over the RTP header
+         */
+        aad_len = enc_start;
+        status = srtp_cipher_set_aad(session_keys->rtp_cipher, srtp, aad_len);
+        if (status) {
+            return (srtp_err_status_cipher_fail);
+        }
     }
 
     /* Encrypt the payload  */
@@ -2249,10 +3506,6 @@ static srtp_err_status_t srtp_protect_aead(srtp_ctx_t *ctx,
                         stream->mki_size);
     }
 
-    if (cryptex_inuse) {
-        srtp_cryptex_protect_cleanup(cryptex_inplace, hdr, srtp);
-    }
-
     *srtp_len = enc_start + enc_octet_len;
 
     /* increase the packet length by the length of the mki_size */
@@ -2316,19 +3569,13 @@ static srtp_err_status_t srtp_unprotect_aead(srtp_ctx_t *ctx,
         enc_start += srtp_get_rtp_xtn_hdr_len(hdr, srtp);
     }
 
-    bool cryptex_inuse, cryptex_inplace;
-    status = srtp_cryptex_unprotect_init(stream, hdr, srtp, rtp, &cryptex_inuse,
-                                         &cryptex_inplace, &enc_start);
+    bool cryptex_inuse;
+    status = srtp_cryptex_unprotect_init(stream, hdr, srtp, &cryptex_inuse,
+                                         &enc_start);
     if (status) {
         return status;
     }
 
-    if (cryptex_inuse && !cryptex_inplace && hdr->cc) {
-        debug_print0(mod_srtp,
-                     "unsupported cryptex mode, AEAD, CC and not inplace io");
-        return srtp_err_status_cryptex_err;
-    }
-
     if (enc_start > srtp_len - tag_len - stream->mki_size) {
         return srtp_err_status_parse_err;
     }
@@ -2376,20 +3623,21 @@ static srtp_err_status_t srtp_unprotect_aead(srtp_ctx_t *ctx,
     }
 
     if (cryptex_inuse) {
-        status = srtp_cryptex_unprotect(cryptex_inplace, hdr, rtp,
+        /* this sets the AAD too, which leaves out the CSRC list */
+        status = srtp_cryptex_unprotect(true, hdr, srtp, rtp,
                                         session_keys->rtp_cipher);
         if (status) {
             return status;
         }
-    }
-
-    /*
-     * Set the AAD for AES-GCM, which is the RTP header
-     */
-    aad_len = enc_start;
-    status = srtp_cipher_set_aad(session_keys->rtp_cipher, srtp, aad_len);
-    if (status) {
-        return srtp_err_status_cipher_fail;
+    } else {
+        /*
+         * Set the AAD for AES-GCM, which is the RTP header
+         */
+        aad_len = enc_start;
+        status = srtp_cipher_set_aad(session_keys->rtp_cipher, srtp, aad_len);
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
     }
 
     /* Decrypt the ciphertext.  This also checks the auth tag based
@@ -2413,7 +3661,7 @@ static srtp_err_status_t srtp_unprotect_aead(srtp_ctx_t *ctx,
     }
 
     if (cryptex_inuse) {
-        srtp_cryptex_unprotect_cleanup(cryptex_inplace, hdr, rtp);
+        srtp_cryptex_unprotect_cleanup(hdr, rtp);
     }
 
     /*
@@ -2443,21 +3691,13 @@ static srtp_err_status_t srtp_unprotect_aead(srtp_ctx_t *ctx,
         srtp_stream_ctx_t *new_stream;
 
         /*
-         * allocate and initialize a new stream
+         * allocate and initialize a new stream, and add it to the list
          *
          * note that we indicate failure if we can't allocate the new
          * stream, and some implementations will want to not return
          * failure here
          */
-        status =
-            srtp_stream_clone(ctx->stream_template, hdr->ssrc, &new_stream);
-        if (status) {
-            return status;
-        }
-
-        /* add new stream to the list */
-        status = srtp_insert_or_dealloc_stream(ctx->stream_list, new_stream,
-                                               ctx->stream_template);
+        status = srtp_session_clone_stream(ctx, hdr->ssrc, &new_stream);
         if (status) {
             return status;
         }
@@ -2470,14 +3710,9 @@ static srtp_err_status_t srtp_unprotect_aead(srtp_ctx_t *ctx,
      * the message authentication function passed, so add the packet
      * index into the replay database
      */
-    if (advance_packet_index) {
-        uint32_t roc_to_set = (uint32_t)(est >> 16);
-        uint16_t seq_to_set = (uint16_t)(est & 0xFFFF);
-        srtp_rdbx_set_roc_seq(&stream->rtp_rdbx, roc_to_set, seq_to_set);
-        stream->pending_roc = 0;
-        srtp_rdbx_add_index(&stream->rtp_rdbx, 0);
-    } else {
-        srtp_rdbx_add_index(&stream->rtp_rdbx, delta);
+    status = srtp_add_pkt_index(stream, est, delta, advance_packet_index);
+    if (status) {
+        return status;
     }
 
     *rtp_len = enc_start + enc_octet_len;
@@ -2485,112 +3720,253 @@ static srtp_err_status_t srtp_unprotect_aead(srtp_ctx_t *ctx,
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_protect(srtp_t ctx,
-                               const uint8_t *rtp,
-                               size_t rtp_len,
-                               uint8_t *srtp,
-                               size_t *srtp_len,
-                               size_t mki_index)
+/*
+ * srtp_protect_double() applies both layers of RFC 8723 double
+ * encryption: the inner layer goes over the header without its extensions
+ * and the payload, and the outer one over the whole packet, which then
+ * ends in the inner tag and an empty OHB.  The inner layer runs in place
+ * in the output buffer, with its header written just before the payload
+ * over the end of the real header.
+ */
+static srtp_err_status_t srtp_protect_double(srtp_ctx_t *ctx,
+                                             srtp_stream_ctx_t *stream,
+                                             const uint8_t *rtp,
+                                             size_t rtp_len,
+                                             uint8_t *srtp,
+                                             size_t *srtp_len,
+                                             srtp_session_keys_t *session_keys)
 {
     const srtp_hdr_t *hdr = (const srtp_hdr_t *)rtp;
-    size_t enc_start;         /* offset to start of encrypted portion   */
-    uint8_t *auth_start;      /* pointer to start of auth. portion      */
-    size_t enc_octet_len = 0; /* number of octets in encrypted portion  */
-    srtp_xtd_seq_num_t est;   /* estimated xtd_seq_num_t of *hdr        */
-    ssize_t delta;            /* delta of local pkt idx and that in hdr */
-    uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
+    srtp_stream_ctx_t *inner = stream->inner;
+    uint32_t inner_hdr[SRTP_MAX_RTP_HDR_LEN / 4];
+    uint8_t saved[SRTP_MAX_RTP_HDR_LEN];
+    size_t hdr_len = srtp_get_rtp_hdr_len(hdr);
+    size_t enc_start = hdr_len;
+    size_t inner_start;
+    size_t inner_len;
     srtp_err_status_t status;
-    size_t tag_len;
-    srtp_stream_ctx_t *stream;
-    size_t prefix_len;
-    srtp_session_keys_t *session_keys = NULL;
 
-    debug_print0(mod_srtp, "function srtp_protect");
+    debug_print0(mod_srtp, "function srtp_protect_double");
 
-    /* Verify RTP header */
-    status = srtp_validate_rtp_header(rtp, rtp_len);
-    if (status) {
-        return status;
+    if (hdr->x == 1) {
+        enc_start += srtp_get_rtp_xtn_hdr_len(hdr, rtp);
     }
-
-    /* check the packet length - it must at least contain a full header */
-    if (rtp_len < octets_in_rtp_header) {
-        return srtp_err_status_bad_param;
+    if (enc_start > rtp_len) {
+        return srtp_err_status_parse_err;
     }
 
-    /*
-     * look up ssrc in srtp_stream list, and process the packet with
-     * the appropriate stream.  if we haven't seen this stream before,
-     * there's a template key for this srtp_session, and the cipher
-     * supports key-sharing, then we assume that a new stream using
-     * that key has just started up
-     */
-    stream = srtp_get_stream(ctx, hdr->ssrc);
-    if (stream == NULL) {
-        if (ctx->stream_template != NULL) {
-            srtp_stream_ctx_t *new_stream;
+    if (*srtp_len < rtp_len) {
+        return srtp_err_status_buffer_small;
+    }
+    if (rtp != srtp) {
+        memcpy(srtp, rtp, rtp_len);
+    }
 
-            /* allocate and initialize a new stream */
-            status =
-                srtp_stream_clone(ctx->stream_template, hdr->ssrc, &new_stream);
-            if (status) {
-                return status;
-            }
+    memcpy(inner_hdr, srtp, hdr_len);
+    ((srtp_hdr_t *)inner_hdr)->x = 0;
 
-            /* add new stream to the list */
-            status = srtp_insert_or_dealloc_stream(ctx->stream_list, new_stream,
-                                                   ctx->stream_template);
-            if (status) {
-                return status;
-            }
+    inner_start = enc_start - hdr_len;
+    memcpy(saved, srtp + inner_start, hdr_len);
+    memcpy(srtp + inner_start, inner_hdr, hdr_len);
+    inner_len = *srtp_len - inner_start;
+    status = srtp_protect_aead(ctx, inner, srtp + inner_start,
+                               rtp_len - inner_start, srtp + inner_start,
+                               &inner_len, &inner->session_keys[0]);
+    memcpy(srtp + inner_start, saved, hdr_len);
+    if (status) {
+        return status;
+    }
 
-            /* set direction to outbound */
-            new_stream->direction = dir_srtp_sender;
+    /* nothing has been changed yet, so the OHB is just its config octet */
+    if (inner_start + inner_len >= *srtp_len) {
+        return srtp_err_status_buffer_small;
+    }
+    srtp[inner_start + inner_len] = 0;
 
-            /* set stream (the pointer used in this function) */
-            stream = new_stream;
-        } else {
-            /* no template stream, so we return an error */
+    return srtp_protect_aead(ctx, stream, srtp, inner_start + inner_len + 1,
+                             srtp, srtp_len, session_keys);
+}
+
+/*
+ * srtp_unprotect_double() removes both layers of RFC 8723 double
+ * encryption, and gives the packet the header fields the sender set; the
+ * arguments are those of srtp_unprotect_aead() for the outer layer
+ */
+static srtp_err_status_t srtp_unprotect_double(
+    srtp_ctx_t *ctx,
+    srtp_stream_ctx_t *stream,
+    ssize_t delta,
+    srtp_xtd_seq_num_t est,
+    const uint8_t *srtp,
+    size_t srtp_len,
+    uint8_t *rtp,
+    size_t *rtp_len,
+    srtp_session_keys_t *session_keys,
+    bool advance_packet_index)
+{
+    srtp_hdr_t *hdr = (srtp_hdr_t *)rtp;
+    srtp_hdr_t *ihdr;
+    srtp_stream_ctx_t *inner;
+    uint32_t inner_hdr[SRTP_MAX_RTP_HDR_LEN / 4];
+    uint8_t saved[SRTP_MAX_RTP_HDR_LEN];
+    bool provisional = stream == ctx->stream_template;
+    srtp_ohb_t ohb;
+    size_t hdr_len;
+    size_t enc_start;
+    size_t inner_start;
+    size_t inner_len;
+    srtp_xtd_seq_num_t inner_est;
+    ssize_t inner_delta;
+    bool inner_advance = false;
+    srtp_err_status_t status;
+
+    debug_print0(mod_srtp, "function srtp_unprotect_double");
+
+    status = srtp_unprotect_aead(ctx, stream, delta, est, srtp, srtp_len, rtp,
+                                 rtp_len, session_keys, advance_packet_index);
+    if (status) {
+        return status;
+    }
+
+    /* a provisional stream has just been replaced by a clone */
+    if (provisional) {
+        stream = srtp_get_stream(ctx, hdr->ssrc);
+        if (stream == NULL) {
             return srtp_err_status_no_ctx;
         }
     }
+    inner = stream->inner;
 
-    /*
-     * verify that stream is for sending traffic - this check will
-     * detect SSRC collisions, since a stream that appears in both
-     * srtp_protect() and srtp_unprotect() will fail this test in one of
-     * those functions.
-     */
+    hdr_len = srtp_get_rtp_hdr_len(hdr);
+    enc_start = hdr_len;
+    if (hdr->x == 1) {
+        enc_start += srtp_get_rtp_xtn_hdr_len(hdr, rtp);
+    }
 
-    if (stream->direction != dir_srtp_sender) {
-        if (stream->direction == dir_unknown) {
-            stream->direction = dir_srtp_sender;
-        } else {
-            srtp_handle_event(ctx, stream, event_ssrc_collision);
-        }
+    status = srtp_parse_ohb(rtp, *rtp_len, enc_start, &ohb);
+    if (status) {
+        return status;
     }
 
-    status = srtp_get_session_keys(stream, mki_index, &session_keys);
+    /* the inner layer covers the header as the sender set it */
+    memcpy(inner_hdr, rtp, hdr_len);
+    ihdr = (srtp_hdr_t *)inner_hdr;
+    ihdr->x = 0;
+    srtp_restore_ohb(ihdr, &ohb);
+
+    /* the original sequence number goes into the inner replay database */
+    status = srtp_get_est_pkt_index(ihdr, inner, &inner_est, &inner_delta);
+    if (status == srtp_err_status_pkt_idx_adv) {
+        inner_advance = true;
+    } else if (status == srtp_err_status_ok) {
+        status = srtp_check_pkt_index(inner, inner_est, inner_delta);
+    }
+    if (status && !inner_advance) {
+        return status;
+    }
+
+    inner_start = enc_start - hdr_len;
+    memcpy(saved, rtp + inner_start, hdr_len);
+    memcpy(rtp + inner_start, inner_hdr, hdr_len);
+    inner_len = *rtp_len - inner_start;
+    status = srtp_unprotect_aead(ctx, inner, inner_delta, inner_est,
+                                 rtp + inner_start,
+                                 *rtp_len - ohb.len - inner_start,
+                                 rtp + inner_start, &inner_len,
+                                 &inner->session_keys[0], inner_advance);
+    memcpy(rtp + inner_start, saved, hdr_len);
     if (status) {
         return status;
     }
 
-    /*
-     * Check if this is an AEAD stream (GCM mode).  If so, then dispatch
-     * the request to our AEAD handler.
-     */
-    if (session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_128 ||
-        session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_256) {
-        return srtp_protect_aead(ctx, stream, rtp, rtp_len, srtp, srtp_len,
-                                 session_keys);
+    hdr->pt = ihdr->pt;
+    hdr->seq = ihdr->seq;
+    hdr->m = ihdr->m;
+    *rtp_len = inner_start + inner_len;
+
+    return srtp_err_status_ok;
+}
+
+static bool srtp_cipher_is_icm(const srtp_cipher_t *cipher)
+{
+    return cipher->type->id == SRTP_AES_ICM_128 ||
+           cipher->type->id == SRTP_AES_ICM_192 ||
+           cipher->type->id == SRTP_AES_ICM_256;
+}
+
+/*
+ * srtp_keystream_cache_take(stream, session_keys, est, len) returns the
+ * precomputed keystream for packet index est if there is at least len
+ * octets of it, or NULL otherwise.  The entry for est is invalidated
+ * either way, so that every keystream is handed out only once.
+ */
+static const uint8_t *srtp_keystream_cache_take(
+    srtp_stream_ctx_t *stream,
+    const srtp_session_keys_t *session_keys,
+    srtp_xtd_seq_num_t est,
+    size_t len)
+{
+    srtp_keystream_cache_t *cache = stream->keystream_cache;
+    srtp_keystream_entry_t *entry;
+    size_t slot;
+
+    if (cache->session_keys != session_keys) {
+        return NULL;
     }
 
-    /*
-     * update the key usage limit, and check it to make sure that we
-     * didn't just hit either the soft limit or the hard limit, and call
-     * the event handler if we hit either.
-     */
-    switch (srtp_key_limit_update(session_keys->limit)) {
+    slot = (size_t)(est % cache->num_entries);
+    entry = &cache->entries[slot];
+    if (!entry->valid || entry->index != est) {
+        return NULL;
+    }
+    entry->valid = false;
+
+    if (len > cache->entry_len) {
+        return NULL;
+    }
+
+    return cache->keystream + slot * cache->entry_len;
+}
+
+static void srtp_xor_keystream(uint8_t *out,
+                               const uint8_t *in,
+                               const uint8_t *keystream,
+                               size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        out[i] = in[i] ^ keystream[i];
+    }
+}
+
+/*
+ * srtp_protect_icm_hmac() and srtp_unprotect_icm_hmac() are srtp_protect()
+ * and srtp_unprotect() compiled for the most common stream configuration:
+ * AES-ICM with HMAC-SHA1, confidentiality and authentication, a single
+ * master key without MKI, and neither header extension encryption,
+ * cryptex nor precomputed keystream.  Everything that does not depend on
+ * the packet is known when srtp_stream_compile() binds them, so they go
+ * straight to the cipher and auth functions of the session keys.
+ *
+ * They are built from steps that either use the stream, and so must run
+ * in packet order, or only use a cipher, an auth function and the packet,
+ * and so can run on copies of them in parallel; the worker pool runs the
+ * steps separately.  srtp_icm_hmac_pkt_t carries a packet between them.
+ */
+typedef struct {
+    srtp_xtd_seq_num_t est; /* estimated index of the packet      */
+    ssize_t delta;          /* its distance from the stream index */
+    bool advance_packet_index;
+    size_t enc_start; /* offset of the payload */
+    size_t enc_octet_len;
+    size_t tag_len;
+} srtp_icm_hmac_pkt_t;
+
+static srtp_err_status_t srtp_icm_hmac_key_limit(srtp_ctx_t *ctx,
+                                                 srtp_stream_ctx_t *stream)
+{
+    switch (srtp_key_limit_update(stream->session_keys[0].limit)) {
     case srtp_key_event_normal:
         break;
     case srtp_key_event_soft_limit:
@@ -2603,308 +3979,462 @@ srtp_err_status_t srtp_protect(srtp_t ctx,
         break;
     }
 
-    /* get tag length from stream */
-    tag_len = srtp_auth_get_tag_length(session_keys->rtp_auth);
-
-    /* check output length */
-    if (*srtp_len < rtp_len + stream->mki_size + tag_len) {
-        return srtp_err_status_buffer_small;
-    }
+    return srtp_err_status_ok;
+}
 
-    /*
-     * find starting point for encryption and length of data to be
-     * encrypted - the encrypted portion starts after the rtp header
-     * extension, if present; otherwise, it starts after the last csrc,
-     * if any are present
-     */
-    enc_start = srtp_get_rtp_hdr_len(hdr);
-    if (hdr->x == 1) {
-        enc_start += srtp_get_rtp_xtn_hdr_len(hdr, rtp);
-    }
+/*
+ * srtp_protect_icm_hmac_start() checks the key limit and the lengths and
+ * takes the index of the packet in the stream
+ */
+static srtp_err_status_t srtp_protect_icm_hmac_start(
+    srtp_ctx_t *ctx,
+    srtp_stream_ctx_t *stream,
+    const uint8_t *rtp,
+    size_t rtp_len,
+    size_t srtp_len,
+    srtp_icm_hmac_pkt_t *pkt)
+{
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)rtp;
+    srtp_err_status_t status;
 
-    bool cryptex_inuse, cryptex_inplace;
-    status = srtp_cryptex_protect_init(stream, hdr, rtp, srtp, &cryptex_inuse,
-                                       &cryptex_inplace, &enc_start);
+    status = srtp_icm_hmac_key_limit(ctx, stream);
     if (status) {
         return status;
     }
 
-    if (enc_start > rtp_len) {
-        return srtp_err_status_parse_err;
-    }
-    enc_octet_len = rtp_len - enc_start;
-
-    /* if not-inplace then need to copy full rtp header */
-    if (rtp != srtp) {
-        memcpy(srtp, rtp, enc_start);
+    pkt->tag_len = stream->session_keys[0].rtp_auth->out_len;
+    if (srtp_len < rtp_len + pkt->tag_len) {
+        return srtp_err_status_buffer_small;
     }
 
-    if (stream->use_mki) {
-        srtp_inject_mki(srtp + rtp_len, session_keys, stream->mki_size);
+    pkt->enc_start = srtp_get_rtp_hdr_len(hdr);
+    if (hdr->x == 1) {
+        pkt->enc_start += srtp_get_rtp_xtn_hdr_len(hdr, rtp);
     }
-
-    /*
-     * if we're providing authentication, set the auth_start and auth_tag
-     * pointers to the proper locations; otherwise, set auth_start to NULL
-     * to indicate that no authentication is needed
-     */
-    if (stream->rtp_services & sec_serv_auth) {
-        auth_start = srtp;
-        auth_tag = srtp + rtp_len + stream->mki_size;
-    } else {
-        auth_start = NULL;
-        auth_tag = NULL;
+    if (pkt->enc_start > rtp_len) {
+        return srtp_err_status_parse_err;
     }
+    pkt->enc_octet_len = rtp_len - pkt->enc_start;
 
-    /*
-     * estimate the packet index using the start of the replay window
-     * and the sequence number from the header
-     */
-    status = srtp_get_est_pkt_index(hdr, stream, &est, &delta);
-
+    status = srtp_get_est_pkt_index(hdr, stream, &pkt->est, &pkt->delta);
     if (status && (status != srtp_err_status_pkt_idx_adv)) {
         return status;
     }
-
     if (status == srtp_err_status_pkt_idx_adv) {
-        srtp_rdbx_set_roc_seq(&stream->rtp_rdbx, (uint32_t)(est >> 16),
-                              (uint16_t)(est & 0xFFFF));
+        srtp_rdbx_set_roc_seq(&stream->rtp_rdbx, (uint32_t)(pkt->est >> 16),
+                              (uint16_t)(pkt->est & 0xFFFF));
         stream->pending_roc = 0;
         srtp_rdbx_add_index(&stream->rtp_rdbx, 0);
     } else {
-        status = srtp_rdbx_check(&stream->rtp_rdbx, delta);
+        status = srtp_rdbx_check(&stream->rtp_rdbx, pkt->delta);
         if (status) {
             if (status != srtp_err_status_replay_fail ||
                 !stream->allow_repeat_tx)
                 return status; /* we've been asked to reuse an index */
         }
-        srtp_rdbx_add_index(&stream->rtp_rdbx, delta);
+        srtp_rdbx_add_index(&stream->rtp_rdbx, pkt->delta);
     }
 
-    debug_print(mod_srtp, "estimated packet index: %016" PRIx64, est);
+    return srtp_err_status_ok;
+}
 
-    /*
-     * if we're using rindael counter mode, set nonce and seq
-     */
-    if (session_keys->rtp_cipher->type->id == SRTP_AES_ICM_128 ||
-        session_keys->rtp_cipher->type->id == SRTP_AES_ICM_192 ||
-        session_keys->rtp_cipher->type->id == SRTP_AES_ICM_256) {
-        v128_t iv;
+/*
+ * srtp_protect_icm_hmac_crypt() encrypts the payload and appends the tag
+ */
+static srtp_err_status_t srtp_protect_icm_hmac_crypt(
+    srtp_cipher_t *cipher,
+    srtp_auth_t *auth,
+    const uint8_t *rtp,
+    uint8_t *srtp,
+    const srtp_icm_hmac_pkt_t *pkt)
+{
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)rtp;
+    size_t enc_start = pkt->enc_start;
+    size_t enc_octet_len = pkt->enc_octet_len;
+    srtp_xtd_seq_num_t roc;
+    v128_t iv;
+    srtp_err_status_t status;
 
-        iv.v32[0] = 0;
-        iv.v32[1] = hdr->ssrc;
-        iv.v64[1] = be64_to_cpu(est << 16);
-        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
-                                    srtp_direction_encrypt);
-        if (!status && session_keys->rtp_xtn_hdr_cipher) {
-            status = srtp_cipher_set_iv(session_keys->rtp_xtn_hdr_cipher,
-                                        (uint8_t *)&iv, srtp_direction_encrypt);
-        }
-    } else {
-        v128_t iv;
+    if (rtp != srtp) {
+        memcpy(srtp, rtp, enc_start);
+    }
 
-        /* otherwise, set the index to est */
-        iv.v64[0] = 0;
-        iv.v64[1] = be64_to_cpu(est);
-        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
-                                    srtp_direction_encrypt);
-        if (!status && session_keys->rtp_xtn_hdr_cipher) {
-            status = srtp_cipher_set_iv(session_keys->rtp_xtn_hdr_cipher,
-                                        (uint8_t *)&iv, srtp_direction_encrypt);
-        }
+    iv.v32[0] = 0;
+    iv.v32[1] = hdr->ssrc;
+    iv.v64[1] = be64_to_cpu(pkt->est << 16);
+    status = cipher->type->set_iv(cipher->state, (uint8_t *)&iv,
+                                  srtp_direction_encrypt);
+    if (status) {
+        return srtp_err_status_cipher_fail;
     }
+    status = cipher->type->encrypt(cipher->state, rtp + enc_start,
+                                   enc_octet_len, srtp + enc_start,
+                                   &enc_octet_len);
     if (status) {
         return srtp_err_status_cipher_fail;
     }
 
-    /* shift est, put into network byte order */
-    est = be64_to_cpu(est << 16);
+    /* the tag covers the packet and the ROC, in network byte order */
+    roc = be64_to_cpu(pkt->est << 16);
+    status = auth->type->start(auth->state);
+    if (status) {
+        return status;
+    }
+    status = auth->type->update(auth->state, srtp, enc_start + enc_octet_len);
+    if (status) {
+        return status;
+    }
+    return auth->type->compute(auth->state, (uint8_t *)&roc, 4, pkt->tag_len,
+                               srtp + enc_start + enc_octet_len);
+}
 
-    /*
-     * if we're authenticating using a universal hash, put the keystream
-     * prefix into the authentication tag
-     */
-    if (auth_start) {
-        prefix_len = srtp_auth_get_prefix_length(session_keys->rtp_auth);
-        if (prefix_len) {
-            status = srtp_cipher_output(session_keys->rtp_cipher, auth_tag,
-                                        &prefix_len);
-            if (status) {
-                return srtp_err_status_cipher_fail;
-            }
-            debug_print(mod_srtp, "keystream prefix: %s",
-                        srtp_octet_string_hex_string(auth_tag, prefix_len));
-        }
+static srtp_err_status_t srtp_protect_icm_hmac(srtp_ctx_t *ctx,
+                                               srtp_stream_ctx_t *stream,
+                                               const uint8_t *rtp,
+                                               size_t rtp_len,
+                                               uint8_t *srtp,
+                                               size_t *srtp_len)
+{
+    srtp_session_keys_t *session_keys = &stream->session_keys[0];
+    srtp_icm_hmac_pkt_t pkt;
+    srtp_err_status_t status;
+
+    status = srtp_protect_icm_hmac_start(ctx, stream, rtp, rtp_len,
+                                         *srtp_len, &pkt);
+    if (status) {
+        return status;
     }
 
-    if (hdr->x == 1 && session_keys->rtp_xtn_hdr_cipher) {
-        /*
-         * extensions header encryption RFC 6904
-         */
-        status = srtp_process_header_encryption(
-            stream, srtp_get_rtp_xtn_hdr(hdr, srtp), session_keys);
-        if (status) {
-            return status;
-        }
+    status = srtp_protect_icm_hmac_crypt(
+        session_keys->rtp_cipher, session_keys->rtp_auth, rtp, srtp, &pkt);
+    if (status) {
+        return status;
     }
 
-    if (cryptex_inuse) {
-        status = srtp_cryptex_protect(cryptex_inplace, hdr, srtp,
-                                      session_keys->rtp_cipher);
-        if (status) {
-            return status;
-        }
+    *srtp_len = pkt.enc_start + pkt.enc_octet_len + pkt.tag_len;
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_unprotect_icm_hmac_index() estimates the index of the packet and
+ * checks it against the replay database
+ */
+static srtp_err_status_t srtp_unprotect_icm_hmac_index(
+    srtp_stream_ctx_t *stream,
+    const uint8_t *srtp,
+    srtp_icm_hmac_pkt_t *pkt)
+{
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)srtp;
+    srtp_err_status_t status;
+
+    pkt->advance_packet_index = false;
+    status = srtp_get_est_pkt_index(hdr, stream, &pkt->est, &pkt->delta);
+    if (status && (status != srtp_err_status_pkt_idx_adv)) {
+        return status;
+    }
+    if (status == srtp_err_status_pkt_idx_adv) {
+        pkt->advance_packet_index = true;
+        return srtp_err_status_ok;
     }
 
-    /* if we're encrypting, exor keystream into the message */
-    if (stream->rtp_services & sec_serv_conf) {
-        status = srtp_cipher_encrypt(session_keys->rtp_cipher, rtp + enc_start,
-                                     enc_octet_len, srtp + enc_start,
-                                     &enc_octet_len);
-        if (status) {
-            return srtp_err_status_cipher_fail;
-        }
-    } else if (rtp != srtp) {
-        /* if no encryption and not-inplace then need to copy rest of packet */
-        memcpy(srtp + enc_start, rtp + enc_start, enc_octet_len);
+    return srtp_check_pkt_index(stream, pkt->est, pkt->delta);
+}
+
+/*
+ * srtp_unprotect_icm_hmac_lengths() finds the payload and the tag of the
+ * packet
+ */
+static srtp_err_status_t srtp_unprotect_icm_hmac_lengths(
+    srtp_stream_ctx_t *stream,
+    const uint8_t *srtp,
+    size_t srtp_len,
+    size_t rtp_len,
+    srtp_icm_hmac_pkt_t *pkt)
+{
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)srtp;
+
+    pkt->tag_len = stream->session_keys[0].rtp_auth->out_len;
+    pkt->enc_start = srtp_get_rtp_hdr_len(hdr);
+    if (hdr->x == 1) {
+        pkt->enc_start += srtp_get_rtp_xtn_hdr_len(hdr, srtp);
+    }
+    if (pkt->enc_start > srtp_len ||
+        srtp_len - pkt->enc_start < pkt->tag_len) {
+        return srtp_err_status_parse_err;
     }
+    pkt->enc_octet_len = srtp_len - pkt->enc_start - pkt->tag_len;
 
-    if (cryptex_inuse) {
-        srtp_cryptex_protect_cleanup(cryptex_inplace, hdr, srtp);
+    if (rtp_len < srtp_len - pkt->tag_len) {
+        return srtp_err_status_buffer_small;
     }
 
-    /*
-     *  if we're authenticating, run authentication function and put result
-     *  into the auth_tag
-     */
-    if (auth_start) {
-        /* initialize auth func context */
-        status = srtp_auth_start(session_keys->rtp_auth);
-        if (status) {
-            return status;
-        }
+    return srtp_err_status_ok;
+}
 
-        /* run auth func over packet */
-        status = srtp_auth_update(session_keys->rtp_auth, auth_start, rtp_len);
-        if (status) {
-            return status;
-        }
+/*
+ * srtp_unprotect_icm_hmac_verify() checks the tag of the packet and the
+ * ROC
+ */
+static srtp_err_status_t srtp_unprotect_icm_hmac_verify(
+    srtp_auth_t *auth,
+    const uint8_t *srtp,
+    const srtp_icm_hmac_pkt_t *pkt)
+{
+    size_t auth_len = pkt->enc_start + pkt->enc_octet_len;
+    srtp_xtd_seq_num_t roc;
+    uint8_t tmp_tag[SRTP_MAX_TAG_LEN];
+    srtp_err_status_t status;
 
-        /* run auth func over ROC, put result into auth_tag */
-        debug_print(mod_srtp, "estimated packet index: %016" PRIx64, est);
-        status = srtp_auth_compute(session_keys->rtp_auth, (uint8_t *)&est, 4,
-                                   auth_tag);
-        debug_print(mod_srtp, "srtp auth tag:    %s",
-                    srtp_octet_string_hex_string(auth_tag, tag_len));
-        if (status) {
-            return status;
+    roc = be64_to_cpu(pkt->est << 16);
+    status = auth->type->start(auth->state);
+    if (status) {
+        return status;
+    }
+    status = auth->type->update(auth->state, srtp, auth_len);
+    if (status) {
+        return status;
+    }
+    status = auth->type->compute(auth->state, (uint8_t *)&roc, 4,
+                                 pkt->tag_len, tmp_tag);
+    if (status) {
+        return srtp_err_status_auth_fail;
+    }
+    if (!srtp_octet_string_equal(tmp_tag, srtp + auth_len, pkt->tag_len)) {
+        return srtp_err_status_auth_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_unprotect_icm_hmac_decrypt() decrypts the payload of a packet
+ * whose tag has been checked
+ */
+static srtp_err_status_t srtp_unprotect_icm_hmac_decrypt(
+    srtp_cipher_t *cipher,
+    const uint8_t *srtp,
+    uint8_t *rtp,
+    const srtp_icm_hmac_pkt_t *pkt)
+{
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)srtp;
+    size_t enc_start = pkt->enc_start;
+    size_t enc_octet_len = pkt->enc_octet_len;
+    v128_t iv;
+    srtp_err_status_t status;
+
+    if (srtp != rtp) {
+        memcpy(rtp, srtp, enc_start);
+    }
+
+    iv.v32[0] = 0;
+    iv.v32[1] = hdr->ssrc;
+    iv.v64[1] = be64_to_cpu(pkt->est << 16);
+    status = cipher->type->set_iv(cipher->state, (uint8_t *)&iv,
+                                  srtp_direction_decrypt);
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+    status = cipher->type->decrypt(cipher->state, srtp + enc_start,
+                                   enc_octet_len, rtp + enc_start,
+                                   &enc_octet_len);
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_unprotect_icm_hmac_finish() accepts an authenticated packet into
+ * the stream
+ */
+static srtp_err_status_t srtp_unprotect_icm_hmac_finish(
+    srtp_ctx_t *ctx,
+    srtp_stream_ctx_t *stream,
+    const srtp_icm_hmac_pkt_t *pkt)
+{
+    if (stream->direction != dir_srtp_receiver) {
+        if (stream->direction == dir_unknown) {
+            stream->direction = dir_srtp_receiver;
+        } else {
+            srtp_handle_event(ctx, stream, event_ssrc_collision);
         }
     }
 
-    *srtp_len = enc_start + enc_octet_len;
+    return srtp_add_pkt_index(stream, pkt->est, pkt->delta,
+                              pkt->advance_packet_index);
+}
 
-    /* increase the packet length by the length of the auth tag */
-    *srtp_len += tag_len;
+static srtp_err_status_t srtp_unprotect_icm_hmac(srtp_ctx_t *ctx,
+                                                 srtp_stream_ctx_t *stream,
+                                                 const uint8_t *srtp,
+                                                 size_t srtp_len,
+                                                 uint8_t *rtp,
+                                                 size_t *rtp_len)
+{
+    srtp_session_keys_t *session_keys = &stream->session_keys[0];
+    srtp_icm_hmac_pkt_t pkt;
+    srtp_err_status_t status;
 
-    /* increate the packet length by the mki size if used */
-    *srtp_len += stream->mki_size;
+    status = srtp_unprotect_icm_hmac_index(stream, srtp, &pkt);
+    if (status) {
+        return status;
+    }
+
+    status = srtp_unprotect_icm_hmac_lengths(stream, srtp, srtp_len, *rtp_len,
+                                             &pkt);
+    if (status) {
+        return status;
+    }
+
+    /* authenticate the packet and the ROC before anything else */
+    status = srtp_unprotect_icm_hmac_verify(session_keys->rtp_auth, srtp, &pkt);
+    if (status) {
+        return status;
+    }
+
+    status = srtp_icm_hmac_key_limit(ctx, stream);
+    if (status) {
+        return status;
+    }
+
+    status =
+        srtp_unprotect_icm_hmac_decrypt(session_keys->rtp_cipher, srtp, rtp,
+                                        &pkt);
+    if (status) {
+        return status;
+    }
+
+    status = srtp_unprotect_icm_hmac_finish(ctx, stream, &pkt);
+    if (status) {
+        return status;
+    }
+
+    *rtp_len = pkt.enc_start + pkt.enc_octet_len;
 
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_unprotect(srtp_t ctx,
-                                 const uint8_t *srtp,
-                                 size_t srtp_len,
-                                 uint8_t *rtp,
-                                 size_t *rtp_len)
+void srtp_stream_compile(srtp_stream_ctx_t *stream)
 {
-    const srtp_hdr_t *hdr = (const srtp_hdr_t *)srtp;
-    size_t enc_start;               /* pointer to start of encrypted portion  */
-    const uint8_t *auth_start;      /* pointer to start of auth. portion      */
-    size_t enc_octet_len = 0;       /* number of octets in encrypted portion  */
-    const uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
-    srtp_xtd_seq_num_t est;         /* estimated xtd_seq_num_t of *hdr        */
-    ssize_t delta;                  /* delta of local pkt idx and that in hdr */
-    v128_t iv;
+    const srtp_session_keys_t *session_keys = &stream->session_keys[0];
+
+    stream->rtp_protect = NULL;
+    stream->rtp_unprotect = NULL;
+
+    if (stream->use_mki || stream->use_cryptex ||
+        stream->enc_xtn_hdr_count > 0 || stream->keystream_cache != NULL ||
+        stream->rtp_services != sec_serv_conf_and_auth) {
+        return;
+    }
+
+    if (srtp_cipher_is_icm(session_keys->rtp_cipher) &&
+        session_keys->rtp_auth->type->id == SRTP_HMAC_SHA1 &&
+        session_keys->rtp_auth->prefix_len == 0) {
+        stream->rtp_protect = srtp_protect_icm_hmac;
+        stream->rtp_unprotect = srtp_unprotect_icm_hmac;
+    }
+}
+
+/*
+ * srtp_protect_packet() is srtp_protect(); if outer_only is set it only
+ * applies the hop-by-hop layer of double encryption, for
+ * srtp_protect_outer()
+ */
+static srtp_err_status_t srtp_protect_packet(srtp_t ctx,
+                                             const uint8_t *rtp,
+                                             size_t rtp_len,
+                                             uint8_t *srtp,
+                                             size_t *srtp_len,
+                                             size_t mki_index,
+                                             bool outer_only)
+{
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)rtp;
+    size_t enc_start;         /* offset to start of encrypted portion   */
+    uint8_t *auth_start;      /* pointer to start of auth. portion      */
+    size_t enc_octet_len = 0; /* number of octets in encrypted portion  */
+    srtp_xtd_seq_num_t est;   /* estimated xtd_seq_num_t of *hdr        */
+    ssize_t delta;            /* delta of local pkt idx and that in hdr */
+    uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
     srtp_err_status_t status;
+    size_t tag_len;
     srtp_stream_ctx_t *stream;
-    uint8_t tmp_tag[SRTP_MAX_TAG_LEN];
-    size_t tag_len, prefix_len;
+    size_t prefix_len;
     srtp_session_keys_t *session_keys = NULL;
-    bool advance_packet_index = false;
-    uint32_t roc_to_set = 0;
-    uint16_t seq_to_set = 0;
+    const uint8_t *keystream = NULL;
 
-    debug_print0(mod_srtp, "function srtp_unprotect");
+    debug_print0(mod_srtp, "function srtp_protect");
 
     /* Verify RTP header */
-    status = srtp_validate_rtp_header(srtp, srtp_len);
+    status = srtp_validate_rtp_header(rtp, rtp_len);
     if (status) {
         return status;
     }
 
     /* check the packet length - it must at least contain a full header */
-    if (srtp_len < octets_in_rtp_header) {
+    if (rtp_len < octets_in_rtp_header) {
         return srtp_err_status_bad_param;
     }
 
     /*
      * look up ssrc in srtp_stream list, and process the packet with
      * the appropriate stream.  if we haven't seen this stream before,
-     * there's only one key for this srtp_session, and the cipher
+     * there's a template key for this srtp_session, and the cipher
      * supports key-sharing, then we assume that a new stream using
      * that key has just started up
      */
     stream = srtp_get_stream(ctx, hdr->ssrc);
     if (stream == NULL) {
         if (ctx->stream_template != NULL) {
-            stream = ctx->stream_template;
-            debug_print(mod_srtp, "using provisional stream (SSRC: 0x%08x)",
-                        (unsigned int)ntohl(hdr->ssrc));
+            srtp_stream_ctx_t *new_stream;
 
-            /*
-             * set estimated packet index to sequence number from header,
-             * and set delta equal to the same value
-             */
-            est = (srtp_xtd_seq_num_t)ntohs(hdr->seq);
-            delta = (int)est;
+            /* allocate a new stream and add it to the list */
+            status = srtp_session_clone_stream(ctx, hdr->ssrc, &new_stream);
+            if (status) {
+                return status;
+            }
+
+            /* set direction to outbound */
+            new_stream->direction = dir_srtp_sender;
+
+            /* set stream (the pointer used in this function) */
+            stream = new_stream;
         } else {
-            /*
-             * no stream corresponding to SSRC found, and we don't do
-             * key-sharing, so return an error
-             */
+            /* no template stream, so we return an error */
             return srtp_err_status_no_ctx;
         }
-    } else {
-        status = srtp_get_est_pkt_index(hdr, stream, &est, &delta);
+    }
 
-        if (status && (status != srtp_err_status_pkt_idx_adv)) {
-            return status;
-        }
+    /*
+     * verify that stream is for sending traffic - this check will
+     * detect SSRC collisions, since a stream that appears in both
+     * srtp_protect() and srtp_unprotect() will fail this test in one of
+     * those functions.
+     */
 
-        if (status == srtp_err_status_pkt_idx_adv) {
-            advance_packet_index = true;
-            roc_to_set = (uint32_t)(est >> 16);
-            seq_to_set = (uint16_t)(est & 0xFFFF);
+    if (stream->direction != dir_srtp_sender) {
+        if (stream->direction == dir_unknown) {
+            stream->direction = dir_srtp_sender;
+        } else {
+            srtp_handle_event(ctx, stream, event_ssrc_collision);
         }
+    }
 
-        /* check replay database */
-        if (!advance_packet_index) {
-            status = srtp_rdbx_check(&stream->rtp_rdbx, delta);
-            if (status) {
-                return status;
-            }
+    /* use the handler compiled for this stream's policy, if it has one */
+    if (stream->rtp_protect != NULL && !outer_only) {
+        status =
+            stream->rtp_protect(ctx, stream, rtp, rtp_len, srtp, srtp_len);
+        if (status == srtp_err_status_ok) {
+            srtp_session_use_stream(ctx, stream);
         }
+        return status;
     }
 
-    debug_print(mod_srtp, "estimated u_packet index: %016" PRIx64, est);
-
-    /* Determine if MKI is being used and what session keys should be used */
-    status = srtp_get_session_keys_for_rtp_packet(stream, srtp, srtp_len,
-                                                  &session_keys);
-    if (status) {
-        return status;
-    }
+    status = srtp_get_session_keys(stream, mki_index, &session_keys);
+    if (status) {
+        return status;
+    }
 
     /*
      * Check if this is an AEAD stream (GCM mode).  If so, then dispatch
@@ -2912,73 +4442,80 @@ srtp_err_status_t srtp_unprotect(srtp_t ctx,
      */
     if (session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_128 ||
         session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_256) {
-        return srtp_unprotect_aead(ctx, stream, delta, est, srtp, srtp_len, rtp,
-                                   rtp_len, session_keys, advance_packet_index);
+        if (stream->inner != NULL && !outer_only) {
+            status = srtp_protect_double(ctx, stream, rtp, rtp_len, srtp,
+                                         srtp_len, session_keys);
+        } else {
+            status = srtp_protect_aead(ctx, stream, rtp, rtp_len, srtp,
+                                       srtp_len, session_keys);
+        }
+        if (status == srtp_err_status_ok) {
+            srtp_session_use_stream(ctx, stream);
+        }
+        return status;
     }
 
-    /* get tag length from stream */
-    tag_len = srtp_auth_get_tag_length(session_keys->rtp_auth);
+    /* double encryption is only defined for the AEAD transforms */
+    if (outer_only) {
+        return srtp_err_status_bad_param;
+    }
 
     /*
-     * set the cipher's IV properly, depending on whatever cipher we
-     * happen to be using
+     * update the key usage limit, and check it to make sure that we
+     * didn't just hit either the soft limit or the hard limit, and call
+     * the event handler if we hit either.
      */
-    if (session_keys->rtp_cipher->type->id == SRTP_AES_ICM_128 ||
-        session_keys->rtp_cipher->type->id == SRTP_AES_ICM_192 ||
-        session_keys->rtp_cipher->type->id == SRTP_AES_ICM_256) {
-        /* aes counter mode */
-        iv.v32[0] = 0;
-        iv.v32[1] = hdr->ssrc; /* still in network order */
-        iv.v64[1] = be64_to_cpu(est << 16);
-        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
-                                    srtp_direction_decrypt);
-        if (!status && session_keys->rtp_xtn_hdr_cipher) {
-            status = srtp_cipher_set_iv(session_keys->rtp_xtn_hdr_cipher,
-                                        (uint8_t *)&iv, srtp_direction_decrypt);
-        }
-    } else {
-        /* no particular format - set the iv to the packet index */
-        iv.v64[0] = 0;
-        iv.v64[1] = be64_to_cpu(est);
-        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
-                                    srtp_direction_decrypt);
-        if (!status && session_keys->rtp_xtn_hdr_cipher) {
-            status = srtp_cipher_set_iv(session_keys->rtp_xtn_hdr_cipher,
-                                        (uint8_t *)&iv, srtp_direction_decrypt);
-        }
-    }
-    if (status) {
-        return srtp_err_status_cipher_fail;
+    switch (srtp_key_limit_update(session_keys->limit)) {
+    case srtp_key_event_normal:
+        break;
+    case srtp_key_event_soft_limit:
+        srtp_handle_event(ctx, stream, event_key_soft_limit);
+        break;
+    case srtp_key_event_hard_limit:
+        srtp_handle_event(ctx, stream, event_key_hard_limit);
+        return srtp_err_status_key_expired;
+    default:
+        break;
     }
 
-    /* shift est, put into network byte order */
-    est = be64_to_cpu(est << 16);
+    /* get tag length from stream */
+    tag_len = srtp_auth_get_tag_length(session_keys->rtp_auth);
+
+    /* check output length */
+    if (*srtp_len < rtp_len + stream->mki_size + tag_len) {
+        return srtp_err_status_buffer_small;
+    }
 
+    /*
+     * find starting point for encryption and length of data to be
+     * encrypted - the encrypted portion starts after the rtp header
+     * extension, if present; otherwise, it starts after the last csrc,
+     * if any are present
+     */
     enc_start = srtp_get_rtp_hdr_len(hdr);
     if (hdr->x == 1) {
-        enc_start += srtp_get_rtp_xtn_hdr_len(hdr, srtp);
+        enc_start += srtp_get_rtp_xtn_hdr_len(hdr, rtp);
     }
 
-    bool cryptex_inuse, cryptex_inplace;
-    status = srtp_cryptex_unprotect_init(stream, hdr, srtp, rtp, &cryptex_inuse,
-                                         &cryptex_inplace, &enc_start);
+    bool cryptex_inuse;
+    status = srtp_cryptex_protect_init(stream, hdr, rtp, &cryptex_inuse,
+                                       &enc_start);
     if (status) {
         return status;
     }
 
-    if (enc_start > srtp_len - tag_len - stream->mki_size) {
+    if (enc_start > rtp_len) {
         return srtp_err_status_parse_err;
     }
-    enc_octet_len = srtp_len - enc_start - stream->mki_size - tag_len;
+    enc_octet_len = rtp_len - enc_start;
 
-    /* check output length */
-    if (*rtp_len < srtp_len - stream->mki_size - tag_len) {
-        return srtp_err_status_buffer_small;
+    /* if not-inplace then need to copy full rtp header */
+    if (rtp != srtp) {
+        memcpy(srtp, rtp, enc_start);
     }
 
-    /* if not-inplace then need to copy full rtp header */
-    if (srtp != rtp) {
-        memcpy(rtp, srtp, enc_start);
+    if (stream->use_mki) {
+        srtp_inject_mki(srtp + rtp_len, session_keys, stream->mki_size);
     }
 
     /*
@@ -2988,2179 +4525,5806 @@ srtp_err_status_t srtp_unprotect(srtp_t ctx,
      */
     if (stream->rtp_services & sec_serv_auth) {
         auth_start = srtp;
-        auth_tag = srtp + srtp_len - tag_len;
+        auth_tag = srtp + rtp_len + stream->mki_size;
     } else {
         auth_start = NULL;
         auth_tag = NULL;
     }
 
     /*
-     * if we expect message authentication, run the authentication
-     * function and compare the result with the value of the auth_tag
+     * estimate the packet index using the start of the replay window
+     * and the sequence number from the header
      */
-    if (auth_start) {
-        /*
-         * if we're using a universal hash, then we need to compute the
-         * keystream prefix for encrypting the universal hash output
-         *
-         * if the keystream prefix length is zero, then we know that
-         * the authenticator isn't using a universal hash function
-         */
-        if (session_keys->rtp_auth->prefix_len != 0) {
-            prefix_len = srtp_auth_get_prefix_length(session_keys->rtp_auth);
-            status = srtp_cipher_output(session_keys->rtp_cipher, tmp_tag,
-                                        &prefix_len);
-            debug_print(mod_srtp, "keystream prefix: %s",
-                        srtp_octet_string_hex_string(tmp_tag, prefix_len));
-            if (status) {
-                return srtp_err_status_cipher_fail;
-            }
-        }
+    status = srtp_get_est_pkt_index(hdr, stream, &est, &delta);
 
-        /* initialize auth func context */
-        status = srtp_auth_start(session_keys->rtp_auth);
-        if (status) {
-            return status;
-        }
+    if (status && (status != srtp_err_status_pkt_idx_adv)) {
+        return status;
+    }
 
-        /* now compute auth function over packet */
-        status = srtp_auth_update(session_keys->rtp_auth, auth_start,
-                                  srtp_len - tag_len - stream->mki_size);
+    if (status == srtp_err_status_pkt_idx_adv) {
+        srtp_rdbx_set_roc_seq(&stream->rtp_rdbx, (uint32_t)(est >> 16),
+                              (uint16_t)(est & 0xFFFF));
+        stream->pending_roc = 0;
+        srtp_rdbx_add_index(&stream->rtp_rdbx, 0);
+    } else {
+        status = srtp_rdbx_check(&stream->rtp_rdbx, delta);
         if (status) {
-            return status;
+            if (status != srtp_err_status_replay_fail ||
+                !stream->allow_repeat_tx)
+                return status; /* we've been asked to reuse an index */
         }
+        srtp_rdbx_add_index(&stream->rtp_rdbx, delta);
+    }
 
-        /* run auth func over ROC, then write tmp tag */
-        status = srtp_auth_compute(session_keys->rtp_auth, (uint8_t *)&est, 4,
-                                   tmp_tag);
+    debug_print(mod_srtp, "estimated packet index: %016" PRIx64, est);
 
-        debug_print(mod_srtp, "computed auth tag:    %s",
-                    srtp_octet_string_hex_string(tmp_tag, tag_len));
-        debug_print(mod_srtp, "packet auth tag:      %s",
-                    srtp_octet_string_hex_string(auth_tag, tag_len));
-        if (status) {
-            return srtp_err_status_auth_fail;
+    /*
+     * use keystream from srtp_stream_precompute() if there is some for
+     * this index; only packets whose payload is the sole user of the
+     * cipher can be handled that way
+     */
+    if (stream->keystream_cache && (stream->rtp_services & sec_serv_conf) &&
+        !cryptex_inuse && !(hdr->x == 1 && session_keys->rtp_xtn_hdr_cipher) &&
+        !(auth_start && srtp_auth_get_prefix_length(session_keys->rtp_auth))) {
+        keystream = srtp_keystream_cache_take(stream, session_keys, est,
+                                              enc_octet_len);
+    }
+
+    /*
+     * if we're using rindael counter mode, set nonce and seq
+     */
+    if (keystream) {
+        /* the cipher is not needed for this packet */
+        status = srtp_err_status_ok;
+    } else if (srtp_cipher_is_icm(session_keys->rtp_cipher)) {
+        v128_t iv;
+
+        iv.v32[0] = 0;
+        iv.v32[1] = hdr->ssrc;
+        iv.v64[1] = be64_to_cpu(est << 16);
+        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_encrypt);
+        if (!status && session_keys->rtp_xtn_hdr_cipher) {
+            status = srtp_cipher_set_iv(session_keys->rtp_xtn_hdr_cipher,
+                                        (uint8_t *)&iv, srtp_direction_encrypt);
         }
+    } else {
+        v128_t iv;
 
-        if (!srtp_octet_string_equal(tmp_tag, auth_tag, tag_len)) {
-            return srtp_err_status_auth_fail;
+        /* otherwise, set the index to est */
+        iv.v64[0] = 0;
+        iv.v64[1] = be64_to_cpu(est);
+        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_encrypt);
+        if (!status && session_keys->rtp_xtn_hdr_cipher) {
+            status = srtp_cipher_set_iv(session_keys->rtp_xtn_hdr_cipher,
+                                        (uint8_t *)&iv, srtp_direction_encrypt);
         }
     }
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+
+    /* shift est, put into network byte order */
+    est = be64_to_cpu(est << 16);
 
     /*
-     * update the key usage limit, and check it to make sure that we
-     * didn't just hit either the soft limit or the hard limit, and call
-     * the event handler if we hit either.
+     * if we're authenticating using a universal hash, put the keystream
+     * prefix into the authentication tag
      */
-    switch (srtp_key_limit_update(session_keys->limit)) {
-    case srtp_key_event_normal:
-        break;
-    case srtp_key_event_soft_limit:
-        srtp_handle_event(ctx, stream, event_key_soft_limit);
-        break;
-    case srtp_key_event_hard_limit:
-        srtp_handle_event(ctx, stream, event_key_hard_limit);
-        return srtp_err_status_key_expired;
-    default:
-        break;
+    if (auth_start) {
+        prefix_len = srtp_auth_get_prefix_length(session_keys->rtp_auth);
+        if (prefix_len) {
+            status = srtp_cipher_output(session_keys->rtp_cipher, auth_tag,
+                                        &prefix_len);
+            if (status) {
+                return srtp_err_status_cipher_fail;
+            }
+            debug_print(mod_srtp, "keystream prefix: %s",
+                        srtp_octet_string_hex_string(auth_tag, prefix_len));
+        }
     }
 
     if (hdr->x == 1 && session_keys->rtp_xtn_hdr_cipher) {
-        /* extensions header encryption RFC 6904 */
+        /*
+         * extensions header encryption RFC 6904
+         */
         status = srtp_process_header_encryption(
-            stream, srtp_get_rtp_xtn_hdr(hdr, rtp), session_keys);
+            stream, srtp_get_rtp_xtn_hdr(hdr, srtp), session_keys);
         if (status) {
             return status;
         }
     }
 
     if (cryptex_inuse) {
-        status = srtp_cryptex_unprotect(cryptex_inplace, hdr, rtp,
-                                        session_keys->rtp_cipher);
+        status = srtp_cryptex_protect(false, hdr, rtp, srtp,
+                                      session_keys->rtp_cipher);
         if (status) {
             return status;
         }
     }
 
-    /* if we're decrypting, add keystream into ciphertext */
-    if (stream->rtp_services & sec_serv_conf) {
-        status =
-            srtp_cipher_decrypt(session_keys->rtp_cipher, srtp + enc_start,
-                                enc_octet_len, rtp + enc_start, &enc_octet_len);
+    /* if we're encrypting, exor keystream into the message */
+    if (keystream) {
+        srtp_xor_keystream(srtp + enc_start, rtp + enc_start, keystream,
+                           enc_octet_len);
+    } else if (stream->rtp_services & sec_serv_conf) {
+        status = srtp_cipher_encrypt(session_keys->rtp_cipher, rtp + enc_start,
+                                     enc_octet_len, srtp + enc_start,
+                                     &enc_octet_len);
         if (status) {
             return srtp_err_status_cipher_fail;
         }
     } else if (rtp != srtp) {
         /* if no encryption and not-inplace then need to copy rest of packet */
-        memcpy(rtp + enc_start, srtp + enc_start, enc_octet_len);
+        memcpy(srtp + enc_start, rtp + enc_start, enc_octet_len);
     }
 
-    if (cryptex_inuse) {
-        srtp_cryptex_unprotect_cleanup(cryptex_inplace, hdr, rtp);
-    }
 
     /*
-     * verify that stream is for received traffic - this check will
-     * detect SSRC collisions, since a stream that appears in both
-     * srtp_protect() and srtp_unprotect() will fail this test in one of
-     * those functions.
-     *
-     * we do this check *after* the authentication check, so that the
-     * latter check will catch any attempts to fool us into thinking
-     * that we've got a collision
+     *  if we're authenticating, run authentication function and put result
+     *  into the auth_tag
      */
-    if (stream->direction != dir_srtp_receiver) {
-        if (stream->direction == dir_unknown) {
-            stream->direction = dir_srtp_receiver;
-        } else {
-            srtp_handle_event(ctx, stream, event_ssrc_collision);
+    if (auth_start) {
+        /* initialize auth func context */
+        status = srtp_auth_start(session_keys->rtp_auth);
+        if (status) {
+            return status;
         }
-    }
 
-    /*
-     * if the stream is a 'provisional' one, in which the template context
-     * is used, then we need to allocate a new stream at this point, since
-     * the authentication passed
-     */
-    if (stream == ctx->stream_template) {
-        srtp_stream_ctx_t *new_stream;
-
-        /*
-         * allocate and initialize a new stream
-         *
-         * note that we indicate failure if we can't allocate the new
-         * stream, and some implementations will want to not return
-         * failure here
-         */
-        status =
-            srtp_stream_clone(ctx->stream_template, hdr->ssrc, &new_stream);
+        /* run auth func over packet */
+        status = srtp_auth_update(session_keys->rtp_auth, auth_start, rtp_len);
         if (status) {
             return status;
         }
 
-        /* add new stream to the list */
-        status = srtp_insert_or_dealloc_stream(ctx->stream_list, new_stream,
-                                               ctx->stream_template);
+        /* run auth func over ROC, put result into auth_tag */
+        debug_print(mod_srtp, "estimated packet index: %016" PRIx64, est);
+        status = srtp_auth_compute(session_keys->rtp_auth, (uint8_t *)&est, 4,
+                                   auth_tag);
+        debug_print(mod_srtp, "srtp auth tag:    %s",
+                    srtp_octet_string_hex_string(auth_tag, tag_len));
         if (status) {
             return status;
         }
-
-        /* set stream (the pointer used in this function) */
-        stream = new_stream;
     }
 
-    /*
-     * the message authentication function passed, so add the packet
-     * index into the replay database
-     */
-    if (advance_packet_index) {
-        srtp_rdbx_set_roc_seq(&stream->rtp_rdbx, roc_to_set, seq_to_set);
-        stream->pending_roc = 0;
-        srtp_rdbx_add_index(&stream->rtp_rdbx, 0);
-    } else {
-        srtp_rdbx_add_index(&stream->rtp_rdbx, delta);
-    }
+    *srtp_len = enc_start + enc_octet_len;
 
-    *rtp_len = enc_start + enc_octet_len;
+    /* increase the packet length by the length of the auth tag */
+    *srtp_len += tag_len;
+
+    /* increate the packet length by the mki size if used */
+    *srtp_len += stream->mki_size;
+    srtp_session_use_stream(ctx, stream);
 
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_init(void)
+/*
+ * srtp_unprotect_packet() is srtp_unprotect(); if outer_only is set it
+ * only removes the hop-by-hop layer of double encryption, for
+ * srtp_unprotect_outer()
+ */
+static srtp_err_status_t srtp_unprotect_packet(srtp_t ctx,
+                                               const uint8_t *srtp,
+                                               size_t srtp_len,
+                                               uint8_t *rtp,
+                                               size_t *rtp_len,
+                                               bool outer_only)
 {
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)srtp;
+    size_t enc_start;               /* pointer to start of encrypted portion  */
+    const uint8_t *auth_start;      /* pointer to start of auth. portion      */
+    size_t enc_octet_len = 0;       /* number of octets in encrypted portion  */
+    const uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
+    srtp_xtd_seq_num_t est;         /* estimated xtd_seq_num_t of *hdr        */
+    srtp_xtd_seq_num_t pkt_index;   /* est, before it is used for the auth tag */
+    ssize_t delta;                  /* delta of local pkt idx and that in hdr */
+    v128_t iv;
     srtp_err_status_t status;
+    srtp_stream_ctx_t *stream;
+    uint8_t tmp_tag[SRTP_MAX_TAG_LEN];
+    size_t tag_len, prefix_len;
+    srtp_session_keys_t *session_keys = NULL;
+    bool advance_packet_index = false;
 
-    /* initialize crypto kernel */
-    status = srtp_crypto_kernel_init();
-    if (status) {
-        return status;
-    }
+    debug_print0(mod_srtp, "function srtp_unprotect");
 
-    /* load srtp debug module into the kernel */
-    status = srtp_crypto_kernel_load_debug_module(&mod_srtp);
+    /* Verify RTP header */
+    status = srtp_validate_rtp_header(srtp, srtp_len);
     if (status) {
         return status;
     }
 
-    return srtp_err_status_ok;
-}
-
-srtp_err_status_t srtp_shutdown(void)
-{
-    srtp_err_status_t status;
+    /* check the packet length - it must at least contain a full header */
+    if (srtp_len < octets_in_rtp_header) {
+        return srtp_err_status_bad_param;
+    }
 
-    /* shut down crypto kernel */
-    status = srtp_crypto_kernel_shutdown();
-    if (status) {
+    /*
+     * look up ssrc in srtp_stream list, and process the packet with
+     * the appropriate stream.  if we haven't seen this stream before,
+     * there's only one key for this srtp_session, and the cipher
+     * supports key-sharing, then we assume that a new stream using
+     * that key has just started up
+     */
+    stream = srtp_get_stream(ctx, hdr->ssrc);
+    if (stream != NULL && stream->rtp_unprotect != NULL && !outer_only) {
+        /* use the handler compiled for this stream's policy */
+        status =
+            stream->rtp_unprotect(ctx, stream, srtp, srtp_len, rtp, rtp_len);
+        if (status == srtp_err_status_ok) {
+            srtp_session_use_stream(ctx, stream);
+        }
         return status;
     }
+    if (stream == NULL) {
+        if (ctx->stream_template != NULL) {
+            stream = ctx->stream_template;
+            debug_print(mod_srtp, "using provisional stream (SSRC: 0x%08x)",
+                        (unsigned int)ntohl(hdr->ssrc));
 
-    /* shutting down crypto kernel frees the srtp debug module as well */
+            /*
+             * set estimated packet index to sequence number from header,
+             * and set delta equal to the same value
+             */
+            est = (srtp_xtd_seq_num_t)ntohs(hdr->seq);
+            delta = (int)est;
+        } else {
+            /*
+             * no stream corresponding to SSRC found, and we don't do
+             * key-sharing, so return an error
+             */
+            return srtp_err_status_no_ctx;
+        }
+    } else {
+        status = srtp_get_est_pkt_index(hdr, stream, &est, &delta);
 
-    return srtp_err_status_ok;
-}
+        if (status && (status != srtp_err_status_pkt_idx_adv)) {
+            return status;
+        }
 
-srtp_stream_ctx_t *srtp_get_stream(srtp_t srtp, uint32_t ssrc)
-{
-    return srtp_stream_list_get(srtp->stream_list, ssrc);
-}
+        if (status == srtp_err_status_pkt_idx_adv) {
+            advance_packet_index = true;
+        }
 
-srtp_err_status_t srtp_dealloc(srtp_t session)
-{
-    srtp_err_status_t status;
+        /* check replay database */
+        if (!advance_packet_index) {
+            status = srtp_check_pkt_index(stream, est, delta);
+            if (status) {
+                return status;
+            }
+        }
+    }
 
-    /*
-     * we take a conservative deallocation strategy - if we encounter an
-     * error deallocating a stream, then we stop trying to deallocate
-     * memory and just return an error
-     */
+    debug_print(mod_srtp, "estimated u_packet index: %016" PRIx64, est);
+    pkt_index = est;
 
-    /* deallocate streams */
-    status = srtp_remove_and_dealloc_streams(session->stream_list,
-                                             session->stream_template);
+    /* Determine if MKI is being used and what session keys should be used */
+    status = srtp_get_session_keys_for_rtp_packet(stream, srtp, srtp_len,
+                                                  &session_keys);
     if (status) {
         return status;
     }
 
-    /* deallocate stream template, if there is one */
-    if (session->stream_template != NULL) {
-        status = srtp_stream_dealloc(session->stream_template, NULL);
-        if (status) {
-            return status;
+    /*
+     * Check if this is an AEAD stream (GCM mode).  If so, then dispatch
+     * the request to our AEAD handler.
+     */
+    if (session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_128 ||
+        session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_256) {
+        if (stream->inner != NULL && !outer_only) {
+            status = srtp_unprotect_double(ctx, stream, delta, est, srtp,
+                                           srtp_len, rtp, rtp_len, session_keys,
+                                           advance_packet_index);
+        } else {
+            status = srtp_unprotect_aead(ctx, stream, delta, est, srtp,
+                                         srtp_len, rtp, rtp_len, session_keys,
+                                         advance_packet_index);
+        }
+        /* a new stream was marked as used when it was cloned */
+        if (status == srtp_err_status_ok && stream != ctx->stream_template) {
+            srtp_session_use_stream(ctx, stream);
         }
+        return status;
     }
 
-    /* deallocate stream list */
-    status = srtp_stream_list_dealloc(session->stream_list);
-    if (status) {
-        return status;
+    /* double encryption is only defined for the AEAD transforms */
+    if (outer_only) {
+        return srtp_err_status_bad_param;
     }
 
-    /* deallocate session context */
-    srtp_crypto_free(session);
+    /* get tag length from stream */
+    tag_len = srtp_auth_get_tag_length(session_keys->rtp_auth);
 
-    return srtp_err_status_ok;
-}
+    /*
+     * set the cipher's IV properly, depending on whatever cipher we
+     * happen to be using
+     */
+    if (session_keys->rtp_cipher->type->id == SRTP_AES_ICM_128 ||
+        session_keys->rtp_cipher->type->id == SRTP_AES_ICM_192 ||
+        session_keys->rtp_cipher->type->id == SRTP_AES_ICM_256) {
+        /* aes counter mode */
+        iv.v32[0] = 0;
+        iv.v32[1] = hdr->ssrc; /* still in network order */
+        iv.v64[1] = be64_to_cpu(est << 16);
+        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_decrypt);
+        if (!status && session_keys->rtp_xtn_hdr_cipher) {
+            status = srtp_cipher_set_iv(session_keys->rtp_xtn_hdr_cipher,
+                                        (uint8_t *)&iv, srtp_direction_decrypt);
+        }
+    } else {
+        /* no particular format - set the iv to the packet index */
+        iv.v64[0] = 0;
+        iv.v64[1] = be64_to_cpu(est);
+        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_decrypt);
+        if (!status && session_keys->rtp_xtn_hdr_cipher) {
+            status = srtp_cipher_set_iv(session_keys->rtp_xtn_hdr_cipher,
+                                        (uint8_t *)&iv, srtp_direction_decrypt);
+        }
+    }
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
 
-srtp_err_status_t srtp_stream_add(srtp_t session, const srtp_policy_t *policy)
-{
-    srtp_err_status_t status;
-    srtp_stream_t tmp;
+    /* shift est, put into network byte order */
+    est = be64_to_cpu(est << 16);
 
-    /* sanity check arguments */
-    if (session == NULL) {
-        return srtp_err_status_bad_param;
+    enc_start = srtp_get_rtp_hdr_len(hdr);
+    if (hdr->x == 1) {
+        enc_start += srtp_get_rtp_xtn_hdr_len(hdr, srtp);
     }
 
-    status = srtp_valid_policy(policy);
-    if (status != srtp_err_status_ok) {
+    bool cryptex_inuse;
+    status = srtp_cryptex_unprotect_init(stream, hdr, srtp, &cryptex_inuse,
+                                         &enc_start);
+    if (status) {
         return status;
     }
 
-    /* allocate stream  */
-    status = srtp_stream_alloc(&tmp, policy);
-    if (status) {
-        return status;
+    if (enc_start > srtp_len - tag_len - stream->mki_size) {
+        return srtp_err_status_parse_err;
     }
+    enc_octet_len = srtp_len - enc_start - stream->mki_size - tag_len;
 
-    /* initialize stream  */
-    status = srtp_stream_init(tmp, policy);
-    if (status) {
-        srtp_stream_dealloc(tmp, NULL);
-        return status;
+    /* check output length */
+    if (*rtp_len < srtp_len - stream->mki_size - tag_len) {
+        return srtp_err_status_buffer_small;
+    }
+
+    /* if not-inplace then need to copy full rtp header */
+    if (srtp != rtp) {
+        memcpy(rtp, srtp, enc_start);
     }
 
     /*
-     * set the head of the stream list or the template to point to the
-     * stream that we've just alloced and init'ed, depending on whether
-     * or not it has a wildcard SSRC value or not
-     *
-     * if the template stream has already been set, then the policy is
-     * inconsistent, so we return a bad_param error code
+     * if we're providing authentication, set the auth_start and auth_tag
+     * pointers to the proper locations; otherwise, set auth_start to NULL
+     * to indicate that no authentication is needed
      */
-    switch (policy->ssrc.type) {
-    case (ssrc_any_outbound):
-        if (session->stream_template) {
-            srtp_stream_dealloc(tmp, NULL);
-            return srtp_err_status_bad_param;
-        }
-        session->stream_template = tmp;
-        session->stream_template->direction = dir_srtp_sender;
-        break;
-    case (ssrc_any_inbound):
-        if (session->stream_template) {
-            srtp_stream_dealloc(tmp, NULL);
-            return srtp_err_status_bad_param;
-        }
-        session->stream_template = tmp;
-        session->stream_template->direction = dir_srtp_receiver;
-        break;
-    case (ssrc_specific):
-        status = srtp_insert_or_dealloc_stream(session->stream_list, tmp,
-                                               session->stream_template);
+    if (stream->rtp_services & sec_serv_auth) {
+        auth_start = srtp;
+        auth_tag = srtp + srtp_len - tag_len;
+    } else {
+        auth_start = NULL;
+        auth_tag = NULL;
+    }
+
+    /*
+     * if we expect message authentication, run the authentication
+     * function and compare the result with the value of the auth_tag
+     */
+    if (auth_start) {
+        /*
+         * if we're using a universal hash, then we need to compute the
+         * keystream prefix for encrypting the universal hash output
+         *
+         * if the keystream prefix length is zero, then we know that
+         * the authenticator isn't using a universal hash function
+         */
+        if (session_keys->rtp_auth->prefix_len != 0) {
+            prefix_len = srtp_auth_get_prefix_length(session_keys->rtp_auth);
+            status = srtp_cipher_output(session_keys->rtp_cipher, tmp_tag,
+                                        &prefix_len);
+            debug_print(mod_srtp, "keystream prefix: %s",
+                        srtp_octet_string_hex_string(tmp_tag, prefix_len));
+            if (status) {
+                return srtp_err_status_cipher_fail;
+            }
+        }
+
+        /* initialize auth func context */
+        status = srtp_auth_start(session_keys->rtp_auth);
+        if (status) {
+            return status;
+        }
+
+        /* now compute auth function over packet */
+        status = srtp_auth_update(session_keys->rtp_auth, auth_start,
+                                  srtp_len - tag_len - stream->mki_size);
         if (status) {
             return status;
         }
+
+        /* run auth func over ROC, then write tmp tag */
+        status = srtp_auth_compute(session_keys->rtp_auth, (uint8_t *)&est, 4,
+                                   tmp_tag);
+
+        debug_print(mod_srtp, "computed auth tag:    %s",
+                    srtp_octet_string_hex_string(tmp_tag, tag_len));
+        debug_print(mod_srtp, "packet auth tag:      %s",
+                    srtp_octet_string_hex_string(auth_tag, tag_len));
+        if (status) {
+            return srtp_err_status_auth_fail;
+        }
+
+        if (!srtp_octet_string_equal(tmp_tag, auth_tag, tag_len)) {
+            return srtp_err_status_auth_fail;
+        }
+    }
+
+    /*
+     * update the key usage limit, and check it to make sure that we
+     * didn't just hit either the soft limit or the hard limit, and call
+     * the event handler if we hit either.
+     */
+    switch (srtp_key_limit_update(session_keys->limit)) {
+    case srtp_key_event_normal:
         break;
-    case (ssrc_undefined):
+    case srtp_key_event_soft_limit:
+        srtp_handle_event(ctx, stream, event_key_soft_limit);
+        break;
+    case srtp_key_event_hard_limit:
+        srtp_handle_event(ctx, stream, event_key_hard_limit);
+        return srtp_err_status_key_expired;
     default:
-        srtp_stream_dealloc(tmp, NULL);
-        return srtp_err_status_bad_param;
+        break;
     }
 
-    return srtp_err_status_ok;
-}
-
-srtp_err_status_t srtp_create(srtp_t *session, /* handle for session     */
-                              const srtp_policy_t *policy)
-{ /* SRTP policy (list)     */
-    srtp_err_status_t stat;
-    srtp_ctx_t *ctx;
-
-    /* sanity check arguments */
-    if (session == NULL) {
-        return srtp_err_status_bad_param;
+    if (hdr->x == 1 && session_keys->rtp_xtn_hdr_cipher) {
+        /* extensions header encryption RFC 6904 */
+        status = srtp_process_header_encryption(
+            stream, srtp_get_rtp_xtn_hdr(hdr, rtp), session_keys);
+        if (status) {
+            return status;
+        }
     }
 
-    if (policy) {
-        stat = srtp_valid_policy(policy);
-        if (stat != srtp_err_status_ok) {
-            return stat;
+    if (cryptex_inuse) {
+        status = srtp_cryptex_unprotect(false, hdr, srtp, rtp,
+                                        session_keys->rtp_cipher);
+        if (status) {
+            return status;
         }
     }
 
-    /* allocate srtp context and set ctx_ptr */
-    ctx = (srtp_ctx_t *)srtp_crypto_alloc(sizeof(srtp_ctx_t));
-    if (ctx == NULL) {
-        return srtp_err_status_alloc_fail;
+    /* if we're decrypting, add keystream into ciphertext */
+    if (stream->rtp_services & sec_serv_conf) {
+        status =
+            srtp_cipher_decrypt(session_keys->rtp_cipher, srtp + enc_start,
+                                enc_octet_len, rtp + enc_start, &enc_octet_len);
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+    } else if (rtp != srtp) {
+        /* if no encryption and not-inplace then need to copy rest of packet */
+        memcpy(rtp + enc_start, srtp + enc_start, enc_octet_len);
     }
-    *session = ctx;
 
-    ctx->stream_template = NULL;
-    ctx->stream_list = NULL;
-    ctx->user_data = NULL;
+    if (cryptex_inuse) {
+        srtp_cryptex_unprotect_cleanup(hdr, rtp);
+    }
 
-    /* allocate stream list */
-    stat = srtp_stream_list_alloc(&ctx->stream_list);
-    if (stat) {
-        /* clean up everything */
-        srtp_dealloc(*session);
-        *session = NULL;
-        return stat;
+    /*
+     * verify that stream is for received traffic - this check will
+     * detect SSRC collisions, since a stream that appears in both
+     * srtp_protect() and srtp_unprotect() will fail this test in one of
+     * those functions.
+     *
+     * we do this check *after* the authentication check, so that the
+     * latter check will catch any attempts to fool us into thinking
+     * that we've got a collision
+     */
+    if (stream->direction != dir_srtp_receiver) {
+        if (stream->direction == dir_unknown) {
+            stream->direction = dir_srtp_receiver;
+        } else {
+            srtp_handle_event(ctx, stream, event_ssrc_collision);
+        }
     }
 
     /*
-     * loop over elements in the policy list, allocating and
-     * initializing a stream for each element
+     * if the stream is a 'provisional' one, in which the template context
+     * is used, then we need to allocate a new stream at this point, since
+     * the authentication passed
      */
-    while (policy != NULL) {
-        stat = srtp_stream_add(ctx, policy);
-        if (stat) {
-            /* clean up everything */
-            srtp_dealloc(*session);
-            *session = NULL;
-            return stat;
+    if (stream == ctx->stream_template) {
+        srtp_stream_ctx_t *new_stream;
+
+        /*
+         * allocate and initialize a new stream, and add it to the list
+         *
+         * note that we indicate failure if we can't allocate the new
+         * stream, and some implementations will want to not return
+         * failure here
+         */
+        status = srtp_session_clone_stream(ctx, hdr->ssrc, &new_stream);
+        if (status) {
+            return status;
         }
 
-        /* set policy to next item in list  */
-        policy = policy->next;
+        /* set stream (the pointer used in this function) */
+        stream = new_stream;
+    }
+
+    /*
+     * the message authentication function passed, so add the packet
+     * index into the replay database
+     */
+    status = srtp_add_pkt_index(stream, pkt_index, delta, advance_packet_index);
+    if (status) {
+        return status;
     }
 
+    *rtp_len = enc_start + enc_octet_len;
+    srtp_session_use_stream(ctx, stream);
+
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_stream_remove(srtp_t session, uint32_t ssrc)
+srtp_err_status_t srtp_protect(srtp_t ctx,
+                               const uint8_t *rtp,
+                               size_t rtp_len,
+                               uint8_t *srtp,
+                               size_t *srtp_len,
+                               size_t mki_index)
+{
+    return srtp_protect_packet(ctx, rtp, rtp_len, srtp, srtp_len, mki_index,
+                               false);
+}
+
+srtp_err_status_t srtp_unprotect(srtp_t ctx,
+                                 const uint8_t *srtp,
+                                 size_t srtp_len,
+                                 uint8_t *rtp,
+                                 size_t *rtp_len)
+{
+    return srtp_unprotect_packet(ctx, srtp, srtp_len, rtp, rtp_len, false);
+}
+
+/*
+ * srtp_get_rtp_payload_start(rtp) returns the offset of the payload of
+ * the packet at rtp, whose header has been validated
+ */
+static size_t srtp_get_rtp_payload_start(const uint8_t *rtp)
+{
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)rtp;
+    size_t start = srtp_get_rtp_hdr_len(hdr);
+
+    if (hdr->x == 1) {
+        start += srtp_get_rtp_xtn_hdr_len(hdr, rtp);
+    }
+    return start;
+}
+
+srtp_err_status_t srtp_protect_outer(srtp_t ctx,
+                                     const uint8_t *rtp,
+                                     size_t rtp_len,
+                                     uint8_t *srtp,
+                                     size_t *srtp_len,
+                                     size_t mki_index)
 {
-    srtp_stream_ctx_t *stream;
     srtp_err_status_t status;
+    srtp_ohb_t ohb;
 
-    /* sanity check arguments */
-    if (session == NULL) {
-        return srtp_err_status_bad_param;
+    status = srtp_validate_rtp_header(rtp, rtp_len);
+    if (status) {
+        return status;
     }
 
-    /* find and remove stream from the list */
-    stream = srtp_stream_list_get(session->stream_list, htonl(ssrc));
-    if (stream == NULL) {
-        return srtp_err_status_no_ctx;
+    status = srtp_parse_ohb(rtp, rtp_len, srtp_get_rtp_payload_start(rtp),
+                            &ohb);
+    if (status) {
+        return status;
     }
 
-    srtp_stream_list_remove(session->stream_list, stream);
+    return srtp_protect_packet(ctx, rtp, rtp_len, srtp, srtp_len, mki_index,
+                               true);
+}
+
+srtp_err_status_t srtp_unprotect_outer(srtp_t ctx,
+                                       const uint8_t *srtp,
+                                       size_t srtp_len,
+                                       uint8_t *rtp,
+                                       size_t *rtp_len)
+{
+    srtp_err_status_t status;
+    srtp_ohb_t ohb;
 
-    /* deallocate the stream */
-    status = srtp_stream_dealloc(stream, session->stream_template);
+    status = srtp_unprotect_packet(ctx, srtp, srtp_len, rtp, rtp_len, true);
     if (status) {
         return status;
     }
 
-    return srtp_err_status_ok;
+    return srtp_parse_ohb(rtp, *rtp_len, srtp_get_rtp_payload_start(rtp),
+                          &ohb);
 }
 
-srtp_err_status_t srtp_update(srtp_t session, const srtp_policy_t *policy)
+srtp_err_status_t srtp_double_rewrite_header(uint8_t *rtp,
+                                             size_t rtp_len,
+                                             size_t *new_len,
+                                             uint8_t payload_type,
+                                             uint16_t seq,
+                                             bool marker)
 {
-    srtp_err_status_t stat;
+    srtp_hdr_t *hdr = (srtp_hdr_t *)rtp;
+    srtp_err_status_t status;
+    srtp_ohb_t ohb;
+    size_t end;
+    uint8_t *ptr;
 
-    /* sanity check arguments */
-    if (session == NULL) {
+    if (payload_type > 0x7f) {
         return srtp_err_status_bad_param;
     }
 
-    stat = srtp_valid_policy(policy);
-    if (stat != srtp_err_status_ok) {
-        return stat;
+    status = srtp_validate_rtp_header(rtp, rtp_len);
+    if (status) {
+        return status;
     }
 
-    while (policy != NULL) {
-        stat = srtp_stream_update(session, policy);
-        if (stat) {
-            return stat;
-        }
+    status = srtp_parse_ohb(rtp, rtp_len, srtp_get_rtp_payload_start(rtp),
+                            &ohb);
+    if (status) {
+        return status;
+    }
+    end = rtp_len - ohb.len;
 
-        /* set policy to next item in list  */
-        policy = policy->next;
+    /* an original value, once recorded, stays */
+    if (hdr->pt != payload_type && !(ohb.config & SRTP_OHB_PT)) {
+        ohb.config |= SRTP_OHB_PT;
+        ohb.pt = hdr->pt;
     }
-    return srtp_err_status_ok;
+    if (hdr->seq != htons(seq) && !(ohb.config & SRTP_OHB_SEQ)) {
+        ohb.config |= SRTP_OHB_SEQ;
+        ohb.seq = hdr->seq;
+    }
+    if (hdr->m != marker && !(ohb.config & SRTP_OHB_M)) {
+        ohb.config |= SRTP_OHB_M;
+        if (hdr->m) {
+            ohb.config |= SRTP_OHB_B;
+        }
+    }
+
+    ohb.len = 1;
+    if (ohb.config & SRTP_OHB_PT) {
+        ohb.len += 1;
+    }
+    if (ohb.config & SRTP_OHB_SEQ) {
+        ohb.len += 2;
+    }
+    if (*new_len < end + ohb.len) {
+        return srtp_err_status_buffer_small;
+    }
+
+    ptr = rtp + end;
+    if (ohb.config & SRTP_OHB_PT) {
+        *ptr++ = ohb.pt;
+    }
+    if (ohb.config & SRTP_OHB_SEQ) {
+        memcpy(ptr, &ohb.seq, 2);
+        ptr += 2;
+    }
+    *ptr = ohb.config;
+
+    hdr->pt = payload_type;
+    hdr->seq = htons(seq);
+    hdr->m = marker ? 1 : 0;
+    *new_len = end + ohb.len;
+
+    return srtp_err_status_ok;
 }
 
-struct update_template_stream_data {
-    srtp_err_status_t status;
-    srtp_t session;
-    srtp_stream_t new_stream_template;
-    srtp_stream_list_t new_stream_list;
-};
+/*
+ * srtp_protect_burst() and srtp_unprotect_burst() hand the packets of a
+ * stream with the compiled AES-ICM/HMAC-SHA1 handlers to its cipher and
+ * auth function up to SRTP_BURST_BATCH at a time, through
+ * srtp_cipher_batch() and srtp_auth_batch(), so that a type with a batch
+ * entry point, e.g. a multi-buffer engine, gets them in one call.  The
+ * steps that use the stream run in packet order around the batch, as for
+ * the worker pool.  Other packets go through srtp_protect() and
+ * srtp_unprotect() one at a time.
+ */
+#define SRTP_BURST_BATCH 16
 
-static bool update_template_stream_cb(srtp_stream_t stream, void *raw_data)
+/*
+ * srtp_burst_stream(ctx, pkt, len, protect) returns the stream of the
+ * packet at pkt if it has the compiled handler for the direction, or
+ * NULL if the packet is to go through srtp_protect() or srtp_unprotect()
+ */
+static srtp_stream_ctx_t *srtp_burst_stream(srtp_t ctx,
+                                            const uint8_t *pkt,
+                                            size_t len,
+                                            bool protect)
 {
-    struct update_template_stream_data *data =
-        (struct update_template_stream_data *)raw_data;
-    srtp_t session = data->session;
-    uint32_t ssrc = stream->ssrc;
-    srtp_xtd_seq_num_t old_index;
-    srtp_rdb_t old_rtcp_rdb;
+    srtp_stream_ctx_t *stream;
 
-    /* old / non-template streams are copied unchanged */
-    if (stream->session_keys[0].rtp_auth !=
-        session->stream_template->session_keys[0].rtp_auth) {
-        srtp_stream_list_remove(session->stream_list, stream);
-        data->status = srtp_insert_or_dealloc_stream(
-            data->new_stream_list, stream, session->stream_template);
-        if (data->status) {
-            return false;
+    if (srtp_validate_rtp_header(pkt, len) || len < octets_in_rtp_header) {
+        return NULL;
+    }
+
+    stream = srtp_get_stream(ctx, ((const srtp_hdr_t *)pkt)->ssrc);
+    if (stream == NULL ||
+        (protect ? stream->rtp_protect != srtp_protect_icm_hmac
+                 : stream->rtp_unprotect != srtp_unprotect_icm_hmac)) {
+        return NULL;
+    }
+
+    return stream;
+}
+
+/*
+ * srtp_protect_burst_batch() protects num_pkts packets of stream, which
+ * has the compiled handlers; like srtp_protect_burst() it stops at the
+ * first packet that fails
+ */
+static srtp_err_status_t srtp_protect_burst_batch(srtp_t ctx,
+                                                  srtp_stream_ctx_t *stream,
+                                                  const uint8_t *rtp,
+                                                  size_t rtp_stride,
+                                                  const size_t rtp_len[],
+                                                  size_t num_pkts,
+                                                  uint8_t *srtp,
+                                                  size_t srtp_stride,
+                                                  size_t srtp_len[])
+{
+    srtp_session_keys_t *session_keys = &stream->session_keys[0];
+    srtp_icm_hmac_pkt_t pkt[SRTP_BURST_BATCH];
+    v128_t iv[SRTP_BURST_BATCH];
+    srtp_xtd_seq_num_t roc[SRTP_BURST_BATCH];
+    srtp_cipher_job_t cipher_jobs[SRTP_BURST_BATCH];
+    srtp_auth_job_t auth_jobs[SRTP_BURST_BATCH];
+    srtp_err_status_t status = srtp_err_status_ok;
+    size_t num_started;
+    size_t i;
+
+    /* the packets take their indices in order, up to the first failure */
+    for (i = 0; i < num_pkts; i++) {
+        if (stream->direction != dir_srtp_sender) {
+            if (stream->direction == dir_unknown) {
+                stream->direction = dir_srtp_sender;
+            } else {
+                srtp_handle_event(ctx, stream, event_ssrc_collision);
+            }
+        }
+        status = srtp_protect_icm_hmac_start(ctx, stream, rtp + i * rtp_stride,
+                                             rtp_len[i], srtp_stride, &pkt[i]);
+        if (status) {
+            break;
         }
-        return true;
     }
+    num_started = i;
 
-    /* save old extended seq */
-    old_index = stream->rtp_rdbx.index;
-    old_rtcp_rdb = stream->rtcp_rdb;
+    for (i = 0; i < num_started; i++) {
+        const uint8_t *in = rtp + i * rtp_stride;
+        uint8_t *out = srtp + i * srtp_stride;
 
-    /* remove stream */
-    data->status = srtp_stream_remove(session, ntohl(ssrc));
-    if (data->status) {
-        return false;
+        if (in != out) {
+            memcpy(out, in, pkt[i].enc_start);
+        }
+
+        iv[i].v32[0] = 0;
+        iv[i].v32[1] = ((const srtp_hdr_t *)in)->ssrc;
+        iv[i].v64[1] = be64_to_cpu(pkt[i].est << 16);
+        cipher_jobs[i].iv = (uint8_t *)&iv[i];
+        cipher_jobs[i].aad = NULL;
+        cipher_jobs[i].aad_len = 0;
+        cipher_jobs[i].src = in + pkt[i].enc_start;
+        cipher_jobs[i].src_len = pkt[i].enc_octet_len;
+        cipher_jobs[i].dst = out + pkt[i].enc_start;
+        cipher_jobs[i].dst_len = pkt[i].enc_octet_len;
+        cipher_jobs[i].status = srtp_err_status_ok;
+
+        /* the tag covers the packet and the ROC, in network byte order */
+        roc[i] = be64_to_cpu(pkt[i].est << 16);
+        auth_jobs[i].buffer = out;
+        auth_jobs[i].len = pkt[i].enc_start + pkt[i].enc_octet_len;
+        auth_jobs[i].trailer = (const uint8_t *)&roc[i];
+        auth_jobs[i].trailer_len = 4;
+        auth_jobs[i].tag = out + auth_jobs[i].len;
+        auth_jobs[i].status = srtp_err_status_ok;
+    }
+
+    if (num_started > 0) {
+        srtp_cipher_batch(session_keys->rtp_cipher, srtp_direction_encrypt,
+                          cipher_jobs, num_started);
+        srtp_auth_batch(session_keys->rtp_auth, auth_jobs, num_started);
+    }
+
+    for (i = 0; i < num_started; i++) {
+        if (cipher_jobs[i].status) {
+            status = srtp_err_status_cipher_fail;
+            break;
+        }
+        if (auth_jobs[i].status) {
+            status = auth_jobs[i].status;
+            break;
+        }
+        srtp_len[i] = auth_jobs[i].len + pkt[i].tag_len;
+        srtp_session_use_stream(ctx, stream);
     }
 
-    /* allocate and initialize a new stream */
-    data->status = srtp_stream_clone(data->new_stream_template, ssrc, &stream);
-    if (data->status) {
-        return false;
+    return status;
+}
+
+/*
+ * srtp_unprotect_burst_batch() unprotects, in place, num_pkts segments of
+ * stream, which has the compiled handlers.  The tags are computed in one
+ * batch with the indices estimated up front; each packet is then checked
+ * against the replay database and accepted in order, after the packets
+ * before it, and verified again if its index has changed since, e.g.
+ * across a ROC change.  The replay check is left to the second pass as a
+ * packet that looks too old up front may not be once the packets before
+ * it are in.  The accepted packets are decrypted in one batch.
+ */
+static void srtp_unprotect_burst_batch(srtp_t ctx,
+                                       srtp_stream_ctx_t *stream,
+                                       uint8_t *buf,
+                                       size_t stride,
+                                       const size_t seg_len[],
+                                       size_t num_pkts,
+                                       size_t rtp_len[],
+                                       srtp_err_status_t pkt_status[])
+{
+    srtp_session_keys_t *session_keys = &stream->session_keys[0];
+    srtp_icm_hmac_pkt_t pkt[SRTP_BURST_BATCH];
+    srtp_xtd_seq_num_t est[SRTP_BURST_BATCH];
+    v128_t iv[SRTP_BURST_BATCH];
+    srtp_xtd_seq_num_t roc[SRTP_BURST_BATCH];
+    uint8_t tags[SRTP_BURST_BATCH][SRTP_MAX_TAG_LEN];
+    srtp_cipher_job_t cipher_jobs[SRTP_BURST_BATCH];
+    srtp_auth_job_t auth_jobs[SRTP_BURST_BATCH];
+    size_t job[SRTP_BURST_BATCH]; /* the auth, then cipher, job of each */
+    bool computed[SRTP_BURST_BATCH];
+    srtp_err_status_t len_status[SRTP_BURST_BATCH];
+    size_t num_jobs = 0;
+    size_t i;
+
+    for (i = 0; i < num_pkts; i++) {
+        uint8_t *srtp = buf + i * stride;
+        srtp_err_status_t status;
+
+        computed[i] = false;
+        len_status[i] = srtp_unprotect_icm_hmac_lengths(
+            stream, srtp, seg_len[i], seg_len[i], &pkt[i]);
+        if (len_status[i]) {
+            continue;
+        }
+        status = srtp_get_est_pkt_index((const srtp_hdr_t *)srtp, stream,
+                                        &est[i], &pkt[i].delta);
+        if (status && status != srtp_err_status_pkt_idx_adv) {
+            continue;
+        }
+
+        computed[i] = true;
+        pkt[i].est = est[i];
+        roc[i] = be64_to_cpu(pkt[i].est << 16);
+        job[i] = num_jobs;
+        auth_jobs[num_jobs].buffer = srtp;
+        auth_jobs[num_jobs].len = pkt[i].enc_start + pkt[i].enc_octet_len;
+        auth_jobs[num_jobs].trailer = (const uint8_t *)&roc[i];
+        auth_jobs[num_jobs].trailer_len = 4;
+        auth_jobs[num_jobs].tag = tags[i];
+        auth_jobs[num_jobs].status = srtp_err_status_ok;
+        num_jobs++;
     }
 
-    /* add new stream to the head of the new_stream_list */
-    data->status = srtp_insert_or_dealloc_stream(data->new_stream_list, stream,
-                                                 data->new_stream_template);
-    if (data->status) {
-        return false;
+    if (num_jobs > 0) {
+        srtp_auth_batch(session_keys->rtp_auth, auth_jobs, num_jobs);
     }
 
-    /* restore old extended seq */
-    stream->rtp_rdbx.index = old_index;
-    stream->rtcp_rdb = old_rtcp_rdb;
+    num_jobs = 0;
+    for (i = 0; i < num_pkts; i++) {
+        uint8_t *srtp = buf + i * stride;
+        srtp_err_status_t status;
 
-    return true;
+        /* the errors come in the order srtp_unprotect() gives them */
+        status = srtp_unprotect_icm_hmac_index(stream, srtp, &pkt[i]);
+        if (status == srtp_err_status_ok) {
+            status = len_status[i];
+        }
+        if (status == srtp_err_status_ok &&
+            (!computed[i] || pkt[i].est != est[i])) {
+            status = srtp_unprotect_icm_hmac_verify(session_keys->rtp_auth,
+                                                    srtp, &pkt[i]);
+        } else if (status == srtp_err_status_ok &&
+                   (auth_jobs[job[i]].status ||
+                    !srtp_octet_string_equal(
+                        tags[i], srtp + auth_jobs[job[i]].len,
+                        pkt[i].tag_len))) {
+            status = srtp_err_status_auth_fail;
+        }
+        if (status == srtp_err_status_ok) {
+            status = srtp_icm_hmac_key_limit(ctx, stream);
+        }
+        if (status == srtp_err_status_ok) {
+            status = srtp_unprotect_icm_hmac_finish(ctx, stream, &pkt[i]);
+        }
+        pkt_status[i] = status;
+        if (status) {
+            continue;
+        }
+
+        iv[i].v32[0] = 0;
+        iv[i].v32[1] = ((const srtp_hdr_t *)srtp)->ssrc;
+        iv[i].v64[1] = be64_to_cpu(pkt[i].est << 16);
+        job[i] = num_jobs;
+        cipher_jobs[num_jobs].iv = (uint8_t *)&iv[i];
+        cipher_jobs[num_jobs].aad = NULL;
+        cipher_jobs[num_jobs].aad_len = 0;
+        cipher_jobs[num_jobs].src = srtp + pkt[i].enc_start;
+        cipher_jobs[num_jobs].src_len = pkt[i].enc_octet_len;
+        cipher_jobs[num_jobs].dst = srtp + pkt[i].enc_start;
+        cipher_jobs[num_jobs].dst_len = pkt[i].enc_octet_len;
+        cipher_jobs[num_jobs].status = srtp_err_status_ok;
+        num_jobs++;
+    }
+
+    if (num_jobs > 0) {
+        srtp_cipher_batch(session_keys->rtp_cipher, srtp_direction_decrypt,
+                          cipher_jobs, num_jobs);
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+        if (pkt_status[i] == srtp_err_status_ok &&
+            cipher_jobs[job[i]].status) {
+            /* a payload that was decrypted only in part is not handed out */
+            octet_string_set_to_zero(buf + i * stride + pkt[i].enc_start,
+                                     pkt[i].enc_octet_len);
+            pkt_status[i] = srtp_err_status_cipher_fail;
+        }
+        if (pkt_status[i]) {
+            rtp_len[i] = 0;
+            continue;
+        }
+        rtp_len[i] = pkt[i].enc_start + pkt[i].enc_octet_len;
+        srtp_session_use_stream(ctx, stream);
+    }
 }
 
-static srtp_err_status_t is_update_policy_compatable(
-    srtp_stream_t stream,
-    const srtp_policy_t *policy)
+srtp_err_status_t srtp_protect_burst(srtp_t ctx,
+                                     const uint8_t *rtp,
+                                     size_t rtp_stride,
+                                     const size_t rtp_len[],
+                                     size_t num_pkts,
+                                     uint8_t *srtp,
+                                     size_t srtp_stride,
+                                     size_t srtp_len[],
+                                     size_t mki_index)
 {
-    if (stream->use_mki != policy->use_mki) {
+    srtp_err_status_t status;
+    size_t i, n;
+
+    debug_print(mod_srtp, "function srtp_protect_burst (%zu packets)",
+                num_pkts);
+
+    if (rtp_stride == 0 || srtp_stride == 0) {
         return srtp_err_status_bad_param;
     }
 
-    if (stream->use_mki && stream->mki_size != policy->mki_size) {
+    /*
+     * packet i of the output may only overlap packet i of the input,
+     * otherwise protecting one packet would clobber the next input
+     */
+    if (rtp == srtp && rtp_stride != srtp_stride) {
         return srtp_err_status_bad_param;
     }
 
+    for (i = 0; i < num_pkts; i++) {
+        srtp_len[i] = 0;
+    }
+
+    for (i = 0; i < num_pkts; i += n) {
+        srtp_stream_ctx_t *stream = srtp_burst_stream(
+            ctx, rtp + i * rtp_stride, rtp_len[i], true);
+
+        if (stream != NULL) {
+            for (n = 1; n < SRTP_BURST_BATCH && i + n < num_pkts; n++) {
+                if (srtp_burst_stream(ctx, rtp + (i + n) * rtp_stride,
+                                      rtp_len[i + n], true) != stream) {
+                    break;
+                }
+            }
+            status = srtp_protect_burst_batch(
+                ctx, stream, rtp + i * rtp_stride, rtp_stride, &rtp_len[i], n,
+                srtp + i * srtp_stride, srtp_stride, &srtp_len[i]);
+            if (status) {
+                return status;
+            }
+            continue;
+        }
+
+        /*
+         * the slot bounds the output, so the trailer (tag and MKI) must fit
+         * between the end of the payload and the start of the next packet
+         */
+        n = 1;
+        srtp_len[i] = srtp_stride;
+        status = srtp_protect(ctx, rtp + i * rtp_stride, rtp_len[i],
+                              srtp + i * srtp_stride, &srtp_len[i], mki_index);
+        if (status) {
+            srtp_len[i] = 0;
+            return status;
+        }
+    }
+
     return srtp_err_status_ok;
 }
 
-static srtp_err_status_t update_template_streams(srtp_t session,
-                                                 const srtp_policy_t *policy)
+srtp_err_status_t srtp_unprotect_burst(srtp_t ctx,
+                                       uint8_t *buf,
+                                       size_t buf_len,
+                                       size_t stride,
+                                       size_t rtp_len[],
+                                       srtp_err_status_t pkt_status[],
+                                       size_t max_pkts,
+                                       size_t *num_pkts)
 {
-    srtp_err_status_t status;
-    srtp_stream_t new_stream_template;
-    srtp_stream_list_t new_stream_list;
+    size_t i, n;
+    size_t offset;
 
-    status = srtp_valid_policy(policy);
-    if (status != srtp_err_status_ok) {
-        return status;
-    }
+    debug_print(mod_srtp, "function srtp_unprotect_burst (%zu octets)",
+                buf_len);
 
-    if (session->stream_template == NULL) {
+    *num_pkts = 0;
+
+    if (stride == 0) {
         return srtp_err_status_bad_param;
     }
 
-    status = is_update_policy_compatable(session->stream_template, policy);
-    if (status != srtp_err_status_ok) {
-        return status;
+    /* all segments but the last one are exactly stride octets long */
+    if ((buf_len + stride - 1) / stride > max_pkts) {
+        return srtp_err_status_buffer_small;
     }
 
-    /* allocate new template stream  */
-    status = srtp_stream_alloc(&new_stream_template, policy);
-    if (status) {
-        return status;
+    /* the length of each segment is in rtp_len until it is processed */
+    for (i = 0, offset = 0; offset < buf_len; i++, offset += stride) {
+        rtp_len[i] = buf_len - offset > stride ? stride : buf_len - offset;
     }
+    *num_pkts = i;
 
-    /* initialize new template stream  */
-    status = srtp_stream_init(new_stream_template, policy);
-    if (status) {
-        srtp_crypto_free(new_stream_template);
-        return status;
-    }
+    for (i = 0; i < *num_pkts; i += n) {
+        size_t seg_len[SRTP_BURST_BATCH];
+        srtp_stream_ctx_t *stream =
+            srtp_burst_stream(ctx, buf + i * stride, rtp_len[i], false);
 
-    /* allocate new stream list */
-    status = srtp_stream_list_alloc(&new_stream_list);
-    if (status) {
-        srtp_crypto_free(new_stream_template);
-        return status;
-    }
+        if (stream != NULL) {
+            seg_len[0] = rtp_len[i];
+            for (n = 1; n < SRTP_BURST_BATCH && i + n < *num_pkts; n++) {
+                if (srtp_burst_stream(ctx, buf + (i + n) * stride,
+                                      rtp_len[i + n], false) != stream) {
+                    break;
+                }
+                seg_len[n] = rtp_len[i + n];
+            }
+            srtp_unprotect_burst_batch(ctx, stream, buf + i * stride, stride,
+                                       seg_len, n, &rtp_len[i],
+                                       &pkt_status[i]);
+            continue;
+        }
 
-    /* process streams */
-    struct update_template_stream_data data = { srtp_err_status_ok, session,
-                                                new_stream_template,
-                                                new_stream_list };
-    srtp_stream_list_for_each(session->stream_list, update_template_stream_cb,
-                              &data);
-    if (data.status) {
-        /* free new allocations */
-        srtp_remove_and_dealloc_streams(new_stream_list, new_stream_template);
-        srtp_stream_list_dealloc(new_stream_list);
-        srtp_stream_dealloc(new_stream_template, NULL);
-        return data.status;
+        n = 1;
+        pkt_status[i] = srtp_unprotect(ctx, buf + i * stride, rtp_len[i],
+                                       buf + i * stride, &rtp_len[i]);
+        if (pkt_status[i]) {
+            rtp_len[i] = 0;
+        }
     }
 
-    /* dealloc old list / template */
-    srtp_remove_and_dealloc_streams(session->stream_list,
-                                    session->stream_template);
-    srtp_stream_list_dealloc(session->stream_list);
-    srtp_stream_dealloc(session->stream_template, NULL);
-
-    /* set new list / template */
-    session->stream_template = new_stream_template;
-    session->stream_list = new_stream_list;
     return srtp_err_status_ok;
 }
 
-static srtp_err_status_t stream_update(srtp_t session,
-                                       const srtp_policy_t *policy)
+srtp_err_status_t srtp_init(void)
 {
     srtp_err_status_t status;
-    srtp_xtd_seq_num_t old_index;
-    srtp_rdb_t old_rtcp_rdb;
-    srtp_stream_t stream;
 
-    status = srtp_valid_policy(policy);
-    if (status != srtp_err_status_ok) {
+    /* initialize crypto kernel */
+    status = srtp_crypto_kernel_init();
+    if (status) {
         return status;
     }
 
-    stream = srtp_get_stream(session, htonl(policy->ssrc.value));
-    if (stream == NULL) {
-        return srtp_err_status_bad_param;
-    }
-
-    status = is_update_policy_compatable(stream, policy);
-    if (status != srtp_err_status_ok) {
+    /* load srtp debug module into the kernel */
+    status = srtp_crypto_kernel_load_debug_module(&mod_srtp);
+    if (status) {
         return status;
     }
 
-    /* save old extendard seq */
-    old_index = stream->rtp_rdbx.index;
-    old_rtcp_rdb = stream->rtcp_rdb;
+    return srtp_err_status_ok;
+}
 
-    status = srtp_stream_remove(session, policy->ssrc.value);
-    if (status) {
-        return status;
-    }
+srtp_err_status_t srtp_shutdown(void)
+{
+    srtp_err_status_t status;
 
-    status = srtp_stream_add(session, policy);
+    /* shut down crypto kernel */
+    status = srtp_crypto_kernel_shutdown();
     if (status) {
         return status;
     }
 
-    stream = srtp_get_stream(session, htonl(policy->ssrc.value));
-    if (stream == NULL) {
-        return srtp_err_status_fail;
-    }
-
-    /* restore old extended seq */
-    stream->rtp_rdbx.index = old_index;
-    stream->rtcp_rdb = old_rtcp_rdb;
+    /* shutting down crypto kernel frees the srtp debug module as well */
 
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_stream_update(srtp_t session,
-                                     const srtp_policy_t *policy)
+void srtp_set_deferred_self_tests(bool defer)
+{
+    srtp_crypto_kernel_set_deferred_self_tests(defer);
+}
+
+srtp_err_status_t srtp_self_test(void)
+{
+    return srtp_crypto_kernel_self_test();
+}
+
+srtp_stream_ctx_t *srtp_get_stream(srtp_t srtp, uint32_t ssrc)
+{
+    return srtp_stream_list_get(srtp->stream_list, ssrc);
+}
+
+srtp_err_status_t srtp_dealloc(srtp_t session)
 {
     srtp_err_status_t status;
 
-    /* sanity check arguments */
-    if (session == NULL) {
-        return srtp_err_status_bad_param;
+    /*
+     * we take a conservative deallocation strategy - if we encounter an
+     * error deallocating a stream, then we stop trying to deallocate
+     * memory and just return an error
+     */
+
+    /* wait for the packets in a worker pool, and detach from it */
+    status = srtp_set_worker_pool(session, NULL);
+    if (status) {
+        return status;
     }
 
-    status = srtp_valid_policy(policy);
-    if (status != srtp_err_status_ok) {
+    /* deallocate streams */
+    status = srtp_remove_and_dealloc_streams(session->stream_list,
+                                             session->stream_template);
+    if (status) {
         return status;
     }
 
-    switch (policy->ssrc.type) {
+    status = srtp_session_drop_spare_streams(session);
+    if (status) {
+        return status;
+    }
+    srtp_crypto_free(session->spare_streams);
+    session->spare_streams = NULL;
+    session->reserved_streams = 0;
+
+    /* deallocate stream template, if there is one */
+    if (session->stream_template != NULL) {
+        status = srtp_stream_dealloc(session->stream_template, NULL);
+        if (status) {
+            return status;
+        }
+    }
+
+    /* deallocate stream list */
+    status = srtp_stream_list_dealloc(session->stream_list);
+    if (status) {
+        return status;
+    }
+
+    srtp_kdf_cache_dealloc(session->kdf_cache);
+    srtp_crypto_free(session->event_queue);
+
+    /* deallocate session context */
+    srtp_crypto_free(session);
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_stream_add(srtp_t session, const srtp_policy_t *policy)
+{
+    srtp_err_status_t status;
+    srtp_stream_t tmp;
+
+    /* sanity check arguments */
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    status = srtp_valid_policy(policy);
+    if (status != srtp_err_status_ok) {
+        return status;
+    }
+
+    /* allocate stream  */
+    status = srtp_stream_alloc(&tmp, policy);
+    if (status) {
+        return status;
+    }
+    tmp->keep_derived = session->serializable;
+
+    /* initialize stream  */
+    status = srtp_stream_init(tmp, policy, srtp_session_kdf_cache(session));
+    if (status) {
+        srtp_stream_dealloc(tmp, NULL);
+        return status;
+    }
+
+    /*
+     * set the head of the stream list or the template to point to the
+     * stream that we've just alloced and init'ed, depending on whether
+     * or not it has a wildcard SSRC value or not
+     *
+     * if the template stream has already been set, then the policy is
+     * inconsistent, so we return a bad_param error code
+     */
+    switch (policy->ssrc.type) {
     case (ssrc_any_outbound):
+        if (session->stream_template) {
+            srtp_stream_dealloc(tmp, NULL);
+            return srtp_err_status_bad_param;
+        }
+        session->stream_template = tmp;
+        session->stream_template->direction = dir_srtp_sender;
+        break;
     case (ssrc_any_inbound):
-        status = update_template_streams(session, policy);
+        if (session->stream_template) {
+            srtp_stream_dealloc(tmp, NULL);
+            return srtp_err_status_bad_param;
+        }
+        session->stream_template = tmp;
+        session->stream_template->direction = dir_srtp_receiver;
         break;
     case (ssrc_specific):
-        status = stream_update(session, policy);
+        status = srtp_insert_or_dealloc_stream(session->stream_list, tmp,
+                                               session->stream_template);
+        if (status) {
+            return status;
+        }
         break;
     case (ssrc_undefined):
     default:
+        srtp_stream_dealloc(tmp, NULL);
         return srtp_err_status_bad_param;
     }
 
-    return status;
+    /* keep the room and spare clones that the session reserved */
+    return srtp_session_fill_spare_streams(session);
 }
 
-/*
- * The default policy - provides a convenient way for callers to use
- * the default security policy
- *
- * The default policy is defined in RFC 3711
- * (Section 5. Default and mandatory-to-implement Transforms)
- *
- */
+srtp_err_status_t srtp_create(srtp_t *session, /* handle for session     */
+                              const srtp_policy_t *policy)
+{ /* SRTP policy (list)     */
+    srtp_err_status_t stat;
+    srtp_ctx_t *ctx;
 
-/*
- * NOTE: cipher_key_len is really key len (128 bits) plus salt len
- *  (112 bits)
- */
-/* There are hard-coded 16's for base_key_len in the key generation code */
+    /* sanity check arguments */
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
 
-void srtp_crypto_policy_set_rtp_default(srtp_crypto_policy_t *p)
-{
-    p->cipher_type = SRTP_AES_ICM_128;
-    p->cipher_key_len =
-        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* default 128 bits per RFC 3711 */
-    p->auth_type = SRTP_HMAC_SHA1;
-    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
-    p->auth_tag_len = 10; /* default 80 bits per RFC 3711 */
-    p->sec_serv = sec_serv_conf_and_auth;
-}
+    if (policy) {
+        stat = srtp_valid_policy(policy);
+        if (stat != srtp_err_status_ok) {
+            return stat;
+        }
+    }
 
-void srtp_crypto_policy_set_rtcp_default(srtp_crypto_policy_t *p)
-{
-    p->cipher_type = SRTP_AES_ICM_128;
-    p->cipher_key_len =
-        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* default 128 bits per RFC 3711 */
-    p->auth_type = SRTP_HMAC_SHA1;
-    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
-    p->auth_tag_len = 10; /* default 80 bits per RFC 3711 */
-    p->sec_serv = sec_serv_conf_and_auth;
-}
+    /* allocate srtp context and set ctx_ptr */
+    ctx = (srtp_ctx_t *)srtp_crypto_alloc(sizeof(srtp_ctx_t));
+    if (ctx == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    *session = ctx;
 
-void srtp_crypto_policy_set_aes_cm_128_hmac_sha1_32(srtp_crypto_policy_t *p)
-{
-    /*
-     * corresponds to RFC 4568
-     *
-     * note that this crypto policy is intended for SRTP, but not SRTCP
-     */
+    ctx->stream_template = NULL;
+    ctx->stream_list = NULL;
+    ctx->user_data = NULL;
 
-    p->cipher_type = SRTP_AES_ICM_128;
-    p->cipher_key_len =
-        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* 128 bit key, 112 bit salt */
-    p->auth_type = SRTP_HMAC_SHA1;
-    p->auth_key_len = 20; /* 160 bit key               */
-    p->auth_tag_len = 4;  /* 32 bit tag                */
-    p->sec_serv = sec_serv_conf_and_auth;
-}
+    /* allocate stream list */
+    stat = srtp_stream_list_alloc(&ctx->stream_list);
+    if (stat) {
+        /* clean up everything */
+        srtp_dealloc(*session);
+        *session = NULL;
+        return stat;
+    }
 
-void srtp_crypto_policy_set_aes_cm_128_null_auth(srtp_crypto_policy_t *p)
-{
     /*
-     * corresponds to RFC 4568
-     *
-     * note that this crypto policy is intended for SRTP, but not SRTCP
+     * loop over elements in the policy list, allocating and
+     * initializing a stream for each element
      */
+    while (policy != NULL) {
+        stat = srtp_stream_add(ctx, policy);
+        if (stat) {
+            /* clean up everything */
+            srtp_dealloc(*session);
+            *session = NULL;
+            return stat;
+        }
 
-    p->cipher_type = SRTP_AES_ICM_128;
-    p->cipher_key_len =
-        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* 128 bit key, 112 bit salt */
-    p->auth_type = SRTP_NULL_AUTH;
-    p->auth_key_len = 0;
-    p->auth_tag_len = 0;
-    p->sec_serv = sec_serv_conf;
+        /* set policy to next item in list  */
+        policy = policy->next;
+    }
+
+    return srtp_err_status_ok;
 }
 
-void srtp_crypto_policy_set_null_cipher_hmac_sha1_80(srtp_crypto_policy_t *p)
+srtp_err_status_t srtp_stream_remove(srtp_t session, uint32_t ssrc)
 {
-    /*
-     * corresponds to RFC 4568
-     */
+    srtp_stream_ctx_t *stream;
+    srtp_err_status_t status;
 
-    p->cipher_type = SRTP_NULL_CIPHER;
-    p->cipher_key_len =
-        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* 128 bit key, 112 bit salt */
-    p->auth_type = SRTP_HMAC_SHA1;
-    p->auth_key_len = 20;
-    p->auth_tag_len = 10;
-    p->sec_serv = sec_serv_auth;
-}
+    /* sanity check arguments */
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
 
-void srtp_crypto_policy_set_null_cipher_hmac_null(srtp_crypto_policy_t *p)
-{
-    /*
-     * Should only be used for testing
-     */
+    /* find and remove stream from the list */
+    stream = srtp_stream_list_get(session->stream_list, htonl(ssrc));
+    if (stream == NULL) {
+        return srtp_err_status_no_ctx;
+    }
 
-    p->cipher_type = SRTP_NULL_CIPHER;
-    p->cipher_key_len = 0;
-    p->auth_type = SRTP_NULL_AUTH;
-    p->auth_key_len = 0;
-    p->auth_tag_len = 0;
-    p->sec_serv = sec_serv_none;
+    srtp_stream_list_remove(session->stream_list, stream);
+
+    /* deallocate the stream, or keep it as a spare */
+    status = srtp_session_release_stream(session, stream);
+    if (status) {
+        return status;
+    }
+
+    srtp_session_kdf_cache_purge(session);
+
+    return srtp_err_status_ok;
 }
 
-void srtp_crypto_policy_set_aes_cm_256_hmac_sha1_80(srtp_crypto_policy_t *p)
+srtp_err_status_t srtp_set_max_streams(srtp_t session, size_t max_streams)
 {
-    /*
-     * corresponds to RFC 6188
-     */
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
 
-    p->cipher_type = SRTP_AES_ICM_256;
-    p->cipher_key_len = SRTP_AES_ICM_256_KEY_LEN_WSALT;
-    p->auth_type = SRTP_HMAC_SHA1;
-    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
-    p->auth_tag_len = 10; /* default 80 bits per RFC 3711 */
-    p->sec_serv = sec_serv_conf_and_auth;
+    session->max_streams = max_streams;
+
+    return srtp_err_status_ok;
 }
 
-void srtp_crypto_policy_set_aes_cm_256_hmac_sha1_32(srtp_crypto_policy_t *p)
+srtp_err_status_t srtp_reserve_streams(srtp_t session, size_t num_streams)
 {
-    /*
-     * corresponds to RFC 6188
-     *
-     * note that this crypto policy is intended for SRTP, but not SRTCP
-     */
+    srtp_stream_ctx_t **spare_streams = NULL;
 
-    p->cipher_type = SRTP_AES_ICM_256;
-    p->cipher_key_len = SRTP_AES_ICM_256_KEY_LEN_WSALT;
-    p->auth_type = SRTP_HMAC_SHA1;
-    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
-    p->auth_tag_len = 4;  /* default 80 bits per RFC 3711 */
-    p->sec_serv = sec_serv_conf_and_auth;
-}
+    if (session == NULL ||
+        num_streams > SIZE_MAX / sizeof(srtp_stream_ctx_t *)) {
+        return srtp_err_status_bad_param;
+    }
 
-/*
- * AES-256 with no authentication.
- */
-void srtp_crypto_policy_set_aes_cm_256_null_auth(srtp_crypto_policy_t *p)
-{
-    p->cipher_type = SRTP_AES_ICM_256;
-    p->cipher_key_len = SRTP_AES_ICM_256_KEY_LEN_WSALT;
-    p->auth_type = SRTP_NULL_AUTH;
-    p->auth_key_len = 0;
-    p->auth_tag_len = 0;
-    p->sec_serv = sec_serv_conf;
-}
+    /* keep at most num_streams of the spare clones there are */
+    while (session->num_spare_streams > num_streams) {
+        srtp_err_status_t status = srtp_stream_dealloc(
+            session->spare_streams[--session->num_spare_streams],
+            session->stream_template);
+        if (status) {
+            return status;
+        }
+    }
 
-void srtp_crypto_policy_set_aes_cm_192_hmac_sha1_80(srtp_crypto_policy_t *p)
-{
-    /*
-     * corresponds to RFC 6188
-     */
+    if (num_streams > 0) {
+        spare_streams = (srtp_stream_ctx_t **)srtp_crypto_alloc(
+            sizeof(srtp_stream_ctx_t *) * num_streams);
+        if (spare_streams == NULL) {
+            return srtp_err_status_alloc_fail;
+        }
+        if (session->num_spare_streams > 0) {
+            memcpy(spare_streams, session->spare_streams,
+                   sizeof(srtp_stream_ctx_t *) * session->num_spare_streams);
+        }
+    }
+    srtp_crypto_free(session->spare_streams);
+    session->spare_streams = spare_streams;
+    session->reserved_streams = num_streams;
 
-    p->cipher_type = SRTP_AES_ICM_192;
-    p->cipher_key_len = SRTP_AES_ICM_192_KEY_LEN_WSALT;
-    p->auth_type = SRTP_HMAC_SHA1;
-    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
-    p->auth_tag_len = 10; /* default 80 bits per RFC 3711 */
-    p->sec_serv = sec_serv_conf_and_auth;
+    return srtp_session_fill_spare_streams(session);
 }
 
-void srtp_crypto_policy_set_aes_cm_192_hmac_sha1_32(srtp_crypto_policy_t *p)
+srtp_err_status_t srtp_set_no_packet_alloc(srtp_t session, bool no_alloc)
 {
-    /*
-     * corresponds to RFC 6188
-     *
-     * note that this crypto policy is intended for SRTP, but not SRTCP
-     */
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
 
-    p->cipher_type = SRTP_AES_ICM_192;
-    p->cipher_key_len = SRTP_AES_ICM_192_KEY_LEN_WSALT;
-    p->auth_type = SRTP_HMAC_SHA1;
-    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
-    p->auth_tag_len = 4;  /* default 80 bits per RFC 3711 */
-    p->sec_serv = sec_serv_conf_and_auth;
-}
+    session->no_packet_alloc = no_alloc;
 
-/*
- * AES-192 with no authentication.
- */
-void srtp_crypto_policy_set_aes_cm_192_null_auth(srtp_crypto_policy_t *p)
-{
-    p->cipher_type = SRTP_AES_ICM_192;
-    p->cipher_key_len = SRTP_AES_ICM_192_KEY_LEN_WSALT;
-    p->auth_type = SRTP_NULL_AUTH;
-    p->auth_key_len = 0;
-    p->auth_tag_len = 0;
-    p->sec_serv = sec_serv_conf;
+    return srtp_err_status_ok;
 }
 
-/*
- * AES-128 GCM mode with 16 octet auth tag.
- */
-void srtp_crypto_policy_set_aes_gcm_128_16_auth(srtp_crypto_policy_t *p)
+srtp_err_status_t srtp_set_serializable(srtp_t session, bool serializable)
 {
-    p->cipher_type = SRTP_AES_GCM_128;
-    p->cipher_key_len = SRTP_AES_GCM_128_KEY_LEN_WSALT;
-    p->auth_type = SRTP_NULL_AUTH; /* GCM handles the auth for us */
-    p->auth_key_len = 0;
-    p->auth_tag_len = 16; /* 16 octet tag length */
-    p->sec_serv = sec_serv_conf_and_auth;
-}
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
 
-/*
- * AES-256 GCM mode with 16 octet auth tag.
- */
-void srtp_crypto_policy_set_aes_gcm_256_16_auth(srtp_crypto_policy_t *p)
-{
-    p->cipher_type = SRTP_AES_GCM_256;
-    p->cipher_key_len = SRTP_AES_GCM_256_KEY_LEN_WSALT;
-    p->auth_type = SRTP_NULL_AUTH; /* GCM handles the auth for us */
-    p->auth_key_len = 0;
-    p->auth_tag_len = 16; /* 16 octet tag length */
-    p->sec_serv = sec_serv_conf_and_auth;
+    session->serializable = serializable;
+
+    return srtp_err_status_ok;
 }
 
-/*
- * secure rtcp functions
- */
+struct expire_idle_streams_data {
+    srtp_t session;
+    uint64_t now;
+    uint64_t idle;
+    srtp_err_status_t status;
+};
 
-/*
- * AEAD uses a new IV formation method.  This function implements
- * section 9.1 (SRTCP IV Formation for AES-GCM) from RFC7714.
- * The calculation is defined as, where (+) is the xor operation:
- *
- *                0  1  2  3  4  5  6  7  8  9 10 11
- *               +--+--+--+--+--+--+--+--+--+--+--+--+
- *               |00|00|    SSRC   |00|00|0+SRTCP Idx|---+
- *               +--+--+--+--+--+--+--+--+--+--+--+--+   |
- *                                                       |
- *               +--+--+--+--+--+--+--+--+--+--+--+--+   |
- *               |         Encryption Salt           |->(+)
- *               +--+--+--+--+--+--+--+--+--+--+--+--+   |
- *                                                       |
- *               +--+--+--+--+--+--+--+--+--+--+--+--+   |
- *               |       Initialization Vector       |<--+
- *               +--+--+--+--+--+--+--+--+--+--+--+--+*
- *
- * Input:  *session_keys - pointer to SRTP stream context session keys,
- *                        used to retrieve the SALT
- *         *iv           - Pointer to recieve the calculated IV
- *         seq_num       - The SEQ value to use for the IV calculation.
- *         *hdr          - The RTP header, used to get the SSRC value
- *
- * Returns: srtp_err_status_ok if no error or srtp_err_status_bad_param
- *          if seq_num is invalid
- *
- */
-static srtp_err_status_t srtp_calc_aead_iv_srtcp(
-    srtp_session_keys_t *session_keys,
-    v128_t *iv,
-    uint32_t seq_num,
-    const srtcp_hdr_t *hdr)
+static bool expire_idle_streams_cb(srtp_stream_t stream, void *raw_data)
 {
-    v128_t in;
-    v128_t salt;
-
-    memset(&in, 0, sizeof(v128_t));
-    memset(&salt, 0, sizeof(v128_t));
+    struct expire_idle_streams_data *data =
+        (struct expire_idle_streams_data *)raw_data;
+    srtp_t session = data->session;
 
-    in.v16[0] = 0;
-    memcpy(&in.v16[1], &hdr->ssrc, 4); /* still in network order! */
-    in.v16[3] = 0;
+    if (!srtp_stream_shares_template_keys(session, stream)) {
+        return true;
+    }
 
     /*
-     *  The SRTCP index (seq_num) spans bits 0 through 30 inclusive.
-     *  The most significant bit should be zero.
+     * a stream that has been used since the last call was last used no
+     * later than now; any other stream was last used no later than the
+     * time it was given then
      */
-    if (seq_num & 0x80000000UL) {
-        return srtp_err_status_bad_param;
+    if (stream->last_used == session->clock) {
+        stream->last_used = data->now;
+        return true;
     }
-    in.v32[2] = htonl(seq_num);
-
-    debug_print(mod_srtp, "Pre-salted RTCP IV = %s\n", v128_hex_string(&in));
 
-    /*
-     * Get the SALT value from the context
-     */
-    memcpy(salt.v8, session_keys->c_salt, 12);
-    debug_print(mod_srtp, "RTCP SALT = %s\n", v128_hex_string(&salt));
+    if (stream->last_used > data->now ||
+        data->now - stream->last_used < data->idle) {
+        return true;
+    }
 
-    /*
-     * Finally, apply the SALT to the input
-     */
-    v128_xor(iv, &in, &salt);
+    debug_print(mod_srtp, "expiring idle stream (SSRC: 0x%08x)",
+                (unsigned int)ntohl(stream->ssrc));
 
-    return srtp_err_status_ok;
+    srtp_stream_list_remove(session->stream_list, stream);
+    data->status = srtp_session_release_stream(session, stream);
+    return data->status == srtp_err_status_ok;
 }
 
-/*
- * This code handles AEAD ciphers for outgoing RTCP.  We currently support
- * AES-GCM mode with 128 or 256 bit keys.
- */
-static srtp_err_status_t srtp_protect_rtcp_aead(
-    srtp_stream_ctx_t *stream,
-    const uint8_t *rtcp,
-    size_t rtcp_len,
-    uint8_t *srtcp,
-    size_t *srtcp_len,
-    srtp_session_keys_t *session_keys)
+srtp_err_status_t srtp_expire_idle_streams(srtp_t session,
+                                           uint64_t now,
+                                           uint64_t idle)
 {
-    const srtcp_hdr_t *hdr = (const srtcp_hdr_t *)rtcp;
-    size_t enc_start;         /* pointer to start of encrypted portion  */
-    uint8_t *trailer_p;       /* pointer to start of trailer            */
-    uint32_t trailer;         /* trailer value                          */
-    size_t enc_octet_len = 0; /* number of octets in encrypted portion  */
-    srtp_err_status_t status;
-    size_t tag_len;
-    uint32_t seq_num;
-    v128_t iv;
+    struct expire_idle_streams_data data;
 
-    /* get tag length from stream context */
-    tag_len = srtp_auth_get_tag_length(session_keys->rtcp_auth);
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    data.session = session;
+    data.now = now;
+    data.idle = idle;
+    data.status = srtp_err_status_ok;
+    srtp_stream_list_for_each(session->stream_list, expire_idle_streams_cb,
+                              &data);
 
     /*
-     * set encryption start and encryption length - if we're not
-     * providing confidentiality, set enc_start to NULL
+     * packets from now on mark their streams with a time after now, which
+     * no stream has been given yet
      */
-    enc_start = octets_in_rtcp_header;
-    enc_octet_len = rtcp_len - enc_start;
+    session->clock = now + 1;
 
-    /* check output length */
-    if (*srtcp_len <
-        rtcp_len + sizeof(srtcp_trailer_t) + stream->mki_size + tag_len) {
-        return srtp_err_status_buffer_small;
+    return data.status;
+}
+
+struct update_template_stream_data {
+    srtp_err_status_t status;
+    srtp_t session;
+    srtp_stream_t new_stream_template;
+    srtp_stream_list_t new_stream_list;
+};
+
+static bool update_template_stream_cb(srtp_stream_t stream, void *raw_data)
+{
+    struct update_template_stream_data *data =
+        (struct update_template_stream_data *)raw_data;
+    srtp_t session = data->session;
+    uint32_t ssrc = stream->ssrc;
+    srtp_xtd_seq_num_t old_index;
+    srtp_xtd_seq_num_t old_inner_index;
+    uint64_t old_last_used;
+    srtp_stream_ctx_t *lru_prev = stream->lru_prev;
+    srtp_rdb_t old_rtcp_rdb;
+    srtp_rdbx_atomic_t *shared_rdbx;
+
+    /* old / non-template streams are copied unchanged */
+    if (stream->session_keys[0].rtp_auth !=
+        session->stream_template->session_keys[0].rtp_auth) {
+        srtp_stream_list_remove(session->stream_list, stream);
+        data->status = srtp_insert_or_dealloc_stream(
+            data->new_stream_list, stream, session->stream_template);
+        if (data->status) {
+            return false;
+        }
+        return true;
     }
 
-    /* if not-inplace then need to copy full rtcp header */
-    if (rtcp != srtcp) {
-        memcpy(srtcp, rtcp, enc_start);
+    /* save old extended seq */
+    old_index = stream->rtp_rdbx.index;
+    old_inner_index = stream->inner ? stream->inner->rtp_rdbx.index : 0;
+    old_last_used = stream->last_used;
+    data->status = srtp_rdb_init(&old_rtcp_rdb,
+                                 srtp_rdb_get_window_size(&stream->rtcp_rdb));
+    if (data->status) {
+        return false;
     }
+    srtp_rdb_copy(&old_rtcp_rdb, &stream->rtcp_rdb);
 
-    /* NOTE: hdr->length is not usable - it refers to only the first
-     * RTCP report in the compound packet!
-     */
-    trailer_p = srtcp + enc_start + enc_octet_len + tag_len;
+    /* take over the reference to a shared replay window */
+    shared_rdbx = stream->shared_rdbx;
+    stream->shared_rdbx = NULL;
 
-    if (stream->rtcp_services & sec_serv_conf) {
-        trailer = htonl(SRTCP_E_BIT); /* set encrypt bit */
-    } else {
-        /* 0 is network-order independent */
-        trailer = 0x00000000; /* set encrypt bit */
+    /* remove stream */
+    data->status = srtp_stream_remove(session, ntohl(ssrc));
+    if (data->status) {
+        srtp_rdb_dealloc(&old_rtcp_rdb);
+        srtp_rdbx_atomic_release(shared_rdbx);
+        return false;
     }
 
-    if (stream->use_mki) {
-        srtp_inject_mki(srtcp + rtcp_len + tag_len + sizeof(srtcp_trailer_t),
-                        session_keys, stream->mki_size);
+    /* allocate and initialize a new stream */
+    data->status = srtp_stream_clone(data->new_stream_template, ssrc, &stream);
+    if (data->status) {
+        srtp_rdb_dealloc(&old_rtcp_rdb);
+        srtp_rdbx_atomic_release(shared_rdbx);
+        return false;
     }
 
-    /*
-     * check sequence number for overruns, and copy it into the packet
-     * if its value isn't too big
-     */
-    status = srtp_rdb_increment(&stream->rtcp_rdb);
-    if (status) {
-        return status;
+    /* add new stream to the head of the new_stream_list */
+    data->status = srtp_insert_or_dealloc_stream(data->new_stream_list, stream,
+                                                 data->new_stream_template);
+    if (data->status) {
+        srtp_rdb_dealloc(&old_rtcp_rdb);
+        srtp_rdbx_atomic_release(shared_rdbx);
+        return false;
     }
-    seq_num = srtp_rdb_get_value(&stream->rtcp_rdb);
-    trailer |= htonl(seq_num);
-    debug_print(mod_srtp, "srtcp index: %x", (unsigned int)seq_num);
 
-    memcpy(trailer_p, &trailer, sizeof(trailer));
+    /* restore old extended seq */
+    stream->rtp_rdbx.index = old_index;
+    if (stream->inner) {
+        stream->inner->rtp_rdbx.index = old_inner_index;
+    }
+    srtp_rdb_copy(&stream->rtcp_rdb, &old_rtcp_rdb);
+    srtp_rdb_dealloc(&old_rtcp_rdb);
+    stream->shared_rdbx = shared_rdbx;
+    stream->last_used = old_last_used;
 
-    /*
-     * Calculate and set the IV
-     */
-    status = srtp_calc_aead_iv_srtcp(session_keys, &iv, seq_num, hdr);
-    if (status) {
-        return srtp_err_status_cipher_fail;
+    /* the new clone takes the place of the old one in the LRU order */
+    srtp_session_lru_link(session, lru_prev, stream);
+
+    return true;
+}
+
+static srtp_err_status_t is_update_policy_compatable(
+    srtp_stream_t stream,
+    const srtp_policy_t *policy)
+{
+    if (stream->use_mki != policy->use_mki) {
+        return srtp_err_status_bad_param;
     }
-    status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
-                                srtp_direction_encrypt);
-    if (status) {
-        return srtp_err_status_cipher_fail;
+
+    if (stream->use_mki && stream->mki_size != policy->mki_size) {
+        return srtp_err_status_bad_param;
     }
 
-    /*
-     * Set the AAD for GCM mode
-     */
-    if (stream->rtcp_services & sec_serv_conf) {
-        /*
-         * If payload encryption is enabled, then the AAD consist of
-         * the RTCP header and the seq# at the end of the packet
-         */
-        status = srtp_cipher_set_aad(session_keys->rtcp_cipher, rtcp,
-                                     octets_in_rtcp_header);
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_stream_can_rekey(stream, policy) returns true if policy differs
+ * from the one stream was created with only in its keys, security
+ * services and flags, so that the stream can be rekeyed in place: the
+ * ciphers, auth functions and replay windows it has are all of the right
+ * type and size
+ */
+static bool srtp_stream_can_rekey(const srtp_stream_ctx_t *stream,
+                                  const srtp_policy_t *p)
+{
+    const srtp_session_keys_t *session_keys = &stream->session_keys[0];
+    size_t num_master_keys = p->key != NULL ? 1 : p->num_master_keys;
+    size_t enc_xtn_hdr_count = p->enc_xtn_hdr ? p->enc_xtn_hdr_count : 0;
+    size_t window_size = p->window_size != 0 ? p->window_size : 128;
+    size_t rtcp_window_size =
+        p->rtcp_window_size != 0 ? p->rtcp_window_size : 128;
+    bool is_double = srtp_policy_is_double(&p->rtp);
+    /* the outer stream of a double policy has half of its cipher key */
+    size_t rtp_key_len =
+        is_double ? p->rtp.cipher_key_len / 2 : p->rtp.cipher_key_len;
+    size_t rtcp_key_len = srtp_policy_is_double(&p->rtcp)
+                              ? p->rtcp.cipher_key_len / 2
+                              : p->rtcp.cipher_key_len;
+
+    if (is_double != (stream->inner != NULL)) {
+        return false;
+    }
+
+    /* the MKIs are written into the buffers the stream has for them */
+    if (num_master_keys != stream->num_master_keys ||
+        (p->key == NULL && p->use_mki) != stream->use_mki ||
+        (stream->use_mki && p->mki_size != stream->mki_size) ||
+        window_size != srtp_rdbx_get_window_size(&stream->rtp_rdbx) ||
+        rtcp_window_size != srtp_rdb_get_window_size(&stream->rtcp_rdb)) {
+        return false;
+    }
+
+    if (session_keys->rtp_cipher->type->id != p->rtp.cipher_type ||
+        srtp_cipher_get_key_length(session_keys->rtp_cipher) != rtp_key_len ||
+        session_keys->rtp_auth->type->id != p->rtp.auth_type ||
+        srtp_auth_get_key_length(session_keys->rtp_auth) !=
+            p->rtp.auth_key_len ||
+        srtp_auth_get_tag_length(session_keys->rtp_auth) !=
+            p->rtp.auth_tag_len) {
+        return false;
+    }
+
+    if (session_keys->rtcp_cipher->type->id != p->rtcp.cipher_type ||
+        srtp_cipher_get_key_length(session_keys->rtcp_cipher) !=
+            rtcp_key_len ||
+        session_keys->rtcp_auth->type->id != p->rtcp.auth_type ||
+        srtp_auth_get_key_length(session_keys->rtcp_auth) !=
+            p->rtcp.auth_key_len ||
+        srtp_auth_get_tag_length(session_keys->rtcp_auth) !=
+            p->rtcp.auth_tag_len) {
+        return false;
+    }
+
+    if (enc_xtn_hdr_count != stream->enc_xtn_hdr_count ||
+        (enc_xtn_hdr_count > 0 &&
+         memcmp(p->enc_xtn_hdr, stream->enc_xtn_hdr,
+                enc_xtn_hdr_count * sizeof(p->enc_xtn_hdr[0])) != 0)) {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * srtp_stream_rekey_t holds the session keys derived for every master key
+ * of a stream, and of its inner stream for a double policy, until they
+ * are installed
+ */
+typedef struct srtp_stream_rekey_t {
+    srtp_double_policy_t d;
+    const srtp_policy_t *outer;
+    srtp_kdf_output_t outer_output[SRTP_MAX_NUM_MASTER_KEYS];
+    srtp_kdf_output_t inner_output[SRTP_MAX_NUM_MASTER_KEYS];
+} srtp_stream_rekey_t;
+
+/*
+ * srtp_policy_master_key(p, i, single) returns master key i of policy p;
+ * single describes the key of a policy that has a single one
+ */
+static const srtp_master_key_t *srtp_policy_master_key(
+    const srtp_policy_t *p,
+    size_t i,
+    srtp_master_key_t *single)
+{
+    if (p->key != NULL) {
+        single->key = p->key;
+        single->mki_id = NULL;
+        return single;
+    }
+
+    return p->keys[i];
+}
+
+/*
+ * srtp_stream_rekey_derive(stream, policy, kdf_cache, output) runs the key
+ * derivation for each master key of policy into output, without touching
+ * stream
+ */
+static srtp_err_status_t srtp_stream_rekey_derive(
+    const srtp_stream_ctx_t *stream,
+    const srtp_policy_t *p,
+    srtp_kdf_cache_t *kdf_cache,
+    srtp_kdf_output_t output[])
+{
+    srtp_master_key_t single;
+    srtp_kdf_profile_t profile;
+    srtp_err_status_t status;
+
+    for (size_t i = 0; i < stream->num_master_keys; i++) {
+        const srtp_master_key_t *master_key =
+            srtp_policy_master_key(p, i, &single);
+
+        if (master_key == NULL || master_key->key == NULL ||
+            (stream->mki_size != 0 && master_key->mki_id == NULL)) {
+            return srtp_err_status_bad_param;
+        }
+
+        status = srtp_kdf_profile_init(&profile, &stream->session_keys[i]);
         if (status) {
-            return srtp_err_status_cipher_fail;
+            return status;
         }
-    } else {
-        /*
-         * Since payload encryption is not enabled, we must authenticate
-         * the entire packet as described in RFC 7714 (Section 9.3. Data
-         * Types in Unencrypted SRTCP Compound Packets)
-         */
-        status = srtp_cipher_set_aad(session_keys->rtcp_cipher, rtcp, rtcp_len);
+        status = srtp_kdf_cache_derive(kdf_cache, &profile, master_key->key,
+                                       &output[i]);
         if (status) {
-            return (srtp_err_status_cipher_fail);
+            return status;
         }
     }
-    /*
-     * Process the sequence# as AAD
-     */
-    status = srtp_cipher_set_aad(session_keys->rtcp_cipher, (uint8_t *)&trailer,
-                                 sizeof(trailer));
-    if (status) {
-        return (srtp_err_status_cipher_fail);
-    }
 
-    /* if we're encrypting, exor keystream into the message */
-    if (stream->rtcp_services & sec_serv_conf) {
-        size_t out_len = *srtcp_len - enc_start;
-        status =
-            srtp_cipher_encrypt(session_keys->rtcp_cipher, rtcp + enc_start,
-                                enc_octet_len, srtcp + enc_start, &out_len);
-        enc_octet_len = out_len;
-        if (status) {
-            return srtp_err_status_cipher_fail;
-        }
-    } else {
-        /* if no encryption and not-inplace then need to copy rest of packet */
-        if (rtcp != srtcp) {
-            memcpy(srtcp + enc_start, rtcp + enc_start, enc_octet_len);
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_stream_rekey_install(stream, policy, output) keys the ciphers and
+ * auth functions that stream already has with the session keys in output,
+ * and takes over the security services and flags of policy; the replay
+ * databases and ROC are kept
+ */
+static srtp_err_status_t srtp_stream_rekey_install(
+    srtp_stream_ctx_t *stream,
+    const srtp_policy_t *p,
+    const srtp_kdf_output_t output[])
+{
+    srtp_master_key_t single;
+    srtp_kdf_profile_t profile;
+    srtp_err_status_t status;
+
+    debug_print(mod_srtp, "rekeying stream (SSRC: 0x%08x)",
+                (unsigned int)ntohl(stream->ssrc));
+
+    for (size_t i = 0; i < stream->num_master_keys; i++) {
+        srtp_session_keys_t *session_keys = &stream->session_keys[i];
+        const srtp_master_key_t *master_key =
+            srtp_policy_master_key(p, i, &single);
+
+        srtp_key_limit_set(session_keys->limit, 0xffffffffffffLL);
+        if (stream->mki_size != 0) {
+            memcpy(session_keys->mki_id, master_key->mki_id,
+                   stream->mki_size);
         }
 
-        /*
-         * Even though we're not encrypting the payload, we need
-         * to run the cipher to get the auth tag.
-         */
-        uint8_t *auth_tag = srtcp + enc_start + enc_octet_len;
-        size_t out_len = *srtcp_len - enc_start - enc_octet_len;
-        status = srtp_cipher_encrypt(session_keys->rtcp_cipher, NULL, 0,
-                                     auth_tag, &out_len);
+        status = srtp_kdf_profile_init(&profile, session_keys);
+        if (status == srtp_err_status_ok) {
+            status = srtp_session_keys_install(session_keys, &profile,
+                                               &output[i]);
+        }
+        if (status == srtp_err_status_ok && stream->keep_derived) {
+            status = srtp_session_keys_keep_derived(session_keys, &output[i]);
+        }
         if (status) {
-            return srtp_err_status_cipher_fail;
+            return status;
         }
-        enc_octet_len += out_len;
     }
+    srtp_stream_index_mkis(stream);
 
-    *srtcp_len = octets_in_rtcp_header + enc_octet_len;
+    /* keystream from the old keys must not be used */
+    if (stream->keystream_cache) {
+        stream->keystream_cache->session_keys = NULL;
+    }
 
-    /* increase the packet length by the length of the seq_num*/
-    *srtcp_len += sizeof(srtcp_trailer_t);
+    stream->rtp_services = p->rtp.sec_serv;
+    stream->rtcp_services = p->rtcp.sec_serv;
+    stream->allow_repeat_tx = p->allow_repeat_tx;
+    stream->use_cryptex = p->use_cryptex;
+    stream->direction = dir_unknown;
+    stream->pending_roc = 0;
 
-    /* increase the packet by the mki_size */
-    *srtcp_len += stream->mki_size;
+    srtp_stream_compile(stream);
 
     return srtp_err_status_ok;
 }
 
+static void srtp_stream_rekey_dealloc(srtp_stream_rekey_t *rekey)
+{
+    /* the scratch holds derived keys and, for a double policy, master keys */
+    octet_string_set_to_zero(rekey, sizeof(srtp_stream_rekey_t));
+    srtp_crypto_free(rekey);
+}
+
 /*
- * This function handles incoming SRTCP packets while in AEAD mode,
- * which currently supports AES-GCM encryption.  Note, the auth tag is
- * at the end of the packet stream and is automatically checked by GCM
- * when decrypting the payload.
+ * srtp_stream_rekey_prepare(stream, policy, kdf_cache, rekey) derives the
+ * session keys of every master key of policy for stream, and its inner
+ * stream, into *rekey.  If this fails, stream is left as it was.
  */
-static srtp_err_status_t srtp_unprotect_rtcp_aead(
-    srtp_t ctx,
-    srtp_stream_ctx_t *stream,
-    const uint8_t *srtcp,
-    size_t srtcp_len,
-    uint8_t *rtcp,
-    size_t *rtcp_len,
-    srtp_session_keys_t *session_keys)
+static srtp_err_status_t srtp_stream_rekey_prepare(
+    const srtp_stream_ctx_t *stream,
+    const srtp_policy_t *p,
+    srtp_kdf_cache_t *kdf_cache,
+    srtp_stream_rekey_t **rekey)
 {
-    const srtcp_hdr_t *hdr = (const srtcp_hdr_t *)srtcp;
-    size_t enc_start;               /* pointer to start of encrypted portion  */
-    const uint8_t *trailer_p;       /* pointer to start of trailer            */
-    uint32_t trailer;               /* trailer value                          */
-    size_t enc_octet_len = 0;       /* number of octets in encrypted portion  */
-    const uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
-    srtp_err_status_t status;
-    size_t tag_len;
-    size_t tmp_len;
-    uint32_t seq_num;
-    v128_t iv;
-
-    /* get tag length from stream context */
-    tag_len = srtp_auth_get_tag_length(session_keys->rtcp_auth);
-
-    enc_start = octets_in_rtcp_header;
-
-    /*
-     * set encryption start, encryption length, and trailer
-     */
-    /* index & E (encryption) bit follow normal data. hdr->len is the number of
-     * words (32-bit) in the normal packet minus 1
-     */
-    /* This should point trailer to the word past the end of the normal data. */
-    /* This would need to be modified for optional mikey data */
-    trailer_p = srtcp + srtcp_len - sizeof(srtcp_trailer_t) - stream->mki_size;
-    memcpy(&trailer, trailer_p, sizeof(trailer));
+    srtp_stream_rekey_t *r;
+    srtp_err_status_t status = srtp_err_status_ok;
 
-    /*
-     * We pass the tag down to the cipher when doing GCM mode
-     */
-    enc_octet_len = srtcp_len - (octets_in_rtcp_header +
-                                 sizeof(srtcp_trailer_t) + stream->mki_size);
-    auth_tag = srtcp + (srtcp_len - tag_len - stream->mki_size -
-                        sizeof(srtcp_trailer_t));
+    r = (srtp_stream_rekey_t *)srtp_crypto_alloc(sizeof(srtp_stream_rekey_t));
+    if (r == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
 
-    /*
-     * check the sequence number for replays
-     */
-    /* this is easier than dealing with bitfield access */
-    seq_num = ntohl(trailer) & SRTCP_INDEX_MASK;
-    debug_print(mod_srtp, "srtcp index: %x", (unsigned int)seq_num);
-    status = srtp_rdb_check(&stream->rtcp_rdb, seq_num);
+    r->outer = p;
+    if (srtp_policy_is_double(&p->rtp)) {
+        status = srtp_double_policy_init(&r->d, p);
+        r->outer = &r->d.outer;
+        if (status == srtp_err_status_ok) {
+            status = srtp_stream_rekey_derive(stream->inner, &r->d.inner,
+                                              kdf_cache, r->inner_output);
+        }
+    }
+    if (status == srtp_err_status_ok) {
+        status = srtp_stream_rekey_derive(stream, r->outer, kdf_cache,
+                                          r->outer_output);
+    }
     if (status) {
+        srtp_stream_rekey_dealloc(r);
         return status;
     }
 
-    /*
-     * Calculate and set the IV
-     */
-    status = srtp_calc_aead_iv_srtcp(session_keys, &iv, seq_num, hdr);
-    if (status) {
-        return srtp_err_status_cipher_fail;
+    *rekey = r;
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_stream_rekey_commit(stream, rekey) installs the session keys
+ * prepared in rekey into stream, and its inner stream, and frees rekey.
+ * Keying a cipher or auth function with a derived key does not fail for
+ * the built-in types; if it does, the stream is left with a mix of old and
+ * new keys, and the caller must remove it.
+ */
+static srtp_err_status_t srtp_stream_rekey_commit(srtp_stream_ctx_t *stream,
+                                                  srtp_stream_rekey_t *rekey)
+{
+    srtp_err_status_t status = srtp_err_status_ok;
+
+    if (stream->inner != NULL) {
+        status = srtp_stream_rekey_install(stream->inner, &rekey->d.inner,
+                                           rekey->inner_output);
     }
-    status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
-                                srtp_direction_decrypt);
-    if (status) {
-        return srtp_err_status_cipher_fail;
+    if (status == srtp_err_status_ok) {
+        status = srtp_stream_rekey_install(stream, rekey->outer,
+                                           rekey->outer_output);
     }
+    srtp_stream_rekey_dealloc(rekey);
 
-    /* check output length */
-    if (*rtcp_len <
-        srtcp_len - sizeof(srtcp_trailer_t) - stream->mki_size - tag_len) {
-        return srtp_err_status_buffer_small;
-    }
+    return status;
+}
 
-    /* if not inplace need to copy rtcp header */
-    if (srtcp != rtcp) {
-        memcpy(rtcp, srtcp, enc_start);
+static bool rekey_template_stream_cb(srtp_stream_t stream, void *raw_data)
+{
+    srtp_t session = (srtp_t)raw_data;
+
+    if (srtp_stream_shares_template_keys(session, stream)) {
+        srtp_stream_follow_template(stream, session->stream_template);
     }
 
-    /*
-     * Set the AAD for GCM mode
-     */
-    if (*trailer_p & SRTCP_E_BYTE_BIT) {
-        /*
-         * If payload encryption is enabled, then the AAD consist of
-         * the RTCP header and the seq# at the end of the packet
-         */
-        status = srtp_cipher_set_aad(session_keys->rtcp_cipher, srtcp,
-                                     octets_in_rtcp_header);
+    return true;
+}
+
+static bool remove_template_stream_cb(srtp_stream_t stream, void *raw_data)
+{
+    srtp_t session = (srtp_t)raw_data;
+
+    if (srtp_stream_shares_template_keys(session, stream)) {
+        srtp_stream_list_remove(session->stream_list, stream);
+        srtp_session_lru_unlink(session, stream);
+        srtp_stream_dealloc(stream, session->stream_template);
+    }
+
+    return true;
+}
+
+/*
+ * srtp_session_remove_template(session) deallocates the template, its
+ * clones and its spares, after the template failed to be rekeyed; the
+ * session then only has the streams that were added with their own
+ * policy
+ */
+static void srtp_session_remove_template(srtp_t session)
+{
+    debug_print0(mod_srtp, "removing template after failed rekey");
+
+    srtp_stream_list_for_each(session->stream_list, remove_template_stream_cb,
+                              session);
+    srtp_session_drop_spare_streams(session);
+    srtp_stream_dealloc(session->stream_template, NULL);
+    session->stream_template = NULL;
+}
+
+static srtp_err_status_t update_template_streams(srtp_t session,
+                                                 const srtp_policy_t *policy)
+{
+    srtp_err_status_t status;
+    srtp_stream_t new_stream_template;
+    srtp_stream_list_t new_stream_list;
+
+    status = srtp_valid_policy(policy);
+    if (status != srtp_err_status_ok) {
+        return status;
+    }
+
+    if (session->stream_template == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    status = is_update_policy_compatable(session->stream_template, policy);
+    if (status != srtp_err_status_ok) {
+        return status;
+    }
+
+    /*
+     * if only the keys change, rekey the template where it is; the streams
+     * cloned from it share its ciphers and follow along
+     */
+    if (srtp_stream_can_rekey(session->stream_template, policy)) {
+        srtp_stream_rekey_t *rekey;
+
+        /* a key that cannot be derived leaves the streams as they were */
+        status = srtp_stream_rekey_prepare(session->stream_template, policy,
+                                           srtp_session_kdf_cache(session),
+                                           &rekey);
         if (status) {
-            return srtp_err_status_cipher_fail;
+            return status;
         }
-    } else {
-        /*
-         * Since payload encryption is not enabled, we must authenticate
-         * the entire packet as described in RFC 7714 (Section 9.3. Data
-         * Types in Unencrypted SRTCP Compound Packets)
-         */
-        status = srtp_cipher_set_aad(
-            session_keys->rtcp_cipher, srtcp,
-            (srtcp_len - tag_len - sizeof(srtcp_trailer_t) - stream->mki_size));
+        status = srtp_stream_rekey_commit(session->stream_template, rekey);
         if (status) {
-            return (srtp_err_status_cipher_fail);
+            /* none of the streams with a mix of old and new keys is kept */
+            srtp_session_remove_template(session);
+            return status;
         }
+        srtp_stream_list_for_each(session->stream_list,
+                                  rekey_template_stream_cb, session);
+        return srtp_session_fill_spare_streams(session);
     }
 
-    /*
-     * Process the sequence# as AAD
-     */
-    status = srtp_cipher_set_aad(session_keys->rtcp_cipher, (uint8_t *)&trailer,
-                                 sizeof(trailer));
+    /* allocate new template stream  */
+    status = srtp_stream_alloc(&new_stream_template, policy);
     if (status) {
-        return (srtp_err_status_cipher_fail);
+        return status;
     }
+    new_stream_template->keep_derived = session->serializable;
 
-    /* if we're decrypting, exor keystream into the message */
-    if (*trailer_p & SRTCP_E_BYTE_BIT) {
-        status = srtp_cipher_decrypt(session_keys->rtcp_cipher,
-                                     srtcp + enc_start, enc_octet_len,
-                                     rtcp + enc_start, &enc_octet_len);
+    /* initialize new template stream  */
+    status = srtp_stream_init(new_stream_template, policy,
+                              srtp_session_kdf_cache(session));
+    if (status) {
+        srtp_crypto_free(new_stream_template);
+        return status;
+    }
+
+    /* allocate new stream list */
+    status = srtp_stream_list_alloc(&new_stream_list);
+    if (status) {
+        srtp_crypto_free(new_stream_template);
+        return status;
+    }
+
+    /* process streams */
+    struct update_template_stream_data data = { srtp_err_status_ok, session,
+                                                new_stream_template,
+                                                new_stream_list };
+    srtp_stream_list_for_each(session->stream_list, update_template_stream_cb,
+                              &data);
+    if (data.status) {
+        /* free new allocations */
+        srtp_remove_and_dealloc_streams(new_stream_list, new_stream_template);
+        srtp_stream_list_dealloc(new_stream_list);
+        srtp_stream_dealloc(new_stream_template, NULL);
+        srtp_session_lru_rebuild(session);
+        return data.status;
+    }
+
+    /* dealloc old list / template, and the spare clones of the template */
+    srtp_remove_and_dealloc_streams(session->stream_list,
+                                    session->stream_template);
+    srtp_stream_list_dealloc(session->stream_list);
+    srtp_session_drop_spare_streams(session);
+    srtp_stream_dealloc(session->stream_template, NULL);
+
+    /* set new list / template, and clone the new template for spares */
+    session->stream_template = new_stream_template;
+    session->stream_list = new_stream_list;
+    return srtp_session_fill_spare_streams(session);
+}
+
+static srtp_err_status_t stream_update(srtp_t session,
+                                       const srtp_policy_t *policy)
+{
+    srtp_err_status_t status;
+    srtp_xtd_seq_num_t old_index;
+    srtp_xtd_seq_num_t old_inner_index;
+    srtp_rdb_t old_rtcp_rdb;
+    srtp_rdbx_atomic_t *shared_rdbx;
+    srtp_stream_t stream;
+
+    status = srtp_valid_policy(policy);
+    if (status != srtp_err_status_ok) {
+        return status;
+    }
+
+    stream = srtp_get_stream(session, htonl(policy->ssrc.value));
+    if (stream == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    status = is_update_policy_compatable(stream, policy);
+    if (status != srtp_err_status_ok) {
+        return status;
+    }
+
+    /* if only the keys change, rekey the stream where it is */
+    if (!srtp_stream_shares_template_keys(session, stream) &&
+        srtp_stream_can_rekey(stream, policy)) {
+        srtp_stream_rekey_t *rekey;
+
+        /* a key that cannot be derived leaves the stream as it was */
+        status = srtp_stream_rekey_prepare(
+            stream, policy, srtp_session_kdf_cache(session), &rekey);
         if (status) {
             return status;
         }
-    } else {
-        /* if no encryption and not-inplace then need to copy rest of packet */
-        if (rtcp != srtcp) {
-            memcpy(rtcp + enc_start, srtcp + enc_start, enc_octet_len);
+        status = srtp_stream_rekey_commit(stream, rekey);
+        if (status) {
+            /* a stream with a mix of old and new keys is not kept */
+            srtp_stream_remove(session, policy->ssrc.value);
         }
+        return status;
+    }
 
-        /*
-         * Still need to run the cipher to check the tag
-         */
-        tmp_len = 0;
-        status = srtp_cipher_decrypt(session_keys->rtcp_cipher, auth_tag,
-                                     tag_len, NULL, &tmp_len);
-        if (status) {
-            return status;
+    /* save old extendard seq */
+    old_index = stream->rtp_rdbx.index;
+    old_inner_index = stream->inner ? stream->inner->rtp_rdbx.index : 0;
+    status = srtp_rdb_init(&old_rtcp_rdb,
+                           srtp_rdb_get_window_size(&stream->rtcp_rdb));
+    if (status) {
+        return status;
+    }
+    srtp_rdb_copy(&old_rtcp_rdb, &stream->rtcp_rdb);
+
+    /* take over the reference to a shared replay window */
+    shared_rdbx = stream->shared_rdbx;
+    stream->shared_rdbx = NULL;
+
+    status = srtp_stream_remove(session, policy->ssrc.value);
+    if (status) {
+        srtp_rdb_dealloc(&old_rtcp_rdb);
+        srtp_rdbx_atomic_release(shared_rdbx);
+        return status;
+    }
+
+    status = srtp_stream_add(session, policy);
+    if (status) {
+        srtp_rdb_dealloc(&old_rtcp_rdb);
+        srtp_rdbx_atomic_release(shared_rdbx);
+        return status;
+    }
+
+    stream = srtp_get_stream(session, htonl(policy->ssrc.value));
+    if (stream == NULL) {
+        srtp_rdb_dealloc(&old_rtcp_rdb);
+        srtp_rdbx_atomic_release(shared_rdbx);
+        return srtp_err_status_fail;
+    }
+
+    /* restore old extended seq */
+    stream->rtp_rdbx.index = old_index;
+    if (stream->inner) {
+        stream->inner->rtp_rdbx.index = old_inner_index;
+    }
+    srtp_rdb_copy(&stream->rtcp_rdb, &old_rtcp_rdb);
+    srtp_rdb_dealloc(&old_rtcp_rdb);
+    stream->shared_rdbx = shared_rdbx;
+
+    return srtp_err_status_ok;
+}
+
+static srtp_err_status_t srtp_session_update(srtp_t session,
+                                             const srtp_policy_t *policy)
+{
+    switch (policy->ssrc.type) {
+    case (ssrc_any_outbound):
+    case (ssrc_any_inbound):
+        return update_template_streams(session, policy);
+    case (ssrc_specific):
+        return stream_update(session, policy);
+    case (ssrc_undefined):
+    default:
+        return srtp_err_status_bad_param;
+    }
+}
+
+srtp_err_status_t srtp_stream_update(srtp_t session,
+                                     const srtp_policy_t *policy)
+{
+    srtp_err_status_t status;
+
+    /* sanity check arguments */
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    status = srtp_valid_policy(policy);
+    if (status != srtp_err_status_ok) {
+        return status;
+    }
+
+    /* the keys being replaced are not kept in the cache */
+    srtp_session_kdf_cache_purge(session);
+
+    return srtp_session_update(session, policy);
+}
+
+srtp_err_status_t srtp_update(srtp_t session, const srtp_policy_t *policy)
+{
+    srtp_err_status_t stat;
+
+    /* sanity check arguments */
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    stat = srtp_valid_policy(policy);
+    if (stat != srtp_err_status_ok) {
+        return stat;
+    }
+
+    /*
+     * the keys being replaced are not kept in the cache; it is purged once
+     * so that the elements of the list can share the new keys
+     */
+    srtp_session_kdf_cache_purge(session);
+
+    while (policy != NULL) {
+        stat = srtp_session_update(session, policy);
+        if (stat) {
+            return stat;
         }
+
+        /* set policy to next item in list  */
+        policy = policy->next;
     }
+    return srtp_err_status_ok;
+}
 
-    *rtcp_len = srtcp_len;
+/*
+ * The default policy - provides a convenient way for callers to use
+ * the default security policy
+ *
+ * The default policy is defined in RFC 3711
+ * (Section 5. Default and mandatory-to-implement Transforms)
+ *
+ */
+
+/*
+ * NOTE: cipher_key_len is really key len (128 bits) plus salt len
+ *  (112 bits)
+ */
+/* There are hard-coded 16's for base_key_len in the key generation code */
+
+void srtp_crypto_policy_set_rtp_default(srtp_crypto_policy_t *p)
+{
+    p->cipher_type = SRTP_AES_ICM_128;
+    p->cipher_key_len =
+        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* default 128 bits per RFC 3711 */
+    p->auth_type = SRTP_HMAC_SHA1;
+    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
+    p->auth_tag_len = 10; /* default 80 bits per RFC 3711 */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+void srtp_crypto_policy_set_rtcp_default(srtp_crypto_policy_t *p)
+{
+    p->cipher_type = SRTP_AES_ICM_128;
+    p->cipher_key_len =
+        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* default 128 bits per RFC 3711 */
+    p->auth_type = SRTP_HMAC_SHA1;
+    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
+    p->auth_tag_len = 10; /* default 80 bits per RFC 3711 */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+void srtp_crypto_policy_set_aes_cm_128_hmac_sha1_32(srtp_crypto_policy_t *p)
+{
+    /*
+     * corresponds to RFC 4568
+     *
+     * note that this crypto policy is intended for SRTP, but not SRTCP
+     */
+
+    p->cipher_type = SRTP_AES_ICM_128;
+    p->cipher_key_len =
+        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* 128 bit key, 112 bit salt */
+    p->auth_type = SRTP_HMAC_SHA1;
+    p->auth_key_len = 20; /* 160 bit key               */
+    p->auth_tag_len = 4;  /* 32 bit tag                */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+void srtp_crypto_policy_set_aes_cm_128_null_auth(srtp_crypto_policy_t *p)
+{
+    /*
+     * corresponds to RFC 4568
+     *
+     * note that this crypto policy is intended for SRTP, but not SRTCP
+     */
+
+    p->cipher_type = SRTP_AES_ICM_128;
+    p->cipher_key_len =
+        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* 128 bit key, 112 bit salt */
+    p->auth_type = SRTP_NULL_AUTH;
+    p->auth_key_len = 0;
+    p->auth_tag_len = 0;
+    p->sec_serv = sec_serv_conf;
+}
+
+void srtp_crypto_policy_set_null_cipher_hmac_sha1_80(srtp_crypto_policy_t *p)
+{
+    /*
+     * corresponds to RFC 4568
+     */
+
+    p->cipher_type = SRTP_NULL_CIPHER;
+    p->cipher_key_len =
+        SRTP_AES_ICM_128_KEY_LEN_WSALT; /* 128 bit key, 112 bit salt */
+    p->auth_type = SRTP_HMAC_SHA1;
+    p->auth_key_len = 20;
+    p->auth_tag_len = 10;
+    p->sec_serv = sec_serv_auth;
+}
+
+void srtp_crypto_policy_set_null_cipher_hmac_null(srtp_crypto_policy_t *p)
+{
+    /*
+     * Should only be used for testing
+     */
+
+    p->cipher_type = SRTP_NULL_CIPHER;
+    p->cipher_key_len = 0;
+    p->auth_type = SRTP_NULL_AUTH;
+    p->auth_key_len = 0;
+    p->auth_tag_len = 0;
+    p->sec_serv = sec_serv_none;
+}
+
+void srtp_crypto_policy_set_aes_cm_256_hmac_sha1_80(srtp_crypto_policy_t *p)
+{
+    /*
+     * corresponds to RFC 6188
+     */
+
+    p->cipher_type = SRTP_AES_ICM_256;
+    p->cipher_key_len = SRTP_AES_ICM_256_KEY_LEN_WSALT;
+    p->auth_type = SRTP_HMAC_SHA1;
+    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
+    p->auth_tag_len = 10; /* default 80 bits per RFC 3711 */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+void srtp_crypto_policy_set_aes_cm_256_hmac_sha1_32(srtp_crypto_policy_t *p)
+{
+    /*
+     * corresponds to RFC 6188
+     *
+     * note that this crypto policy is intended for SRTP, but not SRTCP
+     */
+
+    p->cipher_type = SRTP_AES_ICM_256;
+    p->cipher_key_len = SRTP_AES_ICM_256_KEY_LEN_WSALT;
+    p->auth_type = SRTP_HMAC_SHA1;
+    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
+    p->auth_tag_len = 4;  /* default 80 bits per RFC 3711 */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+/*
+ * AES-256 with no authentication.
+ */
+void srtp_crypto_policy_set_aes_cm_256_null_auth(srtp_crypto_policy_t *p)
+{
+    p->cipher_type = SRTP_AES_ICM_256;
+    p->cipher_key_len = SRTP_AES_ICM_256_KEY_LEN_WSALT;
+    p->auth_type = SRTP_NULL_AUTH;
+    p->auth_key_len = 0;
+    p->auth_tag_len = 0;
+    p->sec_serv = sec_serv_conf;
+}
+
+void srtp_crypto_policy_set_aes_cm_192_hmac_sha1_80(srtp_crypto_policy_t *p)
+{
+    /*
+     * corresponds to RFC 6188
+     */
+
+    p->cipher_type = SRTP_AES_ICM_192;
+    p->cipher_key_len = SRTP_AES_ICM_192_KEY_LEN_WSALT;
+    p->auth_type = SRTP_HMAC_SHA1;
+    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
+    p->auth_tag_len = 10; /* default 80 bits per RFC 3711 */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+void srtp_crypto_policy_set_aes_cm_192_hmac_sha1_32(srtp_crypto_policy_t *p)
+{
+    /*
+     * corresponds to RFC 6188
+     *
+     * note that this crypto policy is intended for SRTP, but not SRTCP
+     */
+
+    p->cipher_type = SRTP_AES_ICM_192;
+    p->cipher_key_len = SRTP_AES_ICM_192_KEY_LEN_WSALT;
+    p->auth_type = SRTP_HMAC_SHA1;
+    p->auth_key_len = 20; /* default 160 bits per RFC 3711 */
+    p->auth_tag_len = 4;  /* default 80 bits per RFC 3711 */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+/*
+ * AES-192 with no authentication.
+ */
+void srtp_crypto_policy_set_aes_cm_192_null_auth(srtp_crypto_policy_t *p)
+{
+    p->cipher_type = SRTP_AES_ICM_192;
+    p->cipher_key_len = SRTP_AES_ICM_192_KEY_LEN_WSALT;
+    p->auth_type = SRTP_NULL_AUTH;
+    p->auth_key_len = 0;
+    p->auth_tag_len = 0;
+    p->sec_serv = sec_serv_conf;
+}
+
+/*
+ * AES-128 GCM mode with 16 octet auth tag.
+ */
+void srtp_crypto_policy_set_aes_gcm_128_16_auth(srtp_crypto_policy_t *p)
+{
+    p->cipher_type = SRTP_AES_GCM_128;
+    p->cipher_key_len = SRTP_AES_GCM_128_KEY_LEN_WSALT;
+    p->auth_type = SRTP_NULL_AUTH; /* GCM handles the auth for us */
+    p->auth_key_len = 0;
+    p->auth_tag_len = 16; /* 16 octet tag length */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+/*
+ * AES-256 GCM mode with 16 octet auth tag.
+ */
+void srtp_crypto_policy_set_aes_gcm_256_16_auth(srtp_crypto_policy_t *p)
+{
+    p->cipher_type = SRTP_AES_GCM_256;
+    p->cipher_key_len = SRTP_AES_GCM_256_KEY_LEN_WSALT;
+    p->auth_type = SRTP_NULL_AUTH; /* GCM handles the auth for us */
+    p->auth_key_len = 0;
+    p->auth_tag_len = 16; /* 16 octet tag length */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+/*
+ * the double policies have the key and salt of both layers, which is how
+ * srtp_policy_is_double() tells them apart from the plain ones
+ */
+void srtp_crypto_policy_set_double_aes_gcm_128_16_auth(srtp_crypto_policy_t *p)
+{
+    p->cipher_type = SRTP_AES_GCM_128;
+    p->cipher_key_len = 2 * SRTP_AES_GCM_128_KEY_LEN_WSALT;
+    p->auth_type = SRTP_NULL_AUTH; /* GCM handles the auth for us */
+    p->auth_key_len = 0;
+    p->auth_tag_len = 16; /* 16 octet tag length, for each layer */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+void srtp_crypto_policy_set_double_aes_gcm_256_16_auth(srtp_crypto_policy_t *p)
+{
+    p->cipher_type = SRTP_AES_GCM_256;
+    p->cipher_key_len = 2 * SRTP_AES_GCM_256_KEY_LEN_WSALT;
+    p->auth_type = SRTP_NULL_AUTH; /* GCM handles the auth for us */
+    p->auth_key_len = 0;
+    p->auth_tag_len = 16; /* 16 octet tag length, for each layer */
+    p->sec_serv = sec_serv_conf_and_auth;
+}
+
+/*
+ * secure rtcp functions
+ */
+
+/*
+ * AEAD uses a new IV formation method.  This function implements
+ * section 9.1 (SRTCP IV Formation for AES-GCM) from RFC7714.
+ * The calculation is defined as, where (+) is the xor operation:
+ *
+ *                0  1  2  3  4  5  6  7  8  9 10 11
+ *               +--+--+--+--+--+--+--+--+--+--+--+--+
+ *               |00|00|    SSRC   |00|00|0+SRTCP Idx|---+
+ *               +--+--+--+--+--+--+--+--+--+--+--+--+   |
+ *                                                       |
+ *               +--+--+--+--+--+--+--+--+--+--+--+--+   |
+ *               |         Encryption Salt           |->(+)
+ *               +--+--+--+--+--+--+--+--+--+--+--+--+   |
+ *                                                       |
+ *               +--+--+--+--+--+--+--+--+--+--+--+--+   |
+ *               |       Initialization Vector       |<--+
+ *               +--+--+--+--+--+--+--+--+--+--+--+--+*
+ *
+ * Input:  *session_keys - pointer to SRTP stream context session keys,
+ *                        used to retrieve the SALT
+ *         *iv           - Pointer to recieve the calculated IV
+ *         seq_num       - The SEQ value to use for the IV calculation.
+ *         *hdr          - The RTP header, used to get the SSRC value
+ *
+ * Returns: srtp_err_status_ok if no error or srtp_err_status_bad_param
+ *          if seq_num is invalid
+ *
+ */
+static srtp_err_status_t srtp_calc_aead_iv_srtcp(
+    srtp_session_keys_t *session_keys,
+    v128_t *iv,
+    uint32_t seq_num,
+    const srtcp_hdr_t *hdr)
+{
+    v128_t in;
+    v128_t salt;
+
+    memset(&in, 0, sizeof(v128_t));
+    memset(&salt, 0, sizeof(v128_t));
+
+    in.v16[0] = 0;
+    memcpy(&in.v16[1], &hdr->ssrc, 4); /* still in network order! */
+    in.v16[3] = 0;
+
+    /*
+     *  The SRTCP index (seq_num) spans bits 0 through 30 inclusive.
+     *  The most significant bit should be zero.
+     */
+    if (seq_num & 0x80000000UL) {
+        return srtp_err_status_bad_param;
+    }
+    in.v32[2] = htonl(seq_num);
+
+    debug_print(mod_srtp, "Pre-salted RTCP IV = %s\n", v128_hex_string(&in));
+
+    /*
+     * Get the SALT value from the context
+     */
+    memcpy(salt.v8, session_keys->c_salt, 12);
+    debug_print(mod_srtp, "RTCP SALT = %s\n", v128_hex_string(&salt));
+
+    /*
+     * Finally, apply the SALT to the input
+     */
+    v128_xor(iv, &in, &salt);
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * This code handles AEAD ciphers for outgoing RTCP.  We currently support
+ * AES-GCM mode with 128 or 256 bit keys.
+ */
+static srtp_err_status_t srtp_protect_rtcp_aead(
+    srtp_stream_ctx_t *stream,
+    const uint8_t *rtcp,
+    size_t rtcp_len,
+    uint8_t *srtcp,
+    size_t *srtcp_len,
+    srtp_session_keys_t *session_keys)
+{
+    const srtcp_hdr_t *hdr = (const srtcp_hdr_t *)rtcp;
+    size_t enc_start;         /* pointer to start of encrypted portion  */
+    uint8_t *trailer_p;       /* pointer to start of trailer            */
+    uint32_t trailer;         /* trailer value                          */
+    size_t enc_octet_len = 0; /* number of octets in encrypted portion  */
+    srtp_err_status_t status;
+    size_t tag_len;
+    uint32_t seq_num;
+    v128_t iv;
+
+    /* get tag length from stream context */
+    tag_len = srtp_auth_get_tag_length(session_keys->rtcp_auth);
+
+    /*
+     * set encryption start and encryption length - if we're not
+     * providing confidentiality, set enc_start to NULL
+     */
+    enc_start = octets_in_rtcp_header;
+    enc_octet_len = rtcp_len - enc_start;
+
+    /* check output length */
+    if (*srtcp_len <
+        rtcp_len + sizeof(srtcp_trailer_t) + stream->mki_size + tag_len) {
+        return srtp_err_status_buffer_small;
+    }
+
+    /* if not-inplace then need to copy full rtcp header */
+    if (rtcp != srtcp) {
+        memcpy(srtcp, rtcp, enc_start);
+    }
+
+    /* NOTE: hdr->length is not usable - it refers to only the first
+     * RTCP report in the compound packet!
+     */
+    trailer_p = srtcp + enc_start + enc_octet_len + tag_len;
+
+    if (stream->rtcp_services & sec_serv_conf) {
+        trailer = htonl(SRTCP_E_BIT); /* set encrypt bit */
+    } else {
+        /* 0 is network-order independent */
+        trailer = 0x00000000; /* set encrypt bit */
+    }
+
+    if (stream->use_mki) {
+        srtp_inject_mki(srtcp + rtcp_len + tag_len + sizeof(srtcp_trailer_t),
+                        session_keys, stream->mki_size);
+    }
+
+    /*
+     * check sequence number for overruns, and copy it into the packet
+     * if its value isn't too big
+     */
+    status = srtp_rdb_increment(&stream->rtcp_rdb);
+    if (status) {
+        return status;
+    }
+    seq_num = srtp_rdb_get_value(&stream->rtcp_rdb);
+    trailer |= htonl(seq_num);
+    debug_print(mod_srtp, "srtcp index: %x", (unsigned int)seq_num);
+
+    memcpy(trailer_p, &trailer, sizeof(trailer));
+
+    /*
+     * Calculate and set the IV
+     */
+    status = srtp_calc_aead_iv_srtcp(session_keys, &iv, seq_num, hdr);
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+    status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
+                                srtp_direction_encrypt);
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+
+    /*
+     * Set the AAD for GCM mode
+     */
+    if (stream->rtcp_services & sec_serv_conf) {
+        /*
+         * If payload encryption is enabled, then the AAD consist of
+         * the RTCP header and the seq# at the end of the packet
+         */
+        status = srtp_cipher_set_aad(session_keys->rtcp_cipher, rtcp,
+                                     octets_in_rtcp_header);
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+    } else {
+        /*
+         * Since payload encryption is not enabled, we must authenticate
+         * the entire packet as described in RFC 7714 (Section 9.3. Data
+         * Types in Unencrypted SRTCP Compound Packets)
+         */
+        status = srtp_cipher_set_aad(session_keys->rtcp_cipher, rtcp, rtcp_len);
+        if (status) {
+            return (srtp_err_status_cipher_fail);
+        }
+    }
+    /*
+     * Process the sequence# as AAD
+     */
+    status = srtp_cipher_set_aad(session_keys->rtcp_cipher, (uint8_t *)&trailer,
+                                 sizeof(trailer));
+    if (status) {
+        return (srtp_err_status_cipher_fail);
+    }
+
+    /* if we're encrypting, exor keystream into the message */
+    if (stream->rtcp_services & sec_serv_conf) {
+        size_t out_len = *srtcp_len - enc_start;
+        status =
+            srtp_cipher_encrypt(session_keys->rtcp_cipher, rtcp + enc_start,
+                                enc_octet_len, srtcp + enc_start, &out_len);
+        enc_octet_len = out_len;
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+    } else {
+        /* if no encryption and not-inplace then need to copy rest of packet */
+        if (rtcp != srtcp) {
+            memcpy(srtcp + enc_start, rtcp + enc_start, enc_octet_len);
+        }
+
+        /*
+         * Even though we're not encrypting the payload, we need
+         * to run the cipher to get the auth tag.
+         */
+        uint8_t *auth_tag = srtcp + enc_start + enc_octet_len;
+        size_t out_len = *srtcp_len - enc_start - enc_octet_len;
+        status = srtp_cipher_encrypt(session_keys->rtcp_cipher, NULL, 0,
+                                     auth_tag, &out_len);
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+        enc_octet_len += out_len;
+    }
+
+    *srtcp_len = octets_in_rtcp_header + enc_octet_len;
+
+    /* increase the packet length by the length of the seq_num*/
+    *srtcp_len += sizeof(srtcp_trailer_t);
+
+    /* increase the packet by the mki_size */
+    *srtcp_len += stream->mki_size;
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * This function handles incoming SRTCP packets while in AEAD mode,
+ * which currently supports AES-GCM encryption.  Note, the auth tag is
+ * at the end of the packet stream and is automatically checked by GCM
+ * when decrypting the payload.
+ */
+static srtp_err_status_t srtp_unprotect_rtcp_aead(
+    srtp_t ctx,
+    srtp_stream_ctx_t *stream,
+    const uint8_t *srtcp,
+    size_t srtcp_len,
+    uint8_t *rtcp,
+    size_t *rtcp_len,
+    srtp_session_keys_t *session_keys)
+{
+    const srtcp_hdr_t *hdr = (const srtcp_hdr_t *)srtcp;
+    size_t enc_start;               /* pointer to start of encrypted portion  */
+    const uint8_t *trailer_p;       /* pointer to start of trailer            */
+    uint32_t trailer;               /* trailer value                          */
+    size_t enc_octet_len = 0;       /* number of octets in encrypted portion  */
+    const uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
+    srtp_err_status_t status;
+    size_t tag_len;
+    size_t tmp_len;
+    uint32_t seq_num;
+    v128_t iv;
+
+    /* get tag length from stream context */
+    tag_len = srtp_auth_get_tag_length(session_keys->rtcp_auth);
+
+    enc_start = octets_in_rtcp_header;
+
+    /*
+     * set encryption start, encryption length, and trailer
+     */
+    /* index & E (encryption) bit follow normal data. hdr->len is the number of
+     * words (32-bit) in the normal packet minus 1
+     */
+    /* This should point trailer to the word past the end of the normal data. */
+    /* This would need to be modified for optional mikey data */
+    trailer_p = srtcp + srtcp_len - sizeof(srtcp_trailer_t) - stream->mki_size;
+    memcpy(&trailer, trailer_p, sizeof(trailer));
+
+    /*
+     * We pass the tag down to the cipher when doing GCM mode
+     */
+    enc_octet_len = srtcp_len - (octets_in_rtcp_header +
+                                 sizeof(srtcp_trailer_t) + stream->mki_size);
+    auth_tag = srtcp + (srtcp_len - tag_len - stream->mki_size -
+                        sizeof(srtcp_trailer_t));
+
+    /*
+     * check the sequence number for replays
+     */
+    /* this is easier than dealing with bitfield access */
+    seq_num = ntohl(trailer) & SRTCP_INDEX_MASK;
+    debug_print(mod_srtp, "srtcp index: %x", (unsigned int)seq_num);
+    status = srtp_rdb_check(&stream->rtcp_rdb, seq_num);
+    if (status) {
+        return status;
+    }
+
+    /*
+     * Calculate and set the IV
+     */
+    status = srtp_calc_aead_iv_srtcp(session_keys, &iv, seq_num, hdr);
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+    status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
+                                srtp_direction_decrypt);
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+
+    /* check output length */
+    if (*rtcp_len <
+        srtcp_len - sizeof(srtcp_trailer_t) - stream->mki_size - tag_len) {
+        return srtp_err_status_buffer_small;
+    }
+
+    /* if not inplace need to copy rtcp header */
+    if (srtcp != rtcp) {
+        memcpy(rtcp, srtcp, enc_start);
+    }
+
+    /*
+     * Set the AAD for GCM mode
+     */
+    if (*trailer_p & SRTCP_E_BYTE_BIT) {
+        /*
+         * If payload encryption is enabled, then the AAD consist of
+         * the RTCP header and the seq# at the end of the packet
+         */
+        status = srtp_cipher_set_aad(session_keys->rtcp_cipher, srtcp,
+                                     octets_in_rtcp_header);
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+    } else {
+        /*
+         * Since payload encryption is not enabled, we must authenticate
+         * the entire packet as described in RFC 7714 (Section 9.3. Data
+         * Types in Unencrypted SRTCP Compound Packets)
+         */
+        status = srtp_cipher_set_aad(
+            session_keys->rtcp_cipher, srtcp,
+            (srtcp_len - tag_len - sizeof(srtcp_trailer_t) - stream->mki_size));
+        if (status) {
+            return (srtp_err_status_cipher_fail);
+        }
+    }
+
+    /*
+     * Process the sequence# as AAD
+     */
+    status = srtp_cipher_set_aad(session_keys->rtcp_cipher, (uint8_t *)&trailer,
+                                 sizeof(trailer));
+    if (status) {
+        return (srtp_err_status_cipher_fail);
+    }
+
+    /* if we're decrypting, exor keystream into the message */
+    if (*trailer_p & SRTCP_E_BYTE_BIT) {
+        status = srtp_cipher_decrypt(session_keys->rtcp_cipher,
+                                     srtcp + enc_start, enc_octet_len,
+                                     rtcp + enc_start, &enc_octet_len);
+        if (status) {
+            return status;
+        }
+    } else {
+        /* if no encryption and not-inplace then need to copy rest of packet */
+        if (rtcp != srtcp) {
+            memcpy(rtcp + enc_start, srtcp + enc_start, enc_octet_len);
+        }
+
+        /*
+         * Still need to run the cipher to check the tag
+         */
+        tmp_len = 0;
+        status = srtp_cipher_decrypt(session_keys->rtcp_cipher, auth_tag,
+                                     tag_len, NULL, &tmp_len);
+        if (status) {
+            return status;
+        }
+    }
+
+    *rtcp_len = srtcp_len;
+
+    /* decrease the packet length by the length of the auth tag and seq_num*/
+    *rtcp_len -= (tag_len + sizeof(srtcp_trailer_t) + stream->mki_size);
+
+    /*
+     * verify that stream is for received traffic - this check will
+     * detect SSRC collisions, since a stream that appears in both
+     * srtp_protect() and srtp_unprotect() will fail this test in one of
+     * those functions.
+     *
+     * we do this check *after* the authentication check, so that the
+     * latter check will catch any attempts to fool us into thinking
+     * that we've got a collision
+     */
+    if (stream->direction != dir_srtp_receiver) {
+        if (stream->direction == dir_unknown) {
+            stream->direction = dir_srtp_receiver;
+        } else {
+            srtp_handle_event(ctx, stream, event_ssrc_collision);
+        }
+    }
+
+    /*
+     * if the stream is a 'provisional' one, in which the template context
+     * is used, then we need to allocate a new stream at this point, since
+     * the authentication passed
+     */
+    if (stream == ctx->stream_template) {
+        srtp_stream_ctx_t *new_stream;
+
+        /*
+         * allocate and initialize a new stream, and add it to the list
+         *
+         * note that we indicate failure if we can't allocate the new
+         * stream, and some implementations will want to not return
+         * failure here
+         */
+        status = srtp_session_clone_stream(ctx, hdr->ssrc, &new_stream);
+        if (status) {
+            return status;
+        }
+
+        /* set stream (the pointer used in this function) */
+        stream = new_stream;
+    }
+
+    /* we've passed the authentication check, so add seq_num to the rdb */
+    srtp_rdb_add_index(&stream->rtcp_rdb, seq_num);
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_protect_rtcp(srtp_t ctx,
+                                    const uint8_t *rtcp,
+                                    size_t rtcp_len,
+                                    uint8_t *srtcp,
+                                    size_t *srtcp_len,
+                                    size_t mki_index)
+{
+    const srtcp_hdr_t *hdr = (const srtcp_hdr_t *)rtcp;
+    size_t enc_start;         /* pointer to start of encrypted portion  */
+    uint8_t *auth_start;      /* pointer to start of auth. portion      */
+    uint8_t *trailer_p;       /* pointer to start of trailer            */
+    uint32_t trailer;         /* trailer value                          */
+    size_t enc_octet_len = 0; /* number of octets in encrypted portion  */
+    uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
+    srtp_err_status_t status;
+    size_t tag_len;
+    srtp_stream_ctx_t *stream;
+    size_t prefix_len;
+    uint32_t seq_num;
+    srtp_session_keys_t *session_keys = NULL;
+
+    /* check the packet length - it must at least contain a full header */
+    if (rtcp_len < octets_in_rtcp_header) {
+        return srtp_err_status_bad_param;
+    }
+
+    /*
+     * look up ssrc in srtp_stream list, and process the packet with
+     * the appropriate stream.  if we haven't seen this stream before,
+     * there's only one key for this srtp_session, and the cipher
+     * supports key-sharing, then we assume that a new stream using
+     * that key has just started up
+     */
+    stream = srtp_get_stream(ctx, hdr->ssrc);
+    if (stream == NULL) {
+        if (ctx->stream_template != NULL) {
+            srtp_stream_ctx_t *new_stream;
+
+            /* allocate a new stream and add it to the list */
+            status = srtp_session_clone_stream(ctx, hdr->ssrc, &new_stream);
+            if (status) {
+                return status;
+            }
+
+            /* set stream (the pointer used in this function) */
+            stream = new_stream;
+        } else {
+            /* no template stream, so we return an error */
+            return srtp_err_status_no_ctx;
+        }
+    }
+
+    /*
+     * verify that stream is for sending traffic - this check will
+     * detect SSRC collisions, since a stream that appears in both
+     * srtp_protect() and srtp_unprotect() will fail this test in one of
+     * those functions.
+     */
+    if (stream->direction != dir_srtp_sender) {
+        if (stream->direction == dir_unknown) {
+            stream->direction = dir_srtp_sender;
+        } else {
+            srtp_handle_event(ctx, stream, event_ssrc_collision);
+        }
+    }
+
+    status = srtp_get_session_keys(stream, mki_index, &session_keys);
+    if (status) {
+        return status;
+    }
+
+    /*
+     * Check if this is an AEAD stream (GCM mode).  If so, then dispatch
+     * the request to our AEAD handler.
+     */
+    if (session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_128 ||
+        session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_256) {
+        status = srtp_protect_rtcp_aead(stream, rtcp, rtcp_len, srtcp,
+                                        srtcp_len, session_keys);
+        if (status == srtp_err_status_ok) {
+            srtp_session_use_stream(ctx, stream);
+        }
+        return status;
+    }
+
+    /* get tag length from stream context */
+    tag_len = srtp_auth_get_tag_length(session_keys->rtcp_auth);
+
+    /*
+     * set encryption start and encryption length
+     */
+    enc_start = octets_in_rtcp_header;
+    enc_octet_len = rtcp_len - enc_start;
+
+    /* check output length */
+    if (*srtcp_len <
+        rtcp_len + sizeof(srtcp_trailer_t) + stream->mki_size + tag_len) {
+        return srtp_err_status_buffer_small;
+    }
+
+    /* if not in place then need to copy rtcp header */
+    if (rtcp != srtcp) {
+        memcpy(srtcp, rtcp, enc_start);
+    }
+
+    /* all of the packet, except the header, gets encrypted */
+    /*
+     * NOTE: hdr->length is not usable - it refers to only the first RTCP report
+     * in the compound packet!
+     */
+    trailer_p = srtcp + enc_start + enc_octet_len;
+
+    if (stream->rtcp_services & sec_serv_conf) {
+        trailer = htonl(SRTCP_E_BIT); /* set encrypt bit */
+    } else {
+        /* 0 is network-order independant */
+        trailer = 0x00000000; /* set encrypt bit */
+    }
+
+    if (stream->use_mki) {
+        srtp_inject_mki(srtcp + rtcp_len + sizeof(srtcp_trailer_t),
+                        session_keys, stream->mki_size);
+    }
+
+    /*
+     * set the auth_start and auth_tag pointers to the proper locations
+     * (note that srtpc *always* provides authentication, unlike srtp)
+     */
+    /* Note: This would need to change for optional mikey data */
+    auth_start = srtcp;
+    auth_tag = srtcp + rtcp_len + sizeof(srtcp_trailer_t) + stream->mki_size;
+
+    /*
+     * check sequence number for overruns, and copy it into the packet
+     * if its value isn't too big
+     */
+    status = srtp_rdb_increment(&stream->rtcp_rdb);
+    if (status) {
+        return status;
+    }
+    seq_num = srtp_rdb_get_value(&stream->rtcp_rdb);
+    trailer |= htonl(seq_num);
+    debug_print(mod_srtp, "srtcp index: %x", (unsigned int)seq_num);
+
+    memcpy(trailer_p, &trailer, sizeof(trailer));
+
+    /*
+     * if we're using rindael counter mode, set nonce and seq
+     */
+    if (session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_128 ||
+        session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_192 ||
+        session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_256) {
+        v128_t iv;
+
+        iv.v32[0] = 0;
+        iv.v32[1] = hdr->ssrc; /* still in network order! */
+        iv.v32[2] = htonl(seq_num >> 16);
+        iv.v32[3] = htonl(seq_num << 16);
+        status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_encrypt);
+
+    } else {
+        v128_t iv;
+
+        /* otherwise, just set the index to seq_num */
+        iv.v32[0] = 0;
+        iv.v32[1] = 0;
+        iv.v32[2] = 0;
+        iv.v32[3] = htonl(seq_num);
+        status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_encrypt);
+    }
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+
+    /*
+     * if we're authenticating using a universal hash, put the keystream
+     * prefix into the authentication tag
+     */
+
+    /* if auth_start is non-null, then put keystream into tag  */
+    if (auth_start) {
+        /* put keystream prefix into auth_tag */
+        prefix_len = srtp_auth_get_prefix_length(session_keys->rtcp_auth);
+        status = srtp_cipher_output(session_keys->rtcp_cipher, auth_tag,
+                                    &prefix_len);
+
+        debug_print(mod_srtp, "keystream prefix: %s",
+                    srtp_octet_string_hex_string(auth_tag, prefix_len));
+
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+    }
+
+    /* if we're encrypting, exor keystream into the message */
+    if (stream->rtcp_services & sec_serv_conf) {
+        status = srtp_cipher_encrypt(session_keys->rtcp_cipher,
+                                     rtcp + enc_start, enc_octet_len,
+                                     srtcp + enc_start, &enc_octet_len);
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+    } else if (rtcp != srtcp) {
+        /* if no encryption and not-inplace then need to copy rest of packet */
+        memcpy(srtcp + enc_start, rtcp + enc_start, enc_octet_len);
+    }
+
+    /* initialize auth func context */
+    status = srtp_auth_start(session_keys->rtcp_auth);
+    if (status) {
+        return status;
+    }
+
+    /*
+     * run auth func over packet (including trailer), and write the
+     * result at auth_tag
+     */
+    status = srtp_auth_compute(session_keys->rtcp_auth, auth_start,
+                               rtcp_len + sizeof(srtcp_trailer_t), auth_tag);
+    debug_print(mod_srtp, "srtcp auth tag:    %s",
+                srtp_octet_string_hex_string(auth_tag, tag_len));
+    if (status) {
+        return srtp_err_status_auth_fail;
+    }
+
+    *srtcp_len = enc_start + enc_octet_len;
+
+    /* increase the packet length by the length of the auth tag and seq_num*/
+    *srtcp_len += (tag_len + sizeof(srtcp_trailer_t));
+
+    /* increase the packet by the mki_size */
+    *srtcp_len += stream->mki_size;
+    srtp_session_use_stream(ctx, stream);
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_unprotect_rtcp(srtp_t ctx,
+                                      const uint8_t *srtcp,
+                                      size_t srtcp_len,
+                                      uint8_t *rtcp,
+                                      size_t *rtcp_len)
+{
+    const srtcp_hdr_t *hdr = (const srtcp_hdr_t *)srtcp;
+    size_t enc_start;               /* pointer to start of encrypted portion  */
+    const uint8_t *auth_start;      /* pointer to start of auth. portion      */
+    const uint8_t *trailer_p;       /* pointer to start of trailer            */
+    uint32_t trailer;               /* trailer value                          */
+    size_t enc_octet_len = 0;       /* number of octets in encrypted portion  */
+    const uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
+    uint8_t tmp_tag[SRTP_MAX_TAG_LEN];
+    srtp_err_status_t status;
+    size_t auth_len;
+    size_t tag_len;
+    srtp_stream_ctx_t *stream;
+    size_t prefix_len;
+    uint32_t seq_num;
+    bool e_bit_in_packet;          /* E-bit was found in the packet */
+    bool sec_serv_confidentiality; /* whether confidentiality was requested */
+    srtp_session_keys_t *session_keys = NULL;
+
+    /*
+     * check that the length value is sane; we'll check again once we
+     * know the tag length, but we at least want to know that it is
+     * a positive value
+     */
+    if (srtcp_len < octets_in_rtcp_header + sizeof(srtcp_trailer_t)) {
+        return srtp_err_status_bad_param;
+    }
+
+    /*
+     * look up ssrc in srtp_stream list, and process the packet with
+     * the appropriate stream.  if we haven't seen this stream before,
+     * there's only one key for this srtp_session, and the cipher
+     * supports key-sharing, then we assume that a new stream using
+     * that key has just started up
+     */
+    stream = srtp_get_stream(ctx, hdr->ssrc);
+    if (stream == NULL) {
+        if (ctx->stream_template != NULL) {
+            stream = ctx->stream_template;
+
+            debug_print(mod_srtp,
+                        "srtcp using provisional stream (SSRC: 0x%08x)",
+                        (unsigned int)ntohl(hdr->ssrc));
+        } else {
+            /* no template stream, so we return an error */
+            return srtp_err_status_no_ctx;
+        }
+    }
+
+    /*
+     * Determine if MKI is being used and what session keys should be used
+     */
+    status = srtp_get_session_keys_for_rtcp_packet(stream, srtcp, srtcp_len,
+                                                   &session_keys);
+    if (status) {
+        return status;
+    }
+
+    /* get tag length from stream context */
+    tag_len = srtp_auth_get_tag_length(session_keys->rtcp_auth);
+
+    /* check the packet length - it must contain at least a full RTCP
+       header, an auth tag (if applicable), and the SRTCP encrypted flag
+       and 31-bit index value */
+    if (srtcp_len < octets_in_rtcp_header + sizeof(srtcp_trailer_t) +
+                        stream->mki_size + tag_len) {
+        return srtp_err_status_bad_param;
+    }
+
+    /*
+     * Check if this is an AEAD stream (GCM mode).  If so, then dispatch
+     * the request to our AEAD handler.
+     */
+    if (session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_128 ||
+        session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_256) {
+        status = srtp_unprotect_rtcp_aead(ctx, stream, srtcp, srtcp_len, rtcp,
+                                          rtcp_len, session_keys);
+        /* a new stream was marked as used when it was cloned */
+        if (status == srtp_err_status_ok && stream != ctx->stream_template) {
+            srtp_session_use_stream(ctx, stream);
+        }
+        return status;
+    }
+
+    sec_serv_confidentiality = stream->rtcp_services == sec_serv_conf ||
+                               stream->rtcp_services == sec_serv_conf_and_auth;
+
+    /*
+     * set encryption start, encryption length, and trailer
+     */
+    enc_start = octets_in_rtcp_header;
+    enc_octet_len = srtcp_len - (octets_in_rtcp_header + tag_len +
+                                 stream->mki_size + sizeof(srtcp_trailer_t));
+    /*
+     *index & E (encryption) bit follow normal data. hdr->len is the number of
+     * words (32-bit) in the normal packet minus 1
+     */
+    /* This should point trailer to the word past the end of the normal data. */
+    /* This would need to be modified for optional mikey data */
+    trailer_p = srtcp + srtcp_len -
+                (tag_len + stream->mki_size + sizeof(srtcp_trailer_t));
+    memcpy(&trailer, trailer_p, sizeof(trailer));
+
+    e_bit_in_packet = (*trailer_p & SRTCP_E_BYTE_BIT) == SRTCP_E_BYTE_BIT;
+    if (e_bit_in_packet != sec_serv_confidentiality) {
+        return srtp_err_status_cant_check;
+    }
+
+    /*
+     * set the auth_start and auth_tag pointers to the proper locations
+     * (note that srtcp *always* uses authentication, unlike srtp)
+     */
+    auth_start = srtcp;
+
+    /*
+     * The location of the auth tag in the packet needs to know MKI
+     * could be present.  The data needed to calculate the Auth tag
+     * must not include the MKI
+     */
+    auth_len = srtcp_len - tag_len - stream->mki_size;
+    auth_tag = srtcp + auth_len + stream->mki_size;
+
+    /*
+     * check the sequence number for replays
+     */
+    /* this is easier than dealing with bitfield access */
+    seq_num = ntohl(trailer) & SRTCP_INDEX_MASK;
+    debug_print(mod_srtp, "srtcp index: %x", (unsigned int)seq_num);
+    status = srtp_rdb_check(&stream->rtcp_rdb, seq_num);
+    if (status) {
+        return status;
+    }
+
+    /*
+     * if we're using aes counter mode, set nonce and seq
+     */
+    if (session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_128 ||
+        session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_192 ||
+        session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_256) {
+        v128_t iv;
+
+        iv.v32[0] = 0;
+        iv.v32[1] = hdr->ssrc; /* still in network order! */
+        iv.v32[2] = htonl(seq_num >> 16);
+        iv.v32[3] = htonl(seq_num << 16);
+        status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_decrypt);
+
+    } else {
+        v128_t iv;
+
+        /* otherwise, just set the index to seq_num */
+        iv.v32[0] = 0;
+        iv.v32[1] = 0;
+        iv.v32[2] = 0;
+        iv.v32[3] = htonl(seq_num);
+        status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_decrypt);
+    }
+    if (status) {
+        return srtp_err_status_cipher_fail;
+    }
+
+    /*
+     * if we're authenticating using a universal hash, put the keystream
+     * prefix into the authentication tag
+     */
+    prefix_len = srtp_auth_get_prefix_length(session_keys->rtcp_auth);
+    if (prefix_len) {
+        status =
+            srtp_cipher_output(session_keys->rtcp_cipher, tmp_tag, &prefix_len);
+        debug_print(mod_srtp, "keystream prefix: %s",
+                    srtp_octet_string_hex_string(tmp_tag, prefix_len));
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+    }
+
+    /* initialize auth func context */
+    status = srtp_auth_start(session_keys->rtcp_auth);
+    if (status) {
+        return status;
+    }
+
+    /* run auth func over packet, put result into tmp_tag */
+    status = srtp_auth_compute(session_keys->rtcp_auth, auth_start, auth_len,
+                               tmp_tag);
+    debug_print(mod_srtp, "srtcp computed tag:       %s",
+                srtp_octet_string_hex_string(tmp_tag, tag_len));
+    if (status) {
+        return srtp_err_status_auth_fail;
+    }
+
+    /* compare the tag just computed with the one in the packet */
+    debug_print(mod_srtp, "srtcp tag from packet:    %s",
+                srtp_octet_string_hex_string(auth_tag, tag_len));
+    if (!srtp_octet_string_equal(tmp_tag, auth_tag, tag_len)) {
+        return srtp_err_status_auth_fail;
+    }
+
+    /* check output length */
+    if (*rtcp_len <
+        srtcp_len - sizeof(srtcp_trailer_t) - stream->mki_size - tag_len) {
+        return srtp_err_status_buffer_small;
+    }
+
+    /* if not inplace need to copy rtcp header */
+    if (srtcp != rtcp) {
+        memcpy(rtcp, srtcp, enc_start);
+    }
+
+    /* if we're decrypting, exor keystream into the message */
+    if (sec_serv_confidentiality) {
+        status = srtp_cipher_decrypt(session_keys->rtcp_cipher,
+                                     srtcp + enc_start, enc_octet_len,
+                                     rtcp + enc_start, &enc_octet_len);
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
+    } else if (srtcp != rtcp) {
+        /* if no encryption and not-inplace then need to copy rest of packet */
+        memcpy(rtcp + enc_start, srtcp + enc_start, enc_octet_len);
+    }
+
+    *rtcp_len = srtcp_len;
+
+    /* decrease the packet length by the length of the auth tag and seq_num */
+    *rtcp_len -= (tag_len + sizeof(srtcp_trailer_t));
+
+    /* decrease the packet length by the length of the mki_size */
+    *rtcp_len -= stream->mki_size;
+
+    /*
+     * verify that stream is for received traffic - this check will
+     * detect SSRC collisions, since a stream that appears in both
+     * srtp_protect() and srtp_unprotect() will fail this test in one of
+     * those functions.
+     *
+     * we do this check *after* the authentication check, so that the
+     * latter check will catch any attempts to fool us into thinking
+     * that we've got a collision
+     */
+    if (stream->direction != dir_srtp_receiver) {
+        if (stream->direction == dir_unknown) {
+            stream->direction = dir_srtp_receiver;
+        } else {
+            srtp_handle_event(ctx, stream, event_ssrc_collision);
+        }
+    }
+
+    /*
+     * if the stream is a 'provisional' one, in which the template context
+     * is used, then we need to allocate a new stream at this point, since
+     * the authentication passed
+     */
+    if (stream == ctx->stream_template) {
+        srtp_stream_ctx_t *new_stream;
+
+        /*
+         * allocate and initialize a new stream, and add it to the list
+         *
+         * note that we indicate failure if we can't allocate the new
+         * stream, and some implementations will want to not return
+         * failure here
+         */
+        status = srtp_session_clone_stream(ctx, hdr->ssrc, &new_stream);
+        if (status) {
+            return status;
+        }
+
+        /* set stream (the pointer used in this function) */
+        stream = new_stream;
+    }
+
+    /* we've passed the authentication check, so add seq_num to the rdb */
+    srtp_rdb_add_index(&stream->rtcp_rdb, seq_num);
+    srtp_session_use_stream(ctx, stream);
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * user data within srtp_t context
+ */
+
+void srtp_set_user_data(srtp_t ctx, void *data)
+{
+    ctx->user_data = data;
+}
+
+void *srtp_get_user_data(srtp_t ctx)
+{
+    return ctx->user_data;
+}
+
+/*
+ * worker pool
+ */
+
+#ifdef HAVE_PTHREAD_H
+
+/*
+ * an srtp_async_job_t is a packet submitted with srtp_protect_async() or
+ * srtp_unprotect_async().  It waits in the queue of its session until it
+ * is started, in packet order.  A packet of a stream with the compiled
+ * ICM/HMAC handlers is then encrypted and authenticated, or verified and
+ * decrypted, by any worker on copies of the cipher and auth function of
+ * the stream, and finished in packet order again.  Any other packet is
+ * run whole by srtp_protect() or srtp_unprotect() once the packets before
+ * it are finished.  Finished jobs wait in the completion queue of the
+ * pool, and go back to its free list once their completion is taken.
+ */
+typedef enum {
+    srtp_job_queued, /* not started yet                      */
+    srtp_job_crypt,  /* in the crypt queue, or being crypted */
+    srtp_job_done    /* waiting to be finished               */
+} srtp_job_stage_t;
+
+typedef struct srtp_async_job_t {
+    struct srtp_async_job_t *next; /* in the session, then the pool */
+    struct srtp_async_job_t *crypt_next;
+    srtp_t session;
+    bool protect;
+    const uint8_t *in;
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len; /* room in out, then the length of the result */
+    size_t mki_index;
+    void *user_data;
+    srtp_job_stage_t stage;
+    srtp_stream_ctx_t *stream; /* NULL if the job runs whole */
+    srtp_icm_hmac_pkt_t pkt;
+    srtp_cipher_t *cipher; /* copies of those of the stream, */
+    srtp_auth_t *auth;     /* kept for the next packets      */
+    bool crypted;          /* crypted with pkt.est           */
+    srtp_err_status_t status;
+} srtp_async_job_t;
+
+/*
+ * the sessions that have jobs to start or finish wait in the run queue of
+ * the pool; a worker takes a session off it and finishes and starts its
+ * jobs without the lock, so that only one worker at a time uses its
+ * streams.  Started jobs wait in the crypt queue, which any worker takes
+ * from.  A session starts at most SRTP_ASYNC_BATCH jobs at a time before
+ * it goes back to the end of the run queue.
+ */
+#define SRTP_ASYNC_BATCH 16
+
+typedef struct srtp_worker_pool_ctx_t_ {
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* a queue is not empty, or stopping */
+    pthread_cond_t done;    /* jobs have been finished           */
+    srtp_async_job_t *jobs; /* capacity jobs                     */
+    size_t capacity;
+    srtp_async_job_t *free_jobs;
+    srtp_async_job_t *completed_head;
+    srtp_async_job_t *completed_tail;
+    srtp_async_job_t *crypt_head;
+    srtp_async_job_t *crypt_tail;
+    srtp_t run_head;
+    srtp_t run_tail;
+    size_t num_outstanding; /* jobs submitted and not yet finished */
+    size_t num_sessions;    /* sessions attached to the pool       */
+    bool stopping;
+    size_t num_workers; /* threads started */
+    pthread_t *workers;
+} srtp_worker_pool_ctx_t_;
+
+static void srtp_async_drop_keys(srtp_async_job_t *job)
+{
+    if (job->cipher != NULL) {
+        srtp_cipher_dealloc(job->cipher);
+        job->cipher = NULL;
+    }
+    if (job->auth != NULL) {
+        srtp_auth_dealloc(job->auth);
+        job->auth = NULL;
+    }
+}
+
+/*
+ * srtp_async_copy_keys(job, session_keys) gives job copies of the RTP
+ * cipher and auth function of session_keys, reusing those it already has
+ * if they are of the same kind
+ */
+static srtp_err_status_t srtp_async_copy_keys(
+    srtp_async_job_t *job,
+    const srtp_session_keys_t *session_keys)
+{
+    const srtp_cipher_t *cipher = session_keys->rtp_cipher;
+    const srtp_auth_t *auth = session_keys->rtp_auth;
+    srtp_err_status_t status;
+
+    if (cipher->type->copy == NULL || auth->type->copy == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    if (job->cipher != NULL &&
+        (job->cipher->type->copy != cipher->type->copy ||
+         job->cipher->key_len != cipher->key_len)) {
+        srtp_cipher_dealloc(job->cipher);
+        job->cipher = NULL;
+    }
+    if (job->cipher == NULL) {
+        status = srtp_cipher_type_alloc(cipher->type, &job->cipher,
+                                        cipher->key_len, 0);
+        if (status) {
+            job->cipher = NULL;
+            return status;
+        }
+    }
+
+    if (job->auth != NULL && (job->auth->type->copy != auth->type->copy ||
+                              job->auth->key_len != auth->key_len ||
+                              job->auth->out_len != auth->out_len)) {
+        srtp_auth_dealloc(job->auth);
+        job->auth = NULL;
+    }
+    if (job->auth == NULL) {
+        status = srtp_auth_type_alloc(auth->type, &job->auth, auth->key_len,
+                                      auth->out_len);
+        if (status) {
+            job->auth = NULL;
+            return status;
+        }
+    }
+
+    status = srtp_cipher_copy(job->cipher, cipher);
+    if (status) {
+        return status;
+    }
+    return srtp_auth_copy(job->auth, auth);
+}
+
+/* srtp_async_run(job) runs a job whole */
+static void srtp_async_run(srtp_async_job_t *job)
+{
+    size_t len = job->out_len;
+
+    if (job->protect) {
+        job->status = srtp_protect(job->session, job->in, job->in_len,
+                                   job->out, &len, job->mki_index);
+    } else {
+        job->status = srtp_unprotect(job->session, job->in, job->in_len,
+                                     job->out, &len);
+    }
+    job->out_len = job->status == srtp_err_status_ok ? len : 0;
+}
+
+/*
+ * srtp_async_start(job) does what srtp_protect() or srtp_unprotect() does
+ * with the stream of a packet before the cipher and auth function, and
+ * leaves the job to be crypted, or done if that failed.  It returns false,
+ * without touching the session, if the job has to run whole.
+ */
+static bool srtp_async_start(srtp_async_job_t *job)
+{
+    srtp_t session = job->session;
+    const srtp_hdr_t *hdr = (const srtp_hdr_t *)job->in;
+    srtp_stream_ctx_t *stream;
+
+    if (srtp_validate_rtp_header(job->in, job->in_len) ||
+        job->in_len < octets_in_rtp_header) {
+        return false;
+    }
+
+    stream = srtp_get_stream(session, hdr->ssrc);
+    if (stream == NULL ||
+        (job->protect ? stream->rtp_protect != srtp_protect_icm_hmac
+                      : stream->rtp_unprotect != srtp_unprotect_icm_hmac) ||
+        srtp_async_copy_keys(job, &stream->session_keys[0])) {
+        return false;
+    }
+
+    job->stream = stream;
+    if (job->protect) {
+        if (stream->direction != dir_srtp_sender) {
+            if (stream->direction == dir_unknown) {
+                stream->direction = dir_srtp_sender;
+            } else {
+                srtp_handle_event(session, stream, event_ssrc_collision);
+            }
+        }
+        job->status = srtp_protect_icm_hmac_start(
+            session, stream, job->in, job->in_len, job->out_len, &job->pkt);
+        job->stage = job->status ? srtp_job_done : srtp_job_crypt;
+        return true;
+    }
+
+    /*
+     * the index of a received packet can only be estimated now, as the
+     * packets before it may not be in the replay database yet; it is
+     * checked when the job is finished
+     */
+    job->stage = srtp_job_done;
+    job->status = srtp_unprotect_icm_hmac_lengths(
+        stream, job->in, job->in_len, job->out_len, &job->pkt);
+    if (job->status == srtp_err_status_ok) {
+        srtp_err_status_t status = srtp_get_est_pkt_index(
+            hdr, stream, &job->pkt.est, &job->pkt.delta);
+        if (status == srtp_err_status_ok ||
+            status == srtp_err_status_pkt_idx_adv) {
+            job->stage = srtp_job_crypt;
+        }
+    }
+
+    return true;
+}
+
+/* srtp_async_crypt(job) runs the cipher and auth function of a job */
+static void srtp_async_crypt(srtp_async_job_t *job)
+{
+    if (job->protect) {
+        job->status = srtp_protect_icm_hmac_crypt(job->cipher, job->auth,
+                                                  job->in, job->out, &job->pkt);
+        return;
+    }
+
+    job->crypted = true;
+    job->status =
+        srtp_unprotect_icm_hmac_verify(job->auth, job->in, &job->pkt);
+    if (job->status == srtp_err_status_ok) {
+        job->status = srtp_unprotect_icm_hmac_decrypt(job->cipher, job->in,
+                                                      job->out, &job->pkt);
+    }
+}
+
+/*
+ * srtp_async_finish(job) finishes a started job once the jobs before it
+ * are finished.  The index of a received packet is checked against the
+ * replay database, and added to it, only now that the packets before it
+ * have been; if it is not the index the packet was crypted with, e.g.
+ * across a ROC change, the packet is verified and decrypted again.  The
+ * payload of a packet that is rejected after it was decrypted is wiped.
+ */
+static void srtp_async_finish(srtp_async_job_t *job)
+{
+    srtp_t session = job->session;
+    srtp_stream_ctx_t *stream = job->stream;
+    srtp_icm_hmac_pkt_t *pkt = &job->pkt;
+    srtp_xtd_seq_num_t est = pkt->est;
+    srtp_err_status_t status;
+    bool decrypted;
+
+    if (job->protect || (job->status && !job->crypted)) {
+        if (job->status) {
+            job->out_len = 0;
+            return;
+        }
+        srtp_session_use_stream(session, stream);
+        job->out_len = pkt->enc_start + pkt->enc_octet_len + pkt->tag_len;
+        return;
+    }
+
+    status = srtp_unprotect_icm_hmac_index(stream, job->in, pkt);
+    if (status == srtp_err_status_ok && (!job->crypted || pkt->est != est)) {
+        srtp_async_crypt(job);
+    }
+    decrypted = job->crypted && job->status == srtp_err_status_ok;
+    if (status == srtp_err_status_ok) {
+        status = job->status;
+    }
+    if (status == srtp_err_status_ok) {
+        status = srtp_icm_hmac_key_limit(session, stream);
+    }
+    if (status == srtp_err_status_ok) {
+        status = srtp_unprotect_icm_hmac_finish(session, stream, pkt);
+    }
+
+    job->status = status;
+    if (status) {
+        if (decrypted) {
+            octet_string_set_to_zero(job->out + pkt->enc_start,
+                                     pkt->enc_octet_len);
+        }
+        job->out_len = 0;
+        return;
+    }
+
+    srtp_session_use_stream(session, stream);
+    job->out_len = pkt->enc_start + pkt->enc_octet_len;
+}
+
+static void srtp_worker_pool_schedule(srtp_worker_pool_t pool, srtp_t session)
+{
+    session->async_next = NULL;
+    if (pool->run_tail != NULL) {
+        pool->run_tail->async_next = session;
+    } else {
+        pool->run_head = session;
+    }
+    pool->run_tail = session;
+}
+
+/*
+ * srtp_async_run_session(pool, session) is called, with the lock held, by
+ * the worker that took session off the run queue.  It finishes the done
+ * jobs at the head of the session, then starts its next jobs, up to
+ * SRTP_ASYNC_BATCH of them, but stops at one that has to run whole while
+ * jobs before it are not finished.
+ */
+static void srtp_async_run_session(srtp_worker_pool_t pool, srtp_t session)
+{
+    srtp_async_job_t *head = session->async_head;
+    srtp_async_job_t *start = session->async_start;
+    srtp_async_job_t *job;
+    srtp_async_job_t *finished = NULL; /* the last job finished */
+    srtp_async_job_t *started = NULL;  /* the last job started  */
+    srtp_async_job_t *crypt_head = NULL;
+    srtp_async_job_t *crypt_tail = NULL;
+    size_t num_finish = 0;
+    size_t num_finished = 0;
+    size_t num_start = 0;
+    size_t running;
+    bool blocked = false;
+
+    for (job = head; job != start && job->stage == srtp_job_done;
+         job = job->next) {
+        num_finish++;
+    }
+    for (job = start; job != NULL && num_start < SRTP_ASYNC_BATCH;
+         job = job->next) {
+        num_start++;
+    }
+    running = session->async_running - num_finish;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* only the links between the jobs counted above are stable now */
+    job = head;
+    for (; num_finished < num_finish; num_finished++) {
+        srtp_async_finish(job);
+        finished = job;
+        if (num_finished + 1 < num_finish) {
+            job = job->next;
+        }
+    }
+
+    job = start;
+    for (size_t i = 0; i < num_start; i++) {
+        if (srtp_async_start(job)) {
+            if (job->stage == srtp_job_crypt) {
+                job->crypt_next = NULL;
+                if (crypt_tail != NULL) {
+                    crypt_tail->crypt_next = job;
+                } else {
+                    crypt_head = job;
+                }
+                crypt_tail = job;
+                running++;
+            } else if (running == 0) {
+                srtp_async_finish(job);
+                finished = job;
+                num_finished++;
+            } else {
+                running++;
+            }
+        } else if (running == 0) {
+            job->stream = NULL;
+            srtp_async_run(job);
+            job->stage = srtp_job_done;
+            finished = job;
+            num_finished++;
+        } else {
+            blocked = true;
+            break;
+        }
+        started = job;
+        if (i + 1 < num_start) {
+            job = job->next;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (started != NULL) {
+        session->async_start = started->next;
+    }
+    if (finished != NULL) {
+        session->async_head = finished->next;
+        if (session->async_head == NULL) {
+            session->async_tail = NULL;
+        }
+        finished->next = NULL;
+        if (pool->completed_tail != NULL) {
+            pool->completed_tail->next = head;
+        } else {
+            pool->completed_head = head;
+        }
+        pool->completed_tail = finished;
+        pool->num_outstanding -= num_finished;
+        session->async_jobs -= num_finished;
+        pthread_cond_broadcast(&pool->done);
+    }
+    session->async_running = running;
+
+    if (crypt_head != NULL) {
+        if (pool->crypt_tail != NULL) {
+            pool->crypt_tail->crypt_next = crypt_head;
+        } else {
+            pool->crypt_head = crypt_head;
+        }
+        pool->crypt_tail = crypt_tail;
+        pthread_cond_broadcast(&pool->work);
+    }
+
+    if ((session->async_head != NULL &&
+         session->async_head->stage == srtp_job_done &&
+         session->async_head != session->async_start) ||
+        (session->async_start != NULL && (!blocked || running == 0))) {
+        srtp_worker_pool_schedule(pool, session);
+        pthread_cond_signal(&pool->work);
+    } else {
+        session->async_scheduled = false;
+    }
+}
+
+static void *srtp_worker_main(void *arg)
+{
+    srtp_worker_pool_t pool = (srtp_worker_pool_t)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        srtp_async_job_t *job;
+        srtp_t session;
+
+        while (pool->run_head == NULL && pool->crypt_head == NULL &&
+               !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+
+        if (pool->run_head != NULL) {
+            session = pool->run_head;
+            pool->run_head = session->async_next;
+            if (pool->run_head == NULL) {
+                pool->run_tail = NULL;
+            }
+            srtp_async_run_session(pool, session);
+            continue;
+        }
+
+        if (pool->crypt_head == NULL) {
+            break;
+        }
+
+        job = pool->crypt_head;
+        pool->crypt_head = job->crypt_next;
+        if (pool->crypt_head == NULL) {
+            pool->crypt_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        srtp_async_crypt(job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->stage = srtp_job_done;
+        session = job->session;
+        if (job == session->async_head && !session->async_scheduled) {
+            session->async_scheduled = true;
+            srtp_worker_pool_schedule(pool, session);
+            pthread_cond_signal(&pool->work);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * srtp_worker_pool_stop(pool) stops the workers that were started and
+ * frees pool
+ */
+static void srtp_worker_pool_stop(srtp_worker_pool_t pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    for (size_t i = 0; i < pool->capacity; i++) {
+        srtp_async_drop_keys(&pool->jobs[i]);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    srtp_crypto_free(pool->workers);
+    srtp_crypto_free(pool->jobs);
+    srtp_crypto_free(pool);
+}
+
+srtp_err_status_t srtp_worker_pool_create(srtp_worker_pool_t *pool,
+                                          size_t num_workers,
+                                          size_t capacity)
+{
+    srtp_worker_pool_t p;
+
+    if (pool == NULL || num_workers == 0 || capacity == 0 ||
+        capacity > SIZE_MAX / sizeof(srtp_async_job_t) ||
+        num_workers > SIZE_MAX / sizeof(pthread_t)) {
+        return srtp_err_status_bad_param;
+    }
+    *pool = NULL;
+
+    p = (srtp_worker_pool_t)srtp_crypto_alloc(sizeof(srtp_worker_pool_ctx_t));
+    if (p == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    p->jobs = (srtp_async_job_t *)srtp_crypto_alloc(sizeof(srtp_async_job_t) *
+                                                    capacity);
+    p->workers =
+        (pthread_t *)srtp_crypto_alloc(sizeof(pthread_t) * num_workers);
+    if (p->jobs == NULL || p->workers == NULL) {
+        srtp_crypto_free(p->workers);
+        srtp_crypto_free(p->jobs);
+        srtp_crypto_free(p);
+        return srtp_err_status_alloc_fail;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        p->jobs[i].next = i + 1 < capacity ? &p->jobs[i + 1] : NULL;
+    }
+    p->free_jobs = &p->jobs[0];
+    p->capacity = capacity;
+
+    if (pthread_mutex_init(&p->lock, NULL)) {
+        srtp_crypto_free(p->workers);
+        srtp_crypto_free(p->jobs);
+        srtp_crypto_free(p);
+        return srtp_err_status_fail;
+    }
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (; p->num_workers < num_workers; p->num_workers++) {
+        if (pthread_create(&p->workers[p->num_workers], NULL,
+                           srtp_worker_main, p)) {
+            srtp_worker_pool_stop(p);
+            return srtp_err_status_fail;
+        }
+    }
+
+    debug_print(mod_srtp, "started %zu workers", num_workers);
+    *pool = p;
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_worker_pool_dealloc(srtp_worker_pool_t pool)
+{
+    size_t num_sessions;
+
+    if (pool == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    num_sessions = pool->num_sessions;
+    pthread_mutex_unlock(&pool->lock);
+    if (num_sessions != 0) {
+        return srtp_err_status_fail;
+    }
+
+    srtp_worker_pool_stop(pool);
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_set_worker_pool(srtp_t session,
+                                       srtp_worker_pool_t pool)
+{
+    srtp_worker_pool_t old_pool;
+
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    old_pool = session->worker_pool;
+    if (old_pool == pool) {
+        return srtp_err_status_ok;
+    }
+
+    if (old_pool != NULL) {
+        pthread_mutex_lock(&old_pool->lock);
+        while (session->async_jobs != 0) {
+            pthread_cond_wait(&old_pool->done, &old_pool->lock);
+        }
+        /*
+         * the completions it has not collected no longer point to the
+         * session, which may be freed, and no job keeps its keys
+         */
+        for (size_t i = 0; i < old_pool->capacity; i++) {
+            srtp_async_job_t *job = &old_pool->jobs[i];
+
+            if (job->session == session) {
+                job->session = NULL;
+                srtp_async_drop_keys(job);
+            }
+        }
+        old_pool->num_sessions--;
+        pthread_mutex_unlock(&old_pool->lock);
+    }
+
+    session->worker_pool = pool;
+    if (pool != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->num_sessions++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return srtp_err_status_ok;
+}
+
+static srtp_err_status_t srtp_async_submit(srtp_t ctx,
+                                           bool protect,
+                                           const uint8_t *in,
+                                           size_t in_len,
+                                           uint8_t *out,
+                                           size_t out_len,
+                                           size_t mki_index,
+                                           void *user_data)
+{
+    srtp_worker_pool_t pool;
+    srtp_async_job_t *job;
+
+    if (ctx == NULL || ctx->worker_pool == NULL || in == NULL ||
+        out == NULL) {
+        return srtp_err_status_bad_param;
+    }
+    pool = ctx->worker_pool;
+
+    pthread_mutex_lock(&pool->lock);
+    job = pool->free_jobs;
+    if (job == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        return srtp_err_status_alloc_fail;
+    }
+    pool->free_jobs = job->next;
+
+    job->next = NULL;
+    job->session = ctx;
+    job->protect = protect;
+    job->in = in;
+    job->in_len = in_len;
+    job->out = out;
+    job->out_len = out_len;
+    job->mki_index = mki_index;
+    job->user_data = user_data;
+    job->stage = srtp_job_queued;
+    job->stream = NULL;
+    job->crypted = false;
+
+    if (ctx->async_tail != NULL) {
+        ctx->async_tail->next = job;
+    } else {
+        ctx->async_head = job;
+    }
+    ctx->async_tail = job;
+    if (ctx->async_start == NULL) {
+        ctx->async_start = job;
+    }
+    ctx->async_jobs++;
+    pool->num_outstanding++;
+
+    if (!ctx->async_scheduled) {
+        ctx->async_scheduled = true;
+        srtp_worker_pool_schedule(pool, ctx);
+        pthread_cond_signal(&pool->work);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_protect_async(srtp_t ctx,
+                                     const uint8_t *rtp,
+                                     size_t rtp_len,
+                                     uint8_t *srtp,
+                                     size_t srtp_len,
+                                     size_t mki_index,
+                                     void *user_data)
+{
+    return srtp_async_submit(ctx, true, rtp, rtp_len, srtp, srtp_len,
+                             mki_index, user_data);
+}
+
+srtp_err_status_t srtp_unprotect_async(srtp_t ctx,
+                                       const uint8_t *srtp,
+                                       size_t srtp_len,
+                                       uint8_t *rtp,
+                                       size_t rtp_len,
+                                       void *user_data)
+{
+    return srtp_async_submit(ctx, false, srtp, srtp_len, rtp, rtp_len, 0,
+                             user_data);
+}
+
+srtp_err_status_t srtp_poll_completions(srtp_worker_pool_t pool,
+                                        srtp_completion_t *completions,
+                                        size_t *num_completions,
+                                        bool wait)
+{
+    size_t n = 0;
+
+    if (pool == NULL || num_completions == NULL ||
+        (completions == NULL && *num_completions != 0)) {
+        return srtp_err_status_bad_param;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (wait) {
+        while (pool->completed_head == NULL && pool->num_outstanding != 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+    }
+    while (n < *num_completions && pool->completed_head != NULL) {
+        srtp_async_job_t *job = pool->completed_head;
+
+        pool->completed_head = job->next;
+        completions[n].session = job->session;
+        completions[n].user_data = job->user_data;
+        completions[n].packet = job->out;
+        completions[n].len = job->out_len;
+        completions[n].status = job->status;
+        n++;
+
+        job->next = pool->free_jobs;
+        pool->free_jobs = job;
+    }
+    if (pool->completed_head == NULL) {
+        pool->completed_tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    *num_completions = n;
+
+    return srtp_err_status_ok;
+}
+
+#else /* HAVE_PTHREAD_H */
+
+srtp_err_status_t srtp_worker_pool_create(srtp_worker_pool_t *pool,
+                                          size_t num_workers,
+                                          size_t capacity)
+{
+    (void)num_workers;
+    (void)capacity;
+
+    if (pool != NULL) {
+        *pool = NULL;
+    }
+
+    return srtp_err_status_fail;
+}
+
+srtp_err_status_t srtp_worker_pool_dealloc(srtp_worker_pool_t pool)
+{
+    (void)pool;
+
+    return srtp_err_status_fail;
+}
+
+srtp_err_status_t srtp_set_worker_pool(srtp_t session,
+                                       srtp_worker_pool_t pool)
+{
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    /* there are no pools, but detaching from none must work */
+    return pool == NULL ? srtp_err_status_ok : srtp_err_status_fail;
+}
+
+srtp_err_status_t srtp_protect_async(srtp_t ctx,
+                                     const uint8_t *rtp,
+                                     size_t rtp_len,
+                                     uint8_t *srtp,
+                                     size_t srtp_len,
+                                     size_t mki_index,
+                                     void *user_data)
+{
+    (void)ctx;
+    (void)rtp;
+    (void)rtp_len;
+    (void)srtp;
+    (void)srtp_len;
+    (void)mki_index;
+    (void)user_data;
+
+    return srtp_err_status_bad_param;
+}
+
+srtp_err_status_t srtp_unprotect_async(srtp_t ctx,
+                                       const uint8_t *srtp,
+                                       size_t srtp_len,
+                                       uint8_t *rtp,
+                                       size_t rtp_len,
+                                       void *user_data)
+{
+    (void)ctx;
+    (void)srtp;
+    (void)srtp_len;
+    (void)rtp;
+    (void)rtp_len;
+    (void)user_data;
+
+    return srtp_err_status_bad_param;
+}
+
+srtp_err_status_t srtp_poll_completions(srtp_worker_pool_t pool,
+                                        srtp_completion_t *completions,
+                                        size_t *num_completions,
+                                        bool wait)
+{
+    (void)pool;
+    (void)completions;
+    (void)wait;
+
+    if (num_completions != NULL) {
+        *num_completions = 0;
+    }
+
+    return srtp_err_status_bad_param;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+srtp_err_status_t srtp_crypto_policy_set_from_profile_for_rtp(
+    srtp_crypto_policy_t *policy,
+    srtp_profile_t profile)
+{
+    /* set SRTP policy from the SRTP profile in the key set */
+    switch (profile) {
+    case srtp_profile_aes128_cm_sha1_80:
+        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(policy);
+        break;
+    case srtp_profile_aes128_cm_sha1_32:
+        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_32(policy);
+        break;
+    case srtp_profile_null_sha1_80:
+        srtp_crypto_policy_set_null_cipher_hmac_sha1_80(policy);
+        break;
+#ifdef GCM
+    case srtp_profile_aead_aes_128_gcm:
+        srtp_crypto_policy_set_aes_gcm_128_16_auth(policy);
+        break;
+    case srtp_profile_aead_aes_256_gcm:
+        srtp_crypto_policy_set_aes_gcm_256_16_auth(policy);
+        break;
+    case srtp_profile_double_aead_aes_128_gcm_aead_aes_128_gcm:
+        srtp_crypto_policy_set_double_aes_gcm_128_16_auth(policy);
+        break;
+    case srtp_profile_double_aead_aes_256_gcm_aead_aes_256_gcm:
+        srtp_crypto_policy_set_double_aes_gcm_256_16_auth(policy);
+        break;
+#endif
+    /* the following profiles are not (yet) supported */
+    case srtp_profile_null_sha1_32:
+    default:
+        return srtp_err_status_bad_param;
+    }
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_crypto_policy_set_from_profile_for_rtcp(
+    srtp_crypto_policy_t *policy,
+    srtp_profile_t profile)
+{
+    /* set SRTP policy from the SRTP profile in the key set */
+    switch (profile) {
+    case srtp_profile_aes128_cm_sha1_80:
+        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(policy);
+        break;
+    case srtp_profile_aes128_cm_sha1_32:
+        /* We do not honor the 32-bit auth tag request since
+         * this is not compliant with RFC 3711 */
+        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(policy);
+        break;
+    case srtp_profile_null_sha1_80:
+        srtp_crypto_policy_set_null_cipher_hmac_sha1_80(policy);
+        break;
+#ifdef GCM
+    case srtp_profile_aead_aes_128_gcm:
+        srtp_crypto_policy_set_aes_gcm_128_16_auth(policy);
+        break;
+    case srtp_profile_aead_aes_256_gcm:
+        srtp_crypto_policy_set_aes_gcm_256_16_auth(policy);
+        break;
+    /* RTCP is only protected hop-by-hop */
+    case srtp_profile_double_aead_aes_128_gcm_aead_aes_128_gcm:
+        srtp_crypto_policy_set_aes_gcm_128_16_auth(policy);
+        break;
+    case srtp_profile_double_aead_aes_256_gcm_aead_aes_256_gcm:
+        srtp_crypto_policy_set_aes_gcm_256_16_auth(policy);
+        break;
+#endif
+    /* the following profiles are not (yet) supported */
+    case srtp_profile_null_sha1_32:
+    default:
+        return srtp_err_status_bad_param;
+    }
+
+    return srtp_err_status_ok;
+}
+
+void srtp_append_salt_to_key(uint8_t *key,
+                             size_t bytes_in_key,
+                             uint8_t *salt,
+                             size_t bytes_in_salt)
+{
+    memcpy(key + bytes_in_key, salt, bytes_in_salt);
+}
+
+size_t srtp_profile_get_master_key_length(srtp_profile_t profile)
+{
+    switch (profile) {
+    case srtp_profile_aes128_cm_sha1_80:
+        return SRTP_AES_128_KEY_LEN;
+        break;
+    case srtp_profile_aes128_cm_sha1_32:
+        return SRTP_AES_128_KEY_LEN;
+        break;
+    case srtp_profile_null_sha1_80:
+        return SRTP_AES_128_KEY_LEN;
+        break;
+    case srtp_profile_aead_aes_128_gcm:
+        return SRTP_AES_128_KEY_LEN;
+        break;
+    case srtp_profile_aead_aes_256_gcm:
+        return SRTP_AES_256_KEY_LEN;
+        break;
+    case srtp_profile_double_aead_aes_128_gcm_aead_aes_128_gcm:
+        return 2 * SRTP_AES_128_KEY_LEN;
+        break;
+    case srtp_profile_double_aead_aes_256_gcm_aead_aes_256_gcm:
+        return 2 * SRTP_AES_256_KEY_LEN;
+        break;
+    /* the following profiles are not (yet) supported */
+    case srtp_profile_null_sha1_32:
+    default:
+        return 0; /* indicate error by returning a zero */
+    }
+}
+
+size_t srtp_profile_get_master_salt_length(srtp_profile_t profile)
+{
+    switch (profile) {
+    case srtp_profile_aes128_cm_sha1_80:
+        return SRTP_SALT_LEN;
+        break;
+    case srtp_profile_aes128_cm_sha1_32:
+        return SRTP_SALT_LEN;
+        break;
+    case srtp_profile_null_sha1_80:
+        return SRTP_SALT_LEN;
+        break;
+    case srtp_profile_aead_aes_128_gcm:
+        return SRTP_AEAD_SALT_LEN;
+        break;
+    case srtp_profile_aead_aes_256_gcm:
+        return SRTP_AEAD_SALT_LEN;
+        break;
+    case srtp_profile_double_aead_aes_128_gcm_aead_aes_128_gcm:
+    case srtp_profile_double_aead_aes_256_gcm_aead_aes_256_gcm:
+        return 2 * SRTP_AEAD_SALT_LEN;
+        break;
+    /* the following profiles are not (yet) supported */
+    case srtp_profile_null_sha1_32:
+    default:
+        return 0; /* indicate error by returning a zero */
+    }
+}
+
+srtp_err_status_t stream_get_protect_trailer_length(srtp_stream_ctx_t *stream,
+                                                    bool is_rtp,
+                                                    size_t mki_index,
+                                                    size_t *length)
+{
+    srtp_session_keys_t *session_key;
+
+    *length = 0;
+
+    if (stream->use_mki) {
+        if (mki_index >= stream->num_master_keys) {
+            return srtp_err_status_bad_mki;
+        }
+        session_key = &stream->session_keys[mki_index];
+
+        *length += stream->mki_size;
+
+    } else {
+        session_key = &stream->session_keys[0];
+    }
+    if (is_rtp) {
+        *length += srtp_auth_get_tag_length(session_key->rtp_auth);
+        /* a double stream also adds the inner tag and the OHB config */
+        if (stream->inner != NULL) {
+            *length += srtp_auth_get_tag_length(
+                           stream->inner->session_keys[0].rtp_auth) +
+                       1;
+        }
+    } else {
+        *length += srtp_auth_get_tag_length(session_key->rtcp_auth);
+        *length += sizeof(srtcp_trailer_t);
+    }
+
+    return srtp_err_status_ok;
+}
+
+struct get_protect_trailer_length_data {
+    bool found_stream; /* whether at least one matching stream was found */
+    size_t length;     /* maximum trailer length found so far */
+    bool is_rtp;
+    size_t mki_index;
+};
+
+static bool get_protect_trailer_length_cb(srtp_stream_t stream, void *raw_data)
+{
+    struct get_protect_trailer_length_data *data =
+        (struct get_protect_trailer_length_data *)raw_data;
+    size_t temp_length;
+
+    if (stream_get_protect_trailer_length(stream, data->is_rtp, data->mki_index,
+                                          &temp_length) == srtp_err_status_ok) {
+        data->found_stream = true;
+        if (temp_length > data->length) {
+            data->length = temp_length;
+        }
+    }
+
+    return true;
+}
+
+srtp_err_status_t get_protect_trailer_length(srtp_t session,
+                                             bool is_rtp,
+                                             size_t mki_index,
+                                             size_t *length)
+{
+    srtp_stream_ctx_t *stream;
+    struct get_protect_trailer_length_data data = { false, 0, is_rtp,
+                                                    mki_index };
+
+    if (session == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    stream = session->stream_template;
+
+    if (stream != NULL) {
+        data.found_stream = true;
+        stream_get_protect_trailer_length(stream, is_rtp, mki_index,
+                                          &data.length);
+    }
+
+    srtp_stream_list_for_each(session->stream_list,
+                              get_protect_trailer_length_cb, &data);
+
+    if (!data.found_stream) {
+        return srtp_err_status_bad_param;
+    }
+
+    *length = data.length;
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_get_protect_trailer_length(srtp_t session,
+                                                  size_t mki_index,
+                                                  size_t *length)
+{
+    return get_protect_trailer_length(session, true, mki_index, length);
+}
+
+srtp_err_status_t srtp_get_protect_rtcp_trailer_length(srtp_t session,
+                                                       size_t mki_index,
+                                                       size_t *length)
+{
+    return get_protect_trailer_length(session, false, mki_index, length);
+}
+
+/*
+ * SRTP debug interface
+ */
+srtp_err_status_t srtp_set_debug_module(const char *mod_name, bool v)
+{
+    return srtp_crypto_kernel_set_debug_module(mod_name, v);
+}
+
+srtp_err_status_t srtp_list_debug_modules(void)
+{
+    return srtp_crypto_kernel_list_debug_modules();
+}
+
+/*
+ * srtp_log_handler is a global variable holding a pointer to the
+ * log handler function; this function is called for any log
+ * output.
+ */
+
+static srtp_log_handler_func_t *srtp_log_handler = NULL;
+static void *srtp_log_handler_data = NULL;
+
+static void srtp_err_handler(srtp_err_reporting_level_t level, const char *msg)
+{
+    if (srtp_log_handler) {
+        srtp_log_level_t log_level = srtp_log_level_error;
+        switch (level) {
+        case srtp_err_level_error:
+            log_level = srtp_log_level_error;
+            break;
+        case srtp_err_level_warning:
+            log_level = srtp_log_level_warning;
+            break;
+        case srtp_err_level_info:
+            log_level = srtp_log_level_info;
+            break;
+        case srtp_err_level_debug:
+            log_level = srtp_log_level_debug;
+            break;
+        }
+
+        srtp_log_handler(log_level, msg, srtp_log_handler_data);
+    }
+}
+
+srtp_err_status_t srtp_install_log_handler(srtp_log_handler_func_t func,
+                                           void *data)
+{
+    /*
+     * note that we accept NULL arguments intentionally - calling this
+     * function with a NULL arguments removes a log handler that's
+     * been previously installed
+     */
+
+    if (srtp_log_handler) {
+        srtp_install_err_report_handler(NULL);
+    }
+    srtp_log_handler = func;
+    srtp_log_handler_data = data;
+    if (srtp_log_handler) {
+        srtp_install_err_report_handler(srtp_err_handler);
+    }
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_set_log_deferred(size_t num_records,
+                                        uint32_t max_per_second)
+{
+    return srtp_err_reporting_defer(num_records, max_per_second);
+}
+
+srtp_err_status_t srtp_flush_log(size_t *num_records)
+{
+    return srtp_err_reporting_flush(num_records);
+}
+
+srtp_err_status_t srtp_get_log_drops(const char *mod_name,
+                                     uint64_t *rate_limited,
+                                     uint64_t *queue_full)
+{
+    if (rate_limited == NULL || queue_full == NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    return srtp_err_reporting_drops(mod_name, rate_limited, queue_full);
+}
 
-    /* decrease the packet length by the length of the auth tag and seq_num*/
-    *rtcp_len -= (tag_len + sizeof(srtcp_trailer_t) + stream->mki_size);
+srtp_err_status_t srtp_stream_set_roc(srtp_t session,
+                                      uint32_t ssrc,
+                                      uint32_t roc)
+{
+    srtp_stream_t stream;
 
-    /*
-     * verify that stream is for received traffic - this check will
-     * detect SSRC collisions, since a stream that appears in both
-     * srtp_protect() and srtp_unprotect() will fail this test in one of
-     * those functions.
-     *
-     * we do this check *after* the authentication check, so that the
-     * latter check will catch any attempts to fool us into thinking
-     * that we've got a collision
-     */
-    if (stream->direction != dir_srtp_receiver) {
-        if (stream->direction == dir_unknown) {
-            stream->direction = dir_srtp_receiver;
-        } else {
-            srtp_handle_event(ctx, stream, event_ssrc_collision);
-        }
+    stream = srtp_get_stream(session, htonl(ssrc));
+    if (stream == NULL) {
+        return srtp_err_status_bad_param;
     }
 
-    /*
-     * if the stream is a 'provisional' one, in which the template context
-     * is used, then we need to allocate a new stream at this point, since
-     * the authentication passed
-     */
-    if (stream == ctx->stream_template) {
-        srtp_stream_ctx_t *new_stream;
+    stream->pending_roc = roc;
+    if (stream->inner != NULL) {
+        stream->inner->pending_roc = roc;
+    }
 
-        /*
-         * allocate and initialize a new stream
-         *
-         * note that we indicate failure if we can't allocate the new
-         * stream, and some implementations will want to not return
-         * failure here
-         */
-        status =
-            srtp_stream_clone(ctx->stream_template, hdr->ssrc, &new_stream);
-        if (status) {
-            return status;
-        }
+    return srtp_err_status_ok;
+}
 
-        /* add new stream to the list */
-        status = srtp_insert_or_dealloc_stream(ctx->stream_list, new_stream,
-                                               ctx->stream_template);
-        if (status) {
-            return status;
-        }
+srtp_err_status_t srtp_stream_get_roc(srtp_t session,
+                                      uint32_t ssrc,
+                                      uint32_t *roc)
+{
+    srtp_stream_t stream;
 
-        /* set stream (the pointer used in this function) */
-        stream = new_stream;
+    stream = srtp_get_stream(session, htonl(ssrc));
+    if (stream == NULL) {
+        return srtp_err_status_bad_param;
     }
 
-    /* we've passed the authentication check, so add seq_num to the rdb */
-    srtp_rdb_add_index(&stream->rtcp_rdb, seq_num);
+    *roc = srtp_rdbx_get_roc(&stream->rtp_rdbx);
 
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_protect_rtcp(srtp_t ctx,
-                                    const uint8_t *rtcp,
-                                    size_t rtcp_len,
-                                    uint8_t *srtcp,
-                                    size_t *srtcp_len,
-                                    size_t mki_index)
+srtp_err_status_t srtp_stream_add_master_key(srtp_t session,
+                                             uint32_t ssrc,
+                                             const srtp_master_key_t *key)
 {
-    const srtcp_hdr_t *hdr = (const srtcp_hdr_t *)rtcp;
-    size_t enc_start;         /* pointer to start of encrypted portion  */
-    uint8_t *auth_start;      /* pointer to start of auth. portion      */
-    uint8_t *trailer_p;       /* pointer to start of trailer            */
-    uint32_t trailer;         /* trailer value                          */
-    size_t enc_octet_len = 0; /* number of octets in encrypted portion  */
-    uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
+    srtp_stream_t stream;
+    srtp_session_keys_t *session_keys;
     srtp_err_status_t status;
-    size_t tag_len;
-    srtp_stream_ctx_t *stream;
-    size_t prefix_len;
-    uint32_t seq_num;
-    srtp_session_keys_t *session_keys = NULL;
 
-    /* check the packet length - it must at least contain a full header */
-    if (rtcp_len < octets_in_rtcp_header) {
+    if (key == NULL || key->key == NULL || key->mki_id == NULL) {
         return srtp_err_status_bad_param;
     }
 
-    /*
-     * look up ssrc in srtp_stream list, and process the packet with
-     * the appropriate stream.  if we haven't seen this stream before,
-     * there's only one key for this srtp_session, and the cipher
-     * supports key-sharing, then we assume that a new stream using
-     * that key has just started up
-     */
-    stream = srtp_get_stream(ctx, hdr->ssrc);
-    if (stream == NULL) {
-        if (ctx->stream_template != NULL) {
-            srtp_stream_ctx_t *new_stream;
-
-            /* allocate and initialize a new stream */
-            status =
-                srtp_stream_clone(ctx->stream_template, hdr->ssrc, &new_stream);
-            if (status) {
-                return status;
-            }
-
-            /* add new stream to the list */
-            status = srtp_insert_or_dealloc_stream(ctx->stream_list, new_stream,
-                                                   ctx->stream_template);
-            if (status) {
-                return status;
-            }
+    /* the inner layer of a double stream has a single master key */
+    stream = srtp_get_stream(session, htonl(ssrc));
+    if (stream == NULL || !stream->use_mki || stream->inner != NULL ||
+        srtp_stream_shares_template_keys(session, stream)) {
+        return srtp_err_status_bad_param;
+    }
 
-            /* set stream (the pointer used in this function) */
-            stream = new_stream;
-        } else {
-            /* no template stream, so we return an error */
-            return srtp_err_status_no_ctx;
-        }
+    if (stream->num_master_keys >= SRTP_MAX_NUM_MASTER_KEYS ||
+        srtp_stream_find_mki(stream, key->mki_id) != stream->num_master_keys) {
+        return srtp_err_status_bad_param;
     }
 
     /*
-     * verify that stream is for sending traffic - this check will
-     * detect SSRC collisions, since a stream that appears in both
-     * srtp_protect() and srtp_unprotect() will fail this test in one of
-     * those functions.
+     * derive the keys into the unused slot after the last key, which no
+     * packet is looked up in until the key is published below
      */
-    if (stream->direction != dir_srtp_sender) {
-        if (stream->direction == dir_unknown) {
-            stream->direction = dir_srtp_sender;
-        } else {
-            srtp_handle_event(ctx, stream, event_ssrc_collision);
-        }
+    session_keys = &stream->session_keys[stream->num_master_keys];
+    status = srtp_session_keys_alloc_like(session_keys,
+                                          &stream->session_keys[0]);
+    if (status == srtp_err_status_ok) {
+        status = srtp_stream_init_keys(session_keys, key, stream->mki_size,
+                                       stream->keep_derived,
+                                       srtp_session_kdf_cache(session));
     }
-
-    status = srtp_get_session_keys(stream, mki_index, &session_keys);
     if (status) {
+        srtp_session_keys_dealloc(session_keys, NULL, stream->mki_size);
+        memset(session_keys, 0, sizeof(srtp_session_keys_t));
         return status;
     }
 
-    /*
-     * Check if this is an AEAD stream (GCM mode).  If so, then dispatch
-     * the request to our AEAD handler.
-     */
-    if (session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_128 ||
-        session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_256) {
-        return srtp_protect_rtcp_aead(stream, rtcp, rtcp_len, srtcp, srtcp_len,
-                                      session_keys);
-    }
+    debug_print2(mod_srtp, "added master key %zu (SSRC: 0x%08x)",
+                 stream->num_master_keys, (unsigned int)ssrc);
 
-    /* get tag length from stream context */
-    tag_len = srtp_auth_get_tag_length(session_keys->rtcp_auth);
+    stream->num_master_keys++;
+    srtp_stream_index_mkis(stream);
 
-    /*
-     * set encryption start and encryption length
-     */
-    enc_start = octets_in_rtcp_header;
-    enc_octet_len = rtcp_len - enc_start;
+    return srtp_err_status_ok;
+}
 
-    /* check output length */
-    if (*srtcp_len <
-        rtcp_len + sizeof(srtcp_trailer_t) + stream->mki_size + tag_len) {
-        return srtp_err_status_buffer_small;
-    }
+srtp_err_status_t srtp_stream_remove_master_key(srtp_t session,
+                                                uint32_t ssrc,
+                                                const uint8_t *mki_id)
+{
+    srtp_stream_t stream;
+    srtp_keystream_cache_t *cache;
+    size_t i;
+    srtp_err_status_t status;
 
-    /* if not in place then need to copy rtcp header */
-    if (rtcp != srtcp) {
-        memcpy(srtcp, rtcp, enc_start);
+    if (mki_id == NULL) {
+        return srtp_err_status_bad_param;
     }
 
-    /* all of the packet, except the header, gets encrypted */
-    /*
-     * NOTE: hdr->length is not usable - it refers to only the first RTCP report
-     * in the compound packet!
-     */
-    trailer_p = srtcp + enc_start + enc_octet_len;
-
-    if (stream->rtcp_services & sec_serv_conf) {
-        trailer = htonl(SRTCP_E_BIT); /* set encrypt bit */
-    } else {
-        /* 0 is network-order independant */
-        trailer = 0x00000000; /* set encrypt bit */
+    stream = srtp_get_stream(session, htonl(ssrc));
+    if (stream == NULL || !stream->use_mki ||
+        srtp_stream_shares_template_keys(session, stream)) {
+        return srtp_err_status_bad_param;
     }
 
-    if (stream->use_mki) {
-        srtp_inject_mki(srtcp + rtcp_len + sizeof(srtcp_trailer_t),
-                        session_keys, stream->mki_size);
+    i = srtp_stream_find_mki(stream, mki_id);
+    if (i == stream->num_master_keys) {
+        return srtp_err_status_bad_mki;
     }
 
-    /*
-     * set the auth_start and auth_tag pointers to the proper locations
-     * (note that srtpc *always* provides authentication, unlike srtp)
-     */
-    /* Note: This would need to change for optional mikey data */
-    auth_start = srtcp;
-    auth_tag = srtcp + rtcp_len + sizeof(srtcp_trailer_t) + stream->mki_size;
+    /* a stream always keeps at least one key */
+    if (stream->num_master_keys == 1) {
+        return srtp_err_status_bad_param;
+    }
 
-    /*
-     * check sequence number for overruns, and copy it into the packet
-     * if its value isn't too big
-     */
-    status = srtp_rdb_increment(&stream->rtcp_rdb);
+    status = srtp_session_keys_dealloc(&stream->session_keys[i], NULL,
+                                       stream->mki_size);
     if (status) {
         return status;
     }
-    seq_num = srtp_rdb_get_value(&stream->rtcp_rdb);
-    trailer |= htonl(seq_num);
-    debug_print(mod_srtp, "srtcp index: %x", (unsigned int)seq_num);
-
-    memcpy(trailer_p, &trailer, sizeof(trailer));
-
-    /*
-     * if we're using rindael counter mode, set nonce and seq
-     */
-    if (session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_128 ||
-        session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_192 ||
-        session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_256) {
-        v128_t iv;
-
-        iv.v32[0] = 0;
-        iv.v32[1] = hdr->ssrc; /* still in network order! */
-        iv.v32[2] = htonl(seq_num >> 16);
-        iv.v32[3] = htonl(seq_num << 16);
-        status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
-                                    srtp_direction_encrypt);
 
-    } else {
-        v128_t iv;
+    memmove(&stream->session_keys[i], &stream->session_keys[i + 1],
+            (stream->num_master_keys - i - 1) * sizeof(srtp_session_keys_t));
+    stream->num_master_keys--;
+    memset(&stream->session_keys[stream->num_master_keys], 0,
+           sizeof(srtp_session_keys_t));
+    srtp_stream_index_mkis(stream);
 
-        /* otherwise, just set the index to seq_num */
-        iv.v32[0] = 0;
-        iv.v32[1] = 0;
-        iv.v32[2] = 0;
-        iv.v32[3] = htonl(seq_num);
-        status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
-                                    srtp_direction_encrypt);
-    }
-    if (status) {
-        return srtp_err_status_cipher_fail;
+    /* keystream precomputed for a key that has gone or moved is dropped */
+    cache = stream->keystream_cache;
+    if (cache && cache->session_keys &&
+        cache->session_keys >= &stream->session_keys[i]) {
+        cache->session_keys = NULL;
     }
 
-    /*
-     * if we're authenticating using a universal hash, put the keystream
-     * prefix into the authentication tag
-     */
-
-    /* if auth_start is non-null, then put keystream into tag  */
-    if (auth_start) {
-        /* put keystream prefix into auth_tag */
-        prefix_len = srtp_auth_get_prefix_length(session_keys->rtcp_auth);
-        status = srtp_cipher_output(session_keys->rtcp_cipher, auth_tag,
-                                    &prefix_len);
+    /* and so is the removed key, with the others, in the derivation cache */
+    srtp_session_kdf_cache_purge(session);
 
-        debug_print(mod_srtp, "keystream prefix: %s",
-                    srtp_octet_string_hex_string(auth_tag, prefix_len));
+    debug_print2(mod_srtp, "removed master key %zu (SSRC: 0x%08x)", i,
+                 (unsigned int)ssrc);
 
-        if (status) {
-            return srtp_err_status_cipher_fail;
-        }
-    }
+    return srtp_err_status_ok;
+}
 
-    /* if we're encrypting, exor keystream into the message */
-    if (stream->rtcp_services & sec_serv_conf) {
-        status = srtp_cipher_encrypt(session_keys->rtcp_cipher,
-                                     rtcp + enc_start, enc_octet_len,
-                                     srtcp + enc_start, &enc_octet_len);
-        if (status) {
-            return srtp_err_status_cipher_fail;
-        }
-    } else if (rtcp != srtcp) {
-        /* if no encryption and not-inplace then need to copy rest of packet */
-        memcpy(srtcp + enc_start, rtcp + enc_start, enc_octet_len);
-    }
+srtp_err_status_t srtp_stream_get_mki_index(srtp_t session,
+                                            uint32_t ssrc,
+                                            const uint8_t *mki_id,
+                                            size_t *mki_index)
+{
+    srtp_stream_t stream;
+    size_t i;
 
-    /* initialize auth func context */
-    status = srtp_auth_start(session_keys->rtcp_auth);
-    if (status) {
-        return status;
+    if (mki_id == NULL || mki_index == NULL) {
+        return srtp_err_status_bad_param;
     }
 
-    /*
-     * run auth func over packet (including trailer), and write the
-     * result at auth_tag
-     */
-    status = srtp_auth_compute(session_keys->rtcp_auth, auth_start,
-                               rtcp_len + sizeof(srtcp_trailer_t), auth_tag);
-    debug_print(mod_srtp, "srtcp auth tag:    %s",
-                srtp_octet_string_hex_string(auth_tag, tag_len));
-    if (status) {
-        return srtp_err_status_auth_fail;
+    stream = srtp_get_stream(session, htonl(ssrc));
+    if (stream == NULL || !stream->use_mki) {
+        return srtp_err_status_bad_param;
     }
 
-    *srtcp_len = enc_start + enc_octet_len;
-
-    /* increase the packet length by the length of the auth tag and seq_num*/
-    *srtcp_len += (tag_len + sizeof(srtcp_trailer_t));
+    i = srtp_stream_find_mki(stream, mki_id);
+    if (i == stream->num_master_keys) {
+        return srtp_err_status_bad_mki;
+    }
 
-    /* increase the packet by the mki_size */
-    *srtcp_len += stream->mki_size;
+    *mki_index = i;
 
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_unprotect_rtcp(srtp_t ctx,
-                                      const uint8_t *srtcp,
-                                      size_t srtcp_len,
-                                      uint8_t *rtcp,
-                                      size_t *rtcp_len)
+srtp_err_status_t srtp_stream_share_replay_window(srtp_t session,
+                                                  uint32_t ssrc,
+                                                  srtp_t peer)
 {
-    const srtcp_hdr_t *hdr = (const srtcp_hdr_t *)srtcp;
-    size_t enc_start;               /* pointer to start of encrypted portion  */
-    const uint8_t *auth_start;      /* pointer to start of auth. portion      */
-    const uint8_t *trailer_p;       /* pointer to start of trailer            */
-    uint32_t trailer;               /* trailer value                          */
-    size_t enc_octet_len = 0;       /* number of octets in encrypted portion  */
-    const uint8_t *auth_tag = NULL; /* location of auth_tag within packet     */
-    uint8_t tmp_tag[SRTP_MAX_TAG_LEN];
+    srtp_stream_t stream;
+    srtp_stream_t peer_stream;
     srtp_err_status_t status;
-    size_t auth_len;
-    size_t tag_len;
-    srtp_stream_ctx_t *stream;
-    size_t prefix_len;
-    uint32_t seq_num;
-    bool e_bit_in_packet;          /* E-bit was found in the packet */
-    bool sec_serv_confidentiality; /* whether confidentiality was requested */
-    srtp_session_keys_t *session_keys = NULL;
 
-    /*
-     * check that the length value is sane; we'll check again once we
-     * know the tag length, but we at least want to know that it is
-     * a positive value
-     */
-    if (srtcp_len < octets_in_rtcp_header + sizeof(srtcp_trailer_t)) {
+    stream = srtp_get_stream(session, htonl(ssrc));
+    peer_stream = srtp_get_stream(peer, htonl(ssrc));
+    if (stream == NULL || peer_stream == NULL || stream == peer_stream) {
         return srtp_err_status_bad_param;
     }
 
-    /*
-     * look up ssrc in srtp_stream list, and process the packet with
-     * the appropriate stream.  if we haven't seen this stream before,
-     * there's only one key for this srtp_session, and the cipher
-     * supports key-sharing, then we assume that a new stream using
-     * that key has just started up
-     */
-    stream = srtp_get_stream(ctx, hdr->ssrc);
-    if (stream == NULL) {
-        if (ctx->stream_template != NULL) {
-            stream = ctx->stream_template;
-
-            debug_print(mod_srtp,
-                        "srtcp using provisional stream (SSRC: 0x%08x)",
-                        (unsigned int)ntohl(hdr->ssrc));
-        } else {
-            /* no template stream, so we return an error */
-            return srtp_err_status_no_ctx;
+    if (peer_stream->shared_rdbx == NULL) {
+        srtp_xtd_seq_num_t index =
+            srtp_rdbx_get_packet_index(&peer_stream->rtp_rdbx);
+        if (srtp_rdbx_get_packet_index(&stream->rtp_rdbx) > index) {
+            index = srtp_rdbx_get_packet_index(&stream->rtp_rdbx);
+        }
+        status = srtp_rdbx_atomic_alloc(
+            &peer_stream->shared_rdbx,
+            srtp_rdbx_get_window_size(&peer_stream->rtp_rdbx), index);
+        if (status) {
+            return status;
         }
     }
 
-    /*
-     * Determine if MKI is being used and what session keys should be used
-     */
-    status = srtp_get_session_keys_for_rtcp_packet(stream, srtcp, srtcp_len,
-                                                   &session_keys);
-    if (status) {
-        return status;
+    if (stream->shared_rdbx != peer_stream->shared_rdbx) {
+        srtp_rdbx_atomic_release(stream->shared_rdbx);
+        srtp_rdbx_atomic_retain(peer_stream->shared_rdbx);
+        stream->shared_rdbx = peer_stream->shared_rdbx;
     }
 
-    /* get tag length from stream context */
-    tag_len = srtp_auth_get_tag_length(session_keys->rtcp_auth);
+    return srtp_err_status_ok;
+}
 
-    /* check the packet length - it must contain at least a full RTCP
-       header, an auth tag (if applicable), and the SRTCP encrypted flag
-       and 31-bit index value */
-    if (srtcp_len < octets_in_rtcp_header + sizeof(srtcp_trailer_t) +
-                        stream->mki_size + tag_len) {
+srtp_err_status_t srtp_stream_precompute(srtp_t session,
+                                         uint32_t ssrc,
+                                         size_t mki_index,
+                                         size_t num_packets,
+                                         size_t max_len)
+{
+    srtp_stream_t stream;
+    srtp_keystream_cache_t *cache;
+    srtp_session_keys_t *session_keys;
+    srtp_xtd_seq_num_t next;
+    srtp_err_status_t status;
+    size_t i;
+
+    stream = srtp_get_stream(session, htonl(ssrc));
+    if (stream == NULL) {
         return srtp_err_status_bad_param;
     }
 
-    /*
-     * Check if this is an AEAD stream (GCM mode).  If so, then dispatch
-     * the request to our AEAD handler.
-     */
-    if (session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_128 ||
-        session_keys->rtp_cipher->algorithm == SRTP_AES_GCM_256) {
-        return srtp_unprotect_rtcp_aead(ctx, stream, srtcp, srtcp_len, rtcp,
-                                        rtcp_len, session_keys);
+    /* a zero size turns the cache off */
+    if (num_packets == 0 || max_len == 0) {
+        srtp_keystream_cache_dealloc(stream->keystream_cache);
+        stream->keystream_cache = NULL;
+        srtp_stream_compile(stream);
+        return srtp_err_status_ok;
     }
 
-    sec_serv_confidentiality = stream->rtcp_services == sec_serv_conf ||
-                               stream->rtcp_services == sec_serv_conf_and_auth;
+    /* the cache is sized num_packets * max_len, which must not wrap */
+    if (max_len > SRTP_MAX_RTP_PAYLOAD_LEN ||
+        num_packets > SIZE_MAX / sizeof(srtp_keystream_entry_t) ||
+        num_packets > SIZE_MAX / max_len) {
+        return srtp_err_status_bad_param;
+    }
 
-    /*
-     * set encryption start, encryption length, and trailer
-     */
-    enc_start = octets_in_rtcp_header;
-    enc_octet_len = srtcp_len - (octets_in_rtcp_header + tag_len +
-                                 stream->mki_size + sizeof(srtcp_trailer_t));
-    /*
-     *index & E (encryption) bit follow normal data. hdr->len is the number of
-     * words (32-bit) in the normal packet minus 1
-     */
-    /* This should point trailer to the word past the end of the normal data. */
-    /* This would need to be modified for optional mikey data */
-    trailer_p = srtcp + srtcp_len -
-                (tag_len + stream->mki_size + sizeof(srtcp_trailer_t));
-    memcpy(&trailer, trailer_p, sizeof(trailer));
+    status = srtp_get_session_keys(stream, mki_index, &session_keys);
+    if (status) {
+        return status;
+    }
 
-    e_bit_in_packet = (*trailer_p & SRTCP_E_BYTE_BIT) == SRTCP_E_BYTE_BIT;
-    if (e_bit_in_packet != sec_serv_confidentiality) {
-        return srtp_err_status_cant_check;
+    /* only counter mode has keystream that is independent of the data */
+    if (!(stream->rtp_services & sec_serv_conf) ||
+        !srtp_cipher_is_icm(session_keys->rtp_cipher)) {
+        return srtp_err_status_bad_param;
     }
 
-    /*
-     * set the auth_start and auth_tag pointers to the proper locations
-     * (note that srtcp *always* uses authentication, unlike srtp)
-     */
-    auth_start = srtcp;
+    cache = stream->keystream_cache;
+    if (cache == NULL || cache->num_entries != num_packets ||
+        cache->entry_len != max_len) {
+        srtp_keystream_cache_dealloc(cache);
+        stream->keystream_cache = NULL;
+        srtp_stream_compile(stream);
 
-    /*
-     * The location of the auth tag in the packet needs to know MKI
-     * could be present.  The data needed to calculate the Auth tag
-     * must not include the MKI
-     */
-    auth_len = srtcp_len - tag_len - stream->mki_size;
-    auth_tag = srtcp + auth_len + stream->mki_size;
+        cache = (srtp_keystream_cache_t *)srtp_crypto_alloc(
+            sizeof(srtp_keystream_cache_t));
+        if (cache == NULL) {
+            return srtp_err_status_alloc_fail;
+        }
+        cache->num_entries = num_packets;
+        cache->entry_len = max_len;
+        cache->entries = (srtp_keystream_entry_t *)srtp_crypto_alloc(
+            num_packets * sizeof(srtp_keystream_entry_t));
+        cache->keystream = (uint8_t *)srtp_crypto_alloc(num_packets * max_len);
+        if (cache->entries == NULL || cache->keystream == NULL) {
+            srtp_keystream_cache_dealloc(cache);
+            return srtp_err_status_alloc_fail;
+        }
+        stream->keystream_cache = cache;
+        srtp_stream_compile(stream);
+    }
 
-    /*
-     * check the sequence number for replays
-     */
-    /* this is easier than dealing with bitfield access */
-    seq_num = ntohl(trailer) & SRTCP_INDEX_MASK;
-    debug_print(mod_srtp, "srtcp index: %x", (unsigned int)seq_num);
-    status = srtp_rdb_check(&stream->rtcp_rdb, seq_num);
-    if (status) {
-        return status;
+    if (cache->session_keys != session_keys) {
+        for (i = 0; i < cache->num_entries; i++) {
+            cache->entries[i].valid = false;
+        }
+        cache->session_keys = session_keys;
     }
 
-    /*
-     * if we're using aes counter mode, set nonce and seq
-     */
-    if (session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_128 ||
-        session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_192 ||
-        session_keys->rtcp_cipher->type->id == SRTP_AES_ICM_256) {
+    /* fill in the indices following the last packet that was protected */
+    next = srtp_rdbx_get_packet_index(&stream->rtp_rdbx) + 1;
+    for (i = 0; i < num_packets; i++) {
+        srtp_xtd_seq_num_t index = next + i;
+        size_t slot = (size_t)(index % num_packets);
+        srtp_keystream_entry_t *entry = &cache->entries[slot];
+        uint8_t *keystream = cache->keystream + slot * max_len;
+        size_t len = max_len;
         v128_t iv;
 
-        iv.v32[0] = 0;
-        iv.v32[1] = hdr->ssrc; /* still in network order! */
-        iv.v32[2] = htonl(seq_num >> 16);
-        iv.v32[3] = htonl(seq_num << 16);
-        status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
-                                    srtp_direction_decrypt);
-
-    } else {
-        v128_t iv;
+        if (entry->valid && entry->index == index) {
+            continue;
+        }
+        entry->valid = false;
 
-        /* otherwise, just set the index to seq_num */
         iv.v32[0] = 0;
-        iv.v32[1] = 0;
-        iv.v32[2] = 0;
-        iv.v32[3] = htonl(seq_num);
-        status = srtp_cipher_set_iv(session_keys->rtcp_cipher, (uint8_t *)&iv,
-                                    srtp_direction_decrypt);
-    }
-    if (status) {
-        return srtp_err_status_cipher_fail;
-    }
+        iv.v32[1] = stream->ssrc;
+        iv.v64[1] = be64_to_cpu(index << 16);
+        status = srtp_cipher_set_iv(session_keys->rtp_cipher, (uint8_t *)&iv,
+                                    srtp_direction_encrypt);
+        if (status) {
+            return srtp_err_status_cipher_fail;
+        }
 
-    /*
-     * if we're authenticating using a universal hash, put the keystream
-     * prefix into the authentication tag
-     */
-    prefix_len = srtp_auth_get_prefix_length(session_keys->rtcp_auth);
-    if (prefix_len) {
-        status =
-            srtp_cipher_output(session_keys->rtcp_cipher, tmp_tag, &prefix_len);
-        debug_print(mod_srtp, "keystream prefix: %s",
-                    srtp_octet_string_hex_string(tmp_tag, prefix_len));
+        /* encrypting zeros leaves the bare keystream */
+        octet_string_set_to_zero(keystream, max_len);
+        status = srtp_cipher_encrypt(session_keys->rtp_cipher, keystream,
+                                     max_len, keystream, &len);
         if (status) {
             return srtp_err_status_cipher_fail;
         }
-    }
 
-    /* initialize auth func context */
-    status = srtp_auth_start(session_keys->rtcp_auth);
-    if (status) {
-        return status;
+        entry->index = index;
+        entry->valid = true;
     }
 
-    /* run auth func over packet, put result into tmp_tag */
-    status = srtp_auth_compute(session_keys->rtcp_auth, auth_start, auth_len,
-                               tmp_tag);
-    debug_print(mod_srtp, "srtcp computed tag:       %s",
-                srtp_octet_string_hex_string(tmp_tag, tag_len));
-    if (status) {
-        return srtp_err_status_auth_fail;
-    }
+    return srtp_err_status_ok;
+}
 
-    /* compare the tag just computed with the one in the packet */
-    debug_print(mod_srtp, "srtcp tag from packet:    %s",
-                srtp_octet_string_hex_string(auth_tag, tag_len));
-    if (!srtp_octet_string_equal(tmp_tag, auth_tag, tag_len)) {
-        return srtp_err_status_auth_fail;
+/*
+ * the state of a session is serialized as a sequence of big-endian fields;
+ * srtp_state_writer_t only counts the octets if buf is NULL or too small,
+ * and srtp_state_reader_t stops at the first field that overruns the blob
+ */
+#define SRTP_STATE_MAGIC 0x53525453 /* "SRTS" */
+#define SRTP_STATE_VERSION 1
+
+/* record kinds */
+#define SRTP_STATE_STREAM 0   /* a stream with its own keys */
+#define SRTP_STATE_TEMPLATE 1 /* the stream template */
+#define SRTP_STATE_CLONE 2    /* a stream that shares the template's keys */
+
+/* record flags */
+#define SRTP_STATE_ALLOW_REPEAT_TX 0x01
+#define SRTP_STATE_USE_CRYPTEX 0x02
+#define SRTP_STATE_USE_MKI 0x04
+
+typedef struct srtp_state_writer_t {
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+} srtp_state_writer_t;
+
+typedef struct srtp_state_reader_t {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    bool ok;
+} srtp_state_reader_t;
+
+static void srtp_state_put(srtp_state_writer_t *w, const void *data, size_t n)
+{
+    if (w->buf != NULL && n <= w->len && w->pos <= w->len - n) {
+        memcpy(w->buf + w->pos, data, n);
     }
+    w->pos += n;
+}
 
-    /* check output length */
-    if (*rtcp_len <
-        srtcp_len - sizeof(srtcp_trailer_t) - stream->mki_size - tag_len) {
-        return srtp_err_status_buffer_small;
-    }
+static void srtp_state_put_u8(srtp_state_writer_t *w, uint8_t v)
+{
+    srtp_state_put(w, &v, 1);
+}
 
-    /* if not inplace need to copy rtcp header */
-    if (srtcp != rtcp) {
-        memcpy(rtcp, srtcp, enc_start);
-    }
+static void srtp_state_put_u32(srtp_state_writer_t *w, uint32_t v)
+{
+    uint32_t be = htonl(v);
+    srtp_state_put(w, &be, 4);
+}
 
-    /* if we're decrypting, exor keystream into the message */
-    if (sec_serv_confidentiality) {
-        status = srtp_cipher_decrypt(session_keys->rtcp_cipher,
-                                     srtcp + enc_start, enc_octet_len,
-                                     rtcp + enc_start, &enc_octet_len);
-        if (status) {
-            return srtp_err_status_cipher_fail;
-        }
-    } else if (srtcp != rtcp) {
-        /* if no encryption and not-inplace then need to copy rest of packet */
-        memcpy(rtcp + enc_start, srtcp + enc_start, enc_octet_len);
+static void srtp_state_put_u64(srtp_state_writer_t *w, uint64_t v)
+{
+    srtp_state_put_u32(w, (uint32_t)(v >> 32));
+    srtp_state_put_u32(w, (uint32_t)v);
+}
+
+static void srtp_state_get(srtp_state_reader_t *r, void *data, size_t n)
+{
+    if (!r->ok || n > r->len || r->pos > r->len - n) {
+        r->ok = false;
+        memset(data, 0, n);
+        return;
     }
+    memcpy(data, r->buf + r->pos, n);
+    r->pos += n;
+}
+
+static uint8_t srtp_state_get_u8(srtp_state_reader_t *r)
+{
+    uint8_t v;
+    srtp_state_get(r, &v, 1);
+    return v;
+}
+
+static uint32_t srtp_state_get_u32(srtp_state_reader_t *r)
+{
+    uint32_t be;
+    srtp_state_get(r, &be, 4);
+    return ntohl(be);
+}
+
+static uint64_t srtp_state_get_u64(srtp_state_reader_t *r)
+{
+    uint64_t hi = srtp_state_get_u32(r);
+    return (hi << 32) | srtp_state_get_u32(r);
+}
 
-    *rtcp_len = srtcp_len;
+static void srtp_state_put_bitvector(srtp_state_writer_t *w,
+                                     const bitvector_t *v)
+{
+    srtp_state_put_u32(w, (uint32_t)v->length);
+    for (size_t i = 0; i < v->length / bits_per_word; i++) {
+        srtp_state_put_u32(w, v->word[i]);
+    }
+}
 
-    /* decrease the packet length by the length of the auth tag and seq_num */
-    *rtcp_len -= (tag_len + sizeof(srtcp_trailer_t));
+/* the bitvector must have been allocated with the length in the blob */
+static void srtp_state_get_bitvector(srtp_state_reader_t *r, bitvector_t *v)
+{
+    if (srtp_state_get_u32(r) != v->length) {
+        r->ok = false;
+        return;
+    }
+    for (size_t i = 0; i < v->length / bits_per_word; i++) {
+        v->word[i] = srtp_state_get_u32(r);
+    }
+}
 
-    /* decrease the packet length by the length of the mki_size */
-    *rtcp_len -= stream->mki_size;
+/*
+ * a replay window that is shared with another session is written as the
+ * stream's own window, with every index up to the highest one seen marked
+ * as received, since the atomic window cannot be read as a whole
+ */
+static void srtp_state_put_replay(srtp_state_writer_t *w,
+                                  const srtp_stream_ctx_t *stream)
+{
+    const srtp_rdbx_t *rdbx = &stream->rtp_rdbx;
+    const srtp_rdb_t *rdb = &stream->rtcp_rdb;
+
+    srtp_state_put_u32(w, (uint32_t)rdbx->window_size);
+    if (stream->shared_rdbx) {
+        srtp_xtd_seq_num_t index =
+            srtp_rdbx_atomic_get_packet_index(stream->shared_rdbx);
+        if (rdbx->index > index) {
+            index = rdbx->index;
+        }
+        srtp_state_put_u64(w, index);
+        srtp_state_put_u32(w, (uint32_t)rdbx->bitmask.length);
+        for (size_t i = 0; i < rdbx->bitmask.length / bits_per_word; i++) {
+            srtp_state_put_u32(w, 0xffffffff);
+        }
+    } else {
+        const uint32_t *ring = srtp_rdbx_get_ring(rdbx);
 
-    /*
-     * verify that stream is for received traffic - this check will
-     * detect SSRC collisions, since a stream that appears in both
-     * srtp_protect() and srtp_unprotect() will fail this test in one of
-     * those functions.
-     *
-     * we do this check *after* the authentication check, so that the
-     * latter check will catch any attempts to fool us into thinking
-     * that we've got a collision
-     */
-    if (stream->direction != dir_srtp_receiver) {
-        if (stream->direction == dir_unknown) {
-            stream->direction = dir_srtp_receiver;
-        } else {
-            srtp_handle_event(ctx, stream, event_ssrc_collision);
+        srtp_state_put_u64(w, rdbx->index);
+        srtp_state_put_u32(w, (uint32_t)rdbx->bitmask.length);
+        for (size_t i = 0; i < rdbx->bitmask.length / bits_per_word; i++) {
+            srtp_state_put_u32(w, ring[i]);
         }
     }
 
-    /*
-     * if the stream is a 'provisional' one, in which the template context
-     * is used, then we need to allocate a new stream at this point, since
-     * the authentication passed
-     */
-    if (stream == ctx->stream_template) {
-        srtp_stream_ctx_t *new_stream;
+    srtp_state_put_u32(w, (uint32_t)rdb->window_size);
+    srtp_state_put_u32(w, rdb->window_start);
+    srtp_state_put_bitvector(w, &rdb->bitmask);
+}
 
-        /*
-         * allocate and initialize a new stream
-         *
-         * note that we indicate failure if we can't allocate the new
-         * stream, and some implementations will want to not return
-         * failure here
-         */
-        status =
-            srtp_stream_clone(ctx->stream_template, hdr->ssrc, &new_stream);
+static srtp_err_status_t srtp_state_get_replay(srtp_state_reader_t *r,
+                                               srtp_stream_ctx_t *stream)
+{
+    srtp_err_status_t status;
+    size_t window_size;
+    bitvector_t ring;
+
+    /* the same limits as in srtp_stream_init() */
+    window_size = srtp_state_get_u32(r);
+    if (!r->ok || window_size < 64 || window_size >= 0x8000) {
+        return srtp_err_status_parse_err;
+    }
+    if (stream->rtp_rdbx.bitmask.length == 0 ||
+        stream->rtp_rdbx.window_size != window_size) {
+        srtp_rdbx_dealloc(&stream->rtp_rdbx);
+        status = srtp_rdbx_init(&stream->rtp_rdbx, window_size);
         if (status) {
             return status;
         }
+    }
+    stream->rtp_rdbx.index = srtp_state_get_u64(r);
+    ring = srtp_rdbx_get_bitmask(&stream->rtp_rdbx);
+    srtp_state_get_bitvector(r, &ring);
 
-        /* add new stream to the list */
-        status = srtp_insert_or_dealloc_stream(ctx->stream_list, new_stream,
-                                               ctx->stream_template);
+    window_size = srtp_state_get_u32(r);
+    if (!r->ok || window_size < 64 || window_size >= 0x8000) {
+        return srtp_err_status_parse_err;
+    }
+    if (stream->rtcp_rdb.bitmask.word == NULL ||
+        stream->rtcp_rdb.window_size != window_size) {
+        srtp_rdb_dealloc(&stream->rtcp_rdb);
+        status = srtp_rdb_init(&stream->rtcp_rdb, window_size);
         if (status) {
             return status;
         }
-
-        /* set stream (the pointer used in this function) */
-        stream = new_stream;
     }
+    stream->rtcp_rdb.window_start = srtp_state_get_u32(r);
+    srtp_state_get_bitvector(r, &stream->rtcp_rdb.bitmask);
 
-    /* we've passed the authentication check, so add seq_num to the rdb */
-    srtp_rdb_add_index(&stream->rtcp_rdb, seq_num);
+    return r->ok ? srtp_err_status_ok : srtp_err_status_parse_err;
+}
 
-    return srtp_err_status_ok;
+static void srtp_state_put_crypto(srtp_state_writer_t *w,
+                                  const srtp_cipher_t *cipher,
+                                  const srtp_auth_t *auth)
+{
+    srtp_state_put_u32(w, cipher->type->id);
+    srtp_state_put_u32(w, (uint32_t)srtp_cipher_get_key_length(cipher));
+    srtp_state_put_u32(w, auth->type->id);
+    srtp_state_put_u32(w, (uint32_t)srtp_auth_get_key_length(auth));
+    srtp_state_put_u32(w, (uint32_t)srtp_auth_get_tag_length(auth));
+}
+
+static void srtp_state_get_crypto(srtp_state_reader_t *r,
+                                  srtp_crypto_policy_t *policy)
+{
+    policy->cipher_type = srtp_state_get_u32(r);
+    policy->cipher_key_len = srtp_state_get_u32(r);
+    policy->auth_type = srtp_state_get_u32(r);
+    policy->auth_key_len = srtp_state_get_u32(r);
+    policy->auth_tag_len = srtp_state_get_u32(r);
 }
 
 /*
- * user data within srtp_t context
+ * the derived keys are written with the lengths that the key derivation
+ * generates for the stream's ciphers and auth functions
  */
-
-void srtp_set_user_data(srtp_t ctx, void *data)
+static void srtp_state_put_keys(srtp_state_writer_t *w,
+                                const srtp_kdf_profile_t *profile,
+                                const srtp_kdf_output_t *output)
 {
-    ctx->user_data = data;
+    srtp_state_put(w, output->rtp_key,
+                   profile->rtp_base_key_len + profile->rtp_salt_len);
+    srtp_state_put(w, output->rtp_auth_key, profile->rtp_auth_key_len);
+    if (profile->rtp_xtn_hdr) {
+        srtp_state_put(w, output->rtp_xtn_hdr_key,
+                       profile->rtp_xtn_hdr_base_key_len +
+                           profile->rtp_xtn_hdr_salt_len);
+    }
+    srtp_state_put(w, output->rtcp_key,
+                   profile->rtcp_base_key_len + profile->rtcp_salt_len);
+    srtp_state_put(w, output->rtcp_auth_key, profile->rtcp_auth_key_len);
 }
 
-void *srtp_get_user_data(srtp_t ctx)
+static void srtp_state_get_keys(srtp_state_reader_t *r,
+                                const srtp_kdf_profile_t *profile,
+                                srtp_kdf_output_t *output)
 {
-    return ctx->user_data;
+    srtp_state_get(r, output->rtp_key,
+                   profile->rtp_base_key_len + profile->rtp_salt_len);
+    srtp_state_get(r, output->rtp_auth_key, profile->rtp_auth_key_len);
+    if (profile->rtp_xtn_hdr) {
+        srtp_state_get(r, output->rtp_xtn_hdr_key,
+                       profile->rtp_xtn_hdr_base_key_len +
+                           profile->rtp_xtn_hdr_salt_len);
+    }
+    srtp_state_get(r, output->rtcp_key,
+                   profile->rtcp_base_key_len + profile->rtcp_salt_len);
+    srtp_state_get(r, output->rtcp_auth_key, profile->rtcp_auth_key_len);
 }
 
-srtp_err_status_t srtp_crypto_policy_set_from_profile_for_rtp(
-    srtp_crypto_policy_t *policy,
-    srtp_profile_t profile)
+static srtp_err_status_t srtp_state_put_stream(srtp_state_writer_t *w,
+                                               uint8_t kind,
+                                               const srtp_stream_ctx_t *stream)
 {
-    /* set SRTP policy from the SRTP profile in the key set */
-    switch (profile) {
-    case srtp_profile_aes128_cm_sha1_80:
-        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(policy);
-        break;
-    case srtp_profile_aes128_cm_sha1_32:
-        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_32(policy);
-        break;
-    case srtp_profile_null_sha1_80:
-        srtp_crypto_policy_set_null_cipher_hmac_sha1_80(policy);
-        break;
-#ifdef GCM
-    case srtp_profile_aead_aes_128_gcm:
-        srtp_crypto_policy_set_aes_gcm_128_16_auth(policy);
-        break;
-    case srtp_profile_aead_aes_256_gcm:
-        srtp_crypto_policy_set_aes_gcm_256_16_auth(policy);
-        break;
-#endif
-    /* the following profiles are not (yet) supported */
-    case srtp_profile_null_sha1_32:
-    default:
+    srtp_err_status_t status;
+    const srtp_session_keys_t *session_keys = &stream->session_keys[0];
+    uint8_t flags = 0;
+
+    /* the state format has no room for the inner layer of a double stream */
+    if (stream->inner != NULL) {
         return srtp_err_status_bad_param;
     }
 
-    return srtp_err_status_ok;
-}
+    if (stream->allow_repeat_tx) {
+        flags |= SRTP_STATE_ALLOW_REPEAT_TX;
+    }
+    if (stream->use_cryptex) {
+        flags |= SRTP_STATE_USE_CRYPTEX;
+    }
+    if (stream->use_mki) {
+        flags |= SRTP_STATE_USE_MKI;
+    }
 
-srtp_err_status_t srtp_crypto_policy_set_from_profile_for_rtcp(
-    srtp_crypto_policy_t *policy,
-    srtp_profile_t profile)
-{
-    /* set SRTP policy from the SRTP profile in the key set */
-    switch (profile) {
-    case srtp_profile_aes128_cm_sha1_80:
-        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(policy);
-        break;
-    case srtp_profile_aes128_cm_sha1_32:
-        /* We do not honor the 32-bit auth tag request since
-         * this is not compliant with RFC 3711 */
-        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(policy);
-        break;
-    case srtp_profile_null_sha1_80:
-        srtp_crypto_policy_set_null_cipher_hmac_sha1_80(policy);
-        break;
-#ifdef GCM
-    case srtp_profile_aead_aes_128_gcm:
-        srtp_crypto_policy_set_aes_gcm_128_16_auth(policy);
-        break;
-    case srtp_profile_aead_aes_256_gcm:
-        srtp_crypto_policy_set_aes_gcm_256_16_auth(policy);
-        break;
-#endif
-    /* the following profiles are not (yet) supported */
-    case srtp_profile_null_sha1_32:
-    default:
-        return srtp_err_status_bad_param;
+    srtp_state_put_u8(w, kind);
+    srtp_state_put(w, &stream->ssrc, 4); /* in network order */
+    srtp_state_put_u8(w, (uint8_t)stream->direction);
+    srtp_state_put_u8(w, flags);
+    srtp_state_put_u8(w, (uint8_t)stream->rtp_services);
+    srtp_state_put_u8(w, (uint8_t)stream->rtcp_services);
+    srtp_state_put_u32(w, stream->pending_roc);
+
+    /* a clone gets its keys from the template */
+    if (kind == SRTP_STATE_CLONE) {
+        srtp_state_put_replay(w, stream);
+        return srtp_err_status_ok;
+    }
+
+    srtp_state_put_u8(w, (uint8_t)stream->num_master_keys);
+    srtp_state_put_u8(w, (uint8_t)stream->mki_size);
+    srtp_state_put_crypto(w, session_keys->rtp_cipher, session_keys->rtp_auth);
+    srtp_state_put_crypto(w, session_keys->rtcp_cipher,
+                          session_keys->rtcp_auth);
+    srtp_state_put_u32(w, (uint32_t)stream->enc_xtn_hdr_count);
+    if (stream->enc_xtn_hdr_count > 0) {
+        srtp_state_put(w, stream->enc_xtn_hdr, stream->enc_xtn_hdr_count);
+    }
+
+    for (size_t i = 0; i < stream->num_master_keys; i++) {
+        srtp_kdf_profile_t profile;
+
+        session_keys = &stream->session_keys[i];
+        if (session_keys->derived == NULL) {
+            return srtp_err_status_bad_param;
+        }
+        status = srtp_kdf_profile_init(&profile, session_keys);
+        if (status) {
+            return status;
+        }
+
+        if (stream->mki_size > 0) {
+            srtp_state_put(w, session_keys->mki_id, stream->mki_size);
+        }
+        srtp_state_put_u64(w, session_keys->limit->num_left);
+        srtp_state_put_u8(w, (uint8_t)session_keys->limit->state);
+        srtp_state_put_keys(w, &profile, session_keys->derived);
     }
 
+    srtp_state_put_replay(w, stream);
+
     return srtp_err_status_ok;
 }
 
-void srtp_append_salt_to_key(uint8_t *key,
-                             size_t bytes_in_key,
-                             uint8_t *salt,
-                             size_t bytes_in_salt)
+struct srtp_state_put_stream_data {
+    srtp_t session;
+    srtp_state_writer_t *w;
+    srtp_err_status_t status;
+};
+
+static bool srtp_state_put_stream_cb(srtp_stream_t stream, void *raw_data)
 {
-    memcpy(key + bytes_in_key, salt, bytes_in_salt);
+    struct srtp_state_put_stream_data *data =
+        (struct srtp_state_put_stream_data *)raw_data;
+    uint8_t kind = SRTP_STATE_STREAM;
+
+    if (srtp_stream_shares_template_keys(data->session, stream)) {
+        kind = SRTP_STATE_CLONE;
+    }
+    data->status = srtp_state_put_stream(data->w, kind, stream);
+    return data->status == srtp_err_status_ok;
 }
 
-size_t srtp_profile_get_master_key_length(srtp_profile_t profile)
+static bool srtp_state_count_stream_cb(srtp_stream_t stream, void *raw_data)
 {
-    switch (profile) {
-    case srtp_profile_aes128_cm_sha1_80:
-        return SRTP_AES_128_KEY_LEN;
-        break;
-    case srtp_profile_aes128_cm_sha1_32:
-        return SRTP_AES_128_KEY_LEN;
-        break;
-    case srtp_profile_null_sha1_80:
-        return SRTP_AES_128_KEY_LEN;
-        break;
-    case srtp_profile_aead_aes_128_gcm:
-        return SRTP_AES_128_KEY_LEN;
-        break;
-    case srtp_profile_aead_aes_256_gcm:
-        return SRTP_AES_256_KEY_LEN;
-        break;
-    /* the following profiles are not (yet) supported */
-    case srtp_profile_null_sha1_32:
-    default:
-        return 0; /* indicate error by returning a zero */
-    }
+    (void)stream;
+    (*(uint32_t *)raw_data)++;
+    return true;
 }
 
-size_t srtp_profile_get_master_salt_length(srtp_profile_t profile)
+srtp_err_status_t srtp_session_serialize(srtp_t session,
+                                         uint8_t *buf,
+                                         size_t *len)
 {
-    switch (profile) {
-    case srtp_profile_aes128_cm_sha1_80:
-        return SRTP_SALT_LEN;
-        break;
-    case srtp_profile_aes128_cm_sha1_32:
-        return SRTP_SALT_LEN;
-        break;
-    case srtp_profile_null_sha1_80:
-        return SRTP_SALT_LEN;
-        break;
-    case srtp_profile_aead_aes_128_gcm:
-        return SRTP_AEAD_SALT_LEN;
-        break;
-    case srtp_profile_aead_aes_256_gcm:
-        return SRTP_AEAD_SALT_LEN;
-        break;
-    /* the following profiles are not (yet) supported */
-    case srtp_profile_null_sha1_32:
-    default:
-        return 0; /* indicate error by returning a zero */
+    srtp_state_writer_t w;
+    struct srtp_state_put_stream_data data;
+    uint32_t num_streams = 0;
+
+    if (session == NULL || len == NULL) {
+        return srtp_err_status_bad_param;
     }
+
+    w.buf = buf;
+    w.len = buf ? *len : 0;
+    w.pos = 0;
+
+    /* the template comes first, so that its clones can be made from it */
+    if (session->stream_template) {
+        num_streams++;
+    }
+    srtp_stream_list_for_each(session->stream_list, srtp_state_count_stream_cb,
+                              &num_streams);
+
+    srtp_state_put_u32(&w, SRTP_STATE_MAGIC);
+    srtp_state_put_u8(&w, SRTP_STATE_VERSION);
+    srtp_state_put_u32(&w, num_streams);
+
+    data.session = session;
+    data.w = &w;
+    data.status = srtp_err_status_ok;
+    if (session->stream_template) {
+        data.status = srtp_state_put_stream(&w, SRTP_STATE_TEMPLATE,
+                                            session->stream_template);
+    }
+    if (data.status == srtp_err_status_ok) {
+        srtp_stream_list_for_each(session->stream_list,
+                                  srtp_state_put_stream_cb, &data);
+    }
+    if (data.status) {
+        return data.status;
+    }
+
+    *len = w.pos;
+    if (buf != NULL && w.pos > w.len) {
+        return srtp_err_status_buffer_small;
+    }
+
+    debug_print2(mod_srtp, "serialized %u streams in %zu octets",
+                 (unsigned int)num_streams, w.pos);
+
+    return srtp_err_status_ok;
 }
 
-srtp_err_status_t stream_get_protect_trailer_length(srtp_stream_ctx_t *stream,
-                                                    bool is_rtp,
-                                                    size_t mki_index,
-                                                    size_t *length)
+/*
+ * srtp_state_alloc_stream(r, str_ptr) allocates a stream with its own keys
+ * and keys its ciphers and auth functions with the session keys in the
+ * record, without running the key derivation
+ */
+static srtp_err_status_t srtp_state_alloc_stream(srtp_state_reader_t *r,
+                                                 srtp_stream_ctx_t **str_ptr)
 {
-    srtp_session_keys_t *session_key;
+    /* srtp_stream_alloc() only checks that there are keys and MKIs */
+    static uint8_t placeholder[SRTP_MAX_KEY_LEN];
+    srtp_master_key_t master_keys[SRTP_MAX_NUM_MASTER_KEYS];
+    srtp_master_key_t *keys[SRTP_MAX_NUM_MASTER_KEYS];
+    uint8_t enc_xtn_hdr[256];
+    srtp_policy_t policy;
+    srtp_stream_ctx_t *str;
+    srtp_err_status_t status;
 
-    *length = 0;
+    memset(&policy, 0, sizeof(policy));
+    policy.num_master_keys = srtp_state_get_u8(r);
+    policy.mki_size = srtp_state_get_u8(r);
+    policy.use_mki = policy.mki_size > 0;
+    srtp_state_get_crypto(r, &policy.rtp);
+    srtp_state_get_crypto(r, &policy.rtcp);
+    policy.enc_xtn_hdr_count = srtp_state_get_u32(r);
+    if (!r->ok || policy.num_master_keys == 0 ||
+        policy.num_master_keys > SRTP_MAX_NUM_MASTER_KEYS ||
+        policy.mki_size > SRTP_MAX_MKI_LEN ||
+        policy.enc_xtn_hdr_count > sizeof(enc_xtn_hdr)) {
+        return srtp_err_status_parse_err;
+    }
+    srtp_state_get(r, enc_xtn_hdr, policy.enc_xtn_hdr_count);
+    if (!r->ok) {
+        return srtp_err_status_parse_err;
+    }
+    policy.enc_xtn_hdr = enc_xtn_hdr;
 
-    if (stream->use_mki) {
-        if (mki_index >= stream->num_master_keys) {
-            return srtp_err_status_bad_mki;
+    for (size_t i = 0; i < policy.num_master_keys; i++) {
+        master_keys[i].key = placeholder;
+        master_keys[i].mki_id = placeholder;
+        keys[i] = &master_keys[i];
+    }
+    policy.keys = keys;
+
+    status = srtp_stream_alloc(&str, &policy);
+    if (status) {
+        return status;
+    }
+    str->use_mki = policy.use_mki;
+    str->mki_size = policy.mki_size;
+    str->keep_derived = true;
+
+    for (size_t i = 0; i < str->num_master_keys; i++) {
+        srtp_session_keys_t *session_keys = &str->session_keys[i];
+        srtp_kdf_profile_t profile;
+        srtp_kdf_output_t output;
+        uint8_t state;
+
+        if (str->mki_size > 0) {
+            session_keys->mki_id = srtp_crypto_alloc(str->mki_size);
+            if (session_keys->mki_id == NULL) {
+                srtp_stream_dealloc(str, NULL);
+                return srtp_err_status_alloc_fail;
+            }
+            srtp_state_get(r, session_keys->mki_id, str->mki_size);
+        }
+        session_keys->limit->num_left = srtp_state_get_u64(r);
+        state = srtp_state_get_u8(r);
+        session_keys->limit->state = (srtp_key_state_t)state;
+
+        memset(&output, 0, sizeof(output));
+        status = srtp_kdf_profile_init(&profile, session_keys);
+        if (state > srtp_key_state_expired) {
+            status = srtp_err_status_parse_err;
+        }
+        if (status == srtp_err_status_ok) {
+            srtp_state_get_keys(r, &profile, &output);
+            if (!r->ok) {
+                status = srtp_err_status_parse_err;
+            }
+        }
+        if (status == srtp_err_status_ok) {
+            status = srtp_session_keys_install(session_keys, &profile, &output);
+        }
+        if (status == srtp_err_status_ok) {
+            status = srtp_session_keys_keep_derived(session_keys, &output);
         }
-        session_key = &stream->session_keys[mki_index];
 
-        *length += stream->mki_size;
+        /* zeroize the derived keys */
+        octet_string_set_to_zero(&output, sizeof(srtp_kdf_output_t));
 
-    } else {
-        session_key = &stream->session_keys[0];
-    }
-    if (is_rtp) {
-        *length += srtp_auth_get_tag_length(session_key->rtp_auth);
-    } else {
-        *length += srtp_auth_get_tag_length(session_key->rtcp_auth);
-        *length += sizeof(srtcp_trailer_t);
+        if (status) {
+            srtp_stream_dealloc(str, NULL);
+            return status;
+        }
     }
+    srtp_stream_index_mkis(str);
 
+    *str_ptr = str;
     return srtp_err_status_ok;
 }
 
-struct get_protect_trailer_length_data {
-    bool found_stream; /* whether at least one matching stream was found */
-    size_t length;     /* maximum trailer length found so far */
-    bool is_rtp;
-    size_t mki_index;
-};
-
-static bool get_protect_trailer_length_cb(srtp_stream_t stream, void *raw_data)
+static srtp_err_status_t srtp_state_get_stream(srtp_state_reader_t *r,
+                                               srtp_t session)
 {
-    struct get_protect_trailer_length_data *data =
-        (struct get_protect_trailer_length_data *)raw_data;
-    size_t temp_length;
+    srtp_stream_ctx_t *str;
+    srtp_stream_ctx_t *template = session->stream_template;
+    srtp_err_status_t status;
+    uint8_t kind, direction, flags, rtp_services, rtcp_services;
+    uint32_t ssrc, pending_roc;
+
+    kind = srtp_state_get_u8(r);
+    srtp_state_get(r, &ssrc, 4);
+    direction = srtp_state_get_u8(r);
+    flags = srtp_state_get_u8(r);
+    rtp_services = srtp_state_get_u8(r);
+    rtcp_services = srtp_state_get_u8(r);
+    pending_roc = srtp_state_get_u32(r);
+    if (!r->ok || kind > SRTP_STATE_CLONE || direction > dir_srtp_receiver ||
+        rtp_services > sec_serv_conf_and_auth ||
+        rtcp_services > sec_serv_conf_and_auth) {
+        return srtp_err_status_parse_err;
+    }
 
-    if (stream_get_protect_trailer_length(stream, data->is_rtp, data->mki_index,
-                                          &temp_length) == srtp_err_status_ok) {
-        data->found_stream = true;
-        if (temp_length > data->length) {
-            data->length = temp_length;
-        }
+    /* there is one template, and it comes before its clones */
+    if ((kind == SRTP_STATE_TEMPLATE && template != NULL) ||
+        (kind == SRTP_STATE_CLONE && template == NULL) ||
+        (kind != SRTP_STATE_TEMPLATE &&
+         srtp_get_stream(session, ssrc) != NULL)) {
+        return srtp_err_status_parse_err;
     }
 
-    return true;
+    if (kind == SRTP_STATE_CLONE) {
+        status = srtp_stream_clone(template, ssrc, &str);
+    } else {
+        status = srtp_state_alloc_stream(r, &str);
+    }
+    if (status) {
+        return status;
+    }
+
+    str->ssrc = ssrc;
+    str->direction = (direction_t)direction;
+    str->rtp_services = (srtp_sec_serv_t)rtp_services;
+    str->rtcp_services = (srtp_sec_serv_t)rtcp_services;
+    str->pending_roc = pending_roc;
+    str->last_used = session->clock;
+    str->allow_repeat_tx = (flags & SRTP_STATE_ALLOW_REPEAT_TX) != 0;
+    str->use_cryptex = (flags & SRTP_STATE_USE_CRYPTEX) != 0;
+    if (str->use_mki != ((flags & SRTP_STATE_USE_MKI) != 0)) {
+        status = srtp_err_status_parse_err;
+    } else {
+        status = srtp_state_get_replay(r, str);
+    }
+    if (status) {
+        srtp_stream_dealloc(str, kind == SRTP_STATE_CLONE ? template : NULL);
+        return status;
+    }
+
+    srtp_stream_compile(str);
+
+    if (kind == SRTP_STATE_TEMPLATE) {
+        session->stream_template = str;
+        return srtp_err_status_ok;
+    }
+
+    status = srtp_insert_or_dealloc_stream(session->stream_list, str, template);
+    if (status == srtp_err_status_ok && kind == SRTP_STATE_CLONE) {
+        srtp_session_lru_link(session, session->lru_tail, str);
+    }
+    return status;
 }
 
-srtp_err_status_t get_protect_trailer_length(srtp_t session,
-                                             bool is_rtp,
-                                             size_t mki_index,
-                                             size_t *length)
+srtp_err_status_t srtp_session_restore(srtp_t *session,
+                                       const uint8_t *buf,
+                                       size_t len)
 {
-    srtp_stream_ctx_t *stream;
-    struct get_protect_trailer_length_data data = { false, 0, is_rtp,
-                                                    mki_index };
+    srtp_state_reader_t r;
+    srtp_err_status_t status;
+    uint32_t num_streams;
 
-    if (session == NULL) {
+    if (session == NULL || buf == NULL) {
         return srtp_err_status_bad_param;
     }
+    *session = NULL;
 
-    stream = session->stream_template;
+    r.buf = buf;
+    r.len = len;
+    r.pos = 0;
+    r.ok = true;
 
-    if (stream != NULL) {
-        data.found_stream = true;
-        stream_get_protect_trailer_length(stream, is_rtp, mki_index,
-                                          &data.length);
+    if (srtp_state_get_u32(&r) != SRTP_STATE_MAGIC ||
+        srtp_state_get_u8(&r) != SRTP_STATE_VERSION) {
+        return srtp_err_status_parse_err;
+    }
+    num_streams = srtp_state_get_u32(&r);
+    if (!r.ok) {
+        return srtp_err_status_parse_err;
     }
 
-    srtp_stream_list_for_each(session->stream_list,
-                              get_protect_trailer_length_cb, &data);
+    status = srtp_create(session, NULL);
+    if (status) {
+        return status;
+    }
+    (*session)->serializable = true;
 
-    if (!data.found_stream) {
-        return srtp_err_status_bad_param;
+    for (uint32_t i = 0; i < num_streams; i++) {
+        status = srtp_state_get_stream(&r, *session);
+        if (status) {
+            break;
+        }
+    }
+    if (status == srtp_err_status_ok && r.pos != r.len) {
+        status = srtp_err_status_parse_err;
+    }
+    if (status) {
+        srtp_dealloc(*session);
+        *session = NULL;
+        return status;
     }
 
-    *length = data.length;
+    debug_print2(mod_srtp, "restored %u streams from %zu octets",
+                 (unsigned int)num_streams, len);
+
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_get_protect_trailer_length(srtp_t session,
-                                                  size_t mki_index,
-                                                  size_t *length)
+/*
+ * the stream store is a region of memory, normally shared by several
+ * processes, that holds the state of streams which are handed from one
+ * session to another.  The region holds no pointers, so that it may be
+ * mapped at a different address in each process: it is a header followed
+ * by an open addressed table of slots, each with the SSRC it is bound to,
+ * the owner that has taken the stream and the state of the stream as
+ * written by srtp_state_put_stream().  A slot stays bound to its SSRC
+ * once bound, and only its owner reads or writes its state.
+ */
+#define SRTP_STREAM_STORE_MAGIC 0x53525353 /* "SRSS" */
+
+typedef struct srtp_stream_store_hdr_t {
+    uint32_t magic;
+    uint32_t num_slots; /* a power of two */
+    uint32_t slot_len;  /* octets of state in each slot */
+    uint32_t reserved;
+} srtp_stream_store_hdr_t;
+
+typedef struct srtp_stream_store_slot_t {
+    uint64_t key;   /* (1 << 32) | SSRC once bound, 0 while unused */
+    uint32_t owner; /* 0 if the stream may be taken */
+    uint32_t len;   /* octets of state, 0 if there is none */
+    /* followed by slot_len octets of state */
+} srtp_stream_store_slot_t;
+
+static size_t srtp_stream_store_stride(size_t slot_len)
 {
-    return get_protect_trailer_length(session, true, mki_index, length);
+    return sizeof(srtp_stream_store_slot_t) + ((slot_len + 7) & ~(size_t)7);
 }
 
-srtp_err_status_t srtp_get_protect_rtcp_trailer_length(srtp_t session,
-                                                       size_t mki_index,
-                                                       size_t *length)
+size_t srtp_stream_store_size(size_t num_slots, size_t slot_len)
 {
-    return get_protect_trailer_length(session, false, mki_index, length);
+    size_t n = 1;
+
+    while (n < num_slots) {
+        n <<= 1;
+    }
+    return sizeof(srtp_stream_store_hdr_t) +
+           n * srtp_stream_store_stride(slot_len);
 }
 
-/*
- * SRTP debug interface
- */
-srtp_err_status_t srtp_set_debug_module(const char *mod_name, bool v)
+srtp_err_status_t srtp_stream_store_init(void *region,
+                                         size_t num_slots,
+                                         size_t slot_len)
 {
-    return srtp_crypto_kernel_set_debug_module(mod_name, v);
+    srtp_stream_store_hdr_t *hdr = (srtp_stream_store_hdr_t *)region;
+    size_t n = 1;
+
+    if (region == NULL || num_slots == 0 || num_slots > 0x10000000 ||
+        slot_len == 0 || slot_len > 0x100000) {
+        return srtp_err_status_bad_param;
+    }
+
+    while (n < num_slots) {
+        n <<= 1;
+    }
+
+    memset(region, 0, srtp_stream_store_size(n, slot_len));
+    hdr->magic = SRTP_STREAM_STORE_MAGIC;
+    hdr->num_slots = (uint32_t)n;
+    hdr->slot_len = (uint32_t)slot_len;
+
+    return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_list_debug_modules(void)
+#ifdef SRTP_HAVE_ATOMIC_BUILTINS
+
+/*
+ * srtp_stream_store_find(region, ssrc, bind) returns the slot bound to
+ * ssrc (in network order), binding an unused one to it if bind is true,
+ * or NULL if there is none
+ */
+static srtp_stream_store_slot_t *srtp_stream_store_find(void *region,
+                                                        uint32_t ssrc,
+                                                        bool bind)
 {
-    return srtp_crypto_kernel_list_debug_modules();
+    const srtp_stream_store_hdr_t *hdr =
+        (const srtp_stream_store_hdr_t *)region;
+    uint8_t *slots = (uint8_t *)region + sizeof(srtp_stream_store_hdr_t);
+    size_t stride = srtp_stream_store_stride(hdr->slot_len);
+    size_t mask = hdr->num_slots - 1;
+    uint64_t key = ((uint64_t)1 << 32) | ssrc;
+    size_t i = (size_t)((ssrc * 0x9e3779b1u) >> 7) & mask;
+
+    for (size_t probes = 0; probes <= mask; probes++) {
+        srtp_stream_store_slot_t *slot =
+            (srtp_stream_store_slot_t *)(slots + i * stride);
+        uint64_t found = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+        if (found == 0 && bind) {
+            /* another process may bind the slot first */
+            __atomic_compare_exchange_n(&slot->key, &found, key, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            if (found == 0) {
+                return slot;
+            }
+        }
+        if (found == key) {
+            return slot;
+        }
+        if (found == 0) {
+            return NULL;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
 }
 
 /*
- * srtp_log_handler is a global variable holding a pointer to the
- * log handler function; this function is called for any log
- * output.
+ * srtp_stream_store_claim(slot, owner) makes owner the owner of slot if
+ * the slot has no owner, and returns the owner it had
  */
+static uint32_t srtp_stream_store_claim(srtp_stream_store_slot_t *slot,
+                                        uint32_t owner)
+{
+    uint32_t expected = 0;
 
-static srtp_log_handler_func_t *srtp_log_handler = NULL;
-static void *srtp_log_handler_data = NULL;
+    __atomic_compare_exchange_n(&slot->owner, &expected, owner, false,
+                                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+    return expected;
+}
 
-static void srtp_err_handler(srtp_err_reporting_level_t level, const char *msg)
+srtp_err_status_t srtp_stream_store_put(void *region,
+                                        srtp_t session,
+                                        uint32_t ssrc,
+                                        uint32_t owner)
 {
-    if (srtp_log_handler) {
-        srtp_log_level_t log_level = srtp_log_level_error;
-        switch (level) {
-        case srtp_err_level_error:
-            log_level = srtp_log_level_error;
-            break;
-        case srtp_err_level_warning:
-            log_level = srtp_log_level_warning;
-            break;
-        case srtp_err_level_info:
-            log_level = srtp_log_level_info;
-            break;
-        case srtp_err_level_debug:
-            log_level = srtp_log_level_debug;
-            break;
-        }
+    const srtp_stream_store_hdr_t *hdr =
+        (const srtp_stream_store_hdr_t *)region;
+    srtp_stream_store_slot_t *slot;
+    srtp_stream_t stream;
+    srtp_state_writer_t w;
+    srtp_err_status_t status;
+    uint32_t prev_owner;
 
-        srtp_log_handler(log_level, msg, srtp_log_handler_data);
+    if (region == NULL || session == NULL || owner == 0 ||
+        hdr->magic != SRTP_STREAM_STORE_MAGIC) {
+        return srtp_err_status_bad_param;
+    }
+
+    stream = srtp_get_stream(session, htonl(ssrc));
+    if (stream == NULL) {
+        return srtp_err_status_no_ctx;
+    }
+
+    slot = srtp_stream_store_find(region, htonl(ssrc), true);
+    if (slot == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    /* the stream is put back by the owner that took it, if any */
+    prev_owner = srtp_stream_store_claim(slot, owner);
+    if (prev_owner != 0 && prev_owner != owner) {
+        return srtp_err_status_bad_param;
     }
-}
 
-srtp_err_status_t srtp_install_log_handler(srtp_log_handler_func_t func,
-                                           void *data)
-{
     /*
-     * note that we accept NULL arguments intentionally - calling this
-     * function with a NULL arguments removes a log handler that's
-     * been previously installed
+     * measure the state first, so that a stream that does not fit leaves
+     * the state that was there before as it was
      */
+    w.buf = NULL;
+    w.len = 0;
+    w.pos = 0;
+    srtp_state_put_u8(&w, SRTP_STATE_VERSION);
+    status = srtp_state_put_stream(&w, SRTP_STATE_STREAM, stream);
+    if (status == srtp_err_status_ok && w.pos > hdr->slot_len) {
+        status = srtp_err_status_buffer_small;
+    }
+    if (status) {
+        __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+        return status;
+    }
 
-    if (srtp_log_handler) {
-        srtp_install_err_report_handler(NULL);
+    /* a stream that shares the template's keys is written with them */
+    w.buf = (uint8_t *)(slot + 1);
+    w.len = hdr->slot_len;
+    w.pos = 0;
+    srtp_state_put_u8(&w, SRTP_STATE_VERSION);
+    status = srtp_state_put_stream(&w, SRTP_STATE_STREAM, stream);
+    if (status) {
+        /* the keys written so far must not stay in shared memory */
+        octet_string_set_to_zero(slot + 1, hdr->slot_len);
+        slot->len = 0;
+        __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+        return status;
     }
-    srtp_log_handler = func;
-    srtp_log_handler_data = data;
-    if (srtp_log_handler) {
-        srtp_install_err_report_handler(srtp_err_handler);
+    slot->len = (uint32_t)w.pos;
+
+    status = srtp_stream_remove(session, ssrc);
+    if (status) {
+        /*
+         * the stream may still be in use here, so the state must not be
+         * taken elsewhere: two processes would reuse the same keystream
+         */
+        octet_string_set_to_zero(slot + 1, hdr->slot_len);
+        slot->len = 0;
     }
-    return srtp_err_status_ok;
+
+    /* the next owner sees the state written above */
+    __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+
+    debug_print2(mod_srtp, "stored stream (SSRC: 0x%08x) in %zu octets",
+                 (unsigned int)ssrc, w.pos);
+
+    return status;
 }
 
-srtp_err_status_t srtp_stream_set_roc(srtp_t session,
-                                      uint32_t ssrc,
-                                      uint32_t roc)
+srtp_err_status_t srtp_stream_store_take(void *region,
+                                         srtp_t session,
+                                         uint32_t ssrc,
+                                         uint32_t owner)
 {
-    srtp_stream_t stream;
+    const srtp_stream_store_hdr_t *hdr =
+        (const srtp_stream_store_hdr_t *)region;
+    srtp_stream_store_slot_t *slot;
+    srtp_state_reader_t r;
+    srtp_err_status_t status;
 
-    stream = srtp_get_stream(session, htonl(ssrc));
-    if (stream == NULL) {
+    if (region == NULL || session == NULL || owner == 0 ||
+        hdr->magic != SRTP_STREAM_STORE_MAGIC) {
         return srtp_err_status_bad_param;
     }
 
-    stream->pending_roc = roc;
+    if (srtp_get_stream(session, htonl(ssrc)) != NULL) {
+        return srtp_err_status_bad_param;
+    }
+
+    slot = srtp_stream_store_find(region, htonl(ssrc), false);
+    if (slot == NULL) {
+        return srtp_err_status_no_ctx;
+    }
+
+    /* a stream that has been taken is not in the store */
+    if (srtp_stream_store_claim(slot, owner) != 0) {
+        return srtp_err_status_no_ctx;
+    }
+    if (slot->len == 0) {
+        __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+        return srtp_err_status_no_ctx;
+    }
+
+    r.buf = (const uint8_t *)(slot + 1);
+    r.len = slot->len;
+    r.pos = 0;
+    r.ok = true;
+    if (srtp_state_get_u8(&r) != SRTP_STATE_VERSION) {
+        status = srtp_err_status_parse_err;
+    } else {
+        status = srtp_state_get_stream(&r, session);
+    }
+    if (status == srtp_err_status_ok && r.pos != r.len) {
+        srtp_stream_remove(session, ssrc);
+        status = srtp_err_status_parse_err;
+    }
+    if (status) {
+        __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+        return status;
+    }
+
+    /*
+     * the state is stale until the owner puts the stream back, and its
+     * keys are not left in shared memory meanwhile
+     */
+    octet_string_set_to_zero(slot + 1, slot->len);
+    slot->len = 0;
+
+    debug_print(mod_srtp, "took stream (SSRC: 0x%08x) from the store",
+                (unsigned int)ssrc);
 
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_stream_get_roc(srtp_t session,
-                                      uint32_t ssrc,
-                                      uint32_t *roc)
+#else /* SRTP_HAVE_ATOMIC_BUILTINS */
+
+srtp_err_status_t srtp_stream_store_put(void *region,
+                                        srtp_t session,
+                                        uint32_t ssrc,
+                                        uint32_t owner)
 {
-    srtp_stream_t stream;
+    (void)region;
+    (void)session;
+    (void)ssrc;
+    (void)owner;
 
-    stream = srtp_get_stream(session, htonl(ssrc));
-    if (stream == NULL) {
-        return srtp_err_status_bad_param;
-    }
+    return srtp_err_status_fail;
+}
 
-    *roc = srtp_rdbx_get_roc(&stream->rtp_rdbx);
+srtp_err_status_t srtp_stream_store_take(void *region,
+                                         srtp_t session,
+                                         uint32_t ssrc,
+                                         uint32_t owner)
+{
+    (void)region;
+    (void)session;
+    (void)ssrc;
+    (void)owner;
 
-    return srtp_err_status_ok;
+    return srtp_err_status_fail;
 }
 
+#endif /* SRTP_HAVE_ATOMIC_BUILTINS */
+
 #ifndef SRTP_NO_STREAM_LIST
 
 #define INITIAL_STREAM_INDEX_SIZE 2
@@ -5262,6 +10426,39 @@ srtp_err_status_t srtp_stream_list_insert(srtp_stream_list_t list,
     return srtp_err_status_ok;
 }
 
+/*
+ * reserving room grows the entries buffer once to hold count more entries
+ * than the list has now.
+ */
+srtp_err_status_t srtp_stream_list_reserve(srtp_stream_list_t list,
+                                           size_t count)
+{
+    size_t new_capacity = list->size + count;
+
+    if (new_capacity <= list->capacity) {
+        return srtp_err_status_ok;
+    }
+
+    // Check for capacity overflow.
+    if (new_capacity < list->size ||
+        new_capacity > SIZE_MAX / sizeof(list_entry)) {
+        return srtp_err_status_alloc_fail;
+    }
+
+    list_entry *new_entries =
+        srtp_crypto_alloc(sizeof(list_entry) * new_capacity);
+    if (new_entries == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+
+    memcpy(new_entries, list->entries, sizeof(list_entry) * list->size);
+    srtp_crypto_free(list->entries);
+    list->entries = new_entries;
+    list->capacity = new_capacity;
+
+    return srtp_err_status_ok;
+}
+
 /*
  * removing an entry from the list performs a memory move of the following
  * entries one position back in order to keep all the entries in the buffer
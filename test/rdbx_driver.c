@@ -53,6 +53,10 @@
 #include <stdio.h> /* for printf()          */
 #include <stdlib.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #ifdef ROC_TEST
 #error "srtp_rdbx_t won't work with ROC_TEST - bitmask same size as seq_median"
 #endif
@@ -61,7 +65,22 @@
 
 srtp_err_status_t test_replay_dbx(size_t num_trials, size_t ws);
 
-double rdbx_check_adds_per_second(size_t num_trials, size_t ws);
+srtp_err_status_t test_rdbx_copy(size_t ws);
+
+srtp_err_status_t test_rdbx_atomic(size_t num_trials, size_t ws);
+
+srtp_err_status_t test_rdbx_atomic_threads(size_t num_packets, size_t ws);
+
+/* arrival patterns used by the timing test */
+typedef enum {
+    rdbx_pattern_sequential, /* every index, in order             */
+    rdbx_pattern_reordered,  /* every index, reordered by <= 128  */
+    rdbx_pattern_gaps,       /* in order, with gaps of up to 2048 */
+} rdbx_pattern_t;
+
+double rdbx_check_adds_per_second(size_t num_trials,
+                                  size_t ws,
+                                  rdbx_pattern_t pattern);
 
 void usage(char *prog_name)
 {
@@ -113,6 +132,15 @@ int main(int argc, char *argv[])
         }
         printf("passed\n");
 
+        printf("testing srtp_rdbx_t copy (ws=128)...\n");
+
+        status = test_rdbx_copy(128);
+        if (status) {
+            printf("failed\n");
+            exit(1);
+        }
+        printf("passed\n");
+
         printf("testing srtp_rdbx_t (ws=1024)...\n");
 
         status = test_replay_dbx(1 << 12, 1024);
@@ -123,11 +151,50 @@ int main(int argc, char *argv[])
         printf("passed\n");
     }
 
+    if (do_validation) {
+        printf("testing srtp_rdbx_t (ws=32768)...\n");
+
+        status = test_replay_dbx(1 << 12, 32768);
+        if (status) {
+            printf("failed\n");
+            exit(1);
+        }
+        printf("passed\n");
+
+        printf("testing srtp_rdbx_atomic_t (ws=128)...\n");
+
+        status = test_rdbx_atomic(1 << 12, 128);
+        if (status) {
+            printf("failed\n");
+            exit(1);
+        }
+        printf("passed\n");
+
+        printf("testing srtp_rdbx_atomic_t with threads (ws=1024)...\n");
+
+        status = test_rdbx_atomic_threads(1 << 18, 1024);
+        if (status) {
+            printf("failed\n");
+            exit(1);
+        }
+        printf("passed\n");
+    }
+
     if (do_timing_test) {
-        rate = rdbx_check_adds_per_second(1 << 18, 128);
-        printf("rdbx_check/replay_adds per second (ws=128): %e\n", rate);
-        rate = rdbx_check_adds_per_second(1 << 18, 1024);
-        printf("rdbx_check/replay_adds per second (ws=1024): %e\n", rate);
+        printf("rdbx_check/replay_adds per second:\n");
+        printf("%8s %14s %14s %14s\n", "ws", "sequential", "reordered",
+               "gaps");
+        for (size_t ws = 64; ws <= 32768; ws <<= 1) {
+            printf("%8zu", ws);
+            rate = rdbx_check_adds_per_second(1 << 20, ws,
+                                              rdbx_pattern_sequential);
+            printf(" %14e", rate);
+            rate = rdbx_check_adds_per_second(1 << 20, ws,
+                                              rdbx_pattern_reordered);
+            printf(" %14e", rate);
+            rate = rdbx_check_adds_per_second(1 << 20, ws, rdbx_pattern_gaps);
+            printf(" %14e\n", rate);
+        }
     }
 
     return 0;
@@ -216,6 +283,56 @@ srtp_err_status_t rdbx_check_add_unordered(srtp_rdbx_t *rdbx, uint32_t idx)
     return srtp_err_status_ok;
 }
 
+/*
+ * test_rdbx_copy(ws) checks that a copy of an rdbx whose ring is kept
+ * inline has a ring of its own, which outlives the original
+ */
+srtp_err_status_t test_rdbx_copy(size_t ws)
+{
+    srtp_rdbx_t rdbx, copy;
+    srtp_err_status_t status;
+
+    status = srtp_rdbx_init(&rdbx, ws);
+    if (status) {
+        printf("replay_init failed with error code %d\n", status);
+        exit(1);
+    }
+
+    for (uint32_t idx = 0; idx < 100; idx += 2) {
+        status = rdbx_check_add(&rdbx, idx);
+        if (status) {
+            return status;
+        }
+    }
+
+    copy = rdbx;
+    for (uint32_t idx = 1; idx < 100; idx += 2) {
+        status = rdbx_check_add(&copy, idx);
+        if (status) {
+            return status;
+        }
+    }
+
+    /* the indices added to the copy are still new to the original */
+    for (uint32_t idx = 1; idx < 100; idx += 2) {
+        status = rdbx_check_add(&rdbx, idx);
+        if (status) {
+            return status;
+        }
+    }
+    srtp_rdbx_dealloc(&rdbx);
+
+    for (uint32_t idx = 0; idx < 100; idx++) {
+        status = rdbx_check_expect_failure(&copy, idx);
+        if (status) {
+            return status;
+        }
+    }
+    srtp_rdbx_dealloc(&copy);
+
+    return srtp_err_status_ok;
+}
+
 srtp_err_status_t test_replay_dbx(size_t num_trials, size_t ws)
 {
     srtp_rdbx_t rdbx;
@@ -324,15 +441,355 @@ srtp_err_status_t test_replay_dbx(size_t num_trials, size_t ws)
     return srtp_err_status_ok;
 }
 
+/*
+ * rdbx_atomic_check_add(rdbx, idx) checks and adds a known-to-be-good
+ * idx to the atomic rdbx
+ */
+srtp_err_status_t rdbx_atomic_check_add(srtp_rdbx_atomic_t *rdbx, uint32_t idx)
+{
+    srtp_xtd_seq_num_t est;
+
+    srtp_rdbx_atomic_estimate_index(rdbx, &est, (srtp_sequence_number_t)idx);
+    if (est != idx) {
+        printf("estimated index %" PRIu64 " for %u\n", est, idx);
+        return srtp_err_status_algo_fail;
+    }
+
+    if (srtp_rdbx_atomic_check(rdbx, est) != srtp_err_status_ok) {
+        printf("atomic replay_check failed at index %u\n", idx);
+        return srtp_err_status_algo_fail;
+    }
+
+    if (srtp_rdbx_atomic_add_index(rdbx, est) != srtp_err_status_ok) {
+        printf("atomic add_index failed at index %u\n", idx);
+        return srtp_err_status_algo_fail;
+    }
+
+    /* a second add of the same index must fail */
+    if (srtp_rdbx_atomic_add_index(rdbx, est) != srtp_err_status_replay_fail) {
+        printf("atomic add_index accepted index %u twice\n", idx);
+        return srtp_err_status_algo_fail;
+    }
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t test_rdbx_atomic(size_t num_trials, size_t ws)
+{
+    srtp_rdbx_atomic_t *rdbx;
+    srtp_err_status_t status;
+    uint32_t idx;
+    uint32_t last = 0;
+
+    status = srtp_rdbx_atomic_alloc(&rdbx, ws, 0);
+    if (status == srtp_err_status_fail) {
+        printf("\tnot supported on this platform, skipped\n");
+        return srtp_err_status_ok;
+    } else if (status) {
+        return status;
+    }
+
+    printf("\ttesting sequential insertion...");
+    for (idx = 0; idx < num_trials; idx++) {
+        status = rdbx_atomic_check_add(rdbx, idx);
+        if (status) {
+            srtp_rdbx_atomic_release(rdbx);
+            return status;
+        }
+    }
+    printf("passed\n");
+
+    printf("\ttesting for false positives...");
+    for (idx = 0; idx < num_trials; idx++) {
+        status = srtp_rdbx_atomic_check(rdbx, idx);
+        if (status == srtp_err_status_ok) {
+            printf("index %u not rejected\n", idx);
+            srtp_rdbx_atomic_release(rdbx);
+            return srtp_err_status_algo_fail;
+        }
+        if (idx + ws > num_trials && status != srtp_err_status_replay_fail) {
+            printf("index %u in window not rejected as replay\n", idx);
+            srtp_rdbx_atomic_release(rdbx);
+            return srtp_err_status_algo_fail;
+        }
+    }
+    printf("passed\n");
+
+    srtp_rdbx_atomic_release(rdbx);
+
+    status = srtp_rdbx_atomic_alloc(&rdbx, ws, 0);
+    if (status) {
+        return status;
+    }
+
+    printf("\ttesting insertion with large gaps...");
+    status = rdbx_atomic_check_add(rdbx, last);
+    if (status) {
+        srtp_rdbx_atomic_release(rdbx);
+        return status;
+    }
+    for (size_t i = 0; i < num_trials; i++) {
+        idx = last + (1 << (srtp_cipher_rand_u32_for_tests() % 12));
+        status = rdbx_atomic_check_add(rdbx, idx);
+        if (status) {
+            srtp_rdbx_atomic_release(rdbx);
+            return status;
+        }
+        /* the previous index is now ws or more behind, or still in window */
+        if (idx - last >= ws) {
+            if (srtp_rdbx_atomic_check(rdbx, last) !=
+                srtp_err_status_replay_old) {
+                printf("index %u not rejected as old\n", last);
+                srtp_rdbx_atomic_release(rdbx);
+                return srtp_err_status_algo_fail;
+            }
+        } else if (srtp_rdbx_atomic_check(rdbx, last) !=
+                   srtp_err_status_replay_fail) {
+            printf("index %u not rejected as replay\n", last);
+            srtp_rdbx_atomic_release(rdbx);
+            return srtp_err_status_algo_fail;
+        }
+        last = idx;
+    }
+    printf("passed\n");
+
+    srtp_rdbx_atomic_release(rdbx);
+
+    return srtp_err_status_ok;
+}
+
+#ifdef HAVE_PTHREAD_H
+
+#define RDBX_NUM_THREADS 4
+
+typedef struct {
+    srtp_rdbx_atomic_t *rdbx;
+    const uint32_t *arrivals;
+    size_t num_arrivals;
+    size_t *next_arrival; /* shared cursor into arrivals              */
+    uint8_t *accepted;    /* per index, number of times accepted     */
+    uint8_t *replayed;    /* per index, number of replay rejections  */
+    size_t num_old;       /* arrivals rejected as too old             */
+    size_t num_misguess;  /* arrivals whose index was mis-estimated  */
+} rdbx_thread_data_t;
+
+static void *rdbx_atomic_thread(void *arg)
+{
+    rdbx_thread_data_t *data = (rdbx_thread_data_t *)arg;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(data->next_arrival, 1, __ATOMIC_RELAXED);
+        uint32_t idx;
+        if (i >= data->num_arrivals) {
+            break;
+        }
+        idx = data->arrivals[i];
+        srtp_xtd_seq_num_t est;
+        srtp_err_status_t status;
+
+        srtp_rdbx_atomic_estimate_index(data->rdbx, &est,
+                                        (srtp_sequence_number_t)idx);
+        if (est != idx) {
+            /* the packet would fail authentication */
+            data->num_misguess++;
+            continue;
+        }
+
+        status = srtp_rdbx_atomic_check(data->rdbx, est);
+        if (status == srtp_err_status_ok) {
+            /* authentication would happen here */
+            status = srtp_rdbx_atomic_add_index(data->rdbx, est);
+        }
+
+        if (status == srtp_err_status_ok) {
+            __atomic_fetch_add(&data->accepted[idx], 1, __ATOMIC_RELAXED);
+        } else if (status == srtp_err_status_replay_fail) {
+            __atomic_fetch_add(&data->replayed[idx], 1, __ATOMIC_RELAXED);
+        } else {
+            data->num_old++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * test_rdbx_atomic_threads(num_packets, ws) has RDBX_NUM_THREADS threads
+ * share one atomic rdbx and pull packets, as a multi-queue receiver
+ * would, from a stream in which every packet is followed, a little
+ * later, by a replay of it.  No index may be
+ * accepted more than once, and an index may only be rejected as a replay
+ * if it has been accepted.
+ */
+srtp_err_status_t test_rdbx_atomic_threads(size_t num_packets, size_t ws)
+{
+    srtp_rdbx_atomic_t *rdbx;
+    srtp_err_status_t status;
+    pthread_t threads[RDBX_NUM_THREADS];
+    rdbx_thread_data_t data[RDBX_NUM_THREADS];
+    const size_t num_arrivals = 2 * num_packets;
+    uint32_t *arrivals;
+    uint8_t *accepted;
+    uint8_t *replayed;
+    size_t num_accepted = 0;
+    size_t num_replayed = 0;
+    size_t num_old = 0;
+    size_t num_misguess = 0;
+    size_t next_arrival = 0;
+
+    status = srtp_rdbx_atomic_alloc(&rdbx, ws, 0);
+    if (status == srtp_err_status_fail) {
+        printf("\tnot supported on this platform, skipped\n");
+        return srtp_err_status_ok;
+    } else if (status) {
+        return status;
+    }
+
+    arrivals = malloc(num_arrivals * sizeof(*arrivals));
+    accepted = calloc(num_packets, 1);
+    replayed = calloc(num_packets, 1);
+    if (arrivals == NULL || accepted == NULL || replayed == NULL) {
+        printf("malloc failed\n");
+        exit(1);
+    }
+
+    /*
+     * packet i is sent at position 2i and its replay is swapped forward
+     * by up to 32 places; a replay can be carried further by later swaps,
+     * so a few end up outside the window or even mis-estimated
+     */
+    for (size_t i = 0; i < num_packets; i++) {
+        arrivals[2 * i] = (uint32_t)i;
+        arrivals[2 * i + 1] = (uint32_t)i;
+    }
+    for (size_t i = 0; i + 64 < num_arrivals; i += 2) {
+        size_t j = i + 1 + (srtp_cipher_rand_u32_for_tests() & 31);
+        uint32_t tmp = arrivals[i + 1];
+        arrivals[i + 1] = arrivals[j];
+        arrivals[j] = tmp;
+    }
+
+    for (size_t t = 0; t < RDBX_NUM_THREADS; t++) {
+        data[t].rdbx = rdbx;
+        data[t].arrivals = arrivals;
+        data[t].num_arrivals = num_arrivals;
+        data[t].next_arrival = &next_arrival;
+        data[t].accepted = accepted;
+        data[t].replayed = replayed;
+        data[t].num_old = 0;
+        data[t].num_misguess = 0;
+        if (pthread_create(&threads[t], NULL, rdbx_atomic_thread, &data[t])) {
+            printf("pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    for (size_t t = 0; t < RDBX_NUM_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        num_old += data[t].num_old;
+        num_misguess += data[t].num_misguess;
+    }
+
+    for (size_t i = 0; i < num_packets; i++) {
+        if (accepted[i] > 1) {
+            printf("index %zu accepted %u times\n", i, accepted[i]);
+            status = srtp_err_status_algo_fail;
+            break;
+        }
+        if (accepted[i] == 0 && replayed[i] != 0) {
+            printf("index %zu rejected as replay but never accepted\n", i);
+            status = srtp_err_status_algo_fail;
+            break;
+        }
+        num_accepted += accepted[i];
+        num_replayed += replayed[i];
+    }
+
+    printf("\t%zu arrivals: %zu accepted, %zu replays, %zu old, "
+           "%zu mis-estimated\n",
+           num_arrivals, num_accepted, num_replayed, num_old, num_misguess);
+
+    if (num_accepted == 0) {
+        status = srtp_err_status_algo_fail;
+    }
+
+    free(arrivals);
+    free(accepted);
+    free(replayed);
+    srtp_rdbx_atomic_release(rdbx);
+
+    return status;
+}
+
+#else /* HAVE_PTHREAD_H */
+
+srtp_err_status_t test_rdbx_atomic_threads(size_t num_packets, size_t ws)
+{
+    (void)num_packets;
+    (void)ws;
+
+    printf("\tno thread support, skipped\n");
+
+    return srtp_err_status_ok;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
 #include <time.h> /* for clock()  */
 
-double rdbx_check_adds_per_second(size_t num_trials, size_t ws)
+/*
+ * rdbx_check_adds_per_second(num_trials, ws, pattern) times num_trials
+ * check/add pairs on an rdbx of window size ws, with indices arriving
+ * according to pattern.  The indices are generated up front so that only
+ * the rdbx calls are timed.  Indices that have fallen out of the window
+ * (possible when reordering exceeds ws) are dropped, not counted as
+ * failures.
+ */
+double rdbx_check_adds_per_second(size_t num_trials,
+                                  size_t ws,
+                                  rdbx_pattern_t pattern)
 {
     ssize_t delta;
     srtp_rdbx_t rdbx;
     srtp_xtd_seq_num_t est;
+    srtp_err_status_t status;
     clock_t timer;
     size_t failures = 0; /* count number of failures */
+    uint32_t *idx;
+    uint32_t next = 0;
+
+    idx = malloc(num_trials * sizeof(*idx));
+    if (idx == NULL) {
+        printf("malloc failed\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < num_trials; i++) {
+        switch (pattern) {
+        case rdbx_pattern_gaps:
+            idx[i] = next;
+            next += 1 + (srtp_cipher_rand_u32_for_tests() % 2048);
+            break;
+        case rdbx_pattern_reordered:
+        case rdbx_pattern_sequential:
+        default:
+            idx[i] = (uint32_t)i;
+            break;
+        }
+    }
+
+    /*
+     * ut_next_index() is too slow to generate this many indices, so
+     * reorder by swapping each index with one up to 127 places later
+     */
+    if (pattern == rdbx_pattern_reordered) {
+        for (size_t i = 0; i + 128 < num_trials; i++) {
+            size_t j = i + (srtp_cipher_rand_u32_for_tests() & 127);
+            uint32_t tmp = idx[i];
+            idx[i] = idx[j];
+            idx[j] = tmp;
+        }
+    }
 
     if (srtp_rdbx_init(&rdbx, ws) != srtp_err_status_ok) {
         printf("replay_init failed\n");
@@ -341,9 +798,13 @@ double rdbx_check_adds_per_second(size_t num_trials, size_t ws)
 
     timer = clock();
     for (size_t i = 0; i < num_trials; i++) {
-        delta = srtp_index_guess(&rdbx.index, &est, (srtp_sequence_number_t)i);
+        delta = srtp_index_guess(&rdbx.index, &est,
+                                 (srtp_sequence_number_t)idx[i]);
 
-        if (srtp_rdbx_check(&rdbx, delta) != srtp_err_status_ok) {
+        status = srtp_rdbx_check(&rdbx, delta);
+        if (status == srtp_err_status_replay_old) {
+            continue;
+        } else if (status != srtp_err_status_ok) {
             ++failures;
         } else if (srtp_rdbx_add_index(&rdbx, delta) != srtp_err_status_ok) {
             ++failures;
@@ -354,7 +815,11 @@ double rdbx_check_adds_per_second(size_t num_trials, size_t ws)
         timer = 1;
     }
 
-    printf("number of failures: %zd \n", failures);
+    if (failures) {
+        printf("number of failures: %zd \n", failures);
+    }
+
+    free(idx);
 
     srtp_rdbx_dealloc(&rdbx);
 
@@ -61,23 +61,50 @@
 
 size_t num_trials = 1 << 16;
 
-srtp_err_status_t test_rdb_db(void);
+srtp_err_status_t test_rdb_db(size_t ws);
 
-double rdb_check_adds_per_second(void);
+srtp_err_status_t test_rdb_window_size(size_t ws);
+
+srtp_err_status_t test_rdb_copy(void);
+
+double rdb_check_adds_per_second(size_t ws);
+
+static const size_t window_sizes[] = { 128, 1024, 32768 };
 
 int main(void)
 {
     srtp_err_status_t err;
 
-    printf("testing anti-replay database (srtp_rdb_t)...\n");
-    err = test_rdb_db();
+    for (size_t i = 0; i < sizeof(window_sizes) / sizeof(window_sizes[0]);
+         i++) {
+        printf("testing anti-replay database (srtp_rdb_t, ws=%zu)...\n",
+               window_sizes[i]);
+        err = test_rdb_db(window_sizes[i]);
+        if (err) {
+            printf("failed\n");
+            exit(1);
+        }
+        err = test_rdb_window_size(window_sizes[i]);
+        if (err) {
+            printf("failed\n");
+            exit(1);
+        }
+        printf("done\n");
+    }
+
+    printf("testing srtp_rdb_copy()...\n");
+    err = test_rdb_copy();
     if (err) {
         printf("failed\n");
         exit(1);
     }
     printf("done\n");
 
-    printf("rdb_check/rdb_adds per second: %e\n", rdb_check_adds_per_second());
+    for (size_t i = 0; i < sizeof(window_sizes) / sizeof(window_sizes[0]);
+         i++) {
+        printf("rdb_check/rdb_adds per second (ws=%zu): %e\n",
+               window_sizes[i], rdb_check_adds_per_second(window_sizes[i]));
+    }
 
     return 0;
 }
@@ -132,14 +159,14 @@ srtp_err_status_t rdb_check_add_unordered(srtp_rdb_t *rdb, uint32_t idx)
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t test_rdb_db(void)
+srtp_err_status_t test_rdb_db(size_t ws)
 {
     srtp_rdb_t rdb;
     uint32_t ircvd;
     ut_connection utc;
     srtp_err_status_t err;
 
-    if (srtp_rdb_init(&rdb) != srtp_err_status_ok) {
+    if (srtp_rdb_init(&rdb, ws) != srtp_err_status_ok) {
         printf("rdb_init failed\n");
         return srtp_err_status_init_fail;
     }
@@ -161,7 +188,8 @@ srtp_err_status_t test_rdb_db(void)
     }
 
     /* re-initialize */
-    if (srtp_rdb_init(&rdb) != srtp_err_status_ok) {
+    srtp_rdb_dealloc(&rdb);
+    if (srtp_rdb_init(&rdb, ws) != srtp_err_status_ok) {
         printf("rdb_init failed\n");
         return srtp_err_status_fail;
     }
@@ -182,7 +210,8 @@ srtp_err_status_t test_rdb_db(void)
     }
 
     /* re-initialize */
-    if (srtp_rdb_init(&rdb) != srtp_err_status_ok) {
+    srtp_rdb_dealloc(&rdb);
+    if (srtp_rdb_init(&rdb, ws) != srtp_err_status_ok) {
         printf("rdb_init failed\n");
         return srtp_err_status_fail;
     }
@@ -202,7 +231,8 @@ srtp_err_status_t test_rdb_db(void)
     }
 
     /* re-initialize */
-    if (srtp_rdb_init(&rdb) != srtp_err_status_ok) {
+    srtp_rdb_dealloc(&rdb);
+    if (srtp_rdb_init(&rdb, ws) != srtp_err_status_ok) {
         printf("rdb_init failed\n");
         return srtp_err_status_fail;
     }
@@ -224,7 +254,8 @@ srtp_err_status_t test_rdb_db(void)
     }
 
     /* test for key expired */
-    if (srtp_rdb_init(&rdb) != srtp_err_status_ok) {
+    srtp_rdb_dealloc(&rdb);
+    if (srtp_rdb_init(&rdb, ws) != srtp_err_status_ok) {
         printf("rdb_init failed\n");
         return srtp_err_status_fail;
     }
@@ -247,20 +278,154 @@ srtp_err_status_t test_rdb_db(void)
         return srtp_err_status_fail;
     }
 
+    srtp_rdb_dealloc(&rdb);
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * test_rdb_window_size(ws) checks that a packet delayed by up to ws - 1
+ * packets is accepted, and that one delayed by ws packets is rejected
+ * as old
+ */
+srtp_err_status_t test_rdb_window_size(size_t ws)
+{
+    srtp_rdb_t rdb;
+    srtp_err_status_t err;
+    const uint32_t last = (uint32_t)(3 * ws);
+    const uint32_t oldest = last - (uint32_t)(ws - 1);
+
+    if (srtp_rdb_init(&rdb, ws) != srtp_err_status_ok) {
+        printf("rdb_init failed\n");
+        return srtp_err_status_init_fail;
+    }
+
+    if (srtp_rdb_get_window_size(&rdb) != ws) {
+        printf("rdb window size was not %zu\n", ws);
+        srtp_rdb_dealloc(&rdb);
+        return srtp_err_status_fail;
+    }
+
+    /* receive everything up to last, except oldest and the one before */
+    for (uint32_t idx = 0; idx <= last; idx++) {
+        if (idx == oldest || idx == oldest - 1) {
+            continue;
+        }
+        err = rdb_check_add(&rdb, idx);
+        if (err) {
+            srtp_rdb_dealloc(&rdb);
+            return err;
+        }
+    }
+
+    if (srtp_rdb_check(&rdb, oldest - 1) != srtp_err_status_replay_old) {
+        printf("index %u was not rejected as old\n", oldest - 1);
+        srtp_rdb_dealloc(&rdb);
+        return srtp_err_status_fail;
+    }
+
+    err = rdb_check_add(&rdb, oldest);
+    if (err) {
+        srtp_rdb_dealloc(&rdb);
+        return err;
+    }
+
+    /* everything in the window has now been received */
+    for (uint32_t idx = oldest; idx <= last; idx++) {
+        if (srtp_rdb_check(&rdb, idx) != srtp_err_status_replay_fail) {
+            printf("index %u was not rejected as a replay\n", idx);
+            srtp_rdb_dealloc(&rdb);
+            return srtp_err_status_fail;
+        }
+    }
+
+    srtp_rdb_dealloc(&rdb);
+
     return srtp_err_status_ok;
 }
 
+/*
+ * test_rdb_copy() checks that srtp_rdb_copy() gives the destination the
+ * state it would have had if it had received the same packets, for
+ * destinations narrower, as wide as and wider than the source
+ */
+srtp_err_status_t test_rdb_copy(void)
+{
+    static const size_t dst_sizes[] = { 64, 512, 4096 };
+    srtp_rdb_t src;
+    uint32_t idx;
+    srtp_err_status_t err = srtp_err_status_ok;
+
+    if (srtp_rdb_init(&src, 512) != srtp_err_status_ok) {
+        printf("rdb_init failed\n");
+        return srtp_err_status_init_fail;
+    }
+
+    /* every third packet of the first 2000 */
+    for (idx = 0; idx < 2000; idx += 3) {
+        err = rdb_check_add(&src, idx);
+        if (err) {
+            srtp_rdb_dealloc(&src);
+            return err;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(dst_sizes) / sizeof(dst_sizes[0]); i++) {
+        srtp_rdb_t dst;
+        srtp_rdb_t expected;
+
+        if (srtp_rdb_init(&dst, dst_sizes[i]) != srtp_err_status_ok ||
+            srtp_rdb_init(&expected, dst_sizes[i]) != srtp_err_status_ok) {
+            printf("rdb_init failed\n");
+            srtp_rdb_dealloc(&dst);
+            srtp_rdb_dealloc(&src);
+            return srtp_err_status_init_fail;
+        }
+
+        /* expected sees only what is still in the source window */
+        expected.window_start = src.window_start;
+        for (idx = 0; idx < 2000; idx += 3) {
+            if (idx >= src.window_start) {
+                srtp_rdb_add_index(&expected, idx);
+            }
+        }
+
+        /* dst starts out with unrelated state that must be discarded */
+        srtp_rdb_add_index(&dst, 5000);
+        srtp_rdb_copy(&dst, &src);
+
+        for (idx = 0; idx < 2100; idx++) {
+            if (srtp_rdb_check(&dst, idx) != srtp_rdb_check(&expected, idx)) {
+                printf("copy to ws=%zu differs at index %u\n", dst_sizes[i],
+                       idx);
+                err = srtp_err_status_fail;
+                break;
+            }
+        }
+
+        srtp_rdb_dealloc(&dst);
+        srtp_rdb_dealloc(&expected);
+        if (err) {
+            break;
+        }
+    }
+
+    srtp_rdb_dealloc(&src);
+
+    return err;
+}
+
 #include <time.h>   /* for clock()  */
 #include <stdlib.h> /* for random() */
 
 #define REPLAY_NUM_TRIALS 10000000
 
-double rdb_check_adds_per_second(void)
+double rdb_check_adds_per_second(size_t ws)
 {
     srtp_rdb_t rdb;
     clock_t timer;
 
-    if (srtp_rdb_init(&rdb) != srtp_err_status_ok) {
+    if (srtp_rdb_init(&rdb, ws) != srtp_err_status_ok) {
         printf("rdb_init failed\n");
         exit(1);
     }
@@ -276,5 +441,7 @@ double rdb_check_adds_per_second(void)
     }
     timer = clock() - timer;
 
+    srtp_rdb_dealloc(&rdb);
+
     return (double)CLOCKS_PER_SEC * REPLAY_NUM_TRIALS / timer;
 }
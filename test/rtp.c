@@ -43,6 +43,11 @@
  *
  */
 
+/* sendmmsg() and recvmmsg() are GNU extensions */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "rtp.h"
 
 #include "cipher_priv.h"
@@ -54,6 +59,9 @@
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#if defined(HAVE_SENDMMSG) || defined(HAVE_RECVMMSG)
+#include <sys/uio.h>
+#endif
 
 #define PRINT_DEBUG 0   /* set to 1 to print out debugging data */
 #define VERBOSE_DEBUG 0 /* set to 1 to print out more data      */
@@ -148,6 +156,199 @@ ssize_t rtp_recvfrom(rtp_receiver_t receiver, void *msg, size_t *len)
     return octets_recvd;
 }
 
+/*
+ * rtp_burst_track_seq(stats, seq) extends the 16-bit sequence number of a
+ * received packet and counts the packets skipped since the highest one
+ * seen so far; a late packet fills one of the gaps counted before
+ */
+static void rtp_burst_track_seq(rtp_burst_stats_t *stats, uint16_t seq)
+{
+    int16_t diff;
+
+    if (!stats->seq_valid) {
+        stats->seq_valid = true;
+        stats->highest_seq = seq;
+        return;
+    }
+
+    diff = (int16_t)(seq - (uint16_t)stats->highest_seq);
+    if (diff > 0) {
+        stats->lost += (uint64_t)(diff - 1);
+        stats->highest_seq += (uint64_t)diff;
+    } else if (stats->lost > 0) {
+        stats->lost--;
+    }
+}
+
+ssize_t rtp_send_burst(rtp_sender_t sender, rtp_burst_stats_t *stats)
+{
+    srtp_err_status_t stat;
+    size_t msg_len = RTP_HEADER_LEN + sender->burst_payload_len;
+    size_t pkt_len[RTP_MAX_BURST];
+    uint8_t *pkt[RTP_MAX_BURST];
+    size_t num_pkts = 0;
+    size_t num_sent = 0;
+
+    if (sender->burst_buf == NULL) {
+        return -1;
+    }
+
+    /* marshal and protect the whole burst before touching the socket */
+    for (size_t i = 0; i < sender->burst_size; i++) {
+        uint8_t *slot = sender->burst_buf + i * RTP_BURST_PKT_LEN;
+
+        sender->message.header.seq =
+            htons((uint16_t)(ntohs(sender->message.header.seq) + 1));
+        sender->message.header.ts = htonl(ntohl(sender->message.header.ts) + 1);
+
+        memcpy(slot, &sender->message.header, RTP_HEADER_LEN);
+        memcpy(slot + RTP_HEADER_LEN, sender->message.body,
+               sender->burst_payload_len);
+
+        pkt_len[num_pkts] = RTP_BURST_PKT_LEN;
+        stat = srtp_protect(sender->srtp_ctx, slot, msg_len, slot,
+                            &pkt_len[num_pkts], 0);
+        if (stat) {
+#if PRINT_DEBUG
+            fprintf(stderr, "error: srtp protection failed with code %d\n",
+                    stat);
+#endif
+            stats->other_fail++;
+            continue;
+        }
+        pkt[num_pkts++] = slot;
+    }
+
+#ifdef HAVE_SENDMMSG
+    {
+        struct mmsghdr msgs[RTP_MAX_BURST];
+        struct iovec iov[RTP_MAX_BURST];
+
+        memset(msgs, 0, sizeof(msgs));
+        for (size_t i = 0; i < num_pkts; i++) {
+            iov[i].iov_base = pkt[i];
+            iov[i].iov_len = pkt_len[i];
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &sender->addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        /* sendmmsg() may stop short of the full vector, so keep going */
+        while (num_sent < num_pkts) {
+            int ret = sendmmsg(sender->socket, msgs + num_sent,
+                               (unsigned int)(num_pkts - num_sent), 0);
+            if (ret <= 0) {
+                break;
+            }
+            num_sent += (size_t)ret;
+        }
+    }
+#else
+    for (; num_sent < num_pkts; num_sent++) {
+        ssize_t ret = sendto(sender->socket, (void *)pkt[num_sent],
+                             pkt_len[num_sent], 0,
+                             (struct sockaddr *)&sender->addr,
+                             sizeof(struct sockaddr_in));
+        if (ret < 0) {
+            break;
+        }
+    }
+#endif
+
+    for (size_t i = 0; i < num_sent; i++) {
+        stats->packets++;
+        stats->octets += pkt_len[i];
+    }
+
+    if (num_sent == 0 && num_pkts > 0) {
+        return -1;
+    }
+
+    return (ssize_t)num_sent;
+}
+
+ssize_t rtp_recv_burst(rtp_receiver_t rcvr, rtp_burst_stats_t *stats)
+{
+    srtp_err_status_t stat;
+    size_t pkt_len[RTP_MAX_BURST];
+    size_t num_recvd = 0;
+
+    if (rcvr->burst_buf == NULL) {
+        return -1;
+    }
+
+#ifdef HAVE_RECVMMSG
+    {
+        struct mmsghdr msgs[RTP_MAX_BURST];
+        struct iovec iov[RTP_MAX_BURST];
+        int ret;
+
+        memset(msgs, 0, sizeof(msgs));
+        for (size_t i = 0; i < rcvr->burst_size; i++) {
+            iov[i].iov_base = rcvr->burst_buf + i * RTP_BURST_PKT_LEN;
+            iov[i].iov_len = RTP_BURST_PKT_LEN;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        /* block for the first datagram, then take whatever is queued */
+        ret = recvmmsg(rcvr->socket, msgs, (unsigned int)rcvr->burst_size,
+                       MSG_WAITFORONE, NULL);
+        if (ret < 0) {
+            return -1;
+        }
+        num_recvd = (size_t)ret;
+        for (size_t i = 0; i < num_recvd; i++) {
+            pkt_len[i] = msgs[i].msg_len;
+        }
+    }
+#else
+    {
+        ssize_t ret = recvfrom(rcvr->socket, (void *)rcvr->burst_buf,
+                               RTP_BURST_PKT_LEN, 0, (struct sockaddr *)NULL, 0);
+        if (ret < 0) {
+            return -1;
+        }
+        num_recvd = 1;
+        pkt_len[0] = (size_t)ret;
+    }
+#endif
+
+    for (size_t i = 0; i < num_recvd; i++) {
+        uint8_t *slot = rcvr->burst_buf + i * RTP_BURST_PKT_LEN;
+        const srtp_hdr_t *hdr = (const srtp_hdr_t *)slot;
+        size_t octets_recvd = pkt_len[i];
+
+        if (octets_recvd < RTP_HEADER_LEN || hdr->version != 2) {
+            stats->other_fail++;
+            continue;
+        }
+
+        stat = srtp_unprotect(rcvr->srtp_ctx, slot, octets_recvd, slot,
+                              &octets_recvd);
+        switch (stat) {
+        case srtp_err_status_ok:
+            stats->packets++;
+            stats->octets += pkt_len[i];
+            rtp_burst_track_seq(stats, ntohs(hdr->seq));
+            break;
+        case srtp_err_status_auth_fail:
+            stats->auth_fail++;
+            break;
+        case srtp_err_status_replay_fail:
+        case srtp_err_status_replay_old:
+            stats->replay_fail++;
+            break;
+        default:
+            stats->other_fail++;
+            break;
+        }
+    }
+
+    return (ssize_t)num_recvd;
+}
+
 srtp_err_status_t rtp_sender_init(rtp_sender_t sender,
                                   int sock,
                                   struct sockaddr_in addr,
@@ -167,6 +368,9 @@ srtp_err_status_t rtp_sender_init(rtp_sender_t sender,
     /* set other stuff */
     sender->socket = sock;
     sender->addr = addr;
+    sender->burst_buf = NULL;
+    sender->burst_size = 0;
+    sender->burst_payload_len = 0;
 
     return srtp_err_status_ok;
 }
@@ -190,6 +394,53 @@ srtp_err_status_t rtp_receiver_init(rtp_receiver_t rcvr,
     /* set other stuff */
     rcvr->socket = sock;
     rcvr->addr = addr;
+    rcvr->burst_buf = NULL;
+    rcvr->burst_size = 0;
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t rtp_sender_init_burst(rtp_sender_t sender,
+                                        size_t burst,
+                                        size_t payload_len)
+{
+    if (burst == 0 || burst > RTP_MAX_BURST) {
+        return srtp_err_status_bad_param;
+    }
+
+    if (RTP_HEADER_LEN + payload_len + SRTP_MAX_TRAILER_LEN >
+        RTP_BURST_PKT_LEN) {
+        return srtp_err_status_bad_param;
+    }
+
+    free(sender->burst_buf);
+    sender->burst_buf = (uint8_t *)malloc(burst * RTP_BURST_PKT_LEN);
+    if (sender->burst_buf == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    sender->burst_size = burst;
+    sender->burst_payload_len = payload_len;
+
+    /* fill the payload with a recognizable pattern */
+    for (size_t i = 0; i < payload_len; i++) {
+        sender->message.body[i] = (char)('a' + i % 26);
+    }
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t rtp_receiver_init_burst(rtp_receiver_t rcvr, size_t burst)
+{
+    if (burst == 0 || burst > RTP_MAX_BURST) {
+        return srtp_err_status_bad_param;
+    }
+
+    free(rcvr->burst_buf);
+    rcvr->burst_buf = (uint8_t *)malloc(burst * RTP_BURST_PKT_LEN);
+    if (rcvr->burst_buf == NULL) {
+        return srtp_err_status_alloc_fail;
+    }
+    rcvr->burst_size = burst;
 
     return srtp_err_status_ok;
 }
@@ -223,6 +474,7 @@ rtp_sender_t rtp_sender_alloc(void)
 
 void rtp_sender_dealloc(rtp_sender_t rtp_ctx)
 {
+    free(rtp_ctx->burst_buf);
     free(rtp_ctx);
 }
 
@@ -233,5 +485,6 @@ rtp_receiver_t rtp_receiver_alloc(void)
 
 void rtp_receiver_dealloc(rtp_receiver_t rtp_ctx)
 {
+    free(rtp_ctx->burst_buf);
     free(rtp_ctx);
 }
@@ -75,6 +75,18 @@ extern "C" {
  */
 #define RTP_MAX_BUF_LEN 16384
 
+/*
+ * RTP_MAX_BURST is the largest number of packets moved by a single call
+ * to rtp_send_burst() or rtp_recv_burst()
+ */
+#define RTP_MAX_BURST 64
+
+/*
+ * RTP_BURST_PKT_LEN is the size of each packet slot in a burst buffer;
+ * it must hold an RTP header, the payload and the SRTP trailer
+ */
+#define RTP_BURST_PKT_LEN 2048
+
 typedef srtp_hdr_t rtp_hdr_t;
 
 typedef struct {
@@ -87,6 +99,9 @@ typedef struct rtp_sender_ctx_t {
     int socket;
     srtp_ctx_t *srtp_ctx;
     struct sockaddr_in addr; /* reciever's address */
+    uint8_t *burst_buf;      /* burst_size packet slots, or NULL */
+    size_t burst_size;
+    size_t burst_payload_len;
 } rtp_sender_ctx_t;
 
 typedef struct rtp_receiver_ctx_t {
@@ -94,8 +109,25 @@ typedef struct rtp_receiver_ctx_t {
     int socket;
     srtp_ctx_t *srtp_ctx;
     struct sockaddr_in addr; /* receiver's address */
+    uint8_t *burst_buf;      /* burst_size packet slots, or NULL */
+    size_t burst_size;
 } rtp_receiver_ctx_t;
 
+/*
+ * rtp_burst_stats_t accumulates the results of rtp_send_burst() and
+ * rtp_recv_burst() calls
+ */
+typedef struct rtp_burst_stats_t {
+    uint64_t packets;     /* packets sent or successfully unprotected */
+    uint64_t octets;      /* octets of those packets on the wire      */
+    uint64_t auth_fail;   /* packets rejected by srtp_unprotect()     */
+    uint64_t replay_fail; /* packets rejected as replays              */
+    uint64_t other_fail;  /* any other protect/unprotect failure      */
+    uint64_t lost;        /* gaps in the received sequence numbers    */
+    bool seq_valid;       /* true once a packet has been received     */
+    uint64_t highest_seq; /* highest extended sequence number seen    */
+} rtp_burst_stats_t;
+
 typedef struct rtp_sender_ctx_t *rtp_sender_t;
 
 typedef struct rtp_receiver_ctx_t *rtp_receiver_t;
@@ -124,6 +156,35 @@ srtp_err_status_t rtp_receiver_init_srtp(rtp_receiver_t sender,
 
 srtp_err_status_t rtp_receiver_deinit_srtp(rtp_receiver_t sender);
 
+/*
+ * rtp_sender_init_burst(sender, burst, payload_len) prepares the sender
+ * for rtp_send_burst(), sending burst packets with payload_len octets of
+ * payload each per call
+ */
+srtp_err_status_t rtp_sender_init_burst(rtp_sender_t sender,
+                                        size_t burst,
+                                        size_t payload_len);
+
+/*
+ * rtp_send_burst(sender, stats) protects a burst of consecutive RTP
+ * packets and sends them with a single sendmmsg() call where available;
+ * returns the number of packets sent or -1 on error
+ */
+ssize_t rtp_send_burst(rtp_sender_t sender, rtp_burst_stats_t *stats);
+
+/*
+ * rtp_receiver_init_burst(rcvr, burst) prepares the receiver for
+ * rtp_recv_burst(), receiving up to burst packets per call
+ */
+srtp_err_status_t rtp_receiver_init_burst(rtp_receiver_t rcvr, size_t burst);
+
+/*
+ * rtp_recv_burst(rcvr, stats) receives up to a burst of packets with a
+ * single recvmmsg() call where available and unprotects each of them;
+ * returns the number of datagrams received or -1 on error
+ */
+ssize_t rtp_recv_burst(rtp_receiver_t rcvr, rtp_burst_stats_t *stats);
+
 rtp_sender_t rtp_sender_alloc(void);
 
 void rtp_sender_dealloc(rtp_sender_t rtp_ctx);
@@ -0,0 +1,978 @@
+/*
+ * rtp_relay.c
+ *
+ * io_uring based SRTP relay
+ *
+ * This app receives SRTP on one UDP socket, unprotects each packet,
+ * re-protects it under a second policy and sends it out again.  All
+ * socket I/O is driven through an io_uring: a single multishot recv
+ * fills kernel-selected buffers from a provided buffer ring and the
+ * re-protected packets leave through zero-copy sends from a set of
+ * registered buffers, so that the number of system calls per packet
+ * approaches zero and what remains is the cost of libsrtp itself.
+ *
+ * With -T the app forks a generator/sink pair on the loopback
+ * interface and reports relay throughput and end-to-end latency.
+ * See the usage() function for more details.
+ *
+ */
+
+/*
+ *
+ * Copyright (c) 2001-2017, Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* syscall() and the io_uring mmap flags are GNU extensions */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "getopt_s.h" /* for local getopt()  */
+
+#include <stdio.h>  /* for printf, fprintf */
+#include <stdlib.h> /* for atoi()          */
+#include <errno.h>
+#include <signal.h> /* for signal()        */
+#include <string.h>
+#include <time.h> /* for clock_gettime() */
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "srtp.h"
+#include "util.h"
+
+/* exit status understood by ctest and meson as "test skipped" */
+#define EXIT_SKIP 77
+
+#define RELAY_RING_ENTRIES 256
+#define RELAY_NUM_BUFS 256 /* must be a power of two */
+#define RELAY_BUF_LEN 2048
+#define RELAY_BUF_GROUP 0
+#define RELAY_PAYLOAD_LEN 160
+#define RELAY_WINDOW 32
+#define RELAY_COUNT 100000
+#define RELAY_KEY_LEN 30 /* AES-128 key plus 112-bit salt */
+#define RELAY_HDR_LEN 12
+
+/* user_data tags that tell the completions apart */
+#define TAG_RECV 1ULL
+#define TAG_SEND 2ULL
+#define TAG_DONE 3ULL
+#define TAG_SHIFT 32
+
+static const char default_key_in[] =
+    "c1eec3717da76195bb878578790af71c4ee9f859e197a414a78d5abc7451";
+static const char default_key_out[] =
+    "e1f97a0d3e018be0d64fa32c06de41390ec675ad498afeebb6960b3aabe6";
+
+/*
+ * relay_ring_t holds the memory-mapped submission and completion
+ * queues of an io_uring, set up without liburing
+ */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+} relay_ring_t;
+
+/*
+ * relay_stats_t collects the counters reported when the relay exits
+ */
+typedef struct {
+    uint64_t received;
+    uint64_t relayed;
+    uint64_t octets;
+    uint64_t unprotect_fail;
+    uint64_t protect_fail;
+    uint64_t send_fail;
+    uint64_t dropped; /* no free send buffer */
+    uint64_t enter_calls;
+    uint64_t srtp_ns; /* time spent inside srtp_unprotect/srtp_protect */
+} relay_stats_t;
+
+typedef struct {
+    relay_ring_t ring;
+    srtp_t srtp_in;
+    srtp_t srtp_out;
+    int in_sock;
+    int out_sock;
+    int done_fd;
+    bool done;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    uint16_t buf_ring_tail;
+    uint8_t *recv_pool;
+    uint8_t *send_pool;
+    uint16_t free_slots[RELAY_NUM_BUFS];
+    size_t num_free_slots;
+    relay_stats_t stats;
+} relay_t;
+
+void usage(char *prog_name);
+
+volatile int interrupted = 0;
+
+static void handle_signal(int signum)
+{
+    (void)signum;
+    interrupted = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd,
+                              unsigned to_submit,
+                              unsigned min_complete,
+                              unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd,
+                                 unsigned opcode,
+                                 void *arg,
+                                 unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int ring_init(relay_ring_t *r, unsigned entries)
+{
+    struct io_uring_params p;
+    uint8_t *sq;
+    uint8_t *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            return -1;
+        }
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    sq = r->sq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+
+    cq = r->cq_ptr;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void ring_deinit(relay_ring_t *r)
+{
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED &&
+        r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+}
+
+/*
+ * ring_submit(r, wait_nr) hands all queued sqes to the kernel and
+ * optionally waits for wait_nr completions, in a single system call
+ */
+static int ring_submit(relay_t *relay, unsigned wait_nr)
+{
+    relay_ring_t *r = &relay->ring;
+    int ret;
+
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    ret = sys_io_uring_enter(r->fd, r->to_submit, wait_nr,
+                             wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    relay->stats.enter_calls++;
+    if (ret < 0) {
+        return -errno;
+    }
+    r->to_submit -= (unsigned)ret < r->to_submit ? (unsigned)ret : r->to_submit;
+    return ret;
+}
+
+static struct io_uring_sqe *ring_get_sqe(relay_t *relay)
+{
+    relay_ring_t *r = &relay->ring;
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+        r->sq_entries) {
+        /* queue full, flush it to the kernel */
+        if (ring_submit(relay, 0) < 0) {
+            return NULL;
+        }
+        if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+            r->sq_entries) {
+            return NULL;
+        }
+    }
+
+    idx = r->sq_local_tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    r->to_submit++;
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+static void buf_ring_add(relay_t *relay, uint16_t bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &relay->buf_ring->bufs[relay->buf_ring_tail & (RELAY_NUM_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(relay->recv_pool + bid * RELAY_BUF_LEN);
+    buf->len = RELAY_BUF_LEN;
+    buf->bid = bid;
+    relay->buf_ring_tail++;
+}
+
+static void buf_ring_publish(relay_t *relay)
+{
+    __atomic_store_n(&relay->buf_ring->tail, relay->buf_ring_tail,
+                     __ATOMIC_RELEASE);
+}
+
+static int queue_recv(relay_t *relay)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(relay);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = relay->in_sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RELAY_BUF_GROUP;
+    sqe->user_data = TAG_RECV << TAG_SHIFT;
+
+    return 0;
+}
+
+static int queue_send(relay_t *relay, uint16_t slot, size_t len)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(relay);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND_ZC;
+    sqe->fd = relay->out_sock;
+    sqe->addr = (uint64_t)(uintptr_t)(relay->send_pool + slot * RELAY_BUF_LEN);
+    sqe->len = (uint32_t)len;
+    sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+    sqe->buf_index = slot;
+    sqe->user_data = (TAG_SEND << TAG_SHIFT) | slot;
+
+    return 0;
+}
+
+static int queue_done_poll(relay_t *relay)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(relay);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = relay->done_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = TAG_DONE << TAG_SHIFT;
+
+    return 0;
+}
+
+/*
+ * relay_packet(...) moves one received packet from the provided buffer
+ * into a registered send buffer, translating it from the inbound to the
+ * outbound policy on the way
+ */
+static void relay_packet(relay_t *relay, uint16_t bid, size_t len)
+{
+    const uint8_t *pkt = relay->recv_pool + bid * RELAY_BUF_LEN;
+    srtp_err_status_t status;
+    uint16_t slot;
+    uint8_t *out;
+    size_t out_len = RELAY_BUF_LEN;
+    uint64_t start;
+
+    relay->stats.received++;
+
+    if (relay->num_free_slots == 0) {
+        relay->stats.dropped++;
+        return;
+    }
+    slot = relay->free_slots[--relay->num_free_slots];
+    out = relay->send_pool + slot * RELAY_BUF_LEN;
+
+    start = now_ns();
+    status = srtp_unprotect(relay->srtp_in, pkt, len, out, &out_len);
+    if (status) {
+        relay->stats.srtp_ns += now_ns() - start;
+        relay->stats.unprotect_fail++;
+        relay->free_slots[relay->num_free_slots++] = slot;
+        return;
+    }
+    len = out_len;
+    out_len = RELAY_BUF_LEN;
+    status = srtp_protect(relay->srtp_out, out, len, out, &out_len, 0);
+    relay->stats.srtp_ns += now_ns() - start;
+    if (status) {
+        relay->stats.protect_fail++;
+        relay->free_slots[relay->num_free_slots++] = slot;
+        return;
+    }
+
+    if (queue_send(relay, slot, out_len)) {
+        relay->stats.send_fail++;
+        relay->free_slots[relay->num_free_slots++] = slot;
+        return;
+    }
+    relay->stats.octets += out_len;
+}
+
+static int relay_handle_cqe(relay_t *relay, const struct io_uring_cqe *cqe)
+{
+    uint64_t tag = cqe->user_data >> TAG_SHIFT;
+
+    switch (tag) {
+    case TAG_RECV:
+        if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+            relay_packet(relay, bid, (size_t)cqe->res);
+            buf_ring_add(relay, bid);
+            buf_ring_publish(relay);
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+            fprintf(stderr, "error: multishot recv failed: %s\n",
+                    strerror(-cqe->res));
+            return -cqe->res;
+        }
+        /* the kernel ends a multishot recv on its own, e.g. on ENOBUFS */
+        if (!(cqe->flags & IORING_CQE_F_MORE) && queue_recv(relay)) {
+            return EBUSY;
+        }
+        break;
+    case TAG_SEND:
+        if (cqe->flags & IORING_CQE_F_NOTIF) {
+            /* the kernel is done with the buffer */
+            relay->free_slots[relay->num_free_slots++] =
+                (uint16_t)cqe->user_data;
+            break;
+        }
+        if (cqe->res < 0) {
+            relay->stats.send_fail++;
+        } else {
+            relay->stats.relayed++;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            /* no notification will follow */
+            relay->free_slots[relay->num_free_slots++] =
+                (uint16_t)cqe->user_data;
+        }
+        break;
+    case TAG_DONE:
+        relay->done = true;
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+static int relay_init(relay_t *relay)
+{
+    struct io_uring_buf_reg reg;
+    struct iovec iov[RELAY_NUM_BUFS];
+
+    if (ring_init(&relay->ring, RELAY_RING_ENTRIES)) {
+        return errno;
+    }
+
+    relay->recv_pool = malloc(RELAY_NUM_BUFS * RELAY_BUF_LEN);
+    relay->send_pool = malloc(RELAY_NUM_BUFS * RELAY_BUF_LEN);
+    if (relay->recv_pool == NULL || relay->send_pool == NULL) {
+        return ENOMEM;
+    }
+
+    /* the send buffers are registered once and referred to by index */
+    for (size_t i = 0; i < RELAY_NUM_BUFS; i++) {
+        iov[i].iov_base = relay->send_pool + i * RELAY_BUF_LEN;
+        iov[i].iov_len = RELAY_BUF_LEN;
+        relay->free_slots[i] = (uint16_t)(RELAY_NUM_BUFS - 1 - i);
+    }
+    relay->num_free_slots = RELAY_NUM_BUFS;
+    if (sys_io_uring_register(relay->ring.fd, IORING_REGISTER_BUFFERS, iov,
+                              RELAY_NUM_BUFS)) {
+        return errno;
+    }
+
+    /* the receive buffers are handed to the kernel through a buffer ring */
+    relay->buf_ring_len = RELAY_NUM_BUFS * sizeof(struct io_uring_buf);
+    relay->buf_ring = mmap(NULL, relay->buf_ring_len, PROT_READ | PROT_WRITE,
+                           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (relay->buf_ring == MAP_FAILED) {
+        relay->buf_ring = NULL;
+        return errno;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)relay->buf_ring;
+    reg.ring_entries = RELAY_NUM_BUFS;
+    reg.bgid = RELAY_BUF_GROUP;
+    if (sys_io_uring_register(relay->ring.fd, IORING_REGISTER_PBUF_RING, &reg,
+                              1)) {
+        return errno;
+    }
+    relay->buf_ring_tail = 0;
+    for (uint16_t i = 0; i < RELAY_NUM_BUFS; i++) {
+        buf_ring_add(relay, i);
+    }
+    buf_ring_publish(relay);
+
+    return 0;
+}
+
+static void relay_deinit(relay_t *relay)
+{
+    ring_deinit(&relay->ring);
+    if (relay->buf_ring != NULL) {
+        munmap(relay->buf_ring, relay->buf_ring_len);
+    }
+    free(relay->recv_pool);
+    free(relay->send_pool);
+}
+
+/*
+ * relay_run(relay) runs the event loop until interrupted or until the
+ * done_fd becomes readable, and returns 0 or an errno value
+ */
+static int relay_run(relay_t *relay)
+{
+    relay_ring_t *r = &relay->ring;
+    int err;
+
+    if (queue_recv(relay)) {
+        return EBUSY;
+    }
+    if (relay->done_fd >= 0 && queue_done_poll(relay)) {
+        return EBUSY;
+    }
+
+    while (!interrupted && !relay->done) {
+        unsigned head;
+        unsigned tail;
+
+        err = ring_submit(relay, 1);
+        if (err == -EINTR) {
+            continue;
+        } else if (err < 0) {
+            fprintf(stderr, "error: io_uring_enter failed: %s\n",
+                    strerror(-err));
+            return -err;
+        }
+
+        /* reap every completion that is ready before entering again */
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            err = relay_handle_cqe(relay, &r->cqes[head & *r->cq_mask]);
+            if (err) {
+                return err;
+            }
+            head++;
+            if (head == tail) {
+                __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+                tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static void relay_report(const relay_stats_t *s, uint64_t elapsed_ns)
+{
+    double seconds = (double)elapsed_ns / 1e9;
+
+    printf("relay: received %llu, relayed %llu packets (%llu octets) "
+           "in %.2f s: %.0f pkt/s\n",
+           (unsigned long long)s->received, (unsigned long long)s->relayed,
+           (unsigned long long)s->octets, seconds,
+           seconds > 0 ? (double)s->relayed / seconds : 0);
+    printf("relay: unprotect fail %llu, protect fail %llu, send fail %llu, "
+           "dropped %llu\n",
+           (unsigned long long)s->unprotect_fail,
+           (unsigned long long)s->protect_fail,
+           (unsigned long long)s->send_fail, (unsigned long long)s->dropped);
+    printf("relay: %.1f ns/pkt in libsrtp, %.3f io_uring_enter calls/pkt\n",
+           s->received ? (double)s->srtp_ns / (double)s->received : 0,
+           s->received ? (double)s->enter_calls / (double)s->received : 0);
+    fflush(stdout);
+}
+
+static srtp_err_status_t create_session(srtp_t *session,
+                                        uint8_t *key,
+                                        srtp_ssrc_type_t type)
+{
+    srtp_policy_t policy;
+
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = type;
+    policy.key = key;
+    policy.window_size = 1024;
+
+    return srtp_create(session, &policy);
+}
+
+static int parse_key(uint8_t *key, const char *hex)
+{
+    if (strlen(hex) != RELAY_KEY_LEN * 2 ||
+        hex_string_to_octet_string(key, hex, RELAY_KEY_LEN * 2) !=
+            RELAY_KEY_LEN * 2) {
+        fprintf(stderr, "error: key must be %d hexadecimal octets\n",
+                RELAY_KEY_LEN);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * run_endpoints(...) is the generator and sink used by -T: it sends
+ * windows of timestamped packets towards the relay and measures how
+ * long each one takes to come back through the sink socket
+ */
+static int run_endpoints(int gen_sock,
+                         int sink_sock,
+                         uint8_t *key_in,
+                         uint8_t *key_out,
+                         unsigned long count,
+                         size_t payload_len)
+{
+    srtp_t gen;
+    srtp_t sink;
+    uint8_t pkt[RELAY_BUF_LEN];
+    struct timeval tv;
+    uint64_t sent = 0, received = 0, failed = 0;
+    uint64_t lat_sum = 0, lat_min = UINT64_MAX, lat_max = 0;
+    uint16_t seq = 0;
+
+    if (create_session(&gen, key_in, ssrc_any_outbound) ||
+        create_session(&sink, key_out, ssrc_any_inbound)) {
+        fprintf(stderr, "error: endpoint srtp_create() failed\n");
+        return 1;
+    }
+
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(sink_sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+
+    while (!interrupted && sent < count) {
+        size_t window = 0;
+
+        for (; window < RELAY_WINDOW && sent < count; window++, sent++) {
+            uint64_t ts = now_ns();
+            size_t len = RELAY_BUF_LEN;
+
+            memset(pkt, 0, RELAY_HDR_LEN + payload_len);
+            pkt[0] = 0x80;
+            pkt[1] = 96;
+            pkt[2] = (uint8_t)(seq >> 8);
+            pkt[3] = (uint8_t)seq;
+            pkt[8] = 0xde;
+            pkt[9] = 0xad;
+            pkt[10] = 0xbe;
+            pkt[11] = 0xef;
+            memcpy(pkt + RELAY_HDR_LEN, &ts, sizeof(ts));
+            seq++;
+
+            if (srtp_protect(gen, pkt, RELAY_HDR_LEN + payload_len, pkt, &len,
+                             0) ||
+                send(gen_sock, pkt, len, 0) < 0) {
+                failed++;
+            }
+        }
+
+        for (; window > 0; window--) {
+            ssize_t n = recv(sink_sock, pkt, sizeof(pkt), 0);
+            size_t len = sizeof(pkt);
+            uint64_t ts, lat;
+
+            if (n < 0) {
+                break; /* timed out, the rest of the window is lost */
+            }
+            if (srtp_unprotect(sink, pkt, (size_t)n, pkt, &len) ||
+                len < RELAY_HDR_LEN + sizeof(ts)) {
+                failed++;
+                continue;
+            }
+            memcpy(&ts, pkt + RELAY_HDR_LEN, sizeof(ts));
+            lat = now_ns() - ts;
+            lat_sum += lat;
+            lat_min = lat < lat_min ? lat : lat_min;
+            lat_max = lat > lat_max ? lat : lat_max;
+            received++;
+        }
+    }
+
+    printf("endpoints: sent %llu, received %llu, failed %llu, lost %llu\n",
+           (unsigned long long)sent, (unsigned long long)received,
+           (unsigned long long)failed,
+           (unsigned long long)(sent - received - failed));
+    if (received) {
+        printf("endpoints: latency min %.1f us, avg %.1f us, max %.1f us "
+               "(window of %d packets)\n",
+               (double)lat_min / 1e3,
+               (double)lat_sum / (double)received / 1e3,
+               (double)lat_max / 1e3, RELAY_WINDOW);
+    }
+    fflush(stdout);
+
+    srtp_dealloc(gen);
+    srtp_dealloc(sink);
+
+    return (received == 0 || failed != 0) ? 1 : 0;
+}
+
+static int udp_socket(struct sockaddr_in *bind_addr,
+                      const struct sockaddr_in *peer)
+{
+    socklen_t len = sizeof(*bind_addr);
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (sock < 0) {
+        return -1;
+    }
+    if (bind_addr != NULL) {
+        if (bind(sock, (struct sockaddr *)bind_addr, sizeof(*bind_addr)) ||
+            getsockname(sock, (struct sockaddr *)bind_addr, &len)) {
+            close(sock);
+            return -1;
+        }
+    }
+    if (peer != NULL &&
+        connect(sock, (const struct sockaddr *)peer, sizeof(*peer))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int main(int argc, char *argv[])
+{
+    relay_t relay;
+    uint8_t key_in[RELAY_KEY_LEN];
+    uint8_t key_out[RELAY_KEY_LEN];
+    const char *key_in_str = default_key_in;
+    const char *key_out_str = default_key_out;
+    bool self_test = false;
+    unsigned long count = RELAY_COUNT;
+    size_t payload_len = RELAY_PAYLOAD_LEN;
+    struct sockaddr_in in_addr, out_addr;
+    pid_t child = -1;
+    uint64_t start;
+    int c, err, ret = 0;
+
+    printf("Using %s [0x%x]\n", srtp_get_version_string(), srtp_get_version());
+
+    while (1) {
+        c = getopt_s(argc, argv, "k:K:Tn:p:");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 'k':
+            key_in_str = optarg_s;
+            break;
+        case 'K':
+            key_out_str = optarg_s;
+            break;
+        case 'T':
+            self_test = true;
+            break;
+        case 'n':
+            count = strtoul(optarg_s, NULL, 10);
+            break;
+        case 'p':
+            payload_len = atoi(optarg_s);
+            if (RELAY_HDR_LEN + payload_len + SRTP_MAX_TRAILER_LEN >
+                    RELAY_BUF_LEN ||
+                payload_len < sizeof(uint64_t)) {
+                fprintf(stderr, "error: payload length out of range\n");
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (parse_key(key_in, key_in_str) || parse_key(key_out, key_out_str)) {
+        exit(1);
+    }
+
+    memset(&in_addr, 0, sizeof(in_addr));
+    in_addr.sin_family = AF_INET;
+    memset(&out_addr, 0, sizeof(out_addr));
+    out_addr.sin_family = AF_INET;
+
+    if (self_test) {
+        in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        out_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    } else {
+        if (argc != optind_s + 3) {
+            usage(argv[0]);
+        }
+        in_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        in_addr.sin_port = htons((uint16_t)atoi(argv[optind_s]));
+        if (inet_pton(AF_INET, argv[optind_s + 1], &out_addr.sin_addr) != 1) {
+            fprintf(stderr, "%s: cannot parse IP v4 address %s\n", argv[0],
+                    argv[optind_s + 1]);
+            exit(1);
+        }
+        out_addr.sin_port = htons((uint16_t)atoi(argv[optind_s + 2]));
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (srtp_init()) {
+        fprintf(stderr, "error: srtp initialization failed\n");
+        exit(1);
+    }
+
+    memset(&relay, 0, sizeof(relay));
+    relay.done_fd = -1;
+    relay.ring.fd = -1;
+
+    err = relay_init(&relay);
+    if (err) {
+        fprintf(stderr, "io_uring setup failed: %s\n", strerror(err));
+        relay_deinit(&relay);
+        srtp_shutdown();
+        /* kernels without io_uring (or with it disabled) are not failures */
+        return self_test ? EXIT_SKIP : 1;
+    }
+
+    if (create_session(&relay.srtp_in, key_in, ssrc_any_inbound) ||
+        create_session(&relay.srtp_out, key_out, ssrc_any_outbound)) {
+        fprintf(stderr, "error: srtp_create() failed\n");
+        exit(1);
+    }
+
+    relay.in_sock = udp_socket(&in_addr, NULL);
+    if (self_test) {
+        struct sockaddr_in sink_addr = out_addr;
+        struct sockaddr_in relay_addr = in_addr;
+        int gen_sock, sink_sock;
+        int done_pipe[2];
+
+        sink_sock = udp_socket(&sink_addr, NULL);
+        relay.out_sock = udp_socket(NULL, &sink_addr);
+        gen_sock = udp_socket(NULL, &relay_addr);
+        if (relay.in_sock < 0 || sink_sock < 0 || relay.out_sock < 0 ||
+            gen_sock < 0 || pipe(done_pipe)) {
+            perror("socket setup failed");
+            exit(1);
+        }
+
+        /* don't let the child repeat what is still buffered */
+        fflush(stdout);
+        child = fork();
+        if (child < 0) {
+            perror("fork failed");
+            exit(1);
+        }
+        if (child == 0) {
+            /* the read end sees EOF once this process exits */
+            close(done_pipe[0]);
+            ret = run_endpoints(gen_sock, sink_sock, key_in, key_out, count,
+                                payload_len);
+            _exit(ret);
+        }
+        close(done_pipe[1]);
+        close(gen_sock);
+        close(sink_sock);
+        relay.done_fd = done_pipe[0];
+    } else {
+        relay.out_sock = udp_socket(NULL, &out_addr);
+        if (relay.in_sock < 0 || relay.out_sock < 0) {
+            perror("socket setup failed");
+            exit(1);
+        }
+    }
+
+    start = now_ns();
+    err = relay_run(&relay);
+    relay_report(&relay.stats, now_ns() - start);
+
+    if (err == EINVAL && relay.stats.received == 0) {
+        /* multishot recv or zero-copy send not supported by this kernel */
+        ret = self_test ? EXIT_SKIP : 1;
+    } else if (err) {
+        ret = 1;
+    }
+
+    if (child > 0) {
+        int status;
+
+        if (err) {
+            kill(child, SIGTERM);
+        }
+        if (waitpid(child, &status, 0) == child && ret == 0) {
+            ret = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+        }
+        close(relay.done_fd);
+    }
+
+    srtp_dealloc(relay.srtp_in);
+    srtp_dealloc(relay.srtp_out);
+    relay_deinit(&relay);
+    close(relay.in_sock);
+    close(relay.out_sock);
+
+    if (srtp_shutdown()) {
+        fprintf(stderr, "error: srtp shutdown failed\n");
+        ret = 1;
+    }
+
+    return ret;
+}
+
+void usage(char *string)
+{
+    printf("usage: %s [-k <key in>] [-K <key out>] "
+           "listen_port dest_ip dest_port\n"
+           "or     %s -T [-k <key in>] [-K <key out>] [-n <count>] "
+           "[-p <len>]\n"
+           "where  -k <key> srtp master key of incoming packets, in hex\n"
+           "       -K <key> srtp master key of outgoing packets, in hex\n"
+           "       -T relay between a generator and a sink on loopback\n"
+           "          and report throughput and latency\n"
+           "       -n <count> number of packets sent with -T (default %d)\n"
+           "       -p <len> payload length used with -T (default %d)\n",
+           string, string, RELAY_COUNT, RELAY_PAYLOAD_LEN);
+    exit(1);
+}
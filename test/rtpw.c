@@ -59,6 +59,7 @@
 #include <stdio.h>  /* for printf, fprintf */
 #include <stdlib.h> /* for atoi()          */
 #include <errno.h>
+#include <limits.h> /* for LONG_MAX        */
 #include <signal.h> /* for signal()        */
 
 #include <string.h> /* for strncpy()       */
@@ -93,6 +94,10 @@
 #define MAX_WORD_LEN 128
 #define ADDR_IS_MULTICAST(a) IN_MULTICAST(htonl(a))
 #define MAX_KEY_LEN 96
+#define BURST_PAYLOAD_LEN 160
+#define BURST_MAX_PAYLOAD_LEN                                                  \
+    (RTP_BURST_PKT_LEN - RTP_HEADER_LEN - SRTP_MAX_TRAILER_LEN)
+#define BURST_REPORT_SEC 1.0
 
 #ifndef HAVE_USLEEP
 #ifdef HAVE_WINDOWS_H
@@ -115,6 +120,22 @@ void usage(char *prog_name);
 
 void leave_group(int sock, struct ip_mreq mreq, char *name);
 
+/*
+ * burst_clock() returns a monotonic timestamp in seconds, used to
+ * compute packet rates in burst mode
+ */
+
+static double burst_clock(void);
+
+/*
+ * print_burst_stats(...) prints the counters accumulated in burst
+ * mode along with the packet rate over the given interval
+ */
+
+static void print_burst_stats(const char *label,
+                              const rtp_burst_stats_t *stats,
+                              double seconds);
+
 /*
  * setup_signal_handler() sets up a signal handler to trigger
  * cleanups after an interrupt
@@ -164,6 +185,11 @@ int main(int argc, char *argv[])
     size_t expected_len;
     bool do_list_mods = false;
     uint32_t ssrc = 0xdeadbeef; /* ssrc value hardcoded for now */
+    size_t burst = 0;
+    size_t burst_payload_len = BURST_PAYLOAD_LEN;
+    long value;
+    char *end;
+    unsigned long burst_count = 0;
 #ifdef RTPW_USE_WINSOCK2
     WORD wVersionRequested = MAKEWORD(2, 0);
     WSADATA wsaData;
@@ -193,7 +219,7 @@ int main(int argc, char *argv[])
 
     /* check args */
     while (1) {
-        c = getopt_s(argc, argv, "b:k:rsgt:ae:ld:w:");
+        c = getopt_s(argc, argv, "b:k:rsgt:ae:ld:w:B:n:p:");
         if (c == -1) {
             break;
         }
@@ -246,6 +272,37 @@ int main(int argc, char *argv[])
         case 'w':
             dictfile = optarg_s;
             break;
+        case 'B':
+            value = strtol(optarg_s, &end, 10);
+            if (end == optarg_s || *end != '\0' || value < 1 ||
+                value > RTP_MAX_BURST) {
+                printf("error: burst size must be between 1 and %d\n",
+                       RTP_MAX_BURST);
+                exit(1);
+            }
+            burst = (size_t)value;
+            break;
+        case 'n':
+            errno = 0;
+            value = strtol(optarg_s, &end, 10);
+            if (end == optarg_s || *end != '\0' || value < 0 ||
+                errno == ERANGE) {
+                printf("error: packet count must be between 0 and %ld\n",
+                       LONG_MAX);
+                exit(1);
+            }
+            burst_count = (unsigned long)value;
+            break;
+        case 'p':
+            value = strtol(optarg_s, &end, 10);
+            if (end == optarg_s || *end != '\0' || value < 0 ||
+                value > BURST_MAX_PAYLOAD_LEN) {
+                printf("error: payload length must be between 0 and %d\n",
+                       BURST_MAX_PAYLOAD_LEN);
+                exit(1);
+            }
+            burst_payload_len = (size_t)value;
+            break;
         default:
             usage(argv[0]);
         }
@@ -553,6 +610,40 @@ int main(int argc, char *argv[])
             exit(1);
         }
 
+        if (burst > 0) {
+            rtp_burst_stats_t stats;
+            double start, last;
+
+            status = rtp_sender_init_burst(snd, burst, burst_payload_len);
+            if (status) {
+                fprintf(stderr,
+                        "error: burst setup failed with code %d\n", status);
+                exit(1);
+            }
+
+            /* send as fast as possible until interrupted or done */
+            memset(&stats, 0, sizeof(stats));
+            start = last = burst_clock();
+            while (!interrupted &&
+                   (burst_count == 0 || stats.packets < burst_count)) {
+                double now;
+
+                if (rtp_send_burst(snd, &stats) < 0) {
+                    stats.other_fail++;
+                }
+                now = burst_clock();
+                if (now - last >= BURST_REPORT_SEC) {
+                    print_burst_stats("sent", &stats, now - start);
+                    last = now;
+                }
+            }
+            print_burst_stats("sent", &stats, burst_clock() - start);
+
+            rtp_sender_deinit_srtp(snd);
+            rtp_sender_dealloc(snd);
+            goto done;
+        }
+
         /* open dictionary */
         dict = fopen(dictfile, "r");
         if (dict == NULL) {
@@ -606,6 +697,48 @@ int main(int argc, char *argv[])
             exit(1);
         }
 
+        if (burst > 0) {
+            rtp_burst_stats_t stats;
+            double start = 0, last = 0;
+#ifndef RTPW_USE_WINSOCK2
+            struct timeval tv;
+
+            /* wake up periodically so that stats get reported */
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+#endif
+
+            status = rtp_receiver_init_burst(rcvr, burst);
+            if (status) {
+                fprintf(stderr,
+                        "error: burst setup failed with code %d\n", status);
+                exit(1);
+            }
+
+            memset(&stats, 0, sizeof(stats));
+            while (!interrupted) {
+                double now;
+                ssize_t n = rtp_recv_burst(rcvr, &stats);
+
+                now = burst_clock();
+                if (n > 0 && start == 0) {
+                    /* start the clock on the first packet */
+                    start = last = now;
+                }
+                if (start != 0 && now - last >= BURST_REPORT_SEC) {
+                    print_burst_stats("received", &stats, now - start);
+                    last = now;
+                }
+            }
+            print_burst_stats("received", &stats,
+                              start == 0 ? 0 : burst_clock() - start);
+
+            rtp_receiver_deinit_srtp(rcvr);
+            rtp_receiver_dealloc(rcvr);
+            goto done;
+        }
+
         /* get next word and loop */
         while (!interrupted) {
             len = MAX_WORD_LEN;
@@ -618,6 +751,7 @@ int main(int argc, char *argv[])
         rtp_receiver_dealloc(rcvr);
     }
 
+done:
     if (ADDR_IS_MULTICAST(rcvr_addr.s_addr)) {
         leave_group(sock, mreq, argv[0]);
     }
@@ -660,11 +794,46 @@ void usage(char *string)
            "       -r act as rtp receiver\n"
            "       -l list debug modules\n"
            "       -d <debug> turn on debugging for module <debug>\n"
-           "       -w <wordsfile> use <wordsfile> for input, rather than %s\n",
-           string, string, DICT_FILE);
+           "       -w <wordsfile> use <wordsfile> for input, rather than %s\n"
+           "       -B <burst> move up to <burst> packets per system call and\n"
+           "          report packet rate, loss and auth/replay failures\n"
+           "       -n <count> in burst mode, stop after sending <count> "
+           "packets\n"
+           "       -p <len> in burst mode, use <len> octet payloads "
+           "(default %d)\n",
+           string, string, DICT_FILE, BURST_PAYLOAD_LEN);
     exit(1);
 }
 
+static double burst_clock(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void print_burst_stats(const char *label,
+                              const rtp_burst_stats_t *stats,
+                              double seconds)
+{
+    double rate = seconds > 0 ? (double)stats->packets / seconds : 0;
+
+    printf("%s %llu packets (%llu octets) in %.2f s: %.0f pkt/s, "
+           "lost %llu, auth fail %llu, replay fail %llu, other fail %llu\n",
+           label, (unsigned long long)stats->packets,
+           (unsigned long long)stats->octets, seconds, rate,
+           (unsigned long long)stats->lost,
+           (unsigned long long)stats->auth_fail,
+           (unsigned long long)stats->replay_fail,
+           (unsigned long long)stats->other_fail);
+    fflush(stdout);
+}
+
 void leave_group(int sock, struct ip_mreq mreq, char *name)
 {
     int ret;
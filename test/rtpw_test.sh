@@ -169,6 +169,82 @@ kill $sender_pid
 wait $receiver_pid 2>/dev/null
 wait $sender_pid 2>/dev/null
 
+# Finally, exercise the batched high-rate mode.
+
+ARGS="-k $key -a -e 256 -B 32"
+BURST_PKTS=100000
+
+receiver_log=$(mktemp)
+sender_log=$(mktemp)
+
+echo  $0 ": starting rtpw burst receiver process... "
+
+$RTPW $* $ARGS -r 0.0.0.0 $DEST_PORT > $receiver_log &
+
+receiver_pid=$!
+
+echo $0 ": receiver PID = $receiver_pid"
+
+sleep 1 
+
+# verify that the background job is running
+ps -e | grep -q $receiver_pid
+retval=$?
+echo $retval
+if [ $retval != 0 ]; then
+    echo $0 ": error"
+    exit 254
+fi
+
+echo  $0 ": starting rtpw burst sender process..."
+
+$RTPW $* $ARGS -n $BURST_PKTS -s 127.0.0.1 $DEST_PORT > $sender_log &
+
+sender_pid=$!
+
+echo $0 ": sender PID = $sender_pid"
+
+sleep $DURATION
+
+kill $receiver_pid
+kill $sender_pid 2>/dev/null
+
+wait $receiver_pid 2>/dev/null
+wait $sender_pid 2>/dev/null
+
+# Check the counters the burst processes report when they stop: every
+# packet that arrived must have been accepted, and packets may only be
+# missing, as UDP can drop them, never invented.
+
+sent_stats=$(grep '^sent' $sender_log | tail -n 1)
+received_stats=$(grep '^received' $receiver_log | tail -n 1)
+rm -f $sender_log $receiver_log
+
+echo $0 ": $sent_stats"
+echo $0 ": $received_stats"
+
+sent=$(echo "$sent_stats" | sed -n 's/^sent \([0-9]*\) packets.*/\1/p')
+received=$(echo "$received_stats" | sed -n 's/^received \([0-9]*\) packets.*/\1/p')
+lost=$(echo "$received_stats" | sed -n 's/.* lost \([0-9]*\),.*/\1/p')
+auth_fail=$(echo "$received_stats" | sed -n 's/.* auth fail \([0-9]*\),.*/\1/p')
+replay_fail=$(echo "$received_stats" | sed -n 's/.* replay fail \([0-9]*\),.*/\1/p')
+other_fail=$(echo "$received_stats" | sed -n 's/.* other fail \([0-9]*\)$/\1/p')
+
+if [ -z "$sent" ] || [ -z "$received" ] || [ -z "$lost" ] ||
+   [ -z "$auth_fail" ] || [ -z "$replay_fail" ] || [ -z "$other_fail" ]; then
+    echo $0 ": error: missing burst statistics"
+    exit 1
+fi
+if [ $sent -gt $BURST_PKTS ] || [ $received -eq 0 ] ||
+   [ $((received + lost)) -gt $sent ] || [ $lost -gt $received ]; then
+    echo $0 ": error: unexpected packet counts"
+    exit 1
+fi
+if [ $auth_fail -ne 0 ] || [ $replay_fail -ne 0 ] || [ $other_fail -ne 0 ]; then
+    echo $0 ": error: packets failed to unprotect"
+    exit 1
+fi
+
 echo $0 ": done (test passed)"
 
 else 
@@ -50,6 +50,8 @@
 
 #include "srtp_priv.h"
 #include "stream_list_priv.h"
+#include "cipher_types.h"
+#include "alloc.h"
 #include "util.h"
 
 #ifdef HAVE_NETINET_IN_H
@@ -116,6 +118,48 @@ srtp_err_status_t srtp_test_set_sender_roc(void);
 
 srtp_err_status_t srtp_test_cryptex_csrc_but_no_extension_header(void);
 
+srtp_err_status_t srtp_test_cryptex_round_trip(void);
+
+srtp_err_status_t srtp_test_protect_burst(void);
+
+srtp_err_status_t srtp_test_burst_batch(void);
+
+srtp_err_status_t srtp_test_stream_precompute(void);
+
+srtp_err_status_t srtp_test_share_replay_window(void);
+
+srtp_err_status_t srtp_test_master_key_ring(void);
+
+srtp_err_status_t srtp_test_update_in_place(void);
+
+srtp_err_status_t srtp_test_update_failure(void);
+
+srtp_err_status_t srtp_test_deferred_self_tests(void);
+
+srtp_err_status_t srtp_test_compiled_policy(void);
+
+srtp_err_status_t srtp_test_session_serialize(void);
+
+srtp_err_status_t srtp_test_stream_store(void);
+
+srtp_err_status_t srtp_test_expire_idle_streams(void);
+
+srtp_err_status_t srtp_test_reserve_streams(void);
+
+srtp_err_status_t srtp_test_worker_pool(void);
+
+srtp_err_status_t srtp_test_worker_pool_stream(void);
+
+srtp_err_status_t srtp_test_encrypted_extensions_headers_runs(void);
+
+srtp_err_status_t srtp_test_event_queue(void);
+
+srtp_err_status_t srtp_test_deferred_log(void);
+
+#ifdef GCM
+srtp_err_status_t srtp_test_double_encryption(void);
+#endif
+
 double srtp_bits_per_second(size_t msg_len_octets, const srtp_policy_t *policy);
 
 double srtp_rejections_per_second(size_t msg_len_octets,
@@ -125,6 +169,12 @@ void srtp_do_timing(const srtp_policy_t *policy);
 
 void srtp_do_rejection_timing(const srtp_policy_t *policy);
 
+void srtp_do_stream_add_timing(void);
+
+void srtp_do_small_packet_timing(void);
+
+void srtp_do_async_timing(void);
+
 srtp_err_status_t srtp_test(const srtp_policy_t *policy,
                             bool test_extension_headers,
                             bool use_mki,
@@ -333,7 +383,7 @@ srtp_err_status_t call_srtp_unprotect_rtcp(srtp_ctx_t *ctx,
 void usage(char *prog_name)
 {
     printf("usage: %s [ -t ][ -c ][ -v ][ -s ][ -o ][-d <debug_module> ]* [ -l "
-           "][ -n ]\n"
+           "][ -n ][ -a ]\n"
            "  -t         run timing test\n"
            "  -r         run rejection timing test\n"
            "  -c         run codec timing test\n"
@@ -342,7 +392,8 @@ void usage(char *prog_name)
            "  -o         output logging to stdout\n"
            "  -d <mod>   turn on debugging module <mod>\n"
            "  -l         list debugging modules\n"
-           "  -n         run with not-in-place io api\n",
+           "  -n         run with not-in-place io api\n"
+           "  -a         run worker pool timing test\n",
            prog_name);
     exit(1);
 }
@@ -402,6 +453,7 @@ int main(int argc, char *argv[])
     bool do_stream_list = false;
     bool do_list_mods = false;
     bool do_log_stdout = false;
+    bool do_async_timing = false;
     srtp_err_status_t status;
     const size_t hdr_size = 12;
 
@@ -434,7 +486,7 @@ int main(int argc, char *argv[])
 
     /* process input arguments */
     while (1) {
-        q = getopt_s(argc, argv, "trcvsold:n");
+        q = getopt_s(argc, argv, "trcvsold:na");
         if (q == -1) {
             break;
         }
@@ -472,13 +524,17 @@ int main(int argc, char *argv[])
             printf("using srtp not-in-place io api\n");
             use_srtp_not_in_place_io_api = true;
             break;
+        case 'a':
+            do_async_timing = true;
+            break;
         default:
             usage(argv[0]);
         }
     }
 
     if (!do_validation && !do_timing_test && !do_codec_timing &&
-        !do_list_mods && !do_rejection_test && !do_stream_list) {
+        !do_list_mods && !do_rejection_test && !do_stream_list &&
+        !do_async_timing) {
         usage(argv[0]);
     }
 
@@ -908,6 +964,169 @@ int main(int argc, char *argv[])
             printf("failed\n");
             exit(1);
         }
+
+        printf("testing cryptex round trips with CSRCs...");
+        if (srtp_test_cryptex_round_trip() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_protect_burst() and srtp_unprotect_burst()...");
+        if (srtp_test_protect_burst() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing the batch entry points through the burst api...");
+        if (srtp_test_burst_batch() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_stream_precompute()...");
+        if (srtp_test_stream_precompute() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_stream_share_replay_window()...");
+        if (srtp_test_share_replay_window() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_stream_add_master_key()...");
+        if (srtp_test_master_key_ring() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_update() in place...");
+        if (srtp_test_update_in_place() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_update() failures...");
+        if (srtp_test_update_failure() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_set_deferred_self_tests()...");
+        if (srtp_test_deferred_self_tests() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing compiled stream handlers...");
+        if (srtp_test_compiled_policy() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_session_serialize()...");
+        if (srtp_test_session_serialize() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing stream store...");
+        if (srtp_test_stream_store() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_expire_idle_streams()...");
+        if (srtp_test_expire_idle_streams() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing streams created without allocating...");
+        if (srtp_test_reserve_streams() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_protect_async() and srtp_unprotect_async()...");
+        if (srtp_test_worker_pool() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing the packets of one stream in a worker pool...");
+        if (srtp_test_worker_pool_stream() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing encrypted extension headers across runs...");
+        if (srtp_test_encrypted_extensions_headers_runs() ==
+            srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_set_event_queue()...");
+        if (srtp_test_event_queue() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+        printf("testing srtp_set_log_deferred()...");
+        if (srtp_test_deferred_log() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+
+#ifdef GCM
+        printf("testing double encryption through a media distributor...");
+        if (srtp_test_double_encryption() == srtp_err_status_ok) {
+            printf("passed\n");
+        } else {
+            printf("failed\n");
+            exit(1);
+        }
+#endif
     }
 
     if (do_stream_list) {
@@ -929,6 +1148,13 @@ int main(int argc, char *argv[])
             srtp_do_timing(*policy);
             policy++;
         }
+
+        srtp_do_stream_add_timing();
+        srtp_do_small_packet_timing();
+    }
+
+    if (do_async_timing) {
+        srtp_do_async_timing();
     }
 
     if (do_rejection_test) {
@@ -1156,126 +1382,530 @@ void srtp_do_rejection_timing(const srtp_policy_t *policy)
 
 #define MAX_MSG_LEN 1024
 
-double srtp_bits_per_second(size_t msg_len_octets, const srtp_policy_t *policy)
+/*
+ * srtp_streams_per_second(num_streams, num_keys) returns the rate at which
+ * srtp_stream_add() sets up num_streams streams that use num_keys
+ * different master keys in turn
+ */
+static double srtp_streams_per_second(size_t num_streams, size_t num_keys)
 {
     srtp_t srtp;
-    uint8_t *mesg;
+    srtp_policy_t policy;
+    uint8_t key[46];
     clock_t timer;
-    size_t num_trials = 100000;
-    size_t input_len, len;
-    uint32_t ssrc;
     srtp_err_status_t status;
 
-    /*
-     * allocate and initialize an srtp session
-     */
-    status = srtp_create(&srtp, policy);
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.key = key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    status = srtp_create(&srtp, NULL);
     if (status) {
         printf("error: srtp_create() failed with error code %d\n", status);
         exit(1);
     }
 
-    /*
-     * if the ssrc is unspecified, use a predetermined one
-     */
-    if (policy->ssrc.type != ssrc_specific) {
-        ssrc = 0xdeadbeef;
-    } else {
-        ssrc = policy->ssrc.value;
-    }
-
-    /*
-     * create a test packet
-     */
-    mesg = create_rtp_test_packet(msg_len_octets, ssrc, 1, 1, false, &input_len,
-                                  NULL);
-    if (mesg == NULL) {
-        return 0.0; /* indicate failure by returning zero */
-    }
+    memcpy(key, test_key, sizeof(key));
     timer = clock();
-    for (size_t i = 0; i < num_trials; i++) {
-        len = input_len;
-        /* srtp protect message */
-        status = call_srtp_protect(srtp, mesg, &len, 0);
+    for (size_t i = 0; i < num_streams; i++) {
+        key[0] = (uint8_t)(i % num_keys);
+        key[1] = (uint8_t)((i % num_keys) >> 8);
+        policy.ssrc.value = (uint32_t)(i + 1);
+        status = srtp_stream_add(srtp, &policy);
         if (status) {
-            printf("error: srtp_protect() failed with error code %d\n", status);
+            printf("error: srtp_stream_add() failed with error code %d\n",
+                   status);
             exit(1);
         }
-
-        /* increment message number */
-        {
-            /* hack sequence to avoid problems with macros for htons/ntohs on
-             * some systems */
-            srtp_hdr_t *hdr = (srtp_hdr_t *)mesg;
-            short new_seq = ntohs(hdr->seq) + 1;
-            hdr->seq = htons(new_seq);
-        }
     }
     timer = clock() - timer;
 
-    free(mesg);
-
     status = srtp_dealloc(srtp);
     if (status) {
         printf("error: srtp_dealloc() failed with error code %d\n", status);
         exit(1);
     }
 
-    return msg_len_octets * 8.0 * num_trials * CLOCKS_PER_SEC / timer;
+    return (double)num_streams * CLOCKS_PER_SEC / timer;
 }
 
-double srtp_rejections_per_second(size_t msg_len_octets,
-                                  const srtp_policy_t *policy)
+/*
+ * srtp_streams_restored_per_second(num_streams) returns the rate at which
+ * srtp_session_restore() recreates a session of num_streams streams that
+ * each have their own master key
+ */
+static double srtp_streams_restored_per_second(size_t num_streams)
 {
-    srtp_ctx_t *srtp;
-    uint8_t *mesg;
-    size_t len;
+    srtp_t srtp;
+    srtp_policy_t policy;
+    uint8_t key[46];
+    uint8_t *state;
+    size_t state_len = 0;
     clock_t timer;
-    size_t num_trials = 1000000;
-    uint32_t ssrc = policy->ssrc.value;
     srtp_err_status_t status;
 
-    /*
-     * allocate and initialize an srtp session
-     */
-    status = srtp_create(&srtp, policy);
-    if (status) {
-        printf("error: srtp_create() failed with error code %d\n", status);
-        exit(1);
-    }
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.key = key;
+    policy.window_size = 128;
+    policy.next = NULL;
 
-    mesg =
-        create_rtp_test_packet(msg_len_octets, ssrc, 1, 1, false, &len, NULL);
-    if (mesg == NULL) {
-        return 0.0; /* indicate failure by returning zero */
+    CHECK_OK(srtp_create(&srtp, NULL));
+    CHECK_OK(srtp_set_serializable(srtp, true));
+    memcpy(key, test_key, sizeof(key));
+    for (size_t i = 0; i < num_streams; i++) {
+        key[0] = (uint8_t)i;
+        key[1] = (uint8_t)(i >> 8);
+        policy.ssrc.value = (uint32_t)(i + 1);
+        CHECK_OK(srtp_stream_add(srtp, &policy));
     }
-    call_srtp_protect(srtp, mesg, &len, 0);
+
+    CHECK_OK(srtp_session_serialize(srtp, NULL, &state_len));
+    state = (uint8_t *)malloc(state_len);
+    CHECK(state != NULL);
+    CHECK_OK(srtp_session_serialize(srtp, state, &state_len));
+    CHECK_OK(srtp_dealloc(srtp));
 
     timer = clock();
-    for (size_t i = 0; i < num_trials; i++) {
-        len = msg_len_octets;
-        call_srtp_unprotect(srtp, mesg, &len);
-    }
+    status = srtp_session_restore(&srtp, state, state_len);
     timer = clock() - timer;
-
-    free(mesg);
-
-    status = srtp_dealloc(srtp);
     if (status) {
-        printf("error: srtp_dealloc() failed with error code %d\n", status);
+        printf("error: srtp_session_restore() failed with error code %d\n",
+               status);
         exit(1);
     }
 
-    return (double)num_trials * CLOCKS_PER_SEC / timer;
+    CHECK_OK(srtp_dealloc(srtp));
+    free(state);
+
+    return (double)num_streams * CLOCKS_PER_SEC / timer;
 }
 
-srtp_err_status_t srtp_test(const srtp_policy_t *policy,
-                            bool test_extension_headers,
-                            bool use_mki,
-                            size_t mki_index)
+/*
+ * srtp_round_trip_timing(policy, payload_len, protect_ns, unprotect_ns)
+ * measures the time that srtp_protect() and srtp_unprotect() take per
+ * packet for a stream of consecutive packets of payload_len octets
+ */
+static void srtp_round_trip_timing(const srtp_policy_t *policy,
+                                   size_t payload_len,
+                                   double *protect_ns,
+                                   double *unprotect_ns)
 {
-    size_t i;
-    srtp_t srtp_sender;
+    srtp_t srtp_snd, srtp_recv;
+    uint8_t *mesg;
+    uint8_t *pkts;
+    size_t *pkt_len;
+    size_t num_trials = 200000;
+    size_t input_len, stride;
+    clock_t timer;
+    srtp_err_status_t status;
+
+    status = srtp_create(&srtp_snd, policy);
+    if (status == srtp_err_status_ok) {
+        status = srtp_create(&srtp_recv, policy);
+    }
+    if (status) {
+        printf("error: srtp_create() failed with error code %d\n", status);
+        exit(1);
+    }
+
+    mesg = create_rtp_test_packet(payload_len, policy->ssrc.value, 1, 1, false,
+                                  &input_len, NULL);
+    stride = input_len + SRTP_MAX_TRAILER_LEN;
+    pkts = (uint8_t *)malloc(num_trials * stride);
+    pkt_len = (size_t *)malloc(num_trials * sizeof(size_t));
+    if (mesg == NULL || pkts == NULL || pkt_len == NULL) {
+        printf("error: malloc() failed\n");
+        exit(1);
+    }
+
+    timer = clock();
+    for (size_t i = 0; i < num_trials; i++) {
+        srtp_hdr_t *hdr = (srtp_hdr_t *)mesg;
+        hdr->seq = htons((uint16_t)(i + 1));
+        pkt_len[i] = stride;
+        status = srtp_protect(srtp_snd, mesg, input_len, pkts + i * stride,
+                              &pkt_len[i], 0);
+        if (status) {
+            printf("error: srtp_protect() failed with error code %d\n",
+                   status);
+            exit(1);
+        }
+    }
+    *protect_ns = (double)(clock() - timer) * 1.0E9 / CLOCKS_PER_SEC /
+                  (double)num_trials;
+
+    timer = clock();
+    for (size_t i = 0; i < num_trials; i++) {
+        size_t len = stride;
+        status = srtp_unprotect(srtp_recv, pkts + i * stride, pkt_len[i],
+                                pkts + i * stride, &len);
+        if (status) {
+            printf("error: srtp_unprotect() failed with error code %d\n",
+                   status);
+            exit(1);
+        }
+    }
+    *unprotect_ns = (double)(clock() - timer) * 1.0E9 / CLOCKS_PER_SEC /
+                    (double)num_trials;
+
+    free(pkt_len);
+    free(pkts);
+    free(mesg);
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+}
+
+void srtp_do_small_packet_timing(void)
+{
+    srtp_policy_t policy;
+    const size_t payload_lens[] = { 20, 160 };
+    double protect_ns, unprotect_ns;
+
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xdecafbad;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    printf("# testing per-packet time for small packets:\r\n");
+    printf("# profile\t\t\tpayload (octets)\tprotect (ns)\t"
+           "unprotect (ns)\r\n");
+
+    for (size_t i = 0; i < sizeof(payload_lens) / sizeof(payload_lens[0]);
+         i++) {
+        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(&policy.rtp);
+        srtp_round_trip_timing(&policy, payload_lens[i], &protect_ns,
+                               &unprotect_ns);
+        printf("aes_cm_128_hmac_sha1_80\t%zu\t\t\t%.1f\t\t%.1f\r\n",
+               payload_lens[i], protect_ns, unprotect_ns);
+
+        srtp_crypto_policy_set_aes_cm_128_hmac_sha1_32(&policy.rtp);
+        srtp_round_trip_timing(&policy, payload_lens[i], &protect_ns,
+                               &unprotect_ns);
+        printf("aes_cm_128_hmac_sha1_32\t%zu\t\t\t%.1f\t\t%.1f\r\n",
+               payload_lens[i], protect_ns, unprotect_ns);
+    }
+
+    printf("\r\n\r\n");
+}
+
+void srtp_do_stream_add_timing(void)
+{
+    size_t num_streams = 10000;
+
+    printf("# testing stream setup rate:\r\n");
+    printf("# master keys\tstreams per second\r\n");
+
+    /* with as many keys as streams, every stream runs the key derivation */
+    printf("%zu\t\t%f\r\n", num_streams,
+           srtp_streams_per_second(num_streams, num_streams));
+    printf("%d\t\t%f\r\n", 4, srtp_streams_per_second(num_streams, 4));
+    printf("%d\t\t%f\r\n", 1, srtp_streams_per_second(num_streams, 1));
+
+    printf("\r\n\r\n");
+
+    printf("# testing session restore rate:\r\n");
+    printf("# streams\tstreams per second\r\n");
+    printf("%zu\t\t%f\r\n", num_streams,
+           srtp_streams_restored_per_second(num_streams));
+
+    printf("\r\n\r\n");
+}
+
+#define ASYNC_SESSIONS 16
+#define ASYNC_PACKETS 64 /* per session and round */
+#define ASYNC_ROUNDS 40
+#define ASYNC_PAYLOAD_LEN 1000
+#define ASYNC_PACKET_LEN (12 + ASYNC_PAYLOAD_LEN + SRTP_MAX_TRAILER_LEN)
+
+/* wall clock time, as clock() adds up the time of all the workers */
+static double srtp_wall_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1.0E9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * srtp_async_round_trips_per_second(num_workers) returns the rate at which
+ * ASYNC_SESSIONS sender and receiver pairs protect and unprotect packets,
+ * with srtp_protect() and srtp_unprotect() if num_workers is zero and
+ * through a pool of num_workers workers otherwise
+ */
+static double srtp_async_round_trips_per_second(size_t num_workers)
+{
+    srtp_policy_t policy;
+    srtp_t snd[ASYNC_SESSIONS];
+    srtp_t recv[ASYNC_SESSIONS];
+    srtp_worker_pool_t pool = NULL;
+    srtp_completion_t completions[64];
+    uint8_t *rtp;
+    uint8_t *pkts;
+    size_t rtp_len;
+    size_t *pkt_len;
+    size_t num_jobs = ASYNC_SESSIONS * ASYNC_PACKETS;
+    uint16_t seq = 1;
+    double timer;
+
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.key = test_key;
+    policy.window_size = 1024;
+    policy.next = NULL;
+
+    if (num_workers != 0) {
+        CHECK_OK(srtp_worker_pool_create(&pool, num_workers, num_jobs));
+    }
+    for (size_t s = 0; s < ASYNC_SESSIONS; s++) {
+        policy.ssrc.type = ssrc_any_outbound;
+        CHECK_OK(srtp_create(&snd[s], &policy));
+        policy.ssrc.type = ssrc_any_inbound;
+        CHECK_OK(srtp_create(&recv[s], &policy));
+        if (pool != NULL) {
+            CHECK_OK(srtp_set_worker_pool(snd[s], pool));
+            CHECK_OK(srtp_set_worker_pool(recv[s], pool));
+        }
+    }
+
+    rtp = create_rtp_test_packet(ASYNC_PAYLOAD_LEN, 0xdecafbad, 1, 1, false,
+                                 &rtp_len, NULL);
+    pkts = (uint8_t *)malloc(num_jobs * ASYNC_PACKET_LEN);
+    pkt_len = (size_t *)malloc(num_jobs * sizeof(size_t));
+    CHECK(rtp != NULL && pkts != NULL && pkt_len != NULL);
+
+    timer = srtp_wall_clock();
+    for (size_t round = 0; round < ASYNC_ROUNDS; round++) {
+        for (size_t i = 0; i < ASYNC_PACKETS; i++, seq++) {
+            ((srtp_hdr_t *)rtp)->seq = htons(seq);
+            for (size_t s = 0; s < ASYNC_SESSIONS; s++) {
+                size_t k = s * ASYNC_PACKETS + i;
+                uint8_t *pkt = pkts + k * ASYNC_PACKET_LEN;
+
+                memcpy(pkt, rtp, rtp_len);
+                pkt_len[k] = ASYNC_PACKET_LEN;
+                if (pool != NULL) {
+                    CHECK_OK(srtp_protect_async(snd[s], pkt, rtp_len, pkt,
+                                                ASYNC_PACKET_LEN, 0,
+                                                &pkt_len[k]));
+                } else {
+                    CHECK_OK(srtp_protect(snd[s], pkt, rtp_len, pkt,
+                                          &pkt_len[k], 0));
+                }
+            }
+        }
+
+        for (size_t done = 0; pool != NULL && done < num_jobs;) {
+            size_t n = sizeof(completions) / sizeof(completions[0]);
+
+            CHECK_OK(srtp_poll_completions(pool, completions, &n, true));
+            for (size_t j = 0; j < n; j++) {
+                CHECK_OK(completions[j].status);
+                *(size_t *)completions[j].user_data = completions[j].len;
+            }
+            done += n;
+        }
+
+        for (size_t s = 0; s < ASYNC_SESSIONS; s++) {
+            for (size_t i = 0; i < ASYNC_PACKETS; i++) {
+                size_t k = s * ASYNC_PACKETS + i;
+                uint8_t *pkt = pkts + k * ASYNC_PACKET_LEN;
+                size_t len = ASYNC_PACKET_LEN;
+
+                if (pool != NULL) {
+                    CHECK_OK(srtp_unprotect_async(recv[s], pkt, pkt_len[k],
+                                                  pkt, ASYNC_PACKET_LEN, NULL));
+                } else {
+                    CHECK_OK(
+                        srtp_unprotect(recv[s], pkt, pkt_len[k], pkt, &len));
+                }
+            }
+        }
+
+        for (size_t done = 0; pool != NULL && done < num_jobs;) {
+            size_t n = sizeof(completions) / sizeof(completions[0]);
+
+            CHECK_OK(srtp_poll_completions(pool, completions, &n, true));
+            for (size_t j = 0; j < n; j++) {
+                CHECK_OK(completions[j].status);
+            }
+            done += n;
+        }
+    }
+    timer = srtp_wall_clock() - timer;
+
+    for (size_t s = 0; s < ASYNC_SESSIONS; s++) {
+        CHECK_OK(srtp_dealloc(snd[s]));
+        CHECK_OK(srtp_dealloc(recv[s]));
+    }
+    if (pool != NULL) {
+        CHECK_OK(srtp_worker_pool_dealloc(pool));
+    }
+    free(pkt_len);
+    free(pkts);
+    free(rtp);
+
+    return (double)(num_jobs * ASYNC_ROUNDS) / timer;
+}
+
+void srtp_do_async_timing(void)
+{
+    srtp_worker_pool_t pool;
+
+    if (srtp_worker_pool_create(&pool, 1, 1) != srtp_err_status_ok) {
+        printf("# worker pools are not available in this build\r\n");
+        return;
+    }
+    CHECK_OK(srtp_worker_pool_dealloc(pool));
+
+    printf("# testing loopback throughput of %d sessions, %d octet payloads:"
+           "\r\n",
+           ASYNC_SESSIONS, ASYNC_PAYLOAD_LEN);
+    printf("# workers (0 is synchronous)\tround trips per second\r\n");
+
+    printf("%d\t\t\t\t%f\r\n", 0, srtp_async_round_trips_per_second(0));
+    for (size_t num_workers = 1; num_workers <= 16; num_workers *= 2) {
+        printf("%zu\t\t\t\t%f\r\n", num_workers,
+               srtp_async_round_trips_per_second(num_workers));
+    }
+
+    printf("\r\n\r\n");
+}
+
+double srtp_bits_per_second(size_t msg_len_octets, const srtp_policy_t *policy)
+{
+    srtp_t srtp;
+    uint8_t *mesg;
+    clock_t timer;
+    size_t num_trials = 100000;
+    size_t input_len, len;
+    uint32_t ssrc;
+    srtp_err_status_t status;
+
+    /*
+     * allocate and initialize an srtp session
+     */
+    status = srtp_create(&srtp, policy);
+    if (status) {
+        printf("error: srtp_create() failed with error code %d\n", status);
+        exit(1);
+    }
+
+    /*
+     * if the ssrc is unspecified, use a predetermined one
+     */
+    if (policy->ssrc.type != ssrc_specific) {
+        ssrc = 0xdeadbeef;
+    } else {
+        ssrc = policy->ssrc.value;
+    }
+
+    /*
+     * create a test packet
+     */
+    mesg = create_rtp_test_packet(msg_len_octets, ssrc, 1, 1, false, &input_len,
+                                  NULL);
+    if (mesg == NULL) {
+        return 0.0; /* indicate failure by returning zero */
+    }
+    timer = clock();
+    for (size_t i = 0; i < num_trials; i++) {
+        len = input_len;
+        /* srtp protect message */
+        status = call_srtp_protect(srtp, mesg, &len, 0);
+        if (status) {
+            printf("error: srtp_protect() failed with error code %d\n", status);
+            exit(1);
+        }
+
+        /* increment message number */
+        {
+            /* hack sequence to avoid problems with macros for htons/ntohs on
+             * some systems */
+            srtp_hdr_t *hdr = (srtp_hdr_t *)mesg;
+            short new_seq = ntohs(hdr->seq) + 1;
+            hdr->seq = htons(new_seq);
+        }
+    }
+    timer = clock() - timer;
+
+    free(mesg);
+
+    status = srtp_dealloc(srtp);
+    if (status) {
+        printf("error: srtp_dealloc() failed with error code %d\n", status);
+        exit(1);
+    }
+
+    return msg_len_octets * 8.0 * num_trials * CLOCKS_PER_SEC / timer;
+}
+
+double srtp_rejections_per_second(size_t msg_len_octets,
+                                  const srtp_policy_t *policy)
+{
+    srtp_ctx_t *srtp;
+    uint8_t *mesg;
+    size_t len;
+    clock_t timer;
+    size_t num_trials = 1000000;
+    uint32_t ssrc = policy->ssrc.value;
+    srtp_err_status_t status;
+
+    /*
+     * allocate and initialize an srtp session
+     */
+    status = srtp_create(&srtp, policy);
+    if (status) {
+        printf("error: srtp_create() failed with error code %d\n", status);
+        exit(1);
+    }
+
+    mesg =
+        create_rtp_test_packet(msg_len_octets, ssrc, 1, 1, false, &len, NULL);
+    if (mesg == NULL) {
+        return 0.0; /* indicate failure by returning zero */
+    }
+    call_srtp_protect(srtp, mesg, &len, 0);
+
+    timer = clock();
+    for (size_t i = 0; i < num_trials; i++) {
+        len = msg_len_octets;
+        call_srtp_unprotect(srtp, mesg, &len);
+    }
+    timer = clock() - timer;
+
+    free(mesg);
+
+    status = srtp_dealloc(srtp);
+    if (status) {
+        printf("error: srtp_dealloc() failed with error code %d\n", status);
+        exit(1);
+    }
+
+    return (double)num_trials * CLOCKS_PER_SEC / timer;
+}
+
+srtp_err_status_t srtp_test(const srtp_policy_t *policy,
+                            bool test_extension_headers,
+                            bool use_mki,
+                            size_t mki_index)
+{
+    size_t i;
+    srtp_t srtp_sender;
     srtp_t srtp_rcvr;
     srtp_err_status_t status = srtp_err_status_ok;
     uint8_t *hdr, *hdr2;
@@ -3131,115 +3761,2154 @@ srtp_err_status_t srtp_validate_cryptex(void)
         "cd31e125"
         "eabe";
 
-    // clang-format on
+    // clang-format on
+
+    const struct test_vectors_t vectors[6] = {
+        { "Plaintext packet with 1-byte header extension", srtp_1bytehdrext_ref,
+          srtp_1bytehdrext_cryptex },
+        { "Plaintext packet with 2-byte header extension", srtp_2bytehdrext_ref,
+          srtp_2bytehdrext_cryptex },
+        { "Plaintext packet with 1-byte header extension and CSRC fields",
+          srtp_1bytehdrext_cc_ref, srtp_1bytehdrext_cc_cryptex },
+        { "Plaintext packet with 2-byte header extension and CSRC fields",
+          srtp_2bytehdrext_cc_ref, srtp_2bytehdrext_cc_cryptex },
+        { "Plaintext packet with empty 1-byte header extension and CSRC fields",
+          srtp_1byte_empty_hdrext_cc_ref, srtp_1byte_empty_hdrext_cc_cryptex },
+        { "Plaintext packet with empty 2-byte header extension and CSRC fields",
+          srtp_2byte_empty_hdrext_cc_ref, srtp_2byte_empty_hdrext_cc_cryptex },
+    };
+    const size_t num_vectors = sizeof(vectors) / sizeof(vectors[0]);
+
+    srtp_t srtp_snd, srtp_recv;
+    size_t len, ref_len, enc_len;
+    srtp_policy_t policy;
+
+    /*
+     * create a session with a single stream using the default srtp
+     * policy and with the SSRC value 0xcafebabe
+     */
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.allow_repeat_tx = 0;
+    policy.use_cryptex = true;
+    policy.next = NULL;
+
+    for (size_t i = 0; i < num_vectors; ++i) {
+        uint8_t packet[1400];
+        uint8_t reference[1400];
+        uint8_t ciphertext[1400];
+
+        /* Initialize reference test vectors */
+        ref_len = hex_string_to_octet_string(reference, vectors[i].plaintext,
+                                             sizeof(reference)) /
+                  2;
+        enc_len = hex_string_to_octet_string(ciphertext, vectors[i].ciphertext,
+                                             sizeof(ciphertext)) /
+                  2;
+
+        /* Initialize test packet */
+        len = ref_len;
+        memcpy(packet, reference, len);
+        printf("%s\n", vectors[i].name);
+        /*
+         * protect plaintext, then compare with ciphertext
+         */
+        debug_print(mod_driver, "test vector: %s\n", vectors[i].name);
+
+        CHECK_OK(srtp_create(&srtp_snd, &policy));
+
+        CHECK_OK(call_srtp_protect(srtp_snd, packet, &len, 0));
+        CHECK(len == enc_len);
+
+        debug_print(mod_driver, "ciphertext:\n  %s",
+                    octet_string_hex_string(packet, len));
+        debug_print(mod_driver, "ciphertext reference:\n  %s",
+                    octet_string_hex_string(ciphertext, len));
+
+        CHECK_BUFFER_EQUAL(packet, ciphertext, len);
+
+        CHECK_OK(srtp_dealloc(srtp_snd));
+
+        CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+        /*
+         * unprotect ciphertext, then compare with plaintext
+         */
+        CHECK_OK(call_srtp_unprotect(srtp_recv, packet, &len));
+        CHECK(len == ref_len);
+
+        CHECK_BUFFER_EQUAL(packet, reference, len);
+
+        CHECK_OK(srtp_dealloc(srtp_recv));
+    }
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_test_cryptex_csrc_but_no_extension_header(void)
+{
+    // clang-format off
+    /* Plaintext packet with no header extension but CSRC fields. */
+    const char *srtp_cc_ref =
+        "820f1238"
+        "decafbad"
+        "cafebabe"
+        "0001e240"
+        "0000b26e"
+        "abababab"
+        "abababab"
+        "abababab"
+        "abababab";
+    // clang-format on
+
+    /*
+     * create a session with a single stream using the default srtp
+     * policy and with the SSRC value 0xcafebabe
+     */
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.allow_repeat_tx = 0;
+    policy.use_cryptex = true;
+    policy.next = NULL;
+
+    srtp_t srtp_snd;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+
+    uint8_t packet[1400];
+    size_t packet_len =
+        hex_string_to_octet_string(packet, srtp_cc_ref, sizeof(packet)) / 2;
+
+    CHECK_RETURN(call_srtp_protect(srtp_snd, packet, &packet_len, 0),
+                 srtp_err_status_cryptex_err);
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * srtp_cryptex_round_trip(policy, cc, two_byte) protects and unprotects
+ * a few packets with cc CSRCs and a header extension with the one or two
+ * byte profile, and checks that the CSRCs and the extension body are
+ * encrypted on the wire and restored on receipt
+ */
+static srtp_err_status_t srtp_cryptex_round_trip(srtp_policy_t *policy,
+                                                 uint8_t cc,
+                                                 bool two_byte)
+{
+    const size_t payload_len = 37;
+    const size_t xtn_len = 12; /* profile, length and two words */
+    size_t hdr_len = 12 + 4 * (size_t)cc;
+    size_t rtp_len = hdr_len + xtn_len + payload_len;
+    uint8_t reference[256];
+    uint8_t packet[256 + SRTP_MAX_TRAILER_LEN];
+    srtp_hdr_t *hdr = (srtp_hdr_t *)reference;
+    srtp_t srtp_snd, srtp_recv;
+    size_t len;
+
+    CHECK_OK(srtp_create(&srtp_snd, policy));
+    CHECK_OK(srtp_create(&srtp_recv, policy));
+
+    for (uint16_t seq = 1; seq <= 3; seq++) {
+        memset(reference, 0, sizeof(reference));
+        hdr->version = 2;
+        hdr->x = 1;
+        hdr->cc = cc;
+        hdr->pt = 0xf;
+        hdr->seq = htons(seq);
+        hdr->ts = htonl(0xdecafbad);
+        hdr->ssrc = htonl(policy->ssrc.value);
+        for (size_t i = 12; i < hdr_len; i++) {
+            reference[i] = (uint8_t)(0x40 + i);
+        }
+        reference[hdr_len] = two_byte ? 0x10 : 0xbe;
+        reference[hdr_len + 1] = two_byte ? 0x00 : 0xde;
+        reference[hdr_len + 3] = 2;
+        memset(reference + hdr_len + 4, 0xc5, xtn_len - 4);
+        memset(reference + hdr_len + xtn_len, 0xab, payload_len);
+
+        len = rtp_len;
+        memcpy(packet, reference, len);
+        CHECK_OK(call_srtp_protect(srtp_snd, packet, &len, 0));
+        CHECK(len > rtp_len);
+
+        /* the fixed header stays, the CSRCs and extension body do not */
+        CHECK_BUFFER_EQUAL(packet, reference, 12);
+        CHECK(memcmp(packet + 12, reference + 12, 4 * (size_t)cc) != 0);
+        CHECK(packet[hdr_len] == 0xc0 || packet[hdr_len] == 0xc2);
+        CHECK(packet[hdr_len + 1] == 0xde);
+        CHECK(memcmp(packet + hdr_len + 4, reference + hdr_len + 4,
+                     xtn_len - 4) != 0);
+
+        CHECK_OK(call_srtp_unprotect(srtp_recv, packet, &len));
+        CHECK(len == rtp_len);
+        CHECK_BUFFER_EQUAL(packet, reference, len);
+    }
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_test_cryptex_round_trip(void)
+{
+    const uint8_t ccs[] = { 1, 4, 15 };
+    srtp_policy_t policy;
+
+    memset(&policy, 0, sizeof(policy));
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.use_cryptex = true;
+    policy.next = NULL;
+
+    for (size_t i = 0; i < sizeof(ccs); i++) {
+        for (int two_byte = 0; two_byte < 2; two_byte++) {
+            srtp_crypto_policy_set_rtp_default(&policy.rtp);
+            srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+            CHECK_OK(srtp_cryptex_round_trip(&policy, ccs[i], two_byte));
+#ifdef GCM
+            srtp_crypto_policy_set_aes_gcm_128_16_auth(&policy.rtp);
+            srtp_crypto_policy_set_aes_gcm_128_16_auth(&policy.rtcp);
+            CHECK_OK(srtp_cryptex_round_trip(&policy, ccs[i], two_byte));
+#endif
+        }
+    }
+
+    return srtp_err_status_ok;
+}
+
+#define BURST_NUM_PKTS 8
+#define BURST_PAYLOAD_LEN 100
+#define BURST_RTP_STRIDE (12 + BURST_PAYLOAD_LEN)
+#define BURST_SRTP_STRIDE (BURST_RTP_STRIDE + 10)
+
+srtp_err_status_t srtp_test_protect_burst(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    srtp_t srtp_snd;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    /* packed RTP packets, the last one shorter, as a GSO burst would be */
+    uint8_t rtp[BURST_NUM_PKTS * BURST_RTP_STRIDE];
+    size_t rtp_len[BURST_NUM_PKTS];
+    for (size_t i = 0; i < BURST_NUM_PKTS; i++) {
+        size_t payload_len = BURST_PAYLOAD_LEN;
+        if (i == BURST_NUM_PKTS - 1) {
+            payload_len /= 2;
+        }
+        size_t len;
+        uint8_t *pkt = create_rtp_test_packet(
+            payload_len, policy.ssrc.value, (uint16_t)(i + 1), (uint32_t)i,
+            false, &len, NULL);
+        memcpy(rtp + i * BURST_RTP_STRIDE, pkt, len);
+        rtp_len[i] = len;
+        free(pkt);
+    }
+
+    /* the SRTP packets are back to back, each one filling its stride */
+    uint8_t srtp[BURST_NUM_PKTS * BURST_SRTP_STRIDE];
+    size_t srtp_len[BURST_NUM_PKTS];
+    CHECK_OK(srtp_protect_burst(srtp_snd, rtp, BURST_RTP_STRIDE, rtp_len,
+                                BURST_NUM_PKTS, srtp, BURST_SRTP_STRIDE,
+                                srtp_len, 0));
+    for (size_t i = 0; i < BURST_NUM_PKTS - 1; i++) {
+        CHECK(srtp_len[i] == BURST_SRTP_STRIDE);
+    }
+    CHECK(srtp_len[BURST_NUM_PKTS - 1] == rtp_len[BURST_NUM_PKTS - 1] + 10);
+
+    /* a stride that cannot hold the trailer is rejected */
+    size_t short_len[BURST_NUM_PKTS];
+    uint8_t scratch[BURST_NUM_PKTS * BURST_RTP_STRIDE];
+    CHECK_RETURN(srtp_protect_burst(srtp_snd, rtp, BURST_RTP_STRIDE, rtp_len,
+                                    BURST_NUM_PKTS, scratch, BURST_RTP_STRIDE,
+                                    short_len, 0),
+                 srtp_err_status_buffer_small);
+    CHECK(short_len[0] == 0 && short_len[BURST_NUM_PKTS - 1] == 0);
+    CHECK_RETURN(srtp_protect_burst(srtp_snd, rtp, BURST_RTP_STRIDE, rtp_len,
+                                    BURST_NUM_PKTS, rtp, BURST_SRTP_STRIDE,
+                                    short_len, 0),
+                 srtp_err_status_bad_param);
+
+    /* the coalesced buffer, as delivered by GRO */
+    size_t gro_len =
+        (BURST_NUM_PKTS - 1) * BURST_SRTP_STRIDE + srtp_len[BURST_NUM_PKTS - 1];
+    size_t out_len[BURST_NUM_PKTS];
+    srtp_err_status_t pkt_status[BURST_NUM_PKTS];
+    size_t num_pkts;
+
+    CHECK_RETURN(srtp_unprotect_burst(srtp_recv, srtp, gro_len,
+                                      BURST_SRTP_STRIDE, out_len, pkt_status,
+                                      BURST_NUM_PKTS - 1, &num_pkts),
+                 srtp_err_status_buffer_small);
+    CHECK(num_pkts == 0);
+
+    /* a damaged packet fails on its own */
+    srtp[3 * BURST_SRTP_STRIDE + 20] ^= 0xff;
+
+    CHECK_OK(srtp_unprotect_burst(srtp_recv, srtp, gro_len, BURST_SRTP_STRIDE,
+                                  out_len, pkt_status, BURST_NUM_PKTS,
+                                  &num_pkts));
+    CHECK(num_pkts == BURST_NUM_PKTS);
+    for (size_t i = 0; i < BURST_NUM_PKTS; i++) {
+        if (i == 3) {
+            CHECK(pkt_status[i] == srtp_err_status_auth_fail);
+            CHECK(out_len[i] == 0);
+            continue;
+        }
+        CHECK_OK(pkt_status[i]);
+        CHECK(out_len[i] == rtp_len[i]);
+        CHECK_BUFFER_EQUAL(srtp + i * BURST_SRTP_STRIDE,
+                           rtp + i * BURST_RTP_STRIDE, rtp_len[i]);
+    }
+
+    /* in-place protection with a common stride */
+    uint8_t inplace[BURST_NUM_PKTS * BURST_SRTP_STRIDE];
+    for (size_t i = 0; i < BURST_NUM_PKTS; i++) {
+        srtp_hdr_t *hdr = (srtp_hdr_t *)(rtp + i * BURST_RTP_STRIDE);
+        hdr->seq = htons((uint16_t)(BURST_NUM_PKTS + i + 1));
+        memcpy(inplace + i * BURST_SRTP_STRIDE, rtp + i * BURST_RTP_STRIDE,
+               rtp_len[i]);
+    }
+    CHECK_OK(srtp_protect_burst(srtp_snd, inplace, BURST_SRTP_STRIDE, rtp_len,
+                                BURST_NUM_PKTS, inplace, BURST_SRTP_STRIDE,
+                                srtp_len, 0));
+    for (size_t i = 0; i < BURST_NUM_PKTS; i++) {
+        out_len[i] = BURST_SRTP_STRIDE;
+        CHECK_OK(srtp_unprotect(srtp_recv, inplace + i * BURST_SRTP_STRIDE,
+                                srtp_len[i], inplace + i * BURST_SRTP_STRIDE,
+                                &out_len[i]));
+        CHECK(out_len[i] == rtp_len[i]);
+        CHECK_BUFFER_EQUAL(inplace + i * BURST_SRTP_STRIDE,
+                           rtp + i * BURST_RTP_STRIDE, rtp_len[i]);
+    }
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * batch_aes_icm_128 and batch_hmac stand in for a multi-buffer engine:
+ * they are aes_icm_128 and hmac with batch entry points that record the
+ * largest batch they get
+ */
+static srtp_cipher_type_t batch_aes_icm_128;
+static srtp_auth_type_t batch_hmac;
+static size_t max_cipher_jobs = 0;
+static size_t max_auth_jobs = 0;
+
+static srtp_err_status_t batch_cipher_alloc(srtp_cipher_pointer_t *cp,
+                                            size_t key_len,
+                                            size_t tag_len)
+{
+    srtp_err_status_t status = srtp_aes_icm_128.alloc(cp, key_len, tag_len);
+    if (status == srtp_err_status_ok) {
+        (*cp)->type = &batch_aes_icm_128;
+    }
+    return status;
+}
+
+static srtp_err_status_t batch_cipher_batch(void *state,
+                                            srtp_cipher_direction_t direction,
+                                            srtp_cipher_job_t *jobs,
+                                            size_t num_jobs)
+{
+    srtp_err_status_t status = srtp_err_status_ok;
+
+    if (num_jobs > max_cipher_jobs) {
+        max_cipher_jobs = num_jobs;
+    }
+    for (size_t i = 0; i < num_jobs; i++) {
+        jobs[i].status = srtp_aes_icm_128.set_iv(state, jobs[i].iv, direction);
+        if (jobs[i].status == srtp_err_status_ok) {
+            jobs[i].status =
+                srtp_aes_icm_128.encrypt(state, jobs[i].src, jobs[i].src_len,
+                                         jobs[i].dst, &jobs[i].dst_len);
+        }
+        if (jobs[i].status && !status) {
+            status = jobs[i].status;
+        }
+    }
+
+    return status;
+}
+
+static srtp_err_status_t batch_auth_alloc(srtp_auth_pointer_t *ap,
+                                          size_t key_len,
+                                          size_t out_len)
+{
+    srtp_err_status_t status = srtp_hmac.alloc(ap, key_len, out_len);
+    if (status == srtp_err_status_ok) {
+        (*ap)->type = &batch_hmac;
+    }
+    return status;
+}
+
+static srtp_err_status_t batch_auth_batch(void *state,
+                                          size_t tag_len,
+                                          srtp_auth_job_t *jobs,
+                                          size_t num_jobs)
+{
+    srtp_err_status_t status = srtp_err_status_ok;
+
+    if (num_jobs > max_auth_jobs) {
+        max_auth_jobs = num_jobs;
+    }
+    for (size_t i = 0; i < num_jobs; i++) {
+        jobs[i].status = srtp_hmac.start(state);
+        if (jobs[i].status == srtp_err_status_ok) {
+            jobs[i].status =
+                srtp_hmac.update(state, jobs[i].buffer, jobs[i].len);
+        }
+        if (jobs[i].status == srtp_err_status_ok) {
+            jobs[i].status =
+                srtp_hmac.compute(state, jobs[i].trailer, jobs[i].trailer_len,
+                                  tag_len, jobs[i].tag);
+        }
+        if (jobs[i].status && !status) {
+            status = jobs[i].status;
+        }
+    }
+
+    return status;
+}
+
+#define BATCH_NUM_PKTS 24
+
+/*
+ * the burst functions hand the packets of a stream to the batch entry
+ * points of its cipher and auth function, and the results are those of
+ * srtp_protect() and srtp_unprotect()
+ */
+srtp_err_status_t srtp_test_burst_batch(void)
+{
+    batch_aes_icm_128 = srtp_aes_icm_128;
+    batch_aes_icm_128.alloc = batch_cipher_alloc;
+    batch_aes_icm_128.batch = batch_cipher_batch;
+    batch_hmac = srtp_hmac;
+    batch_hmac.alloc = batch_auth_alloc;
+    batch_hmac.batch = batch_auth_batch;
+    CHECK_OK(srtp_replace_cipher_type(&batch_aes_icm_128, SRTP_AES_ICM_128));
+    CHECK_OK(srtp_replace_auth_type(&batch_hmac, SRTP_HMAC_SHA1));
+
+    srtp_policy_t policy[2];
+    memset(policy, 0, sizeof(policy));
+    for (size_t i = 0; i < 2; i++) {
+        srtp_crypto_policy_set_rtp_default(&policy[i].rtp);
+        srtp_crypto_policy_set_rtcp_default(&policy[i].rtcp);
+        policy[i].ssrc.type = ssrc_specific;
+        policy[i].key = test_key;
+        policy[i].window_size = 128;
+    }
+    policy[0].ssrc.value = 0xcafebabe;
+    policy[1].ssrc.value = 0xdeadbeef;
+    policy[0].next = &policy[1];
+
+    srtp_t srtp_snd;
+    srtp_t srtp_ref;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, policy));
+    CHECK_OK(srtp_create(&srtp_ref, policy));
+    CHECK_OK(srtp_create(&srtp_recv, policy));
+
+    /*
+     * ten packets of the first stream, across a ROC change, four of the
+     * second one and ten more of the first one
+     */
+    uint8_t rtp[BATCH_NUM_PKTS * BURST_RTP_STRIDE];
+    size_t rtp_len[BATCH_NUM_PKTS];
+    uint16_t seq[2] = { 0xfffa, 1 };
+    for (size_t i = 0; i < BATCH_NUM_PKTS; i++) {
+        size_t s = (i >= 10 && i < 14) ? 1 : 0;
+        size_t len;
+        uint8_t *pkt = create_rtp_test_packet(
+            BURST_PAYLOAD_LEN, policy[s].ssrc.value, seq[s]++, (uint32_t)i,
+            false, &len, NULL);
+        memcpy(rtp + i * BURST_RTP_STRIDE, pkt, len);
+        rtp_len[i] = len;
+        free(pkt);
+    }
+
+    uint8_t srtp[BATCH_NUM_PKTS * BURST_SRTP_STRIDE];
+    size_t srtp_len[BATCH_NUM_PKTS];
+    CHECK_OK(srtp_protect_burst(srtp_snd, rtp, BURST_RTP_STRIDE, rtp_len,
+                                BATCH_NUM_PKTS, srtp, BURST_SRTP_STRIDE,
+                                srtp_len, 0));
+    CHECK(max_cipher_jobs == 10);
+    CHECK(max_auth_jobs == 10);
+
+    for (size_t i = 0; i < BATCH_NUM_PKTS; i++) {
+        uint8_t ref[BURST_SRTP_STRIDE];
+        size_t ref_len = sizeof(ref);
+        CHECK_OK(srtp_protect(srtp_ref, rtp + i * BURST_RTP_STRIDE,
+                              rtp_len[i], ref, &ref_len, 0));
+        CHECK(srtp_len[i] == ref_len);
+        CHECK_BUFFER_EQUAL(srtp + i * BURST_SRTP_STRIDE, ref, ref_len);
+    }
+
+    /*
+     * a replay of a packet earlier in the same batch and a damaged packet
+     * fail on their own
+     */
+    memcpy(srtp + 5 * BURST_SRTP_STRIDE, srtp + 2 * BURST_SRTP_STRIDE,
+           BURST_SRTP_STRIDE);
+    srtp[16 * BURST_SRTP_STRIDE + 20] ^= 0xff;
+
+    size_t out_len[BATCH_NUM_PKTS];
+    srtp_err_status_t pkt_status[BATCH_NUM_PKTS];
+    size_t num_pkts;
+    max_cipher_jobs = 0;
+    max_auth_jobs = 0;
+    CHECK_OK(srtp_unprotect_burst(srtp_recv, srtp, sizeof(srtp),
+                                  BURST_SRTP_STRIDE, out_len, pkt_status,
+                                  BATCH_NUM_PKTS, &num_pkts));
+    CHECK(num_pkts == BATCH_NUM_PKTS);
+    CHECK(max_auth_jobs == 10);
+    CHECK(max_cipher_jobs == 9);
+    for (size_t i = 0; i < BATCH_NUM_PKTS; i++) {
+        if (i == 5) {
+            CHECK(pkt_status[i] == srtp_err_status_replay_fail);
+            CHECK(out_len[i] == 0);
+            continue;
+        }
+        if (i == 16) {
+            CHECK(pkt_status[i] == srtp_err_status_auth_fail);
+            CHECK(out_len[i] == 0);
+            continue;
+        }
+        CHECK_OK(pkt_status[i]);
+        CHECK(out_len[i] == rtp_len[i]);
+        CHECK_BUFFER_EQUAL(srtp + i * BURST_SRTP_STRIDE,
+                           rtp + i * BURST_RTP_STRIDE, rtp_len[i]);
+    }
+
+    /*
+     * the index of the last two packets is only known once the first one
+     * is in, so their tags are checked again
+     */
+    const uint16_t far_seq[3] = { 0x7000, 0xe000, 0xe001 };
+    for (size_t i = 0; i < 3; i++) {
+        srtp_hdr_t *hdr = (srtp_hdr_t *)(rtp + i * BURST_RTP_STRIDE);
+        hdr->ssrc = htonl(policy[0].ssrc.value);
+        hdr->seq = htons(far_seq[i]);
+    }
+    CHECK_OK(srtp_protect_burst(srtp_snd, rtp, BURST_RTP_STRIDE, rtp_len, 3,
+                                srtp, BURST_SRTP_STRIDE, srtp_len, 0));
+    CHECK_OK(srtp_unprotect_burst(srtp_recv, srtp, 3 * BURST_SRTP_STRIDE,
+                                  BURST_SRTP_STRIDE, out_len, pkt_status, 3,
+                                  &num_pkts));
+    CHECK(num_pkts == 3);
+    for (size_t i = 0; i < 3; i++) {
+        CHECK_OK(pkt_status[i]);
+        CHECK(out_len[i] == rtp_len[i]);
+        CHECK_BUFFER_EQUAL(srtp + i * BURST_SRTP_STRIDE,
+                           rtp + i * BURST_RTP_STRIDE, rtp_len[i]);
+    }
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_ref));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    CHECK_OK(srtp_replace_cipher_type(&srtp_aes_icm_128, SRTP_AES_ICM_128));
+    CHECK_OK(srtp_replace_auth_type(&srtp_hmac, SRTP_HMAC_SHA1));
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * protect the same packet with a session that has precomputed keystream
+ * and with one that does not, and compare the results
+ */
+static void check_precomputed_protect(srtp_t srtp_snd,
+                                      srtp_t srtp_ref,
+                                      srtp_t srtp_recv,
+                                      uint32_t ssrc,
+                                      uint16_t seq,
+                                      size_t payload_len)
+{
+    size_t len, ref_len, rtp_len;
+    uint8_t *pkt =
+        create_rtp_test_packet(payload_len, ssrc, seq, seq, false, &len, NULL);
+    uint8_t *ref =
+        create_rtp_test_packet(payload_len, ssrc, seq, seq, false, &len, NULL);
+
+    rtp_len = len;
+    ref_len = len;
+    CHECK_OK(call_srtp_protect(srtp_snd, pkt, &len, 0));
+    CHECK_OK(call_srtp_protect(srtp_ref, ref, &ref_len, 0));
+    CHECK(len == ref_len);
+    CHECK_BUFFER_EQUAL(pkt, ref, len);
+
+    CHECK_OK(call_srtp_unprotect(srtp_recv, pkt, &len));
+    CHECK(len == rtp_len);
+
+    free(pkt);
+    free(ref);
+}
+
+static size_t count_precomputed(srtp_t srtp, uint32_t ssrc)
+{
+    const srtp_stream_ctx_t *stream = srtp_get_stream(srtp, htonl(ssrc));
+    size_t count = 0;
+
+    for (size_t i = 0; i < stream->keystream_cache->num_entries; i++) {
+        if (stream->keystream_cache->entries[i].valid) {
+            count++;
+        }
+    }
+    return count;
+}
+
+srtp_err_status_t srtp_test_stream_precompute(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    srtp_t srtp_snd;
+    srtp_t srtp_ref;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(srtp_create(&srtp_ref, &policy));
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    CHECK_RETURN(srtp_stream_precompute(srtp_snd, 0xdeadbeef, 0, 4, 200),
+                 srtp_err_status_bad_param);
+
+    /* sizes whose product would wrap, or payloads no RTP packet has */
+    CHECK_RETURN(srtp_stream_precompute(srtp_snd, policy.ssrc.value, 0,
+                                        SIZE_MAX / 64 + 1, 64),
+                 srtp_err_status_bad_param);
+    CHECK_RETURN(srtp_stream_precompute(srtp_snd, policy.ssrc.value, 0,
+                                        SIZE_MAX, 1),
+                 srtp_err_status_bad_param);
+    CHECK_RETURN(srtp_stream_precompute(srtp_snd, policy.ssrc.value, 0, 4,
+                                        0x10000),
+                 srtp_err_status_bad_param);
+    CHECK(srtp_get_stream(srtp_snd, htonl(policy.ssrc.value))
+              ->keystream_cache == NULL);
+
+    /* the first packet fixes the sequence number of the stream */
+    check_precomputed_protect(srtp_snd, srtp_ref, srtp_recv, policy.ssrc.value,
+                              1000, 100);
+
+    /* four packets are covered, the fifth one falls back to the cipher */
+    CHECK_OK(srtp_stream_precompute(srtp_snd, policy.ssrc.value, 0, 4, 200));
+    CHECK(count_precomputed(srtp_snd, policy.ssrc.value) == 4);
+    for (uint16_t seq = 1001; seq <= 1005; seq++) {
+        check_precomputed_protect(srtp_snd, srtp_ref, srtp_recv,
+                                  policy.ssrc.value, seq, 100);
+    }
+    CHECK(count_precomputed(srtp_snd, policy.ssrc.value) == 0);
+
+    /* payloads longer than the keystream fall back as well */
+    CHECK_OK(srtp_stream_precompute(srtp_snd, policy.ssrc.value, 0, 4, 200));
+    check_precomputed_protect(srtp_snd, srtp_ref, srtp_recv, policy.ssrc.value,
+                              1006, 300);
+    check_precomputed_protect(srtp_snd, srtp_ref, srtp_recv, policy.ssrc.value,
+                              1007, 200);
+
+    /* gaps in the sequence numbers skip entries */
+    check_precomputed_protect(srtp_snd, srtp_ref, srtp_recv, policy.ssrc.value,
+                              1009, 50);
+    CHECK(count_precomputed(srtp_snd, policy.ssrc.value) == 1);
+
+    /* release the keystream */
+    CHECK_OK(srtp_stream_precompute(srtp_snd, policy.ssrc.value, 0, 0, 0));
+    check_precomputed_protect(srtp_snd, srtp_ref, srtp_recv, policy.ssrc.value,
+                              1010, 100);
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_ref));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    /* there is no keystream to precompute without encryption */
+    srtp_crypto_policy_set_null_cipher_hmac_sha1_80(&policy.rtp);
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_RETURN(
+        srtp_stream_precompute(srtp_snd, policy.ssrc.value, 0, 4, 200),
+        srtp_err_status_bad_param);
+    CHECK_OK(srtp_dealloc(srtp_snd));
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * unprotect_shared(recv, srtp, len) unprotects a copy of the SRTP packet
+ * srtp of length len with recv
+ */
+static srtp_err_status_t unprotect_shared(srtp_t recv,
+                                          const uint8_t *srtp,
+                                          size_t len)
+{
+    uint8_t pkt[256];
+    memcpy(pkt, srtp, len);
+    return call_srtp_unprotect(recv, pkt, &len);
+}
+
+srtp_err_status_t srtp_test_share_replay_window(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    srtp_t srtp_snd;
+    srtp_t srtp_recv_a;
+    srtp_t srtp_recv_b;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(srtp_create(&srtp_recv_a, &policy));
+    CHECK_OK(srtp_create(&srtp_recv_b, &policy));
+
+    CHECK_RETURN(
+        srtp_stream_share_replay_window(srtp_recv_b, 0xdeadbeef, srtp_recv_a),
+        srtp_err_status_bad_param);
+    CHECK_RETURN(srtp_stream_share_replay_window(
+                     srtp_recv_a, policy.ssrc.value, srtp_recv_a),
+                 srtp_err_status_bad_param);
+
+    srtp_err_status_t status = srtp_stream_share_replay_window(
+        srtp_recv_b, policy.ssrc.value, srtp_recv_a);
+    if (status == srtp_err_status_fail) {
+        /* no atomic operations on this platform */
+        CHECK_OK(srtp_dealloc(srtp_snd));
+        CHECK_OK(srtp_dealloc(srtp_recv_a));
+        CHECK_OK(srtp_dealloc(srtp_recv_b));
+        return srtp_err_status_ok;
+    }
+    CHECK_OK(status);
+
+    uint8_t srtp[3][256];
+    size_t srtp_len[3];
+    for (size_t i = 0; i < 3; i++) {
+        uint8_t *pkt = create_rtp_test_packet(64, policy.ssrc.value,
+                                              (uint16_t)(i + 1), (uint32_t)i,
+                                              false, &srtp_len[i], NULL);
+        CHECK_OK(call_srtp_protect(srtp_snd, pkt, &srtp_len[i], 0));
+        memcpy(srtp[i], pkt, srtp_len[i]);
+        free(pkt);
+    }
+
+    /* a packet accepted by one session is a replay for the other */
+    CHECK_OK(unprotect_shared(srtp_recv_a, srtp[0], srtp_len[0]));
+    CHECK_RETURN(unprotect_shared(srtp_recv_b, srtp[0], srtp_len[0]),
+                 srtp_err_status_replay_fail);
+    CHECK_OK(unprotect_shared(srtp_recv_b, srtp[1], srtp_len[1]));
+    CHECK_RETURN(unprotect_shared(srtp_recv_a, srtp[1], srtp_len[1]),
+                 srtp_err_status_replay_fail);
+
+    /* the window is kept when the stream is updated */
+    CHECK_OK(srtp_update(srtp_recv_b, &policy));
+    CHECK_OK(unprotect_shared(srtp_recv_a, srtp[2], srtp_len[2]));
+    CHECK_RETURN(unprotect_shared(srtp_recv_b, srtp[2], srtp_len[2]),
+                 srtp_err_status_replay_fail);
+
+    uint32_t roc;
+    CHECK_OK(srtp_stream_get_roc(srtp_recv_b, policy.ssrc.value, &roc));
+    CHECK(roc == 0);
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv_a));
+    CHECK_OK(srtp_dealloc(srtp_recv_b));
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * protect_with_mki(snd, ssrc, seq, mki_index, srtp, len) protects a test
+ * packet with the given master key and copies the result to srtp
+ */
+static srtp_err_status_t protect_with_mki(srtp_t snd,
+                                          uint32_t ssrc,
+                                          uint16_t seq,
+                                          size_t mki_index,
+                                          uint8_t *srtp,
+                                          size_t *len)
+{
+    uint8_t *pkt = create_rtp_test_packet(64, ssrc, seq, seq, false, len, NULL);
+    srtp_err_status_t status = call_srtp_protect(snd, pkt, len, mki_index);
+    memcpy(srtp, pkt, *len);
+    free(pkt);
+    return status;
+}
+
+srtp_err_status_t srtp_test_master_key_ring(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.keys = test_keys;
+    policy.num_master_keys = 2;
+    policy.use_mki = true;
+    policy.mki_size = TEST_MKI_ID_SIZE;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    /* the reference session has both keys from the start */
+    srtp_t srtp_ref;
+    CHECK_OK(srtp_create(&srtp_ref, &policy));
+
+    srtp_t srtp_snd;
+    srtp_t srtp_recv;
+    policy.num_master_keys = 1;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    CHECK_RETURN(
+        srtp_stream_add_master_key(srtp_snd, 0xdeadbeef, &master_key_2),
+        srtp_err_status_bad_param);
+    CHECK_RETURN(srtp_stream_add_master_key(srtp_snd, policy.ssrc.value,
+                                            &master_key_1),
+                 srtp_err_status_bad_param);
+    CHECK_RETURN(srtp_stream_remove_master_key(srtp_snd, policy.ssrc.value,
+                                               test_mki_id),
+                 srtp_err_status_bad_param);
+    CHECK_RETURN(srtp_stream_remove_master_key(srtp_snd, policy.ssrc.value,
+                                               test_mki_id_2),
+                 srtp_err_status_bad_mki);
+
+    /* the added key protects like one given in the policy */
+    size_t mki_index;
+    CHECK_OK(srtp_stream_add_master_key(srtp_snd, policy.ssrc.value,
+                                        &master_key_2));
+    CHECK_OK(srtp_stream_get_mki_index(srtp_snd, policy.ssrc.value,
+                                       test_mki_id_2, &mki_index));
+    CHECK(mki_index == 1);
+
+    uint8_t srtp[3][256];
+    size_t srtp_len[3];
+    uint8_t ref[256];
+    size_t ref_len;
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 1, 0, srtp[0],
+                              &srtp_len[0]));
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 2, 1, srtp[1],
+                              &srtp_len[1]));
+    CHECK_OK(protect_with_mki(srtp_ref, policy.ssrc.value, 1, 0, ref,
+                              &ref_len));
+    CHECK_OK(protect_with_mki(srtp_ref, policy.ssrc.value, 2, 1, ref,
+                              &ref_len));
+    CHECK(ref_len == srtp_len[1]);
+    CHECK(memcmp(ref, srtp[1], ref_len) == 0);
+
+    /* the receiver accepts the new key once it has it */
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[0], srtp_len[0]));
+    CHECK_RETURN(unprotect_shared(srtp_recv, srtp[1], srtp_len[1]),
+                 srtp_err_status_bad_mki);
+    CHECK_OK(srtp_stream_add_master_key(srtp_recv, policy.ssrc.value,
+                                        &master_key_2));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[1], srtp_len[1]));
+
+    /* a retired key is rejected and the remaining keys move down */
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 3, 0, srtp[2],
+                              &srtp_len[2]));
+    CHECK(srtp_recv->kdf_cache != NULL);
+    CHECK_OK(srtp_stream_remove_master_key(srtp_recv, policy.ssrc.value,
+                                           test_mki_id));
+    CHECK(srtp_recv->kdf_cache == NULL);
+    CHECK_RETURN(unprotect_shared(srtp_recv, srtp[2], srtp_len[2]),
+                 srtp_err_status_bad_mki);
+    CHECK_OK(srtp_stream_get_mki_index(srtp_recv, policy.ssrc.value,
+                                       test_mki_id_2, &mki_index));
+    CHECK(mki_index == 0);
+    CHECK_RETURN(srtp_stream_get_mki_index(srtp_recv, policy.ssrc.value,
+                                           test_mki_id, &mki_index),
+                 srtp_err_status_bad_mki);
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+    CHECK_OK(srtp_dealloc(srtp_ref));
+
+    /* streams cloned from a wildcard policy share its keys */
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+    policy.ssrc.type = ssrc_specific;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 1, 0, srtp[0],
+                              &srtp_len[0]));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[0], srtp_len[0]));
+    CHECK_RETURN(srtp_stream_add_master_key(srtp_recv, policy.ssrc.value,
+                                            &master_key_2),
+                 srtp_err_status_bad_param);
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    /* streams without MKI have a single key */
+    policy.keys = NULL;
+    policy.num_master_keys = 0;
+    policy.use_mki = false;
+    policy.mki_size = 0;
+    policy.key = test_key;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_RETURN(srtp_stream_add_master_key(srtp_snd, policy.ssrc.value,
+                                            &master_key_2),
+                 srtp_err_status_bad_param);
+    CHECK_OK(srtp_dealloc(srtp_snd));
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_test_update_in_place(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    srtp_t srtp_snd;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    uint8_t srtp[3][256];
+    size_t srtp_len[3];
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 1, 0, srtp[0],
+                              &srtp_len[0]));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[0], srtp_len[0]));
+
+    const srtp_stream_ctx_t *snd_stream =
+        srtp_get_stream(srtp_snd, htonl(policy.ssrc.value));
+    const srtp_stream_ctx_t *recv_stream =
+        srtp_get_stream(srtp_recv, htonl(policy.ssrc.value));
+    const srtp_cipher_t *snd_cipher = snd_stream->session_keys[0].rtp_cipher;
+    const srtp_cipher_t *recv_cipher = recv_stream->session_keys[0].rtp_cipher;
+
+    /* a change of keys only reuses the streams and their ciphers */
+    policy.key = test_key_2;
+    policy.ssrc.type = ssrc_specific;
+    CHECK_OK(srtp_update(srtp_snd, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_update(srtp_recv, &policy));
+    CHECK(srtp_get_stream(srtp_snd, htonl(policy.ssrc.value)) == snd_stream);
+    CHECK(srtp_get_stream(srtp_recv, htonl(policy.ssrc.value)) ==
+          recv_stream);
+    CHECK(snd_stream->session_keys[0].rtp_cipher == snd_cipher);
+    CHECK(recv_stream->session_keys[0].rtp_cipher == recv_cipher);
+
+    /* the new keys protect like those of a new session */
+    srtp_t srtp_ref;
+    uint8_t ref[256];
+    size_t ref_len;
+    policy.ssrc.type = ssrc_specific;
+    CHECK_OK(srtp_create(&srtp_ref, &policy));
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 2, 0, srtp[1],
+                              &srtp_len[1]));
+    CHECK_OK(protect_with_mki(srtp_ref, policy.ssrc.value, 2, 0, ref,
+                              &ref_len));
+    CHECK(ref_len == srtp_len[1]);
+    CHECK(memcmp(ref, srtp[1], ref_len) == 0);
+    CHECK_OK(srtp_dealloc(srtp_ref));
+
+    /* the replay state is kept */
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[1], srtp_len[1]));
+    CHECK_RETURN(unprotect_shared(srtp_recv, srtp[0], srtp_len[0]),
+                 srtp_err_status_replay_fail);
+
+    /* other changes still replace the streams */
+    policy.window_size = 256;
+    policy.ssrc.type = ssrc_specific;
+    CHECK_OK(srtp_update(srtp_snd, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_update(srtp_recv, &policy));
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 3, 0, srtp[2],
+                              &srtp_len[2]));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[2], srtp_len[2]));
+    recv_stream = srtp_get_stream(srtp_recv, htonl(policy.ssrc.value));
+    CHECK(srtp_rdbx_get_window_size(&recv_stream->rtp_rdbx) == 256);
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * HMAC-SHA1 whose key setup fails once it has been called a set number
+ * of times, used to make srtp_update() fail part way through a stream
+ */
+#define FLAKY_AUTH_ID 0x7e
+
+static size_t flaky_auth_budget = SIZE_MAX;
+
+static srtp_auth_type_t flaky_auth;
+
+static srtp_err_status_t flaky_auth_alloc(srtp_auth_pointer_t *ap,
+                                          size_t key_len,
+                                          size_t out_len)
+{
+    srtp_err_status_t status = srtp_hmac.alloc(ap, key_len, out_len);
+
+    if (status == srtp_err_status_ok) {
+        (*ap)->type = &flaky_auth;
+    }
+    return status;
+}
+
+static srtp_err_status_t flaky_auth_init(void *state,
+                                         const uint8_t *key,
+                                         size_t key_len)
+{
+    if (flaky_auth_budget == 0) {
+        return srtp_err_status_init_fail;
+    }
+    flaky_auth_budget--;
+    return srtp_hmac.init(state, key, key_len);
+}
+
+/*
+ * AES-ICM-128 whose allocation fails once it has been called a set number
+ * of times; an in-place rekey only allocates the ciphers of the key
+ * derivation, so this makes it fail before any stream has been touched
+ */
+static size_t flaky_cipher_budget = SIZE_MAX;
+
+static srtp_cipher_type_t flaky_aes_icm_128;
+
+static srtp_err_status_t flaky_cipher_alloc(srtp_cipher_pointer_t *cp,
+                                            size_t key_len,
+                                            size_t tag_len)
+{
+    srtp_err_status_t status;
+
+    if (flaky_cipher_budget == 0) {
+        return srtp_err_status_alloc_fail;
+    }
+    flaky_cipher_budget--;
+
+    status = srtp_aes_icm_128.alloc(cp, key_len, tag_len);
+    if (status == srtp_err_status_ok) {
+        (*cp)->type = &flaky_aes_icm_128;
+    }
+    return status;
+}
+
+srtp_err_status_t srtp_test_update_failure(void)
+{
+    flaky_auth = srtp_hmac;
+    flaky_auth.alloc = flaky_auth_alloc;
+    flaky_auth.init = flaky_auth_init;
+    flaky_auth.description = "flaky HMAC-SHA1";
+    flaky_auth.id = FLAKY_AUTH_ID;
+    CHECK_OK(srtp_crypto_kernel_load_auth_type(&flaky_auth, FLAKY_AUTH_ID));
+
+    srtp_master_key_t new_key_1 = { test_key_2, test_mki_id };
+    srtp_master_key_t new_key_2 = { test_key, test_mki_id_2 };
+    srtp_master_key_t *new_keys[2] = { &new_key_1, &new_key_2 };
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.rtp.auth_type = FLAKY_AUTH_ID;
+    policy.rtcp.auth_type = FLAKY_AUTH_ID;
+    policy.num_master_keys = 2;
+    policy.use_mki = true;
+    policy.mki_size = TEST_MKI_ID_SIZE;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    uint8_t srtp[256];
+    size_t len;
+    bool updated = false;
+
+    /* fail each key setup of the updates in turn, until none fails */
+    for (size_t budget = 0; !updated; budget++) {
+        srtp_t srtp_snd;
+        srtp_t srtp_new;
+        srtp_t srtp_recv;
+        policy.ssrc.type = ssrc_any_outbound;
+        policy.keys = test_keys;
+        CHECK_OK(srtp_create(&srtp_snd, &policy));
+        policy.keys = new_keys;
+        CHECK_OK(srtp_create(&srtp_new, &policy));
+        policy.ssrc.type = ssrc_any_inbound;
+        policy.keys = test_keys;
+        CHECK_OK(srtp_create(&srtp_recv, &policy));
+        policy.ssrc.type = ssrc_specific;
+        policy.ssrc.value = 2;
+        CHECK_OK(srtp_stream_add(srtp_recv, &policy));
+
+        /* SSRC 1 is cloned from the template, SSRC 2 has its own policy */
+        for (uint32_t ssrc = 1; ssrc <= 2; ssrc++) {
+            CHECK_OK(protect_with_mki(srtp_snd, ssrc, 1, 0, srtp, &len));
+            CHECK_OK(unprotect_shared(srtp_recv, srtp, len));
+        }
+
+        srtp_err_status_t status[2];
+        policy.keys = new_keys;
+        policy.ssrc.type = ssrc_any_inbound;
+        flaky_auth_budget = budget;
+        status[0] = srtp_update(srtp_recv, &policy);
+        policy.ssrc.type = ssrc_specific;
+        flaky_auth_budget = budget;
+        status[1] = srtp_update(srtp_recv, &policy);
+        flaky_auth_budget = SIZE_MAX;
+
+        /* a stream that failed to update is gone, or has all its old keys */
+        for (uint32_t ssrc = 1; ssrc <= 2; ssrc++) {
+            srtp_t sender =
+                status[ssrc - 1] == srtp_err_status_ok ? srtp_new : srtp_snd;
+            if (status[ssrc - 1] != srtp_err_status_ok &&
+                srtp_get_stream(srtp_recv, htonl(ssrc)) == NULL) {
+                continue;
+            }
+            for (size_t mki_index = 0; mki_index < 2; mki_index++) {
+                uint16_t seq = (uint16_t)(2 + mki_index);
+                CHECK_OK(protect_with_mki(sender, ssrc, seq, mki_index, srtp,
+                                          &len));
+                CHECK_OK(unprotect_shared(srtp_recv, srtp, len));
+            }
+        }
+        updated = status[0] == srtp_err_status_ok &&
+                  status[1] == srtp_err_status_ok;
+
+        CHECK_OK(srtp_dealloc(srtp_snd));
+        CHECK_OK(srtp_dealloc(srtp_new));
+        CHECK_OK(srtp_dealloc(srtp_recv));
+    }
+
+    /* a rekey whose key derivation fails leaves every stream as it was */
+    flaky_aes_icm_128 = srtp_aes_icm_128;
+    flaky_aes_icm_128.alloc = flaky_cipher_alloc;
+    CHECK_OK(srtp_replace_cipher_type(&flaky_aes_icm_128, SRTP_AES_ICM_128));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+
+    updated = false;
+    for (size_t budget = 0; !updated; budget++) {
+        srtp_t srtp_snd;
+        srtp_t srtp_new;
+        srtp_t srtp_recv;
+        policy.ssrc.type = ssrc_any_outbound;
+        policy.keys = test_keys;
+        CHECK_OK(srtp_create(&srtp_snd, &policy));
+        policy.keys = new_keys;
+        CHECK_OK(srtp_create(&srtp_new, &policy));
+        policy.ssrc.type = ssrc_any_inbound;
+        policy.keys = test_keys;
+        CHECK_OK(srtp_create(&srtp_recv, &policy));
+        policy.ssrc.type = ssrc_specific;
+        policy.ssrc.value = 2;
+        CHECK_OK(srtp_stream_add(srtp_recv, &policy));
+
+        for (uint32_t ssrc = 1; ssrc <= 2; ssrc++) {
+            CHECK_OK(protect_with_mki(srtp_snd, ssrc, 1, 0, srtp, &len));
+            CHECK_OK(unprotect_shared(srtp_recv, srtp, len));
+        }
+
+        srtp_err_status_t status[2];
+        policy.keys = new_keys;
+        policy.ssrc.type = ssrc_any_inbound;
+        flaky_cipher_budget = budget;
+        status[0] = srtp_update(srtp_recv, &policy);
+        policy.ssrc.type = ssrc_specific;
+        flaky_cipher_budget = budget;
+        status[1] = srtp_update(srtp_recv, &policy);
+        flaky_cipher_budget = SIZE_MAX;
+
+        /* both streams are there, with the old keys or the new ones */
+        CHECK(srtp_recv->stream_template != NULL);
+        for (uint32_t ssrc = 1; ssrc <= 2; ssrc++) {
+            srtp_t sender =
+                status[ssrc - 1] == srtp_err_status_ok ? srtp_new : srtp_snd;
+            CHECK(srtp_get_stream(srtp_recv, htonl(ssrc)) != NULL);
+            for (size_t mki_index = 0; mki_index < 2; mki_index++) {
+                uint16_t seq = (uint16_t)(2 + mki_index);
+                CHECK_OK(protect_with_mki(sender, ssrc, seq, mki_index, srtp,
+                                          &len));
+                CHECK_OK(unprotect_shared(srtp_recv, srtp, len));
+            }
+        }
+        updated = status[0] == srtp_err_status_ok &&
+                  status[1] == srtp_err_status_ok;
+
+        CHECK_OK(srtp_dealloc(srtp_snd));
+        CHECK_OK(srtp_dealloc(srtp_new));
+        CHECK_OK(srtp_dealloc(srtp_recv));
+    }
+
+    CHECK_OK(srtp_replace_cipher_type(&srtp_aes_icm_128, SRTP_AES_ICM_128));
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * a null cipher whose known-answer test can never pass, used to check
+ * that deferred self-test failures are reported and cached
+ */
+static const uint8_t broken_cipher_plaintext[4] = { 0x61, 0x62, 0x63, 0x64 };
+static const uint8_t broken_cipher_ciphertext[4] = { 0x61, 0x62, 0x63, 0x65 };
+
+static const srtp_cipher_test_case_t broken_cipher_test = {
+    0,                        /* octets in key            */
+    NULL,                     /* key                      */
+    NULL,                     /* packet index             */
+    4,                        /* octets in plaintext      */
+    broken_cipher_plaintext,  /* plaintext                */
+    4,                        /* octets in ciphertext     */
+    broken_cipher_ciphertext, /* ciphertext               */
+    0,                        /* octets in AAD            */
+    NULL,                     /* AAD                      */
+    0,                        /* length of AEAD tag       */
+    NULL                      /* pointer to next testcase */
+};
+
+#define BROKEN_CIPHER_ID 0x7f
+
+srtp_err_status_t srtp_test_deferred_self_tests(void)
+{
+    srtp_cipher_type_t broken_cipher = srtp_null_cipher;
+    broken_cipher.description = "broken null cipher";
+    broken_cipher.test_data = &broken_cipher_test;
+    broken_cipher.id = BROKEN_CIPHER_ID;
+
+    /* by default a type is tested when it is loaded */
+    CHECK_RETURN(
+        srtp_crypto_kernel_load_cipher_type(&broken_cipher, BROKEN_CIPHER_ID),
+        srtp_err_status_algo_fail);
+    CHECK_OK(srtp_self_test());
+
+    CHECK_OK(srtp_shutdown());
+    srtp_set_deferred_self_tests(true);
+    CHECK_OK(srtp_init());
+
+    /* with deferral it is only tested, and rejected, on first use */
+    CHECK_OK(
+        srtp_crypto_kernel_load_cipher_type(&broken_cipher, BROKEN_CIPHER_ID));
+    srtp_cipher_t *cipher = NULL;
+    CHECK_RETURN(srtp_crypto_kernel_alloc_cipher(BROKEN_CIPHER_ID, &cipher, 0,
+                                                 0),
+                 srtp_err_status_algo_fail);
+    CHECK(cipher == NULL);
+    CHECK_RETURN(srtp_crypto_kernel_alloc_cipher(BROKEN_CIPHER_ID, &cipher, 0,
+                                                 0),
+                 srtp_err_status_algo_fail);
+
+    /* other types are unaffected and test themselves as streams are made */
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    srtp_t srtp_snd;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    uint8_t srtp[256];
+    size_t srtp_len;
+    CHECK_OK(
+        protect_with_mki(srtp_snd, policy.ssrc.value, 1, 0, srtp, &srtp_len));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp, srtp_len));
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    /* forcing the remaining tests reports the cached failure */
+    CHECK_RETURN(srtp_self_test(), srtp_err_status_algo_fail);
+
+    CHECK_OK(srtp_shutdown());
+    srtp_set_deferred_self_tests(false);
+    CHECK_OK(srtp_init());
+    CHECK_OK(srtp_self_test());
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_test_compiled_policy(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    srtp_t srtp_fast;
+    srtp_t srtp_generic;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_fast, &policy));
+    CHECK_OK(srtp_create(&srtp_generic, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    /* the default policy has a compiled handler */
+    srtp_stream_ctx_t *fast_stream =
+        srtp_get_stream(srtp_fast, htonl(policy.ssrc.value));
+    CHECK(fast_stream->rtp_protect != NULL);
+    CHECK(fast_stream->rtp_unprotect != NULL);
+
+    /* ...which gives the same packets as the generic path */
+    srtp_stream_ctx_t *generic_stream =
+        srtp_get_stream(srtp_generic, htonl(policy.ssrc.value));
+    generic_stream->rtp_protect = NULL;
+    generic_stream->rtp_unprotect = NULL;
+
+    for (uint16_t seq = 1; seq <= 3; seq++) {
+        size_t len, generic_len;
+        uint8_t *pkt = create_rtp_test_packet(20, policy.ssrc.value, seq, seq,
+                                              seq == 2, &len, NULL);
+        uint8_t *generic_pkt = create_rtp_test_packet(
+            20, policy.ssrc.value, seq, seq, seq == 2, &generic_len, NULL);
+        CHECK_OK(call_srtp_protect(srtp_fast, pkt, &len, 0));
+        CHECK_OK(call_srtp_protect(srtp_generic, generic_pkt, &generic_len, 0));
+        CHECK(len == generic_len);
+        CHECK_BUFFER_EQUAL(pkt, generic_pkt, len);
+
+        /* a receive stream is compiled as soon as it is cloned */
+        CHECK_OK(unprotect_shared(srtp_recv, pkt, len));
+        CHECK(srtp_get_stream(srtp_recv, htonl(policy.ssrc.value))
+                  ->rtp_unprotect != NULL);
+        CHECK_RETURN(unprotect_shared(srtp_recv, pkt, len),
+                     srtp_err_status_replay_fail);
+
+        free(pkt);
+        free(generic_pkt);
+    }
+
+    /* a bad tag is rejected without touching the replay window */
+    size_t len;
+    uint8_t *pkt =
+        create_rtp_test_packet(20, policy.ssrc.value, 4, 4, false, &len, NULL);
+    CHECK_OK(call_srtp_protect(srtp_fast, pkt, &len, 0));
+    pkt[len - 1] ^= 0x01;
+    CHECK_RETURN(unprotect_shared(srtp_recv, pkt, len),
+                 srtp_err_status_auth_fail);
+    pkt[len - 1] ^= 0x01;
+    CHECK_OK(unprotect_shared(srtp_recv, pkt, len));
+    free(pkt);
+
+    /* precomputed keystream is only used by the generic path */
+    CHECK_OK(srtp_stream_precompute(srtp_fast, policy.ssrc.value, 0, 4, 64));
+    CHECK(fast_stream->rtp_protect == NULL);
+    CHECK_OK(srtp_stream_precompute(srtp_fast, policy.ssrc.value, 0, 0, 0));
+    CHECK(fast_stream->rtp_protect != NULL);
+
+    CHECK_OK(srtp_dealloc(srtp_fast));
+    CHECK_OK(srtp_dealloc(srtp_generic));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    /* configurations without a specialized handler keep the generic path */
+    policy.ssrc.type = ssrc_specific;
+    policy.use_cryptex = true;
+    CHECK_OK(srtp_create(&srtp_fast, &policy));
+    CHECK(srtp_get_stream(srtp_fast, htonl(policy.ssrc.value))->rtp_protect ==
+          NULL);
+    CHECK_OK(srtp_dealloc(srtp_fast));
+
+    policy.use_cryptex = false;
+    srtp_crypto_policy_set_aes_cm_128_null_auth(&policy.rtp);
+    CHECK_OK(srtp_create(&srtp_fast, &policy));
+    CHECK(srtp_get_stream(srtp_fast, htonl(policy.ssrc.value))->rtp_protect ==
+          NULL);
+    CHECK_OK(srtp_dealloc(srtp_fast));
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_test_session_serialize(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.keys = test_keys;
+    policy.num_master_keys = 2;
+    policy.use_mki = true;
+    policy.mki_size = TEST_MKI_ID_SIZE;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    /* a session keeps no session keys unless it is made serializable */
+    srtp_t srtp_snd;
+    srtp_t srtp_recv;
+    size_t len = 0;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_RETURN(srtp_session_serialize(srtp_snd, NULL, &len),
+                 srtp_err_status_bad_param);
+    CHECK(srtp_get_stream(srtp_snd, htonl(policy.ssrc.value))
+              ->session_keys[0]
+              .derived == NULL);
+    CHECK_OK(srtp_dealloc(srtp_snd));
+
+    /* the receiver clones its stream from the template */
+    CHECK_OK(srtp_create(&srtp_snd, NULL));
+    CHECK_OK(srtp_set_serializable(srtp_snd, true));
+    CHECK_OK(srtp_stream_add(srtp_snd, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_create(&srtp_recv, NULL));
+    CHECK_OK(srtp_set_serializable(srtp_recv, true));
+    CHECK_OK(srtp_stream_add(srtp_recv, &policy));
+
+    uint8_t srtp[4][256];
+    size_t srtp_len[4];
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 1, 0, srtp[0],
+                              &srtp_len[0]));
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 2, 1, srtp[1],
+                              &srtp_len[1]));
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 3, 1, srtp[2],
+                              &srtp_len[2]));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[0], srtp_len[0]));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[1], srtp_len[1]));
+
+    /* the size can be queried first */
+    uint8_t *snd_state;
+    uint8_t *recv_state;
+    size_t snd_state_len = 0;
+    size_t recv_state_len = 0;
+    CHECK_OK(srtp_session_serialize(srtp_snd, NULL, &snd_state_len));
+    CHECK_OK(srtp_session_serialize(srtp_recv, NULL, &recv_state_len));
+    snd_state = (uint8_t *)malloc(snd_state_len);
+    recv_state = (uint8_t *)malloc(recv_state_len);
+    CHECK(snd_state != NULL && recv_state != NULL);
+
+    len = snd_state_len - 1;
+    CHECK_RETURN(srtp_session_serialize(srtp_snd, snd_state, &len),
+                 srtp_err_status_buffer_small);
+    CHECK(len == snd_state_len);
+    CHECK_OK(srtp_session_serialize(srtp_snd, snd_state, &snd_state_len));
+    CHECK_OK(srtp_session_serialize(srtp_recv, recv_state, &recv_state_len));
+
+    srtp_t srtp_snd_2;
+    srtp_t srtp_recv_2;
+    CHECK_OK(srtp_session_restore(&srtp_snd_2, snd_state, snd_state_len));
+    CHECK_OK(srtp_session_restore(&srtp_recv_2, recv_state, recv_state_len));
+
+    /* a restored session serializes to the same state */
+    uint8_t *state = (uint8_t *)malloc(recv_state_len);
+    CHECK(state != NULL);
+    len = recv_state_len;
+    CHECK_OK(srtp_session_serialize(srtp_recv_2, state, &len));
+    CHECK(len == recv_state_len);
+    CHECK_BUFFER_EQUAL(state, recv_state, len);
+    free(state);
+
+    /* the restored receiver keeps its replay window and its template */
+    CHECK_RETURN(unprotect_shared(srtp_recv_2, srtp[1], srtp_len[1]),
+                 srtp_err_status_replay_fail);
+    CHECK_OK(unprotect_shared(srtp_recv_2, srtp[2], srtp_len[2]));
+    srtp_t srtp_other;
+    srtp_policy_t other_policy = policy;
+    other_policy.ssrc.type = ssrc_specific;
+    other_policy.ssrc.value = 0xdeadbeef;
+    CHECK_OK(srtp_create(&srtp_other, &other_policy));
+    CHECK_OK(protect_with_mki(srtp_other, other_policy.ssrc.value, 1, 0,
+                              srtp[3], &srtp_len[3]));
+    CHECK_OK(unprotect_shared(srtp_recv_2, srtp[3], srtp_len[3]));
+    CHECK_OK(srtp_dealloc(srtp_other));
+
+    /* the restored sender continues where the original left off */
+    uint8_t ref[256];
+    size_t ref_len;
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 4, 1, ref,
+                              &ref_len));
+    CHECK_OK(protect_with_mki(srtp_snd_2, policy.ssrc.value, 4, 1, srtp[3],
+                              &srtp_len[3]));
+    CHECK(ref_len == srtp_len[3]);
+    CHECK_BUFFER_EQUAL(ref, srtp[3], ref_len);
+    CHECK_OK(unprotect_shared(srtp_recv_2, srtp[3], srtp_len[3]));
+
+    /* malformed state is rejected */
+    srtp_t srtp_bad;
+    CHECK_RETURN(srtp_session_restore(&srtp_bad, snd_state, snd_state_len - 1),
+                 srtp_err_status_parse_err);
+    CHECK(srtp_bad == NULL);
+    snd_state[0] ^= 0xff;
+    CHECK_RETURN(srtp_session_restore(&srtp_bad, snd_state, snd_state_len),
+                 srtp_err_status_parse_err);
+
+    free(snd_state);
+    free(recv_state);
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+    CHECK_OK(srtp_dealloc(srtp_snd_2));
+    CHECK_OK(srtp_dealloc(srtp_recv_2));
+
+    return srtp_err_status_ok;
+}
+
+srtp_err_status_t srtp_test_stream_store(void)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 0xcafebabe;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    /* two workers, each with its own session */
+    srtp_t worker_1;
+    srtp_t worker_2;
+    CHECK_OK(srtp_create(&worker_1, NULL));
+    CHECK_OK(srtp_set_serializable(worker_1, true));
+    CHECK_OK(srtp_stream_add(worker_1, &policy));
+    CHECK_OK(srtp_create(&worker_2, NULL));
+    CHECK_OK(srtp_set_serializable(worker_2, true));
+
+    size_t region_len = srtp_stream_store_size(4, 512);
+    void *region = malloc(region_len);
+    CHECK(region != NULL);
+    CHECK_OK(srtp_stream_store_init(region, 4, 512));
+
+    uint8_t srtp[2][256];
+    size_t srtp_len[2];
+    CHECK_OK(protect_with_mki(worker_1, policy.ssrc.value, 1, 0, srtp[0],
+                              &srtp_len[0]));
+
+    /* a stream that is not in the store cannot be taken */
+    CHECK_RETURN(
+        srtp_stream_store_take(region, worker_2, policy.ssrc.value, 2),
+        srtp_err_status_no_ctx);
+
+    /* the stream moves from one worker to the other */
+    CHECK_OK(srtp_stream_store_put(region, worker_1, policy.ssrc.value, 1));
+    CHECK(srtp_get_stream(worker_1, htonl(policy.ssrc.value)) == NULL);
+    CHECK_OK(srtp_stream_store_take(region, worker_2, policy.ssrc.value, 2));
+    CHECK(srtp_get_stream(worker_2, htonl(policy.ssrc.value)) != NULL);
+
+    /* ...and continues where it left off */
+    srtp_t srtp_ref;
+    uint8_t ref[256];
+    size_t ref_len;
+    CHECK_OK(srtp_create(&srtp_ref, &policy));
+    CHECK_OK(protect_with_mki(srtp_ref, policy.ssrc.value, 1, 0, ref,
+                              &ref_len));
+    CHECK_OK(protect_with_mki(srtp_ref, policy.ssrc.value, 2, 0, ref,
+                              &ref_len));
+    CHECK_OK(protect_with_mki(worker_2, policy.ssrc.value, 2, 0, srtp[1],
+                              &srtp_len[1]));
+    CHECK(ref_len == srtp_len[1]);
+    CHECK_BUFFER_EQUAL(ref, srtp[1], ref_len);
+    CHECK_OK(srtp_dealloc(srtp_ref));
+
+    /* a taken stream belongs to its owner until it is put back */
+    CHECK_RETURN(
+        srtp_stream_store_take(region, worker_1, policy.ssrc.value, 1),
+        srtp_err_status_no_ctx);
+    policy.key = test_key_2;
+    CHECK_OK(srtp_stream_add(worker_1, &policy));
+    CHECK_RETURN(srtp_stream_store_put(region, worker_1, policy.ssrc.value, 1),
+                 srtp_err_status_bad_param);
+    CHECK_OK(srtp_stream_remove(worker_1, policy.ssrc.value));
+    CHECK_OK(srtp_stream_store_put(region, worker_2, policy.ssrc.value, 2));
+    CHECK_OK(srtp_stream_store_take(region, worker_1, policy.ssrc.value, 1));
+
+    /* a receive stream keeps its replay window */
+    policy.key = test_key;
+    policy.ssrc.value = 0xdeadbeef;
+    srtp_t srtp_snd;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(srtp_stream_add(worker_2, &policy));
+    CHECK_OK(protect_with_mki(srtp_snd, policy.ssrc.value, 1, 0, srtp[0],
+                              &srtp_len[0]));
+    CHECK_OK(unprotect_shared(worker_2, srtp[0], srtp_len[0]));
+    CHECK_OK(srtp_stream_store_put(region, worker_2, policy.ssrc.value, 2));
+    CHECK_OK(srtp_stream_store_take(region, worker_1, policy.ssrc.value, 1));
+    CHECK_RETURN(unprotect_shared(worker_1, srtp[0], srtp_len[0]),
+                 srtp_err_status_replay_fail);
+
+    /* a stream that does not fit leaves the state in the store as it was */
+    CHECK_OK(srtp_stream_store_put(region, worker_1, policy.ssrc.value, 1));
+    policy.window_size = 8192;
+    CHECK_OK(srtp_stream_add(worker_2, &policy));
+    CHECK_RETURN(srtp_stream_store_put(region, worker_2, policy.ssrc.value, 2),
+                 srtp_err_status_buffer_small);
+    CHECK_OK(srtp_stream_remove(worker_2, policy.ssrc.value));
+    CHECK_OK(srtp_stream_store_take(region, worker_2, policy.ssrc.value, 2));
+    CHECK_RETURN(unprotect_shared(worker_2, srtp[0], srtp_len[0]),
+                 srtp_err_status_replay_fail);
+    CHECK_OK(srtp_dealloc(srtp_snd));
+
+    /* both streams are taken, so no keys are left in the store */
+    void *clean = malloc(region_len);
+    CHECK(clean != NULL);
+    CHECK_OK(srtp_stream_store_init(clean, 4, 512));
+    size_t num_diff = 0;
+    for (size_t i = 0; i < region_len; i++) {
+        if (((uint8_t *)region)[i] != ((uint8_t *)clean)[i]) {
+            num_diff++;
+        }
+    }
+    CHECK(num_diff <= 32); /* the owners, SSRCs and such of two slots */
+    free(clean);
+
+    free(region);
+    CHECK_OK(srtp_dealloc(worker_1));
+    CHECK_OK(srtp_dealloc(worker_2));
+#endif
+
+    return srtp_err_status_ok;
+}
+
+/*
+ * send_from(snd, recv, ssrc, seq) protects a packet from ssrc with snd and
+ * unprotects it with recv
+ */
+static srtp_err_status_t send_from(srtp_t snd,
+                                   srtp_t recv,
+                                   uint32_t ssrc,
+                                   uint16_t seq)
+{
+    uint8_t srtp[256];
+    size_t len;
+    srtp_err_status_t status;
+
+    status = protect_with_mki(snd, ssrc, seq, 0, srtp, &len);
+    if (status) {
+        return status;
+    }
+    return unprotect_shared(recv, srtp, len);
+}
+
+srtp_err_status_t srtp_test_expire_idle_streams(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_any_outbound;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    uint8_t srtp[256];
+    size_t len;
+    srtp_t srtp_snd;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    /* a stream added with its own policy is never removed */
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = 10;
+    CHECK_OK(srtp_stream_add(srtp_recv, &policy));
+
+    for (uint32_t ssrc = 1; ssrc <= 3; ssrc++) {
+        CHECK_OK(send_from(srtp_snd, srtp_recv, ssrc, 1));
+    }
+
+    /* streams used since the last call are kept */
+    CHECK_OK(srtp_expire_idle_streams(srtp_recv, 1000, 100));
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 1, 2));
+    CHECK_OK(srtp_expire_idle_streams(srtp_recv, 1050, 100));
+    for (uint32_t ssrc = 1; ssrc <= 3; ssrc++) {
+        CHECK(srtp_get_stream(srtp_recv, htonl(ssrc)) != NULL);
+    }
+
+    /* ...and the others go once they have been idle long enough */
+    CHECK_OK(srtp_expire_idle_streams(srtp_recv, 1100, 100));
+    CHECK(srtp_get_stream(srtp_recv, htonl(1)) != NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(2)) == NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(3)) == NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(10)) != NULL);
+
+    /* a removed stream is created again by its next packet */
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 2, 2));
+    CHECK(srtp_get_stream(srtp_recv, htonl(2)) != NULL);
+
+    /* at the limit the least recently used stream makes room */
+    CHECK_OK(srtp_set_max_streams(srtp_recv, 2));
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 3, 2));
+    CHECK(srtp_get_stream(srtp_recv, htonl(1)) == NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(2)) != NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(3)) != NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(10)) != NULL);
+
+    /* replacing the template keeps the order of use */
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_update(srtp_recv, &policy));
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 1, 3));
+    CHECK(srtp_get_stream(srtp_recv, htonl(1)) != NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(2)) == NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(3)) != NULL);
+
+    /* a packet that fails authentication does not count as use */
+    CHECK_OK(protect_with_mki(srtp_snd, 3, 3, 0, srtp, &len));
+    srtp[len - 1] ^= 0xff;
+    CHECK_RETURN(unprotect_shared(srtp_recv, srtp, len),
+                 srtp_err_status_auth_fail);
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 2, 3));
+    CHECK(srtp_get_stream(srtp_recv, htonl(1)) != NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(2)) != NULL);
+    CHECK(srtp_get_stream(srtp_recv, htonl(3)) == NULL);
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    return srtp_err_status_ok;
+}
+
+/* the number of srtp_crypto_alloc() calls while count_alloc is the hook */
+static size_t num_allocs;
+
+static void count_alloc(size_t size)
+{
+    (void)size;
+    num_allocs++;
+}
+
+srtp_err_status_t srtp_test_reserve_streams(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_any_outbound;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    uint8_t srtp[4][256];
+    size_t srtp_len[4];
+    srtp_t srtp_snd;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    for (uint32_t ssrc = 1; ssrc <= 4; ssrc++) {
+        CHECK_OK(protect_with_mki(srtp_snd, ssrc, 1, 0, srtp[ssrc - 1],
+                                  &srtp_len[ssrc - 1]));
+    }
+
+    CHECK_OK(srtp_reserve_streams(srtp_recv, 2));
+    CHECK_OK(srtp_set_no_packet_alloc(srtp_recv, true));
+
+    /* the spares serve two new SSRCs, and then there are none left */
+    num_allocs = 0;
+    srtp_crypto_set_alloc_hook(count_alloc);
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[0], srtp_len[0]));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[1], srtp_len[1]));
+    CHECK_RETURN(unprotect_shared(srtp_recv, srtp[2], srtp_len[2]),
+                 srtp_err_status_alloc_fail);
+    CHECK(srtp_get_stream(srtp_recv, htonl(3)) == NULL);
+
+    /* a removed stream is a spare again, ready for the next SSRC */
+    CHECK_OK(srtp_stream_remove(srtp_recv, 1));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[2], srtp_len[2]));
+    CHECK(srtp_get_stream(srtp_recv, htonl(3)) != NULL);
+    srtp_crypto_set_alloc_hook(NULL);
+    CHECK(num_allocs == 0);
+
+    /* ...and it starts with an empty replay window */
+    CHECK_OK(srtp_stream_remove(srtp_recv, 3));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[0], srtp_len[0]));
+
+    /* replacing the template clones the spares again */
+    CHECK_OK(srtp_stream_remove(srtp_recv, 1));
+    policy.window_size = 256;
+    CHECK_OK(srtp_update(srtp_recv, &policy));
+    num_allocs = 0;
+    srtp_crypto_set_alloc_hook(count_alloc);
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[2], srtp_len[2]));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[3], srtp_len[3]));
+    srtp_crypto_set_alloc_hook(NULL);
+    CHECK(num_allocs == 0);
+
+    /* without the flag a session allocates once the spares run out */
+    CHECK_OK(srtp_set_no_packet_alloc(srtp_recv, false));
+    CHECK_OK(unprotect_shared(srtp_recv, srtp[0], srtp_len[0]));
+
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
 
-    const struct test_vectors_t vectors[6] = {
-        { "Plaintext packet with 1-byte header extension", srtp_1bytehdrext_ref,
-          srtp_1bytehdrext_cryptex },
-        { "Plaintext packet with 2-byte header extension", srtp_2bytehdrext_ref,
-          srtp_2bytehdrext_cryptex },
-        { "Plaintext packet with 1-byte header extension and CSRC fields",
-          srtp_1bytehdrext_cc_ref, srtp_1bytehdrext_cc_cryptex },
-        { "Plaintext packet with 2-byte header extension and CSRC fields",
-          srtp_2bytehdrext_cc_ref, srtp_2bytehdrext_cc_cryptex },
-        { "Plaintext packet with empty 1-byte header extension and CSRC fields",
-          srtp_1byte_empty_hdrext_cc_ref, srtp_1byte_empty_hdrext_cc_cryptex },
-        { "Plaintext packet with empty 2-byte header extension and CSRC fields",
-          srtp_2byte_empty_hdrext_cc_ref, srtp_2byte_empty_hdrext_cc_cryptex },
-    };
-    const size_t num_vectors = sizeof(vectors) / sizeof(vectors[0]);
+    return srtp_err_status_ok;
+}
 
-    srtp_t srtp_snd, srtp_recv;
-    size_t len, ref_len, enc_len;
+srtp_err_status_t srtp_test_worker_pool(void)
+{
     srtp_policy_t policy;
-
-    /*
-     * create a session with a single stream using the default srtp
-     * policy and with the SSRC value 0xcafebabe
-     */
     memset(&policy, 0, sizeof(policy));
     srtp_crypto_policy_set_rtp_default(&policy.rtp);
     srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
-    policy.ssrc.type = ssrc_specific;
-    policy.ssrc.value = 0xcafebabe;
+    policy.ssrc.type = ssrc_any_outbound;
     policy.key = test_key;
     policy.window_size = 128;
-    policy.allow_repeat_tx = 0;
-    policy.use_cryptex = true;
     policy.next = NULL;
 
-    for (size_t i = 0; i < num_vectors; ++i) {
-        uint8_t packet[1400];
-        uint8_t reference[1400];
-        uint8_t ciphertext[1400];
+    srtp_worker_pool_t pool;
+    srtp_err_status_t status = srtp_worker_pool_create(&pool, 2, 8);
+    if (status == srtp_err_status_fail) {
+        /* built without threads */
+        CHECK(pool == NULL);
+        return srtp_err_status_ok;
+    }
+    CHECK_OK(status);
+
+    /* two senders, and a reference that protects the same packets */
+    srtp_t srtp_snd[2];
+    srtp_t srtp_ref;
+    CHECK_OK(srtp_create(&srtp_snd[0], &policy));
+    CHECK_OK(srtp_create(&srtp_snd[1], &policy));
+    CHECK_OK(srtp_create(&srtp_ref, &policy));
+    CHECK_OK(srtp_set_worker_pool(srtp_snd[0], pool));
+    CHECK_OK(srtp_set_worker_pool(srtp_snd[1], pool));
+
+    uint8_t rtp[8][64 + 12 + SRTP_MAX_TRAILER_LEN];
+    uint8_t srtp[8][64 + 12 + SRTP_MAX_TRAILER_LEN];
+    uint8_t ref[8][64 + 12 + SRTP_MAX_TRAILER_LEN];
+    size_t rtp_len;
+    size_t ref_len[8];
+    for (size_t i = 0; i < 8; i++) {
+        uint8_t *pkt = create_rtp_test_packet(64, (uint32_t)(i % 2 + 1),
+                                              (uint16_t)(i / 2 + 1), 1, false,
+                                              &rtp_len, NULL);
+        memcpy(rtp[i], pkt, rtp_len);
+        free(pkt);
+        ref_len[i] = sizeof(ref[i]);
+        CHECK_OK(srtp_protect(srtp_ref, rtp[i], rtp_len, ref[i], &ref_len[i],
+                              0));
+    }
 
-        /* Initialize reference test vectors */
-        ref_len = hex_string_to_octet_string(reference, vectors[i].plaintext,
-                                             sizeof(reference)) /
-                  2;
-        enc_len = hex_string_to_octet_string(ciphertext, vectors[i].ciphertext,
-                                             sizeof(ciphertext)) /
-                  2;
+    /* the jobs of a session complete in the order they were submitted */
+    for (size_t i = 0; i < 8; i++) {
+        CHECK_OK(srtp_protect_async(srtp_snd[i % 2], rtp[i], rtp_len, srtp[i],
+                                    sizeof(srtp[i]), 0, &rtp[i]));
+    }
+    CHECK_RETURN(srtp_protect_async(srtp_snd[0], rtp[0], rtp_len, srtp[0],
+                                    sizeof(srtp[0]), 0, NULL),
+                 srtp_err_status_alloc_fail);
 
-        /* Initialize test packet */
-        len = ref_len;
-        memcpy(packet, reference, len);
-        printf("%s\n", vectors[i].name);
-        /*
-         * protect plaintext, then compare with ciphertext
-         */
-        debug_print(mod_driver, "test vector: %s\n", vectors[i].name);
+    srtp_completion_t completions[8];
+    size_t next[2] = { 0, 1 };
+    size_t done = 0;
+    while (done < 8) {
+        size_t num_completions = 8;
+        CHECK_OK(
+            srtp_poll_completions(pool, completions, &num_completions, true));
+        CHECK(num_completions > 0);
+        for (size_t j = 0; j < num_completions; j++) {
+            srtp_completion_t *c = &completions[j];
+            size_t s = c->session == srtp_snd[0] ? 0 : 1;
+            size_t i = next[s];
+            CHECK(c->session == srtp_snd[s]);
+            CHECK(c->user_data == &rtp[i]);
+            CHECK_OK(c->status);
+            CHECK(c->packet == srtp[i]);
+            CHECK(c->len == ref_len[i]);
+            CHECK(memcmp(srtp[i], ref[i], ref_len[i]) == 0);
+            next[s] += 2;
+        }
+        done += num_completions;
+    }
 
-        CHECK_OK(srtp_create(&srtp_snd, &policy));
+    /* nothing is left, so polling does not block */
+    size_t num_completions = 8;
+    CHECK_OK(srtp_poll_completions(pool, completions, &num_completions, true));
+    CHECK(num_completions == 0);
 
-        CHECK_OK(call_srtp_protect(srtp_snd, packet, &len, 0));
-        CHECK(len == enc_len);
+    /* a receiver unprotects them in place, replay checks included */
+    policy.ssrc.type = ssrc_any_inbound;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+    CHECK_OK(srtp_set_worker_pool(srtp_recv, pool));
+    for (size_t i = 0; i < 8; i++) {
+        CHECK_OK(srtp_unprotect_async(srtp_recv, srtp[i], ref_len[i], srtp[i],
+                                      sizeof(srtp[i]), NULL));
+    }
+    done = 0;
+    while (done < 8) {
+        num_completions = 8;
+        CHECK_OK(
+            srtp_poll_completions(pool, completions, &num_completions, true));
+        for (size_t j = 0; j < num_completions; j++) {
+            size_t i = (size_t)(completions[j].packet - srtp[0]) /
+                       sizeof(srtp[0]);
+            CHECK_OK(completions[j].status);
+            CHECK(completions[j].len == rtp_len);
+            CHECK(memcmp(srtp[i], rtp[i], rtp_len) == 0);
+        }
+        done += num_completions;
+    }
+    CHECK_OK(srtp_unprotect_async(srtp_recv, ref[0], ref_len[0], srtp[0],
+                                  sizeof(srtp[0]), NULL));
+    num_completions = 1;
+    CHECK_OK(srtp_poll_completions(pool, completions, &num_completions, true));
+    CHECK(num_completions == 1);
+    CHECK(completions[0].status == srtp_err_status_replay_fail);
+    CHECK(completions[0].len == 0);
+
+    /* the pool outlives the sessions that use it */
+    CHECK_RETURN(srtp_worker_pool_dealloc(pool), srtp_err_status_fail);
+    CHECK_OK(srtp_set_worker_pool(srtp_snd[0], NULL));
+    CHECK_RETURN(srtp_protect_async(srtp_snd[0], rtp[0], rtp_len, srtp[0],
+                                    sizeof(srtp[0]), 0, NULL),
+                 srtp_err_status_bad_param);
+    CHECK_OK(srtp_dealloc(srtp_snd[0]));
+    CHECK_OK(srtp_dealloc(srtp_snd[1]));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+    CHECK_OK(srtp_dealloc(srtp_ref));
+    CHECK_OK(srtp_worker_pool_dealloc(pool));
 
-        debug_print(mod_driver, "ciphertext:\n  %s",
-                    octet_string_hex_string(packet, len));
-        debug_print(mod_driver, "ciphertext reference:\n  %s",
-                    octet_string_hex_string(ciphertext, len));
+    return srtp_err_status_ok;
+}
 
-        CHECK_BUFFER_EQUAL(packet, ciphertext, len);
+/*
+ * The packets of one stream are encrypted and authenticated in parallel
+ * but accepted in order: a burst protected by a pool with several workers
+ * matches srtp_protect(), a packet received twice in one burst is only
+ * accepted once, and a forged packet or one of an unknown stream fails
+ * without affecting the others.  Completions that are not collected when
+ * the session is freed no longer point to it.
+ */
+#define POOL_STREAM_PACKETS 48
 
-        CHECK_OK(srtp_dealloc(srtp_snd));
+srtp_err_status_t srtp_test_worker_pool_stream(void)
+{
+    const uint32_t ssrc = 0xcafebabe;
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = ssrc;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
 
-        CHECK_OK(srtp_create(&srtp_recv, &policy));
+    srtp_worker_pool_t pool;
+    srtp_err_status_t status =
+        srtp_worker_pool_create(&pool, 4, POOL_STREAM_PACKETS + 4);
+    if (status == srtp_err_status_fail) {
+        /* built without threads */
+        return srtp_err_status_ok;
+    }
+    CHECK_OK(status);
 
-        /*
-         * unprotect ciphertext, then compare with plaintext
-         */
-        CHECK_OK(call_srtp_unprotect(srtp_recv, packet, &len));
-        CHECK(len == ref_len);
+    srtp_t srtp_snd;
+    srtp_t srtp_ref;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(srtp_create(&srtp_ref, &policy));
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+    CHECK_OK(srtp_set_worker_pool(srtp_snd, pool));
+    CHECK_OK(srtp_set_worker_pool(srtp_recv, pool));
+
+    static uint8_t rtp[POOL_STREAM_PACKETS][160 + 12 + SRTP_MAX_TRAILER_LEN];
+    static uint8_t ref[POOL_STREAM_PACKETS][160 + 12 + SRTP_MAX_TRAILER_LEN];
+    static uint8_t srtp[POOL_STREAM_PACKETS + 3]
+                       [160 + 12 + SRTP_MAX_TRAILER_LEN];
+    size_t rtp_len;
+    size_t ref_len[POOL_STREAM_PACKETS];
+    for (size_t i = 0; i < POOL_STREAM_PACKETS; i++) {
+        uint8_t *pkt = create_rtp_test_packet(
+            160, ssrc, (uint16_t)(0xfff0 + i), (uint32_t)i, false, &rtp_len,
+            NULL);
+        memcpy(rtp[i], pkt, rtp_len);
+        free(pkt);
+        ref_len[i] = sizeof(ref[i]);
+        CHECK_OK(srtp_protect(srtp_ref, rtp[i], rtp_len, ref[i], &ref_len[i],
+                              0));
+    }
 
-        CHECK_BUFFER_EQUAL(packet, reference, len);
+    /* a burst across a ROC change is protected as by srtp_protect() */
+    for (size_t i = 0; i < POOL_STREAM_PACKETS; i++) {
+        CHECK_OK(srtp_protect_async(srtp_snd, rtp[i], rtp_len, srtp[i],
+                                    sizeof(srtp[i]), 0, srtp[i]));
+    }
+    srtp_completion_t completions[POOL_STREAM_PACKETS + 3];
+    size_t done = 0;
+    while (done < POOL_STREAM_PACKETS) {
+        size_t num_completions = POOL_STREAM_PACKETS - done;
+        CHECK_OK(srtp_poll_completions(pool, completions + done,
+                                       &num_completions, true));
+        done += num_completions;
+    }
+    for (size_t i = 0; i < POOL_STREAM_PACKETS; i++) {
+        CHECK(completions[i].session == srtp_snd);
+        CHECK(completions[i].user_data == srtp[i]);
+        CHECK_OK(completions[i].status);
+        CHECK(completions[i].len == ref_len[i]);
+        CHECK_BUFFER_EQUAL(srtp[i], ref[i], ref_len[i]);
+    }
 
-        CHECK_OK(srtp_dealloc(srtp_recv));
+    /*
+     * receive them in place with packet 10 twice, a forged copy of packet
+     * 20 before it and a packet of an unknown stream in the burst
+     */
+    size_t order[POOL_STREAM_PACKETS + 3];
+    srtp_err_status_t expected[POOL_STREAM_PACKETS + 3];
+    size_t n = 0;
+    for (size_t i = 0; i < POOL_STREAM_PACKETS; i++) {
+        if (i == 20) {
+            order[n] = i;
+            expected[n++] = srtp_err_status_auth_fail;
+        }
+        order[n] = i;
+        expected[n++] = srtp_err_status_ok;
+        if (i == 10) {
+            order[n] = i;
+            expected[n++] = srtp_err_status_replay_fail;
+        } else if (i == 30) {
+            order[n] = i;
+            expected[n++] = srtp_err_status_no_ctx;
+        }
+    }
+    for (size_t k = 0; k < n; k++) {
+        size_t i = order[k];
+        memcpy(srtp[k], ref[i], ref_len[i]);
+        if (expected[k] == srtp_err_status_auth_fail) {
+            srtp[k][ref_len[i] - 1] ^= 1;
+        } else if (expected[k] == srtp_err_status_no_ctx) {
+            srtp[k][8] ^= 0xff;
+        }
+        CHECK_OK(srtp_unprotect_async(srtp_recv, srtp[k], ref_len[i],
+                                      srtp[k], sizeof(srtp[k]), srtp[k]));
+    }
+    done = 0;
+    while (done < n) {
+        size_t num_completions = n - done;
+        CHECK_OK(srtp_poll_completions(pool, completions + done,
+                                       &num_completions, true));
+        done += num_completions;
+    }
+    for (size_t k = 0; k < n; k++) {
+        size_t i = order[k];
+        CHECK(completions[k].user_data == srtp[k]);
+        CHECK_RETURN(completions[k].status, expected[k]);
+        if (expected[k] == srtp_err_status_ok) {
+            CHECK(completions[k].len == rtp_len);
+            CHECK_BUFFER_EQUAL(srtp[k], rtp[i], rtp_len);
+        } else {
+            CHECK(completions[k].len == 0);
+            /* a rejected packet is not left decrypted */
+            CHECK(memcmp(srtp[k] + 12, rtp[i] + 12, 160) != 0);
+        }
+    }
+
+    /* completions of a freed session have no session */
+    for (size_t i = 0; i < 4; i++) {
+        memcpy(srtp[i], rtp[i], rtp_len);
+        srtp[i][2] = 0x01; /* a sequence number not sent yet */
+        CHECK_OK(srtp_protect_async(srtp_snd, srtp[i], rtp_len, srtp[i],
+                                    sizeof(srtp[i]), 0, srtp[i]));
+    }
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    size_t num_completions = 4;
+    CHECK_OK(srtp_poll_completions(pool, completions, &num_completions,
+                                   false));
+    CHECK(num_completions == 4);
+    for (size_t i = 0; i < 4; i++) {
+        CHECK(completions[i].session == NULL);
+        CHECK(completions[i].user_data == srtp[i]);
+        CHECK_OK(completions[i].status);
     }
 
+    CHECK_OK(srtp_dealloc(srtp_recv));
+    CHECK_OK(srtp_dealloc(srtp_ref));
+    CHECK_OK(srtp_worker_pool_dealloc(pool));
+
     return srtp_err_status_ok;
 }
 
-srtp_err_status_t srtp_test_cryptex_csrc_but_no_extension_header(void)
+/*
+ * Header extension elements are encrypted a run at a time; a run ends at
+ * padding or when the keystream buffer is full.  Build a two-byte header
+ * extension that needs several runs and check that exactly the data of
+ * the encrypted elements changes.
+ */
+srtp_err_status_t srtp_test_encrypted_extensions_headers_runs(void)
 {
-    // clang-format off
-    /* Plaintext packet with no header extension but CSRC fields. */
-    const char *srtp_cc_ref =
-        "820f1238"
-        "decafbad"
-        "cafebabe"
-        "0001e240"
-        "0000b26e"
-        "abababab"
-        "abababab"
-        "abababab"
-        "abababab";
-    // clang-format on
+    /* id, data length, padding after */
+    const size_t elements[][3] = {
+        { 1, 255, 0 }, { 2, 200, 0 }, { 1, 255, 3 }, { 3, 10, 0 },
+        { 4, 0, 1 },   { 1, 17, 0 },  { 2, 31, 0 },
+    };
+    uint8_t headers[] = { 1, 4 };
+    uint8_t packet[1200 + SRTP_MAX_TRAILER_LEN];
+    uint8_t plaintext[1200];
+    size_t xtn_len = 0;
+    size_t len;
+    size_t pos;
+    size_t i;
+
+    for (i = 0; i < sizeof(elements) / sizeof(elements[0]); i++) {
+        xtn_len += 2 + elements[i][1] + elements[i][2];
+    }
+    xtn_len = (xtn_len + 3) & ~(size_t)3;
+
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x90;
+    packet[1] = 0x0f;
+    packet[3] = 0x01;
+    packet[8] = 0xca;
+    packet[9] = 0xfe;
+    packet[10] = 0xba;
+    packet[11] = 0xbe;
+    packet[12] = 0x10;
+    packet[14] = (uint8_t)((xtn_len / 4) >> 8);
+    packet[15] = (uint8_t)(xtn_len / 4);
+    pos = 16;
+    for (i = 0; i < sizeof(elements) / sizeof(elements[0]); i++) {
+        packet[pos++] = (uint8_t)elements[i][0];
+        packet[pos++] = (uint8_t)elements[i][1];
+        memset(packet + pos, 0xab, elements[i][1]);
+        pos += elements[i][1] + elements[i][2];
+    }
+    len = 16 + xtn_len + 32;
+    memset(packet + 16 + xtn_len, 0xcd, 32);
+    memcpy(plaintext, packet, len);
 
-    /*
-     * create a session with a single stream using the default srtp
-     * policy and with the SSRC value 0xcafebabe
-     */
     srtp_policy_t policy;
     memset(&policy, 0, sizeof(policy));
     srtp_crypto_policy_set_rtp_default(&policy.rtp);
@@ -3248,26 +5917,346 @@ srtp_err_status_t srtp_test_cryptex_csrc_but_no_extension_header(void)
     policy.ssrc.value = 0xcafebabe;
     policy.key = test_key;
     policy.window_size = 128;
-    policy.allow_repeat_tx = 0;
-    policy.use_cryptex = true;
+    policy.enc_xtn_hdr = headers;
+    policy.enc_xtn_hdr_count = sizeof(headers) / sizeof(headers[0]);
     policy.next = NULL;
 
     srtp_t srtp_snd;
+    srtp_t srtp_recv;
     CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(srtp_create(&srtp_recv, &policy));
+
+    size_t srtp_len = len;
+    CHECK_OK(call_srtp_protect(srtp_snd, packet, &srtp_len, 0));
+
+    pos = 16;
+    for (i = 0; i < sizeof(elements) / sizeof(elements[0]); i++) {
+        size_t xlen = elements[i][1];
+        CHECK_BUFFER_EQUAL(packet + pos, plaintext + pos, 2);
+        pos += 2;
+        if (elements[i][0] == 1) {
+            CHECK(memcmp(packet + pos, plaintext + pos, xlen) != 0);
+        } else {
+            CHECK_BUFFER_EQUAL(packet + pos, plaintext + pos, xlen);
+        }
+        pos += xlen;
+        CHECK_BUFFER_EQUAL(packet + pos, plaintext + pos, elements[i][2]);
+        pos += elements[i][2];
+    }
 
-    uint8_t packet[1400];
-    size_t packet_len =
-        hex_string_to_octet_string(packet, srtp_cc_ref, sizeof(packet)) / 2;
+    CHECK_OK(call_srtp_unprotect(srtp_recv, packet, &srtp_len));
+    CHECK(srtp_len == len);
+    CHECK_BUFFER_EQUAL(packet, plaintext, len);
 
-    CHECK_RETURN(call_srtp_protect(srtp_snd, packet, &packet_len, 0),
-                 srtp_err_status_cryptex_err);
+    CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    return srtp_err_status_ok;
+}
+
+static size_t handled_events;
+static srtp_event_data_t last_handled_event;
+
+static void count_events(srtp_event_data_t *data)
+{
+    handled_events++;
+    last_handled_event = *data;
+}
 
+srtp_err_status_t srtp_test_event_queue(void)
+{
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+    policy.ssrc.type = ssrc_any_outbound;
+    policy.key = test_key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    srtp_t srtp_snd;
+    srtp_t srtp_recv;
+    CHECK_OK(srtp_create(&srtp_snd, &policy));
+    CHECK_OK(srtp_create(&srtp_recv, NULL));
+
+    /*
+     * streams that have protected a packet report an SSRC collision for
+     * every packet they unprotect
+     */
+    uint8_t srtp[256];
+    size_t len;
+    policy.ssrc.type = ssrc_specific;
+    for (uint32_t ssrc = 1; ssrc <= 3; ssrc++) {
+        policy.ssrc.value = ssrc;
+        CHECK_OK(srtp_stream_add(srtp_recv, &policy));
+        CHECK_OK(protect_with_mki(srtp_recv, ssrc, 10, 0, srtp, &len));
+    }
+
+    handled_events = 0;
+    CHECK_OK(srtp_install_event_handler(count_events));
+    CHECK_OK(srtp_set_event_queue(srtp_recv, 2));
+
+    /* repeated events of a stream are queued once, the rest are dropped */
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 1, 1));
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 1, 2));
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 2, 1));
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 3, 1));
+    CHECK(handled_events == 0);
+
+    srtp_event_data_t events[4];
+    size_t num_events = 4;
+    CHECK_OK(srtp_poll_events(srtp_recv, events, &num_events));
+    CHECK(num_events == 2);
+    CHECK(events[0].session == srtp_recv);
+    CHECK(events[0].ssrc == 1);
+    CHECK(events[0].event == event_ssrc_collision);
+    CHECK(events[1].ssrc == 2);
+
+    num_events = 4;
+    CHECK_OK(srtp_poll_events(srtp_recv, events, &num_events));
+    CHECK(num_events == 0);
+
+    /* once read, the event is queued again */
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 1, 3));
+    CHECK_OK(srtp_dispatch_events(srtp_recv));
+    CHECK(handled_events == 1);
+    CHECK(last_handled_event.ssrc == 1);
+
+    /* without the queue the handler is called from the data path */
+    CHECK_OK(srtp_set_event_queue(srtp_recv, 0));
+    CHECK_OK(send_from(srtp_snd, srtp_recv, 2, 2));
+    CHECK(handled_events == 2);
+    CHECK(last_handled_event.ssrc == 2);
+    CHECK_RETURN(srtp_poll_events(srtp_recv, events, &num_events),
+                 srtp_err_status_bad_param);
+
+    CHECK_OK(srtp_install_event_handler(NULL));
     CHECK_OK(srtp_dealloc(srtp_snd));
+    CHECK_OK(srtp_dealloc(srtp_recv));
+
+    return srtp_err_status_ok;
+}
+
+static size_t logged_messages;
+static char logged_message[4][256];
+
+static void capture_log(srtp_log_level_t level, const char *msg, void *data)
+{
+    (void)level;
+    (void)data;
+    if (logged_messages < 4) {
+        snprintf(logged_message[logged_messages],
+                 sizeof(logged_message[logged_messages]), "%s", msg);
+    }
+    logged_messages++;
+}
+
+srtp_err_status_t srtp_test_deferred_log(void)
+{
+    char name[16] = "first";
+    size_t num_records;
+    uint64_t rate_limited;
+    uint64_t queue_full;
+
+    logged_messages = 0;
+    mod_driver.on = true;
+    CHECK_OK(srtp_install_log_handler(capture_log, NULL));
+    CHECK_OK(srtp_set_log_deferred(16, 0));
+
+    /* nothing is formatted until the log is flushed */
+    debug_print2(mod_driver, "ssrc 0x%08x seq %u", 0xcafebabe, 7u);
+    debug_print(mod_driver, "name %s", name);
+    debug_print(mod_driver, "size %zu", (size_t)1234);
+    debug_print(mod_driver, "ratio %.2f", 0.5);
+    strcpy(name, "second");
+    CHECK(logged_messages == 0);
+
+    CHECK_OK(srtp_flush_log(&num_records));
+    CHECK(num_records == 4);
+    CHECK(logged_messages == 4);
+    CHECK(strcmp(logged_message[0], "driver: ssrc 0xcafebabe seq 7") == 0);
+    CHECK(strcmp(logged_message[1], "driver: name first") == 0);
+    CHECK(strcmp(logged_message[2], "driver: size 1234") == 0);
+    CHECK(strcmp(logged_message[3], "driver: ratio 0.50") == 0);
+
+    /* string arguments share a buffer; the ones that do not fit are cut */
+    char long_a[200];
+    char long_b[100];
+    memset(long_a, 'a', sizeof(long_a) - 1);
+    long_a[sizeof(long_a) - 1] = '\0';
+    memset(long_b, 'b', sizeof(long_b) - 1);
+    long_b[sizeof(long_b) - 1] = '\0';
+    logged_messages = 0;
+    srtp_err_report(srtp_err_level_error, "%s|%s|%s", long_a, "x", "y");
+    srtp_err_report(srtp_err_level_error, "%s|%s|%s", long_b, long_b, "z");
+    CHECK_OK(srtp_flush_log(&num_records));
+    CHECK(num_records == 2);
+    CHECK(logged_messages == 2);
+    CHECK(strlen(logged_message[0]) == 127 + 2);
+    CHECK(strspn(logged_message[0], "a") == 127);
+    CHECK(strcmp(logged_message[0] + 127, "||") == 0);
+    CHECK(strlen(logged_message[1]) == 99 + 1 + 27 + 1);
+    CHECK(strspn(logged_message[1], "b") == 99);
+    CHECK(strspn(logged_message[1] + 100, "b") == 27);
+    CHECK(strcmp(logged_message[1] + 127, "|") == 0);
+
+    /* a module that logs too much is cut off */
+    CHECK_OK(srtp_set_log_deferred(16, 3));
+    for (int i = 0; i < 10; i++) {
+        debug_print(mod_driver, "message %d", i);
+    }
+    CHECK_OK(srtp_flush_log(&num_records));
+    CHECK_OK(srtp_get_log_drops("driver", &rate_limited, &queue_full));
+    /* the loop may straddle two seconds */
+    CHECK(num_records >= 3 && num_records <= 6);
+    CHECK(num_records + rate_limited == 10);
+    CHECK(queue_full == 0);
+
+    /* and so is one that fills the ring */
+    CHECK_OK(srtp_set_log_deferred(4, 0));
+    for (int i = 0; i < 6; i++) {
+        debug_print(mod_driver, "message %d", i);
+    }
+    CHECK_OK(srtp_flush_log(&num_records));
+    CHECK(num_records == 4);
+    CHECK_OK(srtp_get_log_drops("driver", &rate_limited, &queue_full));
+    CHECK(rate_limited == 0);
+    CHECK(queue_full == 2);
+
+    CHECK_OK(srtp_set_log_deferred(0, 0));
+    CHECK_RETURN(srtp_flush_log(&num_records), srtp_err_status_bad_param);
+    mod_driver.on = false;
+    CHECK_OK(srtp_install_log_handler(NULL, NULL));
 
     return srtp_err_status_ok;
 }
 
 #ifdef GCM
+/*
+ * a packet goes from a sender to a receiver that share a double policy,
+ * through a media distributor that only has the hop-by-hop key and changes
+ * the header fields it is allowed to
+ */
+srtp_err_status_t srtp_test_double_encryption(void)
+{
+    const srtp_profile_t profile =
+        srtp_profile_double_aead_aes_128_gcm_aead_aes_128_gcm;
+    const size_t payload_len = 40;
+    uint8_t key[56]; /* K_inner || K_outer || S_inner || S_outer */
+    uint8_t outer_key[28];
+    for (size_t i = 0; i < sizeof(key); i++) {
+        key[i] = (uint8_t)(i + 1);
+    }
+    memcpy(outer_key, key + 16, 16);
+    memcpy(outer_key + 16, key + 44, 12);
+    CHECK(srtp_profile_get_master_key_length(profile) +
+              srtp_profile_get_master_salt_length(profile) ==
+          sizeof(key));
+
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    CHECK_OK(srtp_crypto_policy_set_from_profile_for_rtp(&policy.rtp, profile));
+    CHECK_OK(
+        srtp_crypto_policy_set_from_profile_for_rtcp(&policy.rtcp, profile));
+    policy.ssrc.type = ssrc_any_outbound;
+    policy.key = key;
+    policy.window_size = 128;
+    policy.next = NULL;
+
+    srtp_t sender, receiver, sfu_in, sfu_out;
+    CHECK_OK(srtp_create(&sender, &policy));
+    policy.ssrc.type = ssrc_any_inbound;
+    CHECK_OK(srtp_create(&receiver, &policy));
+
+    /* the inner layer would not cover what cryptex hides */
+    policy.use_cryptex = true;
+    CHECK_RETURN(srtp_create(&sfu_in, &policy), srtp_err_status_bad_param);
+    policy.use_cryptex = false;
+
+    size_t trailer_len;
+    CHECK_OK(srtp_get_protect_trailer_length(sender, 0, &trailer_len));
+    CHECK(trailer_len == 16 + 16 + 1);
+
+    srtp_policy_t sfu_policy = policy;
+    CHECK_OK(srtp_crypto_policy_set_from_profile_for_rtp(
+        &sfu_policy.rtp, srtp_profile_aead_aes_128_gcm));
+    CHECK_OK(srtp_crypto_policy_set_from_profile_for_rtcp(
+        &sfu_policy.rtcp, srtp_profile_aead_aes_128_gcm));
+    sfu_policy.key = outer_key;
+    CHECK_OK(srtp_create(&sfu_in, &sfu_policy));
+    sfu_policy.ssrc.type = ssrc_any_outbound;
+    CHECK_OK(srtp_create(&sfu_out, &sfu_policy));
+
+    for (uint16_t seq = 1; seq <= 4; seq++) {
+        size_t len, orig_len, rtp_len, new_len;
+        uint8_t *pkt = create_rtp_test_packet(payload_len, 0xcafebabe, seq,
+                                              seq, seq == 2, &len, NULL);
+        uint8_t *orig = create_rtp_test_packet(payload_len, 0xcafebabe, seq,
+                                               seq, seq == 2, &orig_len, NULL);
+        size_t hdr_len = orig_len - payload_len;
+        ((srtp_hdr_t *)pkt)->m = seq == 1;
+        ((srtp_hdr_t *)orig)->m = seq == 1;
+
+        CHECK_OK(call_srtp_protect(sender, pkt, &len, 0));
+        CHECK(len == orig_len + trailer_len);
+
+        /* the distributor sees the header, but not the payload */
+        rtp_len = len;
+        CHECK_OK(srtp_unprotect_outer(sfu_in, pkt, len, pkt, &rtp_len));
+        CHECK(rtp_len == len - 16);
+        CHECK_BUFFER_EQUAL(pkt, orig, hdr_len);
+        CHECK(memcmp(pkt + hdr_len, orig + hdr_len, payload_len) != 0);
+
+        /* the OHB keeps the first value of each field that changes */
+        new_len = rtp_len + SRTP_MAX_TRAILER_LEN;
+        CHECK_OK(srtp_double_rewrite_header(pkt, rtp_len, &new_len, 96,
+                                            (uint16_t)(seq + 1000), false));
+        CHECK(new_len == rtp_len + 3);
+        rtp_len = new_len;
+        new_len = rtp_len + SRTP_MAX_TRAILER_LEN;
+        CHECK_OK(srtp_double_rewrite_header(pkt, rtp_len, &new_len, 97,
+                                            (uint16_t)(seq + 2000), true));
+        CHECK(new_len == rtp_len);
+        CHECK(((srtp_hdr_t *)pkt)->pt == 97);
+
+        if (seq == 4) {
+            pkt[hdr_len] ^= 0x01;
+        }
+        len = rtp_len + SRTP_MAX_TRAILER_LEN;
+        CHECK_OK(srtp_protect_outer(sfu_out, pkt, rtp_len, pkt, &len, 0));
+
+        /* the receiver gets the packet as it was sent */
+        if (seq == 4) {
+            CHECK_RETURN(call_srtp_unprotect(receiver, pkt, &len),
+                         srtp_err_status_auth_fail);
+        } else {
+            CHECK_OK(call_srtp_unprotect(receiver, pkt, &len));
+            CHECK(len == orig_len);
+            CHECK_BUFFER_EQUAL(pkt, orig, orig_len);
+        }
+
+        free(pkt);
+        free(orig);
+    }
+
+    /* a packet without an OHB is not forwarded */
+    size_t len;
+    uint8_t *pkt = create_rtp_test_packet(payload_len, 0xcafebabe, 5, 5, false,
+                                          &len, NULL);
+    pkt[len - 1] = 0x10;
+    size_t srtp_len = len + SRTP_MAX_TRAILER_LEN;
+    CHECK_RETURN(srtp_protect_outer(sfu_out, pkt, len, pkt, &srtp_len, 0),
+                 srtp_err_status_parse_err);
+    free(pkt);
+
+    CHECK_OK(srtp_dealloc(sender));
+    CHECK_OK(srtp_dealloc(receiver));
+    CHECK_OK(srtp_dealloc(sfu_in));
+    CHECK_OK(srtp_dealloc(sfu_out));
+
+    return srtp_err_status_ok;
+}
+
 /*
  * srtp_validate_gcm() verifies the correctness of libsrtp by comparing
  * an computed packet against the known ciphertext for the plaintext.
@@ -3688,14 +6677,6 @@ srtp_err_status_t srtp_validate_gcm_cryptex(void)
          */
         debug_print(mod_driver, "test vector: %s\n", vectors[i].name);
 
-        const srtp_hdr_t *hdr = (const srtp_hdr_t *)reference;
-        if (use_srtp_not_in_place_io_api && hdr->cc) {
-            // the combination of cryptex, cc, GCM & not inplace is not
-            // supported
-            CHECK_RETURN(call_srtp_protect(srtp_snd, packet, &len, 0),
-                         srtp_err_status_cryptex_err);
-            continue;
-        }
         CHECK_OK(call_srtp_protect(srtp_snd, packet, &len, 0));
         CHECK(len == enc_len);
 
@@ -4383,11 +7364,18 @@ srtp_err_status_t srtp_test_remove_stream(void)
     if (status != srtp_err_status_ok) {
         return status;
     }
+    if (session->kdf_cache == NULL) {
+        return srtp_err_status_fail;
+    }
 
+    /* the keys derived for the stream go with it */
     status = srtp_stream_remove(session, 0xcafebabe);
     if (status != srtp_err_status_ok) {
         return status;
     }
+    if (session->kdf_cache != NULL) {
+        return srtp_err_status_fail;
+    }
 
     status = srtp_dealloc(session);
     if (status != srtp_err_status_ok) {
@@ -5695,7 +8683,8 @@ const srtp_policy_t default_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 const srtp_policy_t aes_only_policy = {
@@ -5726,7 +8715,8 @@ const srtp_policy_t aes_only_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 const srtp_policy_t hmac_only_policy = {
@@ -5757,7 +8747,8 @@ const srtp_policy_t hmac_only_policy = {
     NULL,             /* no encrypted extension headers                   */
     0,                /* list of encrypted extension headers is empty     */
     false,            /* cryptex                                          */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 #ifdef GCM
@@ -5791,7 +8782,8 @@ const srtp_policy_t aes128_gcm_8_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 const srtp_policy_t aes128_gcm_8_cauth_policy = {
@@ -5824,7 +8816,8 @@ const srtp_policy_t aes128_gcm_8_cauth_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 const srtp_policy_t aes256_gcm_8_policy = {
@@ -5857,7 +8850,8 @@ const srtp_policy_t aes256_gcm_8_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 const srtp_policy_t aes256_gcm_8_cauth_policy = {
@@ -5890,7 +8884,8 @@ const srtp_policy_t aes256_gcm_8_cauth_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 #endif
 
@@ -5922,7 +8917,8 @@ const srtp_policy_t null_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 // clang-format off
@@ -5991,7 +8987,8 @@ const srtp_policy_t aes_256_hmac_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 const srtp_policy_t aes_256_hmac_32_policy = {
@@ -6025,7 +9022,8 @@ const srtp_policy_t aes_256_hmac_32_policy = {
     NULL,             /* no encrypted extension headers               */
     0,                /* list of encrypted extension headers is empty */
     false,            /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 const srtp_policy_t hmac_only_with_no_master_key = {
@@ -6056,7 +9054,8 @@ const srtp_policy_t hmac_only_with_no_master_key = {
     NULL,  /* no encrypted extension headers               */
     0,     /* list of encrypted extension headers is empty */
     false, /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 /*
@@ -6124,7 +9123,8 @@ const srtp_policy_t wildcard_policy = {
     NULL,  /* no encrypted extension headers               */
     0,     /* list of encrypted extension headers is empty */
     false, /* cryptex                                      */
-    NULL
+    NULL,
+    128 /* SRTCP replay window size */
 };
 
 static srtp_stream_t stream_list_test_create_stream(uint32_t ssrc)
@@ -6324,6 +9324,16 @@ srtp_err_status_t srtp_stream_list_insert(srtp_stream_list_t list,
     return srtp_err_status_ok;
 }
 
+srtp_err_status_t srtp_stream_list_reserve(srtp_stream_list_t list,
+                                           size_t count)
+{
+    /* nodes come from malloc(), which the allocation tests do not count */
+    (void)list;
+    (void)count;
+
+    return srtp_err_status_ok;
+}
+
 srtp_stream_t srtp_stream_list_get(srtp_stream_list_t list, uint32_t ssrc)
 {
     struct test_list_node *node = list->head;